@@ -57,6 +57,8 @@ struct _hmm_t
     double *tprob_arr;          // Array of transition matrices, precalculated to ntprob_arr
                                 //  positions. The first matrix is the initial tprob matrix
                                 //  set by hmm_init() or hmm_set_tprob()
+    double *tprob_pow;          // Cached powers of the last precalculated matrix for long jumps:
+    int ntprob_pow;             //  the k-th matrix is tprob_arr[ntprob_arr-1]^(2^k), filled lazily
     set_tprob_f set_tprob;      // Optional user function to set / modify transition probabilities
                                 //  at each site (one step of Viterbi algorithm)
     void *set_tprob_data;
@@ -76,6 +78,18 @@ static inline void multiply_matrix(int n, double *a, double *b, double *dst, dou
     if ( a==dst || b==dst )
         out = tmp;
 
+    if ( n==2 )
+    {
+        // the two-state model of roh, unrolled
+        double a00 = a[0], a01 = a[1], a10 = a[2], a11 = a[3];
+        double b00 = b[0], b01 = b[1], b10 = b[2], b11 = b[3];
+        dst[0] = a00*b00 + a01*b10;
+        dst[1] = a00*b01 + a01*b11;
+        dst[2] = a10*b00 + a11*b10;
+        dst[3] = a10*b01 + a11*b11;
+        return;
+    }
+
     int i,j,k;
     for (i=0; i<n; i++)
     {
@@ -135,6 +149,21 @@ hmm_t *hmm_init(int nstates, double *tprob, int ntprob)
     hmm_init_states(hmm, NULL);
     return hmm;
 }
+hmm_t *hmm_copy(hmm_t *src)
+{
+    int nstates = src->nstates, ntprob = src->ntprob_arr > 0 ? src->ntprob_arr : 1;
+    hmm_t *hmm = (hmm_t*) calloc(1,sizeof(hmm_t));
+    hmm->nstates = nstates;
+    hmm->curr_tprob = (double*) malloc(sizeof(double)*nstates*nstates);
+    hmm->tmp = (double*) malloc(sizeof(double)*nstates*nstates);
+    hmm->ntprob_arr = src->ntprob_arr;
+    hmm->tprob_arr  = (double*) malloc(sizeof(double)*nstates*nstates*ntprob);
+    memcpy(hmm->tprob_arr,src->tprob_arr,sizeof(double)*nstates*nstates*ntprob);
+    hmm->set_tprob = src->set_tprob;
+    hmm->set_tprob_data = src->set_tprob_data;
+    hmm_init_states(hmm, src->init.vit_prob);
+    return hmm;
+}
 
 void *hmm_snapshot(hmm_t *hmm, void *_snapshot, uint32_t pos)
 {
@@ -164,6 +193,7 @@ void *hmm_snapshot(hmm_t *hmm, void *_snapshot, uint32_t pos)
 void hmm_restore(hmm_t *hmm, void *_snapshot)
 {
     snapshot_t *snapshot = (snapshot_t*) _snapshot;
+    hmm->snapshot = NULL;   // do not update a snapshot left over from a previous run
     if ( !snapshot || !snapshot->snap_at_pos ) 
     {
         hmm->state.snap_at_pos = 0;
@@ -195,6 +225,7 @@ void hmm_set_tprob(hmm_t *hmm, double *tprob, int ntprob)
         hmm->tprob_arr  = (double*) malloc(sizeof(double)*hmm->nstates*hmm->nstates*ntprob);
 
     memcpy(hmm->tprob_arr,tprob,sizeof(double)*hmm->nstates*hmm->nstates);
+    hmm->ntprob_pow = 0;
 
     int i;
     for (i=1; i<ntprob; i++)
@@ -207,6 +238,24 @@ void hmm_set_tprob_func(hmm_t *hmm, set_tprob_f set_tprob, void *data)
     hmm->set_tprob_data = data;
 }
 
+// The matrix for a jump of 2^k full blocks of ntprob_arr positions
+static double *get_tprob_pow(hmm_t *hmm, int k)
+{
+    int nn = hmm->nstates*hmm->nstates;
+    if ( !hmm->tprob_pow )
+        hmm->tprob_pow = (double*) malloc(sizeof(double)*nn*32);    // pos_diff is an int
+    while ( hmm->ntprob_pow <= k )
+    {
+        double *dst = hmm->tprob_pow + hmm->ntprob_pow*nn;
+        if ( !hmm->ntprob_pow )
+            memcpy(dst, hmm->tprob_arr+(hmm->ntprob_arr-1)*nn, sizeof(double)*nn);
+        else
+            multiply_matrix(hmm->nstates, dst-nn, dst-nn, dst, hmm->tmp);
+        hmm->ntprob_pow++;
+    }
+    return hmm->tprob_pow + k*nn;
+}
+
 static void _set_tprob(hmm_t *hmm, int pos_diff)
 {
     assert( pos_diff>=0 );
@@ -218,9 +267,10 @@ static void _set_tprob(hmm_t *hmm, int pos_diff)
 
     if ( hmm->ntprob_arr > 0  )
     {
-        n = pos_diff / hmm->ntprob_arr;  // number of full blocks to jump
-        for (i=0; i<n; i++)
-            multiply_matrix(hmm->nstates, hmm->tprob_arr+(hmm->ntprob_arr-1)*hmm->nstates*hmm->nstates, hmm->curr_tprob, hmm->curr_tprob, hmm->tmp);
+        // number of full blocks to jump, done in log steps using the cached powers
+        n = pos_diff / hmm->ntprob_arr;
+        for (i=0; n; i++, n>>=1)
+            if ( n&1 ) multiply_matrix(hmm->nstates, get_tprob_pow(hmm,i), hmm->curr_tprob, hmm->curr_tprob, hmm->tmp);
     }
 }
 
@@ -501,6 +551,7 @@ void hmm_destroy(hmm_t *hmm)
     free(hmm->curr_tprob);
     free(hmm->tmp);
     free(hmm->tprob_arr);
+    free(hmm->tprob_pow);
     free(hmm->fwd);
     free(hmm->bwd);
     free(hmm->bwd_tmp);
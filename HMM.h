@@ -42,6 +42,16 @@ typedef void (*set_tprob_f) (hmm_t *hmm, uint32_t prev_pos, uint32_t pos, void *
  *              of distance
  */
 hmm_t *hmm_init(int nstates, double *tprob, int ntprob);
+
+/**
+ *   hmm_copy() - create an independent copy of the model
+ *
+ *   The precalculated transition matrices, the initial state probabilities and
+ *   the tprob setter are copied, the run-time state is not. Intended for running
+ *   the model on different samples in parallel, each thread with its own copy.
+ *   The setter's data can be changed by another hmm_set_tprob_func() call.
+ */
+hmm_t *hmm_copy(hmm_t *hmm);
 void hmm_set_tprob(hmm_t *hmm, double *tprob, int ntprob);
 
 #define HMM_VIT 1
@@ -0,0 +1,222 @@
+/*  arbuf.h -- bounded lock-free round buffers for passing data between threads.
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.  */
+
+/*
+    A companion of rbuf.h for pipelines: a fixed-size queue of pointers (for
+    example to batches of bcf1_t records) which any number of threads can
+    push to and pop from without a mutex. Each slot carries a sequence number
+    which tells the producers and consumers whose turn it is, so the only
+    shared writes are to the head and tail counters, kept on separate cache
+    lines. The blocking calls spin for a while and then yield the CPU.
+
+        arbuf_t *buf = arbuf_init(64);
+        // producer                      // consumer
+        arbuf_push(buf, batch);          while ( arbuf_pop(buf, &ptr) ) ...
+        arbuf_close(buf);
+        arbuf_destroy(buf);
+*/
+
+#ifndef __ARBUF_H__
+#define __ARBUF_H__
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <sched.h>
+
+#define ARBUF_CACHE_LINE 64
+#define ARBUF_NSPIN      1024
+
+typedef struct
+{
+    size_t seq;
+    void *dat;
+}
+arbuf_cell_t;
+
+typedef struct
+{
+    char pad0[ARBUF_CACHE_LINE];
+    size_t head;    // the next slot to push to
+    char pad1[ARBUF_CACHE_LINE - sizeof(size_t)];
+    size_t tail;    // the next slot to pop from
+    char pad2[ARBUF_CACHE_LINE - sizeof(size_t)];
+    int closed;
+    size_t mask;
+    arbuf_cell_t *cells;
+}
+arbuf_t;
+
+/**
+ *  arbuf_init() - create a new buffer
+ *  @size:  the maximum number of elements, rounded up to a power of two
+ */
+static inline arbuf_t *arbuf_init(int size)
+{
+    size_t i, m = 2;
+    while ( m < (size_t)size ) m <<= 1;
+    arbuf_t *buf = (arbuf_t*) calloc(1, sizeof(arbuf_t));
+    buf->cells = (arbuf_cell_t*) malloc(sizeof(arbuf_cell_t)*m);
+    buf->mask  = m - 1;
+    for (i=0; i<m; i++) buf->cells[i].seq = i;
+    return buf;
+}
+
+/**
+ *  arbuf_destroy() - free the buffer, the elements are owned by the caller
+ */
+static inline void arbuf_destroy(arbuf_t *buf)
+{
+    free(buf->cells);
+    free(buf);
+}
+
+/**
+ *  arbuf_try_push() - add an element if there is space, without blocking
+ *
+ *  Returns 1 on success or 0 if the buffer is full
+ */
+static inline int arbuf_try_push(arbuf_t *buf, void *dat)
+{
+    size_t pos = __atomic_load_n(&buf->head, __ATOMIC_RELAXED);
+    arbuf_cell_t *cell;
+    while (1)
+    {
+        cell = &buf->cells[pos & buf->mask];
+        size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if ( diff==0 )
+        {
+            if ( __atomic_compare_exchange_n(&buf->head, &pos, pos+1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED) ) break;
+        }
+        else if ( diff < 0 ) return 0;      // full
+        else pos = __atomic_load_n(&buf->head, __ATOMIC_RELAXED);
+    }
+    cell->dat = dat;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/**
+ *  arbuf_try_pop() - take the oldest element, without blocking
+ *
+ *  Returns 1 on success or 0 if the buffer is empty
+ */
+static inline int arbuf_try_pop(arbuf_t *buf, void **dat)
+{
+    size_t pos = __atomic_load_n(&buf->tail, __ATOMIC_RELAXED);
+    arbuf_cell_t *cell;
+    while (1)
+    {
+        cell = &buf->cells[pos & buf->mask];
+        size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if ( diff==0 )
+        {
+            if ( __atomic_compare_exchange_n(&buf->tail, &pos, pos+1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED) ) break;
+        }
+        else if ( diff < 0 ) return 0;      // empty
+        else pos = __atomic_load_n(&buf->tail, __ATOMIC_RELAXED);
+    }
+    *dat = cell->dat;
+    __atomic_store_n(&cell->seq, pos + buf->mask + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static inline void arbuf_wait_(int *nspin)
+{
+    if ( ++(*nspin) < ARBUF_NSPIN ) return;
+    *nspin = 0;
+    sched_yield();
+}
+
+/**
+ *  arbuf_close() - tell the consumers that no more elements will be pushed,
+ *  to be called once all producers are done
+ */
+static inline void arbuf_close(arbuf_t *buf)
+{
+    __atomic_store_n(&buf->closed, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ *  arbuf_push() - add an element, wait while the buffer is full
+ *
+ *  Returns 0 on success or -1 if the buffer was closed
+ */
+static inline int arbuf_push(arbuf_t *buf, void *dat)
+{
+    int nspin = 0;
+    while ( !arbuf_try_push(buf, dat) )
+    {
+        if ( __atomic_load_n(&buf->closed, __ATOMIC_ACQUIRE) ) return -1;
+        arbuf_wait_(&nspin);
+    }
+    return 0;
+}
+
+/**
+ *  arbuf_pop() - take the oldest element, wait while the buffer is empty
+ *
+ *  Returns 1 on success or 0 if the buffer is closed and empty
+ */
+static inline int arbuf_pop(arbuf_t *buf, void **dat)
+{
+    int nspin = 0;
+    while ( !arbuf_try_pop(buf, dat) )
+    {
+        // the elements pushed before closing are still returned
+        if ( __atomic_load_n(&buf->closed, __ATOMIC_ACQUIRE) ) return arbuf_try_pop(buf, dat);
+        arbuf_wait_(&nspin);
+    }
+    return 1;
+}
+
+/**
+ *  arbuf_push_n() - add up to n elements, wait only for space for the first one
+ *
+ *  Returns the number of elements added, in order, or -1 if the buffer was closed
+ */
+static inline int arbuf_push_n(arbuf_t *buf, void **dat, int n)
+{
+    if ( n<=0 ) return 0;
+    if ( arbuf_push(buf, dat[0])<0 ) return -1;
+    int i;
+    for (i=1; i<n; i++)
+        if ( !arbuf_try_push(buf, dat[i]) ) break;
+    return i;
+}
+
+/**
+ *  arbuf_pop_n() - take up to n elements, wait only for the first one
+ *
+ *  Returns the number of elements taken or 0 if the buffer is closed and empty
+ */
+static inline int arbuf_pop_n(arbuf_t *buf, void **dat, int n)
+{
+    if ( n<=0 || !arbuf_pop(buf, &dat[0]) ) return 0;
+    int i;
+    for (i=1; i<n; i++)
+        if ( !arbuf_try_pop(buf, &dat[i]) ) break;
+    return i;
+}
+
+#endif
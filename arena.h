@@ -0,0 +1,129 @@
+/* The MIT License
+
+   Copyright (C) 2026 Genome Research Ltd.
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+   
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+   
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+ */
+
+/*
+    Scratch memory for temporary arrays which live only while a single site is
+    processed. The allocations are taken from a block which is reset, but not
+    freed, for the next site. When a site does not fit, more blocks are chained
+    and merged into a single block of the peak size on the next reset, so that
+    after a few sites no more memory is allocated.
+
+        arena_t arena = {0,0,0,0,0};
+        int *tmp = (int*) arena_calloc(&arena, n, sizeof(int));
+        ...
+        arena_reset(&arena);    // the pointers become invalid
+        ...
+        arena_destroy(&arena);
+*/
+
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct
+{
+    char *buf;          // the current block
+    size_t n, m;        // used and allocated size of the current block
+    size_t nfull;       // total size of the blocks which did not fit
+    void *full;         // the blocks which did not fit, linked through their first bytes
+}
+arena_t;
+
+#define ARENA_ALIGN 16
+
+static inline void *arena_alloc(arena_t *arena, size_t size)
+{
+    size = (size + ARENA_ALIGN - 1) & ~((size_t)ARENA_ALIGN - 1);
+    if ( arena->n + size > arena->m )
+    {
+        if ( arena->buf )
+        {
+            // keep the block until the next reset, the pointers into it are still in use
+            *((void**)arena->buf) = arena->full;
+            arena->full  = arena->buf;
+            arena->nfull += arena->m;
+        }
+        arena->m = arena->m*2 > size + ARENA_ALIGN ? arena->m*2 : size + ARENA_ALIGN;
+        if ( arena->m < 4096 ) arena->m = 4096;
+        arena->buf = (char*) malloc(arena->m);
+        if ( !arena->buf ) return NULL;
+        arena->n = ARENA_ALIGN;     // room for the link
+    }
+    void *ptr = arena->buf + arena->n;
+    arena->n += size;
+    return ptr;
+}
+
+static inline void *arena_calloc(arena_t *arena, size_t n, size_t size)
+{
+    void *ptr = arena_alloc(arena, n*size);
+    if ( ptr ) memset(ptr, 0, n*size);
+    return ptr;
+}
+
+static inline char *arena_strdup(arena_t *arena, const char *str)
+{
+    size_t len = strlen(str) + 1;
+    char *ptr = (char*) arena_alloc(arena, len);
+    if ( ptr ) memcpy(ptr, str, len);
+    return ptr;
+}
+
+/*
+ *  arena_reset() - release all allocations. If more than one block was needed,
+ *  the blocks are replaced by one which can hold all of them.
+ */
+static inline void arena_reset(arena_t *arena)
+{
+    if ( arena->full )
+    {
+        size_t m = arena->m + arena->nfull;
+        while ( arena->full )
+        {
+            void *next = *((void**)arena->full);
+            free(arena->full);
+            arena->full = next;
+        }
+        free(arena->buf);
+        arena->buf   = (char*) malloc(m);
+        arena->m     = arena->buf ? m : 0;
+        arena->nfull = 0;
+    }
+    arena->n = ARENA_ALIGN;
+}
+
+static inline void arena_destroy(arena_t *arena)
+{
+    while ( arena->full )
+    {
+        void *next = *((void**)arena->full);
+        free(arena->full);
+        arena->full = next;
+    }
+    free(arena->buf);
+    memset(arena, 0, sizeof(*arena));
+}
+
+#endif
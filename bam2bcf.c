@@ -76,6 +76,59 @@ void bcf_call_destroy(bcf_callaux_t *bca)
     free(bca->bases); free(bca->inscns); free(bca);
 }
 
+/*
+ *  bcf_call_shard_init() - private copy of bca for running bcf_call_glfgen()
+ *  on a subset of samples in a separate thread. The copy shares the error model
+ *  with bca, but has its own buffer of bases and bias test counts. The counts
+ *  are added to bca by bcf_call_shard_merge().
+ */
+bcf_callaux_t *bcf_call_shard_init(const bcf_callaux_t *bca)
+{
+    bcf_callaux_t *shard = (bcf_callaux_t*) calloc(1, sizeof(bcf_callaux_t));
+    shard->capQ = bca->capQ;
+    shard->min_baseQ = bca->min_baseQ;
+    shard->e = bca->e;
+    shard->npos = bca->npos;
+    shard->ref_pos = (int*) calloc(shard->npos, sizeof(int));
+    shard->alt_pos = (int*) calloc(shard->npos, sizeof(int));
+    shard->nqual = bca->nqual;
+    shard->ref_mq  = (int*) calloc(shard->nqual, sizeof(int));
+    shard->alt_mq  = (int*) calloc(shard->nqual, sizeof(int));
+    shard->ref_bq  = (int*) calloc(shard->nqual, sizeof(int));
+    shard->alt_bq  = (int*) calloc(shard->nqual, sizeof(int));
+    shard->fwd_mqs = (int*) calloc(shard->nqual, sizeof(int));
+    shard->rev_mqs = (int*) calloc(shard->nqual, sizeof(int));
+    return shard;
+}
+
+static inline void add_counts(int *dst, int *src, int n)
+{
+    int i;
+    for (i=0; i<n; i++) dst[i] += src[i];
+    memset(src, 0, sizeof(int)*n);
+}
+
+void bcf_call_shard_merge(bcf_callaux_t *bca, bcf_callaux_t *shard)
+{
+    add_counts(bca->ref_pos, shard->ref_pos, bca->npos);
+    add_counts(bca->alt_pos, shard->alt_pos, bca->npos);
+    add_counts(bca->ref_mq, shard->ref_mq, bca->nqual);
+    add_counts(bca->alt_mq, shard->alt_mq, bca->nqual);
+    add_counts(bca->ref_bq, shard->ref_bq, bca->nqual);
+    add_counts(bca->alt_bq, shard->alt_bq, bca->nqual);
+    add_counts(bca->fwd_mqs, shard->fwd_mqs, bca->nqual);
+    add_counts(bca->rev_mqs, shard->rev_mqs, bca->nqual);
+}
+
+void bcf_call_shard_destroy(bcf_callaux_t *shard)
+{
+    if (shard == 0) return;
+    free(shard->ref_pos); free(shard->alt_pos);
+    free(shard->ref_mq); free(shard->alt_mq); free(shard->ref_bq); free(shard->alt_bq);
+    free(shard->fwd_mqs); free(shard->rev_mqs);
+    free(shard->bases); free(shard);
+}
+
 // position in the sequence with respect to the aligned part of the read
 static int get_position(const bam_pileup1_t *p, int *len)
 {
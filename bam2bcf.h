@@ -130,6 +130,9 @@ extern "C" {
                      const bcf_callaux_t *bca, const char *ref);
     int bcf_call_gap_prep(int n, int *n_plp, bam_pileup1_t **plp, int pos, bcf_callaux_t *bca, const char *ref);
     void bcf_callaux_clean(bcf_callaux_t *bca, bcf_call_t *call);
+    bcf_callaux_t *bcf_call_shard_init(const bcf_callaux_t *bca);
+    void bcf_call_shard_merge(bcf_callaux_t *bca, bcf_callaux_t *shard);
+    void bcf_call_shard_destroy(bcf_callaux_t *shard);
 
 #ifdef __cplusplus
 }
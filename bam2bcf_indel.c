@@ -87,6 +87,100 @@ static inline int est_indelreg(int pos, const char *ref, int l, char *ins4)
     return max_i - pos;
 }
 
+// Per-read realignment data at one site. The query window, the query sequence
+// and the capped qualities do not depend on the indel type, they are computed
+// once per read. Reads of the same sample with identical windows, sequences and
+// qualities get identical scores, only the first of them (rep) is realigned.
+typedef struct
+{
+    int qbeg, qend, tbeg, tend;
+    int skip, rep, idx;
+    uint8_t *query, *qual;
+}
+indel_read_t;
+
+static int cmp_indel_reads(const void *aptr, const void *bptr)
+{
+    const indel_read_t *a = *(const indel_read_t**) aptr;
+    const indel_read_t *b = *(const indel_read_t**) bptr;
+    if ( a->tbeg != b->tbeg ) return a->tbeg < b->tbeg ? -1 : 1;
+    if ( a->tend != b->tend ) return a->tend < b->tend ? -1 : 1;
+    int alen = a->qend - a->qbeg, blen = b->qend - b->qbeg;
+    if ( alen != blen ) return alen < blen ? -1 : 1;
+    int ret = memcmp(a->query, b->query, 2 * alen);  // the qualities follow the sequence
+    if ( ret ) return ret;
+    return a->idx - b->idx;
+}
+
+static indel_read_t *init_indel_reads(int n, int *n_plp, bam_pileup1_t **plp, int left, int right)
+{
+    int s, i, k, l, K, N = 0, mptr = 0;
+    for (s = 0; s < n; ++s) N += n_plp[s];
+    indel_read_t *reads = (indel_read_t*) calloc(N, sizeof(indel_read_t));
+
+    // determine the start and end of sequences for alignment and the size of the buffer
+    size_t len = 0;
+    for (s = K = 0; s < n; ++s) {
+        for (i = 0; i < n_plp[s]; ++i, ++K) {
+            bam_pileup1_t *p = plp[s] + i;
+            indel_read_t *rd = &reads[K];
+            uint32_t *cigar = bam_get_cigar(p->b);
+            rd->idx = rd->rep = K;
+            if (p->b->core.flag&4) { rd->skip = 1; continue; } // unmapped reads
+            for (k = 0; k < p->b->core.n_cigar; ++k)
+                if ((cigar[k]&BAM_CIGAR_MASK) == BAM_CREF_SKIP) break;
+            if (k < p->b->core.n_cigar) { rd->skip = 1; continue; }
+            // FIXME: the following skips soft clips, but using them may be more sensitive.
+            rd->qbeg = tpos2qpos(&p->b->core, cigar, left,  0, &rd->tbeg);
+            rd->qend = tpos2qpos(&p->b->core, cigar, right, 1, &rd->tend);
+            len += 2 * (rd->qend - rd->qbeg);
+        }
+    }
+
+    // write the query sequences and qualities, stored after the array to be freed with it
+    reads = (indel_read_t*) realloc(reads, N * sizeof(indel_read_t) + len);
+    uint8_t *buf = (uint8_t*) (reads + N);
+    for (s = K = 0; s < n; ++s) {
+        for (i = 0; i < n_plp[s]; ++i, ++K) {
+            bam_pileup1_t *p = plp[s] + i;
+            indel_read_t *rd = &reads[K];
+            if (rd->skip) continue;
+            uint8_t *seq = bam_get_seq(p->b);
+            const uint8_t *qual = bam_get_qual(p->b), *bq;
+            rd->query = buf; buf += rd->qend - rd->qbeg;
+            rd->qual  = buf; buf += rd->qend - rd->qbeg;
+            bq = (uint8_t*)bam_aux_get(p->b, "ZQ");
+            if (bq) ++bq; // skip type
+            for (l = rd->qbeg; l < rd->qend; ++l) {
+                int q = bq? qual[l] + (bq[l] - 64) : qual[l];
+                if (q > 30) q = 30;
+                if (q < 7) q = 7;
+                rd->query[l - rd->qbeg] = seq_nt16_int[bam_seqi(seq, l)];
+                rd->qual[l - rd->qbeg]  = q;
+            }
+        }
+    }
+
+    // find the duplicates within each sample
+    indel_read_t **ptr = NULL;
+    for (s = K = 0; s < n; K += n_plp[s], ++s) {
+        int nptr = 0;
+        hts_expand(indel_read_t*, n_plp[s], mptr, ptr);
+        for (i = 0; i < n_plp[s]; ++i)
+            if (!reads[K+i].skip) ptr[nptr++] = &reads[K+i];
+        if (nptr < 2) continue;
+        qsort(ptr, nptr, sizeof(*ptr), cmp_indel_reads);
+        for (i = 1; i < nptr; ++i) {
+            const indel_read_t *a = ptr[i-1], *b = ptr[i];
+            if (a->tbeg != b->tbeg || a->tend != b->tend || a->qend - a->qbeg != b->qend - b->qbeg) continue;
+            if (memcmp(a->query, b->query, 2 * (a->qend - a->qbeg))) continue;
+            ptr[i]->rep = a->rep;
+        }
+    }
+    free(ptr);
+    return reads;
+}
+
 /*
     notes:
         - n .. number of samples
@@ -100,7 +194,7 @@ int bcf_call_gap_prep(int n, int *n_plp, bam_pileup1_t **plp, int pos, bcf_calla
 {
     int i, s, j, k, t, n_types, *types, max_rd_len, left, right, max_ins, *score1, *score2, max_ref2;
     int N, K, l_run, ref_type, n_alt;
-    char *inscns = 0, *ref2, *query, **ref_sample;
+    char *inscns = 0, *ref2, **ref_sample;
     if (ref == 0 || bca == 0) return -1;
 
     // determine if there is a gap
@@ -284,9 +378,9 @@ int bcf_call_gap_prep(int n, int *n_plp, bam_pileup1_t **plp, int pos, bcf_calla
     // compute the likelihood given each type of indel for each read
     max_ref2 = right - left + 2 + 2 * (max_ins > -types[0]? max_ins : -types[0]);
     ref2  = (char*) calloc(max_ref2, 1);
-    query = (char*) calloc(right - left + max_rd_len + max_ins + 2, 1);
     score1 = (int*) calloc(N * n_types, sizeof(int));
     score2 = (int*) calloc(N * n_types, sizeof(int));
+    indel_read_t *reads = init_indel_reads(n, n_plp, plp, left, right);
     bca->indelreg = 0;
     for (t = 0; t < n_types; ++t) {
         int l, ir;
@@ -309,66 +403,40 @@ int bcf_call_gap_prep(int n, int *n_plp, bam_pileup1_t **plp, int pos, bcf_calla
             for (; j < right && ref[j]; ++j)
                 ref2[k++] = seq_nt16_int[(int)ref_sample[s][j-left]];
             for (; k < max_ref2; ++k) ref2[k] = 4;
-            if (j < right) right = j;
-            // align each read to ref2
+            // align each distinct read to ref2, the windows do not depend on the type
+            int K0 = K;
             for (i = 0; i < n_plp[s]; ++i, ++K) {
-                bam_pileup1_t *p = plp[s] + i;
-                int qbeg, qend, tbeg, tend, sc, kk;
-                uint8_t *seq = bam_get_seq(p->b);
-                uint32_t *cigar = bam_get_cigar(p->b);
-                if (p->b->core.flag&4) continue; // unmapped reads
-                // FIXME: the following loop should be better moved outside; nonetheless, realignment should be much slower anyway.
-                for (kk = 0; kk < p->b->core.n_cigar; ++kk)
-                    if ((cigar[kk]&BAM_CIGAR_MASK) == BAM_CREF_SKIP) break;
-                if (kk < p->b->core.n_cigar) continue;
-                // FIXME: the following skips soft clips, but using them may be more sensitive.
-                // determine the start and end of sequences for alignment
-                qbeg = tpos2qpos(&p->b->core, bam_get_cigar(p->b), left,  0, &tbeg);
-                qend = tpos2qpos(&p->b->core, bam_get_cigar(p->b), right, 1, &tend);
+                indel_read_t *rd = &reads[K];
+                int sc, tbeg = rd->tbeg, qlen = rd->qend - rd->qbeg;
+                if (rd->skip || rd->rep != K) continue;
                 if (types[t] < 0) {
                     int l = -types[t];
                     tbeg = tbeg - l > left?  tbeg - l : left;
                 }
-                // write the query sequence
-                for (l = qbeg; l < qend; ++l)
-                    query[l - qbeg] = seq_nt16_int[bam_seqi(seq, l)];
-                { // do realignment; this is the bottleneck
-                    const uint8_t *qual = bam_get_qual(p->b), *bq;
-                    uint8_t *qq;
-                    qq = (uint8_t*) calloc(qend - qbeg, 1);
-                    bq = (uint8_t*)bam_aux_get(p->b, "ZQ");
-                    if (bq) ++bq; // skip type
-                    for (l = qbeg; l < qend; ++l) {
-                        qq[l - qbeg] = bq? qual[l] + (bq[l] - 64) : qual[l];
-                        if (qq[l - qbeg] > 30) qq[l - qbeg] = 30;
-                        if (qq[l - qbeg] < 7) qq[l - qbeg] = 7;
-                    }
-                    sc = probaln_glocal((uint8_t*)ref2 + tbeg - left, tend - tbeg + abs(types[t]),
-                                        (uint8_t*)query, qend - qbeg, qq, &apf1, 0, 0);
-                    l = (int)(100. * sc / (qend - qbeg) + .499); // used for adjusting indelQ below
+                // do realignment; this is the bottleneck
+                sc = probaln_glocal((uint8_t*)ref2 + tbeg - left, rd->tend - tbeg + abs(types[t]),
+                                    rd->query, qlen, rd->qual, &apf1, 0, 0);
+                l = (int)(100. * sc / qlen + .499); // used for adjusting indelQ below
+                if (l > 255) l = 255;
+                score1[K*n_types + t] = score2[K*n_types + t] = sc<<8 | l;
+                if (sc > 5) {
+                    sc = probaln_glocal((uint8_t*)ref2 + tbeg - left, rd->tend - tbeg + abs(types[t]),
+                                        rd->query, qlen, rd->qual, &apf2, 0, 0);
+                    l = (int)(100. * sc / qlen + .499);
                     if (l > 255) l = 255;
-                    score1[K*n_types + t] = score2[K*n_types + t] = sc<<8 | l;
-                    if (sc > 5) {
-                        sc = probaln_glocal((uint8_t*)ref2 + tbeg - left, tend - tbeg + abs(types[t]),
-                                            (uint8_t*)query, qend - qbeg, qq, &apf2, 0, 0);
-                        l = (int)(100. * sc / (qend - qbeg) + .499);
-                        if (l > 255) l = 255;
-                        score2[K*n_types + t] = sc<<8 | l;
-                    }
-                    free(qq);
+                    score2[K*n_types + t] = sc<<8 | l;
                 }
-#if 0
-                for (l = 0; l < tend - tbeg + abs(types[t]); ++l)
-                    fputc("ACGTN"[(int)ref2[tbeg-left+l]], stderr);
-                fputc('\n', stderr);
-                for (l = 0; l < qend - qbeg; ++l) fputc("ACGTN"[(int)query[l]], stderr);
-                fputc('\n', stderr);
-                fprintf(stderr, "pos=%d type=%d read=%d:%d name=%s qbeg=%d tbeg=%d score=%d\n", pos, types[t], s, i, bam_get_qname(p->b), qbeg, tbeg, sc);
-#endif
+            }
+            for (K = K0, i = 0; i < n_plp[s]; ++i, ++K) {
+                indel_read_t *rd = &reads[K];
+                if (rd->skip || rd->rep == K) continue;
+                score1[K*n_types + t] = score1[rd->rep*n_types + t];
+                score2[K*n_types + t] = score2[rd->rep*n_types + t];
             }
         }
     }
-    free(ref2); free(query);
+    free(ref2);
+    free(reads);
     { // compute indelQ
         int sc_a[16], sumq_a[16];
         int tmp, *sc = sc_a, *sumq = sumq_a;
@@ -33,12 +33,17 @@ DEALINGS IN THE SOFTWARE.  */
 #include "bam_sample.h"
 #include "bcftools.h"
 
+#define MAX_RG_LIST 8   // up to this many read groups per file are compared directly, without hashing
 
 typedef struct
 {
     char *fname;
     void *rg2idx;       // hash: read group name to BCF output sample index. Maintained by bsmpl_add_readgroup
     int default_idx;    // default BCF output sample index, set only when all readgroups are treated as one sample
+    int unkn_idx;       // sample index for reads with no or unlisted read group, the "?" entry, or -1
+    int nrg;            // number of read groups in rg2idx; when few, looked up in rg_name instead of hashing
+    char **rg_name;     // rg2idx keys, not owned
+    int *rg_len, *rg_idx;
 }
 file_t;
 
@@ -75,6 +80,9 @@ void bam_smpl_destroy(bam_smpl_t *bsmpl)
         file_t *file = &bsmpl->files[i];
         if ( file->rg2idx ) khash_str2int_destroy_free(file->rg2idx);
         free(file->fname);
+        free(file->rg_name);
+        free(file->rg_len);
+        free(file->rg_idx);
     }
     free(bsmpl->smpl);
     free(bsmpl->files);
@@ -109,7 +117,17 @@ static void bsmpl_add_readgroup(bam_smpl_t *bsmpl, file_t *file, const char *rg_
     }
     if ( !file->rg2idx ) file->rg2idx = khash_str2int_init();
     if ( khash_str2int_has_key(file->rg2idx,rg_id) ) return;    // duplicate @RG:ID
-    khash_str2int_set(file->rg2idx, strdup(rg_id), ismpl);
+    char *key = strdup(rg_id);
+    khash_str2int_set(file->rg2idx, key, ismpl);
+    if ( !strcmp("?",rg_id) ) file->unkn_idx = ismpl;
+
+    file->nrg++;
+    file->rg_name = (char**) realloc(file->rg_name,sizeof(char*)*file->nrg);
+    file->rg_len  = (int*) realloc(file->rg_len,sizeof(int)*file->nrg);
+    file->rg_idx  = (int*) realloc(file->rg_idx,sizeof(int)*file->nrg);
+    file->rg_name[file->nrg-1] = key;
+    file->rg_len[file->nrg-1]  = strlen(key);
+    file->rg_idx[file->nrg-1]  = ismpl;
 }
 static int bsmpl_keep_readgroup(bam_smpl_t *bsmpl, file_t *file, const char *rg_id, const char **smpl_name)
 {
@@ -156,6 +174,7 @@ int bam_smpl_add_bam(bam_smpl_t *bsmpl, char *bam_hdr, const char *fname)
     memset(file,0,sizeof(file_t));
     file->fname  = strdup(fname);
     file->default_idx = -1;
+    file->unkn_idx = -1;
 
     if ( bsmpl->ignore_rg || !bam_hdr )
     {
@@ -233,7 +252,11 @@ int bam_smpl_add_bam(bam_smpl_t *bsmpl, char *bam_hdr, const char *fname)
     if ( !accept_null_rg && first_smpl==-1 )
     {
         // no suitable read group is available in this bam: ignore the whole file.
+        if ( file->rg2idx ) khash_str2int_destroy_free(file->rg2idx);
         free(file->fname);
+        free(file->rg_name);
+        free(file->rg_len);
+        free(file->rg_idx);
         bsmpl->nfiles--;
         return -1;
     }
@@ -261,12 +284,20 @@ int bam_smpl_get_sample_id(bam_smpl_t *bsmpl, int bam_id, bam1_t *bam_rec)
     if ( file->default_idx >= 0 ) return file->default_idx;
 
     char *aux_rg = (char*) bam_aux_get(bam_rec, "RG");
-    aux_rg = aux_rg ? aux_rg+1 : "?";
+    if ( !aux_rg ) return file->unkn_idx;
+    aux_rg++;
 
-    int rg_id;
-    if ( khash_str2int_get(file->rg2idx, aux_rg, &rg_id)==0 ) return rg_id;
-    if ( khash_str2int_get(file->rg2idx, "?", &rg_id)==0 ) return rg_id;
-    return -1;
+    // NB: called concurrently by the mpileup --threads workers, the file_t must
+    // stay read-only here
+    int i, rg_id = file->unkn_idx;
+    if ( file->nrg <= MAX_RG_LIST )
+    {
+        int len = strlen(aux_rg);
+        for (i=0; i<file->nrg; i++)
+            if ( file->rg_len[i]==len && !memcmp(file->rg_name[i], aux_rg, len) ) { rg_id = file->rg_idx[i]; break; }
+    }
+    else if ( khash_str2int_get(file->rg2idx, aux_rg, &i)==0 ) rg_id = i;
+    return rg_id;
 }
 
 int bam_smpl_add_samples(bam_smpl_t *bsmpl, char *list, int is_file)
@@ -0,0 +1,118 @@
+/*  bcfmmap.c -- zero-copy reading of uncompressed BCF files.
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "bcftools.h"
+#include "bcfmmap.h"
+
+struct _bcf_mmap_t
+{
+    char *fname;
+    uint8_t *map;
+    size_t len, off;
+    bcf1_t *rec;
+};
+
+static inline uint32_t le_u32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1]<<8 | (uint32_t)p[2]<<16 | (uint32_t)p[3]<<24;
+}
+
+bcf_mmap_t *bcf_mmap_open(const char *fname)
+{
+    if ( !fname || !strcmp("-",fname) ) return NULL;
+    int fd = open(fname, O_RDONLY);
+    if ( fd<0 ) return NULL;
+    struct stat st;
+    if ( fstat(fd,&st)!=0 || !S_ISREG(st.st_mode) || st.st_size < 9 ) { close(fd); return NULL; }
+
+    // BCF magic followed by the length of the header text; BGZF files start with the gzip magic
+    uint8_t magic[9];
+    if ( read(fd, magic, 9)!=9 || memcmp(magic,"BCF\2",4) ) { close(fd); return NULL; }
+    size_t off = 9 + (size_t)le_u32(magic+5);
+    if ( off > (size_t)st.st_size ) { close(fd); return NULL; }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if ( map==MAP_FAILED ) return NULL;
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    bcf_mmap_t *mm = (bcf_mmap_t*) calloc(1, sizeof(bcf_mmap_t));
+    mm->fname = strdup(fname);
+    mm->map = (uint8_t*) map;
+    mm->len = st.st_size;
+    mm->off = off;
+    mm->rec = bcf_init();
+    return mm;
+}
+
+// The same layout as read by bcf_read(): the lengths of the shared and indiv blocks
+// and the fixed fields, followed by the blocks
+bcf1_t *bcf_mmap_next(bcf_mmap_t *mm)
+{
+    if ( mm->off == mm->len ) return NULL;
+    if ( mm->len - mm->off < 32 ) error("Truncated BCF file: %s\n", mm->fname);
+
+    const uint8_t *p = mm->map + mm->off;
+    uint32_t l_shared = le_u32(p), l_indiv = le_u32(p+4);
+    if ( l_shared < 24 || mm->len - mm->off - 8 < (size_t)l_shared + l_indiv )
+        error("Truncated or corrupted BCF record in %s at offset %zu\n", mm->fname, mm->off);
+
+    bcf1_t *rec = mm->rec;
+    bcf_clear(rec);
+    rec->rid  = le_u32(p+8);
+    rec->pos  = le_u32(p+12);
+    rec->rlen = le_u32(p+16);
+    memcpy(&rec->qual, p+20, 4);
+    uint32_t x = le_u32(p+24);
+    rec->n_info   = x & 0xffff;
+    rec->n_allele = x >> 16;
+    x = le_u32(p+28);
+    rec->n_sample = x & 0xffffff;
+    rec->n_fmt    = x >> 24;
+
+    // the kstrings have m=0 so that they are never resized or freed
+    rec->shared.s = (char*) p + 32;
+    rec->shared.l = l_shared - 24;
+    rec->indiv.s  = (char*) p + 32 + rec->shared.l;
+    rec->indiv.l  = l_indiv;
+    mm->off += 8 + (size_t)l_shared + l_indiv;
+    return rec;
+}
+
+void bcf_mmap_close(bcf_mmap_t *mm)
+{
+    if ( !mm ) return;
+    mm->rec->shared.s = mm->rec->indiv.s = NULL;
+    mm->rec->shared.l = mm->rec->indiv.l = 0;
+    bcf_destroy(mm->rec);
+    munmap(mm->map, mm->len);
+    free(mm->fname);
+    free(mm);
+}
@@ -0,0 +1,61 @@
+/*  bcfmmap.h -- zero-copy reading of uncompressed BCF files.
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.  */
+
+/*
+    Uncompressed BCF files (-Ou) on a local disk can be read through a memory
+    mapping, the shared and indiv blocks of the returned record point directly
+    into the mapping and the kernel's readahead replaces the buffered reads.
+    The record is read-only: it can be unpacked, queried and copied with
+    bcf_copy(), but not modified or subset.
+
+        bcf_mmap_t *mm = bcf_mmap_open(fname);
+        if ( mm ) while ( (rec = bcf_mmap_next(mm)) ) ...
+        bcf_mmap_close(mm);
+
+    The header is not parsed, the caller reads it the usual way, for example
+    from the synced reader.
+*/
+
+#ifndef __BCFMMAP_H__
+#define __BCFMMAP_H__
+
+#include <htslib/vcf.h>
+
+typedef struct _bcf_mmap_t bcf_mmap_t;
+
+/*
+ *  bcf_mmap_open() - map the file if it is a local uncompressed BCF
+ *
+ *  Returns NULL if the file is compressed, not a BCF, not a regular file
+ *  or cannot be mapped. The caller can then fall back to the usual readers.
+ */
+bcf_mmap_t *bcf_mmap_open(const char *fname);
+
+/*
+ *  bcf_mmap_next() - the next record, owned by bcf_mmap_t and valid until the
+ *  next call, or NULL at the end of the file
+ */
+bcf1_t *bcf_mmap_next(bcf_mmap_t *mm);
+
+void bcf_mmap_close(bcf_mmap_t *mm);
+
+#endif
@@ -43,6 +43,10 @@ void error(const char *format, ...) HTS_NORETURN;
 void bcf_hdr_append_version(bcf_hdr_t *hdr, int argc, char **argv, const char *cmd);
 const char *hts_bcf_wmode(int file_type);
 
+// --write-index: check the output can be indexed before starting and index it once closed
+void init_write_index(const char *fname, int file_type);
+void write_index(const char *fname, int file_type, int n_threads);
+
 void *smalloc(size_t size);     // safe malloc
 
 static inline char gt2iupac(char a, char b)
@@ -0,0 +1,120 @@
+/* The MIT License
+
+   Copyright (C) 2026 Genome Research Ltd.
+   
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+   
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+   
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+#include <htslib/hts.h>
+#include "bcftools.h"
+#include "bpool.h"
+
+struct _bpool_t
+{
+    hts_tpool *pool;
+    hts_tpool_process *q;
+    bpool_batch_t *batches;
+    int nbatches, nbusy, ibatch, batch_size;
+    bpool_work_f work;
+    bpool_done_f done;
+    void *usr;
+};
+
+bpool_t *bpool_init(hts_tpool *pool, int nbatches, int batch_size, bpool_work_f work, bpool_done_f done, void *usr)
+{
+    bpool_t *bp = (bpool_t*) calloc(1, sizeof(bpool_t));
+    bp->pool = pool;
+    bp->nbatches   = nbatches > 0 ? nbatches : 1;
+    bp->batch_size = batch_size > 0 ? batch_size : 1;
+    bp->work = work;
+    bp->done = done;
+    bp->usr  = usr;
+    bp->batches = (bpool_batch_t*) calloc(bp->nbatches, sizeof(bpool_batch_t));
+    int i;
+    for (i=0; i<bp->nbatches; i++) bp->batches[i].bpool = bp;
+    bp->q = hts_tpool_process_init(pool, bp->nbatches, 0);
+    if ( !bp->q ) error("Failed to initialize the thread pool queue\n");
+    return bp;
+}
+
+int bpool_nbatches(bpool_t *bp) { return bp->nbatches; }
+bpool_batch_t *bpool_batch(bpool_t *bp, int i) { return &bp->batches[i]; }
+
+static void *run_batch(void *arg)
+{
+    bpool_batch_t *batch = (bpool_batch_t*) arg;
+    batch->bpool->work(batch, batch->bpool->usr);
+    return batch;
+}
+
+// Wait for the oldest dispatched batch and complete it
+static void complete_next(bpool_t *bp)
+{
+    hts_tpool_result *res = hts_tpool_next_result_wait(bp->q);
+    if ( !res ) error("Failed to retrieve the processed batch\n");
+    bpool_batch_t *batch = (bpool_batch_t*) hts_tpool_result_data(res);
+    bp->done(batch, bp->usr);
+    batch->nlines = 0;
+    hts_tpool_delete_result(res, 0);
+    bp->nbusy--;
+}
+
+// The batches are filled and dispatched round-robin and the results come back
+// in the order of dispatching, so the batch to be filled next is always the
+// one completed first
+void bpool_dispatch(bpool_t *bp)
+{
+    bpool_batch_t *batch = &bp->batches[bp->ibatch];
+    if ( !batch->nlines ) return;
+    if ( hts_tpool_dispatch(bp->pool, bp->q, run_batch, batch) < 0 )
+        error("Failed to dispatch the records to the thread pool\n");
+    bp->nbusy++;
+    bp->ibatch = (bp->ibatch + 1) % bp->nbatches;
+    if ( bp->nbusy==bp->nbatches ) complete_next(bp);
+}
+
+void bpool_push(bpool_t *bp, bcf1_t *rec)
+{
+    bpool_batch_t *batch = &bp->batches[bp->ibatch];
+    hts_expand0(bcf1_t*, batch->nlines+1, batch->mlines, batch->lines);
+    if ( !batch->lines[batch->nlines] ) batch->lines[batch->nlines] = bcf_init();
+    bcf_copy(batch->lines[batch->nlines++], rec);
+    if ( batch->nlines >= bp->batch_size ) bpool_dispatch(bp);
+}
+
+void bpool_flush(bpool_t *bp)
+{
+    bpool_dispatch(bp);
+    while ( bp->nbusy ) complete_next(bp);
+}
+
+void bpool_destroy(bpool_t *bp)
+{
+    if ( !bp ) return;
+    int i, j;
+    hts_tpool_process_destroy(bp->q);
+    for (i=0; i<bp->nbatches; i++)
+    {
+        for (j=0; j<bp->batches[i].mlines; j++)
+            if ( bp->batches[i].lines[j] ) bcf_destroy(bp->batches[i].lines[j]);
+        free(bp->batches[i].lines);
+    }
+    free(bp->batches);
+    free(bp);
+}
@@ -0,0 +1,102 @@
+/* The MIT License
+
+   Copyright (C) 2026 Genome Research Ltd.
+   
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+   
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+   
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+/*
+    Ordered parallel processing of VCF/BCF records in batches. The caller pushes
+    records, which are copied into batches; full batches are processed by the
+    thread pool and handed back to the caller in the order of pushing. At most
+    nbatches are in flight: when all are busy, the oldest is waited for and
+    completed before the next batch is filled, which limits the memory and
+    keeps the reader from running ahead of the writer.
+
+    The pool is normally the one of the synced reader, set up by
+    bcf_sr_set_threads(), so that the BGZF (de)compression and the batches
+    share the same threads.
+
+    Only vcfquery is built on it so far. view, annotate, norm, call, stats and
+    the plugin driver keep their own batch loops of the same shape.
+*/
+
+#ifndef __BPOOL_H__
+#define __BPOOL_H__
+
+#include <htslib/vcf.h>
+#include <htslib/thread_pool.h>
+
+typedef struct _bpool_t bpool_t;
+
+typedef struct
+{
+    bcf1_t **lines;     // the records of the batch, owned by bpool_t
+    int nlines, mlines;
+    void *data;         // per-batch data of the caller, for example its own filter_t
+    bpool_t *bpool;     // private
+}
+bpool_batch_t;
+
+/*
+ *  work() is called by the worker threads, done() by the caller's thread from
+ *  bpool_push(), bpool_dispatch() and bpool_flush(), in the order of the batches
+ */
+typedef void (*bpool_work_f)(bpool_batch_t *batch, void *usr);
+typedef void (*bpool_done_f)(bpool_batch_t *batch, void *usr);
+
+/*
+ *  bpool_init() - create the batches
+ *  @pool:       the thread pool
+ *  @nbatches:   the number of batches, two per thread keep the workers busy
+ *  @batch_size: the number of records in a full batch
+ */
+bpool_t *bpool_init(hts_tpool *pool, int nbatches, int batch_size, bpool_work_f work, bpool_done_f done, void *usr);
+
+/*
+ *  bpool_nbatches() and bpool_batch() - access the batches, for example to set
+ *  bpool_batch_t.data after bpool_init()
+ */
+int bpool_nbatches(bpool_t *bp);
+bpool_batch_t *bpool_batch(bpool_t *bp, int i);
+
+/*
+ *  bpool_push() - copy the record to the current batch and dispatch the batch
+ *  when full
+ */
+void bpool_push(bpool_t *bp, bcf1_t *rec);
+
+/*
+ *  bpool_dispatch() - dispatch the current batch if not empty, for callers
+ *  which need to end batches at their own boundaries
+ */
+void bpool_dispatch(bpool_t *bp);
+
+/*
+ *  bpool_flush() - dispatch the current batch and complete all batches
+ */
+void bpool_flush(bpool_t *bp);
+
+/*
+ *  bpool_destroy() - free the batches, the pool is not destroyed. Must be
+ *  preceded by bpool_flush() and the per-batch data freed by the caller.
+ */
+void bpool_destroy(bpool_t *bp);
+
+#endif
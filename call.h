@@ -50,6 +50,7 @@ typedef struct
 family_t;
 
 typedef struct _ccall_t ccall_t;
+typedef struct _mcall_cand_t mcall_cand_t;
 typedef struct
 {
     // mcall only
@@ -73,6 +74,8 @@ typedef struct
     int32_t *ugts, *cgts;   // unconstraind and constrained GTs
     uint32_t output_tags;
     char *prior_AN, *prior_AC;  // reference panel AF tags (AF=AC/AN)
+    mcall_cand_t *cands;    // candidate allele combinations, see mcall_find_best_alleles()
+    int ncands, mcands;
 
     // ccall only
     double indel_frac, min_perm_p, min_lrt;
@@ -95,6 +98,7 @@ typedef struct
     int nPLs, mPLs, nac;
     int32_t *gts, *ac;      // GTs and AC (w)
     double *pdg;            // PLs converted to P(D|G)
+    double *em_pdg; int nem_pdg;    // P(D|G) transposed for bcf_em1(), [3][nsmpl]
     float *anno16; int n16; // see anno[16] in bam2bcf.h
     double theta;           // prior
 }
@@ -115,6 +119,8 @@ void ccall_init(call_t *call);
 void qcall_init(call_t *call);
 
 void mcall_destroy(call_t *call);
+void mcall_init_copy(call_t *call, call_t *src);    // private scratch buffers for calling in parallel
+void mcall_destroy_copy(call_t *call);
 void ccall_destroy(call_t *call);
 void qcall_destroy(call_t *call);
 
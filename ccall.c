@@ -78,6 +78,7 @@ void ccall_destroy(call_t *call)
     free(call->PLs);
     free(call->GQs);
     free(call->pdg);
+    free(call->em_pdg);
     bcf_p1_destroy(call->cdat->p1);
     free(call->cdat);
     return;
@@ -324,6 +325,9 @@ int ccall(call_t *call, bcf1_t *rec)
     hts_expand(double, 3*nsmpl, call->npdg, call->pdg);
     set_pdg3(call->pl2p, call->PLs, call->pdg, nsmpl, ngts);
 
+    // with -v, the sites which cannot reach the -p threshold would be dropped anyway, skip EM and the DP
+    if ( (call->flag & CALL_VARONLY) && nals > 1 && bcf_p1_min_pref(call->cdat->p1, rec, call->pdg) > call->pref ) return 0;
+
     double em[10] = {-1.,-1.,-1.,-1.,-1.,-1.,-1.,-1.,-1.,-1.};
     int ret = bcf_em1(call, rec, call->ngrp1_samples, 0x1ff, em);
 
@@ -36,6 +36,7 @@
 #include <htslib/kstring.h>
 #include <htslib/synced_bcf_reader.h>
 #include <htslib/kseq.h>
+#include <htslib/thread_pool.h>
 #include "regidx.h"
 #include "bcftools.h"
 #include "rbuf.h"
@@ -52,17 +53,57 @@ typedef struct
 }
 chain_t;
 
-
+// One consensus sequence: all ALT variants, a sample's genotypes or one of its haplotypes
 typedef struct
 {
-    kstring_t fa_buf;   // buffered reference sequence
+    kstring_t fa_buf;   // buffered consensus sequence
     int fa_ori_pos;     // start position of the fa_buffer (wrt original sequence)
     int fa_frz_pos;     // protected position to avoid conflicting variants (last pos for SNPs/ins)
     int fa_mod_off;     // position difference of fa_frz_pos in the ori and modified sequence (ins positive)
+    int isample, haplotype;
+    kstring_t alt;      // the allele being applied; the VCF records are shared and must not be modified
+
+    int chain_id;       // chain_id, to provide a unique ID to each chain in the chain output
+    chain_t *chain;     // chain structure to store the sequence of ungapped blocks between the ref and alt sequences
+                        // Note that the chain is re-initialised for each chromosome/seq_region
+    FILE *fp_out, *fp_chain;
+    char *output_fname, *chain_fname;
+}
+cns_t;
+
+// With --threads, the reference and the VCF are read once by the main thread into a log
+// of events which is then replayed for groups of consensus sequences in parallel
+#define EV_REGION   1   // new sequence: str is the fasta header, a the start position
+#define EV_SEQ      2   // append reference sequence: str of length a
+#define EV_VARIANT  3   // apply the variant rec, a is the fasta case
+#define EV_FLUSH    4   // write out the buffer, a is the length to keep
+#define EV_CHAIN    5   // print and destroy the chain, a is the rid, b the length of the sequence
+
+#define EV_LOG_SIZE     (1<<20)     // replay the log when this much sequence is buffered
+#define EV_LOG_NEVENTS  (1<<16)     // .. or this many events
+
+typedef struct
+{
+    int type, a, b;
+    int off;            // offset of the string in args_t.ev_str
+    bcf1_t *rec;
+}
+event_t;
+
+typedef struct
+{
+    struct _args_t *args;
+    int beg, end;       // the range of consensus sequences to replay the log for
+}
+replay_job_t;
+
+typedef struct _args_t
+{
     int fa_end_pos;     // region's end position in the original sequence
     int fa_length;      // region's length in the original sequence (in case end_pos not provided in the FASTA header)
     int fa_case;        // output upper case or lower case?
     int fa_src_pos;     // last genomic coordinate read from the input fasta (0-based)
+    int in_region;
 
     rbuf_t vcf_rbuf;
     bcf1_t **vcf_buf;
@@ -71,16 +112,23 @@ typedef struct
     regidx_t *mask;
     regitr_t *itr;
 
-    int chain_id;       // chain_id, to provide a unique ID to each chain in the chain output
-    chain_t *chain;     // chain structure to store the sequence of ungapped blocks between the ref and alt sequences
-                        // Note that the chain is re-initialised for each chromosome/seq_region
+    cns_t *cns;
+    int ncns;
+
+    int n_threads;
+    hts_tpool *pool;
+    hts_tpool_process *queue;
+    replay_job_t *jobs;
+    event_t *ev;
+    int nev, mev;
+    bcf1_t **ev_rec;    // private copies of the records in the log
+    int nev_rec, mev_rec;
+    kstring_t ev_str;   // sequences and fasta headers in the log
 
     bcf_srs_t *files;
     bcf_hdr_t *hdr;
-    FILE *fp_out;
-    FILE *fp_chain;
     char **argv;
-    int argc, output_iupac, haplotype, isample;
+    int argc, output_iupac, *haplotypes, nhaplotypes, sample_is_file;
     char *fname, *ref_fname, *sample, *output_fname, *mask_fname, *chain_fname;
 }
 args_t;
@@ -99,17 +147,17 @@ static chain_t* init_chain(chain_t *chain, int ref_ori_pos)
     return chain;
 }
 
-static void destroy_chain(args_t *args)
+static void destroy_chain(cns_t *cns)
 {
-    chain_t *chain = args->chain;
+    chain_t *chain = cns->chain;
     free(chain->ref_gaps);
     free(chain->alt_gaps);
     free(chain->block_lengths);
     free(chain);
-    chain = NULL;
+    cns->chain = NULL;
 }
 
-static void print_chain(args_t *args)
+static void print_chain(args_t *args, cns_t *cns, int rid, int fa_length)
 {
     /*
         Example chain format (see: https://genome.ucsc.edu/goldenPath/help/chain.html):
@@ -138,9 +186,9 @@ static void print_chain(args_t *args)
         - gap on the ref sequence between this and the next block (all but the last line)
         - gap on the alt sequence between this and the next block (all but the last line)
     */
-    chain_t *chain = args->chain;
+    chain_t *chain = cns->chain;
     int n = chain->num;
-    int ref_end_pos = args->fa_length + chain->ori_pos;
+    int ref_end_pos = fa_length + chain->ori_pos;
     int last_block_size = ref_end_pos - chain->ref_last_block_ori;
     int alt_end_pos = chain->alt_last_block_ori + last_block_size;
     int score = 0;
@@ -148,11 +196,11 @@ static void print_chain(args_t *args)
         score += chain->block_lengths[n];
     }
     score += last_block_size;
-    fprintf(args->fp_chain, "chain %d %s %d + %d %d %s %d + %d %d %d\n", score, bcf_hdr_id2name(args->hdr,args->rid), ref_end_pos, chain->ori_pos, ref_end_pos, bcf_hdr_id2name(args->hdr,args->rid), alt_end_pos, chain->ori_pos, alt_end_pos, ++args->chain_id);
+    fprintf(cns->fp_chain, "chain %d %s %d + %d %d %s %d + %d %d %d\n", score, bcf_hdr_id2name(args->hdr,rid), ref_end_pos, chain->ori_pos, ref_end_pos, bcf_hdr_id2name(args->hdr,rid), alt_end_pos, chain->ori_pos, alt_end_pos, ++cns->chain_id);
     for (n=0; n<chain->num; n++) {
-        fprintf(args->fp_chain, "%d %d %d\n", chain->block_lengths[n], chain->ref_gaps[n], chain->alt_gaps[n]);
+        fprintf(cns->fp_chain, "%d %d %d\n", chain->block_lengths[n], chain->ref_gaps[n], chain->alt_gaps[n]);
     }
-    fprintf(args->fp_chain, "%d\n\n", last_block_size);
+    fprintf(cns->fp_chain, "%d\n\n", last_block_size);
 }
 
 static void push_chain_gap(chain_t *chain, int ref_start, int ref_len, int alt_start, int alt_len)
@@ -183,43 +231,104 @@ static void push_chain_gap(chain_t *chain, int ref_start, int ref_len, int alt_s
     }
 }
 
+static void open_cns(args_t *args, cns_t *cns)
+{
+    if ( args->ncns > 1 )
+    {
+        // the -o and -c options are prefixes of the file names
+        kstring_t sfx = {0,0,0}, str = {0,0,0};
+        ksprintf(&sfx, ".%s", args->hdr->samples[cns->isample]);
+        if ( cns->haplotype ) ksprintf(&sfx, ".%d", cns->haplotype);
+        ksprintf(&str, "%s%s.fa", args->output_fname, sfx.s);
+        cns->output_fname = strdup(str.s);
+        if ( args->chain_fname )
+        {
+            str.l = 0;
+            ksprintf(&str, "%s%s.chain", args->chain_fname, sfx.s);
+            cns->chain_fname = strdup(str.s);
+        }
+        free(sfx.s);
+        free(str.s);
+    }
+    else
+    {
+        if ( args->output_fname ) cns->output_fname = strdup(args->output_fname);
+        if ( args->chain_fname ) cns->chain_fname = strdup(args->chain_fname);
+    }
+    // In case we want to store the chains
+    if ( cns->chain_fname )
+    {
+        cns->fp_chain = fopen(cns->chain_fname,"w");
+        if ( ! cns->fp_chain ) error("Failed to create %s: %s\n", cns->chain_fname, strerror(errno));
+        cns->chain_id = 0;
+    }
+    if ( cns->output_fname ) {
+        cns->fp_out = fopen(cns->output_fname,"w");
+        if ( ! cns->fp_out ) error("Failed to create %s: %s\n", cns->output_fname, strerror(errno));
+    }
+    else cns->fp_out = stdout;
+}
+
 static void init_data(args_t *args)
 {
     args->files = bcf_sr_init();
     args->files->require_index = 1;
     if ( !bcf_sr_add_reader(args->files,args->fname) ) error("Failed to open %s: %s\n", args->fname, bcf_sr_strerror(args->files->errnum));
     args->hdr = args->files->readers[0].header;
-    args->isample = -1;
+
+    int i, j, nsmpl = 0, *smpl = NULL;
     if ( args->sample )
     {
-        args->isample = bcf_hdr_id2int(args->hdr,BCF_DT_SAMPLE,args->sample);
-        if ( args->isample<0 ) error("No such sample: %s\n", args->sample);
+        char **list = hts_readlist(args->sample, args->sample_is_file, &nsmpl);
+        if ( !list || !nsmpl ) error("Could not read the samples: %s\n", args->sample);
+        smpl = (int*) malloc(sizeof(int)*nsmpl);
+        for (i=0; i<nsmpl; i++)
+        {
+            smpl[i] = bcf_hdr_id2int(args->hdr,BCF_DT_SAMPLE,list[i]);
+            if ( smpl[i]<0 ) error("No such sample: %s\n", list[i]);
+            free(list[i]);
+        }
+        free(list);
     }
-    if ( args->haplotype && args->isample<0 )
+    if ( args->nhaplotypes && !nsmpl )
     {
         if ( bcf_hdr_nsamples(args->hdr) > 1 ) error("The --sample option is expected with --haplotype\n");
-        args->isample = 0;
+        nsmpl = 1;
+        smpl = (int*) calloc(1,sizeof(int));
     }
+
+    // one consensus sequence per sample and haplotype
+    int nhap = args->nhaplotypes ? args->nhaplotypes : 1;
+    args->ncns = nsmpl ? nsmpl*nhap : 1;
+    if ( args->ncns > 1 && !args->output_fname ) error("The -o option is required with multiple samples or haplotypes\n");
+    args->cns = (cns_t*) calloc(args->ncns, sizeof(cns_t));
+    for (i=0; i<args->ncns; i++) args->cns[i].isample = -1;
+    for (i=0; i<nsmpl; i++)
+        for (j=0; j<nhap; j++)
+        {
+            cns_t *cns = &args->cns[i*nhap+j];
+            cns->isample   = smpl[i];
+            cns->haplotype = args->nhaplotypes ? args->haplotypes[j] : 0;
+        }
+    free(smpl);
+    for (i=0; i<args->ncns; i++) open_cns(args, &args->cns[i]);
+
     if ( args->mask_fname )
     {
         args->mask = regidx_init(args->mask_fname,NULL,NULL,0,NULL);
         if ( !args->mask ) error("Failed to initialize mask regions\n");
         args->itr = regitr_init(args->mask);
-    }
-    // In case we want to store the chains
-    if ( args->chain_fname )
-    {
-        args->fp_chain = fopen(args->chain_fname,"w");
-        if ( ! args->fp_chain ) error("Failed to create %s: %s\n", args->chain_fname, strerror(errno));
-        args->chain_id = 0;
+        regitr_set_sorted(args->itr,1);
     }
     rbuf_init(&args->vcf_rbuf, 100);
     args->vcf_buf = (bcf1_t**) calloc(args->vcf_rbuf.m, sizeof(bcf1_t*));
-    if ( args->output_fname ) {
-        args->fp_out = fopen(args->output_fname,"w");
-        if ( ! args->fp_out ) error("Failed to create %s: %s\n", args->output_fname, strerror(errno));
+
+    if ( args->n_threads && args->ncns > 1 )
+    {
+        if ( !(args->pool = hts_tpool_init(args->n_threads)) ) error("Failed to initialize a pool of %d threads\n", args->n_threads);
+        if ( !(args->queue = hts_tpool_process_init(args->pool, 2*args->n_threads, 1)) ) error("Failed to initialize the thread pool queue\n");
+        args->jobs = (replay_job_t*) calloc(args->n_threads, sizeof(replay_job_t));
     }
-    else args->fp_out = stdout;
 }
 
 static void destroy_data(args_t *args)
@@ -229,148 +338,102 @@ static void destroy_data(args_t *args)
     for (i=0; i<args->vcf_rbuf.m; i++)
         if ( args->vcf_buf[i] ) bcf_destroy1(args->vcf_buf[i]);
     free(args->vcf_buf);
-    free(args->fa_buf.s);
+    for (i=0; i<args->mev_rec; i++)
+        if ( args->ev_rec[i] ) bcf_destroy1(args->ev_rec[i]);
+    free(args->ev_rec);
+    free(args->ev);
+    free(args->ev_str.s);
+    free(args->jobs);
+    if ( args->queue ) hts_tpool_process_destroy(args->queue);
+    if ( args->pool ) hts_tpool_destroy(args->pool);
     if ( args->mask ) regidx_destroy(args->mask);
     if ( args->itr ) regitr_destroy(args->itr);
-    if ( args->chain_fname )
-        if ( fclose(args->fp_chain) ) error("Close failed: %s\n", args->chain_fname);
-    if ( fclose(args->fp_out) ) error("Close failed: %s\n", args->output_fname);
-}
-
-static void init_region(args_t *args, char *line)
-{
-    char *ss, *se = line;
-    while ( *se && !isspace(*se) && *se!=':' ) se++;
-    int from = 0, to = 0;
-    char tmp, *tmp_ptr = NULL;
-    if ( *se )
-    {
-        tmp = *se; *se = 0; tmp_ptr = se;
-        ss = ++se;
-        from = strtol(ss,&se,10);
-        if ( ss==se || !*se || *se!='-' ) from = 0;
-        else
-        {
-            from--;
-            ss = ++se;
-            to = strtol(ss,&se,10);
-            if ( ss==se || (*se && !isspace(*se)) ) { from = 0; to = 0; }
-            else to--;
-        }
-    }
-    args->rid = bcf_hdr_name2id(args->hdr,line);
-    if ( args->rid<0 ) fprintf(stderr,"Warning: Sequence \"%s\" not in %s\n", line,args->fname);
-    args->fa_buf.l = 0;
-    args->fa_length = 0;
-    args->fa_end_pos = to;
-    args->fa_ori_pos = from;
-    args->fa_src_pos = from;
-    args->fa_mod_off = 0;
-    args->fa_frz_pos = -1;
-    args->fa_case    = -1;
-    args->vcf_rbuf.n = 0;
-    bcf_sr_seek(args->files,line,args->fa_ori_pos);
-    if ( tmp_ptr ) *tmp_ptr = tmp;
-    fprintf(args->fp_out,">%s\n",line);
-    if (args->chain_fname )
+    for (i=0; i<args->ncns; i++)
     {
-        args->chain = init_chain(args->chain, args->fa_ori_pos);
-    } else {
-        args->chain = NULL;
+        cns_t *cns = &args->cns[i];
+        free(cns->fa_buf.s);
+        free(cns->alt.s);
+        if ( cns->chain_fname )
+            if ( fclose(cns->fp_chain) ) error("Close failed: %s\n", cns->chain_fname);
+        if ( fclose(cns->fp_out) ) error("Close failed: %s\n", cns->output_fname);
+        free(cns->chain_fname);
+        free(cns->output_fname);
     }
+    free(args->cns);
+    free(args->haplotypes);
 }
 
-static bcf1_t **next_vcf_line(args_t *args)
+static void init_cns_region(args_t *args, cns_t *cns, const char *name, int from)
 {
-    if ( args->vcf_rbuf.n )
-    {
-        int i = rbuf_shift(&args->vcf_rbuf);
-        return &args->vcf_buf[i];
-    }
-    else if ( bcf_sr_next_line(args->files) )
-        return &args->files->readers[0].buffer[0];
-
-    return NULL;
+    cns->fa_buf.l = 0;
+    cns->fa_ori_pos = from;
+    cns->fa_mod_off = 0;
+    cns->fa_frz_pos = -1;
+    fprintf(cns->fp_out,">%s\n",name);
+    if ( cns->chain_fname )
+        cns->chain = init_chain(cns->chain, cns->fa_ori_pos);
+    else
+        cns->chain = NULL;
 }
-static void unread_vcf_line(args_t *args, bcf1_t **rec_ptr)
-{
-    bcf1_t *rec = *rec_ptr;
-    if ( args->vcf_rbuf.n >= args->vcf_rbuf.m )
-        error("FIXME: too many overlapping records near %s:%d\n", bcf_seqname(args->hdr,rec),rec->pos+1);
 
-    // Insert the new record in the buffer. The line would be overwritten in
-    // the next bcf_sr_next_line call, therefore we need to swap it with an
-    // unused one
-    int i = rbuf_append(&args->vcf_rbuf);
-    if ( !args->vcf_buf[i] ) args->vcf_buf[i] = bcf_init1();
-    bcf1_t *tmp = rec; *rec_ptr = args->vcf_buf[i]; args->vcf_buf[i] = tmp;
-}
-static void flush_fa_buffer(args_t *args, int len)
+static void flush_fa_buffer(cns_t *cns, int len)
 {
-    if ( !args->fa_buf.l ) return;
+    if ( !cns->fa_buf.l ) return;
 
     int nwr = 0;
-    while ( nwr + 60 <= args->fa_buf.l )
+    while ( nwr + 60 <= cns->fa_buf.l )
     {
-        if ( fwrite(args->fa_buf.s+nwr,1,60,args->fp_out) != 60 ) error("Could not write: %s\n", args->output_fname);
-        if ( fwrite("\n",1,1,args->fp_out) != 1 ) error("Could not write: %s\n", args->output_fname);
+        if ( fwrite(cns->fa_buf.s+nwr,1,60,cns->fp_out) != 60 ) error("Could not write: %s\n", cns->output_fname);
+        if ( fwrite("\n",1,1,cns->fp_out) != 1 ) error("Could not write: %s\n", cns->output_fname);
         nwr += 60;
     }
     if ( nwr )
-        args->fa_ori_pos += nwr;
+        cns->fa_ori_pos += nwr;
 
     if ( len )
     {
         // not finished on this chr yet and the buffer cannot be emptied completely
-        if ( nwr && nwr < args->fa_buf.l )
-            memmove(args->fa_buf.s,args->fa_buf.s+nwr,args->fa_buf.l-nwr);
-        args->fa_buf.l -= nwr;
+        if ( nwr && nwr < cns->fa_buf.l )
+            memmove(cns->fa_buf.s,cns->fa_buf.s+nwr,cns->fa_buf.l-nwr);
+        cns->fa_buf.l -= nwr;
         return;
     }
 
     // empty the whole buffer
-    if ( nwr == args->fa_buf.l ) { args->fa_buf.l = 0; return; }
+    if ( nwr == cns->fa_buf.l ) { cns->fa_buf.l = 0; return; }
 
-    if ( fwrite(args->fa_buf.s+nwr,1,args->fa_buf.l - nwr,args->fp_out) != args->fa_buf.l - nwr ) error("Could not write: %s\n", args->output_fname);
-    if ( fwrite("\n",1,1,args->fp_out) != 1 ) error("Could not write: %s\n", args->output_fname);
+    if ( fwrite(cns->fa_buf.s+nwr,1,cns->fa_buf.l - nwr,cns->fp_out) != cns->fa_buf.l - nwr ) error("Could not write: %s\n", cns->output_fname);
+    if ( fwrite("\n",1,1,cns->fp_out) != 1 ) error("Could not write: %s\n", cns->output_fname);
 
-    args->fa_ori_pos += args->fa_buf.l - nwr - args->fa_mod_off;
-    args->fa_mod_off = 0;
-    args->fa_buf.l = 0;
+    cns->fa_ori_pos += cns->fa_buf.l - nwr - cns->fa_mod_off;
+    cns->fa_mod_off = 0;
+    cns->fa_buf.l = 0;
 }
-static void apply_variant(args_t *args, bcf1_t *rec)
+static void apply_cns_variant(args_t *args, cns_t *cns, bcf1_t *rec, int fa_case)
 {
-    if ( rec->n_allele==1 ) return;
-
-    if ( rec->pos <= args->fa_frz_pos )
+    if ( rec->pos <= cns->fa_frz_pos )
     {
         fprintf(stderr,"The site %s:%d overlaps with another variant, skipping...\n", bcf_seqname(args->hdr,rec),rec->pos+1);
         return;
     }
-    if ( args->mask )
-    {
-        char *chr = (char*)bcf_hdr_id2name(args->hdr,args->rid);
-        int start = rec->pos;
-        int end   = rec->pos + rec->rlen - 1;
-        if ( regidx_overlap(args->mask, chr,start,end,NULL) ) return;
-    }
 
     int i, ialt = 1;
-    if ( args->isample >= 0 )
+    char iupac = 0;     // the IUPAC code of a het SNP
+    if ( cns->isample >= 0 )
     {
         bcf_fmt_t *fmt = bcf_get_fmt(args->hdr, rec, "GT");
         if ( !fmt ) return;
-        if ( args->haplotype )
+        if ( cns->haplotype )
         {
-            if ( args->haplotype > fmt->n ) error("Can't apply %d-th haplotype at %s:%d\n", args->haplotype,bcf_seqname(args->hdr,rec),rec->pos+1);
-            uint8_t *ignore, *ptr = fmt->p + fmt->size*args->isample + args->haplotype - 1;
+            if ( cns->haplotype > fmt->n ) error("Can't apply %d-th haplotype at %s:%d\n", cns->haplotype,bcf_seqname(args->hdr,rec),rec->pos+1);
+            uint8_t *ignore, *ptr = fmt->p + fmt->size*cns->isample + cns->haplotype - 1;
             ialt = bcf_dec_int1(ptr, fmt->type, &ignore);
             if ( bcf_gt_is_missing(ialt) || ialt==bcf_int32_vector_end ) return;
             ialt = bcf_gt_allele(ialt);
         }
         else if ( args->output_iupac ) 
         {
-            uint8_t *ignore, *ptr = fmt->p + fmt->size*args->isample;
+            uint8_t *ignore, *ptr = fmt->p + fmt->size*cns->isample;
             ialt = bcf_dec_int1(ptr, fmt->type, &ignore);
             if ( bcf_gt_is_missing(ialt) || ialt==bcf_int32_vector_end ) return;
             ialt = bcf_gt_allele(ialt);
@@ -378,7 +441,7 @@ static void apply_variant(args_t *args, bcf1_t *rec)
             int jalt;
             if ( fmt->n>1 )
             {
-                ptr = fmt->p + fmt->size*args->isample + 1;
+                ptr = fmt->p + fmt->size*cns->isample + 1;
                 jalt = bcf_dec_int1(ptr, fmt->type, &ignore);
                 if ( bcf_gt_is_missing(jalt) || jalt==bcf_int32_vector_end ) jalt = ialt;
                 else jalt = bcf_gt_allele(jalt);
@@ -386,17 +449,13 @@ static void apply_variant(args_t *args, bcf1_t *rec)
             else jalt = ialt;
             if ( rec->n_allele <= ialt || rec->n_allele <= jalt ) error("Broken VCF, too few alts at %s:%d\n", bcf_seqname(args->hdr,rec),rec->pos+1);
             if ( ialt!=jalt && !rec->d.allele[ialt][1] && !rec->d.allele[jalt][1] ) // is this a het snp?
-            {
-                char ial = rec->d.allele[ialt][0];
-                char jal = rec->d.allele[jalt][0];
-                rec->d.allele[ialt][0] = gt2iupac(ial,jal);
-            }
+                iupac = gt2iupac(rec->d.allele[ialt][0],rec->d.allele[jalt][0]);
         }
         else
         {
             for (i=0; i<fmt->n; i++)
             {
-                uint8_t *ignore, *ptr = fmt->p + fmt->size*args->isample + i;
+                uint8_t *ignore, *ptr = fmt->p + fmt->size*cns->isample + i;
                 ialt = bcf_dec_int1(ptr, fmt->type, &ignore);
                 if ( bcf_gt_is_missing(ialt) || ialt==bcf_int32_vector_end ) return;
                 ialt = bcf_gt_allele(ialt);
@@ -407,107 +466,272 @@ static void apply_variant(args_t *args, bcf1_t *rec)
         if ( rec->n_allele <= ialt ) error("Broken VCF, too few alts at %s:%d\n", bcf_seqname(args->hdr,rec),rec->pos+1);
     }
     else if ( args->output_iupac && !rec->d.allele[0][1] && !rec->d.allele[1][1] )
-    {
-        char ial = rec->d.allele[0][0];
-        char jal = rec->d.allele[1][0];
-        rec->d.allele[1][0] = gt2iupac(ial,jal);
-    }
+        iupac = gt2iupac(rec->d.allele[0][0],rec->d.allele[1][0]);
+
+    cns->alt.l = 0;
+    kputs(rec->d.allele[ialt], &cns->alt);
+    if ( iupac ) cns->alt.s[0] = iupac;
+    char *alt = cns->alt.s;
 
-    int len_diff = 0, alen = 0;
-    int idx = rec->pos - args->fa_ori_pos + args->fa_mod_off;
+    int len_diff = 0, alen = 0, rlen = rec->rlen;
+    int idx = rec->pos - cns->fa_ori_pos + cns->fa_mod_off;
     if ( idx<0 )
     {
         fprintf(stderr,"Warning: ignoring overlapping variant starting at %s:%d\n", bcf_seqname(args->hdr,rec),rec->pos+1);
         return;
     }
-    if ( rec->rlen > args->fa_buf.l - idx )
+    if ( rlen > cns->fa_buf.l - idx )
     {
-        rec->rlen = args->fa_buf.l - idx;
-        alen = strlen(rec->d.allele[ialt]);
-        if ( alen > rec->rlen )
+        rlen = cns->fa_buf.l - idx;
+        alen = strlen(alt);
+        if ( alen > rlen )
         {
-            rec->d.allele[ialt][rec->rlen] = 0;
+            alt[rlen] = 0;
             fprintf(stderr,"Warning: trimming variant starting at %s:%d\n", bcf_seqname(args->hdr,rec),rec->pos+1);
         }
     }
-    if ( idx>=args->fa_buf.l ) 
-        error("FIXME: %s:%d .. idx=%d, ori_pos=%d, len=%d, off=%d\n",bcf_seqname(args->hdr,rec),rec->pos+1,idx,args->fa_ori_pos,args->fa_buf.l,args->fa_mod_off);
+    if ( idx>=cns->fa_buf.l ) 
+        error("FIXME: %s:%d .. idx=%d, ori_pos=%d, len=%d, off=%d\n",bcf_seqname(args->hdr,rec),rec->pos+1,idx,cns->fa_ori_pos,cns->fa_buf.l,cns->fa_mod_off);
 
     // sanity check the reference base
-    if ( rec->d.allele[ialt][0]=='<' )
+    if ( alt[0]=='<' )
     {
-        if ( strcasecmp(rec->d.allele[ialt], "<DEL>") )
-            error("Symbolic alleles other than <DEL> are currently not supported: %s at %s:%d\n",rec->d.allele[ialt],bcf_seqname(args->hdr,rec),rec->pos+1);
+        if ( strcasecmp(alt, "<DEL>") )
+            error("Symbolic alleles other than <DEL> are currently not supported: %s at %s:%d\n",alt,bcf_seqname(args->hdr,rec),rec->pos+1);
         assert( rec->d.allele[0][1]==0 );           // todo: for now expecting strlen(REF) = 1
-        len_diff = 1-rec->rlen;
-        rec->d.allele[ialt] = rec->d.allele[0];     // according to VCF spec, REF must precede the event
-        alen = strlen(rec->d.allele[ialt]);
+        len_diff = 1-rlen;
+        cns->alt.l = 0;
+        kputs(rec->d.allele[0], &cns->alt);         // according to VCF spec, REF must precede the event
+        alt  = cns->alt.s;
+        alen = strlen(alt);
     }
-    else if ( strncasecmp(rec->d.allele[0],args->fa_buf.s+idx,rec->rlen) )
+    else if ( strncasecmp(rec->d.allele[0],cns->fa_buf.s+idx,rlen) )
     {
-        // fprintf(stderr,"%d .. [%s], idx=%d ori=%d off=%d\n",args->fa_ori_pos,args->fa_buf.s,idx,args->fa_ori_pos,args->fa_mod_off);
+        // fprintf(stderr,"%d .. [%s], idx=%d ori=%d off=%d\n",cns->fa_ori_pos,cns->fa_buf.s,idx,cns->fa_ori_pos,cns->fa_mod_off);
         char tmp = 0;
-        if ( args->fa_buf.l - idx > rec->rlen ) 
+        if ( cns->fa_buf.l - idx > rlen ) 
         { 
-            tmp = args->fa_buf.s[idx+rec->rlen];
-            args->fa_buf.s[idx+rec->rlen] = 0;
+            tmp = cns->fa_buf.s[idx+rlen];
+            cns->fa_buf.s[idx+rlen] = 0;
         }
         error(
             "The fasta sequence does not match the REF allele at %s:%d:\n"
             "   .vcf: [%s]\n" 
             "   .vcf: [%s] <- (ALT)\n" 
             "   .fa:  [%s]%c%s\n",
-            bcf_seqname(args->hdr,rec),rec->pos+1, rec->d.allele[0], rec->d.allele[ialt], args->fa_buf.s+idx, 
-            tmp?tmp:' ',tmp?args->fa_buf.s+idx+rec->rlen+1:""
+            bcf_seqname(args->hdr,rec),rec->pos+1, rec->d.allele[0], alt, cns->fa_buf.s+idx, 
+            tmp?tmp:' ',tmp?cns->fa_buf.s+idx+rlen+1:""
             );
     }
     else
     {
-        alen = strlen(rec->d.allele[ialt]);
-        len_diff = alen - rec->rlen;
+        alen = strlen(alt);
+        len_diff = alen - rlen;
     }
 
-    if ( args->fa_case )
-        for (i=0; i<alen; i++) rec->d.allele[ialt][i] = toupper(rec->d.allele[ialt][i]);
+    if ( fa_case )
+        for (i=0; i<alen; i++) alt[i] = toupper(alt[i]);
     else
-        for (i=0; i<alen; i++) rec->d.allele[ialt][i] = tolower(rec->d.allele[ialt][i]);
+        for (i=0; i<alen; i++) alt[i] = tolower(alt[i]);
 
     if ( len_diff <= 0 )
     {
         // deletion or same size event
         for (i=0; i<alen; i++)
-            args->fa_buf.s[idx+i] = rec->d.allele[ialt][i];
+            cns->fa_buf.s[idx+i] = alt[i];
         if ( len_diff )
-            memmove(args->fa_buf.s+idx+alen,args->fa_buf.s+idx+rec->rlen,args->fa_buf.l-idx-rec->rlen);
+            memmove(cns->fa_buf.s+idx+alen,cns->fa_buf.s+idx+rlen,cns->fa_buf.l-idx-rlen);
     }
     else
     {
         // insertion
-        ks_resize(&args->fa_buf, args->fa_buf.l + len_diff);
-        memmove(args->fa_buf.s + idx + rec->rlen + len_diff, args->fa_buf.s + idx + rec->rlen, args->fa_buf.l - idx - rec->rlen);
+        ks_resize(&cns->fa_buf, cns->fa_buf.l + len_diff);
+        memmove(cns->fa_buf.s + idx + rlen + len_diff, cns->fa_buf.s + idx + rlen, cns->fa_buf.l - idx - rlen);
         for (i=0; i<alen; i++)
-            args->fa_buf.s[idx+i] = rec->d.allele[ialt][i];
+            cns->fa_buf.s[idx+i] = alt[i];
     }
-    if (args->chain && len_diff != 0)
+    if (cns->chain && len_diff != 0)
     {
         // If first nucleotide of both REF and ALT are the same... (indels typically include the nucleotide before the variant)
-        if ( strncasecmp(rec->d.allele[0],rec->d.allele[ialt],1) == 0)
+        if ( strncasecmp(rec->d.allele[0],alt,1) == 0)
         {
             // ...extend the block by 1 bp: start is 1 bp further and alleles are 1 bp shorter
-            push_chain_gap(args->chain, rec->pos + 1, rec->rlen - 1, rec->pos + 1 + args->fa_mod_off, alen - 1);
+            push_chain_gap(cns->chain, rec->pos + 1, rlen - 1, rec->pos + 1 + cns->fa_mod_off, alen - 1);
         }
         else
         {
             // otherwise, just the coordinates of the variant as given
-            push_chain_gap(args->chain, rec->pos, rec->rlen, rec->pos + args->fa_mod_off, alen);
+            push_chain_gap(cns->chain, rec->pos, rlen, rec->pos + cns->fa_mod_off, alen);
+        }
+    }
+    cns->fa_buf.l += len_diff;
+    cns->fa_mod_off += len_diff;
+    cns->fa_frz_pos  = rec->pos + rlen - 1;
+}
+
+static void run_event(args_t *args, cns_t *cns, event_t *ev, const char *str)
+{
+    switch (ev->type)
+    {
+        case EV_REGION: init_cns_region(args, cns, str, ev->a); break;
+        case EV_SEQ: kputsn(str, ev->a, &cns->fa_buf); break;
+        case EV_VARIANT: apply_cns_variant(args, cns, ev->rec, ev->a); break;
+        case EV_FLUSH: flush_fa_buffer(cns, ev->a); break;
+        case EV_CHAIN:
+            if ( cns->chain )
+            {
+                print_chain(args, cns, ev->a, ev->b);
+                destroy_chain(cns);
+            }
+            break;
+    }
+}
+static void *replay_events(void *arg)
+{
+    replay_job_t *job = (replay_job_t*) arg;
+    args_t *args = job->args;
+    int i, j;
+    for (i=0; i<args->nev; i++)
+    {
+        event_t *ev = &args->ev[i];
+        const char *str = ev->off >= 0 ? args->ev_str.s + ev->off : NULL;
+        for (j=job->beg; j<job->end; j++) run_event(args, &args->cns[j], ev, str);
+    }
+    return NULL;
+}
+static void replay_log(args_t *args)
+{
+    if ( !args->nev ) return;
+    int i, njob = args->n_threads < args->ncns ? args->n_threads : args->ncns;
+    for (i=0; i<njob; i++)
+    {
+        replay_job_t *job = &args->jobs[i];
+        job->args = args;
+        job->beg  = (int64_t)args->ncns*i/njob;
+        job->end  = (int64_t)args->ncns*(i+1)/njob;
+        if ( hts_tpool_dispatch(args->pool, args->queue, replay_events, job) < 0 ) error("Failed to dispatch the consensus job\n");
+    }
+    hts_tpool_process_flush(args->queue);
+    args->nev = args->nev_rec = 0;
+    args->ev_str.l = 0;
+}
+// Apply the event to all consensus sequences, either right away or via the log
+static void add_event(args_t *args, int type, int a, int b, const char *str, int len, bcf1_t *rec)
+{
+    int i;
+    if ( !args->pool )
+    {
+        event_t ev = { type, a, b, -1, rec };
+        for (i=0; i<args->ncns; i++) run_event(args, &args->cns[i], &ev, str);
+        return;
+    }
+
+    args->nev++;
+    hts_expand(event_t, args->nev, args->mev, args->ev);
+    event_t *ev = &args->ev[args->nev-1];
+    ev->type = type;
+    ev->a    = a;
+    ev->b    = b;
+    ev->off  = -1;
+    ev->rec  = NULL;
+    if ( str )
+    {
+        ev->off = args->ev_str.l;
+        kputsn(str, len, &args->ev_str);
+        kputc(0, &args->ev_str);
+    }
+    if ( rec )
+    {
+        // the reader's record will be reused, unpack a copy so that the workers only read it
+        args->nev_rec++;
+        hts_expand0(bcf1_t*, args->nev_rec, args->mev_rec, args->ev_rec);
+        if ( !args->ev_rec[args->nev_rec-1] ) args->ev_rec[args->nev_rec-1] = bcf_init1();
+        ev->rec = bcf_copy(args->ev_rec[args->nev_rec-1], rec);
+        bcf_unpack(ev->rec, BCF_UN_ALL);
+    }
+    if ( args->ev_str.l >= EV_LOG_SIZE || args->nev >= EV_LOG_NEVENTS ) replay_log(args);
+}
+static void apply_variant(args_t *args, bcf1_t *rec)
+{
+    if ( rec->n_allele==1 ) return;
+
+    if ( args->mask )
+    {
+        char *chr = (char*)bcf_hdr_id2name(args->hdr,args->rid);
+        int start = rec->pos;
+        int end   = rec->pos + rec->rlen - 1;
+        if ( regidx_overlap(args->mask, chr,start,end,NULL) ) return;
+    }
+    add_event(args, EV_VARIANT, args->fa_case, 0, NULL, 0, rec);
+}
+static void flush_fa_buffers(args_t *args, int len)
+{
+    add_event(args, EV_FLUSH, len, 0, NULL, 0, NULL);
+}
+static void flush_chains(args_t *args)
+{
+    if ( args->chain_fname && args->in_region ) add_event(args, EV_CHAIN, args->rid, args->fa_length, NULL, 0, NULL);
+}
+
+static void init_region(args_t *args, char *line)
+{
+    char *ss, *se = line;
+    while ( *se && !isspace(*se) && *se!=':' ) se++;
+    int from = 0, to = 0;
+    char tmp, *tmp_ptr = NULL;
+    if ( *se )
+    {
+        tmp = *se; *se = 0; tmp_ptr = se;
+        ss = ++se;
+        from = strtol(ss,&se,10);
+        if ( ss==se || !*se || *se!='-' ) from = 0;
+        else
+        {
+            from--;
+            ss = ++se;
+            to = strtol(ss,&se,10);
+            if ( ss==se || (*se && !isspace(*se)) ) { from = 0; to = 0; }
+            else to--;
         }
     }
-    args->fa_buf.l += len_diff;
-    args->fa_mod_off += len_diff;
-    args->fa_frz_pos  = rec->pos + rec->rlen - 1;
+    args->rid = bcf_hdr_name2id(args->hdr,line);
+    if ( args->rid<0 ) fprintf(stderr,"Warning: Sequence \"%s\" not in %s\n", line,args->fname);
+    args->fa_length = 0;
+    args->fa_end_pos = to;
+    args->fa_src_pos = from;
+    args->fa_case    = -1;
+    args->vcf_rbuf.n = 0;
+    args->in_region  = 1;
+    bcf_sr_seek(args->files,line,from);
+    if ( tmp_ptr ) *tmp_ptr = tmp;
+    add_event(args, EV_REGION, from, 0, line, strlen(line), NULL);
 }
 
+static bcf1_t **next_vcf_line(args_t *args)
+{
+    if ( args->vcf_rbuf.n )
+    {
+        int i = rbuf_shift(&args->vcf_rbuf);
+        return &args->vcf_buf[i];
+    }
+    else if ( bcf_sr_next_line(args->files) )
+        return &args->files->readers[0].buffer[0];
 
+    return NULL;
+}
+static void unread_vcf_line(args_t *args, bcf1_t **rec_ptr)
+{
+    bcf1_t *rec = *rec_ptr;
+    if ( args->vcf_rbuf.n >= args->vcf_rbuf.m )
+        error("FIXME: too many overlapping records near %s:%d\n", bcf_seqname(args->hdr,rec),rec->pos+1);
+
+    // Insert the new record in the buffer. The line would be overwritten in
+    // the next bcf_sr_next_line call, therefore we need to swap it with an
+    // unused one
+    int i = rbuf_append(&args->vcf_rbuf);
+    if ( !args->vcf_buf[i] ) args->vcf_buf[i] = bcf_init1();
+    bcf1_t *tmp = rec; *rec_ptr = args->vcf_buf[i]; args->vcf_buf[i] = tmp;
+}
 static void mask_region(args_t *args, char *seq, int len)
 {
     char *chr = (char*)bcf_hdr_id2name(args->hdr,args->rid);
@@ -537,10 +761,7 @@ static void consensus(args_t *args)
         if ( str.s[0]=='>' )
         {
             // new sequence encountered
-            if (args->chain) {
-                print_chain(args);
-                destroy_chain(args);
-            }
+            flush_chains(args);
             // apply all cached variants
             while ( args->vcf_rbuf.n )
             {
@@ -549,7 +770,7 @@ static void consensus(args_t *args)
                 int i = rbuf_shift(&args->vcf_rbuf);
                 apply_variant(args, args->vcf_buf[i]);
             }
-            flush_fa_buffer(args, 0);
+            flush_fa_buffers(args, 0);
             init_region(args, str.s+1);
             continue;
         }
@@ -560,7 +781,7 @@ static void consensus(args_t *args)
         if ( args->fa_case==-1 ) args->fa_case = toupper(str.s[0])==str.s[0] ? 1 : 0;
 
         if ( args->mask && args->rid>=0) mask_region(args, str.s, str.l);
-        kputs(str.s, &args->fa_buf);
+        add_event(args, EV_SEQ, str.l, 0, str.s, str.l, NULL);
 
         bcf1_t **rec_ptr = NULL;
         while ( args->rid>=0 && (rec_ptr = next_vcf_line(args)) )
@@ -577,7 +798,8 @@ static void consensus(args_t *args)
             }
 
             // is the vcf record well beyond cached fasta buffer? if yes, the buf can be flushed
-            if ( args->fa_ori_pos + args->fa_buf.l - args->fa_mod_off <= rec->pos )
+            // note that fa_src_pos is the end of all consensus buffers in the original coordinates
+            if ( args->fa_src_pos <= rec->pos )
             {
                 unread_vcf_line(args, rec_ptr);
                 rec_ptr = NULL;
@@ -585,14 +807,14 @@ static void consensus(args_t *args)
             }
 
             // is the cached fasta buffer full enough? if not, read more fasta, no flushing
-            if ( args->fa_ori_pos + args->fa_buf.l - args->fa_mod_off < rec->pos + rec->rlen )
+            if ( args->fa_src_pos < rec->pos + rec->rlen )
             {
                 unread_vcf_line(args, rec_ptr);
                 break;
             }
             apply_variant(args, rec);
         }
-        if ( !rec_ptr ) flush_fa_buffer(args, 60);
+        if ( !rec_ptr ) flush_fa_buffers(args, 60);
     }
     bcf1_t **rec_ptr = NULL;
     while ( args->rid>=0 && (rec_ptr = next_vcf_line(args)) )
@@ -600,15 +822,12 @@ static void consensus(args_t *args)
         bcf1_t *rec = *rec_ptr;
         if ( rec->rid!=args->rid ) break;
         if ( args->fa_end_pos && rec->pos > args->fa_end_pos ) break;
-        if ( args->fa_ori_pos + args->fa_buf.l - args->fa_mod_off <= rec->pos ) break;
+        if ( args->fa_src_pos <= rec->pos ) break;
         apply_variant(args, rec);
     }
-    if (args->chain)
-    {
-        print_chain(args);
-        destroy_chain(args);
-    }
-    flush_fa_buffer(args, 0);
+    flush_chains(args);
+    flush_fa_buffers(args, 0);
+    if ( args->pool ) replay_log(args);
     hts_close(fasta);
     free(str.s);
 }
@@ -624,17 +843,22 @@ static void usage(args_t *args)
     fprintf(stderr, "Usage:   bcftools consensus [OPTIONS] <file.vcf>\n");
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "    -f, --fasta-ref <file>     reference sequence in fasta format\n");
-    fprintf(stderr, "    -H, --haplotype <1|2>      apply variants for the given haplotype\n");
+    fprintf(stderr, "    -H, --haplotype <1|2>      apply variants for the given haplotype, or a comma-separated list\n");
     fprintf(stderr, "    -i, --iupac-codes          output variants in the form of IUPAC ambiguity codes\n");
     fprintf(stderr, "    -m, --mask <file>          replace regions with N\n");
     fprintf(stderr, "    -o, --output <file>        write output to a file [standard output]\n");
     fprintf(stderr, "    -c, --chain <file>         write a chain file for liftover\n");
-    fprintf(stderr, "    -s, --sample <name>        apply variants of the given sample\n");
+    fprintf(stderr, "    -s, --sample <name>        apply variants of the given sample, or a comma-separated list\n");
+    fprintf(stderr, "    -S, --samples-file <file>  apply variants of the samples listed in the file\n");
+    fprintf(stderr, "        --threads <int>        build the consensus sequences of multiple samples in <int> threads\n");
     fprintf(stderr, "Examples:\n");
     fprintf(stderr, "   # Get the consensus for one region. The fasta header lines are then expected\n");
     fprintf(stderr, "   # in the form \">chr:from-to\".\n");
     fprintf(stderr, "   samtools faidx ref.fa 8:11870-11890 | bcftools consensus in.vcf.gz > out.fa\n");
     fprintf(stderr, "\n");
+    fprintf(stderr, "   # Both haplotypes of all listed samples in one pass, written to out.<sample>.<1|2>.fa\n");
+    fprintf(stderr, "   bcftools consensus -f ref.fa -S samples.txt -H 1,2 -o out --threads 4 in.vcf.gz\n");
+    fprintf(stderr, "\n");
     exit(1);
 }
 
@@ -646,6 +870,8 @@ int main_consensus(int argc, char *argv[])
     static struct option loptions[] = 
     {
         {"sample",1,0,'s'},
+        {"samples-file",1,0,'S'},
+        {"threads",1,0,1},
         {"iupac-codes",0,0,'i'},
         {"haplotype",1,0,'H'},
         {"output",1,0,'o'},
@@ -654,20 +880,36 @@ int main_consensus(int argc, char *argv[])
         {"chain",1,0,'c'},
         {0,0,0,0}
     };
+    char *tmp;
     int c;
-    while ((c = getopt_long(argc, argv, "h?s:1iH:f:o:m:c:",loptions,NULL)) >= 0) 
+    while ((c = getopt_long(argc, argv, "h?s:S:1iH:f:o:m:c:",loptions,NULL)) >= 0) 
     {
         switch (c) 
         {
             case 's': args->sample = optarg; break;
+            case 'S': args->sample = optarg; args->sample_is_file = 1; break;
+            case  1 :
+                args->n_threads = strtol(optarg,&tmp,10);
+                if ( *tmp || args->n_threads<0 ) error("Could not parse: --threads %s\n", optarg);
+                break;
             case 'o': args->output_fname = optarg; break;
             case 'i': args->output_iupac = 1; break;
             case 'f': args->ref_fname = optarg; break;
             case 'm': args->mask_fname = optarg; break;
             case 'c': args->chain_fname = optarg; break;
             case 'H': 
-                args->haplotype = optarg[0] - '0'; 
-                if ( args->haplotype <=0 ) error("Expected positive integer with --haplotype\n");
+                tmp = optarg;
+                do
+                {
+                    char *beg = *tmp==',' ? tmp+1 : tmp;
+                    int hap = strtol(beg,&tmp,10);
+                    if ( tmp==beg || hap<=0 ) error("Expected positive integer with --haplotype\n");
+                    args->nhaplotypes++;
+                    args->haplotypes = (int*) realloc(args->haplotypes, sizeof(int)*args->nhaplotypes);
+                    args->haplotypes[args->nhaplotypes-1] = hap;
+                }
+                while ( *tmp==',' );
+                if ( *tmp ) error("Expected positive integer with --haplotype\n");
                 break;
             default: usage(args); break;
         }
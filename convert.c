@@ -36,6 +36,7 @@ THE SOFTWARE.  */
 #include <htslib/vcfutils.h>
 #include "bcftools.h"
 #include "convert.h"
+#include "profile.h"
 
 #define T_CHROM   1
 #define T_POS     2
@@ -78,6 +79,17 @@ typedef struct _fmt_t
 }
 fmt_t;
 
+// Fields enclosed in square brackets, repeated for each sample. When the block
+// consists of a single FORMAT field and separators, the samples are formatted in
+// a loop specialized for the field type instead of calling the handlers.
+typedef struct
+{
+    int beg, end;       // the block spans fmt[beg..end-1]
+    int ifield;         // the only non-separator field or -1 if not eligible for the fast loop
+    kstring_t pre, post;    // separators before and after the field
+}
+gtblock_t;
+
 struct _convert_t
 {
     fmt_t *fmt;
@@ -92,6 +104,9 @@ struct _convert_t
     int ndat;
     char *undef_info_tag;
     int allow_undef_tags;
+    gtblock_t *blocks;
+    int nblocks;
+    size_t max_len;     // the longest line so far, to preallocate the output
 };
 
 typedef struct
@@ -241,8 +256,7 @@ static void process_info(convert_t *convert, bcf1_t *line, fmt_t *fmt, int isamp
 }
 static void init_format(convert_t *convert, bcf1_t *line, fmt_t *fmt)
 {
-    fmt->id = bcf_hdr_id2int(convert->header, BCF_DT_ID, fmt->key);
-    if ( !bcf_hdr_idinfo_exists(convert->header,BCF_HL_FMT,fmt->id) ) fmt->id = -1;
+    // the tag id was resolved in register_tag()
     fmt->fmt = NULL;
     if ( fmt->id >= 0 )
     {
@@ -603,6 +617,33 @@ static void process_gt_to_prob3(convert_t *convert, bcf1_t *line, fmt_t *fmt, in
         else error("FIXME: not ready for ploidy %d\n", j);
     }
 }
+// Faster equivalent of ksprintf(str,"%.*f",prec,val) for prec<=6, such as the
+// probabilities printed by process_pl_to_prob3 and process_gp_to_prob3. The
+// output is identical: values which printf might round differently, because
+// they fall too close to the midpoint between two outputs, and large or
+// non-finite values are left to ksprintf.
+static inline void kput_fixed(double val, int prec, kstring_t *str)
+{
+    static const double pow10[] = { 1, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6 };
+    if ( prec>6 || !(val > -1e6 && val < 1e6) ) { ksprintf(str,"%.*f",prec,val); return; }
+
+    double v = fabs(val) * pow10[prec];
+    double r = floor(v), frac = v - r;
+    if ( fabs(frac - 0.5) < v*1e-15 + 1e-12 ) { ksprintf(str,"%.*f",prec,val); return; }
+
+    uint64_t n = frac > 0.5 ? (uint64_t)r + 1 : (uint64_t)r;
+    uint64_t ip = n / (uint64_t)pow10[prec], fp = n % (uint64_t)pow10[prec];
+    if ( signbit(val) ) kputc('-', str);
+    kputuw((unsigned)ip, str);
+    if ( !prec ) return;
+    kputc('.', str);
+
+    char buf[8];
+    int i = prec;
+    while ( i>0 ) { buf[--i] = '0' + fp % 10; fp /= 10; }
+    kputsn(buf, prec, str);
+}
+
 static void process_pl_to_prob3(convert_t *convert, bcf1_t *line, fmt_t *fmt, int isample, kstring_t *str)
 {
     int m,n,i;
@@ -627,28 +668,31 @@ static void process_pl_to_prob3(convert_t *convert, bcf1_t *line, fmt_t *fmt, in
         int32_t *ptr = (int32_t*)convert->dat + i*n;
         int j;
         float sum = 0;
+        double prob[3] = {0,0,0};   // the first three are printed, compute them only once
         for (j=0; j<n; j++)
         {
             if ( ptr[j]==bcf_int32_vector_end ) break;
-            sum += pow(10,-0.1*ptr[j]);
+            double p = pow(10,-0.1*ptr[j]);
+            if ( j<3 ) prob[j] = p;
+            sum += p;
         }
         if ( j==line->n_allele )
         {
             // haploid
             kputc(' ',str);
-            ksprintf(str,"%f",pow(10,-0.1*ptr[0])/sum);
+            kput_fixed(prob[0]/sum, 6, str);
             kputs(" 0 ", str);
-            ksprintf(str,"%f",pow(10,-0.1*ptr[1])/sum);
+            kput_fixed(prob[1]/sum, 6, str);
         }
         else
         {
             // diploid
             kputc(' ',str);
-            ksprintf(str,"%f",pow(10,-0.1*ptr[0])/sum);
+            kput_fixed(prob[0]/sum, 6, str);
             kputc(' ',str);
-            ksprintf(str,"%f",pow(10,-0.1*ptr[1])/sum);
+            kput_fixed(prob[1]/sum, 6, str);
             kputc(' ',str);
-            ksprintf(str,"%f",pow(10,-0.1*ptr[2])/sum);
+            kput_fixed(prob[2]/sum, 6, str);
         }
     }
 }
@@ -682,11 +726,264 @@ static void process_gp_to_prob3(convert_t *convert, bcf1_t *line, fmt_t *fmt, in
             if ( ptr[j]<0 || ptr[j]>1 ) error("[%s:%d:%f] GP value outside range [0,1]; bcftools convert expects the VCF4.3+ spec for the GP field encoding genotype posterior probabilities", bcf_seqname(convert->header,line),line->pos+1,ptr[j]);
             sum+=ptr[j];
         }
-        if ( j==line->n_allele )
-            ksprintf(str," %f %f %f",ptr[0],0.,ptr[1]); // haploid
-        else
-            ksprintf(str," %f %f %f",ptr[0],ptr[1],ptr[2]); // diploid
+        kputc(' ',str); kput_fixed(ptr[0], 6, str);
+        if ( j==line->n_allele )    // haploid
+        {
+            kputc(' ',str); kput_fixed(0, 6, str);
+            kputc(' ',str); kput_fixed(ptr[1], 6, str);
+        }
+        else                        // diploid
+        {
+            kputc(' ',str); kput_fixed(ptr[1], 6, str);
+            kputc(' ',str); kput_fixed(ptr[2], 6, str);
+        }
+    }
+}
+
+// One diploid sample of the hap output, the caller reserves the space
+static void gt_to_hap(int8_t *ptr, kstring_t *str)
+{
+    if ( ptr[0]==2 )
+    {
+        if ( ptr[1]==3 ) /* 0|0 */
+        {
+            str->s[str->l++] = '0'; str->s[str->l++] = ' '; str->s[str->l++] = '0'; str->s[str->l++] = ' ';
+        }
+        else if ( ptr[1]==5 ) /* 0|1 */
+        {
+            str->s[str->l++] = '0'; str->s[str->l++] = ' '; str->s[str->l++] = '1'; str->s[str->l++] = ' ';
+        }
+        else if ( ptr[1]==bcf_int8_vector_end ) /* 0 */
+        {
+            str->s[str->l++] = '0'; str->s[str->l++] = ' '; str->s[str->l++] = '-'; str->s[str->l++] = ' ';
+        }
+        else if ( ptr[1]==2 ) /* 0/0 */
+        {
+            str->s[str->l++] = '0'; str->s[str->l++] = '*'; str->s[str->l++] = ' '; str->s[str->l++] = '0'; str->s[str->l++] = '*'; str->s[str->l++] = ' ';
+        }
+        else if ( ptr[1]==4 ) /* 0/1 */
+        {
+            str->s[str->l++] = '0'; str->s[str->l++] = '*'; str->s[str->l++] = ' '; str->s[str->l++] = '1'; str->s[str->l++] = '*'; str->s[str->l++] = ' ';
+        }
+        else if ( bcf_gt_is_missing(ptr[1]) ) /* 0/. */
+        {
+            str->s[str->l++] = '?'; str->s[str->l++] = ' '; str->s[str->l++] = '?'; str->s[str->l++] = ' ';
+        }
+        else if ( bcf_gt_is_phased(ptr[1]) ) /* 0|x */
+        {
+            str->s[str->l++] = '0'; str->s[str->l++] = ' ';
+            kputw(bcf_gt_allele(ptr[1]),str);
+            str->s[str->l++] = ' ';
+        }
+        else /* 0/x */
+        {
+            str->s[str->l++] = '0'; str->s[str->l++] = '*'; str->s[str->l++] = ' ';
+            kputw(bcf_gt_allele(ptr[1]),str);
+            str->s[str->l++] = '*'; str->s[str->l++] = ' ';
+        }
+    }
+    else if ( ptr[0]==4 )
+    {
+        if ( ptr[1]==3 ) /* 1|0 */
+        {
+            str->s[str->l++] = '1'; str->s[str->l++] = ' '; str->s[str->l++] = '0'; str->s[str->l++] = ' ';
+        }
+        else if ( ptr[1]==5 ) /* 1|1 */
+        {
+            str->s[str->l++] = '1'; str->s[str->l++] = ' '; str->s[str->l++] = '1'; str->s[str->l++] = ' ';
+        }
+        else if ( ptr[1]==bcf_int8_vector_end ) /* 1 */
+        {
+            str->s[str->l++] = '1'; str->s[str->l++] = ' '; str->s[str->l++] = '-'; str->s[str->l++] = ' ';
+        }
+        else if ( ptr[1]==2 ) /* 1/0 */
+        {
+            str->s[str->l++] = '1'; str->s[str->l++] = '*'; str->s[str->l++] = ' '; str->s[str->l++] = '0'; str->s[str->l++] = '*'; str->s[str->l++] = ' ';
+        }
+        else if ( ptr[1]==4 ) /* 1/1 */
+        {
+            str->s[str->l++] = '1'; str->s[str->l++] = '*'; str->s[str->l++] = ' '; str->s[str->l++] = '1'; str->s[str->l++] = '*'; str->s[str->l++] = ' ';
+        }
+        else if ( bcf_gt_is_missing(ptr[1]) ) /* 1/. */
+        {
+            str->s[str->l++] = '?'; str->s[str->l++] = ' '; str->s[str->l++] = '?'; str->s[str->l++] = ' ';
+        }
+        else if ( bcf_gt_is_phased(ptr[1]) )    /* 1|x */
+        {
+            str->s[str->l++] = '1'; str->s[str->l++] = ' ';
+            kputw(bcf_gt_allele(ptr[1]),str);
+            str->s[str->l++] = ' ';
+        }
+        else /* 1/x */
+        {
+            str->s[str->l++] = '1'; str->s[str->l++] = '*'; str->s[str->l++] = ' ';
+            kputw(bcf_gt_allele(ptr[1]),str);
+            str->s[str->l++] = '*'; str->s[str->l++] = ' ';
+        }
+    }
+    else if ( bcf_gt_is_missing(ptr[0]) )
+    {
+        if ( ptr[1]==bcf_int8_vector_end ) 
+        {
+            str->s[str->l++] = '?'; str->s[str->l++] = ' '; str->s[str->l++] = '-'; str->s[str->l++] = ' ';
+        }
+        else 
+        { 
+            str->s[str->l++] = '?'; str->s[str->l++] = ' '; str->s[str->l++] = '?'; str->s[str->l++] = ' ';
+        }
+    }
+    else if ( ptr[1]==bcf_int8_vector_end )
+    {
+        /* use REF for something else than first ALT */
+        str->s[str->l++] = '0'; str->s[str->l++] = ' '; str->s[str->l++] = '-'; str->s[str->l++] = ' ';
+    }
+    else
+    {
+        kputw(bcf_gt_allele(ptr[0]),str);
+        if ( bcf_gt_is_phased(ptr[1]) ) str->s[str->l++] = '*';
+        str->s[str->l++] = ' ';
+        kputw(bcf_gt_allele(ptr[1]),str);
+        if ( bcf_gt_is_phased(ptr[1]) ) str->s[str->l++] = '*';
+        str->s[str->l++] = ' ';
+    }
+}
+// Same as gt_to_hap but converts haploid genotypes into diploid
+static void gt_to_hap2(int8_t *ptr, kstring_t *str)
+{
+    if ( ptr[0]==2 )
+    {
+        if ( ptr[1]==3 ) /* 0|0 */
+        {
+            str->s[str->l++] = '0'; str->s[str->l++] = ' '; str->s[str->l++] = '0'; str->s[str->l++] = ' ';
+        }
+        else if ( ptr[1]==5 ) /* 0|1 */
+        {
+            str->s[str->l++] = '0'; str->s[str->l++] = ' '; str->s[str->l++] = '1'; str->s[str->l++] = ' ';
+        }
+        else if ( ptr[1]==bcf_int8_vector_end ) /* 0 -> 0|0 */
+        {
+            str->s[str->l++] = '0'; str->s[str->l++] = ' '; str->s[str->l++] = '0'; str->s[str->l++] = ' ';
+        }
+        else if ( ptr[1]==2 ) /* 0/0 */
+        {
+            str->s[str->l++] = '0'; str->s[str->l++] = '*'; str->s[str->l++] = ' '; str->s[str->l++] = '0'; str->s[str->l++] = '*'; str->s[str->l++] = ' ';
+        }
+        else if ( ptr[1]==4 ) /* 0/1 */
+        {
+            str->s[str->l++] = '0'; str->s[str->l++] = '*'; str->s[str->l++] = ' '; str->s[str->l++] = '1'; str->s[str->l++] = '*'; str->s[str->l++] = ' ';
+        }
+        else if ( bcf_gt_is_missing(ptr[1]) ) /* 0/. */
+        {
+            str->s[str->l++] = '?'; str->s[str->l++] = ' '; str->s[str->l++] = '?'; str->s[str->l++] = ' ';
+        }
+        else if ( bcf_gt_is_phased(ptr[1]) ) /* 0|x */
+        {
+            str->s[str->l++] = '0'; str->s[str->l++] = ' ';
+            kputw(bcf_gt_allele(ptr[1]),str);
+            str->s[str->l++] = ' ';
+        }
+        else /* 0/x */
+        {
+            str->s[str->l++] = '0'; str->s[str->l++] = '*'; str->s[str->l++] = ' ';
+            kputw(bcf_gt_allele(ptr[1]),str);
+            str->s[str->l++] = '*'; str->s[str->l++] = ' ';
+        }
+    }
+    else if ( ptr[0]==4 )
+    {
+        if ( ptr[1]==3 ) /* 1|0 */
+        {
+            str->s[str->l++] = '1'; str->s[str->l++] = ' '; str->s[str->l++] = '0'; str->s[str->l++] = ' ';
+        }
+        else if ( ptr[1]==5 ) /* 1|1 */
+        {
+            str->s[str->l++] = '1'; str->s[str->l++] = ' '; str->s[str->l++] = '1'; str->s[str->l++] = ' ';
+        }
+        else if ( ptr[1]==bcf_int8_vector_end ) /* 1 -> 1|1 */
+        {
+            str->s[str->l++] = '1'; str->s[str->l++] = ' '; str->s[str->l++] = '1'; str->s[str->l++] = ' ';
+        }
+        else if ( ptr[1]==2 ) /* 1/0 */
+        {
+            str->s[str->l++] = '1'; str->s[str->l++] = '*'; str->s[str->l++] = ' '; str->s[str->l++] = '0'; str->s[str->l++] = '*'; str->s[str->l++] = ' ';
+        }
+        else if ( ptr[1]==4 ) /* 1/1 */
+        {
+            str->s[str->l++] = '1'; str->s[str->l++] = '*'; str->s[str->l++] = ' '; str->s[str->l++] = '1'; str->s[str->l++] = '*'; str->s[str->l++] = ' ';
+        }
+        else if ( bcf_gt_is_missing(ptr[1]) ) /* 1/. */
+        {
+            str->s[str->l++] = '?'; str->s[str->l++] = ' '; str->s[str->l++] = '?'; str->s[str->l++] = ' ';
+        }
+        else if ( bcf_gt_is_phased(ptr[1]) )    /* 1|x */
+        {
+            str->s[str->l++] = '1'; str->s[str->l++] = ' ';
+            kputw(bcf_gt_allele(ptr[1]),str);
+            str->s[str->l++] = ' ';
+        }
+        else /* 1/x */
+        {
+            str->s[str->l++] = '1'; str->s[str->l++] = '*'; str->s[str->l++] = ' ';
+            kputw(bcf_gt_allele(ptr[1]),str);
+            str->s[str->l++] = '*'; str->s[str->l++] = ' ';
+        }
     }
+    else if ( bcf_gt_is_missing(ptr[0]) )
+    {
+        str->s[str->l++] = '?'; str->s[str->l++] = ' '; str->s[str->l++] = '?'; str->s[str->l++] = ' ';
+    }
+    else if ( ptr[1]==bcf_int8_vector_end )
+    {
+        /* use REF for something else than first ALT */
+        str->s[str->l++] = '0'; str->s[str->l++] = ' '; str->s[str->l++] = '0'; str->s[str->l++] = ' ';
+    }
+    else
+    {
+        kputw(bcf_gt_allele(ptr[0]),str);
+        if ( bcf_gt_is_phased(ptr[1]) ) str->s[str->l++] = '*';
+        str->s[str->l++] = ' ';
+        kputw(bcf_gt_allele(ptr[1]),str);
+        if ( bcf_gt_is_phased(ptr[1]) ) str->s[str->l++] = '*';
+        str->s[str->l++] = ' ';
+    }
+}
+
+// The output of the most common genotypes, made only of the alleles 0 and 1,
+// missing values and vector_end, is precomputed by gt_to_hap or gt_to_hap2
+// and copied with a single memcpy. The table is indexed by the codes of the
+// two GT bytes, entries of zero length fall back to the generic code.
+#define HAP_LUT_N  8
+#define HAP_LUT_NA 7
+typedef struct
+{
+    uint8_t code[256];      // GT byte to the table code, HAP_LUT_NA if not tabulated
+    uint8_t len[HAP_LUT_N*HAP_LUT_N];
+    char hap[HAP_LUT_N*HAP_LUT_N][8];
+}
+hap_lut_t;
+
+static hap_lut_t *init_hap_lut(void (*gt_to_hap_func)(int8_t *, kstring_t *))
+{
+    static const int8_t vals[] = { 0, 1, 2, 3, 4, 5, bcf_int8_vector_end };
+    int i, j, nvals = sizeof(vals)/sizeof(*vals);
+    hap_lut_t *lut = (hap_lut_t*) calloc(1, sizeof(hap_lut_t));
+    memset(lut->code, HAP_LUT_NA, sizeof(lut->code));
+    for (i=0; i<nvals; i++) lut->code[(uint8_t)vals[i]] = i;
+
+    kstring_t str = {0,0,0};
+    ks_resize(&str, 16);
+    for (i=0; i<nvals; i++)
+        for (j=0; j<nvals; j++)
+        {
+            int8_t gt[2] = { vals[i], vals[j] };
+            str.l = 0;
+            gt_to_hap_func(gt, &str);
+            assert( str.l <= 8 );
+            lut->len[i*HAP_LUT_N+j] = str.l;
+            memcpy(lut->hap[i*HAP_LUT_N+j], str.s, str.l);
+        }
+    free(str.s);
+    return lut;
 }
 
 static void process_gt_to_hap(convert_t *convert, bcf1_t *line, fmt_t *fmt, int isample, kstring_t *str)
@@ -733,119 +1030,31 @@ static void process_gt_to_hap(convert_t *convert, bcf1_t *line, fmt_t *fmt, int
     // Alloc all memory in advance to avoid kput routines. The biggest allowed allele index is 99
     if ( line->n_allele > 100 )
         error("Too many alleles (%d) at %s:%d\n", line->n_allele, bcf_seqname(convert->header, line), line->pos+1);
-    if ( ks_resize(str, str->l+convert->nsamples*8) != 0 )
-        error("Could not alloc %d bytes\n", str->l + convert->nsamples*8);
+    if ( ks_resize(str, str->l+convert->nsamples*8+8) != 0 )
+        error("Could not alloc %d bytes\n", str->l + convert->nsamples*8+8);
 
     if ( fmt_gt->type!=BCF_BT_INT8 )    // todo: use BRANCH_INT if the VCF is valid
         error("Uh, too many alleles (%d) or redundant BCF representation at %s:%d\n", line->n_allele, bcf_seqname(convert->header, line), line->pos+1);
 
+    if ( !fmt->usr )
+    {
+        fmt->usr = init_hap_lut(gt_to_hap);
+        fmt->destroy = free;
+    }
+    hap_lut_t *lut = (hap_lut_t*) fmt->usr;
+
     int8_t *ptr = ((int8_t*) fmt_gt->p) - fmt_gt->n;
     for (i=0; i<convert->nsamples; i++)
     {
         ptr += fmt_gt->n;
-        if ( ptr[0]==2 )
-        {
-            if ( ptr[1]==3 ) /* 0|0 */
-            {
-                str->s[str->l++] = '0'; str->s[str->l++] = ' '; str->s[str->l++] = '0'; str->s[str->l++] = ' ';
-            }
-            else if ( ptr[1]==5 ) /* 0|1 */
-            {
-                str->s[str->l++] = '0'; str->s[str->l++] = ' '; str->s[str->l++] = '1'; str->s[str->l++] = ' ';
-            }
-            else if ( ptr[1]==bcf_int8_vector_end ) /* 0 */
-            {
-                str->s[str->l++] = '0'; str->s[str->l++] = ' '; str->s[str->l++] = '-'; str->s[str->l++] = ' ';
-            }
-            else if ( ptr[1]==2 ) /* 0/0 */
-            {
-                str->s[str->l++] = '0'; str->s[str->l++] = '*'; str->s[str->l++] = ' '; str->s[str->l++] = '0'; str->s[str->l++] = '*'; str->s[str->l++] = ' ';
-            }
-            else if ( ptr[1]==4 ) /* 0/1 */
-            {
-                str->s[str->l++] = '0'; str->s[str->l++] = '*'; str->s[str->l++] = ' '; str->s[str->l++] = '1'; str->s[str->l++] = '*'; str->s[str->l++] = ' ';
-            }
-            else if ( bcf_gt_is_missing(ptr[1]) ) /* 0/. */
-            {
-                str->s[str->l++] = '?'; str->s[str->l++] = ' '; str->s[str->l++] = '?'; str->s[str->l++] = ' ';
-            }
-            else if ( bcf_gt_is_phased(ptr[1]) ) /* 0|x */
-            {
-                str->s[str->l++] = '0'; str->s[str->l++] = ' ';
-                kputw(bcf_gt_allele(ptr[1]),str);
-                str->s[str->l++] = ' ';
-            }
-            else /* 0/x */
-            {
-                str->s[str->l++] = '0'; str->s[str->l++] = '*'; str->s[str->l++] = ' ';
-                kputw(bcf_gt_allele(ptr[1]),str);
-                str->s[str->l++] = '*'; str->s[str->l++] = ' ';
-            }
-        }
-        else if ( ptr[0]==4 )
-        {
-            if ( ptr[1]==3 ) /* 1|0 */
-            {
-                str->s[str->l++] = '1'; str->s[str->l++] = ' '; str->s[str->l++] = '0'; str->s[str->l++] = ' ';
-            }
-            else if ( ptr[1]==5 ) /* 1|1 */
-            {
-                str->s[str->l++] = '1'; str->s[str->l++] = ' '; str->s[str->l++] = '1'; str->s[str->l++] = ' ';
-            }
-            else if ( ptr[1]==bcf_int8_vector_end ) /* 1 */
-            {
-                str->s[str->l++] = '1'; str->s[str->l++] = ' '; str->s[str->l++] = '-'; str->s[str->l++] = ' ';
-            }
-            else if ( ptr[1]==2 ) /* 1/0 */
-            {
-                str->s[str->l++] = '1'; str->s[str->l++] = '*'; str->s[str->l++] = ' '; str->s[str->l++] = '0'; str->s[str->l++] = '*'; str->s[str->l++] = ' ';
-            }
-            else if ( ptr[1]==4 ) /* 1/1 */
-            {
-                str->s[str->l++] = '1'; str->s[str->l++] = '*'; str->s[str->l++] = ' '; str->s[str->l++] = '1'; str->s[str->l++] = '*'; str->s[str->l++] = ' ';
-            }
-            else if ( bcf_gt_is_missing(ptr[1]) ) /* 1/. */
-            {
-                str->s[str->l++] = '?'; str->s[str->l++] = ' '; str->s[str->l++] = '?'; str->s[str->l++] = ' ';
-            }
-            else if ( bcf_gt_is_phased(ptr[1]) )    /* 1|x */
-            {
-                str->s[str->l++] = '1'; str->s[str->l++] = ' ';
-                kputw(bcf_gt_allele(ptr[1]),str);
-                str->s[str->l++] = ' ';
-            }
-            else /* 1/x */
-            {
-                str->s[str->l++] = '1'; str->s[str->l++] = '*'; str->s[str->l++] = ' ';
-                kputw(bcf_gt_allele(ptr[1]),str);
-                str->s[str->l++] = '*'; str->s[str->l++] = ' ';
-            }
-        }
-        else if ( bcf_gt_is_missing(ptr[0]) )
+        int k = lut->code[(uint8_t)ptr[0]]*HAP_LUT_N + lut->code[(uint8_t)ptr[1]];
+        if ( lut->len[k] )
         {
-            if ( ptr[1]==bcf_int8_vector_end ) 
-            {
-                str->s[str->l++] = '?'; str->s[str->l++] = ' '; str->s[str->l++] = '-'; str->s[str->l++] = ' ';
-            }
-            else 
-            { 
-                str->s[str->l++] = '?'; str->s[str->l++] = ' '; str->s[str->l++] = '?'; str->s[str->l++] = ' ';
-            }
-        }
-        else if ( ptr[1]==bcf_int8_vector_end )
-        {
-            /* use REF for something else than first ALT */
-            str->s[str->l++] = '0'; str->s[str->l++] = ' '; str->s[str->l++] = '-'; str->s[str->l++] = ' ';
+            memcpy(str->s + str->l, lut->hap[k], 8);
+            str->l += lut->len[k];
         }
         else
-        {
-            kputw(bcf_gt_allele(ptr[0]),str);
-            if ( bcf_gt_is_phased(ptr[1]) ) str->s[str->l++] = '*';
-            str->s[str->l++] = ' ';
-            kputw(bcf_gt_allele(ptr[1]),str);
-            if ( bcf_gt_is_phased(ptr[1]) ) str->s[str->l++] = '*';
-            str->s[str->l++] = ' ';
-        }
+            gt_to_hap(ptr, str);
     }
     str->s[--str->l] = 0;     // delete the last space
 }
@@ -866,112 +1075,31 @@ static void process_gt_to_hap2(convert_t *convert, bcf1_t *line, fmt_t *fmt, int
     // Alloc all memory in advance to avoid kput routines. The biggest allowed allele index is 99
     if ( line->n_allele > 100 )
         error("Too many alleles (%d) at %s:%d\n", line->n_allele, bcf_seqname(convert->header, line), line->pos+1);
-    if ( ks_resize(str, str->l+convert->nsamples*8) != 0 )
-        error("Could not alloc %d bytes\n", str->l + convert->nsamples*8);
+    if ( ks_resize(str, str->l+convert->nsamples*8+8) != 0 )
+        error("Could not alloc %d bytes\n", str->l + convert->nsamples*8+8);
 
     if ( fmt_gt->type!=BCF_BT_INT8 )    // todo: use BRANCH_INT if the VCF is valid
         error("Uh, too many alleles (%d) or redundant BCF representation at %s:%d\n", line->n_allele, bcf_seqname(convert->header, line), line->pos+1);
 
+    if ( !fmt->usr )
+    {
+        fmt->usr = init_hap_lut(gt_to_hap2);
+        fmt->destroy = free;
+    }
+    hap_lut_t *lut = (hap_lut_t*) fmt->usr;
+
     int8_t *ptr = ((int8_t*) fmt_gt->p) - fmt_gt->n;
     for (i=0; i<convert->nsamples; i++)
     {
         ptr += fmt_gt->n;
-        if ( ptr[0]==2 )
-        {
-            if ( ptr[1]==3 ) /* 0|0 */
-            {
-                str->s[str->l++] = '0'; str->s[str->l++] = ' '; str->s[str->l++] = '0'; str->s[str->l++] = ' ';
-            }
-            else if ( ptr[1]==5 ) /* 0|1 */
-            {
-                str->s[str->l++] = '0'; str->s[str->l++] = ' '; str->s[str->l++] = '1'; str->s[str->l++] = ' ';
-            }
-            else if ( ptr[1]==bcf_int8_vector_end ) /* 0 -> 0|0 */
-            {
-                str->s[str->l++] = '0'; str->s[str->l++] = ' '; str->s[str->l++] = '0'; str->s[str->l++] = ' ';
-            }
-            else if ( ptr[1]==2 ) /* 0/0 */
-            {
-                str->s[str->l++] = '0'; str->s[str->l++] = '*'; str->s[str->l++] = ' '; str->s[str->l++] = '0'; str->s[str->l++] = '*'; str->s[str->l++] = ' ';
-            }
-            else if ( ptr[1]==4 ) /* 0/1 */
-            {
-                str->s[str->l++] = '0'; str->s[str->l++] = '*'; str->s[str->l++] = ' '; str->s[str->l++] = '1'; str->s[str->l++] = '*'; str->s[str->l++] = ' ';
-            }
-            else if ( bcf_gt_is_missing(ptr[1]) ) /* 0/. */
-            {
-                str->s[str->l++] = '?'; str->s[str->l++] = ' '; str->s[str->l++] = '?'; str->s[str->l++] = ' ';
-            }
-            else if ( bcf_gt_is_phased(ptr[1]) ) /* 0|x */
-            {
-                str->s[str->l++] = '0'; str->s[str->l++] = ' ';
-                kputw(bcf_gt_allele(ptr[1]),str);
-                str->s[str->l++] = ' ';
-            }
-            else /* 0/x */
-            {
-                str->s[str->l++] = '0'; str->s[str->l++] = '*'; str->s[str->l++] = ' ';
-                kputw(bcf_gt_allele(ptr[1]),str);
-                str->s[str->l++] = '*'; str->s[str->l++] = ' ';
-            }
-        }
-        else if ( ptr[0]==4 )
-        {
-            if ( ptr[1]==3 ) /* 1|0 */
-            {
-                str->s[str->l++] = '1'; str->s[str->l++] = ' '; str->s[str->l++] = '0'; str->s[str->l++] = ' ';
-            }
-            else if ( ptr[1]==5 ) /* 1|1 */
-            {
-                str->s[str->l++] = '1'; str->s[str->l++] = ' '; str->s[str->l++] = '1'; str->s[str->l++] = ' ';
-            }
-            else if ( ptr[1]==bcf_int8_vector_end ) /* 1 -> 1|1 */
-            {
-                str->s[str->l++] = '1'; str->s[str->l++] = ' '; str->s[str->l++] = '1'; str->s[str->l++] = ' ';
-            }
-            else if ( ptr[1]==2 ) /* 1/0 */
-            {
-                str->s[str->l++] = '1'; str->s[str->l++] = '*'; str->s[str->l++] = ' '; str->s[str->l++] = '0'; str->s[str->l++] = '*'; str->s[str->l++] = ' ';
-            }
-            else if ( ptr[1]==4 ) /* 1/1 */
-            {
-                str->s[str->l++] = '1'; str->s[str->l++] = '*'; str->s[str->l++] = ' '; str->s[str->l++] = '1'; str->s[str->l++] = '*'; str->s[str->l++] = ' ';
-            }
-            else if ( bcf_gt_is_missing(ptr[1]) ) /* 1/. */
-            {
-                str->s[str->l++] = '?'; str->s[str->l++] = ' '; str->s[str->l++] = '?'; str->s[str->l++] = ' ';
-            }
-            else if ( bcf_gt_is_phased(ptr[1]) )    /* 1|x */
-            {
-                str->s[str->l++] = '1'; str->s[str->l++] = ' ';
-                kputw(bcf_gt_allele(ptr[1]),str);
-                str->s[str->l++] = ' ';
-            }
-            else /* 1/x */
-            {
-                str->s[str->l++] = '1'; str->s[str->l++] = '*'; str->s[str->l++] = ' ';
-                kputw(bcf_gt_allele(ptr[1]),str);
-                str->s[str->l++] = '*'; str->s[str->l++] = ' ';
-            }
-        }
-        else if ( bcf_gt_is_missing(ptr[0]) )
-        {
-            str->s[str->l++] = '?'; str->s[str->l++] = ' '; str->s[str->l++] = '?'; str->s[str->l++] = ' ';
-        }
-        else if ( ptr[1]==bcf_int8_vector_end )
+        int k = lut->code[(uint8_t)ptr[0]]*HAP_LUT_N + lut->code[(uint8_t)ptr[1]];
+        if ( lut->len[k] )
         {
-            /* use REF for something else than first ALT */
-            str->s[str->l++] = '0'; str->s[str->l++] = ' '; str->s[str->l++] = '0'; str->s[str->l++] = ' ';
+            memcpy(str->s + str->l, lut->hap[k], 8);
+            str->l += lut->len[k];
         }
         else
-        {
-            kputw(bcf_gt_allele(ptr[0]),str);
-            if ( bcf_gt_is_phased(ptr[1]) ) str->s[str->l++] = '*';
-            str->s[str->l++] = ' ';
-            kputw(bcf_gt_allele(ptr[1]),str);
-            if ( bcf_gt_is_phased(ptr[1]) ) str->s[str->l++] = '*';
-            str->s[str->l++] = ' ';
-        }
+            gt_to_hap2(ptr, str);
     }
     str->s[--str->l] = 0;     // delete the last space
 }
@@ -991,6 +1119,9 @@ static fmt_t *register_tag(convert_t *convert, int type, char *key, int is_gtf)
     fmt->subscript = -1;
     fmt->usr     = NULL;
     fmt->destroy = NULL;
+    fmt->fmt     = NULL;
+    fmt->ready   = 0;
+    fmt->id      = -1;
 
     // Allow non-format tags, such as CHROM, INFO, etc., to appear amongst the format tags.
     if ( key )
@@ -1051,6 +1182,11 @@ static fmt_t *register_tag(convert_t *convert, int type, char *key, int is_gtf)
         case T_LINE: fmt->handler = &process_line; convert->max_unpack |= BCF_UN_FMT; break;
         default: error("TODO: handler for type %d\n", fmt->type);
     }
+    if ( key && (fmt->type==T_FORMAT || fmt->type==T_GT || fmt->type==T_TGT || fmt->type==T_IUPAC_GT || fmt->type==T_TBCSQ) )
+    {
+        fmt->id = bcf_hdr_id2int(convert->header, BCF_DT_ID, key);
+        if ( !bcf_hdr_idinfo_exists(convert->header,BCF_HL_FMT,fmt->id) ) fmt->id = -1;
+    }
     if ( key && fmt->type==T_INFO )
     {
         fmt->id = bcf_hdr_id2int(convert->header, BCF_DT_ID, key);
@@ -1186,6 +1322,41 @@ static char *parse_sep(convert_t *convert, char *p, int is_gtf)
     return q;
 }
 
+static void init_blocks(convert_t *convert)
+{
+    int i = 0;
+    while ( i<convert->nfmt )
+    {
+        if ( !convert->fmt[i].is_gt_field ) { i++; continue; }
+
+        convert->nblocks++;
+        convert->blocks = (gtblock_t*) realloc(convert->blocks, sizeof(gtblock_t)*convert->nblocks);
+        gtblock_t *blk = &convert->blocks[convert->nblocks-1];
+        memset(blk, 0, sizeof(*blk));
+        blk->beg = i;
+        blk->ifield = -1;
+        int nfield = 0;
+        while ( i<convert->nfmt && convert->fmt[i].is_gt_field )
+        {
+            fmt_t *fmt = &convert->fmt[i];
+            if ( fmt->type==T_SEP )
+            {
+                if ( fmt->key ) kputs(fmt->key, nfield ? &blk->post : &blk->pre);
+            }
+            else
+            {
+                nfield++;
+                blk->ifield = fmt->type==T_FORMAT || fmt->type==T_GT ? i : -2;
+            }
+            i++;
+        }
+        blk->end = i;
+        if ( nfield!=1 || blk->ifield<0 ) blk->ifield = -1;
+        if ( !blk->pre.s ) kputs("", &blk->pre);
+        if ( !blk->post.s ) kputs("", &blk->post);
+    }
+}
+
 convert_t *convert_init(bcf_hdr_t *hdr, int *samples, int nsamples, const char *format_str)
 {
     convert_t *convert = (convert_t*) calloc(1,sizeof(convert_t));
@@ -1208,6 +1379,7 @@ convert_t *convert_init(bcf_hdr_t *hdr, int *samples, int nsamples, const char *
     }
     if ( is_gtf )
         error("Could not parse the format string, missing the square bracket \"]\": %s\n", convert->format_str);
+    init_blocks(convert);
 
     if ( nsamples )
     {
@@ -1232,6 +1404,12 @@ void convert_destroy(convert_t *convert)
         if ( convert->fmt[i].destroy ) convert->fmt[i].destroy(convert->fmt[i].usr);
         free(convert->fmt[i].key);
     }
+    for (i=0; i<convert->nblocks; i++)
+    {
+        free(convert->blocks[i].pre.s);
+        free(convert->blocks[i].post.s);
+    }
+    free(convert->blocks);
     free(convert->fmt);
     free(convert->undef_info_tag);
     free(convert->dat);
@@ -1289,26 +1467,115 @@ int convert_header(convert_t *convert, kstring_t *str)
     return str->l - l_ori;
 }
 
+// Format all samples of a block with a single FORMAT field, the type checks are
+// done once per record rather than once per sample
+static void process_block(convert_t *convert, bcf1_t *line, gtblock_t *blk, kstring_t *str)
+{
+    fmt_t *fmt = &convert->fmt[blk->ifield];
+    bcf_fmt_t *bfmt = fmt->fmt;
+    const char *pre = blk->pre.s, *post = blk->post.s;
+    size_t npre = blk->pre.l, npost = blk->post.l;
+    int js, nsmpl = convert->nsamples, *smpl = convert->samples;
+
+    // an upper estimate for short values so that kput* calls below rarely reallocate
+    ks_resize(str, str->l + nsmpl*(npre + npost + 12) + 1);
+
+    if ( !bfmt )
+    {
+        for (js=0; js<nsmpl; js++)
+        {
+            kputsn(pre, npre, str);
+            kputc('.', str);
+            kputsn(post, npost, str);
+        }
+        return;
+    }
+    if ( fmt->type==T_GT )
+    {
+        for (js=0; js<nsmpl; js++)
+        {
+            kputsn(pre, npre, str);
+            bcf_format_gt(bfmt, smpl[js], str);
+            kputsn(post, npost, str);
+        }
+        return;
+    }
+    if ( bfmt->type==BCF_BT_CHAR || bfmt->type==BCF_BT_FLOAT || (fmt->subscript<0 && bfmt->n!=1) )
+    {
+        for (js=0; js<nsmpl; js++)
+        {
+            size_t l_start = str->l;
+            kputsn(pre, npre, str);
+            size_t l = str->l;
+            process_format(convert, line, fmt, smpl[js], str);
+            if ( l==str->l ) { str->l = l_start; continue; }    // empty strings trim the block, see convert_line()
+            kputsn(post, npost, str);
+        }
+        return;
+    }
+
+    // integer scalars or subscripted integer vectors
+    int idx = fmt->subscript>=0 ? fmt->subscript : 0;
+    if ( idx >= bfmt->n )
+    {
+        for (js=0; js<nsmpl; js++)
+        {
+            kputsn(pre, npre, str);
+            kputc('.', str);
+            kputsn(post, npost, str);
+        }
+        return;
+    }
+    #define BRANCH(type_t, missing, vector_end) { \
+        for (js=0; js<nsmpl; js++) \
+        { \
+            type_t val = ((type_t*)(bfmt->p + smpl[js]*bfmt->size))[idx]; \
+            kputsn(pre, npre, str); \
+            if ( val==missing || val==vector_end ) kputc('.', str); \
+            else kputw(val, str); \
+            kputsn(post, npost, str); \
+        } \
+    }
+    switch (bfmt->type)
+    {
+        case BCF_BT_INT8:  BRANCH(int8_t,  bcf_int8_missing,  bcf_int8_vector_end); break;
+        case BCF_BT_INT16: BRANCH(int16_t, bcf_int16_missing, bcf_int16_vector_end); break;
+        case BCF_BT_INT32: BRANCH(int32_t, bcf_int32_missing, bcf_int32_vector_end); break;
+        default: error("Unexpected type %d\n", bfmt->type);
+    }
+    #undef BRANCH
+}
+
 int convert_line(convert_t *convert, bcf1_t *line, kstring_t *str)
 {
     if ( !convert->allow_undef_tags && convert->undef_info_tag )
         error("Error: no such tag defined in the VCF header: INFO/%s. FORMAT fields must be in square brackets, e.g. \"[ %s]\"\n", convert->undef_info_tag,convert->undef_info_tag);
 
+    uint64_t prof_start = profile_start();
     int l_ori = str->l;
     bcf_unpack(line, convert->max_unpack);
 
-    int i, ir;
+    int i, ir, iblk = 0;
     str->l = 0;
+    if ( convert->max_len ) ks_resize(str, convert->max_len);
     for (i=0; i<convert->nfmt; i++)
     {
         // Genotype fields. 
         if ( convert->fmt[i].is_gt_field )
         {
-            int j = i, js, k;
-            while ( j<convert->nfmt && convert->fmt[j].is_gt_field )
+            gtblock_t *blk = &convert->blocks[iblk++];
+            int j = blk->end, js, k;
+            for (k=i; k<j; k++)
+            {
+                fmt_t *fmt = &convert->fmt[k];
+                fmt->ready = 0;
+                if ( convert->nsamples && (fmt->type==T_FORMAT || fmt->type==T_GT || fmt->type==T_TGT) ) init_format(convert, line, fmt);
+            }
+            if ( blk->ifield>=0 )
             {
-                convert->fmt[j].ready = 0;
-                j++;
+                process_block(convert, line, blk, str);
+                i = j-1;
+                continue;
             }
             for (js=0; js<convert->nsamples; js++)
             {
@@ -1348,6 +1615,8 @@ int convert_line(convert_t *convert, bcf1_t *line, kstring_t *str)
             convert->fmt[i].handler(convert, line, &convert->fmt[i], -1, str);
 
     }
+    if ( convert->max_len < str->l + 1 ) convert->max_len = str->l + 1;
+    profile_stop(PROF_CONVERT, prof_start);
     return str->l - l_ori;
 }
 
@@ -1374,3 +1643,18 @@ int convert_max_unpack(convert_t *convert)
     return convert->max_unpack;
 }
 
+int convert_gt_only(convert_t *convert)
+{
+    int i;
+    for (i=0; i<convert->nfmt; i++)
+    {
+        switch (convert->fmt[i].type)
+        {
+            case T_CHROM: case T_POS: case T_POS0: case T_END: case T_END0:
+            case T_SAMPLE: case T_SEP: case T_GT: break;
+            default: return 0;
+        }
+    }
+    return 1;
+}
+
@@ -40,5 +40,11 @@ int convert_header(convert_t *convert, kstring_t *str);
 int convert_line(convert_t *convert, bcf1_t *rec, kstring_t *str);
 int convert_max_unpack(convert_t *convert);
 
+/*
+ *  convert_gt_only() - returns 1 if the format needs only CHROM, POS, END and
+ *  FORMAT/GT, so that the records can come from the genotype index, see gtidx.h
+ */
+int convert_gt_only(convert_t *convert);
+
 #endif
 
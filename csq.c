@@ -140,6 +140,10 @@
 #include <htslib/khash_str2int.h>
 #include <htslib/kseq.h>
 #include <htslib/faidx.h>
+#include <htslib/bgzf.h>
+#include <htslib/tbx.h>
+#include <htslib/hfile.h>
+#include <htslib/thread_pool.h>
 #include <errno.h>
 #include <unistd.h>
 #include <stdint.h>
@@ -150,6 +154,8 @@
 #include "kheap.h"
 #include "smpl_ilist.h"
 #include "rbuf.h"
+#include "refseq.h"
+#include "tmpdir.h"
 
 #ifndef __FUNCTION__
 #  define __FUNCTION__ __func__
@@ -400,11 +406,21 @@ struct _vcsq_t
     kstring_t vstr;     // variant string, eg 5TY>5I|121ACG>A+124TA>T
 };
 typedef struct
+{
+    int32_t key;        // sample index * nsparse_bcsq + the bitmask word
+    int32_t mask;       // 31 bits per word, the sign bit would clash with the missing and vector_end values
+}
+smpl_csq_t;
+KHASH_MAP_INIT_INT(smpl2csq, int)
+typedef struct
 {
     bcf1_t *line;
     uint32_t *smpl;     // bitmask of sample consequences with first/second haplotype interleaved
     uint32_t nfmt:4, nvcsq:28, mvcsq;
     vcsq_t *vcsq;       // there can be multiple consequences for a single VCF record
+    smpl_csq_t *csmpl;  // with --sparse-BCSQ, the non-zero words of smpl, carriers only
+    int ncsmpl, mcsmpl;
+    khash_t(smpl2csq) *smpl2csq;    // csmpl index of the key
 }
 vrec_t;
 typedef struct
@@ -442,6 +458,7 @@ struct _hap_node_t
 {
     char *seq;          // cds segment [parent_node,this_node)
     char *var;          // variant "ref>alt"
+    size_t mseq, mvar;  // allocated sizes of seq and var, kept when the node is recycled
     uint32_t type:2,    // HAP_ROOT or HAP_CDS
              csq:30;    // this node's consequence
     int dlen;           // alt minus ref length: <0 del, >0 ins, 0 substitution
@@ -498,6 +515,8 @@ typedef struct
     kstring_t tref;     // the variable part of translated reference transcript, coding strand
     uint32_t sbeg;      // stack's sbeg, for cases first node's type is HAP_SSS
     int upstream_stop;
+    hap_node_t **pool;  // released nodes, with their buffers, for reuse by hap_node_new
+    int npool, mpool;
 }
 hap_t;
 
@@ -575,9 +594,15 @@ typedef struct _args_t
 
     char *outdir, **argv, *fa_fname, *gff_fname, *output_fname;
     char *bcsq_tag;
-    int argc, output_type;
+    char *tmp_dir, *cache_fname;
+    int argc, output_type, n_threads, build_cache;
     int phase, quiet, local_csq;
     int ncsq_max, nfmt_bcsq;    // maximum number of csq per site that can be accessed from FORMAT/BCSQ
+    int nsparse_bcsq;           // number of 31-bit words per sample in INFO/<bcsq_tag>_SMPL
+    int sparse_bcsq;            // write INFO/<bcsq_tag>_SMPL with carriers only instead of FORMAT/BCSQ
+    char *sparse_tag;
+    int32_t *sparse_arr;
+    int msparse_arr;
     int ncsq_small_warned;
     
     int rid;                    // current chromosome
@@ -592,11 +617,22 @@ typedef struct _args_t
     int ncsq_buf, mcsq_buf;
 
     faidx_t *fai;
+    refseq_t *ref;
     kstring_t str, str2;
     int32_t *gt_arr, mgt_arr;
 }
 args_t;
 
+// With --threads, each chromosome is annotated by a worker thread into a temporary
+// file, using its own reader, reference and a private copy of the arguments
+typedef struct
+{
+    args_t args;
+    const char *chr;
+    char *fname;
+}
+chunk_t;
+
 // AAA, AAC, ...
 const char *gencode = "KNKNTTTTRSRSIIMIQHQHPPPPRRRRLLLLEDEDAAAAGGGGVVVV*Y*YSSSS*CWCLFLF";
 const uint8_t nt4[] =
@@ -1197,6 +1233,229 @@ void tscript_init_cds(args_t *args)
 void regidx_free_gf(void *payload) { free(*((gf_cds_t**)payload)); }
 void regidx_free_tscript(void *payload) { tscript_t *tr = *((tscript_t**)payload); free(tr->cds); free(tr); }
 
+/*
+    Binary cache of the parsed GFF3 annotation, see --build-cache and --cache.
+    The file stores the final transcripts with their trimmed CDS and the exon and
+    UTR features, in the order they are pushed to the indexes, so that the
+    lookups work exactly as if the GFF3 was parsed.
+*/
+#define CSQ_CACHE_MAGIC   "BCSQ"
+#define CSQ_CACHE_VERSION 1
+KHASH_MAP_INIT_INT64(ptr2int, int)
+
+static inline void cache_write(args_t *args, BGZF *fp, const void *dat, size_t len)
+{
+    if ( bgzf_write(fp, dat, len)!=len ) error("Failed to write %s\n", args->cache_fname);
+}
+static inline void cache_write_u32(args_t *args, BGZF *fp, uint32_t val)
+{
+    cache_write(args, fp, &val, sizeof(val));
+}
+static inline void cache_write_str(args_t *args, BGZF *fp, const char *str)
+{
+    uint32_t len = str ? strlen(str) : 0;
+    cache_write_u32(args, fp, len);
+    if ( len ) cache_write(args, fp, str, len);
+}
+static inline void cache_read(args_t *args, BGZF *fp, void *dat, size_t len)
+{
+    if ( bgzf_read(fp, dat, len)!=len ) error("Failed to read %s, truncated cache file?\n", args->cache_fname);
+}
+static inline uint32_t cache_read_u32(args_t *args, BGZF *fp)
+{
+    uint32_t val;
+    cache_read(args, fp, &val, sizeof(val));
+    return val;
+}
+static inline char *cache_read_str(args_t *args, BGZF *fp)
+{
+    uint32_t len = cache_read_u32(args, fp);
+    if ( !len ) return NULL;
+    char *str = (char*) malloc(len+1);
+    cache_read(args, fp, str, len);
+    str[len] = 0;
+    return str;
+}
+
+// Called from init_gff() after the transcripts are finalized and while the
+// temporary structures still exist
+static void write_gff_cache(args_t *args)
+{
+    aux_t *aux = &args->init;
+    BGZF *fp = bgzf_open(args->cache_fname, "w");
+    if ( !fp ) error("Failed to open %s: %s\n", args->cache_fname, strerror(errno));
+
+    cache_write(args, fp, CSQ_CACHE_MAGIC, 4);
+    cache_write_u32(args, fp, CSQ_CACHE_VERSION);
+    cache_write_str(args, fp, ENSID_FMT);
+
+    int i, ret;
+    cache_write_u32(args, fp, aux->nseq);
+    for (i=0; i<aux->nseq; i++) cache_write_str(args, fp, aux->seq[i]);
+
+    khint_t k;
+    khash_t(ptr2int) *gene2idx = kh_init(ptr2int);
+    for (k=0; k<kh_end(aux->gid2gene); k++)
+    {
+        if ( !kh_exist(aux->gid2gene, k) ) continue;
+        gf_gene_t *gene = kh_val(aux->gid2gene, k);
+        if ( !gene->name ) continue;
+        khint_t j = kh_put(ptr2int, gene2idx, (uint64_t)(uintptr_t)gene, &ret);
+        kh_val(gene2idx, j) = kh_size(gene2idx) - 1;
+    }
+    cache_write_u32(args, fp, kh_size(gene2idx));
+    for (k=0; k<kh_end(gene2idx); k++)
+    {
+        if ( !kh_exist(gene2idx, k) ) continue;
+        gf_gene_t *gene = (gf_gene_t*)(uintptr_t) kh_key(gene2idx, k);
+        cache_write_u32(args, fp, kh_val(gene2idx, k));
+        cache_write_u32(args, fp, gene->iseq);
+        cache_write_str(args, fp, gene->name);
+    }
+
+    cache_write_u32(args, fp, kh_size(aux->id2tr));
+    for (k=0; k<kh_end(aux->id2tr); k++)
+    {
+        if ( !kh_exist(aux->id2tr, k) ) continue;
+        tscript_t *tr = kh_val(aux->id2tr, k);
+        khint_t j = kh_get(ptr2int, gene2idx, (uint64_t)(uintptr_t)tr->gene);
+        assert( j!=kh_end(gene2idx) );
+        uint32_t dat[] = { tr->id, tr->beg, tr->end, tr->strand, tr->trim, tr->type, kh_val(gene2idx, j), tr->ncds };
+        cache_write(args, fp, dat, sizeof(dat));
+        for (i=0; i<tr->ncds; i++)
+        {
+            gf_cds_t *cds = tr->cds[i];
+            uint32_t dat[] = { cds->beg, cds->pos, cds->len, cds->icds, cds->phase };
+            cache_write(args, fp, dat, sizeof(dat));
+        }
+    }
+    kh_destroy(ptr2int, gene2idx);
+
+    int nftr = 0;
+    for (i=0; i<aux->nftr; i++)
+        if ( aux->ftr[i].type!=GF_CDS && kh_get(int2tscript, aux->id2tr, (int)aux->ftr[i].trid)!=kh_end(aux->id2tr) ) nftr++;
+    cache_write_u32(args, fp, nftr);
+    for (i=0; i<aux->nftr; i++)
+    {
+        ftr_t *ftr = &aux->ftr[i];
+        if ( ftr->type==GF_CDS || kh_get(int2tscript, aux->id2tr, (int)ftr->trid)==kh_end(aux->id2tr) ) continue;
+        uint32_t dat[] = { ftr->type, ftr->trid, ftr->beg, ftr->end };
+        cache_write(args, fp, dat, sizeof(dat));
+    }
+    if ( bgzf_close(fp)!=0 ) error("Close failed: %s\n", args->cache_fname);
+}
+
+// Fills the same structures as init_gff() without parsing the GFF3
+static void init_gff_cache(args_t *args)
+{
+    aux_t *aux = &args->init;
+    BGZF *fp = bgzf_open(args->cache_fname, "r");
+    if ( !fp ) error("Failed to read %s: %s\n", args->cache_fname, strerror(errno));
+
+    char magic[4];
+    cache_read(args, fp, magic, 4);
+    if ( memcmp(magic, CSQ_CACHE_MAGIC, 4) ) error("Not a bcftools csq cache file: %s\n", args->cache_fname);
+    uint32_t version = cache_read_u32(args, fp);
+    if ( version!=CSQ_CACHE_VERSION ) error("Unsupported version of the cache file %s, please rebuild with --build-cache\n", args->cache_fname);
+    ENSID_FMT = cache_read_str(args, fp);
+
+    int i, j, ret;
+    aux->nseq = aux->mseq = cache_read_u32(args, fp);
+    aux->seq  = (char**) malloc(sizeof(char*)*aux->nseq);
+    for (i=0; i<aux->nseq; i++) aux->seq[i] = cache_read_str(args, fp);
+
+    // the genes are kept only to destroy them at the end, the key is arbitrary
+    aux->gid2gene = kh_init(int2gene);
+    int ngene = cache_read_u32(args, fp);
+    gf_gene_t **genes = (gf_gene_t**) malloc(sizeof(gf_gene_t*)*ngene);
+    for (i=0; i<ngene; i++)
+    {
+        uint32_t igene = cache_read_u32(args, fp);
+        if ( igene>=ngene ) error("Corrupted cache file: %s\n", args->cache_fname);
+        gf_gene_t *gene = genes[igene] = (gf_gene_t*) calloc(1,sizeof(gf_gene_t));
+        gene->iseq = cache_read_u32(args, fp);
+        gene->name = cache_read_str(args, fp);
+        khint_t k = kh_put(int2gene, aux->gid2gene, (int)igene, &ret);
+        kh_val(aux->gid2gene,k) = gene;
+    }
+
+    aux->id2tr = kh_init(int2tscript);
+    args->idx_tscript = regidx_init(NULL, NULL, regidx_free_tscript, sizeof(tscript_t*), NULL);
+    args->idx_cds  = regidx_init(NULL, NULL, regidx_free_gf, sizeof(gf_cds_t*), NULL);
+    args->idx_utr  = regidx_init(NULL, NULL, regidx_free_gf, sizeof(gf_utr_t*), NULL);
+    args->idx_exon = regidx_init(NULL, NULL, regidx_free_gf, sizeof(gf_exon_t*), NULL);
+    args->itr      = regitr_init(NULL);
+    regitr_set_sorted(args->itr,1);     // the VCF positions come sorted
+
+    int ntr = cache_read_u32(args, fp);
+    for (i=0; i<ntr; i++)
+    {
+        uint32_t dat[8];
+        cache_read(args, fp, dat, sizeof(dat));
+        if ( dat[6]>=ngene ) error("Corrupted cache file: %s\n", args->cache_fname);
+        tscript_t *tr = (tscript_t*) calloc(1,sizeof(tscript_t));
+        tr->id     = dat[0];
+        tr->beg    = dat[1];
+        tr->end    = dat[2];
+        tr->strand = dat[3];
+        tr->trim   = dat[4];
+        tr->type   = dat[5];
+        tr->gene   = genes[dat[6]];
+        tr->ncds   = tr->mcds = dat[7];
+        tr->cds    = tr->ncds ? (gf_cds_t**) malloc(sizeof(gf_cds_t*)*tr->ncds) : NULL;
+        khint_t k = kh_put(int2tscript, aux->id2tr, (int)tr->id, &ret);
+        kh_val(aux->id2tr,k) = tr;
+
+        char *chr_beg, *chr_end;
+        chr_beg_end(aux, tr->gene->iseq, &chr_beg, &chr_end);
+        regidx_push(args->idx_tscript, chr_beg, chr_end, tr->beg, tr->end, &tr);
+        for (j=0; j<tr->ncds; j++)
+        {
+            uint32_t dat[5];
+            cache_read(args, fp, dat, sizeof(dat));
+            gf_cds_t *cds = tr->cds[j] = (gf_cds_t*) malloc(sizeof(gf_cds_t));
+            cds->tr    = tr;
+            cds->beg   = dat[0];
+            cds->pos   = dat[1];
+            cds->len   = dat[2];
+            cds->icds  = dat[3];
+            cds->phase = dat[4];
+            regidx_push(args->idx_cds, chr_beg,chr_end, cds->beg,cds->beg+cds->len-1, &tr->cds[j]);
+        }
+    }
+    free(genes);
+
+    int nftr = cache_read_u32(args, fp);
+    for (i=0; i<nftr; i++)
+    {
+        uint32_t dat[4];
+        cache_read(args, fp, dat, sizeof(dat));
+        ftr_t ftr;
+        memset(&ftr, 0, sizeof(ftr));
+        ftr.type = dat[0];
+        ftr.trid = dat[1];
+        ftr.beg  = dat[2];
+        ftr.end  = dat[3];
+        if ( kh_get(int2tscript, aux->id2tr, (int)ftr.trid)==kh_end(aux->id2tr) ) error("Corrupted cache file: %s\n", args->cache_fname);
+        if ( ftr.type==GF_EXON ) register_exon(args, &ftr);
+        else register_utr(args, &ftr);
+    }
+    if ( bgzf_close(fp)!=0 ) error("Close failed: %s\n", args->cache_fname);
+
+    if ( !args->quiet )
+    {
+        fprintf(stderr,"Indexed %d transcripts, %d exons, %d CDSs, %d UTRs\n", 
+                regidx_nregs(args->idx_tscript),
+                regidx_nregs(args->idx_exon),
+                regidx_nregs(args->idx_cds),
+                regidx_nregs(args->idx_utr));
+    }
+
+    kh_destroy(int2tscript,aux->id2tr);
+    for (i=0; i<aux->nseq; i++) free(aux->seq[i]);
+    free(aux->seq);
+}
+
 void init_gff(args_t *args)
 {
     aux_t *aux = &args->init;
@@ -1225,6 +1484,7 @@ void init_gff(args_t *args)
     args->idx_utr  = regidx_init(NULL, NULL, regidx_free_gf, sizeof(gf_utr_t*), NULL);
     args->idx_exon = regidx_init(NULL, NULL, regidx_free_gf, sizeof(gf_exon_t*), NULL);
     args->itr      = regitr_init(NULL);
+    regitr_set_sorted(args->itr,1);     // the VCF positions come sorted
 
     int i;
     for (i=0; i<aux->nftr; i++)
@@ -1255,6 +1515,7 @@ void init_gff(args_t *args)
             error("something: %s\t%d\t%d\t%s\t%s\n", aux->seq[ftr->iseq],ftr->beg+1,ftr->end+1,ENSID(ftr->trid),gf_type2gff_string(ftr->type));
     }
     tscript_init_cds(args);
+    if ( args->build_cache ) write_gff_cache(args);
 
     if ( !args->quiet )
     {
@@ -1284,13 +1545,9 @@ void init_gff(args_t *args)
     khash_str2int_destroy_free(aux->ignored_biotypes);
 }
 
-void init_data(args_t *args)
+// Per-reader state, the annotation structures are shared
+static void init_state(args_t *args)
 {
-    args->nfmt_bcsq = 1 + (args->ncsq_max - 1) / 32; 
-
-    if ( !args->quiet ) fprintf(stderr,"Parsing %s ...\n", args->gff_fname);
-    init_gff(args);
-
     args->rid = -1;
 
     if ( args->filter_str )
@@ -1298,10 +1555,39 @@ void init_data(args_t *args)
 
     args->fai = fai_load(args->fa_fname);
     if ( !args->fai ) error("Failed to load the fai index: %s\n", args->fa_fname);
+    args->ref = refseq_init(args->fai, 0);
 
     args->pos2vbuf  = kh_init(pos2vbuf);
     args->active_tr = khp_init(trhp);
     args->hap = (hap_t*) calloc(1,sizeof(hap_t));
+}
+
+static void init_bcsq_hdr(args_t *args)
+{
+    bcf_hdr_printf(args->hdr,"##INFO=<ID=%s,Number=.,Type=String,Description=\"%s consequence annotation from BCFtools/csq. Format: '[*]consequence|gene|transcript|biotype[|strand|amino_acid_change|dna_change]' or, for consequences of variants split across multiple sites, a pointer to the record storing the consequences '@position'. '*' prefix indicates a consequence downstream from a stop \">",args->bcsq_tag, args->local_csq ? "Local" : "Haplotype-aware");
+    if ( args->hdr_nsmpl && args->sparse_bcsq )
+        bcf_hdr_printf(args->hdr,"##INFO=<ID=%s,Number=.,Type=Integer,Description=\"Samples with consequences in INFO/%s, as pairs of the 0-based sample index and the bitmask of indexes to INFO/%s with interleaved first/second haplotype, 31 bits per integer. When --ncsq is bigger than 15, the index is sample*%d+word and the word-th integer holds the 31 consequence bits starting at word*31\">",args->sparse_tag,args->bcsq_tag,args->bcsq_tag,args->nsparse_bcsq);
+    else if ( args->hdr_nsmpl ) 
+        bcf_hdr_printf(args->hdr,"##FORMAT=<ID=%s,Number=.,Type=Integer,Description=\"Bitmask of indexes to INFO/BCSQ, with interleaved first/second haplotype. Use \\\"bcftools query -f'[%%CHROM\\t%%POS\\t%%SAMPLE\\t%%TBCSQ\\n]'\\\" to translate.\">",args->bcsq_tag);
+}
+
+void init_data(args_t *args)
+{
+    args->nfmt_bcsq = 1 + (args->ncsq_max - 1) / 32; 
+    args->nsparse_bcsq = 1 + (args->ncsq_max - 1) / 31;
+
+    if ( args->cache_fname )
+    {
+        if ( !args->quiet ) fprintf(stderr,"Loading %s ...\n", args->cache_fname);
+        init_gff_cache(args);
+    }
+    else
+    {
+        if ( !args->quiet ) fprintf(stderr,"Parsing %s ...\n", args->gff_fname);
+        init_gff(args);
+    }
+
+    if ( !args->n_threads ) init_state(args);
 
     // init samples
     if ( !bcf_hdr_nsamples(args->hdr) ) args->phase = PHASE_DROP_GT;
@@ -1343,45 +1629,24 @@ void init_data(args_t *args)
     {
         args->out_fh = hts_open(args->output_fname? args->output_fname : "-",hts_bcf_wmode(args->output_type));
         if ( args->out_fh == NULL ) error("Can't write to %s: %s\n", args->output_fname? args->output_fname : "standard output", strerror(errno));
+        if ( args->n_threads ) hts_set_opt(args->out_fh, HTS_OPT_THREAD_POOL, args->sr->p);
         bcf_hdr_append_version(args->hdr,args->argc,args->argv,"bcftools/csq");
-        bcf_hdr_printf(args->hdr,"##INFO=<ID=%s,Number=.,Type=String,Description=\"%s consequence annotation from BCFtools/csq. Format: '[*]consequence|gene|transcript|biotype[|strand|amino_acid_change|dna_change]' or, for consequences of variants split across multiple sites, a pointer to the record storing the consequences '@position'. '*' prefix indicates a consequence downstream from a stop \">",args->bcsq_tag, args->local_csq ? "Local" : "Haplotype-aware");
-        if ( args->hdr_nsmpl ) 
-            bcf_hdr_printf(args->hdr,"##FORMAT=<ID=%s,Number=.,Type=Integer,Description=\"Bitmask of indexes to INFO/BCSQ, with interleaved first/second haplotype. Use \\\"bcftools query -f'[%%CHROM\\t%%POS\\t%%SAMPLE\\t%%TBCSQ\\n]'\\\" to translate.\">",args->bcsq_tag);
+        init_bcsq_hdr(args);
         bcf_hdr_write(args->out_fh, args->hdr);
     }
     if ( !args->quiet ) fprintf(stderr,"Calling...\n");
 }
 
-void destroy_data(args_t *args)
-{
-    regidx_destroy(args->idx_cds);
-    regidx_destroy(args->idx_utr);
-    regidx_destroy(args->idx_exon);
-    regidx_destroy(args->idx_tscript);
-    regitr_destroy(args->itr);
-
-    khint_t k,i,j;
-    for (k=0; k<kh_end(args->init.gid2gene); k++)
-    {
-        if ( !kh_exist(args->init.gid2gene, k) ) continue;
-        gf_gene_t *gene = (gf_gene_t*) kh_val(args->init.gid2gene, k);
-        free(gene->name);
-        free(gene);
-    }
-    kh_destroy(int2gene,args->init.gid2gene);
+void hap_node_free(hap_node_t *hap);
 
+static void destroy_state(args_t *args)
+{
+    int i,j;
     if ( args->filter )
         filter_destroy(args->filter);
 
     khp_destroy(trhp,args->active_tr);
     kh_destroy(pos2vbuf,args->pos2vbuf);
-    if ( args->smpl ) smpl_ilist_destroy(args->smpl);
-    int ret;
-    if ( args->out_fh )
-        ret = hts_close(args->out_fh);
-    else
-        ret = fclose(args->out);
-    if ( ret ) error("Error: close failed .. %s\n", args->output_fname?args->output_fname:"stdout");
     for (i=0; i<args->vcf_rbuf.m; i++)
     {
         vbuf_t *vbuf = args->vcf_buf[i];
@@ -1391,6 +1656,8 @@ void destroy_data(args_t *args)
             if ( !vbuf->vrec[j] ) continue;
             if ( vbuf->vrec[j]->line ) bcf_destroy(vbuf->vrec[j]->line);
             free(vbuf->vrec[j]->smpl);
+            free(vbuf->vrec[j]->csmpl);
+            if ( vbuf->vrec[j]->smpl2csq ) kh_destroy(smpl2csq, vbuf->vrec[j]->smpl2csq);
             free(vbuf->vrec[j]->vcsq);
             free(vbuf->vrec[j]);
         }
@@ -1400,18 +1667,54 @@ void destroy_data(args_t *args)
     free(args->vcf_buf);
     free(args->rm_tr);
     free(args->csq_buf);
+    free(args->sparse_arr);
+    for (i=0; i<args->hap->npool; i++) hap_node_free(args->hap->pool[i]);
+    free(args->hap->pool);
     free(args->hap->stack);
     free(args->hap->sseq.s);
     free(args->hap->tseq.s);
     free(args->hap->tref.s);
     free(args->hap);
+    refseq_destroy(args->ref);
     fai_destroy(args->fai);
     free(args->gt_arr);
     free(args->str.s);
     free(args->str2.s);
+}
+
+static void destroy_gff(args_t *args)
+{
+    regidx_destroy(args->idx_cds);
+    regidx_destroy(args->idx_utr);
+    regidx_destroy(args->idx_exon);
+    regidx_destroy(args->idx_tscript);
+    regitr_destroy(args->itr);
+
+    khint_t k;
+    for (k=0; k<kh_end(args->init.gid2gene); k++)
+    {
+        if ( !kh_exist(args->init.gid2gene, k) ) continue;
+        gf_gene_t *gene = (gf_gene_t*) kh_val(args->init.gid2gene, k);
+        free(gene->name);
+        free(gene);
+    }
+    kh_destroy(int2gene,args->init.gid2gene);
     free(ENSID_FMT);
 }
 
+void destroy_data(args_t *args)
+{
+    destroy_gff(args);
+    if ( args->hap ) destroy_state(args);
+    if ( args->smpl ) smpl_ilist_destroy(args->smpl);
+    int ret;
+    if ( args->out_fh )
+        ret = hts_close(args->out_fh);
+    else
+        ret = fclose(args->out);
+    if ( ret ) error("Error: close failed .. %s\n", args->output_fname?args->output_fname:"stdout");
+}
+
 /*
     The splice_* functions are for consquences around splice sites: start,stop,splice_*
  */
@@ -2004,7 +2307,8 @@ static inline int splice_csq(args_t *args, splice_t *splice, uint32_t ex_beg, ui
 int hap_init(args_t *args, hap_node_t *parent, hap_node_t *child, gf_cds_t *cds, bcf1_t *rec, int ial)
 {
     int i;
-    kstring_t str = {0,0,0};
+    kstring_t str = {0,child->mseq,child->seq};     // reuse the buffers of a recycled node
+    kstring_t var = {0,child->mvar,child->var};
     tscript_t *tr = cds->tr;
     child->icds = cds->icds;     // index of cds in the tscript's list of exons
 
@@ -2048,15 +2352,15 @@ fprintf(stderr,"cds splice_csq: %d [%s][%s] .. beg,end=%d %d, ret=%d, csq=%d\n\n
         if ( !splice.csq ) return 2;        // fully intronic, no csq
 
         // splice_region/acceptor/donor
-        child->seq  = NULL;
         child->sbeg = 0;
         child->rbeg = rec->pos;
         child->rlen = 0;
         child->dlen = 0;
-        kputs(rec->d.allele[0],&str);
-        kputc('>',&str);
-        kputs(rec->d.allele[ial],&str);
-        child->var  = str.s;
+        kputs(rec->d.allele[0],&var);
+        kputc('>',&var);
+        kputs(rec->d.allele[ial],&var);
+        child->var  = var.s;
+        child->mvar = var.m;
         child->type = HAP_SSS;
         child->csq  = splice.csq;
         child->prev = parent->type==HAP_SSS ? parent->prev : parent;
@@ -2098,7 +2402,8 @@ fprintf(stderr,"cds splice_csq: %d [%s][%s] .. beg,end=%d %d, ret=%d, csq=%d\n\n
             int len = splice.ref_beg - parent->rbeg - parent->rlen;
             if ( len < 0 )   // overlapping variants
             {
-                free(str.s);
+                child->seq  = str.s;
+                child->mseq = str.m;
                 return 1;
             }
             kputsn_(tr->ref + N_REF_PAD + parent->rbeg + parent->rlen - tr->beg, len, &str);
@@ -2109,6 +2414,7 @@ fprintf(stderr,"cds splice_csq: %d [%s][%s] .. beg,end=%d %d, ret=%d, csq=%d\n\n
     kputs(splice.kalt.s + dbeg, &str);
 
     child->seq  = str.s;
+    child->mseq = str.m;
     child->sbeg = cds->pos + (splice.ref_beg - cds->beg);
     child->rbeg = splice.ref_beg;
     child->rlen = splice.kref.l;
@@ -2122,11 +2428,11 @@ fprintf(stderr,"cds splice_csq: %d [%s][%s] .. beg,end=%d %d, ret=%d, csq=%d\n\n
         int rlen = strlen(rec->d.allele[0]);
         int alen = strlen(rec->d.allele[ial]);
         child->dlen = alen - rlen;
-        child->var  = (char*) malloc(rlen+alen+2);
-        memcpy(child->var,rec->d.allele[0],rlen);
-        child->var[rlen] = '>';
-        memcpy(child->var+rlen+1,rec->d.allele[ial],alen);
-        child->var[rlen+alen+1] = 0;
+        kputsn(rec->d.allele[0],rlen,&var);
+        kputc('>',&var);
+        kputsn(rec->d.allele[ial],alen,&var);
+        child->var  = var.s;
+        child->mvar = var.m;
     }
 
     // yuck, the whole CDS is modified/deleted, not ready for this, todo.
@@ -2140,11 +2446,9 @@ fprintf(stderr,"cds splice_csq: %d [%s][%s] .. beg,end=%d %d, ret=%d, csq=%d\n\n
     free(splice.kalt.s);
     return 0;
 }
-void hap_destroy(hap_node_t *hap)
+void hap_node_free(hap_node_t *hap)
 {
     int i;
-    for (i=0; i<hap->nchild; i++)
-        if ( hap->child[i] ) hap_destroy(hap->child[i]);
     for (i=0; i<hap->mcsq_list; i++) free(hap->csq_list[i].type.vstr.s);
     free(hap->csq_list);
     free(hap->child);
@@ -2154,6 +2458,44 @@ void hap_destroy(hap_node_t *hap)
     free(hap);
 }
 
+// The nodes are not freed but returned to the pool: with many samples
+// the trees are rebuilt for every transcript and the sequences, child
+// lists and csq lists the nodes own can be reused as they are. The
+// consequence strings are freed: csq_stage() tells filled slots by vstr.s
+hap_node_t *hap_node_new(hap_t *hap)
+{
+    if ( hap->npool ) return hap->pool[--hap->npool];
+    return (hap_node_t*) calloc(1,sizeof(hap_node_t));
+}
+void hap_node_release(hap_t *hap, hap_node_t *node)
+{
+    hap_node_t tmp = *node;
+    memset(node,0,sizeof(*node));
+    node->seq = tmp.seq; node->mseq = tmp.mseq;
+    node->var = tmp.var; node->mvar = tmp.mvar;
+    node->child = tmp.child; node->mchild = tmp.mchild;
+    node->cur_child = tmp.cur_child; node->mcur_child = tmp.mcur_child;
+    node->csq_list = tmp.csq_list; node->mcsq_list = tmp.mcsq_list;
+
+    int i;
+    for (i=0; i<node->mcsq_list; i++)
+    {
+        free(node->csq_list[i].type.vstr.s);
+        memset(&node->csq_list[i],0,sizeof(csq_t));
+    }
+
+    hap->npool++;
+    hts_expand(hap_node_t*,hap->npool,hap->mpool,hap->pool);
+    hap->pool[hap->npool-1] = node;
+}
+void hap_destroy(hap_t *hap, hap_node_t *node)
+{
+    int i;
+    for (i=0; i<node->nchild; i++)
+        if ( node->child[i] ) hap_destroy(hap, node->child[i]);
+    hap_node_release(hap, node);
+}
+
 
 /*
     ref:    spliced reference and its length (ref.l)
@@ -2520,7 +2862,7 @@ void kput_vcsq(vcsq_t *csq, kstring_t *str)
     if ( csq->gene ) kputs(csq->gene , str);
 
     kputc_('|', str);
-    if ( csq->type & CSQ_PRN_TSCRIPT ) ksprintf(str, "%s",ENSID(csq->trid));
+    if ( csq->type & CSQ_PRN_TSCRIPT ) ksprintf(str, ENSID_FMT, csq->trid);      // not ENSID(), can be called from multiple threads
 
     kputc_('|', str);
     kputs(gf_type2gff_string(csq->biotype), str);
@@ -2918,6 +3260,36 @@ static inline void hap_print_text(args_t *args, tscript_t *tr, int ismpl, int ih
     }
 }
 
+// Set the icsq-th bit of the irow-th sample's FORMAT/BCSQ bitmask or, with
+// --sparse-BCSQ, of its entry in the list of carriers
+static inline void vrec_set_csq(args_t *args, vrec_t *vrec, int irow, int icsq)
+{
+    if ( vrec->nfmt < 1 + icsq/32 ) vrec->nfmt = 1 + icsq/32;
+    if ( !args->sparse_bcsq )
+    {
+        vrec->smpl[irow*args->nfmt_bcsq + icsq/32] |= 1 << (icsq % 32);
+        return;
+    }
+    int ret, key = irow*args->nsparse_bcsq + icsq/31;
+    khint_t k = kh_put(smpl2csq, vrec->smpl2csq, key, &ret);
+    if ( ret )
+    {
+        vrec->ncsmpl++;
+        hts_expand(smpl_csq_t, vrec->ncsmpl, vrec->mcsmpl, vrec->csmpl);
+        vrec->csmpl[vrec->ncsmpl-1].key  = key;
+        vrec->csmpl[vrec->ncsmpl-1].mask = 0;
+        kh_val(vrec->smpl2csq, k) = vrec->ncsmpl - 1;
+    }
+    vrec->csmpl[kh_val(vrec->smpl2csq, k)].mask |= 1 << (icsq % 31);
+}
+static int cmp_smpl_csq(const void *aptr, const void *bptr)
+{
+    const smpl_csq_t *a = (const smpl_csq_t*) aptr, *b = (const smpl_csq_t*) bptr;
+    if ( a->key < b->key ) return -1;
+    if ( a->key > b->key ) return 1;
+    return 0;
+}
+
 static inline void hap_stage_vcf(args_t *args, tscript_t *tr, int ismpl, int ihap, hap_node_t *node)
 {
     if ( !node || !node->ncsq_list || ismpl<0 ) return;
@@ -2944,8 +3316,7 @@ static inline void hap_stage_vcf(args_t *args, tscript_t *tr, int ismpl, int iha
             }
             break;
         }
-        if ( vrec->nfmt < 1 + icsq/32 ) vrec->nfmt = 1 + icsq/32;
-        vrec->smpl[ismpl*args->nfmt_bcsq + icsq/32] |= 1 << (icsq % 32);
+        vrec_set_csq(args, vrec, ismpl, icsq);
     }
 }
 
@@ -3021,7 +3392,13 @@ void vbuf_push(args_t *args, bcf1_t **rec_ptr)
         vbuf->vrec[vbuf->n - 1] = (vrec_t*) calloc(1,sizeof(vrec_t));
 
     vrec_t *vrec = vbuf->vrec[vbuf->n - 1];
-    if ( args->phase!=PHASE_DROP_GT && args->smpl->n )
+    if ( args->phase!=PHASE_DROP_GT && args->smpl->n && args->sparse_bcsq )
+    {
+        if ( !vrec->smpl2csq ) vrec->smpl2csq = kh_init(smpl2csq);
+        else kh_clear(smpl2csq, vrec->smpl2csq);
+        vrec->ncsmpl = 0;
+    }
+    else if ( args->phase!=PHASE_DROP_GT && args->smpl->n )
     {
         if ( !vrec->smpl ) vrec->smpl = (uint32_t*) calloc(args->hdr_nsmpl,sizeof(*vrec->smpl) * args->nfmt_bcsq);
         else memset(vrec->smpl,0,args->hdr_nsmpl*sizeof(*vrec->smpl) * args->nfmt_bcsq);
@@ -3064,7 +3441,21 @@ void vbuf_flush(args_t *args)
                 kput_vcsq(&vrec->vcsq[j], &args->str);
             }
             bcf_update_info_string(args->hdr, vrec->line, args->bcsq_tag, args->str.s);
-            if ( args->hdr_nsmpl )
+            if ( args->hdr_nsmpl && args->sparse_bcsq )
+            {
+                if ( vrec->ncsmpl )
+                {
+                    qsort(vrec->csmpl, vrec->ncsmpl, sizeof(*vrec->csmpl), cmp_smpl_csq);
+                    hts_expand(int32_t, 2*vrec->ncsmpl, args->msparse_arr, args->sparse_arr);
+                    for (j=0; j<vrec->ncsmpl; j++)
+                    {
+                        args->sparse_arr[2*j]   = vrec->csmpl[j].key;
+                        args->sparse_arr[2*j+1] = vrec->csmpl[j].mask;
+                    }
+                    bcf_update_info_int32(args->hdr, vrec->line, args->sparse_tag, args->sparse_arr, 2*vrec->ncsmpl);
+                }
+            }
+            else if ( args->hdr_nsmpl )
             {
                 if ( vrec->nfmt < args->nfmt_bcsq )
                     for (j=1; j<args->hdr_nsmpl; j++) memcpy(vrec->smpl+j*vrec->nfmt, vrec->smpl+j*args->nfmt_bcsq, vrec->nfmt*sizeof(*vrec->smpl));
@@ -3084,7 +3475,7 @@ void vbuf_flush(args_t *args)
     for (i=0; i<args->nrm_tr; i++)
     {
         tscript_t *tr = args->rm_tr[i];
-        if ( tr->root ) hap_destroy(tr->root);
+        if ( tr->root ) hap_destroy(args->hap, tr->root);
         tr->root = NULL;
         free(tr->hap);
         free(tr->ref);
@@ -3099,9 +3490,12 @@ void tscript_init_ref(args_t *args, tscript_t *tr, const char *chr)
     int i, len;
     int pad_beg = tr->beg >= N_REF_PAD ? N_REF_PAD : tr->beg;
 
-    tr->ref = faidx_fetch_seq(args->fai, chr, tr->beg - pad_beg, tr->end + N_REF_PAD, &len);
-    if ( !tr->ref )
+    const char *seq = refseq_fetch(args->ref, chr, tr->beg - pad_beg, tr->end + N_REF_PAD, &len);
+    if ( !seq )
         error("faidx_fetch_seq failed %s:%d-%d\n", chr,tr->beg+1,tr->end+1);
+    tr->ref = (char*) malloc(len+1);
+    memcpy(tr->ref, seq, len);
+    tr->ref[len] = 0;
 
     int pad_end = len - (tr->end - tr->beg + 1 + pad_beg);
     if ( pad_beg + pad_end != 2*N_REF_PAD )
@@ -3139,6 +3533,7 @@ int test_cds_local(args_t *args, bcf1_t *rec)
     // structures to fake the normal test_cds machinery
     hap_node_t root, node;
     root.type  = HAP_ROOT;
+    memset(&node, 0, sizeof(node));     // hap_init reuses node.seq and node.var
     kstring_t *tref = &args->hap->tref, *tseq = &args->hap->tseq;
 
     while ( regitr_overlap(args->itr) )
@@ -3279,7 +3674,7 @@ int test_cds_local(args_t *args, bcf1_t *rec)
 
                     // all this only to clean vstr when vrec is flushed
                     if ( !tr->root )
-                        tr->root = (hap_node_t*) calloc(1,sizeof(hap_node_t));
+                        tr->root = hap_node_new(args->hap);
                     tr->root->ncsq_list++;
                     hts_expand0(csq_t,tr->root->ncsq_list,tr->root->mcsq_list,tr->root->csq_list);
                     csq_t *rm_csq = tr->root->csq_list + tr->root->ncsq_list - 1;
@@ -3292,10 +3687,10 @@ int test_cds_local(args_t *args, bcf1_t *rec)
                     csq_stage(args, &csq, rec);
                 }
             }
-            free(node.seq);
-            free(node.var);
         }
     }
+    free(node.seq);
+    free(node.var);
     return ret;
 }
 
@@ -3316,7 +3711,7 @@ int test_cds(args_t *args, bcf1_t *rec)
             // initialize the transcript and its haplotype tree, fetch the reference sequence
             tscript_init_ref(args, tr, chr);
 
-            tr->root = (hap_node_t*) calloc(1,sizeof(hap_node_t));
+            tr->root = hap_node_new(args->hap);
             tr->nhap = args->phase==PHASE_DROP_GT ? 1 : 2*args->smpl->n;     // maximum ploidy = diploid
             tr->hap  = (hap_node_t**) malloc(tr->nhap*sizeof(hap_node_t*));
             for (i=0; i<tr->nhap; i++) tr->hap[i] = NULL;
@@ -3332,7 +3727,7 @@ int test_cds(args_t *args, bcf1_t *rec)
         {
             if ( rec->d.allele[1][0]=='<' || rec->d.allele[1][0]=='*' ) { continue; }
             hap_node_t *parent = tr->hap[0] ? tr->hap[0] : tr->root;
-            hap_node_t *child  = (hap_node_t*)calloc(1,sizeof(hap_node_t));
+            hap_node_t *child  = hap_node_new(args->hap);
             if ( (hap_ret=hap_init(args, parent, child, cds, rec, 1))!=0 )
             {
                 // overlapping or intron variant, cannot apply
@@ -3344,13 +3739,12 @@ int test_cds(args_t *args, bcf1_t *rec)
                         fprintf(args->out,"LOG\tWarning: Skipping overlapping variants at %s:%d\t%s>%s\n", chr,rec->pos+1,rec->d.allele[0],rec->d.allele[1]);
                 }
                 else ret = 1;   // prevent reporting as intron in test_tscript
-                free(child);
+                hap_node_release(args->hap, child);
                 continue;
             }
             parent->nend--;
             parent->nchild = 1;
-            parent->mchild = 1;
-            parent->child  = (hap_node_t**) malloc(sizeof(hap_node_t*));
+            hts_expand(hap_node_t*,1,parent->mchild,parent->child);
             parent->child[0] = child;
             tr->hap[0] = child;
             tr->hap[0]->nend = 1;
@@ -3414,7 +3808,7 @@ int test_cds(args_t *args, bcf1_t *rec)
                     continue;
                 }
 
-                hap_node_t *child = (hap_node_t*)calloc(1,sizeof(hap_node_t));
+                hap_node_t *child = hap_node_new(args->hap);
                 if ( (hap_ret=hap_init(args, parent, child, cds, rec, ial))!=0 )
                 {
                     // overlapping or intron variant, cannot apply
@@ -3427,7 +3821,7 @@ int test_cds(args_t *args, bcf1_t *rec)
                             fprintf(args->out,"LOG\tWarning: Skipping overlapping variants at %s:%d, sample %s\t%s>%s\n",
                                     chr,rec->pos+1,args->hdr->samples[args->smpl->idx[ismpl]],rec->d.allele[0],rec->d.allele[ial]);
                     }
-                    free(child);
+                    hap_node_release(args->hap, child);
                     continue;
                 }
 
@@ -3512,8 +3906,7 @@ void csq_stage(args_t *args, csq_t *csq, bcf1_t *rec)
                 }
                 break;
             }
-            if ( vrec->nfmt < 1 + icsq/32 ) vrec->nfmt = 1 + icsq/32;
-            vrec->smpl[i*args->nfmt_bcsq + icsq/32] |= 1 << (icsq % 32);
+            vrec_set_csq(args, vrec, i, icsq);
         }
     }
 }
@@ -3665,6 +4058,133 @@ void process(args_t *args, bcf1_t **rec_ptr)
     return;
 }
 
+static void *csq_chunk(void *arg)
+{
+    chunk_t *chunk = (chunk_t*) arg;
+    args_t *args = &chunk->args;
+    bcf_srs_t *sr = args->sr;
+
+    args->sr = bcf_sr_init();
+    args->sr->require_index = 1;
+    if ( bcf_sr_set_regions(args->sr, chunk->chr, 0)<0 ) error("Failed to set the region: %s\n", chunk->chr);
+    if ( !bcf_sr_add_reader(args->sr, sr->readers[0].fname) )
+        error("Failed to open %s: %s\n", sr->readers[0].fname,bcf_sr_strerror(args->sr->errnum));
+    args->hdr = bcf_sr_get_header(args->sr,0);
+    args->itr = regitr_init(NULL);
+    regitr_set_sorted(args->itr,1);
+
+    init_state(args);
+    if ( args->output_type==FT_TAB_TEXT )
+    {
+        if ( args->sample_list && !strcmp("-",args->sample_list) ) bcf_hdr_set_samples(args->hdr,NULL,0);
+        args->out = fopen(chunk->fname,"w");
+        if ( !args->out ) error("Failed to open %s: %s\n", chunk->fname,strerror(errno));
+    }
+    else
+    {
+        init_bcsq_hdr(args);
+        if ( bcf_hdr_sync(args->hdr)<0 ) error("Failed to update the header\n");
+        args->out_fh = hts_open(chunk->fname, args->output_type & FT_BCF ? "wbu" : "w");
+        if ( !args->out_fh ) error("Can't write to \"%s\": %s\n", chunk->fname, strerror(errno));
+    }
+
+    while ( bcf_sr_next_line(args->sr) )
+        process(args, &args->sr->readers[0].buffer[0]);
+    process(args,NULL);
+
+    int ret = args->out_fh ? hts_close(args->out_fh) : fclose(args->out);
+    if ( ret ) error("Close failed: %s\n", chunk->fname);
+    destroy_state(args);
+    regitr_destroy(args->itr);
+    bcf_sr_destroy(args->sr);
+    return chunk;
+}
+
+// Append the annotated chromosome to the output and remove the temporary file
+static void write_chunk(args_t *args, hts_tpool_process *q)
+{
+    hts_tpool_result *res = hts_tpool_next_result_wait(q);
+    if ( !res ) error("Failed to retrieve the annotated chunk\n");
+    chunk_t *chunk = (chunk_t*) hts_tpool_result_data(res);
+
+    const size_t page_size = BGZF_MAX_BLOCK_SIZE;
+    uint8_t *buf = (uint8_t*) malloc(page_size);
+    ssize_t nread;
+    if ( args->out )
+    {
+        FILE *fp = fopen(chunk->fname, "r");
+        if ( !fp ) error("Failed to open %s: %s\n", chunk->fname, strerror(errno));
+        while ( (nread = fread(buf, 1, page_size, fp)) > 0 )
+            if ( fwrite(buf, 1, nread, args->out)!=nread ) error("Write failed: %s\n", strerror(errno));
+        if ( ferror(fp) ) error("Failed to read %s\n", chunk->fname);
+        fclose(fp);
+    }
+    else
+    {
+        BGZF *fp = bgzf_open(chunk->fname, "r");
+        if ( !fp ) error("Failed to open %s: %s\n", chunk->fname, strerror(errno));
+        while ( (nread = bgzf_read(fp, buf, page_size)) > 0 )
+        {
+            ssize_t nwr = args->out_fh->is_bgzf ? bgzf_write(args->out_fh->fp.bgzf, buf, nread) : hwrite(args->out_fh->fp.hfile, buf, nread);
+            if ( nwr!=nread ) error("Write failed, wrote %d instead of %d bytes.\n", (int)nwr,(int)nread);
+        }
+        if ( nread<0 ) error("Failed to read %s\n", chunk->fname);
+        if ( bgzf_close(fp)<0 ) error("Close failed: %s\n", chunk->fname);
+    }
+    free(buf);
+    unlink(chunk->fname);
+    hts_tpool_delete_result(res, 0);
+}
+
+// The chromosomes are annotated independently, transcripts never span two
+// chromosomes, and concatenated in the order of the index. At most two chunks
+// per thread are in flight, the oldest one is written out before another is
+// dispatched.
+static void csq_chunks(args_t *args)
+{
+    bcf_sr_t *reader = &args->sr->readers[0];
+    int i, nchr;
+    const char **chrs = reader->tbx_idx ? tbx_seqnames(reader->tbx_idx, &nchr) : bcf_index_seqnames(reader->bcf_idx, args->hdr, &nchr);
+
+    // the workers query the indexes concurrently
+    regidx_finalize(args->idx_cds);
+    regidx_finalize(args->idx_utr);
+    regidx_finalize(args->idx_exon);
+    regidx_finalize(args->idx_tscript);
+
+    char *dir = tmpdir_create(args->tmp_dir, "csq");
+    kstring_t str = {0,0,0};
+
+    int nchunks = 2*args->n_threads, nbusy = 0, ichunk = 0;
+    chunk_t *chunks = (chunk_t*) calloc(nchunks, sizeof(chunk_t));
+    hts_tpool_process *q = hts_tpool_process_init(args->sr->p->pool, nchunks, 0);
+    if ( !q ) error("Failed to initialize the thread pool queue\n");
+    for (i=0; i<nchr; i++)
+    {
+        chunk_t *chunk = &chunks[ichunk];
+        ichunk = (ichunk + 1) % nchunks;
+        if ( nbusy==nchunks ) { write_chunk(args, q); nbusy--; }
+        chunk->args = *args;
+        chunk->chr  = chrs[i];
+        free(chunk->fname);
+        str.l = 0;
+        ksprintf(&str, "%s/%d", dir, i);
+        chunk->fname = strdup(str.s);
+        if ( hts_tpool_dispatch(args->sr->p->pool, q, csq_chunk, chunk) < 0 )
+            error("Failed to dispatch the chunk %s to the thread pool\n", chrs[i]);
+        nbusy++;
+    }
+    while ( nbusy ) { write_chunk(args, q); nbusy--; }
+    hts_tpool_process_destroy(q);
+
+    for (i=0; i<nchunks; i++) free(chunks[i].fname);
+    free(chunks);
+    tmpdir_remove(dir);
+    free(dir);
+    free(str.s);
+    free(chrs);
+}
+
 const char *usage(void)
 {
     return 
@@ -3675,11 +4195,13 @@ const char *usage(void)
         "Required options:\n"
         "   -f, --fasta-ref <file>          reference file in fasta format\n"
         "   -g, --gff-annot <file>          gff3 annotation file\n"
+        "       --cache <file>              read the annotation from a cache created with --build-cache instead of -g\n"
         "\n"
         "CSQ options:\n"
         "   -c, --custom-tag <string>       use this tag instead of the default BCSQ\n"
         "   -l, --local-csq                 localized predictions, consider only one VCF record at a time\n"
         "   -n, --ncsq <int>                maximum number of consequences to consider per site [16]\n"
+        "       --sparse-BCSQ               list carriers in INFO/BCSQ_SMPL instead of writing FORMAT/BCSQ for all samples\n"
         "   -p, --phase <a|m|r|R|s>         how to construct haplotypes and how to deal with unphased data: [r]\n"
         "                                     a: take GTs as is, create haplotypes regardless of phase (0/1 -> 0|1)\n"
         "                                     m: merge *all* GTs into a single haplotype (0/1 -> 1, 1/2 -> 1)\n"
@@ -3699,6 +4221,10 @@ const char *usage(void)
         "   -S, --samples-file <file>       samples to include\n"
         "   -t, --targets <region>          similar to -r but streams rather than index-jumps\n"
         "   -T, --targets-file <file>       similar to -R but streams rather than index-jumps\n"
+        "       --build-cache <file>        parse the -g file, save the annotation to a binary cache and exit\n"
+        "       --temp-dir <dir>            directory for temporary files with --threads [$TMPDIR or /tmp]\n"
+        "       --threads <int>             annotate chromosomes in parallel using <int> extra threads [0]\n"
+        "       --write-index               index the output file, requires compressed VCF/BCF written to a file\n"
         "\n"
         "Example:\n"
         "   bcftools csq -f hs37d5.fa -g Homo_sapiens.GRCh37.82.gff3.gz in.vcf\n"
@@ -3737,9 +4263,15 @@ int main_csq(int argc, char *argv[])
         {"samples-file",1,0,'S'},
         {"targets",1,0,'t'},
         {"targets-file",1,0,'T'},
+        {"threads",1,0,1},
+        {"temp-dir",1,0,2},
+        {"build-cache",1,0,3},
+        {"cache",1,0,4},
+        {"write-index",0,0,5},
+        {"sparse-BCSQ",0,0,6},
         {0,0,0,0}
     };
-    int c, targets_is_file = 0, regions_is_file = 0; 
+    int c, targets_is_file = 0, regions_is_file = 0, write_idx = 0; 
     char *targets_list = NULL, *regions_list = NULL;
     while ((c = getopt_long(argc, argv, "?hr:R:t:T:i:e:f:o:O:g:s:S:p:qc:ln:",loptions,NULL)) >= 0)
     {
@@ -3784,11 +4316,26 @@ int main_csq(int argc, char *argv[])
             case 'S': args->sample_list = optarg; args->sample_is_file = 1; break;
             case 't': targets_list = optarg; break;
             case 'T': targets_list = optarg; targets_is_file = 1; break;
+            case  1 : args->n_threads = strtol(optarg, 0, 0); break;
+            case  2 : args->tmp_dir = optarg; break;
+            case  3 : args->cache_fname = optarg; args->build_cache = 1; break;
+            case  4 : args->cache_fname = optarg; break;
+            case  5 : write_idx = 1; break;
+            case  6 : args->sparse_bcsq = 1; break;
             case 'h':
             case '?': error("%s",usage());
             default: error("The option not recognised: %s\n\n", optarg); break;
         }
     }
+    if ( args->build_cache )
+    {
+        if ( !args->gff_fname ) error("Missing the --gff option\n");
+        if ( !args->quiet ) fprintf(stderr,"Parsing %s ...\n", args->gff_fname);
+        init_gff(args);
+        destroy_gff(args);
+        free(args);
+        return 0;
+    }
     char *fname = NULL;
     if ( optind==argc )
     {
@@ -3798,8 +4345,18 @@ int main_csq(int argc, char *argv[])
     else fname = argv[optind];
     if ( argc - optind>1 ) error("%s", usage());
     if ( !args->fa_fname ) error("Missing the --fa-ref option\n");
-    if ( !args->gff_fname ) error("Missing the --gff option\n");
+    if ( !args->gff_fname && !args->cache_fname ) error("Missing the --gff option\n");
+    if ( write_idx ) init_write_index(args->output_fname, args->output_type);
+    kstring_t tag = {0,0,0};
+    ksprintf(&tag, "%s_SMPL", args->bcsq_tag);
+    args->sparse_tag = tag.s;
     args->sr = bcf_sr_init();
+    if ( args->n_threads )
+    {
+        if ( targets_list || regions_list ) error("The --threads option cannot be combined with -r, -R, -t or -T\n");
+        args->sr->require_index = 1;
+        if ( bcf_sr_set_threads(args->sr, args->n_threads)<0 ) error("Failed to create %d threads\n", args->n_threads);
+    }
     if ( targets_list && bcf_sr_set_targets(args->sr, targets_list, targets_is_file, 0)<0 )
         error("Failed to read the targets: %s\n", targets_list);
     if ( regions_list && bcf_sr_set_regions(args->sr, regions_list, regions_is_file)<0 )
@@ -3809,14 +4366,21 @@ int main_csq(int argc, char *argv[])
     args->hdr = bcf_sr_get_header(args->sr,0);
 
     init_data(args);
-    while ( bcf_sr_next_line(args->sr) )
+    if ( args->n_threads )
+        csq_chunks(args);
+    else
     {
-        process(args, &args->sr->readers[0].buffer[0]);
+        while ( bcf_sr_next_line(args->sr) )
+        {
+            process(args, &args->sr->readers[0].buffer[0]);
+        }
+        process(args,NULL);
     }
-    process(args,NULL);
 
     destroy_data(args);
     bcf_sr_destroy(args->sr);
+    if ( write_idx ) write_index(args->output_fname, args->output_type, args->n_threads);
+    free(args->sparse_tag);
     free(args);
 
     return 0;
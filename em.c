@@ -33,6 +33,7 @@ THE SOFTWARE.  */
 #define ITER_MAX 50
 #define ITER_TRY 10
 #define EPS 1e-5
+#define NACC 4      // independent partial sums in the per-sample loops so that they vectorize, summed as pairs
 
 extern double kf_gammaq(double, double);
 
@@ -62,39 +63,45 @@ static double est_freq(int n, const double *pdg)
     Single-locus EM
  */
 
+// The routines below take P(D|G) in the struct-of-arrays layout, pdg[k][i]
+// is the likelihood of the genotype k in the sample i
 typedef struct {
     int beg, end;
-    const double *pdg;
+    const double **pdg;
 } minaux1_t;
 
 static double prob1(double f, void *data)
 {
     minaux1_t *a = (minaux1_t*)data;
+    const double *p0 = a->pdg[0], *p1 = a->pdg[1], *p2 = a->pdg[2];
     double p = 1., l = 0., f3[3];
     int i;
 //  printf("brent %lg\n", f);
     if (f < 0 || f > 1) return 1e300;
     f3[0] = (1.-f)*(1.-f); f3[1] = 2.*f*(1.-f); f3[2] = f*f;
     for (i = a->beg; i < a->end; ++i) {
-        const double *pdg = a->pdg + i * 3;
-        p *= pdg[0] * f3[0] + pdg[1] * f3[1] + pdg[2] * f3[2];
+        p *= p0[i] * f3[0] + p1[i] * f3[1] + p2[i] * f3[2];
         if (p < 1e-200) l -= log(p), p = 1.;
     }
     return l - log(p);
 }
 
 // one EM iteration for allele frequency estimate
-static double freq_iter(double *f, const double *_pdg, int beg, int end)
+static double freq_iter(double *f, const double **pdg, int beg, int end)
 {
-    double f0 = *f, f3[3], err;
-    int i;
+    const double *p0 = pdg[0], *p1 = pdg[1], *p2 = pdg[2];
+    double f0 = *f, f3[3], err, acc[NACC] = {0.};
+    int i, j;
 //  printf("em %lg\n", *f);
     f3[0] = (1.-f0)*(1.-f0); f3[1] = 2.*f0*(1.-f0); f3[2] = f0*f0;
-    for (i = beg, f0 = 0.; i < end; ++i) {
-        const double *pdg = _pdg + i * 3;
-        f0 += (pdg[1] * f3[1] + 2. * pdg[2] * f3[2])
-            / (pdg[0] * f3[0] + pdg[1] * f3[1] + pdg[2] * f3[2]);
-    }
+    for (i = beg; i + NACC <= end; i += NACC)
+        for (j = 0; j < NACC; ++j)
+            acc[j] += (p1[i+j] * f3[1] + 2. * p2[i+j] * f3[2])
+                / (p0[i+j] * f3[0] + p1[i+j] * f3[1] + p2[i+j] * f3[2]);
+    for (; i < end; ++i)
+        acc[0] += (p1[i] * f3[1] + 2. * p2[i] * f3[2])
+            / (p0[i] * f3[0] + p1[i] * f3[1] + p2[i] * f3[2]);
+    f0 = (acc[0] + acc[1]) + (acc[2] + acc[3]);
     f0 /= (end - beg) * 2;
     err = fabs(f0 - *f);
     *f = f0;
@@ -106,12 +113,14 @@ static double freq_iter(double *f, const double *_pdg, int beg, int end)
  * When this happens, we switch to Brent's method. The idea is learned from
  * Rasmus Nielsen.
  */
-static double freqml(double f0, int beg, int end, const double *pdg)
+static double freqml(double f0, int beg, int end, const double **pdg)
 {
     int i;
-    double f;
-    for (i = 0, f = f0; i < ITER_TRY; ++i)
-        if (freq_iter(&f, pdg, beg, end) < EPS) break;
+    double f, err, prev = HUGE_VAL;
+    for (i = 0, f = f0; i < ITER_TRY; ++i, prev = err) {
+        if ((err = freq_iter(&f, pdg, beg, end)) < EPS) break;
+        if (err >= prev) { i = ITER_TRY; break; } // EM is not getting any closer, do not wait for ITER_TRY
+    }
     if (i == ITER_TRY) { // haven't converged yet; try Brent's method
         minaux1_t a;
         a.beg = beg; a.end = end; a.pdg = pdg;
@@ -121,19 +130,24 @@ static double freqml(double f0, int beg, int end, const double *pdg)
 }
 
 // one EM iteration for genotype frequency estimate
-static double g3_iter(double g[3], const double *_pdg, int beg, int end)
+static double g3_iter(double g[3], const double **pdg, int beg, int end)
 {
-    double err, gg[3];
-    int i;
-    gg[0] = gg[1] = gg[2] = 0.;
+    const double *p0 = pdg[0], *p1 = pdg[1], *p2 = pdg[2];
+    double err, gg[3], acc[3][NACC] = {{0.}};
+    int i, j, k;
 //  printf("%lg,%lg,%lg\n", g[0], g[1], g[2]);
-    for (i = beg; i < end; ++i) {
-        double sum, tmp[3];
-        const double *pdg = _pdg + i * 3;
-        tmp[0] = pdg[0] * g[0]; tmp[1] = pdg[1] * g[1]; tmp[2] = pdg[2] * g[2];
-        sum = (tmp[0] + tmp[1] + tmp[2]) * (end - beg);
-        gg[0] += tmp[0] / sum; gg[1] += tmp[1] / sum; gg[2] += tmp[2] / sum;
+    for (i = beg; i + NACC <= end; i += NACC)
+        for (j = 0; j < NACC; ++j) {
+            double t0 = p0[i+j] * g[0], t1 = p1[i+j] * g[1], t2 = p2[i+j] * g[2];
+            double sum = (t0 + t1 + t2) * (end - beg);
+            acc[0][j] += t0 / sum; acc[1][j] += t1 / sum; acc[2][j] += t2 / sum;
+        }
+    for (; i < end; ++i) {
+        double t0 = p0[i] * g[0], t1 = p1[i] * g[1], t2 = p2[i] * g[2];
+        double sum = (t0 + t1 + t2) * (end - beg);
+        acc[0][0] += t0 / sum; acc[1][0] += t1 / sum; acc[2][0] += t2 / sum;
     }
+    for (k = 0; k < 3; ++k) gg[k] = (acc[k][0] + acc[k][1]) + (acc[k][2] + acc[k][3]);
     err = fabs(gg[0] - g[0]) > fabs(gg[1] - g[1])? fabs(gg[0] - g[0]) : fabs(gg[1] - g[1]);
     err = err > fabs(gg[2] - g[2])? err : fabs(gg[2] - g[2]);
     g[0] = gg[0]; g[1] = gg[1]; g[2] = gg[2];
@@ -141,20 +155,17 @@ static double g3_iter(double g[3], const double *_pdg, int beg, int end)
 }
 
 // perform likelihood ratio test
-static double lk_ratio_test(int n, int n1, const double *pdg, double f3[3][3])
+static double lk_ratio_test(int n, int n1, const double **pdg, double f3[3][3])
 {
+    const double *p0 = pdg[0], *p1 = pdg[1], *p2 = pdg[2];
     double r;
     int i;
-    for (i = 0, r = 1.; i < n1; ++i) {
-        const double *p = pdg + i * 3;
-        r *= (p[0] * f3[1][0] + p[1] * f3[1][1] + p[2] * f3[1][2])
-            / (p[0] * f3[0][0] + p[1] * f3[0][1] + p[2] * f3[0][2]);
-    }
-    for (; i < n; ++i) {
-        const double *p = pdg + i * 3;
-        r *= (p[0] * f3[2][0] + p[1] * f3[2][1] + p[2] * f3[2][2])
-            / (p[0] * f3[0][0] + p[1] * f3[0][1] + p[2] * f3[0][2]);
-    }
+    for (i = 0, r = 1.; i < n1; ++i)
+        r *= (p0[i] * f3[1][0] + p1[i] * f3[1][1] + p2[i] * f3[1][2])
+            / (p0[i] * f3[0][0] + p1[i] * f3[0][1] + p2[i] * f3[0][2]);
+    for (; i < n; ++i)
+        r *= (p0[i] * f3[2][0] + p1[i] * f3[2][1] + p2[i] * f3[2][2])
+            / (p0[i] * f3[0][0] + p1[i] * f3[0][1] + p2[i] * f3[0][2]);
     return r;
 }
 
@@ -166,7 +177,7 @@ static double lk_ratio_test(int n, int n1, const double *pdg, double f3[3][3])
 // x[8]: 2-degree P-value
 int bcf_em1(call_t *call, const bcf1_t *rec, int n1, int flag, double x[10])
 {
-    double *pdg;
+    const double *pdg[3];
     int i, n; //, n2;
     if (rec->n_allele < 2) return -1; // one allele only
     // initialization
@@ -174,13 +185,18 @@ int bcf_em1(call_t *call, const bcf1_t *rec, int n1, int flag, double x[10])
     if (flag & 1<<7) flag |= 7<<5; // compute group freq if LRT is required
     if (flag & 0xf<<1) flag |= 0xf<<1;
     n = rec->n_sample; //n2 = n - n1;
-    pdg = call->pdg;
-    if (pdg == 0) return -1;
+    if (call->pdg == 0) return -1;
     for (i = 0; i < 10; ++i) x[i] = -1.; // set to negative
-    {
-        if ((x[0] = est_freq(n, pdg)) < 0.) return -1; // no data
-        x[0] = freqml(x[0], 0, n, pdg);
+    if ((x[0] = est_freq(n, call->pdg)) < 0.) return -1; // no data
+    // transpose P(D|G) to pdg[genotype][sample]
+    hts_expand(double, 3*n, call->nem_pdg, call->em_pdg);
+    for (i = 0; i < 3; ++i) pdg[i] = call->em_pdg + i * n;
+    for (i = 0; i < n; ++i) {
+        call->em_pdg[i]       = call->pdg[i*3];
+        call->em_pdg[n + i]   = call->pdg[i*3 + 1];
+        call->em_pdg[2*n + i] = call->pdg[i*3 + 2];
     }
+    x[0] = freqml(x[0], 0, n, pdg);
     if (flag & (0xf<<1|3<<8)) { // estimate the genotype frequency and test HWE
         double *g = x + 1, f3[3], r;
         f3[0] = g[0] = (1 - x[0]) * (1 - x[0]);
@@ -189,10 +205,9 @@ int bcf_em1(call_t *call, const bcf1_t *rec, int n1, int flag, double x[10])
         for (i = 0; i < ITER_MAX; ++i)
             if (g3_iter(g, pdg, 0, n) < EPS) break;
         // Hardy-Weinberg equilibrium (HWE)
-        for (i = 0, r = 1.; i < n; ++i) {
-            double *p = pdg + i * 3;
-            r *= (p[0] * g[0] + p[1] * g[1] + p[2] * g[2]) / (p[0] * f3[0] + p[1] * f3[1] + p[2] * f3[2]);
-        }
+        for (i = 0, r = 1.; i < n; ++i)
+            r *= (pdg[0][i] * g[0] + pdg[1][i] * g[1] + pdg[2][i] * g[2])
+                / (pdg[0][i] * f3[0] + pdg[1][i] * f3[1] + pdg[2][i] * f3[2]);
         x[4] = kf_gammaq(.5, log(r));
     }
     if ((flag & 7<<5) && n1 > 0 && n1 < n) { // group frequency
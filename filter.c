@@ -24,6 +24,7 @@ THE SOFTWARE.  */
 
 #include <ctype.h>
 #include <stdlib.h>
+#include <inttypes.h>
 #include <strings.h>
 #include <errno.h>
 #include <math.h>
@@ -32,6 +33,7 @@ THE SOFTWARE.  */
 #include <htslib/khash_str2int.h>
 #include "filter.h"
 #include "bcftools.h"
+#include "profile.h"
 #include <htslib/hts_defs.h>
 #include <htslib/vcfutils.h>
 
@@ -59,6 +61,24 @@ static inline int bcf_double_test(double d, uint64_t value)
 #define bcf_double_is_missing(x)     bcf_double_test((x),bcf_double_missing)
 
 
+// Regex patterns which are plain strings, optionally anchored by ^ and $, or
+// alternations of such strings, are matched without calling regexec()
+typedef struct
+{
+    char *str;
+    int len, beg, end;  // beg,end: anchored at the start or the end
+}
+relit_t;
+
+typedef struct _regex_lit_t
+{
+    int nlit, icase;
+    relit_t *lit;
+}
+regex_lit_t;
+
+#define REGEX_MEMO_MAX 4096     // the maximum number of values with memoized regexec() results
+
 typedef struct _token_t
 {
     // read-only values, same for all VCF lines
@@ -72,6 +92,8 @@ typedef struct _token_t
     int (*comparator)(struct _token_t *, struct _token_t *, int op_type, bcf1_t *);
     void *hash;         // test presence of str value in the hash via comparator
     regex_t *regex;     // precompiled regex for string comparison
+    struct _regex_lit_t *relit; // regex that is a literal string, matched without regexec
+    void *rememo;       // the results of regexec for previously seen values
 
     // modified on filter evaluation at each VCF line
     double *values;     // In case str_value is set, values[0] is one sample's string length
@@ -85,17 +107,70 @@ typedef struct _token_t
 }
 token_t;
 
+// The RPN token array is compiled by filter_compile() into a flat program. The
+// operands are addressed directly by their index to filter_t.filters, i.e. each
+// value token serves as a register, and the result of an operation is stored in
+// the register of its left operand. The stack positions are resolved once at
+// initialization, no evaluation stack is needed when filtering.
+#define FLT_OP_NUM      0   // load numeric constant
+#define FLT_OP_STR      1   // load string constant
+#define FLT_OP_SET      2   // query the VCF line via the token's setter
+#define FLT_OP_SET_FMT  3   // same as FLT_OP_SET but requires FORMAT fields to be unpacked
+#define FLT_OP_FUNC     4   // apply single-argument function on register a
+#define FLT_OP_SKIP     5   // stop the evaluation if register a failed, see filter_reorder()
+#define FLT_OP_AND      6   // & and &&
+#define FLT_OP_OR       7   // | and ||
+#define FLT_OP_ADD      8
+#define FLT_OP_SUB      9
+#define FLT_OP_MULT     10
+#define FLT_OP_DIV      11
+#define FLT_OP_CMP      12  // comparison operators, including regex matching
+
+typedef struct
+{
+    int op;         // one of the FLT_OP_* instructions
+    int tok_type;   // one of the TOK_* operators
+    int itok;       // the token the instruction was compiled from
+    int a, b;       // operand registers, b is -1 for unary instructions
+    int len;        // the length of a string constant
+}
+flt_insn_t;
+
 struct _filter_t
 {
     bcf_hdr_t *hdr;
     char *str;
     int nfilters;
-    token_t *filters, **flt_stack;  // filtering input tokens (in RPN) and evaluation stack
+    token_t *filters;       // filtering input tokens (in RPN)
+    flt_insn_t *prog;       // the compiled program
+    int nprog, iresult;     // number of instructions and the register holding the result
+    uint64_t ntested, nsite_only;   // number of tested records and those decided without FORMAT fields
     int32_t *tmpi;
     float   *tmpf;
     int max_unpack, mtmpi, mtmpf, nsamples;
+    uint8_t  gt_code[256];          // GT classes: the raw int8 GT value to GT_CODE_*
+    uint16_t gt_pair[16][16];       //  and the class bits of a pair of codes, set when gt_init=1
+    int gt_init;
 };
 
+// Genotype classes for GT="het" and friends, see filters_set_genotype_class()
+#define GT_CLS_REF  (1<<0)      // all alleles REF
+#define GT_CLS_ALT  (1<<1)      // at least one ALT allele
+#define GT_CLS_MIS  (1<<2)      // at least one allele missing
+#define GT_CLS_HOM  (1<<3)      // not haploid, all alleles the same
+#define GT_CLS_HET  (1<<4)      // not all alleles the same
+#define GT_CLS_HAP  (1<<5)      // haploid
+#define GT_CLS_RR   (1<<6)
+#define GT_CLS_RA   (1<<7)
+#define GT_CLS_AA   (1<<8)
+#define GT_CLS_Aa   (1<<9)      // two different ALT alleles
+#define GT_CLS_R    (1<<10)     // haploid REF
+#define GT_CLS_A    (1<<11)     // haploid ALT
+#define GT_CODE_BIG 13          // allele index too big for the lookup table
+#define GT_CODE_MIS 14
+#define GT_CODE_END 15          // vector_end, i.e. lower ploidy
+#define GT_PAIR_SLOW 0xffff     // classify without the lookup table
+
 
 #define TOK_VAL     0
 #define TOK_LFT     1       // (
@@ -664,6 +739,124 @@ gt_length_too_big:
     tok->values[0] = blen;
     tok->str_value = str.s;
 }
+// nal: number of called alleles, nref: of which REF, ndiff: number of changes between consecutive alleles
+static int genotype_class(int nal, int nmis, int nref, int ndiff)
+{
+    if ( nmis || !nal ) return GT_CLS_MIS;
+    if ( nal==1 ) return GT_CLS_HAP | (nref ? GT_CLS_REF|GT_CLS_R : GT_CLS_ALT|GT_CLS_A);
+    if ( !ndiff ) return GT_CLS_HOM | (nref ? GT_CLS_REF|GT_CLS_RR : GT_CLS_ALT|GT_CLS_AA);
+    return GT_CLS_HET | GT_CLS_ALT | (nref ? GT_CLS_RA : GT_CLS_Aa);
+}
+static int genotype_class_slow(bcf_fmt_t *fmt, int ismpl)
+{
+    int j, ial, iprev = -1, nal = 0, nmis = 0, nref = 0, ndiff = 0;
+    #define BRANCH(type_t, vector_end) { \
+        type_t *ptr = (type_t*) (fmt->p + ismpl*fmt->size); \
+        for (j=0; j<fmt->n; j++) \
+        { \
+            if ( ptr[j]==vector_end ) break; \
+            if ( bcf_gt_is_missing(ptr[j]) ) { nmis++; continue; } \
+            ial = bcf_gt_allele(ptr[j]); \
+            if ( !ial ) nref++; \
+            if ( nal++ && ial!=iprev ) ndiff++; \
+            iprev = ial; \
+        } \
+    }
+    switch (fmt->type)
+    {
+        case BCF_BT_INT8:  BRANCH(int8_t,  bcf_int8_vector_end); break;
+        case BCF_BT_INT16: BRANCH(int16_t, bcf_int16_vector_end); break;
+        case BCF_BT_INT32: BRANCH(int32_t, bcf_int32_vector_end); break;
+        default: error("The GT type is not recognised: %d at %d\n", fmt->type, ismpl);
+    }
+    #undef BRANCH
+    return genotype_class(nal, nmis, nref, ndiff);
+}
+static void init_genotype_class(filter_t *flt)
+{
+    int i, j;
+    for (i=0; i<256; i++)
+    {
+        int8_t val = (int8_t) i;
+        if ( val==bcf_int8_vector_end ) flt->gt_code[i] = GT_CODE_END;
+        else if ( bcf_gt_is_missing(val) ) flt->gt_code[i] = GT_CODE_MIS;
+        else if ( val<0 || bcf_gt_allele(val)>=GT_CODE_BIG ) flt->gt_code[i] = GT_CODE_BIG;
+        else flt->gt_code[i] = bcf_gt_allele(val);
+    }
+    for (i=0; i<16; i++)
+        for (j=0; j<16; j++)
+        {
+            if ( i==GT_CODE_BIG || j==GT_CODE_BIG ) { flt->gt_pair[i][j] = GT_PAIR_SLOW; continue; }
+            if ( i==GT_CODE_END || i==GT_CODE_MIS || j==GT_CODE_MIS ) { flt->gt_pair[i][j] = GT_CLS_MIS; continue; }
+            if ( j==GT_CODE_END ) { flt->gt_pair[i][j] = genotype_class(1, 0, i==0, 0); continue; }
+            flt->gt_pair[i][j] = genotype_class(2, 0, (i==0) + (j==0), i!=j);
+        }
+    flt->gt_init = 1;
+}
+// Sets pass_samples of GT="het" etc directly from the raw GT values, without
+// formatting the genotypes. The class bits to match are stored in tok->threshold.
+static void filters_set_genotype_class(filter_t *flt, bcf1_t *line, token_t *tok)
+{
+    bcf_fmt_t *fmt = bcf_get_fmt_id(line, tok->hdr_id);
+    if ( !fmt || !fmt->p )
+    {
+        tok->nvalues = tok->nsamples = 0;
+        return;
+    }
+    int i, nsmpl = bcf_hdr_nsamples(flt->hdr), cls, mask = (int)tok->threshold;
+    if ( fmt->type==BCF_BT_INT8 && (fmt->n==1 || fmt->n==2) )
+    {
+        for (i=0; i<nsmpl; i++)
+        {
+            uint8_t *ptr = fmt->p + i*fmt->size;
+            int ia = flt->gt_code[ptr[0]], ib = fmt->n==2 ? flt->gt_code[ptr[1]] : GT_CODE_END;
+            cls = flt->gt_pair[ia][ib];
+            if ( cls==GT_PAIR_SLOW ) cls = genotype_class_slow(fmt, i);
+            tok->pass_samples[i] = cls & mask ? 1 : 0;
+        }
+    }
+    else
+    {
+        for (i=0; i<nsmpl; i++)
+            tok->pass_samples[i] = genotype_class_slow(fmt, i) & mask ? 1 : 0;
+    }
+    tok->nvalues  = 1;
+    tok->nsamples = nsmpl;
+}
+static int filters_cmp_genotype_class(token_t *btok, token_t *atok, int op_type, bcf1_t *line)
+{
+    // the result goes to atok, which can be either the GT or the string token
+    token_t *gtok = atok->setter==filters_set_genotype_class ? atok : btok;
+    if ( !gtok->nsamples )
+    {
+        atok->nvalues = atok->nsamples = 0;
+        return 0;
+    }
+    int i, pass_site = 0, neg = op_type==TOK_NE ? 1 : 0;
+    for (i=0; i<gtok->nsamples; i++)
+    {
+        atok->pass_samples[i] = gtok->pass_samples[i] ^ neg;
+        pass_site |= atok->pass_samples[i];
+    }
+    atok->nsamples = gtok->nsamples;
+    return pass_site;
+}
+static int genotype_class_mask(const char *str)
+{
+    if ( !strcasecmp(str,"ref") ) return GT_CLS_REF;
+    if ( !strcasecmp(str,"alt") ) return GT_CLS_ALT;
+    if ( !strcasecmp(str,"mis") ) return GT_CLS_MIS;
+    if ( !strcasecmp(str,"hom") ) return GT_CLS_HOM;
+    if ( !strcasecmp(str,"het") ) return GT_CLS_HET;
+    if ( !strcasecmp(str,"hap") ) return GT_CLS_HAP;
+    if ( !strcmp(str,"RR") ) return GT_CLS_RR;
+    if ( !strcmp(str,"RA") || !strcmp(str,"AR") ) return GT_CLS_RA;
+    if ( !strcmp(str,"AA") ) return GT_CLS_AA;
+    if ( !strcmp(str,"Aa") || !strcmp(str,"aA") ) return GT_CLS_Aa;
+    if ( !strcmp(str,"R") ) return GT_CLS_R;
+    if ( !strcmp(str,"A") ) return GT_CLS_A;
+    return 0;
+}
 static void filters_set_ref_string(filter_t *flt, bcf1_t *line, token_t *tok)
 {
     kstring_t str; str.s = tok->str_value; str.m = tok->values[0]; str.l = 0;
@@ -1071,6 +1264,9 @@ static int vector_logic_or(token_t *atok, token_t *btok, int or_type)
     tok->nvalues = 1; \
 }
 
+// The per-sample loops are kept free of branches so that the compiler can
+// vectorize them, the pass mask and the site status are accumulated in one pass.
+// Missing values are NaNs, they fail all comparisons except for "!=".
 #define CMP_VECTORS(atok,btok,CMP_OP,ret) \
 { \
     int i, j, has_values = 0, pass_site = 0; \
@@ -1079,33 +1275,34 @@ static int vector_logic_or(token_t *atok, token_t *btok, int or_type)
     { \
         if ( (atok)->nsamples && (btok)->nsamples ) \
         { \
+            double *aval = (atok)->values, *bval = (btok)->values; \
+            uint8_t *pass = (atok)->pass_samples; \
             for (i=0; i<(atok)->nsamples; i++) \
             { \
-                has_values = 1; \
-                if ( (atok)->values[i] CMP_OP (btok)->values[i] ) { (atok)->pass_samples[i] = 1; pass_site = 1; } \
-                else (atok)->pass_samples[i] = 0; \
+                pass[i] = aval[i] CMP_OP bval[i]; \
+                pass_site |= pass[i]; \
             } \
-            if ( !has_values ) (atok)->nvalues = 0; \
         } \
         else if ( (atok)->nsamples ) \
         { \
+            double *aval = (atok)->values, bval = (btok)->values[0]; \
+            uint8_t *pass = (atok)->pass_samples; \
             for (i=0; i<(atok)->nsamples; i++) \
             { \
-                /*if ( bcf_double_is_missing((atok)->values[i]) ) { (atok)->pass_samples[i] = 0; continue; }*/ \
-                has_values = 1; \
-                if ( (atok)->values[i] CMP_OP (btok)->values[0] ) { (atok)->pass_samples[i] = 1; pass_site = 1; } \
-                else (atok)->pass_samples[i] = 0; \
+                pass[i] = aval[i] CMP_OP bval; \
+                pass_site |= pass[i]; \
             } \
-            if ( !has_values ) (atok)->nvalues = 0; \
         } \
         else if ( (btok)->nsamples ) \
         { \
+            double aval = (atok)->values[0], *bval = (btok)->values; \
+            uint8_t *pass = (atok)->pass_samples; \
             for (i=0; i<(btok)->nsamples; i++) \
             { \
-                if ( bcf_double_is_missing((btok)->values[i]) ) { (atok)->pass_samples[i] = 0; continue; } \
-                has_values = 1; \
-                if ( (atok)->values[0] CMP_OP (btok)->values[i] ) { (atok)->pass_samples[i] = 1; pass_site = 1; } \
-                else (atok)->pass_samples[i] = 0; \
+                int is_set = !bcf_double_is_missing(bval[i]); \
+                has_values |= is_set; \
+                pass[i] = is_set & (aval CMP_OP bval[i]); \
+                pass_site |= pass[i]; \
             } \
             (atok)->nvalues  = (btok)->nvalues; \
             (atok)->nsamples = (btok)->nsamples; \
@@ -1205,6 +1402,104 @@ static int cmp_vector_strings(token_t *atok, token_t *btok, int logic)    // log
     }
     return pass_site;
 }
+static void regex_lit_destroy(regex_lit_t *re)
+{
+    int i;
+    for (i=0; i<re->nlit; i++) free(re->lit[i].str);
+    free(re->lit);
+    free(re);
+}
+
+// Returns NULL if the pattern is not a literal string or an alternation of literals
+static regex_lit_t *regex_lit_init(const char *pattern, int icase)
+{
+    regex_lit_t *re = (regex_lit_t*) calloc(1,sizeof(regex_lit_t));
+    re->icase = icase;
+    kstring_t str = {0,0,0};
+    const char *ptr = pattern;
+    while ( 1 )
+    {
+        relit_t lit = {0,0,0,0};
+        str.l = 0;
+        kputs("", &str);
+        if ( *ptr=='^' ) { lit.beg = 1; ptr++; }
+        while ( *ptr )
+        {
+            if ( *ptr=='\\' )
+            {
+#ifdef __GLIBC__
+                if ( ptr[1]=='|' ) break;   // alternation is a GNU extension of basic regular expressions
+#endif
+                if ( !ptr[1] || !strchr(".[]*^$\\/", ptr[1]) ) goto not_literal;
+                kputc(ptr[1], &str);
+                ptr += 2;
+                continue;
+            }
+            if ( *ptr=='$' && (!ptr[1] || (ptr[1]=='\\' && ptr[2]=='|')) ) { lit.end = 1; ptr++; continue; }
+            if ( strchr(".[]*^$", *ptr) ) goto not_literal;
+            kputc(*ptr, &str);
+            ptr++;
+        }
+        lit.len = str.l;
+        lit.str = str.s;
+        str.s = NULL; str.m = 0;
+        re->nlit++;
+        re->lit = (relit_t*) realloc(re->lit, sizeof(relit_t)*re->nlit);
+        re->lit[re->nlit-1] = lit;
+        if ( !*ptr ) break;
+        ptr += 2;   // \|
+    }
+    return re;
+
+not_literal:
+    free(str.s);
+    regex_lit_destroy(re);
+    return NULL;
+}
+
+static int regex_lit_match(regex_lit_t *re, const char *str)
+{
+    int i, slen = -1;
+    for (i=0; i<re->nlit; i++)
+    {
+        relit_t *lit = &re->lit[i];
+        if ( lit->end && slen<0 ) slen = strlen(str);
+        if ( lit->beg )
+        {
+            if ( lit->end && slen!=lit->len ) continue;
+            if ( !(re->icase ? strncasecmp(str,lit->str,lit->len) : strncmp(str,lit->str,lit->len)) ) return 1;
+        }
+        else if ( lit->end )
+        {
+            if ( slen < lit->len ) continue;
+            const char *beg = str + slen - lit->len;
+            if ( !(re->icase ? strncasecmp(beg,lit->str,lit->len) : strncmp(beg,lit->str,lit->len)) ) return 1;
+        }
+        else if ( !re->icase )
+        {
+            if ( strstr(str,lit->str) ) return 1;
+        }
+        else
+        {
+            if ( slen<0 ) slen = strlen(str);
+            const char *beg = str, *end = str + slen - lit->len;
+            for (; beg<=end; beg++)
+                if ( !strncasecmp(beg,lit->str,lit->len) ) return 1;
+        }
+    }
+    return 0;
+}
+
+static inline int regex_match(token_t *tok, const char *str)
+{
+    if ( tok->relit ) return regex_lit_match(tok->relit, str);
+    int ret;
+    if ( khash_str2int_get(tok->rememo, str, &ret)==0 ) return ret;
+    ret = regexec(tok->regex, str, 0,NULL,0) ? 0 : 1;
+    if ( khash_str2int_size(tok->rememo) < REGEX_MEMO_MAX ) khash_str2int_set(tok->rememo, strdup(str), ret);
+    return ret;
+}
+
 static int regex_vector_strings(token_t *atok, token_t *btok, int negate)
 {
     int i, pass_site = 0;
@@ -1213,13 +1508,13 @@ static int regex_vector_strings(token_t *atok, token_t *btok, int negate)
         for (i=0; i<atok->nsamples; i++)
         {
             char *ptr = atok->str_value + i*(int)atok->values[0];
-            atok->pass_samples[i] = regexec(btok->regex, ptr, 0,NULL,0) ? 0 : 1;
+            atok->pass_samples[i] = regex_match(btok, ptr);
             if ( negate ) atok->pass_samples[i] = atok->pass_samples[i] ? 0 : 1;
             pass_site |= atok->pass_samples[i];
         }
         return pass_site;
     }
-    pass_site = regexec(btok->regex, atok->str_value, 0,NULL,0) ? 0 : 1;
+    pass_site = regex_match(btok, atok->str_value);
     if ( negate ) pass_site = pass_site ? 0 : 1;
     return pass_site;
 }
@@ -1519,6 +1814,180 @@ static void filter_debug_print(token_t *toks, token_t **tok_ptrs, int ntoks)
 }
 
 
+static inline int is_numeric_constant(token_t *tok)
+{
+    if ( tok->tok_type!=TOK_VAL ) return 0;
+    if ( tok->setter || tok->comparator || tok->key || tok->hash || tok->regex ) return 0;
+    return 1;
+}
+
+static int token_needs_fmt(token_t *tok)
+{
+    if ( tok->type==BCF_HL_FMT ) return 1;
+    if ( tok->setter==filters_set_nmissing ) return 1;
+    if ( tok->setter==filters_set_ac || tok->setter==filters_set_an || tok->setter==filters_set_mac ) return 1;
+    if ( tok->setter==filters_set_af || tok->setter==filters_set_maf ) return 1;
+    return 0;
+}
+
+static int prog_needs_fmt(flt_insn_t *prog, int beg, int end)
+{
+    int i;
+    for (i=beg; i<=end; i++)
+        if ( prog[i].op==FLT_OP_SET_FMT ) return 1;
+    return 0;
+}
+
+// Emit the subtree rooted at the instruction k of the program src into
+// filter->prog, returns the register holding the subtree's result. The
+// subtrees of AND operators which lie on the path from the root, i.e. their
+// result determines the final outcome via other AND operators only, are
+// evaluated site-level operand first and are followed by FLT_OP_SKIP: once
+// one of the operands fails, the whole expression is false and the other
+// operand, often a FORMAT field, does not need to be unpacked at all. The AND
+// operators are commutative, so the operands can be swapped.
+static int filter_reorder(filter_t *filter, flt_insn_t *src, int *start, int k)
+{
+    if ( src[k].op!=FLT_OP_AND )
+    {
+        memcpy(filter->prog + filter->nprog, src + start[k], sizeof(*src)*(k - start[k] + 1));
+        filter->nprog += k - start[k] + 1;
+        return src[k].a;
+    }
+    int iright = k - 1, ileft = start[iright] - 1;
+    if ( prog_needs_fmt(src, start[ileft], ileft) && !prog_needs_fmt(src, start[iright], iright) )
+    {
+        int tmp = ileft; ileft = iright; iright = tmp;
+    }
+
+    int a = filter_reorder(filter, src, start, ileft);
+    flt_insn_t *insn = &filter->prog[filter->nprog++];
+    memset(insn, 0, sizeof(*insn));
+    insn->op   = FLT_OP_SKIP;
+    insn->itok = src[k].itok;
+    insn->a    = a;
+    insn->b    = -1;
+
+    int b = filter_reorder(filter, src, start, iright);
+    insn = &filter->prog[filter->nprog++];
+    *insn = src[k];
+    insn->a = a;
+    insn->b = b;
+    return a;
+}
+
+// Translate the RPN tokens into a flat program, see flt_insn_t. Arithmetic
+// operations on two numeric constants, such as the unary minus or "2*N_SAMPLES",
+// are folded at this point.
+static void filter_compile(filter_t *filter)
+{
+    token_t *toks = filter->filters;
+    int i, nstack = 0, *stack = (int*) malloc(sizeof(int)*filter->nfilters);
+    int *stack_start = (int*) malloc(sizeof(int)*filter->nfilters);  // the first instruction of each stack value
+    int *start = (int*) malloc(sizeof(int)*filter->nfilters);        // the first instruction of each subtree
+    filter->prog  = (flt_insn_t*) malloc(sizeof(flt_insn_t)*filter->nfilters);
+    filter->nprog = 0;
+    for (i=0; i<filter->nfilters; i++)
+    {
+        flt_insn_t *insn = &filter->prog[filter->nprog];
+        insn->tok_type = toks[i].tok_type;
+        insn->itok = i;
+        insn->a = insn->b = -1;
+        insn->len = 0;
+
+        if ( toks[i].tok_type==TOK_VAL )
+        {
+            if ( toks[i].setter )
+            {
+                insn->op = token_needs_fmt(&toks[i]) ? FLT_OP_SET_FMT : FLT_OP_SET;
+
+                // preallocate the buffers so that there is no reallocation when filtering
+                if ( toks[i].type==BCF_HL_FMT && filter->nsamples )
+                    hts_expand(double,filter->nsamples,toks[i].mvalues,toks[i].values);
+            }
+            else if ( toks[i].key )
+            {
+                insn->op  = FLT_OP_STR;
+                insn->len = strlen(toks[i].key);
+            }
+            else
+                insn->op = FLT_OP_NUM;
+            insn->a = i;
+            start[filter->nprog] = stack_start[nstack] = filter->nprog;
+            stack[nstack++] = i;
+            filter->nprog++;
+            continue;
+        }
+        if ( toks[i].tok_type==TOK_FUNC )   // all functions take only one argument
+        {
+            if ( nstack<1 ) error("Error occurred while processing the filter \"%s\" (1:%d)\n", filter->str,nstack);
+            insn->op = FLT_OP_FUNC;
+            insn->a  = stack[nstack-1];
+            start[filter->nprog] = stack_start[nstack-1];
+            filter->nprog++;
+            continue;
+        }
+        if ( nstack<2 )
+            error("Error occurred while processing the filter \"%s\" (1:%d)\n", filter->str,nstack);  // too few values left on the stack
+
+        insn->a = stack[nstack-2];
+        insn->b = stack[nstack-1];
+        start[filter->nprog] = stack_start[nstack-2];
+        nstack--;
+
+        switch (toks[i].tok_type)
+        {
+            case TOK_OR:
+            case TOK_OR_VEC:  insn->op = FLT_OP_OR; break;
+            case TOK_AND:
+            case TOK_AND_VEC: insn->op = FLT_OP_AND; break;
+            case TOK_ADD:  insn->op = FLT_OP_ADD; break;
+            case TOK_SUB:  insn->op = FLT_OP_SUB; break;
+            case TOK_MULT: insn->op = FLT_OP_MULT; break;
+            case TOK_DIV:  insn->op = FLT_OP_DIV; break;
+            case TOK_LE:
+            case TOK_LT:
+            case TOK_EQ:
+            case TOK_BT:
+            case TOK_BE:
+            case TOK_NE:
+            case TOK_LIKE:
+            case TOK_NLIKE: insn->op = FLT_OP_CMP; break;
+            default: error("FIXME: did not expect this .. tok_type %d = %d\n", i, toks[i].tok_type);
+        }
+
+        // constant folding: both operands are numeric constants loaded by the two preceding instructions
+        if ( insn->op>=FLT_OP_ADD && insn->op<=FLT_OP_DIV && filter->nprog>=2
+                && is_numeric_constant(&toks[insn->a]) && is_numeric_constant(&toks[insn->b])
+                && filter->prog[filter->nprog-1].op==FLT_OP_NUM && filter->prog[filter->nprog-1].a==insn->b
+                && filter->prog[filter->nprog-2].op==FLT_OP_NUM && filter->prog[filter->nprog-2].a==insn->a )
+        {
+            token_t *atok = &toks[insn->a], *btok = &toks[insn->b];
+            if ( insn->op==FLT_OP_ADD ) atok->threshold += btok->threshold;
+            else if ( insn->op==FLT_OP_SUB ) atok->threshold -= btok->threshold;
+            else if ( insn->op==FLT_OP_MULT ) atok->threshold *= btok->threshold;
+            else atok->threshold /= btok->threshold;
+            filter->nprog--;    // drop the load of b, the load of a now carries the result
+            continue;
+        }
+        filter->nprog++;
+    }
+    if ( nstack>1 ) error("Error occurred while processing the filter \"%s\" (2:%d)\n", filter->str,nstack);    // too few values left on the stack
+    if ( !nstack ) error("Could not parse the expression: [%s]\n", filter->str);
+
+    // the program can grow by one FLT_OP_SKIP per AND operator
+    flt_insn_t *src = filter->prog;
+    int nsrc = filter->nprog;
+    filter->prog  = (flt_insn_t*) malloc(sizeof(flt_insn_t)*nsrc*2);
+    filter->nprog = 0;
+    filter->iresult = filter_reorder(filter, src, start, nsrc - 1);
+
+    free(src);
+    free(start);
+    free(stack_start);
+    free(stack);
+}
+
 // Parse filter expression and convert to reverse polish notation. Dijkstra's shunting-yard algorithm
 filter_t *filter_init(bcf_hdr_t *hdr, const char *str)
 {
@@ -1646,9 +2115,29 @@ filter_t *filter_init(bcf_hdr_t *hdr, const char *str)
             }
             if ( regcomp(out[j].regex, out[j].key, cflags) )
                 error("Could not compile the regex expression \"%s\": %s\n", out[j].key,filter->str);
+            out[j].relit = regex_lit_init(out[j].key, cflags & REG_ICASE ? 1 : 0);
+            if ( !out[j].relit ) out[j].rememo = khash_str2int_init();
         }
         if ( out[i].tok_type!=TOK_VAL ) continue;
         if ( !out[i].tag ) continue;
+        if ( out[i].setter==filters_set_genotype_string && i+1<nout )
+        {
+            // GT="het" and other genotype classes are tested on the raw values, see filters_set_genotype_class()
+            int itok = -1, ival = -1, mask = 0;
+            if ( out[i+1].tok_type==TOK_EQ || out[i+1].tok_type==TOK_NE ) ival = i - 1, itok = i + 1;
+            else if ( i+2<nout && (out[i+2].tok_type==TOK_EQ || out[i+2].tok_type==TOK_NE) ) ival = i + 1, itok = i + 2;
+            if ( ival>=0 && out[ival].tok_type==TOK_VAL && out[ival].key ) mask = genotype_class_mask(out[ival].key);
+            if ( mask )
+            {
+                if ( !filter->gt_init ) init_genotype_class(filter);
+                out[i].setter    = filters_set_genotype_class;
+                out[i].is_str    = 0;
+                out[i].threshold = mask;
+                out[itok].comparator = filters_cmp_genotype_class;
+                i = itok;
+                continue;
+            }
+        }
         if ( !strcmp(out[i].tag,"TYPE") )
         {
             if ( i+1==nout ) error("Could not parse the expression: %s\n", filter->str);
@@ -1719,7 +2208,7 @@ filter_t *filter_init(bcf_hdr_t *hdr, const char *str)
     if ( mops ) free(ops);
     filter->filters   = out;
     filter->nfilters  = nout;
-    filter->flt_stack = (token_t **)malloc(sizeof(token_t*)*nout);
+    filter_compile(filter);
     return filter;
 }
 
@@ -1738,10 +2227,12 @@ void filter_destroy(filter_t *filter)
         {
             regfree(filter->filters[i].regex);
             free(filter->filters[i].regex);
+            if ( filter->filters[i].relit ) regex_lit_destroy(filter->filters[i].relit);
+            khash_str2int_destroy_free(filter->filters[i].rememo);
         }
     }
     free(filter->filters);
-    free(filter->flt_stack);
+    free(filter->prog);
     free(filter->str);
     free(filter->tmpi);
     free(filter->tmpf);
@@ -1750,165 +2241,182 @@ void filter_destroy(filter_t *filter)
 
 int filter_test(filter_t *filter, bcf1_t *line, const uint8_t **samples)
 {
-    bcf_unpack(line, filter->max_unpack);
-
-    int i, nstack = 0;
-    for (i=0; i<filter->nfilters; i++)
-    {
-        filter->filters[i].nsamples  = 0;
-        filter->filters[i].nvalues   = 0;
-        filter->filters[i].pass_site = -1;
-
-        if ( filter->filters[i].tok_type == TOK_VAL )
-        {
-            if ( filter->filters[i].setter )    // variable, query the VCF line
-                filter->filters[i].setter(filter, line, &filter->filters[i]);
-            else if ( filter->filters[i].key )  // string constant
-            {
-                filter->filters[i].str_value = filter->filters[i].key;
-                filter->filters[i].values[0] = filter->filters[i].values[0];
-                filter->filters[i].nvalues   = strlen(filter->filters[i].key);
-            }
-            else    // numeric constant
-            {
-                filter->filters[i].values[0] = filter->filters[i].threshold;
-                filter->filters[i].nvalues   = 1;
-            }
-
-            filter->flt_stack[nstack++] = &filter->filters[i];
-            continue;
-        }
-        else if ( filter->filters[i].tok_type == TOK_FUNC ) // all functions take only one argument
-        {
-            filter->filters[i].setter(filter, line, filter->flt_stack[nstack-1]);
-            continue;
-        }
-        if ( nstack<2 )
-            error("Error occurred while processing the filter \"%s\" (1:%d)\n", filter->str,nstack);  // too few values left on the stack
+    uint64_t prof_start = profile_start();
 
-        int is_str  = filter->flt_stack[nstack-1]->is_str + filter->flt_stack[nstack-2]->is_str;
-
-        if ( filter->filters[i].tok_type == TOK_OR || filter->filters[i].tok_type == TOK_OR_VEC )
-        {
-            if ( filter->flt_stack[nstack-1]->pass_site<0 || filter->flt_stack[nstack-2]->pass_site<0 )
-                error("Error occurred while processing the filter \"%s\" (%d %d OR)\n", filter->str,filter->flt_stack[nstack-2]->pass_site,filter->flt_stack[nstack-1]->pass_site);
-            filter->flt_stack[nstack-2]->pass_site = vector_logic_or(filter->flt_stack[nstack-2],filter->flt_stack[nstack-1], filter->filters[i].tok_type);
-            nstack--;
-            continue;
-        }
-        if ( filter->filters[i].tok_type == TOK_AND || filter->filters[i].tok_type == TOK_AND_VEC )
-        {
-            if ( filter->flt_stack[nstack-1]->pass_site<0 || filter->flt_stack[nstack-2]->pass_site<0 )
-                error("Error occurred while processing the filter \"%s\" (%d %d AND)\n", filter->str,filter->flt_stack[nstack-2]->pass_site,filter->flt_stack[nstack-1]->pass_site);
-            filter->flt_stack[nstack-2]->pass_site = vector_logic_and(filter->flt_stack[nstack-2],filter->flt_stack[nstack-1], filter->filters[i].tok_type);
-            nstack--;
-            continue;
-        }
-
-        if ( filter->filters[i].tok_type == TOK_ADD )
-        {
-            VECTOR_ARITHMETICS(filter->flt_stack[nstack-2],filter->flt_stack[nstack-1],+);
-            nstack--;
-            continue;
-        }
-        else if ( filter->filters[i].tok_type == TOK_SUB )
-        {
-            VECTOR_ARITHMETICS(filter->flt_stack[nstack-2],filter->flt_stack[nstack-1],-);
-            nstack--;
-            continue;
-        }
-        else if ( filter->filters[i].tok_type == TOK_MULT )
-        {
-            VECTOR_ARITHMETICS(filter->flt_stack[nstack-2],filter->flt_stack[nstack-1],*);
-            nstack--;
-            continue;
-        }
-        else if ( filter->filters[i].tok_type == TOK_DIV )
-        {
-            VECTOR_ARITHMETICS(filter->flt_stack[nstack-2],filter->flt_stack[nstack-1],/);
-            nstack--;
-            continue;
-        }
+    // FORMAT fields are unpacked only when the site-level part of the expression does not decide
+    bcf_unpack(line, filter->max_unpack & ~BCF_UN_FMT);
+    filter->ntested++;
+    profile_count(PROF_NFLT_TESTED, 1);
+    int fmt_used = 0;
 
-        int is_true = 0;
-        if ( filter->filters[i].comparator )
-            is_true = filter->filters[i].comparator(filter->flt_stack[nstack-1],filter->flt_stack[nstack-2],filter->filters[i].tok_type,line);
-        else if ( !filter->flt_stack[nstack-1]->nvalues || !filter->flt_stack[nstack-2]->nvalues )
+    token_t *toks = filter->filters;
+    int i;
+    for (i=0; i<filter->nprog; i++)
+    {
+        flt_insn_t *insn = &filter->prog[i];
+        token_t *atok = &toks[insn->a];
+        token_t *btok = insn->b >= 0 ? &toks[insn->b] : NULL;
+        switch (insn->op)
+        {
+            case FLT_OP_NUM:
+                atok->nsamples  = 0;
+                atok->pass_site = -1;
+                atok->values[0] = atok->threshold;
+                atok->nvalues   = 1;
+                continue;
+            case FLT_OP_STR:
+                atok->nsamples  = 0;
+                atok->pass_site = -1;
+                atok->str_value = atok->key;
+                atok->nvalues   = insn->len;
+                continue;
+            case FLT_OP_SET:    // variable, query the VCF line
+                atok->nsamples  = 0;
+                atok->nvalues   = 0;
+                atok->pass_site = -1;
+                atok->setter(filter, line, atok);
+                continue;
+            case FLT_OP_SET_FMT:
+                if ( !(line->unpacked & BCF_UN_FMT) ) bcf_unpack(line, BCF_UN_FMT);
+                fmt_used = 1;
+                atok->nsamples  = 0;
+                atok->nvalues   = 0;
+                atok->pass_site = -1;
+                atok->setter(filter, line, atok);
+                continue;
+            case FLT_OP_SKIP:   // left operand of an AND on the path to the root failed, the result is known
+                if ( atok->pass_site ) continue;
+                toks[filter->iresult].pass_site = 0;
+                toks[filter->iresult].nsamples  = 0;
+                i = filter->nprog;
+                continue;
+            case FLT_OP_FUNC:
+                toks[insn->itok].setter(filter, line, atok);
+                continue;
+            case FLT_OP_OR:
+                if ( atok->pass_site<0 || btok->pass_site<0 )
+                    error("Error occurred while processing the filter \"%s\" (%d %d OR)\n", filter->str,atok->pass_site,btok->pass_site);
+                atok->pass_site = vector_logic_or(atok, btok, insn->tok_type);
+                continue;
+            case FLT_OP_AND:
+                if ( atok->pass_site<0 || btok->pass_site<0 )
+                    error("Error occurred while processing the filter \"%s\" (%d %d AND)\n", filter->str,atok->pass_site,btok->pass_site);
+                atok->pass_site = vector_logic_and(atok, btok, insn->tok_type);
+                continue;
+            case FLT_OP_ADD:  VECTOR_ARITHMETICS(atok,btok,+); continue;
+            case FLT_OP_SUB:  VECTOR_ARITHMETICS(atok,btok,-); continue;
+            case FLT_OP_MULT: VECTOR_ARITHMETICS(atok,btok,*); continue;
+            case FLT_OP_DIV:  VECTOR_ARITHMETICS(atok,btok,/); continue;
+        }
+
+        // FLT_OP_CMP
+        int tok_type = insn->tok_type;
+        int is_str   = atok->is_str + btok->is_str;
+        int is_true  = 0;
+        if ( toks[insn->itok].comparator )
+            is_true = toks[insn->itok].comparator(btok,atok,tok_type,line);
+        else if ( !btok->nvalues || !atok->nvalues )
         {
             int skip = 0;
-            if ( !filter->flt_stack[nstack-2]->is_missing && !filter->flt_stack[nstack-1]->is_missing ) skip = 1;
-            if ( filter->filters[i].tok_type != TOK_EQ  && filter->filters[i].tok_type != TOK_NE ) skip = 1;
-
-            if ( skip ) 
-                filter->flt_stack[nstack-2]->nvalues = filter->flt_stack[nstack-2]->nsamples = 0;
-            else if ( filter->filters[i].tok_type == TOK_EQ )
-                CMP_MISSING(filter->flt_stack[nstack-2],filter->flt_stack[nstack-1],==,is_true)
-            else if ( filter->filters[i].tok_type == TOK_NE )
-                CMP_MISSING(filter->flt_stack[nstack-2],filter->flt_stack[nstack-1],!=,is_true)
-        }
-        else if ( filter->filters[i].tok_type == TOK_EQ )
-        {
-            if ( filter->flt_stack[nstack-1]->comparator )
-                is_true = filter->flt_stack[nstack-1]->comparator(filter->flt_stack[nstack-1],filter->flt_stack[nstack-2],TOK_EQ,line);
-            else if ( filter->flt_stack[nstack-2]->comparator )
-                is_true = filter->flt_stack[nstack-2]->comparator(filter->flt_stack[nstack-2],filter->flt_stack[nstack-1],TOK_EQ,line);
+            if ( !atok->is_missing && !btok->is_missing ) skip = 1;
+            if ( tok_type != TOK_EQ && tok_type != TOK_NE ) skip = 1;
+
+            if ( skip )
+                atok->nvalues = atok->nsamples = 0;
+            else if ( tok_type == TOK_EQ )
+                CMP_MISSING(atok,btok,==,is_true)
+            else if ( tok_type == TOK_NE )
+                CMP_MISSING(atok,btok,!=,is_true)
+        }
+        else if ( tok_type == TOK_EQ )
+        {
+            if ( btok->comparator )
+                is_true = btok->comparator(btok,atok,TOK_EQ,line);
+            else if ( atok->comparator )
+                is_true = atok->comparator(atok,btok,TOK_EQ,line);
             else if ( is_str==2 )   // both are strings
-                is_true = cmp_vector_strings(filter->flt_stack[nstack-2],filter->flt_stack[nstack-1],TOK_EQ);
+                is_true = cmp_vector_strings(atok,btok,TOK_EQ);
             else if ( is_str==1 )
                 error("Comparing string to numeric value: %s\n", filter->str);
             else
-                CMP_VECTORS(filter->flt_stack[nstack-2],filter->flt_stack[nstack-1],==,is_true);
+                CMP_VECTORS(atok,btok,==,is_true);
         }
-        else if ( filter->filters[i].tok_type == TOK_NE )
+        else if ( tok_type == TOK_NE )
         {
-            if ( filter->flt_stack[nstack-1]->comparator )
-                is_true = filter->flt_stack[nstack-1]->comparator(filter->flt_stack[nstack-1],filter->flt_stack[nstack-2],TOK_NE,line);
-            else if ( filter->flt_stack[nstack-2]->comparator )
-                is_true = filter->flt_stack[nstack-2]->comparator(filter->flt_stack[nstack-2],filter->flt_stack[nstack-1],TOK_NE,line);
+            if ( btok->comparator )
+                is_true = btok->comparator(btok,atok,TOK_NE,line);
+            else if ( atok->comparator )
+                is_true = atok->comparator(atok,btok,TOK_NE,line);
             else if ( is_str==2 )
-                is_true = cmp_vector_strings(filter->flt_stack[nstack-2],filter->flt_stack[nstack-1],TOK_NE);
+                is_true = cmp_vector_strings(atok,btok,TOK_NE);
             else if ( is_str==1 )
                 error("Comparing string to numeric value: %s\n", filter->str);
             else
-                CMP_VECTORS(filter->flt_stack[nstack-2],filter->flt_stack[nstack-1],!=,is_true);
+                CMP_VECTORS(atok,btok,!=,is_true);
         }
-        else if ( filter->filters[i].tok_type == TOK_LIKE || filter->filters[i].tok_type == TOK_NLIKE )
+        else if ( tok_type == TOK_LIKE || tok_type == TOK_NLIKE )
         {
             if ( is_str==2 )
-                is_true = regex_vector_strings(filter->flt_stack[nstack-2],filter->flt_stack[nstack-1], filter->filters[i].tok_type == TOK_LIKE ? 0 : 1);
+                is_true = regex_vector_strings(atok,btok, tok_type == TOK_LIKE ? 0 : 1);
             else
                 error("The regex operator can be used on strings only: %s\n", filter->str);
         }
         else if ( is_str>0 )
-            error("Wrong operator in string comparison: %s [%s,%s]\n", filter->str, filter->flt_stack[nstack-1]->str_value, filter->flt_stack[nstack-2]->str_value);
-        else if ( filter->filters[i].tok_type == TOK_LE )
-            CMP_VECTORS(filter->flt_stack[nstack-2],filter->flt_stack[nstack-1],<=,is_true)
-        else if ( filter->filters[i].tok_type == TOK_LT )
-            CMP_VECTORS(filter->flt_stack[nstack-2],filter->flt_stack[nstack-1],<,is_true)
-        else if ( filter->filters[i].tok_type == TOK_BT )
-            CMP_VECTORS(filter->flt_stack[nstack-2],filter->flt_stack[nstack-1],>,is_true)
-        else if ( filter->filters[i].tok_type == TOK_BE )
-            CMP_VECTORS(filter->flt_stack[nstack-2],filter->flt_stack[nstack-1],>=,is_true)
+            error("Wrong operator in string comparison: %s [%s,%s]\n", filter->str, btok->str_value, atok->str_value);
+        else if ( tok_type == TOK_LE )
+            CMP_VECTORS(atok,btok,<=,is_true)
+        else if ( tok_type == TOK_LT )
+            CMP_VECTORS(atok,btok,<,is_true)
+        else if ( tok_type == TOK_BT )
+            CMP_VECTORS(atok,btok,>,is_true)
+        else if ( tok_type == TOK_BE )
+            CMP_VECTORS(atok,btok,>=,is_true)
         else
-            error("FIXME: did not expect this .. tok_type %d = %d\n", i, filter->filters[i].tok_type);
+            error("FIXME: did not expect this .. tok_type %d = %d\n", insn->itok, tok_type);
 
-        filter->flt_stack[nstack-2]->pass_site = is_true;
-        nstack--;
+        atok->pass_site = is_true;
     }
-    if ( nstack>1 ) error("Error occurred while processing the filter \"%s\" (2:%d)\n", filter->str,nstack);    // too few values left on the stack
+
+    if ( !fmt_used && filter->max_unpack&BCF_UN_FMT )
+    {
+        filter->nsite_only++;
+        profile_count(PROF_NFLT_SITE_ONLY, 1);
+    }
+
+    token_t *result = &toks[filter->iresult];
     if ( samples )
     {
-        *samples = filter->max_unpack&BCF_UN_FMT ? filter->flt_stack[0]->pass_samples : NULL;
-        if ( *samples && !filter->flt_stack[0]->nsamples )
+        *samples = filter->max_unpack&BCF_UN_FMT ? result->pass_samples : NULL;
+        if ( *samples && !result->nsamples )
         {
             for (i=0; i<filter->nsamples; i++)
-                filter->flt_stack[0]->pass_samples[i] = filter->flt_stack[0]->pass_site;
+                result->pass_samples[i] = result->pass_site;
         }
     }
-    return filter->flt_stack[0]->pass_site;
+    profile_stop(PROF_FILTER, prof_start);
+    return result->pass_site;
 }
 
 int filter_max_unpack(filter_t *flt)
 {
     return flt->max_unpack;
 }
+
+void filter_stats(filter_t *flt, uint64_t *ntested, uint64_t *nsite_only)
+{
+    *ntested    = flt->ntested;
+    *nsite_only = flt->nsite_only;
+}
+
+void print_filter_stats(filter_t **filters, int nfilters)
+{
+    uint64_t ntested = 0, nsite_only = 0;
+    int i;
+    for (i=0; i<nfilters; i++)
+    {
+        ntested    += filters[i]->ntested;
+        nsite_only += filters[i]->nsite_only;
+    }
+    fprintf(stderr,"Filter stats: %"PRIu64" records tested, %"PRIu64" (%.1f%%) decided without FORMAT fields\n",
+        ntested, nsite_only, ntested ? 100.*nsite_only/ntested : 0);
+}
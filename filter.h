@@ -47,6 +47,26 @@ void filter_destroy(filter_t *filter);
 int filter_test(filter_t *filter, bcf1_t *rec, const uint8_t **samples);
 
 void filter_expression_info(FILE *fp);
+
+/**
+  *  filter_max_unpack() - the BCF_UN_* flags required by the expression. Note
+  *  that filter_test() unpacks FORMAT fields only when the site-level part of
+  *  the expression does not decide the outcome, but readers of VCF text must
+  *  still be instructed to parse them.
+  */
 int filter_max_unpack(filter_t *filter);
 
+/**
+  *  filter_stats() - the number of records tested so far and the number of
+  *  those which were decided without unpacking FORMAT fields even though the
+  *  expression references them
+  */
+void filter_stats(filter_t *filter, uint64_t *ntested, uint64_t *nsite_only);
+
+/**
+  *  print_filter_stats() - print the filter_stats() counts summed over the
+  *  filters to stderr, used by --filter-stats
+  */
+void print_filter_stats(filter_t **filters, int nfilters);
+
 #endif
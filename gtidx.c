@@ -0,0 +1,296 @@
+/*  gtidx.c -- genotype-only sidecar index of VCF/BCF files.
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <htslib/vcf.h>
+#include <htslib/bgzf.h>
+#include <htslib/kstring.h>
+#include "bcftools.h"
+#include "gtidx.h"
+
+#define GTI_MAGIC     "GTI\1"
+#define GTI_MAX_SITES 1024
+#define GTI_MAX_BYTES (8*1024*1024)
+
+// The plane flags
+#define GTI_ZEROS 0
+#define GTI_ONES  1
+#define GTI_BITS  2
+
+struct _gtidx_t
+{
+    BGZF *fp;
+    bcf_hdr_t *hdr;
+    int nsmpl, nbytes;      // samples and bytes per plane
+    bcf1_t *rec;
+    int32_t *gts, *vals;
+    int mgts, mvals;
+    kstring_t blk;          // the current block
+    size_t off;             // the read offset in blk
+    int rid, nsites, isite, nals;
+};
+
+static inline int gt_value(int32_t gt)
+{
+    if ( gt==bcf_int32_vector_end ) return 0;
+    if ( gt<0 ) return 1;
+    return (gt>>1) + 1;
+}
+
+static void put_plane(kstring_t *blk, uint8_t *plane, int nbytes, int nset, int nsmpl)
+{
+    if ( !nset ) kputc(GTI_ZEROS, blk);
+    else if ( nset==nsmpl ) kputc(GTI_ONES, blk);
+    else
+    {
+        kputc(GTI_BITS, blk);
+        kputsn((char*)plane, nbytes, blk);
+    }
+}
+
+static void encode_site(kstring_t *blk, bcf_hdr_t *hdr, bcf1_t *rec, int32_t **gt, int *mgt, uint8_t *plane, int nbytes)
+{
+    int i, j, b, nsmpl = bcf_hdr_nsamples(hdr);
+    int ngt = bcf_get_genotypes(hdr, rec, gt, mgt);
+    int ploidy = ngt>0 && nsmpl ? ngt/nsmpl : 0;
+    if ( ploidy > 255 ) error("Ploidy %d not supported by the genotype index at %s:%d\n", ploidy, bcf_seqname(hdr,rec), rec->pos+1);
+
+    int vmax = 0, nbits = 0;
+    for (i=0; i<nsmpl*ploidy; i++)
+    {
+        int v = gt_value((*gt)[i]);
+        if ( vmax < v ) vmax = v;
+    }
+    while ( (1<<nbits) <= vmax ) nbits++;
+
+    int32_t site[3] = { rec->pos, rec->rlen, rec->n_allele };
+    kputsn((char*)site, sizeof(site), blk);
+    kputc(ploidy, blk);
+    kputc(nbits, blk);
+    for (j=0; j<ploidy; j++)
+    {
+        int32_t *ptr = *gt + j;
+        for (b=0; b<=nbits; b++)
+        {
+            // the value bits and then the phase
+            int nset = 0;
+            memset(plane, 0, nbytes);
+            for (i=0; i<nsmpl; i++)
+            {
+                int v = gt_value(ptr[i*ploidy]);
+                int bit = b<nbits ? (v>>b)&1 : (v && (ptr[i*ploidy]&1));
+                if ( !bit ) continue;
+                plane[i>>3] |= 1<<(i&7);
+                nset++;
+            }
+            put_plane(blk, plane, nbytes, nset, nsmpl);
+        }
+    }
+}
+
+static int write_block(BGZF *fp, kstring_t *blk, int nsites, int rid, int beg, int end)
+{
+    int32_t hdr[5] = { nsites, rid, beg, end, blk->l };
+    if ( bgzf_write(fp, hdr, sizeof(hdr)) != sizeof(hdr) ) return -1;
+    if ( blk->l && bgzf_write(fp, blk->s, blk->l) != blk->l ) return -1;
+    blk->l = 0;
+    return 0;
+}
+
+int gtidx_build(const char *fname, const char *idx_fname, int n_threads)
+{
+    struct stat st;
+    if ( stat(fname, &st)!=0 ) return -1;
+    htsFile *fp = hts_open(fname, "r");
+    if ( !fp ) return -1;
+    if ( n_threads ) hts_set_threads(fp, n_threads);
+    bcf_hdr_t *hdr = bcf_hdr_read(fp);
+    if ( !hdr ) { hts_close(fp); return -1; }
+
+    kstring_t str = {0,0,0};
+    if ( !idx_fname ) { ksprintf(&str, "%s.gti", fname); idx_fname = str.s; }
+    BGZF *out = bgzf_open(idx_fname, "w");
+    if ( !out ) error("Could not write %s\n", idx_fname);
+
+    int ret = 0;
+    int32_t nsmpl = bcf_hdr_nsamples(hdr);
+    int64_t src[2] = { st.st_size, st.st_mtime };
+    if ( bgzf_write(out, GTI_MAGIC, 4)!=4 || bgzf_write(out, src, sizeof(src))!=sizeof(src) || bgzf_write(out, &nsmpl, 4)!=4 ) ret = -1;
+
+    int nbytes = (nsmpl+7)/8, nsites = 0, rid = -1, beg = 0, end = 0, mgt = 0;
+    uint8_t *plane = (uint8_t*) malloc(nbytes ? nbytes : 1);
+    int32_t *gt = NULL;
+    kstring_t blk = {0,0,0};
+    bcf1_t *rec = bcf_init();
+    while ( !ret && bcf_read(fp, hdr, rec)==0 )
+    {
+        if ( nsites && (rec->rid!=rid || nsites>=GTI_MAX_SITES || blk.l>=GTI_MAX_BYTES) )
+        {
+            ret = write_block(out, &blk, nsites, rid, beg, end);
+            nsites = 0;
+        }
+        if ( !nsites ) { rid = rec->rid; beg = rec->pos; }
+        end = rec->pos;
+        encode_site(&blk, hdr, rec, &gt, &mgt, plane, nbytes);
+        nsites++;
+    }
+    if ( !ret && nsites ) ret = write_block(out, &blk, nsites, rid, beg, end);
+    if ( !ret ) ret = write_block(out, &blk, 0, -1, 0, 0);   // the end marker
+    if ( bgzf_close(out)!=0 ) ret = -1;
+
+    bcf_destroy(rec);
+    bcf_hdr_destroy(hdr);
+    hts_close(fp);
+    free(plane);
+    free(gt);
+    free(blk.s);
+    free(str.s);
+    return ret;
+}
+
+gtidx_t *gtidx_open(const char *fname, bcf_hdr_t *hdr)
+{
+    struct stat st;
+    if ( !fname || !strcmp("-",fname) || stat(fname, &st)!=0 ) return NULL;
+
+    kstring_t str = {0,0,0};
+    ksprintf(&str, "%s.gti", fname);
+    BGZF *fp = bgzf_open(str.s, "r");
+    free(str.s);
+    if ( !fp ) return NULL;
+
+    char magic[4];
+    int64_t src[2];
+    int32_t nsmpl;
+    if ( bgzf_read(fp, magic, 4)!=4 || memcmp(magic, GTI_MAGIC, 4)
+        || bgzf_read(fp, src, sizeof(src))!=sizeof(src) || bgzf_read(fp, &nsmpl, 4)!=4
+        || src[0]!=st.st_size || src[1]!=st.st_mtime || nsmpl!=bcf_hdr_nsamples(hdr) )
+    {
+        bgzf_close(fp);
+        return NULL;
+    }
+    gtidx_t *gi = (gtidx_t*) calloc(1, sizeof(gtidx_t));
+    gi->fp = fp;
+    gi->hdr = hdr;
+    gi->nsmpl = nsmpl;
+    gi->nbytes = (nsmpl+7)/8;
+    gi->rec = bcf_init();
+    return gi;
+}
+
+void gtidx_close(gtidx_t *gi)
+{
+    if ( !gi ) return;
+    bgzf_close(gi->fp);
+    bcf_destroy(gi->rec);
+    free(gi->gts);
+    free(gi->vals);
+    free(gi->blk.s);
+    free(gi);
+}
+
+static int read_block(gtidx_t *gi)
+{
+    int32_t hdr[5];
+    if ( bgzf_read(gi->fp, hdr, sizeof(hdr))!=sizeof(hdr) ) error("Could not read the genotype index\n");
+    if ( !hdr[0] ) return -1;
+    gi->nsites = hdr[0];
+    gi->rid    = hdr[1];
+    gi->isite  = 0;
+    gi->off    = 0;
+    gi->blk.l  = 0;
+    if ( ks_resize(&gi->blk, hdr[4]) < 0 ) error("Could not alloc %d bytes\n", hdr[4]);
+    if ( bgzf_read(gi->fp, gi->blk.s, hdr[4])!=hdr[4] ) error("Could not read the genotype index\n");
+    gi->blk.l = hdr[4];
+    return 0;
+}
+
+static inline const uint8_t *get_bytes(gtidx_t *gi, size_t n)
+{
+    if ( gi->off + n > gi->blk.l ) error("Corrupted genotype index\n");
+    const uint8_t *ptr = (const uint8_t*) gi->blk.s + gi->off;
+    gi->off += n;
+    return ptr;
+}
+
+// Add the plane as bit `b` of the values
+static void get_plane(gtidx_t *gi, int b)
+{
+    int i, flag = *get_bytes(gi, 1);
+    if ( flag==GTI_ZEROS ) return;
+    if ( flag==GTI_ONES )
+    {
+        for (i=0; i<gi->nsmpl; i++) gi->vals[i] |= 1<<b;
+        return;
+    }
+    if ( flag!=GTI_BITS ) error("Corrupted genotype index\n");
+    const uint8_t *plane = get_bytes(gi, gi->nbytes);
+    for (i=0; i<gi->nsmpl; i++)
+        gi->vals[i] |= ((plane[i>>3]>>(i&7))&1)<<b;
+}
+
+bcf1_t *gtidx_next(gtidx_t *gi)
+{
+    if ( gi->isite >= gi->nsites && read_block(gi)<0 ) return NULL;
+    gi->isite++;
+
+    int32_t site[3];
+    memcpy(site, get_bytes(gi, sizeof(site)), sizeof(site));
+    int i, j, b, ploidy = *get_bytes(gi, 1), nbits = *get_bytes(gi, 1);
+
+    bcf1_t *rec = gi->rec;
+    bcf_clear(rec);
+    rec->rid  = gi->rid;
+    rec->pos  = site[0];
+    gi->nals  = site[2];
+    rec->n_sample = gi->nsmpl;
+    rec->unpacked |= BCF_UN_SHR;    // there is no shared block to unpack
+    if ( ploidy )
+    {
+        hts_expand(int32_t, gi->nsmpl*ploidy, gi->mgts, gi->gts);
+        hts_expand(int32_t, gi->nsmpl, gi->mvals, gi->vals);
+        for (j=0; j<ploidy; j++)
+        {
+            memset(gi->vals, 0, sizeof(*gi->vals)*gi->nsmpl);
+            for (b=0; b<nbits; b++) get_plane(gi, b);
+            for (i=0; i<gi->nsmpl; i++)
+                gi->gts[i*ploidy+j] = gi->vals[i] ? (gi->vals[i]-1)<<1 : bcf_int32_vector_end;
+            // the phase bits
+            memset(gi->vals, 0, sizeof(*gi->vals)*gi->nsmpl);
+            get_plane(gi, 0);
+            for (i=0; i<gi->nsmpl; i++)
+                if ( gi->vals[i] ) gi->gts[i*ploidy+j] |= 1;
+        }
+        if ( bcf_update_genotypes(gi->hdr, rec, gi->gts, gi->nsmpl*ploidy) ) error("Could not update GT field\n");
+    }
+    rec->rlen = site[1];
+    return rec;
+}
+
+int gtidx_nallele(gtidx_t *gi)
+{
+    return gi->nals;
+}
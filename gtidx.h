@@ -0,0 +1,80 @@
+/*  gtidx.h -- genotype-only sidecar index of VCF/BCF files.
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.  */
+
+/*
+    A sidecar file with only the genotypes of a VCF/BCF, for commands which
+    need nothing else. It is written by `bcftools index --gt` next to the
+    indexed file as FILE.gti and read back as records which carry only CHROM,
+    POS, rlen and FORMAT/GT:
+
+        gtidx_t *gi = gtidx_open(fname, hdr);
+        if ( gi ) while ( (rec = gtidx_next(gi)) ) ...
+        gtidx_close(gi);
+
+    The file is BGZF compressed and consists of blocks of sites from a single
+    contig. Each block starts with the contig and the range of positions so
+    that the blocks can be skipped without decoding. The genotypes of a site
+    are stored as bit-planes: for each ploidy slot the value v (0 for
+    vector_end, 1 for missing, allele+2 otherwise) is split into nbits planes
+    of one bit per sample, followed by a plane of the phase bits. Planes which
+    are all zeros or all ones, for example the high bit of biallelic sites
+    without missing genotypes, take a single byte.
+
+    The header records the size and the modification time of the source, a
+    sidecar which does not match is ignored by gtidx_open().
+*/
+
+#ifndef __GTIDX_H__
+#define __GTIDX_H__
+
+#include <htslib/vcf.h>
+
+typedef struct _gtidx_t gtidx_t;
+
+/*
+ *  gtidx_build() - write the genotype index of fname
+ *  @idx_fname:  the output file name or NULL for fname.gti
+ *
+ *  Returns 0 on success or -1 on error
+ */
+int gtidx_build(const char *fname, const char *idx_fname, int n_threads);
+
+/*
+ *  gtidx_open() - open the genotype index of fname, the samples of hdr must
+ *  match those of the index
+ *
+ *  Returns NULL if there is no index, it is out of date or does not match
+ *  the header. The caller can then fall back to the usual readers.
+ */
+gtidx_t *gtidx_open(const char *fname, bcf_hdr_t *hdr);
+
+/*
+ *  gtidx_next() - the next record, owned by gtidx_t and valid until the next
+ *  call, or NULL at the end. Only rid, pos, rlen and FORMAT/GT are set,
+ *  gtidx_nallele() gives the number of alleles of the site.
+ */
+bcf1_t *gtidx_next(gtidx_t *gi);
+int gtidx_nallele(gtidx_t *gi);
+
+void gtidx_close(gtidx_t *gi);
+
+#endif
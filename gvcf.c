@@ -30,13 +30,50 @@ struct _gvcf_t
     int *dp_range, ndp_range;   // per-sample DP ranges
     int prev_range;             // 0 if not in a block
     int32_t *dp, mdp, *pl, mpl, npl;
-    int32_t *tmp, mtmp, *gts, ngts,mgts, nqsum,mqsum;
+    int32_t *gts, ngts,mgts, nqsum,mqsum;
     float *qsum;
     int32_t rid, start, end, min_dp;
     kstring_t als;
     bcf1_t *line;
+    const bcf_hdr_t *hdr;       // the header of the cached tag ids
+    int dp_id, pl_id, end_id;
 };
 
+static void init_tag_ids(gvcf_t *gvcf, const bcf_hdr_t *hdr)
+{
+    if ( gvcf->hdr==hdr ) return;
+    gvcf->hdr    = hdr;
+    gvcf->dp_id  = bcf_hdr_id2int(hdr, BCF_DT_ID, "DP");
+    gvcf->pl_id  = bcf_hdr_id2int(hdr, BCF_DT_ID, "PL");
+    gvcf->end_id = bcf_hdr_id2int(hdr, BCF_DT_ID, "END");
+}
+
+// Read the i-th value of an integer FORMAT field directly from the record,
+// missing values are converted as by bcf_get_format_int32()
+static inline int32_t fmt_int32(const bcf_fmt_t *fmt, int i)
+{
+    switch (fmt->type)
+    {
+        case BCF_BT_INT8:
+        {
+            int8_t val = ((int8_t*)fmt->p)[i];
+            if ( val==bcf_int8_missing ) return bcf_int32_missing;
+            if ( val==bcf_int8_vector_end ) return bcf_int32_vector_end;
+            return val;
+        }
+        case BCF_BT_INT16:
+        {
+            int16_t val = ((int16_t*)fmt->p)[i];
+            if ( val==bcf_int16_missing ) return bcf_int32_missing;
+            if ( val==bcf_int16_vector_end ) return bcf_int32_vector_end;
+            return val;
+        }
+        case BCF_BT_INT32: return ((int32_t*)fmt->p)[i];
+    }
+    error("Unexpected type %d\n", fmt->type);
+    return 0;
+}
+
 void gvcf_update_header(gvcf_t *gvcf, bcf_hdr_t *hdr)
 {
     bcf_hdr_append(hdr,"##INFO=<ID=END,Number=1,Type=Integer,Description=\"End position of the variant described in this record\">");
@@ -77,7 +114,6 @@ void gvcf_destroy(gvcf_t *gvcf)
     free(gvcf->dp_range);
     free(gvcf->dp);
     free(gvcf->pl);
-    free(gvcf->tmp);
     free(gvcf->qsum);
     free(gvcf->gts);
     free(gvcf->als.s);
@@ -87,7 +123,7 @@ void gvcf_destroy(gvcf_t *gvcf)
 
 bcf1_t *gvcf_write(gvcf_t *gvcf, htsFile *fh, bcf_hdr_t *hdr, bcf1_t *rec, int is_ref)
 {
-    int i, ret, nsmpl = bcf_hdr_nsamples(hdr);
+    int i, nsmpl = bcf_hdr_nsamples(hdr);
     int can_collapse = is_ref ? 1 : 0;
     int32_t dp_range = 0, min_dp = 0;
 
@@ -100,17 +136,23 @@ bcf1_t *gvcf_write(gvcf_t *gvcf, htsFile *fh, bcf_hdr_t *hdr, bcf1_t *rec, int i
 
 
     // Can the record be included in a gVCF block? That is, is this a ref-only site?
+    // Nearly all sites are, the FORMAT fields are read in place and the record is
+    // unpacked only at the start of a new block.
+    bcf_fmt_t *dp_fmt = NULL;
     if ( rec && can_collapse )
     {
-        bcf_unpack(rec, BCF_UN_ALL);
+        init_tag_ids(gvcf, hdr);
 
         // per-sample depth
-        ret = bcf_get_format_int32(hdr, rec, "DP", &gvcf->tmp, &gvcf->mtmp);
-        if ( ret==nsmpl )
+        dp_fmt = gvcf->dp_id>=0 ? bcf_get_fmt_id(rec, gvcf->dp_id) : NULL;
+        if ( dp_fmt && dp_fmt->n==1 && dp_fmt->p )
         {
-            min_dp = gvcf->tmp[0];
+            min_dp = fmt_int32(dp_fmt, 0);
             for (i=1; i<nsmpl; i++)
-                if ( min_dp > gvcf->tmp[i] ) min_dp = gvcf->tmp[i];
+            {
+                int32_t dp = fmt_int32(dp_fmt, i);
+                if ( min_dp > dp ) min_dp = dp;
+            }
 
             for (i=0; i<gvcf->ndp_range; i++)
                 if ( min_dp < gvcf->dp_range[i] ) break;
@@ -170,8 +212,9 @@ bcf1_t *gvcf_write(gvcf_t *gvcf, htsFile *fh, bcf_hdr_t *hdr, bcf1_t *rec, int i
     {
         if ( !gvcf->prev_range )
         {
+            bcf_unpack(rec, BCF_UN_ALL);
             hts_expand(int32_t,nsmpl,gvcf->mdp,gvcf->dp);
-            memcpy(gvcf->dp,gvcf->tmp,nsmpl*sizeof(int32_t));   // tmp still contains DP from rec
+            for (i=0; i<nsmpl; i++) gvcf->dp[i] = fmt_int32(dp_fmt, i);
             gvcf->npl = bcf_get_format_int32(hdr, rec, "PL", &gvcf->pl, &gvcf->mpl);
 
             gvcf->nqsum = bcf_get_info_float(hdr,rec,"QS",&gvcf->qsum,&gvcf->mqsum);
@@ -192,28 +235,33 @@ bcf1_t *gvcf_write(gvcf_t *gvcf, htsFile *fh, bcf_hdr_t *hdr, bcf1_t *rec, int i
         {
             if ( gvcf->min_dp > min_dp ) gvcf->min_dp = min_dp;
             for (i=0; i<nsmpl; i++)
-                if ( gvcf->dp[i] > gvcf->tmp[i] ) gvcf->dp[i] = gvcf->tmp[i];
-            ret = bcf_get_format_int32(hdr, rec, "PL", &gvcf->tmp, &gvcf->mtmp);
-            if ( ret>=0 )
             {
-                if ( ret!=nsmpl*3 ) error("Unexpected number of PL fields\n");
+                int32_t dp = fmt_int32(dp_fmt, i);
+                if ( gvcf->dp[i] > dp ) gvcf->dp[i] = dp;
+            }
+            bcf_fmt_t *pl_fmt = gvcf->pl_id>=0 ? bcf_get_fmt_id(rec, gvcf->pl_id) : NULL;
+            if ( pl_fmt && pl_fmt->p )
+            {
+                if ( pl_fmt->n!=3 ) error("Unexpected number of PL fields\n");
                 for (i=0; i<nsmpl; i++)
                 {
-                    if ( gvcf->pl[3*i+1] > gvcf->tmp[3*i+1] )
+                    int32_t pl1 = fmt_int32(pl_fmt, 3*i+1), pl2 = fmt_int32(pl_fmt, 3*i+2);
+                    if ( gvcf->pl[3*i+1] > pl1 )
                     {
-                        gvcf->pl[3*i+1] = gvcf->tmp[3*i+1];
-                        gvcf->pl[3*i+2] = gvcf->tmp[3*i+2];
+                        gvcf->pl[3*i+1] = pl1;
+                        gvcf->pl[3*i+2] = pl2;
                     }
-                    else if ( gvcf->pl[3*i+1]==gvcf->tmp[3*i+1] && gvcf->pl[3*i+2] > gvcf->tmp[3*i+2] )
-                        gvcf->pl[3*i+2] = gvcf->tmp[3*i+2];
+                    else if ( gvcf->pl[3*i+1]==pl1 && gvcf->pl[3*i+2] > pl2 )
+                        gvcf->pl[3*i+2] = pl2;
                 }
             }
             else
                 gvcf->npl = 0;
         }
         gvcf->prev_range = dp_range;
-        if ( bcf_get_info_int32(hdr,rec,"END",&gvcf->tmp,&gvcf->mtmp)==1 )
-            gvcf->end = gvcf->tmp[0] - 1;   // from 1-based to 0-based
+        bcf_info_t *end_info = gvcf->end_id>=0 ? bcf_get_info_id(rec, gvcf->end_id) : NULL;
+        if ( end_info && end_info->len==1 && end_info->type!=BCF_BT_FLOAT && end_info->type!=BCF_BT_CHAR )
+            gvcf->end = end_info->v1.i - 1;   // from 1-based to 0-based
         else
             gvcf->end = rec->pos;
         return NULL;
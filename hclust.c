@@ -133,30 +133,48 @@ hclust_t *hclust_init(int n, float *pdist)
     int i;
     for (i=0; i<clust->ndat; i++) append_node(clust,i);
 
-    // build the tree
+    // Build the tree using the nearest-neighbour chain: follow the nearest
+    // neighbours from any cluster until two clusters are each other's nearest
+    // neighbours, then merge them. The complete linkage is reducible, so the
+    // rest of the chain stays valid after a merge. This takes O(n^2) rather than
+    // O(n^3) steps. With distinct distances the tree is the same as when merging
+    // the globally closest pair each time. With tied distances, a different one
+    // of the tied pairs may be merged first and the tree can differ, though it
+    // is still determined by pdist and the order of the samples.
+    node_t **chain = (node_t**) malloc(sizeof(node_t*)*clust->ndat);
+    int nchain = 0;
     while ( clust->nclust>1 )
     {
-        // find two clusters with minimum distance
-        float min_value = HUGE_VAL;
-        node_t *iclust = clust->first->next;
-        node_t *min_iclust = NULL, *min_jclust = NULL;
-        while ( iclust )
+        if ( !nchain ) chain[nchain++] = clust->first;
+        node_t *iclust = chain[nchain-1];
+        node_t *prev   = nchain>1 ? chain[nchain-2] : NULL;
+
+        // find the nearest neighbour, in case of ties prefer the previous
+        // element of the chain so that the chain cannot cycle
+        float min_value = prev ? PDIST(clust->pdist,iclust->idx,prev->idx) : HUGE_VAL;
+        node_t *min_jclust = prev, *jclust = clust->first;
+        while ( jclust )
         {
-            node_t *jclust = clust->first;
-            while ( jclust!=iclust )
+            if ( jclust!=iclust )
             {
                 float value = PDIST(clust->pdist,iclust->idx,jclust->idx);
-                if ( value < min_value ) 
-                { 
+                if ( value < min_value )
+                {
                     min_value  = value;
-                    min_iclust = iclust;
-                    min_jclust = jclust; 
+                    min_jclust = jclust;
                 }
-                jclust = jclust->next;
             }
-            iclust = iclust->next;
+            jclust = jclust->next;
+        }
+        assert( min_jclust ); // pdist contains inf or nan, fix the caller
+        if ( min_jclust!=prev )
+        {
+            chain[nchain++] = min_jclust;
+            continue;
         }
-        assert( min_iclust && min_jclust ); // pdist contains inf or nan, fix the caller
+        nchain -= 2;
+
+        node_t *min_iclust = iclust;
         remove_node(clust,min_iclust);
         remove_node(clust,min_jclust);
 
@@ -179,6 +197,7 @@ hclust_t *hclust_init(int n, float *pdist)
         node->akid->parent = node;
         node->bkid->parent = node;
     }
+    free(chain);
 
     return clust;
 }
@@ -0,0 +1,109 @@
+/*  hdrmerge.c -- merging of many VCF/BCF headers.
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.  */
+
+#include <stdlib.h>
+#include <string.h>
+#include <htslib/vcf.h>
+#include <htslib/kstring.h>
+#include <htslib/khash_str2int.h>
+#include "bcftools.h"
+#include "hdrmerge.h"
+
+struct _hdrmerge_t
+{
+    void *seen;         // hash: text of the header lines in dst
+    const bcf_hdr_t *dst;
+    kstring_t str;
+};
+
+hdrmerge_t *hdrmerge_init(void)
+{
+    hdrmerge_t *hm = (hdrmerge_t*) calloc(1,sizeof(hdrmerge_t));
+    hm->seen = khash_str2int_init();
+    return hm;
+}
+
+void hdrmerge_destroy(hdrmerge_t *hm)
+{
+    if ( !hm ) return;
+    khash_str2int_destroy_free(hm->seen);
+    free(hm->str.s);
+    free(hm);
+}
+
+// Returns 1 if the line was not seen before; it is remembered as seen
+static int hdrmerge_is_new(hdrmerge_t *hm, bcf_hrec_t *hrec)
+{
+    hm->str.l = 0;
+    bcf_hrec_format(hrec, &hm->str);
+    if ( khash_str2int_has_key(hm->seen, hm->str.s) ) return 0;
+    khash_str2int_inc(hm->seen, strdup(hm->str.s));
+    return 1;
+}
+
+static void hdrmerge_reset(hdrmerge_t *hm, const bcf_hdr_t *dst)
+{
+    int i;
+    khash_str2int_clear_free(hm->seen);
+    for (i=0; i<dst->nhrec; i++) hdrmerge_is_new(hm, dst->hrec[i]);
+    hm->dst = dst;
+}
+
+// The checks bcf_hdr_merge() makes when a tag is defined in both headers
+static void hdrmerge_check_tag(bcf_hrec_t *dst, bcf_hrec_t *src)
+{
+    if ( src->type!=BCF_HL_INFO && src->type!=BCF_HL_FMT ) return;
+    int isrc = bcf_hrec_find_key(src, "Number"), idst = bcf_hrec_find_key(dst, "Number");
+    if ( isrc>=0 && idst>=0 && strcmp(src->vals[isrc], dst->vals[idst]) )
+        fprintf(stderr,"Warning: trying to combine \"%s\" tag definitions of different lengths\n", src->vals[0]);
+    isrc = bcf_hrec_find_key(src, "Type"), idst = bcf_hrec_find_key(dst, "Type");
+    if ( isrc>=0 && idst>=0 && strcmp(src->vals[isrc], dst->vals[idst]) )
+        fprintf(stderr,"Warning: trying to combine \"%s\" tag definitions of different types\n", src->vals[0]);
+}
+
+bcf_hdr_t *hdrmerge_add(hdrmerge_t *hm, bcf_hdr_t *dst, const bcf_hdr_t *src)
+{
+    if ( !dst )
+    {
+        dst = bcf_hdr_dup(src);
+        hdrmerge_reset(hm, dst);
+        return dst;
+    }
+    if ( hm->dst!=dst ) hdrmerge_reset(hm, dst);
+
+    int i;
+    for (i=0; i<src->nhrec; i++)
+    {
+        bcf_hrec_t *hrec = src->hrec[i];
+        if ( !hdrmerge_is_new(hm, hrec) ) continue;
+        if ( hrec->type==BCF_HL_GEN )
+        {
+            if ( hrec->value ) bcf_hdr_add_hrec(dst, bcf_hrec_dup(hrec));
+            continue;
+        }
+        int j = bcf_hrec_find_key(hrec, "ID");
+        bcf_hrec_t *rec = j>=0 ? bcf_hdr_get_hrec(dst, hrec->type, "ID", hrec->vals[j], hrec->type==BCF_HL_STR ? hrec->key : NULL) : NULL;
+        if ( rec ) hdrmerge_check_tag(rec, hrec);
+        else bcf_hdr_add_hrec(dst, bcf_hrec_dup(hrec));
+    }
+    return dst;
+}
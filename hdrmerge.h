@@ -0,0 +1,57 @@
+/*  hdrmerge.h -- merging of many VCF/BCF headers.
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.  */
+
+/*
+    bcf_hdr_merge() compares every line of the source header with the lines
+    of the destination, the generic lines one by one, and syncs the
+    destination each time something is added. When merging thousands of
+    files, which mostly share the same header lines, this dominates the
+    start-up. A hdrmerge_t remembers the text of all lines merged so far:
+    the lines seen before are skipped with a hash lookup and only the new
+    ones are added, without syncing. The caller syncs once at the end.
+
+        hdrmerge_t *hm = hdrmerge_init();
+        for (i=0; i<nfiles; i++)
+            out_hdr = hdrmerge_add(hm, out_hdr, hdr[i]);
+        bcf_hdr_sync(out_hdr);
+        hdrmerge_destroy(hm);
+*/
+
+#ifndef __HDRMERGE_H__
+#define __HDRMERGE_H__
+
+#include <htslib/vcf.h>
+
+typedef struct _hdrmerge_t hdrmerge_t;
+
+hdrmerge_t *hdrmerge_init(void);
+void hdrmerge_destroy(hdrmerge_t *hm);
+
+/*
+ *  hdrmerge_add() - add the header lines of src to dst, like bcf_hdr_merge().
+ *  When dst is NULL, a copy of src including the samples is returned. The
+ *  samples are not merged otherwise. The returned header must be synced
+ *  with bcf_hdr_sync() before use.
+ */
+bcf_hdr_t *hdrmerge_add(hdrmerge_t *hm, bcf_hdr_t *dst, const bcf_hdr_t *src);
+
+#endif
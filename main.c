@@ -30,6 +30,7 @@ THE SOFTWARE.  */
 #include <htslib/hts.h>
 #include "version.h"
 #include "bcftools.h"
+#include "profile.h"
 
 int main_tabix(int argc, char *argv[]);
 int main_vcfindex(int argc, char *argv[]);
@@ -46,6 +47,7 @@ int main_vcfcall(int argc, char *argv[]);
 int main_vcfannotate(int argc, char *argv[]);
 int main_vcfroh(int argc, char *argv[]);
 int main_vcfconcat(int argc, char *argv[]);
+int main_vcfsort(int argc, char *argv[]);
 int main_reheader(int argc, char *argv[]);
 int main_vcfconvert(int argc, char *argv[]);
 int main_vcfcnv(int argc, char *argv[]);
@@ -120,6 +122,10 @@ static cmd_t cmds[] =
       .alias = "reheader",
       .help  = "modify VCF/BCF header, change sample names"
     },
+    { .func  = main_vcfsort,
+      .alias = "sort",
+      .help  = "sort VCF/BCF file"
+    },
     { .func  = main_vcfview,
       .alias = "view",
       .help  = "VCF/BCF conversion, view, subset and filter VCF/BCF files"
@@ -198,7 +204,7 @@ static void usage(FILE *fp)
 #endif
     fprintf(fp, "Version: %s (using htslib %s)\n", bcftools_version(), hts_version());
     fprintf(fp, "\n");
-    fprintf(fp, "Usage:   bcftools [--version|--version-only] [--help] <command> <argument>\n");
+    fprintf(fp, "Usage:   bcftools [--version|--version-only] [--help] [--profile[=FILE]] <command> <argument>\n");
     fprintf(fp, "\n");
     fprintf(fp, "Commands:\n");
 
@@ -228,6 +234,16 @@ int main(int argc, char *argv[])
 {
     if (argc < 2) { usage(stderr); return 1; }
 
+    // "bcftools --profile[=file.json] command ..." prints time spent in the main phases at exit
+    if ( !strcmp(argv[1],"--profile") || !strncmp(argv[1],"--profile=",10) )
+    {
+        if ( argc < 3 ) { usage(stderr); return 1; }
+        profile_init(argv[2], argv[1][9]=='=' ? argv[1]+10 : NULL);
+        argv[1] = argv[0];
+        argv++;
+        argc--;
+    }
+
     if (strcmp(argv[1], "version") == 0 || strcmp(argv[1], "--version") == 0 || strcmp(argv[1], "-v") == 0) {
         printf("bcftools %s\nUsing htslib %s\nCopyright (C) 2016 Genome Research Ltd.\n", bcftools_version(), hts_version());
 #if USE_GPL
@@ -23,6 +23,7 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.  */
 
 #include <math.h>
+#include <string.h>
 #include <htslib/kfunc.h>
 #include "call.h"
 
@@ -322,9 +323,70 @@ void mcall_destroy(call_t *call)
     free(call->pdg);
     free(call->als);
     free(call->ac);
+    free(call->cands);
     return;
 }
 
+// Initialize a private copy of src, which must have been initialized by
+// mcall_init(), for calling in parallel. The settings and the trio tables are
+// shared, the scratch buffers and the ploidy are private to the copy.
+void mcall_init_copy(call_t *call, call_t *src)
+{
+    int nsmpl = bcf_hdr_nsamples(src->hdr);
+    *call = *src;
+    call->nqsum    = 5;
+    call->qsum     = (float*) malloc(sizeof(float)*call->nqsum);
+    call->nals_map = 5;
+    call->als_map  = (int*) malloc(sizeof(int)*call->nals_map);
+    call->npl_map  = 5*(5+1)/2;
+    call->pl_map   = (int*) malloc(sizeof(int)*call->npl_map);
+    call->gts  = (int32_t*) calloc(nsmpl*2,sizeof(int32_t));
+    call->cgts = call->ugts = NULL;
+    call->GLs  = NULL;
+    if ( call->flag & CALL_CONSTR_TRIO )
+    {
+        call->cgts = (int32_t*) calloc(nsmpl,sizeof(int32_t));
+        call->ugts = (int32_t*) calloc(nsmpl,sizeof(int32_t));
+        call->GLs  = (double*) calloc(nsmpl*10,sizeof(double));
+    }
+    call->GQs = NULL;
+    if ( call->output_tags & (CALL_FMT_GQ|CALL_FMT_GP) )
+        call->GQs = (int32_t*) malloc(sizeof(int32_t)*nsmpl);
+    if ( src->ploidy )
+    {
+        call->ploidy = (uint8_t*) malloc(nsmpl);
+        memcpy(call->ploidy, src->ploidy, nsmpl);
+    }
+    call->vcmp   = NULL;
+    call->GPs    = NULL; call->nGPs = 0;
+    call->itmp   = NULL; call->n_itmp = 0;
+    call->PLs    = NULL; call->nPLs = call->mPLs = 0;
+    call->pdg    = NULL; call->npdg = 0;
+    call->anno16 = NULL; call->n16 = 0;
+    call->als    = NULL; call->nals = 0;
+    call->ac     = NULL; call->nac = 0;
+    call->cands  = NULL; call->ncands = call->mcands = 0;
+}
+
+void mcall_destroy_copy(call_t *call)
+{
+    free(call->qsum);
+    free(call->als_map);
+    free(call->pl_map);
+    free(call->gts); free(call->cgts); free(call->ugts);
+    free(call->GLs);
+    free(call->GQs);
+    free(call->GPs);
+    free(call->itmp);
+    free(call->PLs);
+    free(call->pdg);
+    free(call->anno16);
+    free(call->als);
+    free(call->ac);
+    free(call->cands);
+    free(call->ploidy);
+}
+
 
 // Inits P(D|G): convert PLs from log space and normalize. In case of zero
 // depth, missing PLs are all zero. In this case, pdg's are set to 0
@@ -336,9 +398,92 @@ void mcall_destroy(call_t *call)
 // the original samtools -c calling code uses pdgs in reverse order (AA comes
 // first, RR last).
 // NB: Ploidy is not taken into account here, which is incorrect.
+static void set_pdg1(double *pl2p, int *PLs, double *pdg, int n_gt, int nals, int unseen)
+{
+    int j;
+    double sum = 0;
+    for (j=0; j<n_gt; j++)
+    {
+        if ( PLs[j]==bcf_int32_vector_end )
+        {
+            // We expect diploid genotype likelihoods. If not diploid, treat as missing
+            j = 0;
+            break;
+        }
+        if ( PLs[j]==bcf_int32_missing ) break;
+        pdg[j] = PLs[j] < 256 ? pl2p[PLs[j]] : pow(10., -PLs[j]/10.);
+        sum += pdg[j];
+    }
+
+    if ( j==0 )
+    {
+        // First value is missing (LK of RR), this indicates that
+        // all values are missing.
+        j = sum = n_gt;
+    }
+    else if ( j<n_gt && unseen<0 )
+    {
+        // Some of the values are missing and the unseen allele LK is not
+        // available. In such a case, we set LK to a very small value.
+        sum = 0;
+        for (j=0; j<n_gt; j++)
+        {
+            assert( PLs[j]!=bcf_int32_vector_end );
+            if ( PLs[j]==bcf_int32_missing ) PLs[j] = 255;
+            pdg[j] = PLs[j] < 256 ? pl2p[PLs[j]] : pow(10., -PLs[j]/10.);
+            sum += pdg[j];
+        }
+    }
+    if ( j<n_gt )
+    {
+        // Missing values present, fill with unseen allele LK. This can be only
+        // as good as the merge was.
+        int ia,ib, k;
+        j = 0;
+        sum = 0;
+        for (ia=0; ia<nals; ia++)
+        {
+            for (ib=0; ib<=ia; ib++)
+            {
+                if ( PLs[j]==bcf_int32_missing )
+                {
+                    k = bcf_alleles2gt(ia,unseen);
+                    if ( PLs[k]==bcf_int32_missing ) k = bcf_alleles2gt(ib,unseen);
+                    if ( PLs[k]==bcf_int32_missing ) k = bcf_alleles2gt(unseen,unseen);
+                    if ( PLs[k]==bcf_int32_missing )
+                    {
+                        // The PLs for unseen allele X are not present as well as for ia, ib.
+                        // This can happen with incremental calling, when one of the merged
+                        // files had all alleles A,C,G,T, in such a case, X was not present.
+                        // Use a very small value instead.
+                        PLs[j] = 255;
+                    }
+                    else
+                        PLs[j] = PLs[k];
+                }
+                pdg[j] = pl2p[ PLs[j] ];
+                sum += pdg[j];
+                j++;
+            }
+        }
+    }
+    // Normalize: sum_i pdg_i = 1
+    if ( sum==n_gt )
+    {
+        // all missing
+        #if FLAT_PDG_FOR_MISSING
+            for (j=0; j<n_gt; j++) pdg[j] = 1./n_gt;
+        #else
+            for (j=0; j<n_gt; j++) pdg[j] = 0;
+        #endif
+    }
+    else
+        for (j=0; j<n_gt; j++) pdg[j] /= sum;
+}
+
 void set_pdg(double *pl2p, int *PLs, double *pdg, int n_smpl, int n_gt, int unseen)
 {
-    int i, j, nals;
+    int i, nals;
 
     // find out the number of alleles, expecting diploid genotype likelihoods
     bcf_gt2alleles(n_gt-1, &i, &nals);
@@ -347,89 +492,87 @@ void set_pdg(double *pl2p, int *PLs, double *pdg, int n_smpl, int n_gt, int unse
 
     for (i=0; i<n_smpl; i++)
     {
-        double sum = 0;
-        for (j=0; j<n_gt; j++)
-        {
-            if ( PLs[j]==bcf_int32_vector_end )
-            {
-                // We expect diploid genotype likelihoods. If not diploid, treat as missing
-                j = 0;
-                break;
-            }
-            if ( PLs[j]==bcf_int32_missing ) break;
-            pdg[j] = PLs[j] < 256 ? pl2p[PLs[j]] : pow(10., -PLs[j]/10.);
-            sum += pdg[j];
-        }
+        set_pdg1(pl2p, PLs, pdg, n_gt, nals, unseen);
+        PLs += n_gt;
+        pdg += n_gt;
+    }
+}
 
-        if ( j==0 )
-        {
-            // First value is missing (LK of RR), this indicates that
-            // all values are missing.
-            j = sum = n_gt;
-        }
-        else if ( j<n_gt && unseen<0 )
+// Widen one sample's PLs from the BCF encoding, returns 1 if there are missing or
+// out-of-table values which must go through set_pdg1()
+#define BRANCH_WIDEN_PLS(type_t, missing, vector_end, max) \
+{ \
+    type_t *p = (type_t*) src; \
+    for (j=0; j<n_gt; j++) \
+    { \
+        if ( p[j]==missing ) { PLs[j] = bcf_int32_missing; special = 1; } \
+        else if ( p[j]==vector_end ) \
+        { \
+            for (; j<n_gt; j++) PLs[j] = bcf_int32_vector_end; \
+            special = 1; \
+        } \
+        else \
+        { \
+            PLs[j] = p[j]; \
+            if ( p[j]<0 || p[j]>max ) special = 1; \
+        } \
+    } \
+}
+
+// The same as bcf_get_format_int32() followed by set_pdg(), but the PLs are
+// read from the int8 or int16 encoded FORMAT/PL directly and converted in a
+// single pass. Returns 0 if PL is not present in this form or not diploid.
+static int set_pdg_packed(call_t *call, bcf1_t *rec, int nals, int unseen)
+{
+    int n_gt = nals*(nals+1)/2;
+    bcf_fmt_t *fmt = bcf_get_fmt(call->hdr, rec, "PL");
+    if ( !fmt || !fmt->p || fmt->n!=n_gt ) return 0;
+    if ( fmt->type!=BCF_BT_INT8 && fmt->type!=BCF_BT_INT16 ) return 0;
+
+    int i, j, nsmpl = bcf_hdr_nsamples(call->hdr);
+    call->nPLs = nsmpl*n_gt;
+    hts_expand(int32_t, call->nPLs, call->mPLs, call->PLs);
+    hts_expand(double, call->nPLs, call->npdg, call->pdg);
+
+    int32_t *PLs = call->PLs;
+    double *pdg = call->pdg, *pl2p = call->pl2p;
+    for (i=0; i<nsmpl; i++)
+    {
+        uint8_t *src = fmt->p + i*fmt->size;
+        int special = 0;
+        if ( fmt->type==BCF_BT_INT8 )
+            BRANCH_WIDEN_PLS(int8_t, bcf_int8_missing, bcf_int8_vector_end, 255)
+        else
+            BRANCH_WIDEN_PLS(int16_t, bcf_int16_missing, bcf_int16_vector_end, 255)
+
+        if ( special )
+            set_pdg1(pl2p, PLs, pdg, n_gt, nals, unseen);
+        else
         {
-            // Some of the values are missing and the unseen allele LK is not
-            // available. In such a case, we set LK to a very small value.
-            sum = 0;
+            double sum = 0;
             for (j=0; j<n_gt; j++)
             {
-                assert( PLs[j]!=bcf_int32_vector_end );
-                if ( PLs[j]==bcf_int32_missing ) PLs[j] = 255;
-                pdg[j] = PLs[j] < 256 ? pl2p[PLs[j]] : pow(10., -PLs[j]/10.);
+                pdg[j] = pl2p[PLs[j]];
                 sum += pdg[j];
             }
-        }
-        if ( j<n_gt )
-        {
-            // Missing values present, fill with unseen allele LK. This can be only
-            // as good as the merge was.
-            int ia,ib, k;
-            j = 0;
-            sum = 0;
-            for (ia=0; ia<nals; ia++)
+            if ( sum==n_gt )
             {
-                for (ib=0; ib<=ia; ib++)
-                {
-                    if ( PLs[j]==bcf_int32_missing )
-                    {
-                        k = bcf_alleles2gt(ia,unseen);
-                        if ( PLs[k]==bcf_int32_missing ) k = bcf_alleles2gt(ib,unseen);
-                        if ( PLs[k]==bcf_int32_missing ) k = bcf_alleles2gt(unseen,unseen);
-                        if ( PLs[k]==bcf_int32_missing )
-                        {
-                            // The PLs for unseen allele X are not present as well as for ia, ib.
-                            // This can happen with incremental calling, when one of the merged
-                            // files had all alleles A,C,G,T, in such a case, X was not present.
-                            // Use a very small value instead.
-                            PLs[j] = 255;
-                        }
-                        else
-                            PLs[j] = PLs[k];
-                    }
-                    pdg[j] = pl2p[ PLs[j] ];
-                    sum += pdg[j];
-                    j++;
-                }
+                // all PLs zero, no coverage: the same as missing in set_pdg1()
+                #if FLAT_PDG_FOR_MISSING
+                    for (j=0; j<n_gt; j++) pdg[j] = 1./n_gt;
+                #else
+                    for (j=0; j<n_gt; j++) pdg[j] = 0;
+                #endif
             }
+            else
+                for (j=0; j<n_gt; j++) pdg[j] /= sum;
         }
-        // Normalize: sum_i pdg_i = 1
-        if ( sum==n_gt )
-        {
-            // all missing
-            #if FLAT_PDG_FOR_MISSING
-                for (j=0; j<n_gt; j++) pdg[j] = 1./n_gt;
-            #else
-                for (j=0; j<n_gt; j++) pdg[j] = 0;
-            #endif
-        }
-        else
-            for (j=0; j<n_gt; j++) pdg[j] /= sum;
-
         PLs += n_gt;
         pdg += n_gt;
     }
+    return 1;
 }
+#undef BRANCH_WIDEN_PLS
 
 /*
     Allele frequency estimated as:
@@ -577,8 +720,44 @@ static inline double logsumexp2(double a, double b)
 
 #define SWAP(type_t,x,y) {type_t tmp; tmp = x; x = y; y = tmp; }
 
+// Candidate combination of alleles evaluated by mcall_find_best_alleles()
+struct _mcall_cand_t
+{
+    int als;                // bitmask of the alleles
+    int nals, ngts;         // number of alleles (haploid genotypes) and diploid genotypes, 0 for single alleles
+    int idx[6];             // indexes of the genotypes in PL, homozygous first
+    double w2[6], w1[3];    // frequencies of the diploid and haploid genotypes
+    double mant;            // the product of per-sample likelihoods kept as mantissa..
+    int exp, lk_set;        // ..and binary exponent
+};
+
+// Multiplies the running product of likelihoods, renormalizing both the value and
+// the product before they could underflow
+#define LK_PROD_MIN 1e-150
+static inline void lk_prod_mul(mcall_cand_t *cand, double val)
+{
+    int e;
+    if ( val < LK_PROD_MIN ) { val = frexp(val, &e); cand->exp += e; }
+    cand->mant *= val;
+    if ( cand->mant < LK_PROD_MIN ) { cand->mant = frexp(cand->mant, &e); cand->exp += e; }
+}
+
+static mcall_cand_t *mcall_add_cand(call_t *call, int als)
+{
+    hts_expand(mcall_cand_t, call->ncands+1, call->mcands, call->cands);
+    mcall_cand_t *cand = &call->cands[call->ncands++];
+    memset(cand, 0, sizeof(*cand));
+    cand->als  = als;
+    cand->mant = 1;
+    return cand;
+}
+
 // Determine the most likely combination of alleles. In this implementation,
 // at most tri-allelic sites are considered. Returns the number of alleles.
+//
+// All candidate combinations are evaluated in a single pass over the samples
+// and the per-sample likelihoods are multiplied rather than summing their logs,
+// so that log() is called once per candidate instead of once per sample.
 static int mcall_find_best_alleles(call_t *call, int nals, int *out_als)
 {
     int ia,ib,ic;   // iterators over up to three alleles
@@ -589,21 +768,11 @@ static int mcall_find_best_alleles(call_t *call, int nals, int *out_als)
     int ngts  = nals*(nals+1)/2;
 
     // Single allele
+    call->ncands = 0;
     for (ia=0; ia<nals; ia++)
     {
-        double lk_tot  = 0;
-        int lk_tot_set = 0;
-        int iaa = (ia+1)*(ia+2)/2-1;    // index in PL which corresponds to the homozygous "ia/ia" genotype
-        int isample;
-        double *pdg = call->pdg + iaa;
-        for (isample=0; isample<nsmpl; isample++)
-        {
-            if ( *pdg ) { lk_tot += log(*pdg); lk_tot_set = 1; }
-            pdg += ngts;
-        }
-        if ( ia==0 ) ref_lk = lk_tot;   // likelihood of 0/0 for all samples
-        else lk_tot += call->theta; // the prior
-        UPDATE_MAX_LKs(1<<ia, ia>0 && lk_tot_set);
+        mcall_cand_t *cand = mcall_add_cand(call, 1<<ia);
+        cand->idx[0] = (ia+1)*(ia+2)/2-1;   // index in PL which corresponds to the homozygous "ia/ia" genotype
     }
 
     // Two alleles
@@ -616,28 +785,14 @@ static int mcall_find_best_alleles(call_t *call, int nals, int *out_als)
             for (ib=0; ib<ia; ib++)
             {
                 if ( call->qsum[ib]==0 ) continue;
-                double lk_tot  = 0;
-                int lk_tot_set = 0;
                 double fa  = call->qsum[ia]/(call->qsum[ia]+call->qsum[ib]);
                 double fb  = call->qsum[ib]/(call->qsum[ia]+call->qsum[ib]);
-                double fa2 = fa*fa;
-                double fb2 = fb*fb;
-                double fab = 2*fa*fb;
-                int isample, ibb = (ib+1)*(ib+2)/2-1, iab = iaa - ia + ib;
-                double *pdg  = call->pdg;
-                for (isample=0; isample<nsmpl; isample++)
-                {
-                    double val = 0;
-                    if ( !call->ploidy || call->ploidy[isample]==2 )
-                        val = fa2*pdg[iaa] + fb2*pdg[ibb] + fab*pdg[iab];
-                    else if ( call->ploidy && call->ploidy[isample]==1 )
-                        val = fa*pdg[iaa] + fb*pdg[ibb];
-                    if ( val ) { lk_tot += log(val); lk_tot_set = 1; }
-                    pdg += ngts;
-                }
-                if ( ia!=0 ) lk_tot += call->theta;    // the prior
-                if ( ib!=0 ) lk_tot += call->theta;
-                UPDATE_MAX_LKs(1<<ia|1<<ib, lk_tot_set);
+                int ibb = (ib+1)*(ib+2)/2-1, iab = iaa - ia + ib;
+                mcall_cand_t *cand = mcall_add_cand(call, 1<<ia|1<<ib);
+                cand->nals = 2; cand->ngts = 3;
+                cand->idx[0] = iaa; cand->w2[0] = fa*fa; cand->w1[0] = fa;
+                cand->idx[1] = ibb; cand->w2[1] = fb*fb; cand->w1[1] = fb;
+                cand->idx[2] = iab; cand->w2[2] = 2*fa*fb;
             }
         }
     }
@@ -657,42 +812,62 @@ static int mcall_find_best_alleles(call_t *call, int nals, int *out_als)
                 for (ic=0; ic<ib; ic++)
                 {
                     if ( call->qsum[ic]==0 ) continue;
-                    double lk_tot  = 0;
-                    int lk_tot_set = 1;
                     double fa  = call->qsum[ia]/(call->qsum[ia]+call->qsum[ib]+call->qsum[ic]);
                     double fb  = call->qsum[ib]/(call->qsum[ia]+call->qsum[ib]+call->qsum[ic]);
                     double fc  = call->qsum[ic]/(call->qsum[ia]+call->qsum[ib]+call->qsum[ic]);
-                    double fa2 = fa*fa;
-                    double fb2 = fb*fb;
-                    double fc2 = fc*fc;
-                    double fab = 2*fa*fb, fac = 2*fa*fc, fbc = 2*fb*fc;
-                    int isample, icc = (ic+1)*(ic+2)/2-1;
+                    int icc = (ic+1)*(ic+2)/2-1;
                     int iac = iaa - ia + ic, ibc = ibb - ib + ic;
-                    double *pdg = call->pdg;
-                    for (isample=0; isample<nsmpl; isample++)
-                    {
-                        double val = 0;
-                        if ( !call->ploidy || call->ploidy[isample]==2 )
-                            val = fa2*pdg[iaa] + fb2*pdg[ibb] + fc2*pdg[icc] + fab*pdg[iab] + fac*pdg[iac] + fbc*pdg[ibc];
-                        else if ( call->ploidy && call->ploidy[isample]==1 )
-                            val = fa*pdg[iaa] + fb*pdg[ibb] + fc*pdg[icc];
-                        if ( val ) { lk_tot += log(val); lk_tot_set = 1; }
-                        pdg += ngts;
-                    }
-                    if ( ia!=0 ) lk_tot += call->theta;    // the prior
-                    if ( ib!=0 ) lk_tot += call->theta;    // the prior
-                    if ( ic!=0 ) lk_tot += call->theta;    // the prior
-                    UPDATE_MAX_LKs(1<<ia|1<<ib|1<<ic, lk_tot_set);
+                    mcall_cand_t *cand = mcall_add_cand(call, 1<<ia|1<<ib|1<<ic);
+                    cand->nals = 3; cand->ngts = 6;
+                    cand->lk_set = 1;
+                    cand->idx[0] = iaa; cand->w2[0] = fa*fa; cand->w1[0] = fa;
+                    cand->idx[1] = ibb; cand->w2[1] = fb*fb; cand->w1[1] = fb;
+                    cand->idx[2] = icc; cand->w2[2] = fc*fc; cand->w1[2] = fc;
+                    cand->idx[3] = iab; cand->w2[3] = 2*fa*fb;
+                    cand->idx[4] = iac; cand->w2[4] = 2*fa*fc;
+                    cand->idx[5] = ibc; cand->w2[5] = 2*fb*fc;
                 }
             }
         }
     }
 
+    int i, j, isample;
+    double *pdg = call->pdg;
+    for (isample=0; isample<nsmpl; isample++)
+    {
+        int ploidy = call->ploidy ? call->ploidy[isample] : 2;
+        for (i=0; i<call->ncands; i++)
+        {
+            mcall_cand_t *cand = &call->cands[i];
+            double val = 0;
+            if ( !cand->ngts ) val = pdg[cand->idx[0]];
+            else if ( ploidy==2 )
+                for (j=0; j<cand->ngts; j++) val += cand->w2[j]*pdg[cand->idx[j]];
+            else if ( ploidy==1 )
+                for (j=0; j<cand->nals; j++) val += cand->w1[j]*pdg[cand->idx[j]];
+            if ( val ) { lk_prod_mul(cand, val); cand->lk_set = 1; }
+        }
+        pdg += ngts;
+    }
+
+    for (i=0; i<call->ncands; i++)
+    {
+        mcall_cand_t *cand = &call->cands[i];
+        double lk_tot = log(cand->mant) + cand->exp*M_LN2;
+        if ( cand->als==1 ) ref_lk = lk_tot;    // likelihood of 0/0 for all samples
+        for (ia=1; ia<nals; ia++)
+            if ( cand->als & 1<<ia ) lk_tot += call->theta;    // the prior
+        if ( !cand->ngts )
+            UPDATE_MAX_LKs(cand->als, cand->als>1 && cand->lk_set)
+        else
+            UPDATE_MAX_LKs(cand->als, cand->lk_set)
+    }
+
     call->ref_lk = ref_lk;
     call->lk_sum = lk_sum;
     *out_als = max_als;
 
-    int i, n = 0;
+    int n = 0;
     for (i=0; i<nals; i++) if ( max_als & 1<<i) n++;
 
     return n;
@@ -1394,15 +1569,17 @@ int mcall(call_t *call, bcf1_t *rec)
     hts_expand(int,nals,call->nals_map,call->als_map);
     hts_expand(int,nals*(nals+1)/2,call->npl_map,call->pl_map);
 
-    // Get the genotype likelihoods
-    call->nPLs = bcf_get_format_int32(call->hdr, rec, "PL", &call->PLs, &call->mPLs);
-    if ( call->nPLs!=nsmpl*nals*(nals+1)/2 && call->nPLs!=nsmpl*nals )  // a mixture of diploid and haploid or haploid only
-        error("Wrong number of PL fields? nals=%d npl=%d\n", nals,call->nPLs);
-
-    // Convert PLs to probabilities
+    // Get the genotype likelihoods and convert PLs to probabilities
     int ngts = nals*(nals+1)/2;
-    hts_expand(double, call->nPLs, call->npdg, call->pdg);
-    set_pdg(call->pl2p, call->PLs, call->pdg, nsmpl, ngts, unseen);
+    if ( !set_pdg_packed(call, rec, nals, unseen) )
+    {
+        call->nPLs = bcf_get_format_int32(call->hdr, rec, "PL", &call->PLs, &call->mPLs);
+        if ( call->nPLs!=nsmpl*nals*(nals+1)/2 && call->nPLs!=nsmpl*nals )  // a mixture of diploid and haploid or haploid only
+            error("Wrong number of PL fields? nals=%d npl=%d\n", nals,call->nPLs);
+
+        hts_expand(double, call->nPLs, call->npdg, call->pdg);
+        set_pdg(call->pl2p, call->PLs, call->pdg, nsmpl, ngts, unseen);
+    }
 
     #if QS_FROM_PDG
         estimate_qsum(call, rec);
@@ -38,12 +38,17 @@ DEALINGS IN THE SOFTWARE.  */
 #include <htslib/faidx.h>
 #include <htslib/kstring.h>
 #include <htslib/khash_str2int.h>
+#include <htslib/bgzf.h>
+#include <htslib/hfile.h>
+#include <htslib/thread_pool.h>
 #include <assert.h>
 #include "regidx.h"
 #include "bcftools.h"
 #include "bam2bcf.h"
 #include "bam_sample.h"
 #include "gvcf.h"
+#include "kheap.h"
+#include "tmpdir.h"
 
 #define MPLP_BCF        1
 #define MPLP_VCF        (1<<1)
@@ -58,9 +63,23 @@ DEALINGS IN THE SOFTWARE.  */
 #define MPLP_PRINT_MAPQ (1<<10)
 #define MPLP_PER_SAMPLE (1<<11)
 #define MPLP_SMART_OVERLAPS (1<<12)
+#define MPLP_LAZY_BAQ   (1<<13)
 
 typedef struct _mplp_aux_t mplp_aux_t;
 typedef struct _mplp_pileup_t mplp_pileup_t;
+typedef struct _mplp_glf_job_t mplp_glf_job_t;
+
+// Streaming per-sample downsampling with --downsample, see mplp_downsample()
+static inline int end_is_smaller(uint32_t *a, uint32_t *b) { return *a < *b ? 1 : 0; }
+KHEAP_INIT(end, uint32_t, end_is_smaller)
+typedef khp_end_t end_heap_t;
+
+typedef struct
+{
+    int tid, igen;                  // current sequence and the reset generation, see mplp_conf_t.dsmpl_gen
+    end_heap_t *all[2], *kept[2];   // end positions of the overlapping reads, per strand
+}
+mplp_dsmpl_t;
 
 // Data shared by all bam files
 typedef struct {
@@ -68,8 +87,15 @@ typedef struct {
     int rflag_require, rflag_filter, output_type;
     int openQ, extQ, tandemQ, min_support; // for indels
     double min_frac; // for indels
-    char *reg_fname, *pl_list, *fai_fname, *output_fname;
+    char *reg_fname, *pl_list, *fai_fname, *output_fname, *tmp_dir;
     int reg_is_file, record_cmd_line, n_threads;
+    int downsample, dsmpl_gen;  // per-sample depth cap and the reset counter, incremented with each new region
+    uint32_t seed;
+    mplp_dsmpl_t *dsmpl;
+    hts_tpool *pool;            // sample-parallel bcf_call_glfgen() at deep positions when not sharding
+    hts_tpool_process *glf_q;
+    mplp_glf_job_t *glf_jobs;
+    int nglf_jobs;
     faidx_t *fai;
     regidx_t *bed, *reg;    // bed: skipping regions, reg: index-jump to regions
     regitr_t *bed_itr, *reg_itr;
@@ -122,6 +148,14 @@ struct _mplp_pileup_t {
     bam_pileup1_t **plp;
 };
 
+// A range of samples processed by one thread in mplp_glfgen()
+#define MPLP_GLF_MIN_DEPTH 2000
+struct _mplp_glf_job_t {
+    mplp_conf_t *conf;
+    bcf_callaux_t *bca;     // private base buffer and bias counts
+    int beg, end, ref_base;
+};
+
 static int mplp_get_ref(mplp_aux_t *ma, int tid,  char **ref, int *ref_len) {
     mplp_ref_t *r = ma->ref;
 
@@ -179,6 +213,78 @@ static int mplp_get_ref(mplp_aux_t *ma, int tid,  char **ref, int *ref_len) {
     return 1;
 }
 
+// Deterministic pseudo-random number in [0,1) derived from the read name, so
+// that runs are reproducible. The mates are not coupled, the heap state in
+// mplp_downsample() differs for each of them.
+static inline double mplp_read_hash(const bam1_t *b, uint32_t seed)
+{
+    const uint8_t *s = (const uint8_t*) bam_get_qname(b);
+    uint32_t h = 2166136261u ^ seed;
+    for (; *s; s++) h = (h ^ *s) * 16777619u;
+    h ^= h >> 16; h *= 0x85ebca6b; h ^= h >> 13; h *= 0xc2b2ae35; h ^= h >> 16;
+    return h / 4294967296.0;
+}
+
+// Keep about conf->downsample reads per sample and position, split evenly
+// between the strands. Rather than taking the first reads, as the pileup's
+// max_depth does, each read is kept with the probability cap/depth where depth
+// is the number of reads overlapping its start. Assumes the reads of a sample
+// come sorted, which is only approximately true when a sample is spread across
+// multiple files.
+static int mplp_downsample(const mplp_conf_t *conf, bam1_t *b, int ismpl)
+{
+    mplp_dsmpl_t *ds = &conf->dsmpl[ismpl];
+    int i, strand = b->core.flag & BAM_FREVERSE ? 1 : 0;
+    if ( !ds->all[0] )
+        for (i=0; i<2; i++) ds->all[i] = khp_init(end), ds->kept[i] = khp_init(end);
+    if ( ds->tid != b->core.tid || ds->igen != conf->dsmpl_gen )
+    {
+        for (i=0; i<2; i++) ds->all[i]->ndat = ds->kept[i]->ndat = 0;
+        ds->tid  = b->core.tid;
+        ds->igen = conf->dsmpl_gen;
+    }
+    uint32_t beg = b->core.pos, end = bam_endpos(b) - 1;
+    end_heap_t *all = ds->all[strand], *kept = ds->kept[strand];
+    while ( all->ndat && all->dat[0] < beg ) khp_delete(end, all);
+    while ( kept->ndat && kept->dat[0] < beg ) khp_delete(end, kept);
+    khp_insert(end, all, &end);
+
+    int cap = (conf->downsample + 1) / 2;
+    if ( kept->ndat >= cap ) return 0;
+    if ( all->ndat > cap && mplp_read_hash(b, conf->seed) * all->ndat >= cap ) return 0;
+    khp_insert(end, kept, &end);
+    return 1;
+}
+
+// With --lazy-BAQ, realign only reads which could be misaligned: those with an
+// indel or with a base of sufficient quality mismatching the reference. BAQ can
+// only lower the qualities of a read which matches the reference everywhere,
+// so such reads never contribute to a variant call and are left as they are.
+static int mplp_need_baq(const mplp_conf_t *conf, const bam1_t *b, const char *ref, int ref_len)
+{
+    const uint32_t *cigar = bam_get_cigar(b);
+    const uint8_t *seq = bam_get_seq(b), *qual = bam_get_qual(b);
+    int k, j, x = b->core.pos, y = 0;
+    for (k=0; k<b->core.n_cigar; k++)
+    {
+        int op = bam_cigar_op(cigar[k]), len = bam_cigar_oplen(cigar[k]);
+        if ( op==BAM_CINS || op==BAM_CDEL ) return 1;
+        if ( op==BAM_CMATCH || op==BAM_CEQUAL || op==BAM_CDIFF )
+        {
+            if ( x + len > ref_len ) return 1;
+            for (j=0; j<len; j++)
+            {
+                int c = seq_nt16_table[(unsigned char)ref[x+j]];
+                if ( c!=bam_seqi(seq,y+j) && c!=15 && qual[y+j] >= conf->min_baseQ ) return 1;
+            }
+            x += len; y += len;
+        }
+        else if ( op==BAM_CSOFT_CLIP ) y += len;
+        else if ( op==BAM_CREF_SKIP ) x += len;
+    }
+    return 0;
+}
+
 static int mplp_func(void *data, bam1_t *b)
 {
     char *ref;
@@ -211,7 +317,8 @@ static int mplp_func(void *data, bam1_t *b)
             }
             if ( !overlap ) continue;
         }
-        if ( bam_smpl_get_sample_id(ma->conf->bsmpl,ma->bam_id,b)<0 ) continue;
+        int ismpl = bam_smpl_get_sample_id(ma->conf->bsmpl,ma->bam_id,b);
+        if ( ismpl<0 ) continue;
         if (ma->conf->flag & MPLP_ILLUMINA13) {
             int i;
             uint8_t *qual = bam_get_qual(b);
@@ -230,7 +337,16 @@ static int mplp_func(void *data, bam1_t *b)
             has_ref = 0;
         }
 
-        if (has_ref && (ma->conf->flag&MPLP_REALN)) sam_prob_realn(b, ref, ref_len, (ma->conf->flag & MPLP_REDO_BAQ)? 7 : 3);
+        if ( ma->conf->downsample )
+        {
+            // reject before the expensive BAQ the reads which would be filtered anyway, -C only lowers mapQ
+            if (b->core.qual < ma->conf->min_mq) continue;
+            if ((ma->conf->flag&MPLP_NO_ORPHAN) && (b->core.flag&BAM_FPAIRED) && !(b->core.flag&BAM_FPROPER_PAIR)) continue;
+            if ( !mplp_downsample(ma->conf, b, ismpl) ) continue;
+        }
+
+        if (has_ref && (ma->conf->flag&MPLP_REALN) && (!(ma->conf->flag&MPLP_LAZY_BAQ) || mplp_need_baq(ma->conf, b, ref, ref_len)))
+            sam_prob_realn(b, ref, ref_len, (ma->conf->flag & MPLP_REDO_BAQ)? 7 : 3);
         if (has_ref && ma->conf->capQ_thres > 10) {
             int q = sam_cap_mapq(b, ref, ref_len, ma->conf->capQ_thres);
             if (q < 0) continue;    // skip
@@ -301,6 +417,72 @@ static void flush_bcf_records(mplp_conf_t *conf, htsFile *fp, bcf_hdr_t *hdr, bc
     if ( rec ) bcf_write1(fp,hdr,rec);
 }
 
+static void *glfgen_job(void *arg)
+{
+    mplp_glf_job_t *job = (mplp_glf_job_t*) arg;
+    mplp_pileup_t *gplp = job->conf->gplp;
+    int i;
+    for (i = job->beg; i < job->end; ++i)
+        bcf_call_glfgen(gplp->n_plp[i], gplp->plp[i], job->ref_base, job->bca, job->conf->bcr + i);
+    return job;
+}
+
+// Compute the genotype likelihoods of all samples at a position. With --threads,
+// deep positions are split between the threads in sample ranges of similar depth.
+static void mplp_glfgen(mplp_conf_t *conf, int ref_base, int depth)
+{
+    int i, j;
+    if ( !conf->nglf_jobs || depth < MPLP_GLF_MIN_DEPTH )
+    {
+        for (i = 0; i < conf->gplp->n; ++i)
+            bcf_call_glfgen(conf->gplp->n_plp[i], conf->gplp->plp[i], ref_base, conf->bca, conf->bcr + i);
+        return;
+    }
+    int njobs = 0, nreads = 0;
+    for (i = j = 0; i < conf->gplp->n; ++i)
+    {
+        nreads += conf->gplp->n_plp[i];
+        if ( i+1 < conf->gplp->n && (njobs+1==conf->nglf_jobs || (double)nreads * conf->nglf_jobs < (double)depth * (njobs+1)) ) continue;
+        mplp_glf_job_t *job = &conf->glf_jobs[njobs++];
+        job->beg = j;
+        job->end = j = i + 1;
+        job->ref_base = ref_base;
+        if ( hts_tpool_dispatch(conf->pool, conf->glf_q, glfgen_job, job) < 0 )
+            error("Failed to dispatch the genotype likelihoods job\n");
+    }
+    for (i = 0; i < njobs; ++i)
+    {
+        hts_tpool_result *res = hts_tpool_next_result_wait(conf->glf_q);
+        if ( !res ) error("Failed to retrieve the genotype likelihoods job\n");
+        hts_tpool_delete_result(res, 0);
+    }
+    for (i = 0; i < njobs; ++i)
+        bcf_call_shard_merge(conf->bca, conf->glf_jobs[i].bca);
+}
+
+static void init_glf_jobs(mplp_conf_t *conf, hts_tpool *pool)
+{
+    int i;
+    conf->pool = pool;
+    conf->nglf_jobs = hts_tpool_size(pool);
+    conf->glf_q = hts_tpool_process_init(pool, conf->nglf_jobs, 0);
+    if ( !conf->glf_q ) error("Failed to initialize the thread pool queue\n");
+    conf->glf_jobs = (mplp_glf_job_t*) calloc(conf->nglf_jobs, sizeof(mplp_glf_job_t));
+    for (i = 0; i < conf->nglf_jobs; ++i)
+    {
+        conf->glf_jobs[i].conf = conf;
+        conf->glf_jobs[i].bca  = bcf_call_shard_init(conf->bca);
+    }
+}
+
+static void destroy_glf_jobs(mplp_conf_t *conf)
+{
+    int i;
+    for (i = 0; i < conf->nglf_jobs; ++i) bcf_call_shard_destroy(conf->glf_jobs[i].bca);
+    free(conf->glf_jobs);
+    hts_tpool_process_destroy(conf->glf_q);
+}
+
 static int mpileup_reg(mplp_conf_t *conf, uint32_t beg, uint32_t end)
 {
     bam_hdr_t *hdr = conf->mplp_data[0]->h; // header of first file in input list
@@ -325,8 +507,7 @@ static int mpileup_reg(mplp_conf_t *conf, uint32_t beg, uint32_t end)
         _ref0 = (ref && pos < ref_len)? ref[pos] : 'N';
         ref16 = seq_nt16_table[_ref0];
         bcf_callaux_clean(conf->bca, &conf->bc);
-        for (i = 0; i < conf->gplp->n; ++i)
-            bcf_call_glfgen(conf->gplp->n_plp[i], conf->gplp->plp[i], ref16, conf->bca, conf->bcr + i);
+        mplp_glfgen(conf, ref16, total_depth);
         conf->bc.tid = tid; conf->bc.pos = pos;
         bcf_call_combine(conf->gplp->n, conf->bcr, conf->bca, ref16, &conf->bc);
         bcf_clear1(conf->bcf_rec);
@@ -339,8 +520,7 @@ static int mpileup_reg(mplp_conf_t *conf, uint32_t beg, uint32_t end)
             && bcf_call_gap_prep(conf->gplp->n, conf->gplp->n_plp, conf->gplp->plp, pos, conf->bca, ref) >= 0)
         {
             bcf_callaux_clean(conf->bca, &conf->bc);
-            for (i = 0; i < conf->gplp->n; ++i)
-                bcf_call_glfgen(conf->gplp->n_plp[i], conf->gplp->plp[i], -1, conf->bca, conf->bcr + i);
+            mplp_glfgen(conf, -1, total_depth);
             if (bcf_call_combine(conf->gplp->n, conf->bcr, conf->bca, -1, &conf->bc) >= 0) 
             {
                 bcf_clear1(conf->bcf_rec);
@@ -352,6 +532,356 @@ static int mpileup_reg(mplp_conf_t *conf, uint32_t beg, uint32_t end)
     return 0;
 }
 
+static samFile *mplp_open_bam(mplp_conf_t *conf, const char *fname)
+{
+    samFile *fp = sam_open(fname, "rb");
+    if ( !fp )
+    {
+        fprintf(stderr, "[%s] failed to open %s: %s\n", __func__, fname, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (hts_set_opt(fp, CRAM_OPT_DECODE_MD, 0)) {
+        fprintf(stderr, "Failed to set CRAM_OPT_DECODE_MD value\n");
+        exit(EXIT_FAILURE);
+    }
+    if (conf->fai_fname && hts_set_fai_filename(fp, conf->fai_fname) != 0) {
+        fprintf(stderr, "[%s] failed to process %s: %s\n",
+                __func__, conf->fai_fname, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    return fp;
+}
+
+// Initialize the pileup and calling structures, the bams must be open already
+static void init_mplp_engine(mplp_conf_t *conf, int nsmpl)
+{
+    int i;
+    conf->gplp = (mplp_pileup_t *) calloc(1,sizeof(mplp_pileup_t));
+    conf->gplp->n = nsmpl;
+    conf->gplp->n_plp = (int*) calloc(conf->gplp->n, sizeof(int));
+    conf->gplp->m_plp = (int*) calloc(conf->gplp->n, sizeof(int));
+    conf->gplp->plp = (bam_pileup1_t**) calloc(conf->gplp->n, sizeof(bam_pileup1_t*));  
+
+    conf->bca = bcf_call_init(-1., conf->min_baseQ);
+    conf->bcr = (bcf_callret1_t*) calloc(nsmpl, sizeof(bcf_callret1_t));
+    conf->bca->openQ = conf->openQ, conf->bca->extQ = conf->extQ, conf->bca->tandemQ = conf->tandemQ;
+    conf->bca->min_frac = conf->min_frac;
+    conf->bca->min_support = conf->min_support;
+    conf->bca->per_sample_flt = conf->flag & MPLP_PER_SAMPLE;
+
+    conf->bc.bcf_hdr = conf->bcf_hdr;
+    conf->bc.n  = nsmpl;
+    conf->bc.PL = (int32_t*) malloc(15 * nsmpl * sizeof(*conf->bc.PL));
+    if (conf->fmt_flag)
+    {
+        assert( sizeof(float)==sizeof(int32_t) );
+        conf->bc.DP4 = (int32_t*) malloc(nsmpl * sizeof(int32_t) * 4);
+        conf->bc.fmt_arr = (uint8_t*) malloc(nsmpl * sizeof(float)); // all fmt_flag fields, float and int32
+        if ( conf->fmt_flag&(B2B_INFO_DPR|B2B_FMT_DPR|B2B_INFO_AD|B2B_INFO_ADF|B2B_INFO_ADR|B2B_FMT_AD|B2B_FMT_ADF|B2B_FMT_ADR) )
+        {
+            // first B2B_MAX_ALLELES fields for total numbers, the rest per-sample
+            conf->bc.ADR = (int32_t*) malloc((nsmpl+1)*B2B_MAX_ALLELES*sizeof(int32_t));
+            conf->bc.ADF = (int32_t*) malloc((nsmpl+1)*B2B_MAX_ALLELES*sizeof(int32_t));
+            for (i=0; i<nsmpl; i++)
+            {
+                conf->bcr[i].ADR = conf->bc.ADR + (i+1)*B2B_MAX_ALLELES;
+                conf->bcr[i].ADF = conf->bc.ADF + (i+1)*B2B_MAX_ALLELES;
+            }
+        }
+    }
+
+    conf->iter = bam_mplp_init(conf->nfiles, mplp_func, (void**)conf->mplp_data);
+    if ( conf->flag & MPLP_SMART_OVERLAPS ) bam_mplp_init_overlaps(conf->iter);
+    bam_mplp_set_maxcnt(conf->iter, conf->max_depth);
+    conf->bcf_rec = bcf_init1();
+    bam_mplp_constructor(conf->iter, pileup_constructor);
+
+    if ( conf->downsample )
+    {
+        conf->dsmpl = (mplp_dsmpl_t*) calloc(nsmpl, sizeof(mplp_dsmpl_t));
+        for (i=0; i<nsmpl; i++) conf->dsmpl[i].tid = -1;
+    }
+}
+
+static void destroy_mplp_engine(mplp_conf_t *conf)
+{
+    int i;
+    free(conf->bc.tmp.s);
+    bcf_destroy1(conf->bcf_rec);
+    bcf_call_destroy(conf->bca);
+    free(conf->bc.PL);
+    free(conf->bc.DP4);
+    free(conf->bc.ADR);
+    free(conf->bc.ADF);
+    free(conf->bc.fmt_arr);
+    free(conf->bcr);
+    if ( conf->dsmpl )
+    {
+        for (i = 0; i < conf->gplp->n; ++i)
+        {
+            khp_destroy(end, conf->dsmpl[i].all[0]); khp_destroy(end, conf->dsmpl[i].all[1]);
+            khp_destroy(end, conf->dsmpl[i].kept[0]); khp_destroy(end, conf->dsmpl[i].kept[1]);
+        }
+        free(conf->dsmpl);
+    }
+    for (i = 0; i < conf->gplp->n; ++i) free(conf->gplp->plp[i]);
+    free(conf->gplp->plp); free(conf->gplp->n_plp); free(conf->gplp->m_plp); free(conf->gplp);
+    bam_mplp_destroy(conf->iter);
+}
+
+// Genome sharding with --threads. The regions, or the whole genome, are split
+// into chunks of about equal numbers of reads and each chunk is piled up by an
+// independent engine, which writes to a temporary file. The main thread appends
+// the files to the output in the genomic order.
+#define MPLP_CHUNKS_PER_THREAD 4
+#define MPLP_MIN_CHUNK_LEN 1000000
+
+typedef struct
+{
+    int tid;
+    uint32_t beg, end;      // 0-based, inclusive
+}
+mplp_creg_t;
+
+typedef struct
+{
+    mplp_conf_t conf;       // private copy of the main conf
+    mplp_creg_t *reg;
+    int nreg, mreg;
+    char *fname;
+}
+mplp_chunk_t;
+
+static void chunk_add_reg(mplp_chunk_t *chunk, int tid, uint32_t beg, uint32_t end)
+{
+    hts_expand(mplp_creg_t, chunk->nreg+1, chunk->mreg, chunk->reg);
+    mplp_creg_t *reg = &chunk->reg[chunk->nreg++];
+    reg->tid = tid;
+    reg->beg = beg;
+    reg->end = end;
+}
+
+// The read counts are taken from the index of the first file only, on the
+// assumption that the coverage profile is similar across the cohort.
+static mplp_chunk_t *mplp_make_chunks(mplp_conf_t *conf, bam_hdr_t *hdr, hts_idx_t *idx, int *nchunks)
+{
+    int i, nreg = 0, mreg = 0, has_stats = 0;
+    mplp_creg_t *reg = NULL;
+    double *dens = (double*) calloc(hdr->n_targets, sizeof(double));
+    double tot_len = 0, tot_mapped = 0;
+    for (i=0; i<hdr->n_targets; i++)
+    {
+        uint64_t mapped, unmapped;
+        if ( hts_idx_get_stat(idx, i, &mapped, &unmapped)<0 ) mapped = 0;  // no reads or no stats in CRAI
+        else has_stats = 1;
+        dens[i] = mapped;
+        tot_mapped += mapped;
+        tot_len += hdr->target_len[i];
+    }
+    if ( !tot_mapped ) has_stats = 0;
+    for (i=0; i<hdr->n_targets; i++)
+    {
+        if ( !has_stats ) dens[i] = 1;
+        else if ( hdr->target_len[i] ) dens[i] = dens[i] / hdr->target_len[i] * tot_len / tot_mapped;
+    }
+
+    if ( conf->reg )
+    {
+        regitr_t *itr = regitr_init(conf->reg);
+        while ( regitr_loop(itr) )
+        {
+            int tid = bam_name2id(hdr, itr->seq);
+            if ( tid<0 ) error("[E::%s] the sequence \"%s\" not found: %s\n",__func__,itr->seq,conf->files[0]);
+            uint32_t end = itr->end < hdr->target_len[tid] ? itr->end : hdr->target_len[tid] - 1;
+            if ( itr->beg > end ) continue;
+            hts_expand(mplp_creg_t, nreg+1, mreg, reg);
+            reg[nreg].tid = tid, reg[nreg].beg = itr->beg, reg[nreg].end = end;
+            nreg++;
+        }
+        regitr_destroy(itr);
+    }
+    else
+    {
+        hts_expand(mplp_creg_t, hdr->n_targets, mreg, reg);
+        for (i=0; i<hdr->n_targets; i++)
+        {
+            if ( !hdr->target_len[i] ) continue;
+            reg[nreg].tid = i, reg[nreg].beg = 0, reg[nreg].end = hdr->target_len[i] - 1;
+            nreg++;
+        }
+    }
+
+    // sequences without reads are skipped, the rest is weighted by the read density
+    double tot_weight = 0;
+    for (i=0; i<nreg; i++) tot_weight += (double)(reg[i].end - reg[i].beg + 1) * dens[reg[i].tid];
+    double max_weight = tot_weight / (conf->n_threads * MPLP_CHUNKS_PER_THREAD);
+    if ( max_weight < MPLP_MIN_CHUNK_LEN ) max_weight = MPLP_MIN_CHUNK_LEN;
+
+    int mchunks = 0;
+    mplp_chunk_t *chunks = NULL;
+    double weight = 0;
+    *nchunks = 0;
+    for (i=0; i<nreg; i++)
+    {
+        if ( dens[reg[i].tid]==0 ) continue;
+        uint32_t beg = reg[i].beg;
+        while ( beg <= reg[i].end )
+        {
+            if ( !weight )
+            {
+                hts_expand0(mplp_chunk_t, *nchunks+1, mchunks, chunks);
+                (*nchunks)++;
+            }
+            double len = ceil((max_weight - weight) / dens[reg[i].tid]);
+            uint32_t end = len > reg[i].end - beg ? reg[i].end : beg + len - 1;
+            chunk_add_reg(&chunks[*nchunks-1], reg[i].tid, beg, end);
+            weight += (double)(end - beg + 1) * dens[reg[i].tid];
+            if ( weight >= max_weight ) weight = 0;
+            if ( end == reg[i].end ) break;
+            beg = end + 1;
+        }
+    }
+    free(reg);
+    free(dens);
+    return chunks;
+}
+
+static void *mpileup_chunk(void *arg)
+{
+    mplp_chunk_t *chunk = (mplp_chunk_t*) arg;
+    mplp_conf_t *conf = &chunk->conf;
+    mplp_aux_t **main_data = conf->mplp_data;
+    mplp_ref_t mp_ref = MPLP_REF_INIT;
+    bam_hdr_t *hdr = NULL;
+    int i, j;
+
+    conf->buf.l = conf->buf.m = 0; conf->buf.s = NULL;
+    if ( conf->fai_fname && !(conf->fai = fai_load(conf->fai_fname)) ) error("Failed to load the fai index: %s\n", conf->fai_fname);
+    conf->bed_itr = conf->bed ? regitr_init(conf->bed) : NULL;
+    conf->mplp_data = (mplp_aux_t**) calloc(conf->nfiles, sizeof(mplp_aux_t*));
+    conf->plp = (const bam_pileup1_t**) calloc(conf->nfiles, sizeof(bam_pileup1_t*));
+    conf->n_plp = (int*) calloc(conf->nfiles, sizeof(int));
+    for (i=0; i<conf->nfiles; i++)
+    {
+        mplp_aux_t *ma = conf->mplp_data[i] = (mplp_aux_t*) calloc(1, sizeof(mplp_aux_t));
+        ma->fp = mplp_open_bam(conf, conf->files[i]);
+        ma->conf = conf;
+        ma->ref = &mp_ref;
+        ma->bam_id = main_data[i]->bam_id;
+        bam_hdr_t *h_tmp = sam_hdr_read(ma->fp);
+        if ( !h_tmp ) error("[%s] fail to read the header of %s\n", __func__, conf->files[i]);
+        if ( !hdr ) hdr = h_tmp;
+        else bam_hdr_destroy(h_tmp);
+        ma->h = hdr;
+        ma->idx = sam_index_load(ma->fp, conf->files[i]);
+        if ( !ma->idx ) error("[%s] fail to load index for %s\n", __func__, conf->files[i]);
+    }
+
+    conf->bcf_fp = hts_open(chunk->fname, conf->output_type & FT_BCF ? "wbu" : "w");
+    if ( !conf->bcf_fp ) error("Can't write to \"%s\": %s\n", chunk->fname, strerror(errno));
+
+    int nsmpl;
+    bam_smpl_get_samples(conf->bsmpl, &nsmpl);
+    init_mplp_engine(conf, nsmpl);
+    for (j=0; j<chunk->nreg; j++)
+    {
+        mplp_creg_t *reg = &chunk->reg[j];
+        for (i=0; i<conf->nfiles; i++)
+        {
+            if ( conf->mplp_data[i]->iter ) hts_itr_destroy(conf->mplp_data[i]->iter);
+            conf->mplp_data[i]->iter = sam_itr_queryi(conf->mplp_data[i]->idx, reg->tid, reg->beg, reg->end + 1);
+            if ( !conf->mplp_data[i]->iter )
+                error("[E::%s] fail to query %s:%u-%u in %s\n", __func__, hdr->target_name[reg->tid], reg->beg+1, reg->end+1, conf->files[i]);
+        }
+        if ( j ) { bam_mplp_reset(conf->iter); conf->dsmpl_gen++; }
+        mpileup_reg(conf, reg->beg, reg->end);
+    }
+    destroy_mplp_engine(conf);
+
+    if ( hts_close(conf->bcf_fp)!=0 ) error("Close failed: %s\n", chunk->fname);
+    for (i=0; i<conf->nfiles; i++)
+    {
+        sam_close(conf->mplp_data[i]->fp);
+        if ( conf->mplp_data[i]->iter ) hts_itr_destroy(conf->mplp_data[i]->iter);
+        hts_idx_destroy(conf->mplp_data[i]->idx);
+        free(conf->mplp_data[i]);
+    }
+    bam_hdr_destroy(hdr);
+    free(conf->mplp_data); free(conf->plp); free(conf->n_plp);
+    if ( conf->bed_itr ) regitr_destroy(conf->bed_itr);
+    if ( conf->fai ) fai_destroy(conf->fai);
+    free(conf->buf.s);
+    free(mp_ref.ref[0]);
+    free(mp_ref.ref[1]);
+    return chunk;
+}
+
+// Append the chunk to the output and remove the temporary file
+static void write_chunk(mplp_conf_t *conf, hts_tpool_process *q)
+{
+    hts_tpool_result *res = hts_tpool_next_result_wait(q);
+    if ( !res ) error("Failed to retrieve the pileup chunk\n");
+    mplp_chunk_t *chunk = (mplp_chunk_t*) hts_tpool_result_data(res);
+
+    BGZF *fp = bgzf_open(chunk->fname, "r");
+    if ( !fp ) error("Failed to open %s: %s\n", chunk->fname, strerror(errno));
+    const size_t page_size = BGZF_MAX_BLOCK_SIZE;
+    uint8_t *buf = (uint8_t*) malloc(page_size);
+    ssize_t nread;
+    while ( (nread = bgzf_read(fp, buf, page_size)) > 0 )
+    {
+        ssize_t nwr = conf->bcf_fp->is_bgzf ? bgzf_write(conf->bcf_fp->fp.bgzf, buf, nread) : hwrite(conf->bcf_fp->fp.hfile, buf, nread);
+        if ( nwr!=nread ) error("Write failed, wrote %d instead of %d bytes.\n", (int)nwr,(int)nread);
+    }
+    if ( nread<0 ) error("Failed to read %s\n", chunk->fname);
+    free(buf);
+    if ( bgzf_close(fp)<0 ) error("Close failed: %s\n", chunk->fname);
+    unlink(chunk->fname);
+    hts_tpool_delete_result(res, 0);
+}
+
+// At most two chunks per thread are in flight, the oldest one is written out
+// before another is dispatched.
+static void mpileup_chunks(mplp_conf_t *conf, bam_hdr_t *hdr, hts_idx_t *idx, hts_tpool *pool)
+{
+    int i, nchunks;
+    mplp_chunk_t *chunks = mplp_make_chunks(conf, hdr, idx, &nchunks);
+    hts_idx_destroy(idx);
+
+    // the workers query the regions concurrently
+    if ( conf->bed ) regidx_finalize(conf->bed);
+
+    char *dir = tmpdir_create(conf->tmp_dir, "mpileup");
+    kstring_t str = {0,0,0};
+    int qsize = 2*conf->n_threads, nbusy = 0;
+    hts_tpool_process *q = hts_tpool_process_init(pool, qsize, 0);
+    if ( !q ) error("Failed to initialize the thread pool queue\n");
+    for (i=0; i<nchunks; i++)
+    {
+        if ( nbusy==qsize ) { write_chunk(conf, q); nbusy--; }
+        mplp_chunk_t *chunk = &chunks[i];
+        chunk->conf = *conf;
+        str.l = 0;
+        ksprintf(&str, "%s/%d", dir, i);
+        chunk->fname = strdup(str.s);
+        if ( hts_tpool_dispatch(pool, q, mpileup_chunk, chunk) < 0 )
+            error("Failed to dispatch the chunk %s:%u to the thread pool\n", hdr->target_name[chunk->reg[0].tid], chunk->reg[0].beg+1);
+        nbusy++;
+    }
+    while ( nbusy ) { write_chunk(conf, q); nbusy--; }
+    hts_tpool_process_destroy(q);
+
+    for (i=0; i<nchunks; i++)
+    {
+        free(chunks[i].reg);
+        free(chunks[i].fname);
+    }
+    free(chunks);
+    tmpdir_remove(dir);
+    free(dir);
+    free(str.s);
+}
+
 static int mpileup(mplp_conf_t *conf)
 {
     if (conf->nfiles == 0) {
@@ -360,11 +890,15 @@ static int mpileup(mplp_conf_t *conf)
     }
 
     mplp_ref_t mp_ref = MPLP_REF_INIT;
-    conf->gplp = (mplp_pileup_t *) calloc(1,sizeof(mplp_pileup_t));
     conf->mplp_data = (mplp_aux_t**) calloc(conf->nfiles, sizeof(mplp_aux_t*));
     conf->plp = (const bam_pileup1_t**) calloc(conf->nfiles, sizeof(bam_pileup1_t*));
     conf->n_plp = (int*) calloc(conf->nfiles, sizeof(int));
 
+    // Shard the genome between the threads if the input is indexed. The gVCF blocks
+    // would span the chunk boundaries, --gvcf therefore runs in a single thread.
+    int parallel = conf->n_threads && !conf->gvcf ? 1 : 0;
+    hts_idx_t *shard_idx = NULL;
+
     // Allow to run mpileup on multiple regions in one go. This comes at cost: the bai index
     // must be kept in the memory for the whole time which can be a problem with many bams.
     // Therefore if none or only one region is requested, we initialize the bam iterator as
@@ -400,21 +934,7 @@ static int mpileup(mplp_conf_t *conf)
     for (i = 0; i < conf->nfiles; ++i) {
         bam_hdr_t *h_tmp;
         conf->mplp_data[i] = (mplp_aux_t*) calloc(1, sizeof(mplp_aux_t));
-        conf->mplp_data[i]->fp = sam_open(conf->files[i], "rb");
-        if ( !conf->mplp_data[i]->fp )
-        {
-            fprintf(stderr, "[%s] failed to open %s: %s\n", __func__, conf->files[i], strerror(errno));
-            exit(EXIT_FAILURE);
-        }
-        if (hts_set_opt(conf->mplp_data[i]->fp, CRAM_OPT_DECODE_MD, 0)) {
-            fprintf(stderr, "Failed to set CRAM_OPT_DECODE_MD value\n");
-            exit(EXIT_FAILURE);
-        }
-        if (conf->fai_fname && hts_set_fai_filename(conf->mplp_data[i]->fp, conf->fai_fname) != 0) {
-            fprintf(stderr, "[%s] failed to process %s: %s\n",
-                    __func__, conf->fai_fname, strerror(errno));
-            exit(EXIT_FAILURE);
-        }
+        conf->mplp_data[i]->fp = mplp_open_bam(conf, conf->files[i]);
         conf->mplp_data[i]->conf = conf;
         conf->mplp_data[i]->ref = &mp_ref;
         h_tmp = sam_hdr_read(conf->mplp_data[i]->fp);
@@ -436,7 +956,17 @@ static int mpileup(mplp_conf_t *conf)
             i--;
             continue;
         }
-        if (conf->reg) {
+        if ( parallel && !shard_idx )
+        {
+            // the read counts in the index of the first file guide the sharding
+            shard_idx = sam_index_load(conf->mplp_data[i]->fp, conf->files[i]);
+            if ( !shard_idx )
+            {
+                fprintf(stderr,"[%s] no index for %s, the genome is not sharded between the threads\n", __func__, conf->files[i]);
+                parallel = 0;
+            }
+        }
+        if (conf->reg && !parallel) {
             hts_idx_t *idx = sam_index_load(conf->mplp_data[i]->fp, conf->files[i]);
             if (idx == NULL) {
                 fprintf(stderr, "[%s] fail to load index for %s\n", __func__, conf->files[i]);
@@ -471,20 +1001,31 @@ static int mpileup(mplp_conf_t *conf)
             conf->mplp_data[i]->h = hdr;
         }
     }
-    // allocate data storage proportionate to number of samples being studied sm->n
-    bam_smpl_get_samples(conf->bsmpl, &conf->gplp->n);
-    conf->gplp->n_plp = (int*) calloc(conf->gplp->n, sizeof(int));
-    conf->gplp->m_plp = (int*) calloc(conf->gplp->n, sizeof(int));
-    conf->gplp->plp = (bam_pileup1_t**) calloc(conf->gplp->n, sizeof(bam_pileup1_t*));  
+    if ( parallel )
+    {
+        // the workers open the files themselves
+        for (i = 0; i < conf->nfiles; ++i)
+        {
+            sam_close(conf->mplp_data[i]->fp);
+            conf->mplp_data[i]->fp = NULL;
+        }
+    }
 
-    fprintf(stderr, "[%s] %d samples in %d input files\n", __func__, conf->gplp->n, conf->nfiles);
+    int nsmpl;
+    const char **smpl = bam_smpl_get_samples(conf->bsmpl, &nsmpl);
+    fprintf(stderr, "[%s] %d samples in %d input files\n", __func__, nsmpl, conf->nfiles);
     // write the VCF header
     conf->bcf_fp = hts_open(conf->output_fname?conf->output_fname:"-", hts_bcf_wmode(conf->output_type));
     if (conf->bcf_fp == NULL) {
         fprintf(stderr, "[%s] failed to write to %s: %s\n", __func__, conf->output_fname? conf->output_fname : "standard output", strerror(errno));
         exit(EXIT_FAILURE);
     }
-    if ( conf->n_threads ) hts_set_threads(conf->bcf_fp, conf->n_threads);
+    htsThreadPool tpool = {NULL, 0};
+    if ( conf->n_threads )
+    {
+        if ( !(tpool.pool = hts_tpool_init(conf->n_threads)) ) error("Failed to initialize a pool of %d threads\n", conf->n_threads);
+        hts_set_opt(conf->bcf_fp, HTS_OPT_THREAD_POOL, &tpool);
+    }
 
     // BCF header creation
     conf->bcf_hdr = bcf_hdr_init("w");
@@ -567,114 +1108,75 @@ static int mpileup(mplp_conf_t *conf)
     if ( conf->gvcf )
         gvcf_update_header(conf->gvcf, conf->bcf_hdr);
 
-    int nsmpl;
-    const char **smpl = bam_smpl_get_samples(conf->bsmpl, &nsmpl);
     for (i=0; i<nsmpl; i++)
         bcf_hdr_add_sample(conf->bcf_hdr, smpl[i]);
     bcf_hdr_write(conf->bcf_fp, conf->bcf_hdr);
 
-    conf->bca = bcf_call_init(-1., conf->min_baseQ);
-    conf->bcr = (bcf_callret1_t*) calloc(nsmpl, sizeof(bcf_callret1_t));
-    conf->bca->openQ = conf->openQ, conf->bca->extQ = conf->extQ, conf->bca->tandemQ = conf->tandemQ;
-    conf->bca->min_frac = conf->min_frac;
-    conf->bca->min_support = conf->min_support;
-    conf->bca->per_sample_flt = conf->flag & MPLP_PER_SAMPLE;
-
-    conf->bc.bcf_hdr = conf->bcf_hdr;
-    conf->bc.n  = nsmpl;
-    conf->bc.PL = (int32_t*) malloc(15 * nsmpl * sizeof(*conf->bc.PL));
-    if (conf->fmt_flag)
-    {
-        assert( sizeof(float)==sizeof(int32_t) );
-        conf->bc.DP4 = (int32_t*) malloc(nsmpl * sizeof(int32_t) * 4);
-        conf->bc.fmt_arr = (uint8_t*) malloc(nsmpl * sizeof(float)); // all fmt_flag fields, float and int32
-        if ( conf->fmt_flag&(B2B_INFO_DPR|B2B_FMT_DPR|B2B_INFO_AD|B2B_INFO_ADF|B2B_INFO_ADR|B2B_FMT_AD|B2B_FMT_ADF|B2B_FMT_ADR) )
-        {
-            // first B2B_MAX_ALLELES fields for total numbers, the rest per-sample
-            conf->bc.ADR = (int32_t*) malloc((nsmpl+1)*B2B_MAX_ALLELES*sizeof(int32_t));
-            conf->bc.ADF = (int32_t*) malloc((nsmpl+1)*B2B_MAX_ALLELES*sizeof(int32_t));
-            for (i=0; i<nsmpl; i++)
-            {
-                conf->bcr[i].ADR = conf->bc.ADR + (i+1)*B2B_MAX_ALLELES;
-                conf->bcr[i].ADF = conf->bc.ADF + (i+1)*B2B_MAX_ALLELES;
-            }
-        }
-    }
-
-    // init mpileup
-    conf->iter = bam_mplp_init(conf->nfiles, mplp_func, (void**)conf->mplp_data);
-    if ( conf->flag & MPLP_SMART_OVERLAPS ) bam_mplp_init_overlaps(conf->iter);
     if ( (double)conf->max_depth * conf->nfiles > 1<<20)
         fprintf(stderr, "Warning: Potential memory hog, up to %.0fM reads in the pileup!\n", (double)conf->max_depth*conf->nfiles);
     if ( (double)conf->max_depth * conf->nfiles / nsmpl < 250 )
         fprintf(stderr, "Note: The maximum per-sample depth with -d %d is %.1fx\n", conf->max_depth,(double)conf->max_depth * conf->nfiles / nsmpl);
-    bam_mplp_set_maxcnt(conf->iter, conf->max_depth);
     conf->max_indel_depth = conf->max_indel_depth * nsmpl;
-    conf->bcf_rec = bcf_init1();
-    bam_mplp_constructor(conf->iter, pileup_constructor);
 
-    // Run mpileup for multiple regions
-    if ( nregs )
+    if ( parallel )
+        mpileup_chunks(conf, hdr, shard_idx, tpool.pool);
+    else
     {
-        int ireg = 0;
-        do 
+        init_mplp_engine(conf, nsmpl);
+        if ( tpool.pool ) init_glf_jobs(conf, tpool.pool);
+
+        // Run mpileup for multiple regions
+        if ( nregs )
         {
-            // first region is already positioned
-            if ( ireg++ > 0 )
+            int ireg = 0;
+            do 
             {
-                conf->buf.l = 0;
-                ksprintf(&conf->buf,"%s:%u-%u",conf->reg_itr->seq,conf->reg_itr->beg,conf->reg_itr->end);
-
-                for (i=0; i<conf->nfiles; i++) 
+                // first region is already positioned
+                if ( ireg++ > 0 )
                 {
-                    hts_itr_destroy(conf->mplp_data[i]->iter);
-                    conf->mplp_data[i]->iter = sam_itr_querys(conf->mplp_data[i]->idx, conf->mplp_data[i]->h, conf->buf.s);
-                    if ( !conf->mplp_data[i]->iter ) 
+                    conf->buf.l = 0;
+                    ksprintf(&conf->buf,"%s:%u-%u",conf->reg_itr->seq,conf->reg_itr->beg,conf->reg_itr->end);
+
+                    for (i=0; i<conf->nfiles; i++) 
                     {
-                        conf->mplp_data[i]->iter = sam_itr_querys(conf->mplp_data[i]->idx, conf->mplp_data[i]->h, conf->reg_itr->seq);
-                        if ( conf->mplp_data[i]->iter ) {
-                            fprintf(stderr,"[E::%s] fail to parse region '%s'\n", __func__, conf->buf.s);
+                        hts_itr_destroy(conf->mplp_data[i]->iter);
+                        conf->mplp_data[i]->iter = sam_itr_querys(conf->mplp_data[i]->idx, conf->mplp_data[i]->h, conf->buf.s);
+                        if ( !conf->mplp_data[i]->iter ) 
+                        {
+                            conf->mplp_data[i]->iter = sam_itr_querys(conf->mplp_data[i]->idx, conf->mplp_data[i]->h, conf->reg_itr->seq);
+                            if ( conf->mplp_data[i]->iter ) {
+                                fprintf(stderr,"[E::%s] fail to parse region '%s'\n", __func__, conf->buf.s);
+                                exit(EXIT_FAILURE);
+                            }
+                            fprintf(stderr,"[E::%s] the sequence \"%s\" not found: %s\n",__func__,conf->reg_itr->seq,conf->files[i]);
                             exit(EXIT_FAILURE);
                         }
-                        fprintf(stderr,"[E::%s] the sequence \"%s\" not found: %s\n",__func__,conf->reg_itr->seq,conf->files[i]);
-                        exit(EXIT_FAILURE);
+                        bam_mplp_reset(conf->iter);
                     }
-                    bam_mplp_reset(conf->iter);
+                    conf->dsmpl_gen++;
                 }
+                mpileup_reg(conf,conf->reg_itr->beg,conf->reg_itr->end);
             }
-            mpileup_reg(conf,conf->reg_itr->beg,conf->reg_itr->end);
+            while ( regitr_loop(conf->reg_itr) );
         }
-        while ( regitr_loop(conf->reg_itr) );
-    }
-    else
-        mpileup_reg(conf,0,0);
+        else
+            mpileup_reg(conf,0,0);
 
-    flush_bcf_records(conf, conf->bcf_fp, conf->bcf_hdr, NULL);
+        flush_bcf_records(conf, conf->bcf_fp, conf->bcf_hdr, NULL);
+        if ( conf->nglf_jobs ) destroy_glf_jobs(conf);
+        destroy_mplp_engine(conf);
+    }
 
     // clean up
-    free(conf->bc.tmp.s);
-    bcf_destroy1(conf->bcf_rec);
-    if (conf->bcf_fp)
-    {
-        hts_close(conf->bcf_fp);
-        bcf_hdr_destroy(conf->bcf_hdr);
-        bcf_call_destroy(conf->bca);
-        free(conf->bc.PL);
-        free(conf->bc.DP4);
-        free(conf->bc.ADR);
-        free(conf->bc.ADF);
-        free(conf->bc.fmt_arr);
-        free(conf->bcr);
-    }
+    hts_close(conf->bcf_fp);
+    bcf_hdr_destroy(conf->bcf_hdr);
+    if ( tpool.pool ) hts_tpool_destroy(tpool.pool);
     if ( conf->gvcf ) gvcf_destroy(conf->gvcf);
     free(conf->buf.s);
-    for (i = 0; i < conf->gplp->n; ++i) free(conf->gplp->plp[i]);
-    free(conf->gplp->plp); free(conf->gplp->n_plp); free(conf->gplp->m_plp); free(conf->gplp);
-    bam_mplp_destroy(conf->iter);
     bam_hdr_destroy(hdr);
     for (i = 0; i < conf->nfiles; ++i) {
         if ( nregs>1 ) hts_idx_destroy(conf->mplp_data[i]->idx);
-        sam_close(conf->mplp_data[i]->fp);
+        if ( conf->mplp_data[i]->fp ) sam_close(conf->mplp_data[i]->fp);
         if ( conf->mplp_data[i]->iter) hts_itr_destroy(conf->mplp_data[i]->iter);
         free(conf->mplp_data[i]);
     }
@@ -820,7 +1322,10 @@ static void print_usage(FILE *fp, const mplp_conf_t *mplp)
 "  -C, --adjust-MQ INT     adjust mapping quality; recommended:50, disable:0 [0]\n"
 "  -d, --max-depth INT     max per-file depth; avoids excessive memory usage [%d]\n", mplp->max_depth);
     fprintf(fp,
+"      --downsample INT    randomly downsample to about INT reads per sample and position\n"
+"      --seed INT          random seed for --downsample [0]\n"
 "  -E, --redo-BAQ          recalculate BAQ on the fly, ignore existing BQs\n"
+"      --lazy-BAQ          apply BAQ only to reads with an indel or a mismatch\n"
 "  -f, --fasta-ref FILE    faidx indexed reference sequence file\n"
 "      --no-reference      do not require fasta reference file\n"
 "  -G, --read-groups FILE  select or exclude read groups listed in the file\n"
@@ -850,7 +1355,9 @@ static void print_usage(FILE *fp, const mplp_conf_t *mplp)
 "  -o, --output FILE       write output to FILE [standard output]\n"
 "  -O, --output-type TYPE  'b' compressed BCF; 'u' uncompressed BCF;\n"
 "                          'z' compressed VCF; 'v' uncompressed VCF [v]\n"
-"      --threads INT       number of extra output compression threads [0]\n"
+"      --temp-dir DIR      directory for temporary files [$TMPDIR or /tmp]\n"
+"      --threads INT       number of extra threads for pileup of genome chunks,\n"
+"                          or of samples at deep sites, and output compression [0]\n"
 "\n"
 "SNP/INDEL genotype likelihoods options:\n"
 "  -e, --ext-prob INT      Phred-scaled gap extension seq error probability [%d]\n", mplp->extQ);
@@ -879,6 +1386,7 @@ static void print_usage(FILE *fp, const mplp_conf_t *mplp)
 int bam_mpileup(int argc, char *argv[])
 {
     int c;
+    char *tmp;
     const char *file_list = NULL;
     char **fn = NULL;
     int nfiles = 0, use_orphan = 0, noref = 0;
@@ -912,6 +1420,10 @@ int bam_mpileup(int argc, char *argv[])
         {"non-reference", no_argument, NULL, 7},
         {"no-version", no_argument, NULL, 8},
         {"threads",required_argument,NULL,9},
+        {"temp-dir",required_argument,NULL,10},
+        {"downsample",required_argument,NULL,11},
+        {"seed",required_argument,NULL,12},
+        {"lazy-BAQ",no_argument,NULL,13},
         {"illumina1.3+", no_argument, NULL, '6'},
         {"count-orphans", no_argument, NULL, 'A'},
         {"bam-list", required_argument, NULL, 'b'},
@@ -975,6 +1487,15 @@ int bam_mpileup(int argc, char *argv[])
         case  7 : noref = 1; break;
         case  8 : mplp.record_cmd_line = 0; break;
         case  9 : mplp.n_threads = strtol(optarg, 0, 0); break;
+        case 10 : mplp.tmp_dir = optarg; break;
+        case 11 :
+            mplp.downsample = strtol(optarg, &tmp, 10);
+            if ( *tmp || mplp.downsample<=0 ) error("Could not parse --downsample %s\n", optarg);
+            break;
+        case 12 :
+            mplp.seed = strtoul(optarg, &tmp, 10);
+            if ( *tmp ) error("Could not parse --seed %s\n", optarg);
+            break;
         case 'd': mplp.max_depth = atoi(optarg); break;
         case 'r': mplp.reg_fname = strdup(optarg); break;
         case 'R': mplp.reg_fname = strdup(optarg); mplp.reg_is_file = 1; break;
@@ -1003,6 +1524,7 @@ int bam_mpileup(int argc, char *argv[])
         case 'B': mplp.flag &= ~MPLP_REALN; break;
         case 'I': mplp.flag |= MPLP_NO_INDEL; break;
         case 'E': mplp.flag |= MPLP_REDO_BAQ; break;
+        case  13: mplp.flag |= MPLP_LAZY_BAQ; break;
         case '6': mplp.flag |= MPLP_ILLUMINA13; break;
         case 's': if ( bam_smpl_add_samples(mplp.bsmpl,optarg,0)<0 ) error("Could not read samples: %s\n",optarg); break;
         case 'S': if ( bam_smpl_add_samples(mplp.bsmpl,optarg,1)<0 ) error("Could not read samples: %s\n",optarg); break;
@@ -26,6 +26,8 @@
 
 #include "peakfit.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
 #include <gsl/gsl_version.h>
 #include <gsl/gsl_vector.h>
 #include <gsl/gsl_multifit_nlin.h>
@@ -59,6 +61,8 @@ struct _peakfit_t
     double *xvals, *yvals, *vals;
     kstring_t str;
     int verbose, nmc_iter;
+    kstring_t *log;         // verbose output goes here if set, otherwise to stderr
+    unsigned int seed;      // private random state so that fitters can run in parallel threads
 };
 
 
@@ -475,6 +479,20 @@ void peakfit_verbose(peakfit_t *pkf, int level)
     pkf->verbose = level;
 }
 
+void peakfit_set_log(peakfit_t *pkf, kstring_t *log)
+{
+    pkf->log = log;
+}
+
+static void peakfit_log(peakfit_t *pkf, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    if ( pkf->log ) kvsprintf(pkf->log, fmt, ap);
+    else vfprintf(stderr, fmt, ap);
+    va_end(ap);
+}
+
 void peakfit_set_mc(peakfit_t *pkf, double xmin, double xmax, int iparam, int niter)
 {
     peak_t *pk = &pkf->peaks[ pkf->npeaks-1 ];
@@ -486,7 +504,7 @@ void peakfit_set_mc(peakfit_t *pkf, double xmin, double xmax, int iparam, int ni
 
 double peakfit_run(peakfit_t *pkf, int nvals, double *xvals, double *yvals)
 {
-    srand(0);   // for reproducibility
+    pkf->seed = 0;   // for reproducibility
 
     pkf->nvals = nvals;
     pkf->xvals = xvals;
@@ -522,7 +540,7 @@ double peakfit_run(peakfit_t *pkf, int nvals, double *xvals, double *yvals)
                 pk->params[j] = pk->ori_params[j];
                 if ( pk->mc[j].scan )
                 {
-                    pk->params[j] = rand()*(pk->mc[j].max - pk->mc[j].min)/RAND_MAX + pk->mc[j].min;
+                    pk->params[j] = rand_r(&pkf->seed)*(pk->mc[j].max - pk->mc[j].min)/RAND_MAX + pk->mc[j].min;
                     if ( pk->convert_set ) pk->params[j] = pk->convert_set(pk, j, pk->params[j]);
                 }
                 if ( !(pk->fit_mask & (1<<j)) ) continue;
@@ -541,13 +559,13 @@ double peakfit_run(peakfit_t *pkf, int nvals, double *xvals, double *yvals)
             ret = gsl_multifit_fdfsolver_iterate(solver);
             if ( pkf->verbose >1 )
             {
-                fprintf(stderr, "%d: ", niter);
+                peakfit_log(pkf, "%d: ", niter);
                 for (i=0; i<pkf->npeaks; i++)
                 {
                     peak_t *pk = &pkf->peaks[i];
-                    fprintf(stderr,"\t%f %f %f", pk->params[0],pk->params[1],pk->params[2]);
+                    peakfit_log(pkf,"\t%f %f %f", pk->params[0],pk->params[1],pk->params[2]);
                 }
-                fprintf(stderr, "\t.. %s\n", gsl_strerror(ret));
+                peakfit_log(pkf, "\t.. %s\n", gsl_strerror(ret));
             }
             if ( ret ) break;
 
@@ -563,8 +581,8 @@ double peakfit_run(peakfit_t *pkf, int nvals, double *xvals, double *yvals)
         while ((test1==GSL_CONTINUE || test2==GSL_CONTINUE) && ++niter<niter_max);
         if ( pkf->verbose >1 )
         {
-            fprintf(stderr,"test1=%s\n", gsl_strerror(test1));
-            fprintf(stderr,"test2=%s\n", gsl_strerror(test2));
+            peakfit_log(pkf,"test1=%s\n", gsl_strerror(test1));
+            peakfit_log(pkf,"test2=%s\n", gsl_strerror(test2));
         }
 
         // recover parameters
@@ -27,6 +27,8 @@
 #ifndef PEAKFIT_H
 #define PEAKFIT_H
 
+#include <htslib/kstring.h>
+
 typedef struct _peakfit_t peakfit_t;
 
 peakfit_t *peakfit_init(void);
@@ -41,6 +43,7 @@ double peakfit_run(peakfit_t *pkf, int nvals, double *xvals, double *yvals);
 double peakfit_evaluate(peakfit_t *pkf);
 
 void peakfit_verbose(peakfit_t *pkf, int level);
+void peakfit_set_log(peakfit_t *pkf, kstring_t *log);   // append verbose output to log instead of stderr
 void peakfit_get_params(peakfit_t *pkf, int ipk, double *params, int nparams);
 void peakfit_set_params(peakfit_t *pkf, int ipk, double *params, int nparams);
 const char *peakfit_sprint_func(peakfit_t *pkf);
@@ -34,7 +34,7 @@ struct _ploidy_t
     int dflt, min, max; // ploidy: default, min and max (only explicitly listed)
     int *sex2dflt;
     regidx_t *idx;
-    regitr_t *itr;
+    regitr_t *itr, *seg_itr;
     void *sex2id;
     char **id2sex;
     kstring_t tmp_str;
@@ -145,6 +145,8 @@ ploidy_t *ploidy_init(const char *fname, int dflt)
         return NULL;
     }
     pld->itr = regitr_init(pld->idx);
+    regitr_set_sorted(pld->itr,1);
+    pld->seg_itr = regitr_init(pld->idx);
     _set_defaults(pld,dflt);
     return pld;
 }
@@ -158,6 +160,8 @@ ploidy_t *ploidy_init_string(const char *str, int dflt)
     pld->sex2id = khash_str2int_init();
     pld->idx = regidx_init(NULL,ploidy_parse,NULL,sizeof(sex_ploidy_t),pld);
     pld->itr = regitr_init(pld->idx);
+    regitr_set_sorted(pld->itr,1);
+    pld->seg_itr = regitr_init(pld->idx);
 
     kstring_t tmp = {0,0,0};
     const char *ss = str;
@@ -182,6 +186,7 @@ void ploidy_destroy(ploidy_t *ploidy)
 {
     if ( ploidy->sex2id ) khash_str2int_destroy_free(ploidy->sex2id);
     if ( ploidy->itr ) regitr_destroy(ploidy->itr);
+    if ( ploidy->seg_itr ) regitr_destroy(ploidy->seg_itr);
     if ( ploidy->idx ) regidx_destroy(ploidy->idx);
     free(ploidy->id2sex);
     free(ploidy->tmp_str.s);
@@ -226,6 +231,39 @@ int ploidy_query(ploidy_t *ploidy, char *seq, int pos, int *sex2ploidy, int *min
     return 1;
 }
 
+int ploidy_query_segment(ploidy_t *ploidy, char *seq, int pos, int *sex2ploidy, int *min, int *max, uint32_t *beg, uint32_t *end)
+{
+    int ret = ploidy_query(ploidy, seq, pos, sex2ploidy, min, max);
+
+    // The ploidy cannot change until a region starts or ends. The regions are
+    // few so simply check all of them before and after the position.
+    uint32_t seg_beg = 0, seg_end = UINT32_MAX;
+    if ( regidx_overlap(ploidy->idx, seq,0,pos, ploidy->seg_itr) )
+    {
+        while ( regitr_overlap(ploidy->seg_itr) )
+        {
+            if ( ploidy->seg_itr->end < pos )
+            {
+                if ( seg_beg < ploidy->seg_itr->end + 1 ) seg_beg = ploidy->seg_itr->end + 1;
+                continue;
+            }
+            if ( seg_beg < ploidy->seg_itr->beg ) seg_beg = ploidy->seg_itr->beg;
+            if ( seg_end > ploidy->seg_itr->end ) seg_end = ploidy->seg_itr->end;
+        }
+    }
+    if ( regidx_overlap(ploidy->idx, seq,pos+1,REGIDX_MAX, ploidy->seg_itr) )
+    {
+        while ( regitr_overlap(ploidy->seg_itr) )
+        {
+            if ( ploidy->seg_itr->beg <= pos ) continue;
+            if ( seg_end > ploidy->seg_itr->beg - 1 ) seg_end = ploidy->seg_itr->beg - 1;
+        }
+    }
+    if ( beg ) *beg = seg_beg;
+    if ( end ) *end = seg_end;
+    return ret;
+}
+
 int ploidy_nsex(ploidy_t *ploidy)
 {
     return ploidy->nsex;
@@ -88,6 +88,16 @@ void ploidy_destroy(ploidy_t *ploidy);
  */
 int ploidy_query(ploidy_t *ploidy, char *seq, int pos, int *sex2ploidy, int *min, int *max);
 
+/*
+ *  ploidy_query_segment() - same as ploidy_query() but also returns the
+ *      segment around the position where the ploidy stays the same, so that
+ *      callers with sorted input can skip the queries until they leave it
+ *  @param beg: if not NULL, set to the 0-based start of the segment
+ *  @param end: if not NULL, set to the 0-based inclusive end of the segment,
+ *              UINT32_MAX if it extends to the end of the chromosome
+ */
+int ploidy_query_segment(ploidy_t *ploidy, char *seq, int pos, int *sex2ploidy, int *min, int *max, uint32_t *beg, uint32_t *end);
+
 /*
  *  ploidy_nsex() - return number of recognised genders
  */
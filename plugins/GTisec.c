@@ -40,8 +40,6 @@ DEALINGS IN THE SOFTWARE.  */
 
 #include <htslib/vcf.h>
 #include <htslib/synced_bcf_reader.h>
-#include <htslib/khash.h>
-KHASH_MAP_INIT_INT(gts2smps, uint32_t)
 
 #include "bcftools.h"
 
@@ -61,6 +59,11 @@ typedef struct _args_t
     int nsmpp2; /*! 2^(nsmp) (is needed multiple times) */
     int *gt_arr; /*! temporary array, to store GTs of current line/record */
     int ngt_arr; /*! hold the number of current GT array entries */
+    uint32_t *gt2smps; /*! sample bitmask for each genotype index of the current record,
+                         reused across records and reset for the touched entries only */
+    int mgt2smps; /*! allocated size of gt2smps */
+    int *gts; /*! list of genotype indexes present in the current record */
+    int mgts; /*! allocated size of gts */
     uint32_t *bankers; /*! array to store banker's sequence for all possible sample subsets for
                                 programmatic indexing into smp_is for output printing, e.g. for three
                                 samples A, B and C this would be the following order:
@@ -324,11 +327,9 @@ bcf1_t *process(bcf1_t *rec)
     }
 
     gte_smp /= args.nsmp; // divide total number of genotypes array entries (= args.ngt_arr) by number of samples
-    int ret;
+    int ngts = 0;
 
-    // stick all genotypes in a hash as keys and store up to 32 samples in a corresponding flag as its value
-    khiter_t bucket;
-    khash_t(gts2smps) *gts = kh_init(gts2smps); // create hash
+    // collect for each genotype the samples which carry it as a bitmask of up to 32 samples
     for ( i = 0; i < args.nsmp; i++ )
     {
         int *gt_ptr = args.gt_arr + gte_smp * i;
@@ -354,27 +355,23 @@ bcf1_t *process(bcf1_t *rec)
             error("gtisec does not support ploidy higher than 2.\n");
         }
 
-        int idx = bcf_alleles2gt(a,b); // generate genotype specific hash key
-
-        bucket = kh_get(gts2smps, gts, idx); // get the genotype's hash bucket
-
-        if ( bucket == kh_end(gts) ) { // means that key does not exist
-            bucket = kh_put(gts2smps, gts, idx, &ret); // create bucket with genotype index as key and return its iterator
-            kh_val(gts, bucket) = 0; // initialize the bucket with all sample bits unset
+        // generate genotype specific index, even for haploid and odd for diploid genotypes
+        int idx = b < 0 ? 2*a : 2*bcf_alleles2gt(a,b) + 1;
+        hts_expand0(uint32_t, idx+1, args.mgt2smps, args.gt2smps);
+        if ( !args.gt2smps[idx] ) // first sample with this genotype
+        {
+            hts_expand(int, ngts+1, args.mgts, args.gts);
+            args.gts[ngts++] = idx;
         }
-        kh_value(gts, bucket) |= (1<<i); // set the sample's bit to 1 in this genotype's bucket
+        args.gt2smps[idx] |= (uint32_t)1<<i; // set the sample's bit to 1 for this genotype
     }
 
-    // iterate over genotypes and for each genotype increment the appropriate smp_is entry
-    for ( bucket = kh_begin(gts); bucket != kh_end(gts); ++bucket ) // iterate over all genotypes at this position
+    // for each genotype present at this position increment the appropriate smp_is entry
+    for ( i = 0; i < ngts; i++ )
     {
-        if ( kh_exist(gts, bucket) ) // for existing genotype buckets
-        {
-            uint32_t s = kh_val(gts, bucket); // get the 32 bit flag
-            args.smp_is[s]++; // add to the corresponding subset
-        }
+        args.smp_is[ args.gt2smps[args.gts[i]] ]++; // add to the corresponding subset
+        args.gt2smps[args.gts[i]] = 0;
     }
-    kh_destroy(gts2smps, gts); // destroy hash
 
     return NULL;
 }
@@ -463,6 +460,8 @@ void destroy(void)
 
     /* freeing up args */
     free(args.gt_arr);
+    free(args.gt2smps);
+    free(args.gts);
     free(args.bankers);
     free(args.quick);
     if (args.flag & MISSING) free(args.missing_gts);
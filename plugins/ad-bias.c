@@ -33,6 +33,7 @@
 #include <htslib/kstring.h>
 #include <htslib/kseq.h>
 #include <htslib/kfunc.h>
+#include <htslib/khash.h>
 #include <inttypes.h>
 #include "bcftools.h"
 #include "convert.h"
@@ -44,6 +45,11 @@ typedef struct
 }
 pair_t;
 
+// Fisher test p-values keyed by the 2x2 table, the AD counts repeat a lot at low depth
+KHASH_MAP_INIT_INT64(fisher, double)
+#define FISHER_CACHE_MAX_COUNT 0xffff
+#define FISHER_CACHE_MAX_SIZE  (1<<20)
+
 typedef struct
 {
     bcf_hdr_t *hdr;
@@ -55,6 +61,7 @@ typedef struct
     convert_t *convert;
     kstring_t str;
     uint64_t nsite,ncmp;
+    khash_t(fisher) *fisher_cache;
 }
 args_t;
 
@@ -164,6 +171,7 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
     if ( !fname ) error("Expected the -s option\n");
     parse_samples(&args, fname);
     if ( format ) args.convert = convert_init(args.hdr, NULL, 0, format);
+    args.fisher_cache = kh_init(fisher);
     printf("# This file was produced by: bcftools +ad-bias(%s+htslib-%s)\n", bcftools_version(),hts_version());
     printf("# The command line was:\tbcftools +ad-bias %s", argv[0]);
     for (c=1; c<argc; c++) printf(" %s",argv[c]);
@@ -174,6 +182,31 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
     return 1;
 }
 
+static double fisher_test(args_t *args, int n11, int n12, int n21, int n22)
+{
+    double left, right, fisher;
+    if ( n11<0 || n12<0 || n21<0 || n22<0
+            || n11>FISHER_CACHE_MAX_COUNT || n12>FISHER_CACHE_MAX_COUNT
+            || n21>FISHER_CACHE_MAX_COUNT || n22>FISHER_CACHE_MAX_COUNT )
+    {
+        kt_fisher_exact(n11,n12,n21,n22, &left,&right,&fisher);
+        return fisher;
+    }
+
+    uint64_t key = (uint64_t)n11<<48 | (uint64_t)n12<<32 | (uint64_t)n21<<16 | (uint64_t)n22;
+    khint_t k = kh_get(fisher, args->fisher_cache, key);
+    if ( k!=kh_end(args->fisher_cache) ) return kh_val(args->fisher_cache, k);
+
+    kt_fisher_exact(n11,n12,n21,n22, &left,&right,&fisher);
+
+    // keep the memory bounded, deep sites rarely repeat
+    if ( kh_size(args->fisher_cache) >= FISHER_CACHE_MAX_SIZE ) kh_clear(fisher, args->fisher_cache);
+    int ret;
+    k = kh_put(fisher, args->fisher_cache, key, &ret);
+    kh_val(args->fisher_cache, k) = fisher;
+    return fisher;
+}
+
 bcf1_t *process(bcf1_t *rec)
 {
     int nad = bcf_get_format_int32(args.hdr, rec, "AD", &args.ad_arr, &args.mad_arr);
@@ -200,8 +233,7 @@ bcf1_t *process(bcf1_t *rec)
 
         int n11 = aptr[0], n12 = aptr[1];
         int n21 = bptr[0], n22 = bptr[1];
-        double left, right, fisher;
-        kt_fisher_exact(n11,n12,n21,n22, &left,&right,&fisher);
+        double fisher = fisher_test(&args, n11,n12,n21,n22);
         if ( fisher >= args.th ) continue;
 
         printf("FT\t%s\t%s\t%s\t%d\t%d\t%d\t%d\t%d\t%e",
@@ -223,4 +255,5 @@ void destroy(void)
     free(args.str.s);
     free(args.pair);
     free(args.ad_arr);
+    kh_destroy(fisher, args.fisher_cache);
 }
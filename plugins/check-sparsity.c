@@ -32,6 +32,7 @@
 #include <htslib/synced_bcf_reader.h>
 #include <htslib/vcfutils.h>
 #include <htslib/kseq.h>
+#include <htslib/thread_pool.h>
 #include <inttypes.h>
 #include <unistd.h>
 #include "bcftools.h"
@@ -41,8 +42,8 @@ typedef struct
     int argc;
     char **argv, *fname, *region, **regs;
     int region_is_file, nregs, regs_free;
-    int *smpl, nsmpl, *nsites, min_sites, gt_id;
-    kstring_t tmps;
+    int *smpl, nsmpl, *nsites, min_sites, gt_id, n_threads;
+    kstring_t tmps, out;
     bcf1_t *rec;
     tbx_t *tbx;
     hts_idx_t *idx;
@@ -52,6 +53,14 @@ typedef struct
 }
 args_t;
 
+typedef struct
+{
+    args_t args;        // a copy with its own reader
+    char *reg;
+    kstring_t out;
+}
+chunk_t;
+
 const char *about(void)
 {
     return "Print samples without genotypes in a region or chromosome\n";
@@ -68,9 +77,18 @@ static const char *usage_text(void)
         "   -n, --n-markers <int>           minimum number of required markers [1]\n"
         "   -r, --regions <chr:beg-end>     restrict to comma-separated list of regions\n"
         "   -R, --regions-file <file>       restrict to regions listed in a file\n"
+        "       --threads <int>             number of regions to check in parallel, requires an indexed file [0]\n"
         "\n";
 }
 
+static void init_samples(args_t *args)
+{
+    int i;
+    args->nsmpl  = bcf_hdr_nsamples(args->hdr);
+    args->nsites = (int*) calloc(args->nsmpl, sizeof(int));
+    args->smpl   = (int*) malloc(sizeof(int)*args->nsmpl);
+    for (i=0; i<args->nsmpl; i++) args->smpl[i] = i;
+}
 static void init_data(args_t *args)
 {
     args->fp = hts_open(args->fname,"r");
@@ -81,12 +99,7 @@ static void init_data(args_t *args)
     args->rec = bcf_init1();
     args->gt_id = bcf_hdr_id2int(args->hdr,BCF_DT_ID,"GT");
     if ( args->gt_id<0 ) error("Error: GT field is not present\n");
-
-    int i;
-    args->nsmpl  = bcf_hdr_nsamples(args->hdr);
-    args->nsites = (int*) calloc(args->nsmpl, sizeof(int));
-    args->smpl   = (int*) malloc(sizeof(int)*args->nsmpl);
-    for (i=0; i<args->nsmpl; i++) args->smpl[i] = i;
+    init_samples(args);
 
     if ( strcmp("-",args->fname) )  // not reading from stdin
     {
@@ -124,6 +137,7 @@ static void destroy_data(args_t *args)
     bcf_hdr_destroy(args->hdr);
     bcf_destroy(args->rec);
     free(args->tmps.s);
+    free(args->out.s);
     free(args->smpl);
     free(args->nsites);
     if ( args->itr ) hts_itr_destroy(args->itr);
@@ -136,7 +150,12 @@ static void report(args_t *args, const char *reg)
 {
     int i;
     for (i=0; i<args->nsmpl; i++)
-        printf("%s\t%s\n", reg, args->hdr->samples[args->smpl[i]]);
+        ksprintf(&args->out, "%s\t%s\n", reg, args->hdr->samples[args->smpl[i]]);
+    if ( !args->n_threads && args->out.l )
+    {
+        fwrite(args->out.s, 1, args->out.l, stdout);
+        args->out.l = 0;
+    }
     args->nsmpl = bcf_hdr_nsamples(args->hdr);
     for (i=0; i<args->nsmpl; i++) args->smpl[i] = i;
     memset(args->nsites, 0, sizeof(int)*args->nsmpl);
@@ -225,6 +244,72 @@ static void test_region(args_t *args, char *reg)
     args->itr = NULL;
 }
 
+static void *test_chunk(void *arg)
+{
+    chunk_t *chunk = (chunk_t*) arg;
+    args_t *args = &chunk->args;
+
+    // the index is shared, the reader and the per-sample counts are not
+    args->fp = hts_open(args->fname,"r");
+    if ( !args->fp ) error("Could not read %s\n", args->fname);
+    args->hdr = bcf_hdr_read(args->fp);
+    if ( !args->hdr ) error("Could not read the header: %s\n", args->fname);
+    args->rec = bcf_init1();
+    memset(&args->tmps, 0, sizeof(args->tmps));
+    args->out = chunk->out;
+    args->out.l = 0;
+    init_samples(args);
+
+    test_region(args, chunk->reg);
+
+    chunk->out = args->out;
+    free(args->tmps.s);
+    free(args->smpl);
+    free(args->nsites);
+    bcf_destroy(args->rec);
+    bcf_hdr_destroy(args->hdr);
+    hts_close(args->fp);
+    return chunk;
+}
+
+static void write_chunk(hts_tpool_process *q)
+{
+    hts_tpool_result *res = hts_tpool_next_result_wait(q);
+    if ( !res ) error("Failed to retrieve the checked region\n");
+    chunk_t *chunk = (chunk_t*) hts_tpool_result_data(res);
+    if ( chunk->out.l ) fwrite(chunk->out.s, 1, chunk->out.l, stdout);
+    hts_tpool_delete_result(res, 0);
+}
+
+// The regions are checked independently, at most two per thread are in flight
+// and the output is printed in the original order of the regions
+static void test_chunks(args_t *args)
+{
+    hts_tpool *pool = hts_tpool_init(args->n_threads);
+    if ( !pool ) error("Failed to create threads\n");
+    int i, nchunks = 2*args->n_threads, nbusy = 0, ichunk = 0;
+    chunk_t *chunks = (chunk_t*) calloc(nchunks, sizeof(chunk_t));
+    hts_tpool_process *q = hts_tpool_process_init(pool, nchunks, 0);
+    if ( !q ) error("Failed to initialize the thread pool queue\n");
+    for (i=0; i<args->nregs; i++)
+    {
+        chunk_t *chunk = &chunks[ichunk];
+        ichunk = (ichunk + 1) % nchunks;
+        if ( nbusy==nchunks ) { write_chunk(q); nbusy--; }
+        chunk->args = *args;
+        chunk->reg  = args->regs[i];
+        if ( hts_tpool_dispatch(pool, q, test_chunk, chunk) < 0 )
+            error("Failed to dispatch the region %s to the thread pool\n", args->regs[i]);
+        nbusy++;
+    }
+    while ( nbusy ) { write_chunk(q); nbusy--; }
+    hts_tpool_process_destroy(q);
+    hts_tpool_destroy(pool);
+
+    for (i=0; i<nchunks; i++) free(chunks[i].out.s);
+    free(chunks);
+}
+
 int run(int argc, char **argv)
 {
     args_t *args = (args_t*) calloc(1,sizeof(args_t));
@@ -235,6 +320,7 @@ int run(int argc, char **argv)
         {"n-markers",required_argument,NULL,'n'},
         {"regions",required_argument,NULL,'r'},
         {"regions-file",required_argument,NULL,'R'},
+        {"threads",required_argument,NULL,1},
         {NULL,0,NULL,0}
     };
     int c,i;
@@ -247,6 +333,10 @@ int run(int argc, char **argv)
                 args->min_sites = strtol(optarg,&tmp,10);
                 if ( *tmp ) error("Could not parse: -n %s\n", optarg);
                 break;
+            case 1:
+                args->n_threads = strtol(optarg,&tmp,10);
+                if ( *tmp || args->n_threads<0 ) error("Could not parse: --threads %s\n", optarg);
+                break;
             case 'R': args->region_is_file = 1; 
             case 'r': args->region = optarg; break; 
             case 'h':
@@ -263,8 +353,14 @@ int run(int argc, char **argv)
     else args->fname = argv[optind];
     init_data(args);
 
-    for (i=0; i<args->nregs; i++) test_region(args, args->regs[i]);
-    if ( !args->nregs ) test_region(args, NULL);
+    if ( args->n_threads && args->nregs > 1 )
+        test_chunks(args);
+    else
+    {
+        for (i=0; i<args->nregs; i++) test_region(args, args->regs[i]);
+        if ( !args->nregs ) test_region(args, NULL);
+        if ( args->out.l ) fwrite(args->out.s, 1, args->out.l, stdout);
+    }
 
     destroy_data(args);
     free(args);
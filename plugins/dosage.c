@@ -25,6 +25,7 @@ DEALINGS IN THE SOFTWARE.  */
 #include <stdio.h>
 #include <stdlib.h>
 #include <htslib/vcf.h>
+#include <htslib/kstring.h>
 #include <math.h>
 #include <getopt.h>
 
@@ -47,6 +48,8 @@ const char *usage(void)
         "   run \"bcftools plugin\" for a list of common options\n"
         "\n"
         "Plugin options:\n"
+        "   -b, --binary <file> write the dosages to <file> as a matrix of native 32-bit floats,\n"
+        "                       one row of samples per site; only the sites are printed\n"
         "   -t, --tags <list>   VCF tags to determine the dosage from [PL,GL,GT]\n"
         "\n"
         "Example:\n"
@@ -60,38 +63,59 @@ uint8_t *buf = NULL;
 int nbuf = 0;   // NB: number of elements, not bytes
 char **tags = NULL;
 int ntags = 0;
+float *dsg = NULL;  // dosages of the current site, one per sample
+kstring_t str = {0,0,0};
+FILE *bin_fh = NULL;
+
+// PLs are small integers, their probabilities are looked up rather than
+// calculated with exp() for every genotype of every sample
+#define NPL2PROB 1024
+float pl2prob[NPL2PROB];
 
 typedef int (*dosage_f) (bcf1_t *);
 dosage_f *handlers = NULL;
 int nhandlers = 0;
 
 
+static inline float pl_prob_int(int32_t pl)
+{
+    return pl>=0 && pl<NPL2PROB ? pl2prob[pl] : exp(-0.1*pl);
+}
+static inline float pl_prob_float(float pl)
+{
+    return exp(-0.1*pl);
+}
+static inline float gl_prob(float gl)
+{
+    return exp(gl);
+}
+
 int calc_dosage_PL(bcf1_t *rec)
 {
     int i, j, nret = bcf_get_format_values(in_hdr,rec,"PL",(void**)&buf,&nbuf,pl_type);
     if ( nret<0 ) return -1;
 
     nret /= rec->n_sample;
-    #define BRANCH(type_t,is_missing,is_vector_end) \
+    #define BRANCH(type_t,is_missing,is_vector_end,prob) \
     { \
         type_t *ptr = (type_t*) buf; \
         for (i=0; i<rec->n_sample; i++) \
         { \
             float vals[3] = {0,0,0}; \
-            for (j=0; j<nret; j++) \
+            for (j=0; j<nret && j<3; j++) \
             { \
                 if ( is_missing || is_vector_end ) break; \
-                vals[j] = exp(-0.1*ptr[j]); \
+                vals[j] = prob(ptr[j]); \
             } \
             float sum = vals[0] + vals[1] + vals[2]; \
-            printf("\t%.1f", sum==0 ? -1 : (vals[1] + 2*vals[2]) / sum); \
+            dsg[i] = sum==0 ? -1 : (vals[1] + 2*vals[2]) / sum; \
             ptr += nret; \
         } \
     }
     switch (pl_type)
     {
-        case BCF_HT_INT:  BRANCH(int32_t,ptr[j]==bcf_int32_missing,ptr[j]==bcf_int32_vector_end); break;
-        case BCF_HT_REAL: BRANCH(float,bcf_float_is_missing(ptr[j]),bcf_float_is_vector_end(ptr[j])); break;
+        case BCF_HT_INT:  BRANCH(int32_t,ptr[j]==bcf_int32_missing,ptr[j]==bcf_int32_vector_end,pl_prob_int); break;
+        case BCF_HT_REAL: BRANCH(float,bcf_float_is_missing(ptr[j]),bcf_float_is_vector_end(ptr[j]),pl_prob_float); break;
     }
     #undef BRANCH
     return 0;
@@ -99,7 +123,7 @@ int calc_dosage_PL(bcf1_t *rec)
 
 int calc_dosage_GL(bcf1_t *rec)
 {
-    int i, j, nret = bcf_get_format_values(in_hdr,rec,"GL",(void**)&buf,&nbuf,pl_type);
+    int i, j, nret = bcf_get_format_values(in_hdr,rec,"GL",(void**)&buf,&nbuf,gl_type);
     if ( nret<0 ) return -1;
 
     nret /= rec->n_sample;
@@ -109,17 +133,17 @@ int calc_dosage_GL(bcf1_t *rec)
         for (i=0; i<rec->n_sample; i++) \
         { \
             float vals[3] = {0,0,0}; \
-            for (j=0; j<nret; j++) \
+            for (j=0; j<nret && j<3; j++) \
             { \
                 if ( is_missing || is_vector_end ) break; \
-                vals[j] = exp(ptr[j]); \
+                vals[j] = gl_prob(ptr[j]); \
             } \
             float sum = vals[0] + vals[1] + vals[2]; \
-            printf("\t%.1f", sum==0 ? -1 : (vals[1] + 2*vals[2]) / sum); \
+            dsg[i] = sum==0 ? -1 : (vals[1] + 2*vals[2]) / sum; \
             ptr  += nret; \
         } \
     }
-    switch (pl_type)
+    switch (gl_type)
     {
         case BCF_HT_INT:  BRANCH(int32_t,ptr[j]==bcf_int32_missing,ptr[j]==bcf_int32_vector_end); break;
         case BCF_HT_REAL: BRANCH(float,bcf_float_is_missing(ptr[j]),bcf_float_is_vector_end(ptr[j])); break;
@@ -137,18 +161,38 @@ int calc_dosage_GT(bcf1_t *rec)
     int32_t *ptr = (int32_t*) buf;
     for (i=0; i<rec->n_sample; i++)
     {
-        float dsg = 0;
+        float val = 0;
         for (j=0; j<nret; j++)
         {
             if ( ptr[j]==bcf_int32_vector_end || bcf_gt_is_missing(ptr[j]) ) break;
-            if ( bcf_gt_allele(ptr[j]) ) dsg += 1;
+            if ( bcf_gt_allele(ptr[j]) ) val += 1;
         }
-        printf("\t%.1f", j>0 ? dsg : -1);
+        dsg[i] = j>0 ? val : -1;
         ptr += nret;
     }
     return 0;
 }
 
+// Same as ksprintf(str,"\t%.1f",val) for the usual values. The float is scaled
+// exactly in double precision and lrint() rounds half to even, as printf does.
+static inline void format_dosage(kstring_t *str, float val)
+{
+    if ( !(val>=0 && val<100) )
+    {
+        ksprintf(str,"\t%.1f",val);
+        return;
+    }
+    long k = lrint((double)val*10.0);
+    ks_resize(str, str->l + 7);
+    char *p = str->s + str->l;
+    *p++ = '\t';
+    if ( k>=100 ) *p++ = '0' + k/100;
+    *p++ = '0' + (k/10)%10;
+    *p++ = '.';
+    *p++ = '0' + k%10;
+    str->l = p - str->s;
+}
+
 
 char **split_list(char *str, int *nitems)
 {
@@ -177,13 +221,18 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
     static struct option loptions[] =
     {
         {"tags",1,0,'t'},
+        {"binary",1,0,'b'},
         {0,0,0,0}
     };
-    while ((c = getopt_long(argc, argv, "t:?h",loptions,NULL)) >= 0)
+    while ((c = getopt_long(argc, argv, "t:b:?h",loptions,NULL)) >= 0)
     {
         switch (c) 
         {
             case 't': tags_str = optarg; break;
+            case 'b':
+                bin_fh = fopen(optarg,"wb");
+                if ( !bin_fh ) { fprintf(stderr,"Could not open %s\n", optarg); return -1; }
+                break;
             case 'h':
             case '?':
             default: fprintf(stderr,"%s", usage()); exit(1); break;
@@ -238,8 +287,12 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
     free(tags[0]);
     free(tags);
 
+    for (i=0; i<NPL2PROB; i++) pl2prob[i] = exp(-0.1*i);
+    dsg = (float*) malloc(sizeof(*dsg)*(bcf_hdr_nsamples(in_hdr) ? bcf_hdr_nsamples(in_hdr) : 1));
+
     printf("#[1]CHROM\t[2]POS\t[3]REF\t[4]ALT");
-    for (i=0; i<bcf_hdr_nsamples(in_hdr); i++) printf("\t[%d]%s", i+5,in_hdr->samples[i]);
+    if ( !bin_fh )
+        for (i=0; i<bcf_hdr_nsamples(in_hdr); i++) printf("\t[%d]%s", i+5,in_hdr->samples[i]);
     printf("\n");
 
     return 1;
@@ -250,25 +303,37 @@ bcf1_t *process(bcf1_t *rec)
 {
     int i, ret;
 
-    printf("%s\t%d\t%s\t%s", bcf_seqname(in_hdr,rec),rec->pos+1,rec->d.allele[0],rec->n_allele>1 ? rec->d.allele[1] : ".");
+    str.l = 0;
+    ksprintf(&str,"%s\t%d\t%s\t%s", bcf_seqname(in_hdr,rec),rec->pos+1,rec->d.allele[0],rec->n_allele>1 ? rec->d.allele[1] : ".");
     if ( rec->n_allele==1 )
     {
-        for (i=0; i<rec->n_sample; i++) printf("\t0.0");
+        for (i=0; i<rec->n_sample; i++) dsg[i] = 0;
     }
     else
     {
         for (i=0; i<nhandlers; i++)
         {
             ret = handlers[i](rec);
-            if ( !ret ) break;  // successfully printed
+            if ( !ret ) break;  // successfully set
         }
         if ( i==nhandlers )
         {
             // none of the annotations present
-            for (i=0; i<rec->n_sample; i++) printf("\t-1.0");
+            for (i=0; i<rec->n_sample; i++) dsg[i] = -1;
         }
     }
-    printf("\n");
+    if ( bin_fh )
+    {
+        if ( fwrite(dsg,sizeof(*dsg),rec->n_sample,bin_fh)!=(size_t)rec->n_sample )
+        {
+            fprintf(stderr,"Failed to write the binary dosages\n");
+            exit(1);
+        }
+    }
+    else
+        for (i=0; i<rec->n_sample; i++) format_dosage(&str,dsg[i]);
+    kputc('\n',&str);
+    fwrite(str.s,1,str.l,stdout);
 
     return NULL;
 }
@@ -278,6 +343,13 @@ void destroy(void)
 {
     free(handlers);
     free(buf);
+    free(dsg);
+    free(str.s);
+    if ( bin_fh && fclose(bin_fh)!=0 )
+    {
+        fprintf(stderr,"Failed to close the binary dosage file\n");
+        exit(1);
+    }
 }
 
 
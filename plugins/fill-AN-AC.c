@@ -31,6 +31,9 @@ DEALINGS IN THE SOFTWARE.  */
 bcf_hdr_t *in_hdr, *out_hdr;
 int *arr = NULL, marr = 0;
 
+// No state is kept between records, batches can be processed concurrently
+int thread_safe = 1;
+
 const char *about(void)
 {
     return "Fill INFO fields AN and AC.\n";
@@ -45,23 +48,34 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
     return 0;
 }
 
-bcf1_t *process(bcf1_t *rec)
+static void fill_an_ac(bcf1_t *rec, int **arr, int *marr)
 {
-    hts_expand(int,rec->n_allele,marr,arr);
-    int ret = bcf_calc_ac(in_hdr,rec,arr,BCF_UN_FMT);
+    hts_expand(int,rec->n_allele,*marr,*arr);
+    int ret = bcf_calc_ac(in_hdr,rec,*arr,BCF_UN_FMT);
     if ( ret>0 )
     {
         int i, an = 0;
-        for (i=0; i<rec->n_allele; i++) an += arr[i];
+        for (i=0; i<rec->n_allele; i++) an += (*arr)[i];
         bcf_update_info_int32(out_hdr, rec, "AN", &an, 1);
-        bcf_update_info_int32(out_hdr, rec, "AC", arr+1, rec->n_allele-1);
+        bcf_update_info_int32(out_hdr, rec, "AC", *arr+1, rec->n_allele-1);
     }
+}
+
+bcf1_t *process(bcf1_t *rec)
+{
+    fill_an_ac(rec, &arr, &marr);
     return rec;
 }
 
+int process_batch(bcf1_t **recs, int nrecs)
+{
+    int i, *tmp = NULL, mtmp = 0;
+    for (i=0; i<nrecs; i++) fill_an_ac(recs[i], &tmp, &mtmp);
+    free(tmp);
+    return 0;
+}
+
 void destroy(void)
 {
     free(arr);
 }
-
-
@@ -31,6 +31,7 @@ DEALINGS IN THE SOFTWARE.  */
 #include <htslib/kseq.h>
 #include "filter.h"
 #include "bcftools.h"
+#include "refseq.h"
 
 const char *about(void)
 {
@@ -72,6 +73,8 @@ const char *usage(void)
 
 bcf_hdr_t *in_hdr = NULL, *out_hdr = NULL;
 faidx_t *faidx;
+refseq_t *refseq;
+kstring_t fa_str = {0,0,0};
 int anno = 0;
 char *column = NULL;
 
@@ -158,6 +161,8 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
         return -1;
     }
     faidx = fai_load(ref_fname);
+    if ( !faidx ) error("Failed to load the fai index: %s\n", ref_fname);
+    refseq = refseq_init(faidx, 0);
     if ( filter_str )
         filter = filter_init(in, filter_str);
     return 0;
@@ -178,9 +183,7 @@ bcf1_t *process(bcf1_t *rec)
     char *ref = rec->d.allele[0];
     int ref_len = strlen(ref);
     int fa_len;
-    // could be sped up here by fetching the whole chromosome? could assume
-    // sorted, but revert to this when non-sorted records found?
-    char *fa = faidx_fetch_seq(faidx, bcf_seqname(in_hdr,rec), rec->pos, rec->pos+ref_len-1, &fa_len);
+    char *fa = refseq_fetch_kstr(refseq, bcf_seqname(in_hdr,rec), rec->pos, rec->pos+ref_len-1, &fa_str, &fa_len);
     if ( !fa ) error("faidx_fetch_seq failed at %s:%d\n", bcf_hdr_id2name(in_hdr,rec->rid), rec->pos+1);
     for (i=0; i<fa_len; i++)
         if ( (int)fa[i]>96 ) fa[i] -= 32;
@@ -195,12 +198,13 @@ bcf1_t *process(bcf1_t *rec)
         int val = atoi(&fa[0]);
         bcf_update_info_int32(out_hdr, rec, column, &val, 1);
     }
-    free(fa);
     return rec;
 }
 
 void destroy(void)
 {
+    refseq_destroy(refseq);
+    free(fa_str.s);
     fai_destroy(faidx);
     if (filter) filter_destroy(filter);
 }
@@ -45,6 +45,17 @@
 #define SET_MAF     (1<<7)
 #define SET_HWE     (1<<8)
 
+// Diploid genotypes with alleles 0-3 are classified by a lookup of the two raw
+// BCF_BT_INT8 values and counted in per-population histograms indexed by the
+// key als<<2|kind, which are converted to allele counts once per site
+#define GT_HALF 0
+#define GT_HET  1
+#define GT_HOM  2
+#define GT_HEMI 3
+#define GT_NKEYS 64
+#define GT_MISSING -1
+#define GT_SLOW    -2
+
 typedef struct
 {
     int nhom, nhet, nhemi, nac;
@@ -58,6 +69,7 @@ typedef struct
     counts_t *counts;
     char *name, *suffix;
     int nsmpl, *smpl;
+    int *gt_hist;       // GT_NKEYS genotype counts
 }
 pop_t;
 
@@ -71,6 +83,7 @@ typedef struct
     double *hwe_probs;
     int mhwe_probs;
     kstring_t str;
+    int8_t *gt2key;     // two INT8 GT values to the histogram key, GT_MISSING or GT_SLOW
 }
 args_t;
 
@@ -192,6 +205,9 @@ void init_pops(args_t *args)
     args->pop[args->npop-1].name   = strdup("");
     args->pop[args->npop-1].suffix = strdup("");
 
+    for (i=0; i<args->npop; i++)
+        args->pop[i].gt_hist = (int*) calloc(GT_NKEYS,sizeof(int));
+
     nsmpl = bcf_hdr_nsamples(args->in_hdr);
     args->smpl2pop = (pop_t**) calloc(nsmpl*(args->npop+1),sizeof(pop_t*));
     for (i=0; i<nsmpl; i++)
@@ -209,6 +225,39 @@ void init_pops(args_t *args)
     }
 }
 
+// The same classification as in process(), tabulated for all pairs of INT8 values
+static void init_gt2key(args_t *args)
+{
+    args->gt2key = (int8_t*) malloc(256*256);
+    int b0, b1;
+    for (b0=0; b0<256; b0++)
+        for (b1=0; b1<256; b1++)
+        {
+            int8_t p[2] = { (int8_t)b0, (int8_t)b1 };
+            int ial, als = 0, nals = 0, key = 0, kind;
+            for (ial=0; ial<2; ial++)
+            {
+                if ( p[ial]==bcf_int8_vector_end ) break;
+                if ( bcf_gt_is_missing(p[ial]) ) continue;
+                int idx = bcf_gt_allele(p[ial]);
+                if ( idx<0 || idx>=4 ) { key = GT_SLOW; break; }
+                nals++;
+                als |= 1<<idx;
+            }
+            if ( key==GT_SLOW ) ;
+            else if ( nals==0 ) key = GT_MISSING;
+            else
+            {
+                int is_hom = !(als & (als-1));
+                if ( nals!=ial ) kind = args->drop_missing ? GT_HALF : (is_hom ? GT_HEMI : GT_HET);
+                else if ( nals==1 ) kind = GT_HEMI;
+                else kind = is_hom ? GT_HOM : GT_HET;
+                key = als<<2 | kind;
+            }
+            args->gt2key[b0 | b1<<8] = key;
+        }
+}
+
 int parse_tags(args_t *args, const char *str)
 {
     int i, flag = 0, n_tags;
@@ -279,6 +328,7 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
 
     if ( samples_fname ) parse_samples(args, samples_fname);
     init_pops(args);
+    init_gt2key(args);
 
     if ( args->tags & SET_AN ) hdr_append(args, "##INFO=<ID=AN%s,Number=1,Type=Integer,Description=\"Total number of alleles in called genotypes%s%s\">");
     if ( args->tags & SET_AC ) hdr_append(args, "##INFO=<ID=AC%s,Number=A,Type=Integer,Description=\"Allele count in genotypes%s%s\">");
@@ -384,6 +434,53 @@ static void clean_counts(pop_t *pop, int nals)
     memset(pop->counts,0,sizeof(counts_t)*nals);
 }
 
+// Add the genotype histogram to the counts, with the multiplicity of set_counts()
+static void hist2counts(pop_t *pop)
+{
+    int key;
+    for (key=0; key<GT_NKEYS; key++)
+    {
+        int n = pop->gt_hist[key];
+        if ( !n ) continue;
+        pop->gt_hist[key] = 0;
+        int ial, als = key>>2, kind = key&3;
+        for (ial=0; als; ial++, als>>=1)
+        {
+            if ( !(als&1) ) continue;
+            if ( kind==GT_HALF ) pop->counts[ial].nac += n;
+            else if ( kind==GT_HET ) pop->counts[ial].nhet += n;
+            else if ( kind==GT_HOM ) pop->counts[ial].nhom += 2*n;
+            else pop->counts[ial].nhemi += n;
+        }
+        pop->ns += n;
+    }
+}
+
+// Single pass over diploid INT8 genotypes. Returns 0 if some genotype needs the
+// general code, the histograms are then left clean
+static int count_diploid_int8(args_t *args, bcf1_t *rec, bcf_fmt_t *fmt_gt, int nsmpl)
+{
+    int i, npop1 = args->npop + 1;
+    uint8_t *p = fmt_gt->p;
+    for (i=0; i<nsmpl; i++, p+=2)
+    {
+        int key = args->gt2key[p[0] | p[1]<<8];
+        if ( key<0 )
+        {
+            if ( key==GT_MISSING ) continue;
+            for (i=0; i<args->npop; i++) memset(args->pop[i].gt_hist,0,sizeof(int)*GT_NKEYS);
+            return 0;
+        }
+        if ( (key>>2) >> rec->n_allele )
+            error("Incorrect allele (\"%d\") in %s at %s:%d\n",bcf_gt_allele((int8_t)p[0]) >= rec->n_allele ? bcf_gt_allele((int8_t)p[0]) : bcf_gt_allele((int8_t)p[1]),
+                args->in_hdr->samples[i],bcf_seqname(args->in_hdr,rec),rec->pos+1);
+        pop_t **pop = &args->smpl2pop[i*npop1];
+        while ( *pop ) { (*pop)->gt_hist[key]++; pop++; }
+    }
+    for (i=0; i<args->npop; i++) hist2counts(&args->pop[i]);
+    return 1;
+}
+
 bcf1_t *process(bcf1_t *rec)
 {
     int i,j, nsmpl = bcf_hdr_nsamples(args->in_hdr);;
@@ -404,6 +501,9 @@ bcf1_t *process(bcf1_t *rec)
 
     assert( rec->n_allele < 8*sizeof(int) );
 
+    if ( fmt_gt->type==BCF_BT_INT8 && fmt_gt->n==2 && count_diploid_int8(args, rec, fmt_gt, nsmpl) )
+        goto counted;
+
     #define BRANCH_INT(type_t,vector_end) \
     { \
         for (i=0; i<nsmpl; i++) \
@@ -442,6 +542,7 @@ bcf1_t *process(bcf1_t *rec)
     }
     #undef BRANCH_INT
 
+counted:
     if ( args->tags & SET_NS )
     {
         for (i=0; i<args->npop; i++)
@@ -607,6 +708,7 @@ void destroy(void)
         free(args->pop[i].suffix);
         free(args->pop[i].smpl);
         free(args->pop[i].counts);
+        free(args->pop[i].gt_hist);
     }
     free(args->str.s);
     free(args->pop);
@@ -614,6 +716,7 @@ void destroy(void)
     free(args->iarr);
     free(args->farr);
     free(args->hwe_probs);
+    free(args->gt2key);
     free(args);
 }
 
@@ -85,6 +85,7 @@
 #include <htslib/khash.h>
 #include <htslib/synced_bcf_reader.h>
 #include "bcftools.h"
+#include "refseq.h"
 
 #define MODE_STATS    1
 #define MODE_TOP2FWD  2
@@ -107,6 +108,7 @@ typedef struct
     int mode, discard;
     bcf_hdr_t *hdr;
     faidx_t *fai;
+    refseq_t *ref;
     int rid, skip_rid;
     i2m_t *i2m;
     int32_t *gts, ngts, pos;
@@ -203,6 +205,7 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
     if ( !ref_fname ) error("Expected the -f option\n");
     args.fai = fai_load(ref_fname);
     if ( !args.fai ) error("Failed to load the fai index: %s\n", ref_fname);
+    args.ref = refseq_init(args.fai, 0);
 
     if ( args.mode==MODE_STATS ) return 1;
     return 0;
@@ -266,7 +269,7 @@ static int fetch_ref(args_t *args, bcf1_t *rec)
 {
     // Get the reference allele
     int len;
-    char *ref = faidx_fetch_seq(args->fai, (char*)bcf_seqname(args->hdr,rec), rec->pos, rec->pos, &len);
+    const char *ref = refseq_fetch(args->ref, bcf_seqname(args->hdr,rec), rec->pos, rec->pos, &len);
     if ( !ref )
     {
         if ( faidx_has_seq(args->fai, bcf_seqname(args->hdr,rec))==0 )
@@ -277,9 +280,7 @@ static int fetch_ref(args_t *args, bcf1_t *rec)
         }
         error("faidx_fetch_seq failed at %s:%d\n", bcf_seqname(args->hdr,rec),rec->pos+1);
     }
-    int ir = nt2int(*ref);
-    free(ref);
-    return ir;
+    return nt2int(*ref);
 }
 
 static void dbsnp_init(args_t *args, const char *chr)
@@ -455,7 +456,7 @@ bcf1_t *process(bcf1_t *rec)
         else    // ambiguous pair, sequence walking must be performed
         {
             int len, win = rec->pos > 100 ? 100 : rec->pos, beg = rec->pos - win, end = rec->pos + win;
-            char *ref = faidx_fetch_seq(args.fai, (char*)bcf_seqname(args.hdr,rec), beg,end, &len);
+            const char *ref = refseq_fetch(args.ref, bcf_seqname(args.hdr,rec), beg,end, &len);
             if ( !ref ) error("faidx_fetch_seq failed at %s:%d\n", bcf_seqname(args.hdr,rec),rec->pos+1);
             if ( end - beg + 1 != len ) error("FIXME: check win=%d,len=%d at %s:%d  (%d %d %d)\n", win,len, bcf_seqname(args.hdr,rec),rec->pos+1);
 
@@ -470,7 +471,6 @@ bcf1_t *process(bcf1_t *rec)
                 strand = ra & 0x9 ? 1 : -1;
                 break;
             }
-            free(ref);
             
             if ( strand==1 )
             {
@@ -566,6 +566,7 @@ void destroy(void)
     fprintf(stderr,"NS\tnon-biallelic\t%u\n", args.nonbiallelic);
 
     free(args.gts);
+    refseq_destroy(args.ref);
     if ( args.fai ) fai_destroy(args.fai);
     if ( args.i2m ) kh_destroy(i2m, args.i2m);
 }
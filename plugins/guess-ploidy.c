@@ -31,6 +31,8 @@
 #include <htslib/vcf.h>
 #include <htslib/synced_bcf_reader.h>
 #include <htslib/vcfutils.h>
+#include <htslib/kstring.h>
+#include <htslib/thread_pool.h>
 #include <inttypes.h>
 #include <unistd.h>
 #include "bcftools.h"
@@ -44,6 +46,8 @@
 #define GUESS_PL 2
 #define GUESS_GL 4
 
+#define BATCH_SIZE 1000
+
 typedef struct
 {
     uint64_t ncount;
@@ -59,6 +63,18 @@ typedef struct
 }
 stats_t;
 
+// Per-record buffers and the accumulated per-sample counts, one per batch with --threads
+typedef struct
+{
+    int32_t *arr, narr, nfarr;
+    float *farr, *af;
+    int maf;
+    double *tmpf;
+    count_t *counts;
+    kstring_t dbg;      // the -vv output
+}
+work_t;
+
 typedef struct
 {
     int argc;
@@ -71,16 +87,24 @@ typedef struct
     const uint8_t *smpl_pass;
     int nsample, verbose, tag, include_indels;
     int *counts, ncounts;       // number of observed GTs with given ploidy, used when -g is not given
-    double *tmpf, *pl2p, gt_err_prob;
-    float *af;
-    int maf;
-    int32_t *arr, narr, nfarr;
-    float *farr;
+    double *pl2p, gt_err_prob;
+    work_t work;
+    int n_threads;
     bcf_srs_t *sr;
     bcf_hdr_t *hdr;
 }
 args_t;
 
+typedef struct
+{
+    args_t *args;
+    work_t work;
+    bcf1_t **lines;
+    uint8_t *pass;      // per-sample filter flags, nsample per line
+    int *has_pass, nlines, mlines;
+}
+batch_t;
+
 const char *about(void)
 {
     return "Determine sample sex by checking genotype likelihoods in haploid regions.\n";
@@ -113,6 +137,7 @@ static const char *usage_text(void)
         "   -g, --genome <str>              shortcut to select nonPAR region for common genomes b37|hg19|b38|hg38\n"
         "   -r, --regions <chr:beg-end>     restrict to comma-separated list of regions\n"
         "   -R, --regions-file <file>       restrict to regions listed in a file\n"
+        "       --threads <int>             number of extra threads to process batches of sites with [0]\n"
         "   -t, --tag <tag>                 genotype or genotype likelihoods: GT, PL, GL [PL]\n"
         "   -v, --verbose                   verbose output (specify twice to increase verbosity)\n"
         "\n"
@@ -130,266 +155,392 @@ static const char *usage_text(void)
         "\n";
 }
 
-static inline int smpl_pass(args_t *args, int ismpl)
+static inline int smpl_pass(args_t *args, const uint8_t *pass_arr, int ismpl)
 {
-    if ( !args->smpl_pass ) return 1;
-    int pass = args->smpl_pass[ismpl];
+    if ( !pass_arr ) return 1;
+    int pass = pass_arr[ismpl];
     if ( args->filter_logic & FLT_EXCLUDE ) pass = pass ? 0 : 1;
     if ( pass ) return 1;
     return 0;
 }
 
-void process_region_guess(args_t *args)
+static void process_record(args_t *args, work_t *work, bcf1_t *rec, const uint8_t *pass_arr)
 {
-    while ( bcf_sr_next_line(args->sr) )
+    double freq[2] = {0,0}, sum;
+    int ismpl,i;
+    if ( args->tag & GUESS_GT )   // use GTs to guess the ploidy, considering only one ALT
     {
-        bcf1_t *rec = bcf_sr_get_line(args->sr,0);
-        if ( rec->n_allele==1 ) continue;
-        if ( !args->include_indels && !(bcf_get_variant_types(rec)&VCF_SNP) ) continue;
-
-        if ( args->filter )
+        int ngt = bcf_get_genotypes(args->hdr,rec,&work->arr,&work->narr);
+        if ( ngt<=0 ) return;
+        ngt /= args->nsample;
+        for (ismpl=0; ismpl<args->nsample; ismpl++)
         {
-            int pass = filter_test(args->filter, rec, &args->smpl_pass);
-            if ( args->filter_logic & FLT_EXCLUDE ) pass = pass ? 0 : 1;
-            if ( !args->smpl_pass && !pass ) continue;     // site-level filtering, not per-sample filtering
-        }
+            if ( !smpl_pass(args,pass_arr,ismpl) ) continue;
+            int32_t *ptr = work->arr + ismpl*ngt;
+            double *tmp = work->tmpf + ismpl*3;
 
-        double freq[2] = {0,0}, sum;
-        int ismpl,i;
-        if ( args->tag & GUESS_GT )   // use GTs to guess the ploidy, considering only one ALT
-        {
-            int ngt = bcf_get_genotypes(args->hdr,rec,&args->arr,&args->narr);
-            if ( ngt<=0 ) continue;
-            ngt /= args->nsample;
-            for (ismpl=0; ismpl<args->nsample; ismpl++)
+            if ( ptr[0]==bcf_gt_missing ) 
             {
-                if ( !smpl_pass(args,ismpl) ) continue;
-                int32_t *ptr = args->arr + ismpl*ngt;
-                double *tmp = args->tmpf + ismpl*3;
-
-                if ( ptr[0]==bcf_gt_missing ) 
-                {
-                    tmp[0] = -1;
-                    continue;
-                }
-                if ( ptr[1]==bcf_int32_vector_end )
-                {
-                    if ( bcf_gt_allele(ptr[0])==0 ) // haploid R
-                    {
-                        tmp[0] = 1 - 2*args->gt_err_prob;
-                        tmp[1] = tmp[2] = args->gt_err_prob;
-                    }
-                    else    // haploid A
-                    {
-                        tmp[0] = tmp[1] = args->gt_err_prob;
-                        tmp[2] = 1 - 2*args->gt_err_prob;
-                    }
-                    continue;
-                }
-                if ( bcf_gt_allele(ptr[0])==0 && bcf_gt_allele(ptr[1])==0 ) // RR
+                tmp[0] = -1;
+                continue;
+            }
+            if ( ptr[1]==bcf_int32_vector_end )
+            {
+                if ( bcf_gt_allele(ptr[0])==0 ) // haploid R
                 {
                     tmp[0] = 1 - 2*args->gt_err_prob;
                     tmp[1] = tmp[2] = args->gt_err_prob;
                 }
-                else if ( bcf_gt_allele(ptr[0])==bcf_gt_allele(ptr[1]) ) // AA
+                else    // haploid A
                 {
                     tmp[0] = tmp[1] = args->gt_err_prob;
                     tmp[2] = 1 - 2*args->gt_err_prob;
                 }
-                else  // RA or hetAA, treating as RA
-                {
-                    tmp[1] = 1 - 2*args->gt_err_prob;
-                    tmp[0] = tmp[2] = args->gt_err_prob;
-                }
-                freq[0] += 2*tmp[0]+tmp[1];
-                freq[1] += tmp[1]+2*tmp[2];
+                continue;
+            }
+            if ( bcf_gt_allele(ptr[0])==0 && bcf_gt_allele(ptr[1])==0 ) // RR
+            {
+                tmp[0] = 1 - 2*args->gt_err_prob;
+                tmp[1] = tmp[2] = args->gt_err_prob;
+            }
+            else if ( bcf_gt_allele(ptr[0])==bcf_gt_allele(ptr[1]) ) // AA
+            {
+                tmp[0] = tmp[1] = args->gt_err_prob;
+                tmp[2] = 1 - 2*args->gt_err_prob;
             }
+            else  // RA or hetAA, treating as RA
+            {
+                tmp[1] = 1 - 2*args->gt_err_prob;
+                tmp[0] = tmp[2] = args->gt_err_prob;
+            }
+            freq[0] += 2*tmp[0]+tmp[1];
+            freq[1] += tmp[1]+2*tmp[2];
         }
-        else if ( args->tag & GUESS_PL )    // use PL guess the ploidy, restrict to first ALT allele
+    }
+    else if ( args->tag & GUESS_PL )    // use PL guess the ploidy, restrict to first ALT allele
+    {
+        int npl = bcf_get_format_int32(args->hdr,rec,"PL",&work->arr,&work->narr);
+        if ( npl<=0 ) return;
+        npl /= args->nsample;
+        int ndip_gt = rec->n_allele*(rec->n_allele+1)/2;
+        if ( npl==ndip_gt )             // diploid
         {
-            int npl = bcf_get_format_int32(args->hdr,rec,"PL",&args->arr,&args->narr);
-            if ( npl<=0 ) continue;
-            npl /= args->nsample;
-            int ndip_gt = rec->n_allele*(rec->n_allele+1)/2;
-            if ( npl==ndip_gt )             // diploid
+            for (ismpl=0; ismpl<args->nsample; ismpl++)
             {
-                for (ismpl=0; ismpl<args->nsample; ismpl++)
+                if ( !smpl_pass(args,pass_arr,ismpl) ) continue;
+                int32_t *ptr = work->arr + ismpl*npl;
+                double *tmp = work->tmpf + ismpl*3;
+
+                // restrict to first ALT
+                if ( ptr[0]==bcf_int32_missing || ptr[1]==bcf_int32_missing || ptr[2]==bcf_int32_missing ) 
                 {
-                    if ( !smpl_pass(args,ismpl) ) continue;
-                    int32_t *ptr = args->arr + ismpl*npl;
-                    double *tmp = args->tmpf + ismpl*3;
-
-                    // restrict to first ALT
-                    if ( ptr[0]==bcf_int32_missing || ptr[1]==bcf_int32_missing || ptr[2]==bcf_int32_missing ) 
-                    {
-                        tmp[0] = -1;
-                        continue;
-                    }
-                    if ( ptr[0]==ptr[1] && ptr[0]==ptr[2] ) // non-informative
-                    {
-                        tmp[0] = -1;
-                        continue;
-                    }
-                    if ( ptr[2]==bcf_int32_vector_end )
-                    {
-                        tmp[0] = (ptr[0]<0 || ptr[0]>=256) ? args->pl2p[255] : args->pl2p[ptr[0]];
-                        tmp[1] = args->pl2p[255];
-                        tmp[2] = (ptr[1]<0 || ptr[1]>=256) ? args->pl2p[255] : args->pl2p[ptr[1]];
-                    }
-                    else
-                        for (i=0; i<3; i++)
-                            tmp[i] = (ptr[i]<0 || ptr[i]>=256) ? args->pl2p[255] : args->pl2p[ptr[i]];
-
-                    sum = 0;
-                    for (i=0; i<3; i++) sum += tmp[i];
-                    for (i=0; i<3; i++) tmp[i] /= sum;
-
-                    if ( ptr[2]==bcf_int32_vector_end )
-                    {
-                        freq[0] += tmp[0];
-                        freq[1] += tmp[2];
-                    }
-                    else
-                    {
-                        freq[0] += 2*tmp[0]+tmp[1];
-                        freq[1] += tmp[1]+2*tmp[2];
-                    }
+                    tmp[0] = -1;
+                    continue;
                 }
-            }
-            else if ( npl==rec->n_allele )  // all samples haploid
-            {
-                for (ismpl=0; ismpl<args->nsample; ismpl++)
+                if ( ptr[0]==ptr[1] && ptr[0]==ptr[2] ) // non-informative
+                {
+                    tmp[0] = -1;
+                    continue;
+                }
+                if ( ptr[2]==bcf_int32_vector_end )
                 {
-                    if ( !smpl_pass(args,ismpl) ) continue;
-                    int32_t *ptr = args->arr + ismpl*npl;
-                    double *tmp = args->tmpf + ismpl*3;
-
-                    // restrict to first ALT
-                    if ( ptr[0]==bcf_int32_missing || ptr[1]==bcf_int32_missing ) 
-                    {
-                        tmp[0] = -1;
-                        continue;
-                    }
                     tmp[0] = (ptr[0]<0 || ptr[0]>=256) ? args->pl2p[255] : args->pl2p[ptr[0]];
                     tmp[1] = args->pl2p[255];
                     tmp[2] = (ptr[1]<0 || ptr[1]>=256) ? args->pl2p[255] : args->pl2p[ptr[1]];
+                }
+                else
+                    for (i=0; i<3; i++)
+                        tmp[i] = (ptr[i]<0 || ptr[i]>=256) ? args->pl2p[255] : args->pl2p[ptr[i]];
 
-                    sum = 0;
-                    for (i=0; i<3; i++) sum += tmp[i];
-                    for (i=0; i<3; i++) tmp[i] /= sum;
+                sum = 0;
+                for (i=0; i<3; i++) sum += tmp[i];
+                for (i=0; i<3; i++) tmp[i] /= sum;
 
+                if ( ptr[2]==bcf_int32_vector_end )
+                {
                     freq[0] += tmp[0];
                     freq[1] += tmp[2];
                 }
+                else
+                {
+                    freq[0] += 2*tmp[0]+tmp[1];
+                    freq[1] += tmp[1]+2*tmp[2];
+                }
             }
-            else
-                continue;   // neither diploid nor haploid
         }
-        else    // use GL
+        else if ( npl==rec->n_allele )  // all samples haploid
         {
-            int ngl = bcf_get_format_float(args->hdr,rec,"GL",&args->farr,&args->nfarr);
-            if ( ngl<=0 ) continue;
-            ngl /= args->nsample;
-            int ndip_gt = rec->n_allele*(rec->n_allele+1)/2;
-            if ( ngl==ndip_gt )             // diploid
+            for (ismpl=0; ismpl<args->nsample; ismpl++)
             {
-                for (ismpl=0; ismpl<args->nsample; ismpl++)
+                if ( !smpl_pass(args,pass_arr,ismpl) ) continue;
+                int32_t *ptr = work->arr + ismpl*npl;
+                double *tmp = work->tmpf + ismpl*3;
+
+                // restrict to first ALT
+                if ( ptr[0]==bcf_int32_missing || ptr[1]==bcf_int32_missing ) 
                 {
-                    if ( !smpl_pass(args,ismpl) ) continue;
-                    float *ptr = args->farr + ismpl*ngl;
-                    double *tmp = args->tmpf + ismpl*3;
-
-                    // restrict to first ALT
-                    if ( bcf_float_is_missing(ptr[0]) || bcf_float_is_missing(ptr[1]) || bcf_float_is_missing(ptr[2]) ) 
-                    {
-                        tmp[0] = -1;
-                        continue;
-                    }
-                    if ( ptr[0]==ptr[1] && ptr[0]==ptr[2] ) // non-informative
-                    {
-                        tmp[0] = -1;
-                        continue;
-                    }
-                    if ( bcf_float_is_vector_end(ptr[2]) )
-                    {
-                        tmp[0] = pow(10.,ptr[0]);
-                        tmp[1] = 1e-26;             // arbitrary small value for a het
-                        tmp[2] = pow(10.,ptr[1]);
-                    }
-                    else
-                        for (i=0; i<3; i++)
-                            tmp[i] = pow(10.,ptr[i]);
-
-                    sum = 0;
-                    for (i=0; i<3; i++) sum += tmp[i];
-                    for (i=0; i<3; i++) tmp[i] /= sum;
-
-                    if ( bcf_float_is_vector_end(ptr[2]) )
-                    {
-                        freq[0] += tmp[0];
-                        freq[1] += tmp[2];
-                    }
-                    else
-                    {
-                        freq[0] += 2*tmp[0]+tmp[1];
-                        freq[1] += tmp[1]+2*tmp[2];
-                    }
+                    tmp[0] = -1;
+                    continue;
                 }
+                tmp[0] = (ptr[0]<0 || ptr[0]>=256) ? args->pl2p[255] : args->pl2p[ptr[0]];
+                tmp[1] = args->pl2p[255];
+                tmp[2] = (ptr[1]<0 || ptr[1]>=256) ? args->pl2p[255] : args->pl2p[ptr[1]];
+
+                sum = 0;
+                for (i=0; i<3; i++) sum += tmp[i];
+                for (i=0; i<3; i++) tmp[i] /= sum;
+
+                freq[0] += tmp[0];
+                freq[1] += tmp[2];
             }
-            else if ( ngl==rec->n_allele )  // all samples haploid
+        }
+        else
+            return;   // neither diploid nor haploid
+    }
+    else    // use GL
+    {
+        int ngl = bcf_get_format_float(args->hdr,rec,"GL",&work->farr,&work->nfarr);
+        if ( ngl<=0 ) return;
+        ngl /= args->nsample;
+        int ndip_gt = rec->n_allele*(rec->n_allele+1)/2;
+        if ( ngl==ndip_gt )             // diploid
+        {
+            for (ismpl=0; ismpl<args->nsample; ismpl++)
             {
-                for (ismpl=0; ismpl<args->nsample; ismpl++)
+                if ( !smpl_pass(args,pass_arr,ismpl) ) continue;
+                float *ptr = work->farr + ismpl*ngl;
+                double *tmp = work->tmpf + ismpl*3;
+
+                // restrict to first ALT
+                if ( bcf_float_is_missing(ptr[0]) || bcf_float_is_missing(ptr[1]) || bcf_float_is_missing(ptr[2]) ) 
+                {
+                    tmp[0] = -1;
+                    continue;
+                }
+                if ( ptr[0]==ptr[1] && ptr[0]==ptr[2] ) // non-informative
+                {
+                    tmp[0] = -1;
+                    continue;
+                }
+                if ( bcf_float_is_vector_end(ptr[2]) )
                 {
-                    if ( !smpl_pass(args,ismpl) ) continue;
-                    float *ptr = args->farr + ismpl*ngl;
-                    double *tmp = args->tmpf + ismpl*3;
-
-                    // restrict to first ALT
-                    if ( bcf_float_is_missing(ptr[0]) || bcf_float_is_missing(ptr[1]) ) 
-                    {
-                        tmp[0] = -1;
-                        continue;
-                    }
                     tmp[0] = pow(10.,ptr[0]);
-                    tmp[1] = 1e-26;
+                    tmp[1] = 1e-26;             // arbitrary small value for a het
                     tmp[2] = pow(10.,ptr[1]);
+                }
+                else
+                    for (i=0; i<3; i++)
+                        tmp[i] = pow(10.,ptr[i]);
 
-                    sum = 0;
-                    for (i=0; i<3; i++) sum += tmp[i];
-                    for (i=0; i<3; i++) tmp[i] /= sum;
+                sum = 0;
+                for (i=0; i<3; i++) sum += tmp[i];
+                for (i=0; i<3; i++) tmp[i] /= sum;
 
+                if ( bcf_float_is_vector_end(ptr[2]) )
+                {
                     freq[0] += tmp[0];
                     freq[1] += tmp[2];
                 }
+                else
+                {
+                    freq[0] += 2*tmp[0]+tmp[1];
+                    freq[1] += tmp[1]+2*tmp[2];
+                }
             }
-            else
-                continue;   // neither diploid nor haploid
         }
-        if ( args->af_tag )
+        else if ( ngl==rec->n_allele )  // all samples haploid
         {
-            int ret = bcf_get_info_float(args->hdr,rec,args->af_tag,&args->af, &args->maf);
-            if ( ret>0 ) { freq[0] = 1 - args->af[0]; freq[1] = args->af[0]; }
+            for (ismpl=0; ismpl<args->nsample; ismpl++)
+            {
+                if ( !smpl_pass(args,pass_arr,ismpl) ) continue;
+                float *ptr = work->farr + ismpl*ngl;
+                double *tmp = work->tmpf + ismpl*3;
+
+                // restrict to first ALT
+                if ( bcf_float_is_missing(ptr[0]) || bcf_float_is_missing(ptr[1]) ) 
+                {
+                    tmp[0] = -1;
+                    continue;
+                }
+                tmp[0] = pow(10.,ptr[0]);
+                tmp[1] = 1e-26;
+                tmp[2] = pow(10.,ptr[1]);
+
+                sum = 0;
+                for (i=0; i<3; i++) sum += tmp[i];
+                for (i=0; i<3; i++) tmp[i] /= sum;
+
+                freq[0] += tmp[0];
+                freq[1] += tmp[2];
+            }
         }
+        else
+            return;   // neither diploid nor haploid
+    }
+    if ( args->af_tag )
+    {
+        int ret = bcf_get_info_float(args->hdr,rec,args->af_tag,&work->af, &work->maf);
+        if ( ret>0 ) { freq[0] = 1 - work->af[0]; freq[1] = work->af[0]; }
+    }
 
-        if ( !freq[0] && !freq[1] ) { freq[0] = 1 - args->af_dflt; freq[1] = args->af_dflt; }
-        sum = freq[0] + freq[1];
-        freq[0] /= sum;
-        freq[1] /= sum;
-        for (ismpl=0; ismpl<args->nsample; ismpl++)
+    if ( !freq[0] && !freq[1] ) { freq[0] = 1 - args->af_dflt; freq[1] = args->af_dflt; }
+    sum = freq[0] + freq[1];
+    freq[0] /= sum;
+    freq[1] /= sum;
+    for (ismpl=0; ismpl<args->nsample; ismpl++)
+    {
+        if ( !smpl_pass(args,pass_arr,ismpl) ) continue;
+        count_t *counts = &work->counts[ismpl];
+        double *tmp = work->tmpf + ismpl*3;
+        if ( tmp[0] < 0 ) continue;
+        double phap = freq[0]*tmp[0] + freq[1]*tmp[2];
+        double pdip = freq[0]*freq[0]*tmp[0] + 2*freq[0]*freq[1]*tmp[1] + freq[1]*freq[1]*tmp[2];
+        counts->phap += log(phap);
+        counts->pdip += log(pdip);
+        counts->ncount++;
+        if ( args->verbose>1 )
+            ksprintf(&work->dbg, "DBG\t%s\t%d\t%s\t%e\t%e\t%e\t%e\t%e\t%e\n", bcf_seqname(args->hdr,rec),rec->pos+1,bcf_hdr_int2id(args->hdr,BCF_DT_SAMPLE,ismpl),
+                freq[1],tmp[0],tmp[1],tmp[2],phap,pdip);
+    }
+}
+
+static void *process_batch(void *arg)
+{
+    batch_t *batch = (batch_t*) arg;
+    args_t *args = batch->args;
+    int i;
+    for (i=0; i<batch->nlines; i++)
+        process_record(args, &batch->work, batch->lines[i], batch->has_pass[i] ? batch->pass + i*args->nsample : NULL);
+    return batch;
+}
+
+// Add the batch counts to the totals, the batches are retrieved in order so that
+// the -vv output is unchanged
+static void merge_batch(args_t *args, hts_tpool_process *q)
+{
+    hts_tpool_result *res = hts_tpool_next_result_wait(q);
+    if ( !res ) error("Failed to retrieve the processed batch\n");
+    batch_t *batch = (batch_t*) hts_tpool_result_data(res);
+    int i;
+    for (i=0; i<args->nsample; i++)
+    {
+        count_t *src = &batch->work.counts[i], *dst = &args->stats.counts[i];
+        dst->ncount += src->ncount;
+        dst->phap   += src->phap;
+        dst->pdip   += src->pdip;
+    }
+    memset(batch->work.counts, 0, sizeof(count_t)*args->nsample);
+    if ( batch->work.dbg.l ) fwrite(batch->work.dbg.s, 1, batch->work.dbg.l, stdout);
+    batch->work.dbg.l = 0;
+    batch->nlines = 0;
+    hts_tpool_delete_result(res, 0);
+}
+
+// Returns 1 if the site passes the site-level filters
+static int filter_site(args_t *args, bcf1_t *rec)
+{
+    if ( rec->n_allele==1 ) return 0;
+    if ( !args->include_indels && !(bcf_get_variant_types(rec)&VCF_SNP) ) return 0;
+
+    args->smpl_pass = NULL;
+    if ( args->filter )
+    {
+        int pass = filter_test(args->filter, rec, &args->smpl_pass);
+        if ( args->filter_logic & FLT_EXCLUDE ) pass = pass ? 0 : 1;
+        if ( !args->smpl_pass && !pass ) return 0;     // site-level filtering, not per-sample filtering
+    }
+    return 1;
+}
+
+static void init_work(args_t *args, work_t *work)
+{
+    memset(work, 0, sizeof(*work));
+    work->tmpf   = (double*) malloc(sizeof(*work->tmpf)*3*args->nsample);
+    work->counts = (count_t*) calloc(args->nsample,sizeof(count_t));
+}
+static void destroy_work(work_t *work)
+{
+    free(work->tmpf);
+    free(work->counts);
+    free(work->arr);
+    free(work->farr);
+    free(work->af);
+    free(work->dbg.s);
+}
+
+// The filters are applied when reading; the sites are copied into batches which
+// are processed by the thread pool, at most two batches per thread are in flight
+static void process_batches(args_t *args)
+{
+    int i, j, nbatches = 2*args->n_threads, nbusy = 0, ibatch = 0;
+    batch_t *batches = (batch_t*) calloc(nbatches, sizeof(batch_t));
+    for (i=0; i<nbatches; i++)
+    {
+        batches[i].args = args;
+        init_work(args, &batches[i].work);
+    }
+    hts_tpool *pool = args->sr->p->pool;
+    hts_tpool_process *q = hts_tpool_process_init(pool, nbatches, 0);
+    if ( !q ) error("Failed to initialize the thread pool queue\n");
+
+    batch_t *batch = &batches[ibatch];
+    while ( 1 )
+    {
+        bcf1_t *rec = bcf_sr_next_line(args->sr) ? bcf_sr_get_line(args->sr,0) : NULL;
+        if ( rec && !filter_site(args, rec) ) continue;
+        if ( rec )
+        {
+            if ( batch->nlines == batch->mlines )
+            {
+                int m = batch->mlines;
+                hts_expand0(bcf1_t*, batch->nlines+1, batch->mlines, batch->lines);
+                batch->pass = (uint8_t*) realloc(batch->pass, (size_t)batch->mlines*args->nsample);
+                batch->has_pass = (int*) realloc(batch->has_pass, sizeof(int)*batch->mlines);
+                for (j=m; j<batch->mlines; j++) batch->lines[j] = bcf_init1();
+            }
+            bcf_copy(batch->lines[batch->nlines], rec);
+            batch->has_pass[batch->nlines] = args->smpl_pass ? 1 : 0;
+            if ( args->smpl_pass ) memcpy(batch->pass + batch->nlines*args->nsample, args->smpl_pass, args->nsample);
+            batch->nlines++;
+            if ( batch->nlines < BATCH_SIZE ) continue;
+        }
+        if ( batch->nlines )
         {
-            if ( !smpl_pass(args,ismpl) ) continue;
-            count_t *counts = &args->stats.counts[ismpl];
-            double *tmp = args->tmpf + ismpl*3;
-            if ( tmp[0] < 0 ) continue;
-            double phap = freq[0]*tmp[0] + freq[1]*tmp[2];
-            double pdip = freq[0]*freq[0]*tmp[0] + 2*freq[0]*freq[1]*tmp[1] + freq[1]*freq[1]*tmp[2];
-            counts->phap += log(phap);
-            counts->pdip += log(pdip);
-            counts->ncount++;
-            if ( args->verbose>1 )
-                printf("DBG\t%s\t%d\t%s\t%e\t%e\t%e\t%e\t%e\t%e\n", bcf_seqname(args->hdr,rec),rec->pos+1,bcf_hdr_int2id(args->hdr,BCF_DT_SAMPLE,ismpl),
-                    freq[1],tmp[0],tmp[1],tmp[2],phap,pdip);
+            if ( hts_tpool_dispatch(pool, q, process_batch, batch) < 0 )
+                error("Failed to dispatch the batch to the thread pool\n");
+            nbusy++;
+            ibatch = (ibatch + 1) % nbatches;
+            batch  = &batches[ibatch];
+            if ( nbusy==nbatches ) { merge_batch(args, q); nbusy--; }
         }
+        if ( !rec ) break;
+    }
+    while ( nbusy ) { merge_batch(args, q); nbusy--; }
+    hts_tpool_process_destroy(q);
+
+    for (i=0; i<nbatches; i++)
+    {
+        for (j=0; j<batches[i].mlines; j++) bcf_destroy(batches[i].lines[j]);
+        free(batches[i].lines);
+        free(batches[i].pass);
+        free(batches[i].has_pass);
+        destroy_work(&batches[i].work);
+    }
+    free(batches);
+}
+
+void process_region_guess(args_t *args)
+{
+    if ( args->n_threads ) { process_batches(args); return; }
+
+    args->work.counts = args->stats.counts;
+    while ( bcf_sr_next_line(args->sr) )
+    {
+        bcf1_t *rec = bcf_sr_get_line(args->sr,0);
+        if ( !filter_site(args, rec) ) continue;
+        process_record(args, &args->work, rec, args->smpl_pass);
+        if ( args->work.dbg.l ) fwrite(args->work.dbg.s, 1, args->work.dbg.l, stdout);
+        args->work.dbg.l = 0;
     }
 }
 
@@ -416,6 +567,7 @@ int run(int argc, char **argv)
         {"regions",required_argument,NULL,'r'},
         {"regions-file",required_argument,NULL,'R'},
         {"background",required_argument,NULL,'b'},
+        {"threads",required_argument,NULL,4},
         {NULL,0,NULL,0}
     };
     int c;
@@ -431,6 +583,10 @@ int run(int argc, char **argv)
                     break;
             case 2: args->filter_str = optarg; args->filter_logic |= FLT_EXCLUDE; break;
             case 3: args->filter_str = optarg; args->filter_logic |= FLT_INCLUDE; break;
+            case 4:
+                    args->n_threads = strtol(optarg,&tmp,10);
+                    if ( *tmp || args->n_threads<0 ) error("Could not parse: --threads %s\n", optarg);
+                    break;
             case 'i': args->include_indels = 1; break;
             case 'e':
                 args->gt_err_prob = strtod(optarg,&tmp);
@@ -487,6 +643,7 @@ int run(int argc, char **argv)
                 error("Failed to read the targets: %s\n",region);
         }
     }
+    if ( args->n_threads && bcf_sr_set_threads(args->sr, args->n_threads)<0 ) error("Failed to create threads\n");
     if ( !bcf_sr_add_reader(args->sr,fname) ) error("Error: %s\n", bcf_sr_strerror(args->sr->errnum));
     args->hdr = args->sr->readers[0].header;
     args->nsample = bcf_hdr_nsamples(args->hdr);
@@ -519,8 +676,8 @@ int run(int argc, char **argv)
         args->pl2p = (double*) calloc(256,sizeof(double));
         for (i=0; i<256; i++) args->pl2p[i] = pow(10., -i/10.);
     }
-    if ( args->tag&GUESS_PL || args->tag&GUESS_GL || args->tag&GUESS_GT )
-        args->tmpf = (double*) malloc(sizeof(*args->tmpf)*3*args->nsample);
+    if ( !args->n_threads )
+        args->work.tmpf = (double*) malloc(sizeof(*args->work.tmpf)*3*args->nsample);
 
     if ( args->verbose )
     {
@@ -557,12 +714,10 @@ int run(int argc, char **argv)
 
     bcf_sr_destroy(args->sr);
     free(args->pl2p);
-    free(args->tmpf);
     free(args->counts);
+    args->work.counts = NULL;   // same as stats.counts
+    destroy_work(&args->work);
     free(args->stats.counts);
-    free(args->arr);
-    free(args->farr);
-    free(args->af);
     free(args);
     return 0;
 }
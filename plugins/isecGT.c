@@ -132,7 +132,12 @@ int run(int argc, char **argv)
     args->out_fh = hts_open(args->output_fname, hts_bcf_wmode(args->output_type));
     if ( args->out_fh == NULL ) error("Can't write to \"%s\": %s\n", args->output_fname, strerror(errno));
     bcf_hdr_write(args->out_fh, args->hdr_a);
-    
+
+    // with the same sample order the genotype blocks can be compared as a whole
+    int i, same_order = 1;
+    for (i=0; i<smpl->n; i++)
+        if ( smpl->idx[i]!=i ) { same_order = 0; break; }
+
     while ( bcf_sr_next_line(args->sr) )
     {
         if ( !bcf_sr_has_line(args->sr,0) ) continue;
@@ -147,20 +152,21 @@ int run(int argc, char **argv)
         int ngt_a = bcf_get_genotypes(args->hdr_a, line_a, &args->arr_a, &args->narr_a);
         int ngt_b = bcf_get_genotypes(args->hdr_b, line_b, &args->arr_b, &args->narr_b);
         assert( ngt_a==ngt_b );     // todo
+        if ( same_order && !memcmp(args->arr_a, args->arr_b, sizeof(int32_t)*ngt_a) )
+        {
+            bcf_write(args->out_fh, args->hdr_a, line_a);
+            continue;
+        }
         ngt_a /= smpl->n;
         ngt_b /= smpl->n;
-        int i, j, dirty = 0;
+        int j, dirty = 0;
         for (i=0; i<smpl->n; i++)
         {
             int32_t *a = args->arr_a + i*ngt_a;
             int32_t *b = args->arr_b + smpl->idx[i]*ngt_b;
-            for (j=0; j<ngt_a; j++)
-                if ( a[j]!=b[j] ) break;
-            if ( j<ngt_a )
-            {
-                dirty = 1;
-                for (j=0; j<ngt_a; j++) a[j] = bcf_gt_missing;
-            }
+            if ( !memcmp(a, b, sizeof(int32_t)*ngt_a) ) continue;
+            dirty = 1;
+            for (j=0; j<ngt_a; j++) a[j] = bcf_gt_missing;
         }
         if ( dirty ) bcf_update_genotypes(args->hdr_a, line_a, args->arr_a, ngt_a*smpl->n);
         bcf_write(args->out_fh, args->hdr_a, line_a);
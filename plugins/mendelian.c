@@ -54,6 +54,8 @@ typedef struct _args_t
     int ngt_arr, nrec;
     trio_t *trios;
     int ntrios;
+    int *smpl, nsmpl;   // unique samples of all trios
+    uint32_t *als;      // per-sample allele bitmask of the current record, 0 for missing
 }
 args_t;
 
@@ -166,6 +168,22 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
         }
         free(list);
     }
+
+    // Each sample is decoded only once per record, even when shared by several trios
+    int nsmpl = bcf_hdr_nsamples(args.hdr);
+    args.als  = (uint32_t*) calloc(nsmpl,sizeof(uint32_t));
+    args.smpl = (int*) malloc(sizeof(int)*3*args.ntrios);
+    for (i=0; i<args.ntrios; i++)
+    {
+        int j, ismpl[3] = { args.trios[i].imother, args.trios[i].ifather, args.trios[i].ichild };
+        for (j=0; j<3; j++)
+        {
+            if ( ismpl[j]<0 ) error("No such sample in the trio %d\n", i+1);
+            if ( args.als[ismpl[j]] ) continue;
+            args.als[ismpl[j]] = 1;
+            args.smpl[args.nsmpl++] = ismpl[j];
+        }
+    }
     return args.mode&(MODE_LIST_GOOD|MODE_LIST_BAD) ? 0 : 1;
 }
 
@@ -179,25 +197,23 @@ bcf1_t *process(bcf1_t *rec)
     if ( ngt!=2*bcf_hdr_nsamples(args.hdr) ) return dflt;
 
     int i, has_bad = 0, needs_update = 0;
+    for (i=0; i<args.nsmpl; i++)
+    {
+        int32_t *ptr = args.gt_arr + 2*args.smpl[i];
+        uint32_t *als = &args.als[args.smpl[i]];
+        if ( bcf_gt_is_missing(ptr[0]) || bcf_gt_is_missing(ptr[1]) ) { *als = 0; continue; }
+        int a = bcf_gt_allele(ptr[0]);
+        int b = ptr[1]==bcf_int32_vector_end ? a : bcf_gt_allele(ptr[1]);
+        if ( a<0 || b<0 || a>=32 || b>=32 ) { *als = 0; continue; }
+        *als = (1<<a) | (1<<b);
+    }
     for (i=0; i<args.ntrios; i++)
     {
-        int mother,father,child;
-        int32_t a,b,c,d,e,f;
         trio_t *trio = &args.trios[i];
-
-        a = args.gt_arr[2*trio->imother];
-        b = args.gt_arr[2*trio->imother+1];
-        c = args.gt_arr[2*trio->ifather];
-        d = args.gt_arr[2*trio->ifather+1];
-        e = args.gt_arr[2*trio->ichild];
-        f = args.gt_arr[2*trio->ichild+1];
-        if ( bcf_gt_is_missing(a) || bcf_gt_is_missing(b) ) continue; 
-        if ( bcf_gt_is_missing(c) || bcf_gt_is_missing(d) ) continue; 
-        if ( bcf_gt_is_missing(e) || bcf_gt_is_missing(f) ) continue; 
-
-        mother = (1<<bcf_gt_allele(a)) | (1<<bcf_gt_allele(b));
-        father = (1<<bcf_gt_allele(c)) | (1<<bcf_gt_allele(d));
-        child  = (1<<bcf_gt_allele(e)) | (1<<bcf_gt_allele(f));
+        uint32_t mother = args.als[trio->imother];
+        uint32_t father = args.als[trio->ifather];
+        uint32_t child  = args.als[trio->ichild];
+        if ( !mother || !father || !child ) continue;
 
         if ( (mother&child) && (father&child) ) 
         {
@@ -215,6 +231,7 @@ bcf1_t *process(bcf1_t *rec)
                 args.gt_arr[2*trio->ifather+1] = bcf_gt_missing;
                 args.gt_arr[2*trio->ichild]    = bcf_gt_missing;
                 args.gt_arr[2*trio->ichild+1]  = bcf_gt_missing;
+                args.als[trio->imother] = args.als[trio->ifather] = args.als[trio->ichild] = 0;
                 needs_update = 1;
             }
         }
@@ -246,6 +263,8 @@ void destroy(void)
     }
     free(args.gt_arr);
     free(args.trios);
+    free(args.smpl);
+    free(args.als);
 }
 
 
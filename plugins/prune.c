@@ -35,13 +35,21 @@
 #include <stdarg.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
 #include <errno.h>
 #include <htslib/vcf.h>
+#include <htslib/tbx.h>
 #include <htslib/synced_bcf_reader.h>
 #include <htslib/vcfutils.h>
+#include <htslib/kstring.h>
+#include <htslib/bgzf.h>
+#include <htslib/hfile.h>
+#include <htslib/thread_pool.h>
 #include "bcftools.h"
 #include "vcfbuf.h"
 #include "filter.h"
+#include "tmpdir.h"
 
 #define FLT_INCLUDE 1
 #define FLT_EXCLUDE 2
@@ -53,7 +61,8 @@ typedef struct
     int filter_logic;   // one of FLT_INCLUDE/FLT_EXCLUDE (-i or -e)
     vcfbuf_t *vcfbuf;
     int argc, region_is_file, target_is_file, output_type, filter_r2_id, rand_missing, nsites, ld_win;
-    char **argv, *region, *target, *fname, *output_fname, *info_pos, *info_r2, *filter_r2;
+    int n_threads, parallel;
+    char **argv, *region, *target, *fname, *output_fname, *info_pos, *info_r2, *filter_r2, *tmp_dir;
     htsFile *out_fh;
     bcf_hdr_t *hdr;
     bcf_srs_t *sr;
@@ -61,6 +70,15 @@ typedef struct
 }
 args_t;
 
+// One chromosome pruned by a worker thread with its own reader, filter and buffer
+typedef struct
+{
+    args_t args;
+    char *chr, *fname;
+    char *reg_fname;    // a one-line regions file when the name cannot be given as a region string
+}
+chunk_t;
+
 const char *about(void)
 {
     return "Prune sites by missingness, linkage disequilibrium\n";
@@ -88,6 +106,9 @@ static const char *usage_text(void)
         "   -R, --regions-file FILE         restrict to regions listed in a file\n"
         "   -t, --targets REGION            similar to -r but streams rather than index-jumps\n"
         "   -T, --targets-file FILE         similar to -R but streams rather than index-jumps\n"
+        "       --temp-dir DIR              directory for the temporary files of --parallel [$TMPDIR or /tmp]\n"
+        "       --threads INT               number of extra threads to compare the sites of the -w window with [0]\n"
+        "       --parallel                  with --threads, prune chromosomes in parallel, requires an indexed file\n"
         "   -w, --window INT[bp|kb]         the window size of INT sites/bp/kb for the -n/-l options [100kb]\n"
         "Examples:\n"
         "   # Discard records with r2 bigger than 0.6 in a window of 1000 sites\n"
@@ -104,20 +125,9 @@ static const char *usage_text(void)
         "\n";
 }
 
-static void init_data(args_t *args)
+// The workers repeat the same header changes so that the ids of the records match
+static void init_header(args_t *args)
 {
-    args->sr = bcf_sr_init();
-    if ( args->region )
-    {
-        args->sr->require_index = 1;
-        if ( bcf_sr_set_regions(args->sr, args->region, args->region_is_file)<0 ) error("Failed to read the regions: %s\n",args->region);
-    }
-    if ( args->target && bcf_sr_set_targets(args->sr, args->target, args->target_is_file, 0)<0 ) error("Failed to read the targets: %s\n",args->target);
-    if ( !bcf_sr_add_reader(args->sr,args->fname) ) error("Error: %s\n", bcf_sr_strerror(args->sr->errnum));
-    args->hdr = bcf_sr_get_header(args->sr,0);
-
-    args->out_fh = hts_open(args->output_fname,hts_bcf_wmode(args->output_type));
-    if ( args->out_fh == NULL ) error("Can't write to \"%s\": %s\n", args->output_fname, strerror(errno));
     if ( args->filter_r2 )
     {
         bcf_hdr_printf(args->hdr,"##FILTER=<ID=%s,Description=\"A site with r2>%e upstream within %d%s\">",args->filter_r2,args->max_ld,
@@ -129,19 +139,44 @@ static void init_data(args_t *args)
         bcf_hdr_printf(args->hdr,"##INFO=<ID=%s,Number=1,Type=Integer,Description=\"A site with r2>%e upstream\">",args->info_pos,args->max_ld);
         bcf_hdr_printf(args->hdr,"##INFO=<ID=%s,Number=1,Type=Float,Description=\"A site with r2>%e upstream\">",args->info_r2,args->max_ld);
     }
-    bcf_hdr_write(args->out_fh, args->hdr);
     if ( args->filter_r2 )
         args->filter_r2_id = bcf_hdr_id2int(args->hdr, BCF_DT_ID, args->filter_r2);
+}
 
+static void init_buffer(args_t *args, hts_tpool *pool)
+{
     args->vcfbuf = vcfbuf_init(args->hdr, args->ld_win);
     vcfbuf_set_opt(args->vcfbuf,double,VCFBUF_LD_MAX,args->max_ld);
     if ( args->nsites ) vcfbuf_set_opt(args->vcfbuf,int,VCFBUF_NSITES,args->nsites);
     if ( args->af_tag ) vcfbuf_set_opt(args->vcfbuf,char*,VCFBUF_AF_TAG,args->af_tag);
     if ( args->rand_missing ) vcfbuf_set_opt(args->vcfbuf,int,VCFBUF_RAND_MISSING,1);
     vcfbuf_set_opt(args->vcfbuf,int,VCFBUF_SKIP_FILTER,args->filter_r2 ? 1 : 0);
+    if ( pool ) vcfbuf_set_opt(args->vcfbuf,hts_tpool*,VCFBUF_THREAD_POOL,pool);
 
-    if ( args->filter_str )
-        args->filter = filter_init(args->hdr, args->filter_str);
+    args->filter = args->filter_str ? filter_init(args->hdr, args->filter_str) : NULL;
+}
+
+static void init_data(args_t *args)
+{
+    args->sr = bcf_sr_init();
+    if ( args->parallel ) args->sr->require_index = 1;     // the chromosomes are taken from the index
+    if ( args->region )
+    {
+        args->sr->require_index = 1;
+        if ( bcf_sr_set_regions(args->sr, args->region, args->region_is_file)<0 ) error("Failed to read the regions: %s\n",args->region);
+    }
+    if ( args->target && bcf_sr_set_targets(args->sr, args->target, args->target_is_file, 0)<0 ) error("Failed to read the targets: %s\n",args->target);
+    if ( args->n_threads && bcf_sr_set_threads(args->sr, args->n_threads)<0 ) error("Failed to create threads\n");
+    if ( !bcf_sr_add_reader(args->sr,args->fname) ) error("Error: %s\n", bcf_sr_strerror(args->sr->errnum));
+    args->hdr = bcf_sr_get_header(args->sr,0);
+
+    args->out_fh = hts_open(args->output_fname,hts_bcf_wmode(args->output_type));
+    if ( args->out_fh == NULL ) error("Can't write to \"%s\": %s\n", args->output_fname, strerror(errno));
+    init_header(args);
+    bcf_hdr_write(args->out_fh, args->hdr);
+
+    // in the --parallel mode the pool runs the chromosomes, the workers compare serially
+    init_buffer(args, args->n_threads && !args->parallel ? args->sr->p->pool : NULL);
 }
 static void destroy_data(args_t *args)
 {
@@ -190,6 +225,130 @@ static void process(args_t *args)
     flush(args,0);
 }
 
+static void *prune_chunk(void *arg)
+{
+    chunk_t *chunk = (chunk_t*) arg;
+    args_t *args = &chunk->args;
+
+    args->sr = bcf_sr_init();
+    args->sr->require_index = 1;
+    if ( args->target && bcf_sr_set_targets(args->sr, args->target, args->target_is_file, 0)<0 ) error("Failed to read the targets: %s\n",args->target);
+    // a sequence name with a colon would be parsed as chr:pos, read it from a file instead
+    if ( chunk->reg_fname )
+    {
+        if ( bcf_sr_set_regions(args->sr, chunk->reg_fname, 1)<0 ) error("Failed to set the region: %s\n", chunk->chr);
+    }
+    else if ( bcf_sr_set_regions(args->sr, chunk->chr, 0)<0 ) error("Failed to set the region: %s\n", chunk->chr);
+    if ( !bcf_sr_add_reader(args->sr,args->fname) ) error("Error: %s\n", bcf_sr_strerror(args->sr->errnum));
+    args->hdr = bcf_sr_get_header(args->sr,0);
+    init_header(args);
+    init_buffer(args, NULL);
+
+    // the records are written without the header and appended to the real output later
+    args->out_fh = hts_open(chunk->fname, args->output_type & FT_BCF ? "wbu" : "w");
+    if ( args->out_fh == NULL ) error("Can't write to \"%s\": %s\n", chunk->fname, strerror(errno));
+
+    while ( bcf_sr_next_line(args->sr) ) process(args);
+    flush(args,1);
+
+    if ( hts_close(args->out_fh)!=0 ) error("Close failed: %s\n", chunk->fname);
+    if ( args->filter ) filter_destroy(args->filter);
+    vcfbuf_destroy(args->vcfbuf);
+    bcf_sr_destroy(args->sr);
+    return chunk;
+}
+
+// Append the temporary file to the output and remove it
+static void append_file(const char *fname, htsFile *out_fh)
+{
+    BGZF *fp = bgzf_open(fname, "r");
+    if ( !fp ) error("Failed to open %s: %s\n", fname, strerror(errno));
+    const size_t page_size = BGZF_MAX_BLOCK_SIZE;
+    uint8_t *buf = (uint8_t*) malloc(page_size);
+    ssize_t nread;
+    while ( (nread = bgzf_read(fp, buf, page_size)) > 0 )
+    {
+        ssize_t nwr = out_fh->is_bgzf ? bgzf_write(out_fh->fp.bgzf, buf, nread) : hwrite(out_fh->fp.hfile, buf, nread);
+        if ( nwr!=nread ) error("Write failed, wrote %d instead of %d bytes.\n", (int)nwr,(int)nread);
+    }
+    if ( nread<0 ) error("Failed to read %s\n", fname);
+    free(buf);
+    if ( bgzf_close(fp)<0 ) error("Close failed: %s\n", fname);
+    unlink(fname);
+}
+
+static void write_chunk(args_t *args, hts_tpool_process *q)
+{
+    hts_tpool_result *res = hts_tpool_next_result_wait(q);
+    if ( !res ) error("Failed to retrieve the pruned chunk\n");
+    chunk_t *chunk = (chunk_t*) hts_tpool_result_data(res);
+    append_file(chunk->fname, args->out_fh);
+    if ( chunk->reg_fname ) unlink(chunk->reg_fname);
+    hts_tpool_delete_result(res, 0);
+}
+
+// The chromosomes are pruned independently and the outputs concatenated in the
+// order of the index, which unlike the header includes VCF contigs without a
+// ##contig line. At most two chunks per thread are in flight, the oldest one is
+// written out before another is dispatched.
+static void prune_chunks(args_t *args)
+{
+    int i, nchr = 0;
+    bcf_sr_t *reader = bcf_sr_get_reader(args->sr, 0);
+    const char **chrs = NULL;
+    if ( reader->tbx_idx ) chrs = tbx_seqnames(reader->tbx_idx, &nchr);
+    else if ( reader->bcf_idx ) chrs = bcf_index_seqnames(reader->bcf_idx, args->hdr, &nchr);
+    if ( !nchr ) error("No sequences found in the index of %s\n", args->fname);
+
+    char *dir = tmpdir_create(args->tmp_dir, "prune");
+    kstring_t str = {0,0,0};
+
+    int nchunks = 2*args->n_threads, nbusy = 0, ichunk = 0;
+    chunk_t *chunks = (chunk_t*) calloc(nchunks, sizeof(chunk_t));
+    hts_tpool_process *q = hts_tpool_process_init(args->sr->p->pool, nchunks, 0);
+    if ( !q ) error("Failed to initialize the thread pool queue\n");
+    for (i=0; i<nchr; i++)
+    {
+        chunk_t *chunk = &chunks[ichunk];
+        ichunk = (ichunk + 1) % nchunks;
+        if ( nbusy==nchunks ) { write_chunk(args, q); nbusy--; }
+        chunk->args = *args;
+        chunk->chr  = (char*) chrs[i];
+        free(chunk->fname);
+        str.l = 0;
+        ksprintf(&str, "%s/%d", dir, i);
+        chunk->fname = strdup(str.s);
+        free(chunk->reg_fname);
+        chunk->reg_fname = NULL;
+        if ( strchr(chrs[i],':') )
+        {
+            str.l = 0;
+            ksprintf(&str, "%s/%d.reg", dir, i);
+            FILE *fp = fopen(str.s, "w");
+            if ( !fp ) error("Can't write to \"%s\": %s\n", str.s, strerror(errno));
+            fprintf(fp, "%s\t1\t%"PRId64"\n", chrs[i], (int64_t)HTS_POS_MAX);
+            if ( fclose(fp)!=0 ) error("Close failed: %s\n", str.s);
+            chunk->reg_fname = strdup(str.s);
+        }
+        if ( hts_tpool_dispatch(args->sr->p->pool, q, prune_chunk, chunk) < 0 )
+            error("Failed to dispatch the chunk %s to the thread pool\n", chrs[i]);
+        nbusy++;
+    }
+    while ( nbusy ) { write_chunk(args, q); nbusy--; }
+    hts_tpool_process_destroy(q);
+
+    for (i=0; i<nchunks; i++)
+    {
+        free(chunks[i].fname);
+        free(chunks[i].reg_fname);
+    }
+    free(chunks);
+    free(chrs);
+    tmpdir_remove(dir);
+    free(dir);
+    free(str.s);
+}
+
 int run(int argc, char **argv)
 {
     args_t *args = (args_t*) calloc(1,sizeof(args_t));
@@ -201,6 +360,9 @@ int run(int argc, char **argv)
     {
         {"randomize-missing",no_argument,NULL,1},
         {"AF-tag",required_argument,NULL,2},
+        {"threads",required_argument,NULL,3},
+        {"parallel",no_argument,NULL,4},
+        {"temp-dir",required_argument,NULL,5},
         {"exclude",required_argument,NULL,'e'},
         {"include",required_argument,NULL,'i'},
         {"annotate-info",required_argument,NULL,'a'},
@@ -222,6 +384,12 @@ int run(int argc, char **argv)
         {
             case  1 : args->rand_missing = 1; break;
             case  2 : args->af_tag = optarg; break;
+            case  3 :
+                args->n_threads = strtol(optarg,&tmp,10);
+                if ( *tmp || args->n_threads<0 ) error("Could not parse: --threads %s\n", optarg);
+                break;
+            case  4 : args->parallel = 1; break;
+            case  5 : args->tmp_dir = optarg; break;
             case 'e': args->filter_str = optarg; args->filter_logic |= FLT_EXCLUDE; break;
             case 'i': args->filter_str = optarg; args->filter_logic |= FLT_INCLUDE; break;
             case 'a': 
@@ -280,10 +448,22 @@ int run(int argc, char **argv)
     else if ( optind+1!=argc ) error(usage_text());
     else args->fname = argv[optind];
 
+    if ( args->parallel )
+    {
+        if ( !args->n_threads ) error("The --parallel option requires --threads\n");
+        if ( args->region ) error("The --parallel option cannot be combined with -r/-R, use -t/-T instead\n");
+        if ( !strcmp("-",args->fname) ) error("The --parallel option requires an indexed file\n");
+    }
+
     init_data(args);
-    
-    while ( bcf_sr_next_line(args->sr) ) process(args);
-    flush(args,1);
+
+    if ( args->parallel )
+        prune_chunks(args);
+    else
+    {
+        while ( bcf_sr_next_line(args->sr) ) process(args);
+        flush(args,1);
+    }
 
     destroy_data(args);
     return 0;
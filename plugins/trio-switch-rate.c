@@ -51,6 +51,13 @@ typedef struct
 }
 pop_t;
 
+typedef struct
+{
+    int a, b, phased;
+    int ok;                 // parse_genotype() succeeded
+}
+gt_t;
+
 typedef struct
 {
     int argc;
@@ -62,6 +69,8 @@ typedef struct
     int npop;
     pop_t *pop;
     int mgt_arr, prev_rid;
+    int *smpl, nsmpl;       // unique samples of all trios
+    gt_t *gts;              // per-sample genotypes of the current record
 }
 args_t;
 
@@ -169,14 +178,23 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
     }
     if ( !ped_fname ) error("Expected the -p option\n");
     parse_ped(&args, ped_fname);
-    return 1;
-}
 
-typedef struct
-{
-    int a, b, phased;
+    // Each sample is decoded only once per record, even when shared by several trios
+    int i;
+    args.gts  = (gt_t*) calloc(bcf_hdr_nsamples(args.hdr),sizeof(gt_t));
+    args.smpl = (int*) malloc(sizeof(int)*(3*args.ntrio+1));
+    for (i=0; i<args.ntrio; i++)
+    {
+        int j, ismpl[3] = { args.trio[i].father, args.trio[i].mother, args.trio[i].child };
+        for (j=0; j<3; j++)
+        {
+            if ( args.gts[ismpl[j]].ok ) continue;
+            args.gts[ismpl[j]].ok = 1;
+            args.smpl[args.nsmpl++] = ismpl[j];
+        }
+    }
+    return 1;
 }
-gt_t;
 
 int parse_genotype(gt_t *gt, int32_t *ptr);
 
@@ -205,23 +223,30 @@ bcf1_t *process(bcf1_t *rec)
         for (i=0; i<args.ntrio; i++) args.trio[i].prev = 0;
     }
 
-    gt_t child, father, mother;
+    for (i=0; i<args.nsmpl; i++)
+    {
+        gt_t *gt = &args.gts[args.smpl[i]];
+        gt->ok = parse_genotype(gt, args.gt_arr + ngt*args.smpl[i]);
+    }
+
     for (i=0; i<args.ntrio; i++)
     {
         trio_t *trio = &args.trio[i];
+        gt_t *child = &args.gts[trio->child];
 
-        if ( !parse_genotype(&child, args.gt_arr + ngt*trio->child) ) continue;
-        if ( !child.phased ) continue;
-        if ( child.a+child.b != 1 ) continue;       // child is not a het
+        if ( !child->ok ) continue;
+        if ( !child->phased ) continue;
+        if ( child->a+child->b != 1 ) continue;       // child is not a het
 
-        if ( !parse_genotype(&father, args.gt_arr + ngt*trio->father) ) continue;
-        if ( !parse_genotype(&mother, args.gt_arr + ngt*trio->mother) ) continue;
-        if ( father.a+father.b == 1 && mother.a+mother.b == 1 ) continue;     // both parents are hets
-        if ( father.a+father.b == mother.a+mother.b ) { trio->err++; continue; }    // mendelian error
+        gt_t *father = &args.gts[trio->father];
+        gt_t *mother = &args.gts[trio->mother];
+        if ( !father->ok || !mother->ok ) continue;
+        if ( father->a+father->b == 1 && mother->a+mother->b == 1 ) continue;     // both parents are hets
+        if ( father->a+father->b == mother->a+mother->b ) { trio->err++; continue; }    // mendelian error
 
         int test_phase = 0; 
-        if ( father.a==father.b ) test_phase = 1 + (child.a==father.a);
-        else if ( mother.a==mother.b ) test_phase = 1 + (child.b==mother.a);
+        if ( father->a==father->b ) test_phase = 1 + (child->a==father->a);
+        else if ( mother->a==mother->b ) test_phase = 1 + (child->b==mother->a);
         if ( trio->prev > 0 )
         {
             if ( trio->prev!=test_phase ) trio->nswitch++;
@@ -270,4 +295,6 @@ void destroy(void)
     free(args.pop);
     free(args.trio);
     free(args.gt_arr);
+    free(args.smpl);
+    free(args.gts);
 }
@@ -26,6 +26,9 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
 #include <getopt.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -34,6 +37,8 @@
 #include <gsl/gsl_multifit_nlin.h>
 #include <htslib/vcf.h>
 #include <htslib/synced_bcf_reader.h>
+#include <htslib/kstring.h>
+#include <htslib/thread_pool.h>
 #include "bcftools.h"
 #include "peakfit.h"
 
@@ -55,12 +60,23 @@ typedef struct
     dist_t *dist;
     char **argv, *output_dir;
     double fit_th, peak_symmetry, cn_penalty, min_peak_size, min_fraction;
-    int argc, plot, verbose, regions_is_file, targets_is_file, include_aa, force_cn;
+    int argc, plot, verbose, regions_is_file, targets_is_file, include_aa, force_cn, n_threads;
     char *dat_fname, *fname, *regions_list, *targets_list, *sample;
+    char *save_dist_fname, *load_dist_fname;   // binary dump of the raw BAF histograms
     FILE *dat_fp;
 }
 args_t;
 
+typedef struct
+{
+    args_t *args;
+    dist_t *dist;
+    kstring_t out, err;     // dist.dat lines and verbose output, written in chromosome order
+}
+fit_job_t;
+
+#define DIST_MAGIC "PSD\1"
+
 FILE *open_file(char **fname, const char *mode, const char *fmt, ...);
 
 static void init_dist(args_t *args, dist_t *dist, int verbose)
@@ -164,7 +180,26 @@ static void init_dist(args_t *args, dist_t *dist, int verbose)
             dist->copy_number,sra/srr,saa/sra, (int)sra);
 }
 
-static void init_data(args_t *args)
+static void init_xvals(args_t *args)
+{
+    int i;
+    args->xvals = (double*) calloc(args->nbins,sizeof(double));
+    for (i=0; i<args->nbins; i++) args->xvals[i] = 1.0*i/(args->nbins-1);
+}
+
+static dist_t *add_dist(args_t *args, const char *chr)
+{
+    int idist = args->ndist++;
+    args->dist = (dist_t*) realloc(args->dist, sizeof(dist_t)*args->ndist);
+    memset(&args->dist[idist],0,sizeof(dist_t));
+    args->dist[idist].chr   = strdup(chr);
+    args->dist[idist].yvals = (double*) calloc(args->nbins,sizeof(double));
+    args->dist[idist].xvals = args->xvals;
+    args->dist[idist].nvals = args->nbins;
+    return &args->dist[idist];
+}
+
+static void read_dists(args_t *args)
 {
     bcf_srs_t *files = bcf_sr_init();
     if ( args->regions_list )
@@ -191,13 +226,10 @@ static void init_data(args_t *args)
     if ( !bcf_hdr_idinfo_exists(hdr,BCF_HL_FMT,bcf_hdr_id2int(hdr,BCF_DT_ID,"BAF")) )
         error("The tag FORMAT/BAF is not present in the VCF: %s\n", args->fname);
 
-    int i;
-    args->xvals = (double*) calloc(args->nbins,sizeof(double));
-    for (i=0; i<args->nbins; i++) args->xvals[i] = 1.0*i/(args->nbins-1);
-
     // collect BAF distributions for all chromosomes
-    int idist = -1, nbaf = 0, nprocessed = 0, ntotal = 0, prev_chr = -1;
+    int nbaf = 0, nprocessed = 0, ntotal = 0, prev_chr = -1;
     float *baf = NULL;
+    dist_t *dist = NULL;
     while ( bcf_sr_next_line(files) )
     {
         ntotal++;
@@ -211,21 +243,74 @@ static void init_data(args_t *args)
         if ( prev_chr==-1 || prev_chr!=line->rid )
         {
             // new chromosome
-            idist = args->ndist++;
-            args->dist = (dist_t*) realloc(args->dist, sizeof(dist_t)*args->ndist);
-            memset(&args->dist[idist],0,sizeof(dist_t));
-            args->dist[idist].chr   = strdup(bcf_seqname(hdr,line));
-            args->dist[idist].yvals = (double*) calloc(args->nbins,sizeof(double));
-            args->dist[idist].xvals = args->xvals;
-            args->dist[idist].nvals = args->nbins;
+            dist = add_dist(args, bcf_seqname(hdr,line));
             prev_chr = line->rid;
         }
         int bin = baf[0]*(args->nbins-1);
-        args->dist[idist].yvals[bin]++;   // the distribution
+        dist->yvals[bin]++;   // the distribution
     }
     free(baf);
     bcf_sr_destroy(files);
+}
+
+// The raw histograms, before init_dist() normalizes them, so that the curves can be
+// refitted with different parameters without reading the VCF again
+static void save_dists(args_t *args)
+{
+    FILE *fp = fopen(args->save_dist_fname,"wb");
+    if ( !fp ) error("Failed to open %s: %s\n", args->save_dist_fname,strerror(errno));
+    int32_t nbins = args->nbins, ndist = args->ndist, i;
+    if ( fwrite(DIST_MAGIC,1,4,fp)!=4 ) error("Failed to write %s\n", args->save_dist_fname);
+    if ( fwrite(&nbins,sizeof(nbins),1,fp)!=1 || fwrite(&ndist,sizeof(ndist),1,fp)!=1 ) error("Failed to write %s\n", args->save_dist_fname);
+    for (i=0; i<args->ndist; i++)
+    {
+        dist_t *dist = &args->dist[i];
+        int32_t len = strlen(dist->chr);
+        if ( fwrite(&len,sizeof(len),1,fp)!=1 || fwrite(dist->chr,1,len,fp)!=len ) error("Failed to write %s\n", args->save_dist_fname);
+        if ( fwrite(dist->yvals,sizeof(double),args->nbins,fp)!=args->nbins ) error("Failed to write %s\n", args->save_dist_fname);
+    }
+    if ( fclose(fp)!=0 ) error("Failed to close %s: %s\n", args->save_dist_fname,strerror(errno));
+}
 
+static void load_dists(args_t *args)
+{
+    FILE *fp = fopen(args->load_dist_fname,"rb");
+    if ( !fp ) error("Failed to open %s: %s\n", args->load_dist_fname,strerror(errno));
+    char magic[4];
+    int32_t nbins, ndist, i;
+    if ( fread(magic,1,4,fp)!=4 || memcmp(magic,DIST_MAGIC,4) ) error("The file is not a polysomy histogram dump: %s\n", args->load_dist_fname);
+    if ( fread(&nbins,sizeof(nbins),1,fp)!=1 || fread(&ndist,sizeof(ndist),1,fp)!=1 ) error("Failed to read %s\n", args->load_dist_fname);
+    if ( nbins<2 || ndist<0 ) error("Failed to read %s\n", args->load_dist_fname);
+    args->nbins = nbins;   // the binning is fixed at the time of reading the VCF
+    init_xvals(args);
+
+    kstring_t str = {0,0,0};
+    for (i=0; i<ndist; i++)
+    {
+        int32_t len;
+        if ( fread(&len,sizeof(len),1,fp)!=1 || len<0 ) error("Failed to read %s\n", args->load_dist_fname);
+        str.l = 0;
+        ks_resize(&str, len+1);
+        if ( fread(str.s,1,len,fp)!=len ) error("Failed to read %s\n", args->load_dist_fname);
+        str.s[len] = 0;
+        dist_t *dist = add_dist(args, str.s);
+        if ( fread(dist->yvals,sizeof(double),nbins,fp)!=nbins ) error("Failed to read %s\n", args->load_dist_fname);
+    }
+    free(str.s);
+    fclose(fp);
+}
+
+static void init_data(args_t *args)
+{
+    if ( args->load_dist_fname ) load_dists(args);
+    else
+    {
+        init_xvals(args);
+        read_dists(args);
+    }
+    if ( args->save_dist_fname ) save_dists(args);
+
+    int i, idist;
     for (idist=0; idist<args->ndist; idist++)
     {
         #if 0
@@ -368,251 +453,314 @@ static void destroy_data(args_t *args)
     fclose(args->dat_fp);
 }
 
-static void save_dist(args_t *args, dist_t *dist)
+static void save_dist(args_t *args, dist_t *dist, kstring_t *out)
 {
     int i;
     for (i=0; i<args->nbins; i++)
-        fprintf(args->dat_fp,"DIST\t%s\t%f\t%f\n",dist->chr,dist->xvals[i],dist->yvals[i]);
+        ksprintf(out,"DIST\t%s\t%f\t%f\n",dist->chr,dist->xvals[i],dist->yvals[i]);
 }
-static void fit_curves(args_t *args)
+
+// Fit one chromosome, the output is stored in the job so that chromosomes can be fitted in parallel
+static void *fit_dist(void *arg)
 {
-    peakfit_t *pkf = peakfit_init();
-    peakfit_verbose(pkf,args->verbose);
+    fit_job_t *job = (fit_job_t*) arg;
+    args_t *args   = job->args;
+    dist_t *dist   = job->dist;
+    kstring_t *out = &job->out, *err = &job->err;
 
-    int i, nmc = 50;
-    for (i=0; i<args->ndist; i++)
+    int nmc = 50;
+    save_dist(args, dist, out);
+
+    if ( dist->copy_number!=0 )
     {
-        dist_t *dist = &args->dist[i];
-        save_dist(args, &args->dist[i]);
+        ksprintf(out,"CN\t%s\t%.2f\n", dist->chr,(float)dist->copy_number);
+        return job;
+    }
 
-        if ( dist->copy_number!=0 )
-        {
-            fprintf(args->dat_fp,"CN\t%s\t%.2f\n", dist->chr,(float)dist->copy_number);
-            continue;
-        }
+    peakfit_t *pkf = peakfit_init();
+    peakfit_verbose(pkf,args->verbose);
+    peakfit_set_log(pkf,err);
 
-        if ( args->verbose )
-            fprintf(stderr,"%s:\n", dist->chr);
+    if ( args->verbose )
+        ksprintf(err,"%s:\n", dist->chr);
 
-        int nrr_aa  = dist->iaa - dist->irr + 1;
-        int nrr_ra  = dist->ira - dist->irr + 1;
-        int naa_max = dist->nvals - dist->iaa;
-        double xrr  = dist->xvals[dist->irr], *xrr_vals = &dist->xvals[dist->irr], *yrr_vals = &dist->yvals[dist->irr];
-        double xaa  = dist->xvals[dist->iaa], *xaa_vals = &dist->xvals[dist->iaa], *yaa_vals = &dist->yvals[dist->iaa];
-        double xra  = dist->xvals[dist->ira];
-        double xmax = dist->xvals[dist->nvals-1];
+    int nrr_aa  = dist->iaa - dist->irr + 1;
+    int nrr_ra  = dist->ira - dist->irr + 1;
+    int naa_max = dist->nvals - dist->iaa;
+    double xrr  = dist->xvals[dist->irr], *xrr_vals = &dist->xvals[dist->irr], *yrr_vals = &dist->yvals[dist->irr];
+    double xaa  = dist->xvals[dist->iaa], *xaa_vals = &dist->xvals[dist->iaa], *yaa_vals = &dist->yvals[dist->iaa];
+    double xra  = dist->xvals[dist->ira];
+    double xmax = dist->xvals[dist->nvals-1];
 
 
-        // CN2
-        double cn2aa_fit = 0, cn2ra_fit, cn2_fit;
-        char *cn2aa_func = 0, *cn2ra_func;
-        double cn2aa_params[3] = {1,1,1} ,cn2ra_params[3];
-        if ( args->include_aa )
-        {
-            peakfit_reset(pkf);
-            peakfit_add_exp(pkf, 1.0,1.0,0.2, 5);
-            peakfit_set_mc(pkf, 0.01,0.3,2,nmc);
-            peakfit_set_mc(pkf, 0.05,1.0,0,nmc);
-            cn2aa_fit  = peakfit_run(pkf, naa_max, xaa_vals, yaa_vals);
-            cn2aa_func = strdup(peakfit_sprint_func(pkf));
-            peakfit_get_params(pkf,0,cn2aa_params,3);
-        }
+    // CN2
+    double cn2aa_fit = 0, cn2ra_fit, cn2_fit;
+    char *cn2aa_func = 0, *cn2ra_func;
+    double cn2aa_params[3] = {1,1,1} ,cn2ra_params[3];
+    if ( args->include_aa )
+    {
         peakfit_reset(pkf);
-        peakfit_add_bounded_gaussian(pkf, 1.0,0.5,0.03, 0.45,0.55, 7);
+        peakfit_add_exp(pkf, 1.0,1.0,0.2, 5);
         peakfit_set_mc(pkf, 0.01,0.3,2,nmc);
         peakfit_set_mc(pkf, 0.05,1.0,0,nmc);
-        cn2ra_fit  = peakfit_run(pkf, nrr_aa,xrr_vals,yrr_vals);
-        cn2ra_func = strdup(peakfit_sprint_func(pkf));
-        cn2_fit    = cn2ra_fit + cn2aa_fit;
-        peakfit_get_params(pkf,0,cn2ra_params,3);
-
-
-        // CN3: fit two peaks, then enforce the symmetry and fit again
-        double cn3rra_params[5], cn3raa_params[5], *cn3aa_params = cn2aa_params;
-        double cn3aa_fit = cn2aa_fit, cn3ra_fit;
-        char *cn3aa_func = cn2aa_func, *cn3ra_func;
-        double min_dx3   = 0.5 - 1./(args->min_fraction+2);
-        peakfit_reset(pkf);
-        peakfit_add_bounded_gaussian(pkf, 1.0,1/3.,0.03, xrr,xra-min_dx3, 7);
-        peakfit_set_mc(pkf, xrr,xra-min_dx3, 1,nmc);
-        peakfit_add_bounded_gaussian(pkf, 1.0,2/3.,0.03, xra+min_dx3,xaa, 7);
-        peakfit_set_mc(pkf, xra+min_dx3,xaa, 1,nmc);
-        peakfit_run(pkf, nrr_aa, xrr_vals, yrr_vals);
-        // force symmetry around x=0.5
-        peakfit_get_params(pkf,0,cn3rra_params,5);
-        peakfit_get_params(pkf,1,cn3raa_params,5);
-        double cn3_dx = (0.5-cn3rra_params[1] + cn3raa_params[1]-0.5)*0.5;
-        if ( cn3_dx > 0.5/3 ) cn3_dx = 0.5/3;   // CN3 peaks should not be separated by more than 1/3
-        peakfit_reset(pkf);
-        peakfit_add_gaussian(pkf, cn3rra_params[0],0.5-cn3_dx,cn3rra_params[2], 5);
-        peakfit_add_gaussian(pkf, cn3raa_params[0],0.5+cn3_dx,cn3raa_params[2], 5);
-        cn3ra_fit  = peakfit_run(pkf, nrr_aa, xrr_vals, yrr_vals);
-        cn3ra_func = strdup(peakfit_sprint_func(pkf));
-        // compare peak sizes
-        peakfit_get_params(pkf,0,cn3rra_params,3);
-        peakfit_get_params(pkf,1,cn3raa_params,3);
-        double cn3rra_size = cn3rra_params[0]*cn3rra_params[0];
-        double cn3raa_size = cn3raa_params[0]*cn3raa_params[0];
-        double cn3_dy      = cn3rra_size > cn3raa_size ? cn3raa_size/cn3rra_size : cn3rra_size/cn3raa_size;
-        double cn3_frac    = (1 - 2*cn3rra_params[1]) / cn3rra_params[1];
-        double cn3_fit     = cn3ra_fit + cn3aa_fit;
-        // A very reasonable heuristics: check if the peak's width converged, exclude far too broad or far too narrow peaks
-        if ( cn3rra_params[2]>0.3  || cn3raa_params[2]>0.3 ) cn3_fit = HUGE_VAL;
-        if ( cn3rra_params[2]<1e-2 || cn3raa_params[2]<1e-2 ) cn3_fit = HUGE_VAL;
-
-
-        // CN4 (contaminations)
-        // - first fit only the [0,0.5] part of the data, then enforce the symmetry and fit again
-        // - min_frac=1 (resp. 0.5) is interpreted as 50:50% (rep. 75:25%) contamination
-        double cn4AAaa_params[3] = {1,1,1} ,cn4AAra_params[3] = {1,1,1}, cn4RAra_params[3], cn4RArr_params[5], cn4RAaa_params[5];
-        double cn4aa_fit = 0, cn4ra_fit;
-        char *cn4aa_func = 0, *cn4ra_func;
-        double min_dx4   = 0.25*args->min_fraction;
-        if ( args->include_aa )
-        {
-            peakfit_reset(pkf);
-            peakfit_add_exp(pkf, 0.5,1.0,0.2, 5);
-            peakfit_set_mc(pkf, 0.01,0.3,2,nmc);
-            peakfit_add_bounded_gaussian(pkf, 0.4,(xaa+xmax)*0.5,2e-2, xaa,xmax, 7);
-            peakfit_set_mc(pkf, xaa,xmax, 1,nmc);
-            cn4aa_fit  = peakfit_run(pkf, naa_max, xaa_vals,yaa_vals);
-            cn4aa_func = strdup(peakfit_sprint_func(pkf));
-            peakfit_get_params(pkf,0,cn4AAaa_params,3);
-            peakfit_get_params(pkf,1,cn4AAra_params,5);
-        }
-        peakfit_reset(pkf);
-        // first fit only the [0,0.5] part of the data
-        peakfit_add_gaussian(pkf, 1.0,0.5,0.03, 5);
-        peakfit_add_bounded_gaussian(pkf, 0.6,0.3,0.03, xrr,xra-min_dx4, 7);
-        peakfit_set_mc(pkf, xrr,xra-min_dx4,2,nmc);
-        peakfit_run(pkf, nrr_ra , xrr_vals, yrr_vals);
-        // now forcet symmetry around x=0.5
-        peakfit_get_params(pkf,0,cn4RAra_params,3);
-        peakfit_get_params(pkf,1,cn4RArr_params,5);
-        double cn4_dx = 0.5-cn4RArr_params[1];
-        if ( cn4_dx > 0.25 ) cn4_dx = 0.25;   // CN4 peaks should not be separated by more than 0.5
+        cn2aa_fit  = peakfit_run(pkf, naa_max, xaa_vals, yaa_vals);
+        cn2aa_func = strdup(peakfit_sprint_func(pkf));
+        peakfit_get_params(pkf,0,cn2aa_params,3);
+    }
+    peakfit_reset(pkf);
+    peakfit_add_bounded_gaussian(pkf, 1.0,0.5,0.03, 0.45,0.55, 7);
+    peakfit_set_mc(pkf, 0.01,0.3,2,nmc);
+    peakfit_set_mc(pkf, 0.05,1.0,0,nmc);
+    cn2ra_fit  = peakfit_run(pkf, nrr_aa,xrr_vals,yrr_vals);
+    cn2ra_func = strdup(peakfit_sprint_func(pkf));
+    cn2_fit    = cn2ra_fit + cn2aa_fit;
+    peakfit_get_params(pkf,0,cn2ra_params,3);
+
+
+    // CN3: fit two peaks, then enforce the symmetry and fit again
+    double cn3rra_params[5], cn3raa_params[5], *cn3aa_params = cn2aa_params;
+    double cn3aa_fit = cn2aa_fit, cn3ra_fit;
+    char *cn3aa_func = cn2aa_func, *cn3ra_func;
+    double min_dx3   = 0.5 - 1./(args->min_fraction+2);
+    peakfit_reset(pkf);
+    peakfit_add_bounded_gaussian(pkf, 1.0,1/3.,0.03, xrr,xra-min_dx3, 7);
+    peakfit_set_mc(pkf, xrr,xra-min_dx3, 1,nmc);
+    peakfit_add_bounded_gaussian(pkf, 1.0,2/3.,0.03, xra+min_dx3,xaa, 7);
+    peakfit_set_mc(pkf, xra+min_dx3,xaa, 1,nmc);
+    peakfit_run(pkf, nrr_aa, xrr_vals, yrr_vals);
+    // force symmetry around x=0.5
+    peakfit_get_params(pkf,0,cn3rra_params,5);
+    peakfit_get_params(pkf,1,cn3raa_params,5);
+    double cn3_dx = (0.5-cn3rra_params[1] + cn3raa_params[1]-0.5)*0.5;
+    if ( cn3_dx > 0.5/3 ) cn3_dx = 0.5/3;   // CN3 peaks should not be separated by more than 1/3
+    peakfit_reset(pkf);
+    peakfit_add_gaussian(pkf, cn3rra_params[0],0.5-cn3_dx,cn3rra_params[2], 5);
+    peakfit_add_gaussian(pkf, cn3raa_params[0],0.5+cn3_dx,cn3raa_params[2], 5);
+    cn3ra_fit  = peakfit_run(pkf, nrr_aa, xrr_vals, yrr_vals);
+    cn3ra_func = strdup(peakfit_sprint_func(pkf));
+    // compare peak sizes
+    peakfit_get_params(pkf,0,cn3rra_params,3);
+    peakfit_get_params(pkf,1,cn3raa_params,3);
+    double cn3rra_size = cn3rra_params[0]*cn3rra_params[0];
+    double cn3raa_size = cn3raa_params[0]*cn3raa_params[0];
+    double cn3_dy      = cn3rra_size > cn3raa_size ? cn3raa_size/cn3rra_size : cn3rra_size/cn3raa_size;
+    double cn3_frac    = (1 - 2*cn3rra_params[1]) / cn3rra_params[1];
+    double cn3_fit     = cn3ra_fit + cn3aa_fit;
+    // A very reasonable heuristics: check if the peak's width converged, exclude far too broad or far too narrow peaks
+    if ( cn3rra_params[2]>0.3  || cn3raa_params[2]>0.3 ) cn3_fit = HUGE_VAL;
+    if ( cn3rra_params[2]<1e-2 || cn3raa_params[2]<1e-2 ) cn3_fit = HUGE_VAL;
+
+
+    // CN4 (contaminations)
+    // - first fit only the [0,0.5] part of the data, then enforce the symmetry and fit again
+    // - min_frac=1 (resp. 0.5) is interpreted as 50:50% (rep. 75:25%) contamination
+    double cn4AAaa_params[3] = {1,1,1} ,cn4AAra_params[3] = {1,1,1}, cn4RAra_params[3], cn4RArr_params[5], cn4RAaa_params[5];
+    double cn4aa_fit = 0, cn4ra_fit;
+    char *cn4aa_func = 0, *cn4ra_func;
+    double min_dx4   = 0.25*args->min_fraction;
+    if ( args->include_aa )
+    {
         peakfit_reset(pkf);
-        peakfit_add_gaussian(pkf, cn4RAra_params[0],0.5,cn4RAra_params[2], 5);
-        peakfit_add_gaussian(pkf, cn4RArr_params[0],0.5-cn4_dx,cn4RArr_params[2], 5);
-        peakfit_add_gaussian(pkf, cn4RArr_params[0],0.5+cn4_dx,cn4RArr_params[2], 5);
-        peakfit_set_mc(pkf, 0.1,cn4RAra_params[0],0,nmc);
-        peakfit_set_mc(pkf, 0.01,0.1,2,nmc);
-        cn4ra_fit  = peakfit_run(pkf, nrr_aa , xrr_vals, yrr_vals);
-        cn4ra_func = strdup(peakfit_sprint_func(pkf));
-        peakfit_get_params(pkf,0,cn4RAra_params,3);
-        peakfit_get_params(pkf,1,cn4RArr_params,3);
-        peakfit_get_params(pkf,2,cn4RAaa_params,3);
-        double cn4RAra_size = cn4RAra_params[0]==0 ? HUGE_VAL : cn4RAra_params[0]*cn4RAra_params[0];
-        double cn4RArr_size = cn4RArr_params[0]*cn4RArr_params[0];
-        double cn4RAaa_size = cn4RAaa_params[0]*cn4RAaa_params[0];
-        double cn4RArr_dy   = cn4RArr_size < cn4RAra_size ? cn4RArr_size/cn4RAra_size : cn4RAra_size/cn4RArr_size;
-        double cn4RAaa_dy   = cn4RAaa_size < cn4RAra_size ? cn4RAaa_size/cn4RAra_size : cn4RAra_size/cn4RAaa_size;
-        double cn4_dy       = cn4RArr_dy < cn4RAaa_dy ? cn4RArr_dy/cn4RAaa_dy : cn4RAaa_dy/cn4RArr_dy;
-        double cn4_ymin     = cn4RArr_size < cn4RAaa_size ? cn4RArr_size/cn4RAra_size : cn4RAaa_size/cn4RAra_size;
-        cn4_dx              = (cn4RAaa_params[1]-0.5) - (0.5-cn4RArr_params[1]);
-        double cn4_frac     = cn4RAaa_params[1] - cn4RArr_params[1];
-        double cn4_fit      = cn4ra_fit + cn4aa_fit;
-        // A very reasonable heuristics: check if the peak's width converged, exclude far too broad or far too narrow peaks
-        if ( cn4RAra_params[2]>0.3 || cn4RArr_params[2]>0.3 || cn4RAaa_params[2]>0.3 ) cn4_fit = HUGE_VAL;
-        if ( cn4RAra_params[2]<1e-2 || cn4RArr_params[2]<1e-2 || cn4RAaa_params[2]<1e-2 ) cn4_fit = HUGE_VAL;
-
-
-        // Choose the best match
-        char cn2_fail = '*', cn3_fail = '*', cn4_fail = '*';
-        if ( cn2_fit > args->fit_th ) cn2_fail = 'f';
-
-        if ( cn3_fit > args->fit_th ) cn3_fail = 'f';
-        else if ( cn3_dy < args->peak_symmetry ) cn3_fail = 'y';    // size difference is too big
-
-        if ( cn4_fit > args->fit_th ) cn4_fail = 'f';
-        else if ( cn4_ymin < args->min_peak_size ) cn4_fail = 'y';      // side peak is too small
-        else if ( cn4_dy < args->peak_symmetry ) cn4_fail = 'Y';    // size difference is too big
-        else if ( cn4_dx > 0.1 ) cn4_fail = 'x';                    // side peaks placed assymetrically
-
-        double cn = -1, fit = cn2_fit;
-        if ( cn2_fail == '*' ) { cn = 2; fit = cn2_fit; }
-        if ( cn3_fail == '*' )
+        peakfit_add_exp(pkf, 0.5,1.0,0.2, 5);
+        peakfit_set_mc(pkf, 0.01,0.3,2,nmc);
+        peakfit_add_bounded_gaussian(pkf, 0.4,(xaa+xmax)*0.5,2e-2, xaa,xmax, 7);
+        peakfit_set_mc(pkf, xaa,xmax, 1,nmc);
+        cn4aa_fit  = peakfit_run(pkf, naa_max, xaa_vals,yaa_vals);
+        cn4aa_func = strdup(peakfit_sprint_func(pkf));
+        peakfit_get_params(pkf,0,cn4AAaa_params,3);
+        peakfit_get_params(pkf,1,cn4AAra_params,5);
+    }
+    peakfit_reset(pkf);
+    // first fit only the [0,0.5] part of the data
+    peakfit_add_gaussian(pkf, 1.0,0.5,0.03, 5);
+    peakfit_add_bounded_gaussian(pkf, 0.6,0.3,0.03, xrr,xra-min_dx4, 7);
+    peakfit_set_mc(pkf, xrr,xra-min_dx4,2,nmc);
+    peakfit_run(pkf, nrr_ra , xrr_vals, yrr_vals);
+    // now forcet symmetry around x=0.5
+    peakfit_get_params(pkf,0,cn4RAra_params,3);
+    peakfit_get_params(pkf,1,cn4RArr_params,5);
+    double cn4_dx = 0.5-cn4RArr_params[1];
+    if ( cn4_dx > 0.25 ) cn4_dx = 0.25;   // CN4 peaks should not be separated by more than 0.5
+    peakfit_reset(pkf);
+    peakfit_add_gaussian(pkf, cn4RAra_params[0],0.5,cn4RAra_params[2], 5);
+    peakfit_add_gaussian(pkf, cn4RArr_params[0],0.5-cn4_dx,cn4RArr_params[2], 5);
+    peakfit_add_gaussian(pkf, cn4RArr_params[0],0.5+cn4_dx,cn4RArr_params[2], 5);
+    peakfit_set_mc(pkf, 0.1,cn4RAra_params[0],0,nmc);
+    peakfit_set_mc(pkf, 0.01,0.1,2,nmc);
+    cn4ra_fit  = peakfit_run(pkf, nrr_aa , xrr_vals, yrr_vals);
+    cn4ra_func = strdup(peakfit_sprint_func(pkf));
+    peakfit_get_params(pkf,0,cn4RAra_params,3);
+    peakfit_get_params(pkf,1,cn4RArr_params,3);
+    peakfit_get_params(pkf,2,cn4RAaa_params,3);
+    double cn4RAra_size = cn4RAra_params[0]==0 ? HUGE_VAL : cn4RAra_params[0]*cn4RAra_params[0];
+    double cn4RArr_size = cn4RArr_params[0]*cn4RArr_params[0];
+    double cn4RAaa_size = cn4RAaa_params[0]*cn4RAaa_params[0];
+    double cn4RArr_dy   = cn4RArr_size < cn4RAra_size ? cn4RArr_size/cn4RAra_size : cn4RAra_size/cn4RArr_size;
+    double cn4RAaa_dy   = cn4RAaa_size < cn4RAra_size ? cn4RAaa_size/cn4RAra_size : cn4RAra_size/cn4RAaa_size;
+    double cn4_dy       = cn4RArr_dy < cn4RAaa_dy ? cn4RArr_dy/cn4RAaa_dy : cn4RAaa_dy/cn4RArr_dy;
+    double cn4_ymin     = cn4RArr_size < cn4RAaa_size ? cn4RArr_size/cn4RAra_size : cn4RAaa_size/cn4RAra_size;
+    cn4_dx              = (cn4RAaa_params[1]-0.5) - (0.5-cn4RArr_params[1]);
+    double cn4_frac     = cn4RAaa_params[1] - cn4RArr_params[1];
+    double cn4_fit      = cn4ra_fit + cn4aa_fit;
+    // A very reasonable heuristics: check if the peak's width converged, exclude far too broad or far too narrow peaks
+    if ( cn4RAra_params[2]>0.3 || cn4RArr_params[2]>0.3 || cn4RAaa_params[2]>0.3 ) cn4_fit = HUGE_VAL;
+    if ( cn4RAra_params[2]<1e-2 || cn4RArr_params[2]<1e-2 || cn4RAaa_params[2]<1e-2 ) cn4_fit = HUGE_VAL;
+
+
+    // Choose the best match
+    char cn2_fail = '*', cn3_fail = '*', cn4_fail = '*';
+    if ( cn2_fit > args->fit_th ) cn2_fail = 'f';
+
+    if ( cn3_fit > args->fit_th ) cn3_fail = 'f';
+    else if ( cn3_dy < args->peak_symmetry ) cn3_fail = 'y';    // size difference is too big
+
+    if ( cn4_fit > args->fit_th ) cn4_fail = 'f';
+    else if ( cn4_ymin < args->min_peak_size ) cn4_fail = 'y';      // side peak is too small
+    else if ( cn4_dy < args->peak_symmetry ) cn4_fail = 'Y';    // size difference is too big
+    else if ( cn4_dx > 0.1 ) cn4_fail = 'x';                    // side peaks placed assymetrically
+
+    double cn = -1, fit = cn2_fit;
+    if ( cn2_fail == '*' ) { cn = 2; fit = cn2_fit; }
+    if ( cn3_fail == '*' )
+    {
+        // Use cn_penalty as a tiebreaker. If set to 0.3, cn3_fit must be 30% smaller than cn2_fit.
+        if ( cn<0 || cn3_fit < (1-args->cn_penalty) * fit )
         {
-            // Use cn_penalty as a tiebreaker. If set to 0.3, cn3_fit must be 30% smaller than cn2_fit.
-            if ( cn<0 || cn3_fit < (1-args->cn_penalty) * fit )
-            {
-                cn = 2 + cn3_frac; 
-                fit = cn3_fit; 
-                if ( cn2_fail=='*' ) cn2_fail = 'p';
-            }
-            else cn3_fail = 'p';
+            cn = 2 + cn3_frac; 
+            fit = cn3_fit; 
+            if ( cn2_fail=='*' ) cn2_fail = 'p';
         }
-        if ( cn4_fail == '*' )
+        else cn3_fail = 'p';
+    }
+    if ( cn4_fail == '*' )
+    {
+        if ( cn<0 || cn4_fit < (1-args->cn_penalty) * fit )
         {
-            if ( cn<0 || cn4_fit < (1-args->cn_penalty) * fit )
-            {
-                cn = 3 + cn4_frac;
-                fit = cn4_fit;
-                if ( cn2_fail=='*' ) cn2_fail = 'p';
-                if ( cn3_fail=='*' ) cn3_fail = 'p';
-            }
-            else cn4_fail = 'p';
+            cn = 3 + cn4_frac;
+            fit = cn4_fit;
+            if ( cn2_fail=='*' ) cn2_fail = 'p';
+            if ( cn3_fail=='*' ) cn3_fail = 'p';
         }
+        else cn4_fail = 'p';
+    }
 
-        if ( args->verbose )
-        {
-            fprintf(stderr,"\tcn2 %c fit=%e\n", cn2_fail, cn2_fit);
-            fprintf(stderr,"\t       .. %e\n", cn2ra_fit);
-            fprintf(stderr,"\t            RA:   %f %f %f\n", cn2ra_params[0],cn2ra_params[1],cn2ra_params[2]);
-            fprintf(stderr,"\t       .. %e\n", cn2aa_fit);
-            fprintf(stderr,"\t            AA:   %f %f %f\n", cn2aa_params[0],cn2aa_params[1],cn2aa_params[2]);
-            fprintf(stderr,"\t      func:\n");
-            fprintf(stderr,"\t            %s\n", cn2ra_func);
-            fprintf(stderr,"\t            %s\n", cn2aa_func);
-            fprintf(stderr,"\n");
-            fprintf(stderr,"\tcn3 %c fit=%e  frac=%f  symmetry=%f\n", cn3_fail, cn3_fit, cn3_frac, cn3_dy);
-            fprintf(stderr,"\t       .. %e\n", cn3ra_fit);
-            fprintf(stderr,"\t            RRA:  %f %f %f\n", cn3rra_params[0],cn3rra_params[1],cn3rra_params[2]);
-            fprintf(stderr,"\t            RAA:  %f %f %f\n", cn3raa_params[0],cn3raa_params[1],cn3raa_params[2]);
-            fprintf(stderr,"\t       .. %e\n", cn3aa_fit);
-            fprintf(stderr,"\t            AAA:  %f %f %f\n", cn3aa_params[0],cn3aa_params[1],cn3aa_params[2]);
-            fprintf(stderr,"\t      func:\n");
-            fprintf(stderr,"\t            %s\n", cn3ra_func);
-            fprintf(stderr,"\t            %s\n", cn3aa_func);
-            fprintf(stderr,"\n");
-            fprintf(stderr,"\tcn4 %c fit=%e  frac=%f  symmetry=%f ymin=%f\n", cn4_fail, cn4_fit, cn4_frac, cn4_dy, cn4_ymin);
-            fprintf(stderr,"\t       .. %e\n", cn4ra_fit);
-            fprintf(stderr,"\t            RArr:  %f %f %f\n", cn4RArr_params[0],cn4RArr_params[1],cn4RArr_params[2]);
-            fprintf(stderr,"\t            RAra:  %f %f %f\n", cn4RAra_params[0],cn4RAra_params[1],cn4RAra_params[2]);
-            fprintf(stderr,"\t            RAaa:  %f %f %f\n", cn4RAaa_params[0],cn4RAaa_params[1],cn4RAaa_params[2]);
-            fprintf(stderr,"\t       .. %e\n", cn4aa_fit);
-            fprintf(stderr,"\t            AAaa:  %f %f %f\n", cn4AAaa_params[0],cn4AAaa_params[1],cn4AAaa_params[2]);
-            fprintf(stderr,"\t      func:\n");
-            fprintf(stderr,"\t            %s\n", cn4ra_func);
-            fprintf(stderr,"\t            %s\n", cn4aa_func);
-            fprintf(stderr,"\n");
-        }
+    if ( args->verbose )
+    {
+        ksprintf(err,"\tcn2 %c fit=%e\n", cn2_fail, cn2_fit);
+        ksprintf(err,"\t       .. %e\n", cn2ra_fit);
+        ksprintf(err,"\t            RA:   %f %f %f\n", cn2ra_params[0],cn2ra_params[1],cn2ra_params[2]);
+        ksprintf(err,"\t       .. %e\n", cn2aa_fit);
+        ksprintf(err,"\t            AA:   %f %f %f\n", cn2aa_params[0],cn2aa_params[1],cn2aa_params[2]);
+        ksprintf(err,"\t      func:\n");
+        ksprintf(err,"\t            %s\n", cn2ra_func);
+        ksprintf(err,"\t            %s\n", cn2aa_func);
+        ksprintf(err,"\n");
+        ksprintf(err,"\tcn3 %c fit=%e  frac=%f  symmetry=%f\n", cn3_fail, cn3_fit, cn3_frac, cn3_dy);
+        ksprintf(err,"\t       .. %e\n", cn3ra_fit);
+        ksprintf(err,"\t            RRA:  %f %f %f\n", cn3rra_params[0],cn3rra_params[1],cn3rra_params[2]);
+        ksprintf(err,"\t            RAA:  %f %f %f\n", cn3raa_params[0],cn3raa_params[1],cn3raa_params[2]);
+        ksprintf(err,"\t       .. %e\n", cn3aa_fit);
+        ksprintf(err,"\t            AAA:  %f %f %f\n", cn3aa_params[0],cn3aa_params[1],cn3aa_params[2]);
+        ksprintf(err,"\t      func:\n");
+        ksprintf(err,"\t            %s\n", cn3ra_func);
+        ksprintf(err,"\t            %s\n", cn3aa_func);
+        ksprintf(err,"\n");
+        ksprintf(err,"\tcn4 %c fit=%e  frac=%f  symmetry=%f ymin=%f\n", cn4_fail, cn4_fit, cn4_frac, cn4_dy, cn4_ymin);
+        ksprintf(err,"\t       .. %e\n", cn4ra_fit);
+        ksprintf(err,"\t            RArr:  %f %f %f\n", cn4RArr_params[0],cn4RArr_params[1],cn4RArr_params[2]);
+        ksprintf(err,"\t            RAra:  %f %f %f\n", cn4RAra_params[0],cn4RAra_params[1],cn4RAra_params[2]);
+        ksprintf(err,"\t            RAaa:  %f %f %f\n", cn4RAaa_params[0],cn4RAaa_params[1],cn4RAaa_params[2]);
+        ksprintf(err,"\t       .. %e\n", cn4aa_fit);
+        ksprintf(err,"\t            AAaa:  %f %f %f\n", cn4AAaa_params[0],cn4AAaa_params[1],cn4AAaa_params[2]);
+        ksprintf(err,"\t      func:\n");
+        ksprintf(err,"\t            %s\n", cn4ra_func);
+        ksprintf(err,"\t            %s\n", cn4aa_func);
+        ksprintf(err,"\n");
+    }
 
-        if ( args->force_cn==2 || cn2_fail == '*' )
-        {
-            fprintf(args->dat_fp,"FIT\t%s\t%e\t%d\t%d\t%s\n", dist->chr,cn2ra_fit,dist->irr,dist->iaa,cn2ra_func);
-            if ( cn2aa_func ) fprintf(args->dat_fp,"FIT\t%s\t%e\t%d\t%d\t%s\n", dist->chr,cn2aa_fit,dist->iaa,dist->nvals-1,cn2aa_func);
-        }
-        if ( args->force_cn==3 || cn3_fail == '*' )
+    if ( args->force_cn==2 || cn2_fail == '*' )
+    {
+        ksprintf(out,"FIT\t%s\t%e\t%d\t%d\t%s\n", dist->chr,cn2ra_fit,dist->irr,dist->iaa,cn2ra_func);
+        if ( cn2aa_func ) ksprintf(out,"FIT\t%s\t%e\t%d\t%d\t%s\n", dist->chr,cn2aa_fit,dist->iaa,dist->nvals-1,cn2aa_func);
+    }
+    if ( args->force_cn==3 || cn3_fail == '*' )
+    {
+        ksprintf(out,"FIT\t%s\t%e\t%d\t%d\t%s\n", dist->chr,cn3ra_fit,dist->irr,dist->iaa,cn3ra_func);
+        if ( cn3aa_func ) ksprintf(out,"FIT\t%s\t%e\t%d\t%d\t%s\n", dist->chr,cn3aa_fit,dist->iaa,dist->nvals-1,cn3aa_func);
+    }
+    if ( args->force_cn==4 || cn4_fail == '*' )
+    {
+        ksprintf(out,"FIT\t%s\t%e\t%d\t%d\t%s\n", dist->chr,cn4ra_fit,dist->irr,dist->iaa,cn4ra_func);
+        if ( cn4aa_func ) ksprintf(out,"FIT\t%s\t%e\t%d\t%d\t%s\n", dist->chr,cn4aa_fit,dist->iaa,dist->nvals-1,cn4aa_func);
+    }
+    ksprintf(out,"CN\t%s\t%.2f\t%f\n", dist->chr, cn, fit);
+
+    free(cn2aa_func);
+    free(cn2ra_func);
+    free(cn3ra_func);
+    free(cn4ra_func);
+    free(cn4aa_func);
+
+    peakfit_destroy(pkf);
+    return job;
+}
+
+static void write_job(args_t *args, fit_job_t *job)
+{
+    if ( job->err.l ) fputs(job->err.s, stderr);
+    if ( job->out.l ) fputs(job->out.s, args->dat_fp);
+    free(job->err.s);
+    free(job->out.s);
+}
+
+static void fit_curves(args_t *args)
+{
+    int i;
+    fit_job_t *jobs = (fit_job_t*) calloc(args->ndist,sizeof(fit_job_t));
+    for (i=0; i<args->ndist; i++)
+    {
+        jobs[i].args = args;
+        jobs[i].dist = &args->dist[i];
+    }
+    if ( !args->n_threads )
+    {
+        for (i=0; i<args->ndist; i++)
         {
-            fprintf(args->dat_fp,"FIT\t%s\t%e\t%d\t%d\t%s\n", dist->chr,cn3ra_fit,dist->irr,dist->iaa,cn3ra_func);
-            if ( cn3aa_func ) fprintf(args->dat_fp,"FIT\t%s\t%e\t%d\t%d\t%s\n", dist->chr,cn3aa_fit,dist->iaa,dist->nvals-1,cn3aa_func);
+            fit_dist(&jobs[i]);
+            write_job(args, &jobs[i]);
         }
-        if ( args->force_cn==4 || cn4_fail == '*' )
+        free(jobs);
+        return;
+    }
+
+    // the results come back in the order of dispatch, keep at most qsize jobs in flight
+    int qsize = 2*args->n_threads, nbusy = 0;
+    hts_tpool *pool = hts_tpool_init(args->n_threads);
+    if ( !pool ) error("Failed to initialize a pool of %d threads\n", args->n_threads);
+    hts_tpool_process *queue = hts_tpool_process_init(pool, qsize, 0);
+    if ( !queue ) error("Failed to initialize the thread pool queue\n");
+    for (i=0; i<args->ndist; i++)
+    {
+        if ( nbusy>=qsize )
         {
-            fprintf(args->dat_fp,"FIT\t%s\t%e\t%d\t%d\t%s\n", dist->chr,cn4ra_fit,dist->irr,dist->iaa,cn4ra_func);
-            if ( cn4aa_func ) fprintf(args->dat_fp,"FIT\t%s\t%e\t%d\t%d\t%s\n", dist->chr,cn4aa_fit,dist->iaa,dist->nvals-1,cn4aa_func);
+            hts_tpool_result *res = hts_tpool_next_result_wait(queue);
+            write_job(args, (fit_job_t*) hts_tpool_result_data(res));
+            hts_tpool_delete_result(res, 0);
+            nbusy--;
         }
-        fprintf(args->dat_fp,"CN\t%s\t%.2f\t%f\n", dist->chr, cn, fit);
-
-        free(cn2aa_func);
-        free(cn2ra_func);
-        free(cn3ra_func);
-        free(cn4ra_func);
-        free(cn4aa_func);
+        if ( hts_tpool_dispatch(pool, queue, fit_dist, &jobs[i]) < 0 ) error("Failed to dispatch the fit of %s\n", args->dist[i].chr);
+        nbusy++;
     }
-
-    peakfit_destroy(pkf);
+    while ( nbusy>0 )
+    {
+        hts_tpool_result *res = hts_tpool_next_result_wait(queue);
+        write_job(args, (fit_job_t*) hts_tpool_result_data(res));
+        hts_tpool_delete_result(res, 0);
+        nbusy--;
+    }
+    hts_tpool_process_destroy(queue);
+    hts_tpool_destroy(pool);
+    free(jobs);
 }
 
 static void usage(args_t *args)
@@ -629,6 +777,9 @@ static void usage(args_t *args)
     fprintf(stderr, "    -t, --targets <region>         similar to -r but streams rather than index-jumps\n");
     fprintf(stderr, "    -T, --targets-file <file>      similar to -R but streams rather than index-jumps\n");
     fprintf(stderr, "    -v, --verbose                  \n");
+    fprintf(stderr, "        --load-dist <file>         read BAF histograms saved by --save-dist instead of the VCF\n");
+    fprintf(stderr, "        --save-dist <file>         save BAF histograms in binary form for later refitting\n");
+    fprintf(stderr, "        --threads <int>            fit chromosomes in parallel using <int> threads [0]\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Algorithm options:\n");
     fprintf(stderr, "    -b, --peak-size <float>        minimum peak size (0-1, larger is stricter) [0.1]\n");
@@ -660,6 +811,9 @@ int main_polysomy(int argc, char *argv[])
         {"force-cn",1,0,2},         // hidden option
         {"smooth",1,0,'S'},         // hidden option
         {"nbins",1,0,'n'},          // hidden option
+        {"save-dist",1,0,3},
+        {"load-dist",1,0,4},
+        {"threads",1,0,5},
         {"include-aa",0,0,'i'},
         {"peak-size",1,0,'b'},
         {"min-fraction",1,0,'m'},
@@ -683,6 +837,12 @@ int main_polysomy(int argc, char *argv[])
         {
             case  1 : args->ra_rr_scaling = 0; break;
             case  2 : args->force_cn = atoi(optarg); break;
+            case  3 : args->save_dist_fname = optarg; break;
+            case  4 : args->load_dist_fname = optarg; break;
+            case  5 :
+                args->n_threads = strtol(optarg,&tmp,10);
+                if ( *tmp || args->n_threads<0 ) error("Could not parse: --threads %s\n", optarg);
+                break;
             case 'n': args->nbins = atoi(optarg); break;
             case 'S': args->smooth = atoi(optarg); break;
             case 'i': args->include_aa = 1; break;
@@ -720,10 +880,10 @@ int main_polysomy(int argc, char *argv[])
     }
     if ( optind>=argc )
     {
-        if ( !isatty(fileno((FILE *)stdin)) ) args->fname = "-";
+        if ( !args->load_dist_fname && !isatty(fileno((FILE *)stdin)) ) args->fname = "-";
     }
     else args->fname = argv[optind];
-    if ( !args->fname ) usage(args);
+    if ( !args->fname && !args->load_dist_fname ) usage(args);
     if ( !args->output_dir ) error("Missing the -o option\n");
 
     init_data(args);
@@ -0,0 +1,147 @@
+/* The MIT License
+
+   Copyright (C) 2026 Genome Research Ltd.
+   
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+   
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+   
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+
+ */
+
+#include <pthread.h>
+#include <htslib/vcf.h>
+#include <htslib/kseq.h>
+#include "bcftools.h"
+#include "prefetch.h"
+#include "rbuf.h"
+
+struct _prefetch_t
+{
+    htsFile *fp;
+    bcf_hdr_t *hdr;
+    bcf1_t **recs;
+    kstring_t *lines;   // VCF only: the lines are read ahead and parsed by the caller
+    rbuf_t rbuf;        // the records read so far, the first is held by the caller when held is set
+    int held, eof, ret, stop;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t has_data, has_space;
+};
+
+static void *prefetch_worker(void *arg)
+{
+    prefetch_t *pf = (prefetch_t*) arg;
+    while (1)
+    {
+        pthread_mutex_lock(&pf->lock);
+        while ( pf->rbuf.n==pf->rbuf.m && !pf->stop ) pthread_cond_wait(&pf->has_space, &pf->lock);
+        if ( pf->stop ) { pthread_mutex_unlock(&pf->lock); break; }
+        int i = pf->rbuf.f + pf->rbuf.n;
+        if ( i >= pf->rbuf.m ) i -= pf->rbuf.m;
+        pthread_mutex_unlock(&pf->lock);
+
+        // the slot past the end of the buffer is not touched by the caller. VCF records
+        // are not parsed here: vcf_parse() adds undefined contigs and tags to the header,
+        // which the caller reads at the same time
+        int ret;
+        if ( pf->lines )
+        {
+            ret = hts_getline(pf->fp, KS_SEP_LINE, &pf->lines[i]);
+            if ( ret>=0 ) ret = 0;
+        }
+        else
+            ret = bcf_read(pf->fp, pf->hdr, pf->recs[i]);
+
+        pthread_mutex_lock(&pf->lock);
+        if ( ret==0 ) rbuf_append(&pf->rbuf);
+        else { pf->eof = 1; pf->ret = ret; }
+        pthread_cond_signal(&pf->has_data);
+        pthread_mutex_unlock(&pf->lock);
+        if ( ret!=0 ) break;
+    }
+    return NULL;
+}
+
+prefetch_t *prefetch_init(htsFile *fp, bcf_hdr_t *hdr, int nrec, int max_unpack)
+{
+    prefetch_t *pf = (prefetch_t*) calloc(1, sizeof(prefetch_t));
+    pf->fp  = fp;
+    pf->hdr = hdr;
+    if ( nrec < 2 ) nrec = 2;   // one held by the caller, one being read
+    rbuf_init(&pf->rbuf, nrec);
+    pf->recs = (bcf1_t**) malloc(sizeof(bcf1_t*)*nrec);
+    int i;
+    for (i=0; i<nrec; i++)
+    {
+        pf->recs[i] = bcf_init1();
+        pf->recs[i]->max_unpack = max_unpack;
+    }
+    if ( hts_get_format(fp)->format==vcf ) pf->lines = (kstring_t*) calloc(nrec, sizeof(kstring_t));
+    pthread_mutex_init(&pf->lock, NULL);
+    pthread_cond_init(&pf->has_data, NULL);
+    pthread_cond_init(&pf->has_space, NULL);
+    if ( pthread_create(&pf->thread, NULL, prefetch_worker, pf)!=0 ) error("Failed to create the prefetch thread\n");
+    return pf;
+}
+
+bcf1_t *prefetch_next(prefetch_t *pf)
+{
+    pthread_mutex_lock(&pf->lock);
+    if ( pf->held )
+    {
+        rbuf_shift(&pf->rbuf);
+        pf->held = 0;
+        pthread_cond_signal(&pf->has_space);
+    }
+    while ( !pf->rbuf.n && !pf->eof ) pthread_cond_wait(&pf->has_data, &pf->lock);
+    bcf1_t *rec = NULL;
+    int i = pf->rbuf.n ? pf->rbuf.f : -1;
+    if ( i>=0 )
+    {
+        rec = pf->recs[i];
+        pf->held = 1;
+    }
+    else if ( pf->ret < -1 ) error("Failed to read the VCF/BCF record: %d\n", pf->ret);
+    pthread_mutex_unlock(&pf->lock);
+
+    // the held slot is not touched by the thread, the header can be modified outside the lock
+    if ( rec && pf->lines && vcf_parse(&pf->lines[i], pf->hdr, rec)!=0 )
+        error("Failed to parse the VCF record: %s\n", pf->lines[i].s);
+    return rec;
+}
+
+void prefetch_destroy(prefetch_t *pf)
+{
+    pthread_mutex_lock(&pf->lock);
+    pf->stop = 1;
+    pthread_cond_signal(&pf->has_space);
+    pthread_mutex_unlock(&pf->lock);
+    pthread_join(pf->thread, NULL);
+
+    int i;
+    for (i=0; i<pf->rbuf.m; i++)
+    {
+        bcf_destroy1(pf->recs[i]);
+        if ( pf->lines ) free(pf->lines[i].s);
+    }
+    free(pf->recs);
+    free(pf->lines);
+    pthread_mutex_destroy(&pf->lock);
+    pthread_cond_destroy(&pf->has_data);
+    pthread_cond_destroy(&pf->has_space);
+    free(pf);
+}
@@ -0,0 +1,64 @@
+/* The MIT License
+
+   Copyright (C) 2026 Genome Research Ltd.
+   
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+   
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+   
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+
+ */
+
+/*
+    Read records of a VCF/BCF file ahead of the caller in a background thread.
+    The thread decompresses and parses the records into a bounded round buffer,
+    the caller takes them out in the order of the file. VCF lines are only read
+    ahead and parsed by the caller, so that undefined contigs and tags are added
+    to the header in the caller's thread.
+*/
+
+#ifndef __PREFETCH_H__
+#define __PREFETCH_H__
+
+#include <htslib/vcf.h>
+
+typedef struct _prefetch_t prefetch_t;
+
+/*
+ *  prefetch_init() - start reading records from an open file
+ *  @fp:         the file positioned after the header
+ *  @hdr:        the header of the file
+ *  @nrec:       the maximum number of records read ahead
+ *  @max_unpack: the max_unpack value of the records, see bcf1_t
+ *
+ *  The file must not be accessed by the caller until prefetch_destroy().
+ */
+prefetch_t *prefetch_init(htsFile *fp, bcf_hdr_t *hdr, int nrec, int max_unpack);
+
+/*
+ *  prefetch_next() - return the next record or NULL at the end of the file
+ *
+ *  The record is owned by the prefetch_t and can be modified by the caller, it
+ *  is valid until the next call. Reading errors are fatal.
+ */
+bcf1_t *prefetch_next(prefetch_t *pf);
+
+/*
+ *  prefetch_destroy() - stop the thread and free the buffers; the file is not closed
+ */
+void prefetch_destroy(prefetch_t *pf);
+
+#endif
@@ -459,6 +459,31 @@ static double mc_cal_afs(bcf_p1aux_t *ma, double *p_ref_folded, double *p_var_fo
     return sum / ma->M;
 }
 
+/*
+    A lower bound of the posterior probability of the site being non-variant
+    without running the DP: P(D|k) of any allele count k cannot exceed the
+    product of the per-sample maxima of P(D|g) and for k=M it equals the
+    product of the P(D|RR) terms, because only one configuration has M
+    reference alleles. The pdg array is in the order of bcf_p1_cal(), RR last.
+ */
+double bcf_p1_min_pref(bcf_p1aux_t *ma, bcf1_t *b, const double *pdg)
+{
+    double *phi = bcf_is_snp(b) ? ma->phi : ma->phi_indel;
+    double sum = 0., r = 1., l = 0.;
+    int i;
+    for (i = 0; i <= ma->M; ++i) sum += phi[i];
+    for (i = 0; i < ma->n; ++i, pdg += 3) {
+        double max = pdg[0] > pdg[1] ? pdg[0] : pdg[1];
+        if (max < pdg[2]) max = pdg[2];
+        if (max <= 0.) continue;
+        r *= pdg[2] / max;
+        if (r < 1e-200) l += log(r), r = 1.;
+    }
+    l += log(r);
+    if (phi[ma->M] <= 0.) return 0.;
+    return 1. / (1. + (sum - phi[ma->M]) / phi[ma->M] * exp(-l));
+}
+
 int bcf_p1_cal(call_t *call, bcf1_t *b, int do_contrast, bcf_p1aux_t *ma, bcf_p1rst_t *rst)
 {
     int i, k;
@@ -78,6 +78,7 @@ extern "C" {
     void bcf_p1_destroy(bcf_p1aux_t *ma);
     void bcf_p1_set_ploidy(bcf1_t *b, bcf_p1aux_t *ma);
     int bcf_p1_cal(call_t *call, bcf1_t *b, int do_contrast, bcf_p1aux_t *ma, bcf_p1rst_t *rst);
+    double bcf_p1_min_pref(bcf_p1aux_t *ma, bcf1_t *b, const double *pdg);
     int bcf_p1_call_gt(const bcf_p1aux_t *ma, double f0, int k, int is_var);
     void bcf_p1_dump_afs(bcf_p1aux_t *ma);
     int bcf_p1_read_prior(bcf_p1aux_t *ma, const char *fn);
@@ -0,0 +1,100 @@
+/*  profile.c -- lightweight timers and counters for --profile.
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include "bcftools.h"
+#include "profile.h"
+
+int bcftools_profile = 0;
+uint64_t bcftools_prof_time[PROF_NPHASES], bcftools_prof_count[PROF_NCOUNTERS];
+
+static const char *phase_names[] = { "read", "filter", "convert", "write" };
+static const char *counter_names[] =
+{
+    "records_in", "records_out", "bytes_decoded", "unpacked_str", "unpacked_flt",
+    "unpacked_info", "unpacked_fmt", "filter_tested", "filter_site_only"
+};
+
+static struct
+{
+    char *cmd, *fname;
+    uint64_t start;
+}
+prof;
+
+static double tv2sec(struct timeval *tv) { return tv->tv_sec + 1e-6*tv->tv_usec; }
+
+static void profile_report(void)
+{
+    double wall = 1e-9*(profile_start() - prof.start);
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+
+    // the time not accounted for by the phases run in the main thread
+    double other = wall;
+    int i;
+    for (i=0; i<PROF_NPHASES; i++)
+        if ( i!=PROF_FILTER ) other -= 1e-9*bcftools_prof_time[i];
+    if ( other < 0 ) other = 0;
+
+    FILE *fp = stderr;
+    if ( prof.fname && !(fp = fopen(prof.fname,"w")) )
+    {
+        fprintf(stderr,"Could not write %s\n", prof.fname);
+        return;
+    }
+    if ( prof.fname )
+    {
+        fprintf(fp,"{\"command\":\"%s\",\"wall\":%.6f,\"user\":%.6f,\"sys\":%.6f,\"max_rss_kb\":%ld,\"phases\":{",
+            prof.cmd, wall, tv2sec(&ru.ru_utime), tv2sec(&ru.ru_stime), (long)ru.ru_maxrss);
+        for (i=0; i<PROF_NPHASES; i++)
+            fprintf(fp,"\"%s\":%.6f,", phase_names[i], 1e-9*bcftools_prof_time[i]);
+        fprintf(fp,"\"other\":%.6f},\"counters\":{", other);
+        for (i=0; i<PROF_NCOUNTERS; i++)
+            fprintf(fp,"%s\"%s\":%"PRIu64, i ? "," : "", counter_names[i], bcftools_prof_count[i]);
+        fprintf(fp,"}}\n");
+        fclose(fp);
+        return;
+    }
+    fprintf(fp,"# Profile of bcftools %s\n", prof.cmd);
+    fprintf(fp,"wall\t%.3f s\nuser\t%.3f s\nsys\t%.3f s\nmax_rss\t%ld kB\n",
+        wall, tv2sec(&ru.ru_utime), tv2sec(&ru.ru_stime), (long)ru.ru_maxrss);
+    for (i=0; i<PROF_NPHASES; i++)
+        fprintf(fp,"%s\t%.3f s\t%.1f%%\n", phase_names[i], 1e-9*bcftools_prof_time[i], wall ? 100e-9*bcftools_prof_time[i]/wall : 0);
+    fprintf(fp,"other\t%.3f s\t%.1f%%\n", other, wall ? 100*other/wall : 0);
+    for (i=0; i<PROF_NCOUNTERS; i++)
+        fprintf(fp,"%s\t%"PRIu64"\n", counter_names[i], bcftools_prof_count[i]);
+}
+
+void profile_init(const char *cmd, const char *fname)
+{
+    bcftools_profile = 1;
+    prof.cmd   = strdup(cmd);
+    prof.fname = fname ? strdup(fname) : NULL;
+    prof.start = profile_start();
+    atexit(profile_report);
+}
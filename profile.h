@@ -0,0 +1,112 @@
+/*  profile.h -- lightweight timers and counters for --profile.
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.  */
+
+/*
+    With `bcftools --profile <command>`, the time spent in the main phases of
+    processing and a few counters are collected and printed at exit. When the
+    profiling is off, each call costs one test of a global flag.
+
+    The phase times of work done in worker threads (filter_test) are summed
+    over the threads. Reading includes both BGZF decompression and parsing,
+    these happen inside htslib.
+*/
+
+#ifndef __PROFILE_H__
+#define __PROFILE_H__
+
+#include <stdint.h>
+#include <time.h>
+#include <htslib/vcf.h>
+
+typedef enum
+{
+    PROF_READ,          // bcf_sr_next_line: decompression and parsing
+    PROF_FILTER,        // filter_test
+    PROF_CONVERT,       // convert_line
+    PROF_WRITE,         // bcf_write and text output, including compression
+    PROF_NPHASES
+}
+prof_phase_t;
+
+typedef enum
+{
+    PROF_NREC_IN,
+    PROF_NREC_OUT,
+    PROF_NBYTES,        // bytes of decoded BCF records read
+    PROF_NUN_STR,       // the highest unpack level reached by the records
+    PROF_NUN_FLT,
+    PROF_NUN_INFO,
+    PROF_NUN_FMT,
+    PROF_NFLT_TESTED,   // records tested by filter_test
+    PROF_NFLT_SITE_ONLY,// records decided without unpacking FORMAT
+    PROF_NCOUNTERS
+}
+prof_counter_t;
+
+extern int bcftools_profile;
+extern uint64_t bcftools_prof_time[PROF_NPHASES], bcftools_prof_count[PROF_NCOUNTERS];
+
+/*
+ *  profile_init() - enable the profiling, the report is printed to stderr or,
+ *  when fname is given, saved as JSON
+ */
+void profile_init(const char *cmd, const char *fname);
+
+static inline uint64_t profile_start(void)
+{
+    if ( !bcftools_profile ) return 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+static inline void profile_stop(prof_phase_t phase, uint64_t start)
+{
+    if ( !start ) return;
+    uint64_t now = profile_start();
+    __atomic_fetch_add(&bcftools_prof_time[phase], now - start, __ATOMIC_RELAXED);
+}
+static inline void profile_count(prof_counter_t counter, uint64_t n)
+{
+    if ( !bcftools_profile ) return;
+    __atomic_fetch_add(&bcftools_prof_count[counter], n, __ATOMIC_RELAXED);
+}
+
+// A record was read
+static inline void profile_in(bcf1_t *rec)
+{
+    if ( !bcftools_profile ) return;
+    profile_count(PROF_NREC_IN, 1);
+    profile_count(PROF_NBYTES, rec->shared.l + rec->indiv.l);
+}
+
+// Processing of the record is finished, count how deep it was unpacked
+static inline void profile_done(bcf1_t *rec, int written)
+{
+    if ( !bcftools_profile ) return;
+    if ( written ) profile_count(PROF_NREC_OUT, 1);
+    if ( rec->unpacked & BCF_UN_FMT ) profile_count(PROF_NUN_FMT, 1);
+    else if ( rec->unpacked & BCF_UN_INFO ) profile_count(PROF_NUN_INFO, 1);
+    else if ( rec->unpacked & BCF_UN_FLT ) profile_count(PROF_NUN_FLT, 1);
+    else if ( rec->unpacked & BCF_UN_STR ) profile_count(PROF_NUN_STR, 1);
+}
+
+#endif
@@ -0,0 +1,94 @@
+/* 
+    Copyright (C) 2026 Genome Research Ltd.
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+    
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+    
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "refseq.h"
+
+struct _refseq_t
+{
+    faidx_t *fai;
+    char *chr;          // the current sequence
+    int chr_len;        // its length or -1 if not present in the index
+    char *seq;          // the window, chr:beg..beg+len-1
+    int beg, len, win;
+};
+
+refseq_t *refseq_init(faidx_t *fai, int win)
+{
+    refseq_t *ref = (refseq_t*) calloc(1,sizeof(refseq_t));
+    ref->fai = fai;
+    ref->win = win>0 ? win : REFSEQ_WIN;
+    return ref;
+}
+
+void refseq_destroy(refseq_t *ref)
+{
+    if ( !ref ) return;
+    free(ref->chr);
+    free(ref->seq);
+    free(ref);
+}
+
+const char *refseq_fetch(refseq_t *ref, const char *chr, int beg, int end, int *len)
+{
+    if ( !ref->chr || strcmp(ref->chr,chr) )
+    {
+        free(ref->chr);
+        free(ref->seq);
+        ref->chr = strdup(chr);
+        ref->chr_len = faidx_seq_len(ref->fai, chr);
+        ref->seq = NULL;
+        ref->len = 0;
+    }
+    if ( beg < 0 ) beg = 0;
+    if ( end >= ref->chr_len ) end = ref->chr_len - 1;
+    if ( beg > end ) return NULL;
+
+    if ( !ref->seq || beg < ref->beg || end >= ref->beg + ref->len )
+    {
+        free(ref->seq);
+        int wbeg = beg > REFSEQ_BACK ? beg - REFSEQ_BACK : 0;
+        int wend = end - beg + 1 > ref->win ? end : beg + ref->win - 1;
+        if ( wend >= ref->chr_len ) wend = ref->chr_len - 1;
+        ref->seq = faidx_fetch_seq(ref->fai, ref->chr, wbeg, wend, &ref->len);
+        if ( !ref->seq || ref->len != wend - wbeg + 1 )
+        {
+            free(ref->seq);
+            ref->seq = NULL;
+            ref->len = 0;
+            return NULL;
+        }
+        ref->beg = wbeg;
+    }
+    *len = end - beg + 1;
+    return ref->seq + beg - ref->beg;
+}
+
+char *refseq_fetch_kstr(refseq_t *ref, const char *chr, int beg, int end, kstring_t *str, int *len)
+{
+    const char *seq = refseq_fetch(ref, chr, beg, end, len);
+    if ( !seq ) return NULL;
+    str->l = 0;
+    kputsn(seq, *len, str);
+    return str->s;
+}
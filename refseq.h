@@ -0,0 +1,78 @@
+/* 
+    Copyright (C) 2026 Genome Research Ltd.
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+    
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+    
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+/*
+    Streaming access to the reference sequence. A window of the current
+    sequence is fetched with one faidx_fetch_seq() call and subsequent queries
+    within the window are served without further reads, decompression or
+    allocation. The window is refilled when a query falls outside of it, so
+    queries may come in any order, but sorted streams are the fast case.
+
+    Example of usage:
+
+        refseq_t *ref = refseq_init(fai, 0);
+        int len;
+        const char *seq = refseq_fetch(ref, chr, beg, end, &len);
+        if ( !seq ) error("Failed to fetch the sequence %s:%d-%d\n", chr,beg+1,end+1);
+        fwrite(seq, 1, len, stdout);
+        refseq_destroy(ref);
+*/
+
+#ifndef __REFSEQ_H__
+#define __REFSEQ_H__
+
+#include <htslib/faidx.h>
+#include <htslib/kstring.h>
+
+#define REFSEQ_WIN  (1<<20)     // default window size
+#define REFSEQ_BACK 1024        // bases kept before the query, for padding upstream
+
+typedef struct _refseq_t refseq_t;
+
+/*
+ *  refseq_init() - initialize the window over an open faidx index. The index
+ *                  is not owned by refseq_t and must outlive it.
+ *  @fai:   the faidx index
+ *  @win:   the window size, or 0 for the default REFSEQ_WIN
+ */
+refseq_t *refseq_init(faidx_t *fai, int win);
+void refseq_destroy(refseq_t *ref);
+
+/*
+ *  refseq_fetch() - return pointer to the sequence chr:beg-end (0-based, inclusive).
+ *  @len:   set to the number of bases returned, can be shorter than requested 
+ *          at the end of the sequence
+ *
+ *  Returns NULL if the sequence is not present or beg is past its end. The
+ *  returned string is not NUL-terminated and must not be modified, it is valid
+ *  only until the next call.
+ */
+const char *refseq_fetch(refseq_t *ref, const char *chr, int beg, int end, int *len);
+
+/*
+ *  refseq_fetch_kstr() - same as refseq_fetch(), but copy the sequence into a
+ *                  reusable NUL-terminated string which the caller can modify
+ *
+ *  Returns the string or NULL on error.
+ */
+char *refseq_fetch_kstr(refseq_t *ref, const char *chr, int beg, int end, kstring_t *str, int *len);
+
+#endif
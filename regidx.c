@@ -23,6 +23,11 @@
 */
 
 #include <strings.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <htslib/hts.h>
 #include <htslib/kstring.h>
 #include <htslib/kseq.h>
@@ -33,6 +38,16 @@
 
 #define iBIN(x) ((x)>>13)
 
+// regidx_save() format, native byte order, sections padded to 8 bytes:
+//      magic, uint32 payload_size, uint32 nseq, then for each sequence
+//      uint32 name length, name, uint32 nreg, reg_t[nreg], payloads[nreg]
+#define REGIDX_MAGIC "RIDXv1\0\0"
+#define PAD8(x) (((x)+7) & ~(size_t)7)
+
+// With REGIDX_INDEX_AUTO, the tree is used when a region spans this many bins or more.
+// Such regions would be scanned by every query that falls into any of the bins.
+#define TREE_MIN_NBINS 4
+
 typedef struct
 {
     uint32_t beg, end;
@@ -47,12 +62,26 @@ pos_t;
 
 typedef struct _reglist_t reglist_t;
 
+// Cursor for queries sorted by position, see regitr_set_sorted(). The window
+// holds the regions passed by the cursor which can still overlap, sorted
+typedef struct
+{
+    regidx_t *ridx;
+    reglist_t *list;
+    uint32_t beg, next;     // the last query start and the first region not reached yet
+    uint32_t *win, nwin, mwin;
+}
+_cursor_t;
+
 typedef struct
 {
     uint32_t beg, end, ireg;      // query coordinates and the active region
     regidx_t *ridx;
     reglist_t *list;
     int active;
+    uint32_t *hit, nhit, mhit, ihit;    // overlapping regions found by the tree or the cursor, sorted
+    int sorted, ncur, mcur;             // the queries are sorted, one cursor per regidx
+    _cursor_t *cur;
 }
 _itr_t;
 
@@ -66,6 +95,11 @@ struct _reglist_t
     char *seq;              // sequence name
     int unsorted;
 
+    // Implicit interval tree over the sorted regions, used instead of idx (see
+    // cgranges by Heng Li): the node i at level k is the region reg[i], its
+    // children are i -/+ 2^(k-1) and max_end[i] is the maximum end in its subtree
+    uint32_t *max_end;
+    int max_level;
 };
 
 // Container of all sequences
@@ -81,6 +115,10 @@ struct _regidx_t
     int payload_size;
     void *payload;          // temporary payload data set by regidx_parse_f (sequence is not known beforehand)
     kstring_t str;
+    int index_type;         // REGIDX_INDEX_AUTO, REGIDX_INDEX_BINS or REGIDX_INDEX_TREE
+    void *map;              // regions and payloads mapped by regidx_load_mmap(), read-only
+    size_t map_size;
+    int frozen;             // set by regidx_finalize(), no more insertions
 };
 
 int regidx_seq_nregs(regidx_t *idx, const char *seq)
@@ -97,6 +135,11 @@ int regidx_nregs(regidx_t *idx)
     return nreg;
 }
 
+void regidx_set_index_type(regidx_t *idx, int type)
+{
+    idx->index_type = type;
+}
+
 char **regidx_seq_names(regidx_t *idx, int *n)
 {
     *n = idx->nseq;
@@ -144,6 +187,7 @@ static int cmp_reg_ptrs2(const void *a, const void *b)
 
 inline int regidx_push(regidx_t *idx, char *chr_beg, char *chr_end, uint32_t beg, uint32_t end, void *payload)
 {
+    if ( idx->map || idx->frozen ) return -1;   // read-only
     if ( beg > MAX_COOR_0 ) beg = MAX_COOR_0;
     if ( end > MAX_COOR_0 ) end = MAX_COOR_0;
 
@@ -185,10 +229,104 @@ int regidx_insert(regidx_t *idx, char *line)
     int ret = idx->parse(line,&chr_from,&chr_to,&beg,&end,idx->payload,idx->usr);
     if ( ret==-2 ) return -1;   // error
     if ( ret==-1 ) return 0;    // skip the line
-    regidx_push(idx, chr_from,chr_to,beg,end,idx->payload);
+    return regidx_push(idx, chr_from,chr_to,beg,end,idx->payload);
+}
+
+static void _reglist_sort(regidx_t *regidx, reglist_t *list);
+
+static int _write_padded(FILE *fp, const void *dat, size_t len)
+{
+    static const char zeros[8] = {0,0,0,0,0,0,0,0};
+    if ( len && fwrite(dat,1,len,fp)!=len ) return -1;
+    if ( PAD8(len)!=len && fwrite(zeros,1,PAD8(len)-len,fp)!=PAD8(len)-len ) return -1;
     return 0;
 }
 
+int regidx_save(regidx_t *idx, const char *fname)
+{
+    FILE *fp = fopen(fname,"w");
+    if ( !fp ) return -1;
+
+    uint32_t hdr[2] = { idx->payload_size, idx->nseq };
+    int i, ret = 0;
+    if ( fwrite(REGIDX_MAGIC,1,8,fp)!=8 || _write_padded(fp,hdr,sizeof(hdr))<0 ) ret = -1;
+    for (i=0; i<idx->nseq && !ret; i++)
+    {
+        reglist_t *list = &idx->seq[i];
+        _reglist_sort(idx, list);
+        uint32_t len = strlen(list->seq);
+        if ( _write_padded(fp,&len,sizeof(len))<0 || _write_padded(fp,list->seq,len)<0 ) ret = -1;
+        else if ( _write_padded(fp,&list->nreg,sizeof(list->nreg))<0 ) ret = -1;
+        else if ( _write_padded(fp,list->reg,sizeof(reg_t)*list->nreg)<0 ) ret = -1;
+        else if ( _write_padded(fp,list->dat,(size_t)idx->payload_size*list->nreg)<0 ) ret = -1;
+    }
+    if ( fclose(fp)!=0 ) ret = -1;
+    return ret;
+}
+
+regidx_t *regidx_load_mmap(const char *fname, size_t payload_size)
+{
+    int fd = open(fname,O_RDONLY);
+    if ( fd<0 ) return NULL;
+    struct stat st;
+    if ( fstat(fd,&st)<0 || st.st_size < 16 ) { close(fd); return NULL; }
+    void *map = mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+    close(fd);
+    if ( map==MAP_FAILED ) return NULL;
+
+    regidx_t *idx = (regidx_t*) calloc(1,sizeof(regidx_t));
+    idx->seq2regs = khash_str2int_init();
+    idx->map  = map;
+    idx->map_size = st.st_size;
+    idx->parse = regidx_parse_tab;
+
+    char *ptr = (char*) map, *end = ptr + st.st_size;
+    uint32_t *hdr = (uint32_t*)(ptr + 8);
+    if ( memcmp(ptr,REGIDX_MAGIC,8) ) goto error;
+    if ( hdr[0]!=payload_size )
+    {
+        fprintf(stderr,"The payload size of %s differs: %u vs %u\n", fname,hdr[0],(uint32_t)payload_size);
+        goto error;
+    }
+    idx->payload_size = payload_size;
+    if ( payload_size ) idx->payload = malloc(payload_size);
+    idx->nseq = idx->mseq = hdr[1];
+    idx->seq  = (reglist_t*) calloc(idx->nseq,sizeof(reglist_t));
+    idx->seq_names = (char**) calloc(idx->nseq,sizeof(char*));
+    ptr += 8 + PAD8(sizeof(uint32_t)*2);
+
+    int i;
+    for (i=0; i<idx->nseq; i++)
+    {
+        reglist_t *list = &idx->seq[i];
+        if ( ptr + 8 > end ) goto error;
+        uint32_t len = *((uint32_t*)ptr);
+        ptr += 8;
+        if ( ptr + PAD8(len) + 8 > end ) goto error;
+        idx->seq_names[i] = (char*) malloc(len+1);
+        memcpy(idx->seq_names[i],ptr,len);
+        idx->seq_names[i][len] = 0;
+        if ( khash_str2int_has_key(idx->seq2regs,idx->seq_names[i]) ) { free(idx->seq_names[i]); goto error; }
+        khash_str2int_set(idx->seq2regs,idx->seq_names[i],i);
+        list->seq = idx->seq_names[i];
+        ptr += PAD8(len);
+
+        list->nreg = *((uint32_t*)ptr);
+        ptr += 8;
+        size_t reg_size = PAD8(sizeof(reg_t)*list->nreg), dat_size = PAD8((size_t)payload_size*list->nreg);
+        if ( ptr + reg_size + dat_size > end ) goto error;
+        list->reg = (reg_t*) ptr;
+        list->dat = payload_size ? ptr + reg_size : NULL;
+        ptr += reg_size + dat_size;
+    }
+    return idx;
+
+error:
+    fprintf(stderr,"Could not load the regions: %s\n", fname);
+    regidx_destroy(idx);
+    return NULL;
+}
+
 regidx_t *regidx_init(const char *fname, regidx_parse_f parser, regidx_free_f free_f, size_t payload_size, void *usr_dat)
 {
     if ( !parser )
@@ -217,7 +355,24 @@ regidx_t *regidx_init(const char *fname, regidx_parse_f parser, regidx_free_f fr
     if ( payload_size ) idx->payload = malloc(payload_size);
 
     if ( !fname ) return idx;
-    
+
+    // a file written by regidx_save()
+    char magic[8];
+    FILE *mfp = fopen(fname,"r");
+    int is_saved = mfp && fread(magic,1,8,mfp)==8 && !memcmp(magic,REGIDX_MAGIC,8);
+    if ( mfp ) fclose(mfp);
+    if ( is_saved )
+    {
+        regidx_destroy(idx);
+        idx = regidx_load_mmap(fname,payload_size);
+        if ( idx )
+        {
+            idx->parse = parser;
+            idx->usr   = usr_dat;
+        }
+        return idx;
+    }
+
     kstring_t str = {0,0,0};
 
     htsFile *fp = hts_open(fname,"r");
@@ -245,6 +400,9 @@ void regidx_destroy(regidx_t *idx)
     for (i=0; i<idx->nseq; i++)
     {
         reglist_t *list = &idx->seq[i];
+        free(list->idx);
+        free(list->max_end);
+        if ( idx->map ) continue;
         if ( idx->free )
         {
             for (j=0; j<list->nreg; j++)
@@ -252,8 +410,8 @@ void regidx_destroy(regidx_t *idx)
         }
         free(list->dat);
         free(list->reg);
-        free(list->idx);
     }
+    if ( idx->map ) munmap(idx->map, idx->map_size);
     free(idx->seq_names);
     free(idx->seq);
     free(idx->str.s);
@@ -262,7 +420,88 @@ void regidx_destroy(regidx_t *idx)
     free(idx);
 }
 
-int _reglist_build_index(regidx_t *regidx, reglist_t *list)
+static int _reglist_build_tree(reglist_t *list)
+{
+    int64_t i, last_i = 0, n = list->nreg;
+    uint32_t last = 0;
+    int k;
+    list->max_end = (uint32_t*) malloc(sizeof(uint32_t)*n);
+    for (i=0; i<n; i+=2) { last_i = i; last = list->max_end[i] = list->reg[i].end; }
+    for (k=1; (1LL<<k) <= n; k++)
+    {
+        int64_t x = 1LL<<(k-1), i0 = (x<<1) - 1, step = x<<2;
+        for (i=i0; i<n; i+=step)
+        {
+            uint32_t el = list->max_end[i-x];
+            uint32_t er = i + x < n ? list->max_end[i+x] : last;
+            uint32_t e  = list->reg[i].end;
+            if ( e < el ) e = el;
+            if ( e < er ) e = er;
+            list->max_end[i] = e;
+        }
+        last_i = last_i>>k&1 ? last_i - x : last_i + x;
+        if ( last_i < n && list->max_end[last_i] > last ) last = list->max_end[last_i];
+    }
+    list->max_level = k - 1;
+    return 0;
+}
+
+/*
+ *  In-order traversal of the tree so that the overlaps are found sorted, as
+ *  with the bins. The hits are stored in the iterator, without one the search
+ *  stops at the first hit. Returns the number of hits.
+ */
+static int _reglist_tree_overlap(reglist_t *list, uint32_t beg, uint32_t end, _itr_t *itr)
+{
+    struct { int64_t x; int k, w; } stack[64], z;
+    int64_t n = list->nreg;
+    int t = 0, nhit = 0;
+    if ( itr ) itr->nhit = 0;
+
+    stack[t].k = list->max_level; stack[t].x = (1LL<<list->max_level) - 1; stack[t++].w = 0;   // the root
+    while ( t )
+    {
+        z = stack[--t];
+        if ( z.k <= 3 )
+        {
+            // small subtree, scan linearly
+            int64_t i, i0 = z.x >> z.k << z.k, i1 = i0 + (1LL<<(z.k+1)) - 1;
+            if ( i1 > n ) i1 = n;
+            for (i=i0; i<i1 && list->reg[i].beg <= end; i++)
+            {
+                if ( list->reg[i].end < beg ) continue;
+                if ( !itr ) return 1;
+                itr->nhit++;
+                hts_expand(uint32_t, itr->nhit, itr->mhit, itr->hit);
+                itr->hit[itr->nhit-1] = i;
+                nhit++;
+            }
+        }
+        else if ( z.w==0 )
+        {
+            // the left child first, the node is revisited afterwards. The child may not exist (y>=n)
+            int64_t y = z.x - (1LL<<(z.k-1));
+            stack[t].k = z.k; stack[t].x = z.x; stack[t++].w = 1;
+            if ( y >= n || list->max_end[y] >= beg ) { stack[t].k = z.k - 1; stack[t].x = y; stack[t++].w = 0; }
+        }
+        else if ( z.x < n && list->reg[z.x].beg <= end )
+        {
+            // the node itself, then the right child
+            if ( list->reg[z.x].end >= beg )
+            {
+                if ( !itr ) return 1;
+                itr->nhit++;
+                hts_expand(uint32_t, itr->nhit, itr->mhit, itr->hit);
+                itr->hit[itr->nhit-1] = z.x;
+                nhit++;
+            }
+            stack[t].k = z.k - 1; stack[t].x = z.x + (1LL<<(z.k-1)); stack[t++].w = 0;
+        }
+    }
+    return nhit;
+}
+
+static void _reglist_sort(regidx_t *regidx, reglist_t *list)
 {
     int i;
     if ( list->unsorted )
@@ -299,6 +538,19 @@ int _reglist_build_index(regidx_t *regidx, reglist_t *list)
         }
         list->unsorted = 0;
     }
+}
+
+int _reglist_build_index(regidx_t *regidx, reglist_t *list)
+{
+    int i;
+    _reglist_sort(regidx, list);
+
+    if ( regidx->index_type==REGIDX_INDEX_TREE ) return _reglist_build_tree(list);
+    if ( regidx->index_type==REGIDX_INDEX_AUTO )
+    {
+        for (i=0; i<list->nreg; i++)
+            if ( iBIN(list->reg[i].end) - iBIN(list->reg[i].beg) >= TREE_MIN_NBINS ) return _reglist_build_tree(list);
+    }
 
     list->nidx = 0;
     int j,k, midx = 0;
@@ -329,6 +581,94 @@ int _reglist_build_index(regidx_t *regidx, reglist_t *list)
     return 0;
 }
 
+static void _cursor_seek(_cursor_t *cur, reglist_t *list, uint32_t beg, _itr_t *itr)
+{
+    cur->list = list;
+    cur->nwin = 0;
+    cur->next = 0;
+    if ( list->max_end )
+    {
+        // the regions overlapping beg from the tree, then the first region starting after it
+        _reglist_tree_overlap(list, beg, beg, itr);
+        hts_expand(uint32_t, itr->nhit, cur->mwin, cur->win);
+        if ( itr->nhit ) memcpy(cur->win, itr->hit, sizeof(*itr->hit)*itr->nhit);
+        cur->nwin = itr->nhit;
+
+        uint32_t lo = 0, hi = list->nreg;
+        while ( lo < hi )
+        {
+            uint32_t mid = lo + (hi - lo)/2;
+            if ( list->reg[mid].beg <= beg ) lo = mid + 1;
+            else hi = mid;
+        }
+        cur->next = lo;
+    }
+    else if ( list->idx )
+    {
+        // no region before the first one in a bin reaches the bin
+        uint32_t ibin = iBIN(beg);
+        while ( ibin < list->nidx && !list->idx[ibin] ) ibin++;
+        cur->next = ibin < list->nidx ? list->idx[ibin] - 1 : list->nreg;
+    }
+}
+
+static int _reglist_cursor_overlap(regidx_t *regidx, reglist_t *list, uint32_t beg, uint32_t end, _itr_t *itr)
+{
+    int i, j;
+    _cursor_t *cur = NULL;
+    for (i=0; i<itr->ncur; i++)
+        if ( itr->cur[i].ridx==regidx ) { cur = &itr->cur[i]; break; }
+    if ( !cur )
+    {
+        itr->ncur++;
+        hts_expand0(_cursor_t, itr->ncur, itr->mcur, itr->cur);
+        cur = &itr->cur[itr->ncur-1];
+        cur->ridx = regidx;
+    }
+
+    if ( list->nreg > 1 && !list->idx && !list->max_end )
+        _reglist_build_index(regidx,list);
+
+    if ( cur->list!=list || beg < cur->beg )
+        _cursor_seek(cur, list, beg, itr);      // new sequence or going back
+    else
+    {
+        // evict the regions which ended
+        for (i=j=0; i<cur->nwin; i++)
+            if ( list->reg[cur->win[i]].end >= beg ) cur->win[j++] = cur->win[i];
+        cur->nwin = j;
+    }
+    cur->beg = beg;
+
+    for (; cur->next < list->nreg && list->reg[cur->next].beg <= end; cur->next++)
+    {
+        if ( list->reg[cur->next].end < beg ) continue;
+        cur->nwin++;
+        hts_expand(uint32_t, cur->nwin, cur->mwin, cur->win);
+        cur->win[cur->nwin-1] = cur->next;
+    }
+
+    // a previous query could have ended further
+    hts_expand(uint32_t, cur->nwin, itr->mhit, itr->hit);
+    itr->nhit = 0;
+    for (i=0; i<cur->nwin; i++)
+        if ( list->reg[cur->win[i]].beg <= end ) itr->hit[itr->nhit++] = cur->win[i];
+
+    return itr->nhit;
+}
+
+int regidx_finalize(regidx_t *idx)
+{
+    int i;
+    for (i=0; i<idx->nseq; i++)
+    {
+        reglist_t *list = &idx->seq[i];
+        if ( list->nreg > 1 && !list->idx && !list->max_end ) _reglist_build_index(idx,list);
+    }
+    idx->frozen = 1;
+    return 0;
+}
+
 int regidx_overlap(regidx_t *regidx, const char *chr, uint32_t beg, uint32_t end, regitr_t *regitr)
 {
     if ( regitr ) regitr->seq = NULL;
@@ -339,7 +679,16 @@ int regidx_overlap(regidx_t *regidx, const char *chr, uint32_t beg, uint32_t end
     reglist_t *list = &regidx->seq[iseq];
     if ( !list->nreg ) return 0;
 
-    if ( list->nreg==1 )
+    _itr_t *itr = regitr ? (_itr_t*)regitr->itr : NULL;
+    if ( itr ) itr->nhit = 0;
+
+    if ( itr && itr->sorted )
+    {
+        if ( !_reglist_cursor_overlap(regidx, list, beg, end, itr) ) return 0;
+        itr->ihit = 0;
+        ireg = itr->hit[0];
+    }
+    else if ( list->nreg==1 )
     {
         if ( beg > list->reg[0].end ) return 0;
         if ( end < list->reg[0].beg ) return 0;
@@ -347,37 +696,46 @@ int regidx_overlap(regidx_t *regidx, const char *chr, uint32_t beg, uint32_t end
     }
     else
     {
-        if ( !list->idx )
+        if ( !list->idx && !list->max_end )
             _reglist_build_index(regidx,list);
 
-        int ibeg = iBIN(beg);
-        if ( ibeg >= list->nidx ) return 0;     // beg is too big
-
-        // find a matching region
-        uint32_t i = list->idx[ibeg];
-        if ( !i )
+        if ( list->max_end )
         {
-            int iend = iBIN(end);
-            if ( iend > list->nidx ) iend = list->nidx;
-            for (i=ibeg; i<iend; i++)
-                if ( list->idx[i] ) break;
-            if ( i==iend ) return 0;
-            i = list->idx[i];
+            if ( !_reglist_tree_overlap(list, beg, end, itr) ) return 0;
+            if ( !itr ) return 1;
+            itr->ihit = 0;
+            ireg = itr->hit[0];
         }
-
-        for (ireg=i-1; ireg<list->nreg; ireg++)
+        else
         {
-            if ( list->reg[ireg].beg > end ) return 0;   // no match, past the query region
-            if ( list->reg[ireg].end >= beg && list->reg[ireg].beg <= end ) break; // found
-        }
+            int ibeg = iBIN(beg);
+            if ( ibeg >= list->nidx ) return 0;     // beg is too big
 
-        if ( ireg >= list->nreg ) return 0;   // no match
+            // find a matching region
+            uint32_t i = list->idx[ibeg];
+            if ( !i )
+            {
+                int iend = iBIN(end);
+                if ( iend >= list->nidx ) iend = list->nidx - 1;
+                for (i=ibeg; i<=iend; i++)
+                    if ( list->idx[i] ) break;
+                if ( i > iend ) return 0;
+                i = list->idx[i];
+            }
+
+            for (ireg=i-1; ireg<list->nreg; ireg++)
+            {
+                if ( list->reg[ireg].beg > end ) return 0;   // no match, past the query region
+                if ( list->reg[ireg].end >= beg && list->reg[ireg].beg <= end ) break; // found
+            }
+
+            if ( ireg >= list->nreg ) return 0;   // no match
+        }
     }
 
     if ( !regitr ) return 1;    // match, but no more info to save
 
     // may need to iterate over the matching regions later
-    _itr_t *itr = (_itr_t*)regitr->itr;
     itr->ridx = regidx;
     itr->list = list;
     itr->beg  = beg;
@@ -518,12 +876,30 @@ regitr_t *regitr_init(regidx_t *regidx)
 void regitr_reset(regidx_t *regidx, regitr_t *regitr)
 {
     _itr_t *itr = (_itr_t*) regitr->itr;
+    _itr_t tmp = *itr;
     memset(itr,0,sizeof(_itr_t));
     itr->ridx = regidx;
+    itr->hit  = tmp.hit;
+    itr->mhit = tmp.mhit;
+    itr->sorted = tmp.sorted;
+    itr->cur  = tmp.cur;
+    itr->ncur = tmp.ncur;
+    itr->mcur = tmp.mcur;
+}
+
+void regitr_set_sorted(regitr_t *regitr, int sorted)
+{
+    _itr_t *itr = (_itr_t*) regitr->itr;
+    itr->sorted = sorted;
 }
 
 void regitr_destroy(regitr_t *regitr)
 {
+    _itr_t *itr = (_itr_t*) regitr->itr;
+    int i;
+    for (i=0; i<itr->mcur; i++) free(itr->cur[i].win);
+    free(itr->cur);
+    free(itr->hit);
     free(regitr->itr);
     free(regitr);
 }
@@ -544,13 +920,22 @@ int regitr_overlap(regitr_t *regitr)
     reglist_t *list = itr->list;
 
     int i;
-    for (i=itr->ireg; i<list->nreg; i++)
+    if ( itr->nhit )
     {
-        if ( list->reg[i].beg > itr->end ) return 0;   // no match, past the query region
-        if ( list->reg[i].end >= itr->beg && list->reg[i].beg <= itr->end ) break; // found
+        // the overlaps were collected by the tree search
+        if ( ++itr->ihit >= itr->nhit ) return 0;
+        i = itr->hit[itr->ihit];
     }
+    else
+    {
+        for (i=itr->ireg; i<list->nreg; i++)
+        {
+            if ( list->reg[i].beg > itr->end ) return 0;   // no match, past the query region
+            if ( list->reg[i].end >= itr->beg && list->reg[i].beg <= itr->end ) break; // found
+        }
 
-    if ( i >= list->nreg ) return 0;   // no match
+        if ( i >= list->nreg ) return 0;   // no match
+    }
 
     itr->ireg = i + 1;
     regitr->seq = list->seq;
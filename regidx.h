@@ -122,11 +122,37 @@ int regidx_parse_reg(const char*,char**,char**,uint32_t*,uint32_t*,void*,void*);
  */
 regidx_t *regidx_init(const char *fname, regidx_parse_f parsef, regidx_free_f freef, size_t payload_size, void *usr);
 
+/*
+ *  regidx_save() - write the sorted regions and their payloads to a file
+ *  regidx_load_mmap() - memory-map a file written by regidx_save()
+ *
+ *  Loading the binary file does not parse or sort anything and the mapped
+ *  regions are read-only and shared between processes. Only payloads without
+ *  pointers can be saved. The file is in the native byte order. regidx_init()
+ *  recognises these files and loads them this way.
+ *
+ *  regidx_save() returns 0 on success or -1 on error; regidx_load_mmap()
+ *  returns NULL on error, including a payload_size different from the saved.
+ */
+int regidx_save(regidx_t *idx, const char *fname);
+regidx_t *regidx_load_mmap(const char *fname, size_t payload_size);
+
 /*
  *  regidx_destroy() - free memory allocated by regidx_init
  */
 void regidx_destroy(regidx_t *idx);
 
+/*
+ *  regidx_finalize() - sort the regions and build the index of all sequences,
+ *                  which otherwise happens lazily on the first query of each.
+ *                  After this the index does not change: further insertions
+ *                  fail and regidx_overlap() can be called from multiple
+ *                  threads, each with its own iterator (or none).
+ *
+ *  Returns 0 on success.
+ */
+int regidx_finalize(regidx_t *idx);
+
 /*
  *  regidx_overlap() - check overlap of the location chr:from-to with regions
  *  @param beg,end:     0-based start, end coordinate (inclusive)
@@ -148,6 +174,20 @@ int regidx_insert(regidx_t *idx, char *line);
 int regidx_insert_list(regidx_t *idx, char *line, char delim);
 int regidx_push(regidx_t *idx, char *chr_beg, char *chr_end, uint32_t beg, uint32_t end, void *payload);
 
+/*
+ *  regidx_set_index_type() - select how the regions are indexed for regidx_overlap
+ *  @type:  REGIDX_INDEX_BINS .. fixed-size bins, fast with short evenly spread regions
+ *          REGIDX_INDEX_TREE .. implicit interval tree, does not slow down with long regions
+ *          REGIDX_INDEX_AUTO .. the tree when long regions are present, bins otherwise (default)
+ *
+ *  Must be called before the first regidx_overlap() call. The overlapping
+ *  regions are returned in the same order regardless of the index type.
+ */
+#define REGIDX_INDEX_AUTO 0
+#define REGIDX_INDEX_BINS 1
+#define REGIDX_INDEX_TREE 2
+void regidx_set_index_type(regidx_t *idx, int type);
+
 /*
  *  regidx_seq_names() - return list of all sequence names
  */
@@ -172,6 +212,17 @@ regitr_t *regitr_init(regidx_t *idx);
 void regitr_destroy(regitr_t *itr);
 void regitr_reset(regidx_t *idx, regitr_t *itr);
 
+/*
+ *  regitr_set_sorted() - hint that regidx_overlap queries with this iterator
+ *                  come sorted by the start coordinate. The iterator then keeps
+ *                  a cursor for each index which moves along with the queries
+ *                  and remembers the regions which may still overlap, so that a
+ *                  query costs only the regions entered and left since the
+ *                  previous one. A query which goes back or to another sequence
+ *                  restarts the cursor.
+ */
+void regitr_set_sorted(regitr_t *itr, int sorted);
+
 /*
  *  regitr_overlap() - next overlapping region
  *  Returns 0 when done or 1 when itr is set to next region
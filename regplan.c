@@ -0,0 +1,190 @@
+/*  regplan.c -- coalescing of large region lists for the synced reader.
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <htslib/hts.h>
+#include <htslib/vcf.h>
+#include <htslib/tbx.h>
+#include <htslib/kstring.h>
+#include <htslib/synced_bcf_reader.h>
+#include "bcftools.h"
+#include "regidx.h"
+#include "regplan.h"
+
+// Regions whose compressed block ranges are at most this many bytes apart
+// are merged, about the size of one BGZF block
+#define REGPLAN_BLOCK_GAP 65536
+
+struct _regplan_t
+{
+    regidx_t *idx;      // the original regions
+};
+
+static regidx_t *read_list(const char *list, int is_file)
+{
+    regidx_t *idx;
+    if ( is_file ) idx = regidx_init(list,NULL,NULL,0,NULL);
+    else
+    {
+        idx = regidx_init(NULL,regidx_parse_reg,NULL,0,NULL);
+        if ( idx && regidx_insert_list(idx,(char*)list,',')!=0 ) { regidx_destroy(idx); idx = NULL; }
+    }
+    return idx;
+}
+
+typedef struct
+{
+    int tid, iseq;
+}
+seq_tid_t;
+
+static int cmp_seq_tid(const void *aptr, const void *bptr)
+{
+    const seq_tid_t *a = (const seq_tid_t*) aptr, *b = (const seq_tid_t*) bptr;
+    if ( a->tid < b->tid ) return -1;
+    if ( a->tid > b->tid ) return 1;
+    return 0;
+}
+
+// Merge the regions of idx by the compressed blocks they span, the result
+// is a comma-separated list of regions. The sequences are listed in the order
+// of the file, the synced reader returns the records in the order of the
+// regions. Returns -1 if the file has no index.
+static int coalesce(const char *fname, regidx_t *idx, kstring_t *str)
+{
+    htsFile *fp = hts_open(fname, "r");
+    if ( !fp ) return -1;
+    bcf_hdr_t *hdr = bcf_hdr_read(fp);
+    int is_vcf = hts_get_format(fp)->format==vcf;
+    tbx_t *tbx = hdr && is_vcf ? tbx_index_load(fname) : NULL;
+    hts_idx_t *bidx = hdr && !is_vcf ? bcf_index_load(fname) : NULL;
+    if ( !tbx && !bidx )
+    {
+        if ( hdr ) bcf_hdr_destroy(hdr);
+        hts_close(fp);
+        return -1;
+    }
+
+    int i, j, nseq, ntid = 0;
+    char **seq = regidx_seq_names(idx, &nseq);
+    seq_tid_t *tids = (seq_tid_t*) malloc(sizeof(seq_tid_t)*(nseq ? nseq : 1));
+    for (i=0; i<nseq; i++)
+    {
+        int tid = tbx ? tbx_name2id(tbx, seq[i]) : bcf_hdr_name2id(hdr, seq[i]);
+        if ( tid<0 ) continue;
+        tids[ntid].tid  = tid;
+        tids[ntid].iseq = i;
+        ntid++;
+    }
+    qsort(tids, ntid, sizeof(*tids), cmp_seq_tid);
+
+    regitr_t *itr = regitr_init(idx);
+    for (j=0; j<ntid; j++)
+    {
+        int tid = tids[j].tid;
+        i = tids[j].iseq;
+
+        // the regions come sorted by the start
+        int beg = -1, end = 0;
+        uint64_t off_end = 0;
+        regidx_overlap(idx, seq[i], 0, REGIDX_MAX, itr);
+        while ( regitr_overlap(itr) )
+        {
+            hts_itr_t *hitr = tbx ? tbx_itr_queryi(tbx, tid, itr->beg, itr->end+1) : bcf_itr_queryi(bidx, tid, itr->beg, itr->end+1);
+            if ( !hitr || !hitr->n_off ) { hts_itr_destroy(hitr); continue; }  // no records here
+            uint64_t ubeg = hitr->off[0].u>>16, uend = hitr->off[hitr->n_off-1].v>>16;
+            hts_itr_destroy(hitr);
+
+            if ( beg>=0 && ubeg <= off_end + REGPLAN_BLOCK_GAP )
+            {
+                if ( end < itr->end ) end = itr->end;
+                if ( off_end < uend ) off_end = uend;
+                continue;
+            }
+            if ( beg>=0 ) ksprintf(str, "%s%s:%d-%d", str->l ? "," : "", seq[i], beg+1, end+1);
+            beg = itr->beg;
+            end = itr->end;
+            off_end = uend;
+        }
+        if ( beg>=0 ) ksprintf(str, "%s%s:%d-%d", str->l ? "," : "", seq[i], beg+1, end+1);
+    }
+    regitr_destroy(itr);
+    free(tids);
+    if ( tbx ) tbx_destroy(tbx);
+    if ( bidx ) hts_idx_destroy(bidx);
+    bcf_hdr_destroy(hdr);
+    hts_close(fp);
+    return 0;
+}
+
+regplan_t *regplan_init(bcf_srs_t *files, const char *fname, const char *regions, int regions_is_file, const char *targets, int targets_is_file)
+{
+    regplan_t *plan = NULL;
+    kstring_t str = {0,0,0};
+    if ( regions )
+    {
+        regidx_t *idx = fname && strcmp("-",fname) ? read_list(regions, regions_is_file) : NULL;
+        if ( idx && regidx_nregs(idx) >= REGPLAN_MIN_REGIONS && coalesce(fname, idx, &str)==0 && str.l )
+        {
+            plan = (regplan_t*) calloc(1, sizeof(regplan_t));
+            plan->idx = idx;
+            if ( bcf_sr_set_regions(files, str.s, 0)<0 ) error("Failed to read the regions: %s\n", regions);
+        }
+        else
+        {
+            if ( idx ) regidx_destroy(idx);
+            if ( bcf_sr_set_regions(files, regions, regions_is_file)<0 ) error("Failed to read the regions: %s\n", regions);
+        }
+    }
+    if ( targets )
+    {
+        // the targets still select the records, the coalesced regions only let the reader skip
+        if ( !regions && targets[0]!='^' && fname && strcmp("-",fname) )
+        {
+            regidx_t *idx = read_list(targets, targets_is_file);
+            str.l = 0;
+            if ( idx && regidx_nregs(idx) >= REGPLAN_MIN_REGIONS && coalesce(fname, idx, &str)==0 && str.l )
+            {
+                if ( bcf_sr_set_regions(files, str.s, 0)<0 ) error("Failed to read the targets: %s\n", targets);
+            }
+            if ( idx ) regidx_destroy(idx);
+        }
+        if ( bcf_sr_set_targets(files, targets, targets_is_file, 0)<0 ) error("Failed to read the targets: %s\n", targets);
+    }
+    free(str.s);
+    return plan;
+}
+
+int regplan_test(regplan_t *plan, bcf_hdr_t *hdr, bcf1_t *rec)
+{
+    int end = rec->rlen > 0 ? rec->pos + rec->rlen - 1 : rec->pos;
+    return regidx_overlap(plan->idx, bcf_seqname(hdr,rec), rec->pos, end, NULL);
+}
+
+void regplan_destroy(regplan_t *plan)
+{
+    if ( !plan ) return;
+    regidx_destroy(plan->idx);
+    free(plan);
+}
@@ -0,0 +1,75 @@
+/*  regplan.h -- coalescing of large region lists for the synced reader.
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.  */
+
+/*
+    Reading many small regions, such as exome capture or fingerprinting sites,
+    one by one makes the synced reader seek and inflate the same BGZF blocks
+    again for each of the regions which share them. With a list of at least
+    REGPLAN_MIN_REGIONS regions, regplan_init() maps the regions through the
+    index of the file to the compressed blocks they span and merges the
+    regions whose blocks are the same or adjacent, so that the reader seeks
+    only between distant groups and streams through dense ones. The merged
+    regions are set in the synced reader and regplan_test() drops the records
+    between the original regions. Targets (-t/-T) on an indexed file are
+    coalesced the same way and set also as regions, so that the reader jumps
+    over the parts of the file without targets instead of streaming through
+    the whole file.
+
+        regplan_t *plan = regplan_init(files, fname, regions, regions_is_file, targets, targets_is_file);
+        bcf_sr_add_reader(files, fname);
+        while ( bcf_sr_next_line(files) )
+        {
+            if ( plan && !regplan_test(plan, hdr, rec) ) continue;
+            ...
+        }
+        regplan_destroy(plan);
+*/
+
+#ifndef __REGPLAN_H__
+#define __REGPLAN_H__
+
+#include <htslib/vcf.h>
+#include <htslib/synced_bcf_reader.h>
+
+#define REGPLAN_MIN_REGIONS 100
+
+typedef struct _regplan_t regplan_t;
+
+/*
+ *  regplan_init() - set the regions and targets of the synced reader, to be
+ *  called instead of bcf_sr_set_regions() and bcf_sr_set_targets() before the
+ *  file is added. Either list can be NULL.
+ *
+ *  Returns NULL if the records need no further testing: the regions were set
+ *  as given, or were not given at all. Errors are fatal.
+ */
+regplan_t *regplan_init(bcf_srs_t *files, const char *fname, const char *regions, int regions_is_file, const char *targets, int targets_is_file);
+
+/*
+ *  regplan_test() - returns 1 if the record overlaps one of the original
+ *  regions, 0 if it comes only from the coalescing
+ */
+int regplan_test(regplan_t *plan, bcf_hdr_t *hdr, bcf1_t *rec);
+
+void regplan_destroy(regplan_t *plan);
+
+#endif
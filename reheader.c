@@ -182,6 +182,24 @@ static void set_samples(char **samples, int nsamples, kstring_t *hdr)
 }
 
 BGZF *hts_get_bgzfp(htsFile *fp);
+// Stream the rest of the file as it is, without decompressing
+static void copy_raw_blocks(args_t *args, BGZF *fp, BGZF *bgzf_out)
+{
+    ssize_t nread;
+    const size_t page_size = 32768;
+    char *buf = (char*) malloc(page_size);
+    while (1)
+    {
+        nread = bgzf_raw_read(fp, buf, page_size);
+        if ( nread<=0 ) break;
+
+        int count = bgzf_raw_write(bgzf_out, buf, nread);
+        if (count != nread) error("Write failed, wrote %d instead of %d bytes.\n", count,(int)nread);
+    }
+    if ( nread<0 ) error("Error reading %s\n", args->fname);
+    free(buf);
+}
+
 static void reheader_vcf_gz(args_t *args)
 {
     BGZF *fp = hts_get_bgzfp(args->fp);
@@ -253,21 +271,9 @@ static void reheader_vcf_gz(args_t *args)
     }
     if ( bgzf_flush(bgzf_out)<0 ) error("Error: %d\n",bgzf_out->errcode);
 
-    // Stream the rest of the file without as it is, without decompressing
-    ssize_t nread;
-    const size_t page_size = 32768;
-    char *buf = (char*) malloc(page_size);
-    while (1)
-    {
-        nread = bgzf_raw_read(fp, buf, page_size);
-        if ( nread<=0 ) break;
-
-        int count = bgzf_raw_write(bgzf_out, buf, nread);
-        if (count != nread) error("Write failed, wrote %d instead of %d bytes.\n", count,(int)nread);
-    }
+    copy_raw_blocks(args, fp, bgzf_out);
     if (bgzf_close(bgzf_out) < 0) error("Error closing %s: %d\n",args->output_fname ? args->output_fname : "-",bgzf_out->errcode);
     if (hts_close(args->fp)) error("Error closing %s: %d\n",args->fname,fp->errcode);
-    free(buf);
 }
 static void reheader_vcf(args_t *args)
 {
@@ -366,6 +372,28 @@ static bcf_hdr_t *strip_header(bcf_hdr_t *src, bcf_hdr_t *dst)
     return out;
 }
 
+// Only the sample names changed, the number of samples and the BCF dictionary
+// are the same. Write the new header and copy the compressed blocks of the
+// records verbatim; only records sharing the last header block are recompressed.
+static void reheader_bcf_gz(args_t *args, bcf_hdr_t *hdr_out)
+{
+    BGZF *fp = hts_get_bgzfp(args->fp);
+    htsFile *fp_out = hts_open(args->output_fname ? args->output_fname : "-","wb");
+    if ( !fp_out ) error("%s: %s\n", args->output_fname ? args->output_fname : "-", strerror(errno));
+    if ( bcf_hdr_write(fp_out, hdr_out)!=0 ) error("Failed to write the header\n");
+
+    BGZF *bgzf_out = hts_get_bgzfp(fp_out);
+    if ( fp->block_offset < fp->block_length )
+    {
+        if ( bgzf_write(bgzf_out, (char*)fp->uncompressed_block + fp->block_offset, fp->block_length - fp->block_offset)<0 )
+            error("Error: %d\n",bgzf_out->errcode);
+    }
+    if ( bgzf_flush(bgzf_out)<0 ) error("Error: %d\n",bgzf_out->errcode);
+
+    copy_raw_blocks(args, fp, bgzf_out);
+    if ( hts_close(fp_out) ) error("Error closing %s\n", args->output_fname ? args->output_fname : "-");
+}
+
 static void reheader_bcf(args_t *args, int is_compressed)
 {
     htsFile *fp = args->fp;
@@ -393,6 +421,16 @@ static void reheader_bcf(args_t *args, int is_compressed)
     if ( bcf_hdr_parse(hdr_out, htxt.s) < 0 ) error("An error occurred while parsing the header\n");
     if ( args->header_fname ) hdr_out = strip_header(hdr, hdr_out);
 
+    if ( args->type.compression==bgzf && !args->header_fname && bcf_hdr_nsamples(hdr)==bcf_hdr_nsamples(hdr_out) )
+    {
+        reheader_bcf_gz(args, hdr_out);
+        free(htxt.s);
+        hts_close(fp);
+        bcf_hdr_destroy(hdr_out);
+        bcf_hdr_destroy(hdr);
+        return;
+    }
+
     // write the header and the body
     htsFile *fp_out = hts_open(args->output_fname ? args->output_fname : "-",is_compressed ? "wb" : "wbu");
     if ( !fp_out ) error("%s: %s\n", args->output_fname ? args->output_fname : "-", strerror(errno));
@@ -0,0 +1,303 @@
+#!/usr/bin/env perl
+#
+#   Copyright (C) 2026 Genome Research Ltd.
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in
+# all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+# THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+# FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+# DEALINGS IN THE SOFTWARE.
+
+# Throughput benchmarks. Synthetic data are generated first, then each
+# benchmark runs one bcftools command and prints a tab-delimited line with
+# the number of input records, input bytes, the best wall time, records/s,
+# bytes/s and peak RSS. The "kernel" benchmarks are chosen so that most of
+# the time is spent in one function (filter_test, convert_line,
+# merge_format_field, realign, csq's process, calc_ld); compare them with
+# the "view.bcf" baseline which only decodes and encodes the records.
+
+use strict;
+use warnings;
+use Carp;
+use FindBin;
+use Getopt::Long;
+use File::Temp qw/ tempdir /;
+use Time::HiRes qw/ time sleep /;
+use POSIX qw/ :sys_wait_h /;
+
+my $opts = parse_params();
+generate_data($opts);
+
+print join("\t",'# name','records','bytes','seconds','records/s','bytes/s','peak_rss_kb'),"\n";
+bench($opts,name=>'view.bcf',           in=>'a.bcf', args=>[qw(view -Ou)]);
+bench($opts,name=>'view.vcf',           in=>'a.bcf', args=>[qw(view -Ov)]);
+bench($opts,name=>'view.vcf.gz',        in=>'a.bcf', args=>[qw(view -Oz)]);
+bench($opts,name=>'filter_test',        in=>'a.bcf', args=>['view','-Ou','-i','QUAL>30 && INFO/DP>50 && FMT/DP>10 && GT="alt"']);
+bench($opts,name=>'convert_line',       in=>'a.bcf', args=>['query','-f','%CHROM\t%POS\t%REF\t%ALT\t%INFO/DP[\t%GT:%DP]\n']);
+bench($opts,name=>'merge_format_field', in=>['a.bcf','b.bcf'], args=>[qw(merge -Ou)]);
+bench($opts,name=>'realign',            in=>'a.bcf', args=>['norm','-Ou','-f',"$$opts{tmp}/ref.fa"]);
+bench($opts,name=>'csq.process',        in=>'a.bcf', args=>['csq','-Ou','-p','a','-f',"$$opts{tmp}/ref.fa",'-g',"$$opts{tmp}/ref.gff3"]);
+bench($opts,name=>'calc_ld',            in=>'a.bcf', args=>[qw(+prune -Ou -l 0.6 -w 1000)], plugin=>1);
+bench($opts,name=>'annotate',           in=>'a.bcf', args=>['annotate','-Ou','-x','INFO,^FMT/GT']);
+bench($opts,name=>'stats',              in=>'a.bcf', args=>[qw(stats -s -)]);
+bench($opts,name=>'isec',               in=>['a.bcf','b.bcf'], args=>[qw(isec -n =2)]);
+bench($opts,name=>'call',               in=>'a.bcf', args=>[qw(call -mv -Ou)]) if $$opts{fmt}>=4;
+bench($opts,name=>'concat',             in=>['a.bcf','a.bcf'], args=>[qw(concat -a -Ou)]);
+
+exit 0;
+
+#--------------------
+
+sub error
+{
+    my (@msg) = @_;
+    if ( scalar @msg ) { confess @msg; }
+    print
+        "About: bcftools throughput benchmarks\n",
+        "Usage: bench.pl [OPTIONS]\n",
+        "Options:\n",
+        "   -a, --alleles <int>             Maximum number of alleles at SNVs [3]\n",
+        "   -f, --fmt <int>                 FORMAT density: 1=GT, 2=+DP, 3=+AD, 4=+PL [4]\n",
+        "   -i, --info <int>                Number of INFO tags in addition to DP,AF,MQ [2]\n",
+        "   -n, --records <int>             Number of records [20000]\n",
+        "   -r, --repeat <int>              Run each benchmark N times and report the best [3]\n",
+        "   -s, --samples <int>             Number of samples [100]\n",
+        "   -S, --seed <int>                Random seed [1]\n",
+        "   -t, --temp-dir <path>           When given, temporary files will not be removed.\n",
+        "   -T, --threads <int>             Pass --threads to the commands which accept it [0]\n",
+        "   -h, -?, --help                  This help message.\n",
+        "\n";
+    exit -1;
+}
+sub parse_params
+{
+    my $opts = { alleles=>3, fmt=>4, info=>2, records=>20000, repeat=>3, samples=>100, seed=>1, keep_files=>0, threads=>0 };
+    my $help;
+    Getopt::Long::Configure('bundling');
+    my $ret = GetOptions (
+            'e|exec=s' => sub { my ($tool, $path) = split /=/, $_[1]; $$opts{$tool} = $path if $path },
+            'a|alleles=i' => \$$opts{alleles},
+            'f|fmt=i' => \$$opts{fmt},
+            'i|info=i' => \$$opts{info},
+            'n|records=i' => \$$opts{records},
+            'r|repeat=i' => \$$opts{repeat},
+            's|samples=i' => \$$opts{samples},
+            'S|seed=i' => \$$opts{seed},
+            't|temp-dir:s' => \$$opts{keep_files},
+            'T|threads=i' => \$$opts{threads},
+            'h|?|help' => \$help
+            );
+    if ( !$ret or $help ) { error(); }
+    if ( $$opts{alleles}<2 ) { $$opts{alleles} = 2; }
+    $$opts{tmp} = $$opts{keep_files} ? $$opts{keep_files} : tempdir(CLEANUP=>1);
+    if ( $$opts{keep_files} ) { system("mkdir -p $$opts{keep_files}"); }
+    $$opts{bin} = $FindBin::RealBin;
+    $$opts{bin} =~ s{/test/?$}{};
+    $ENV{BCFTOOLS_PLUGINS} = "$$opts{bin}/plugins";
+    return $opts;
+}
+
+# Run the command without a shell, polling /proc for the peak RSS. Returns
+# the wall time and the peak RSS in kB, or NA where /proc is not available.
+sub run
+{
+    my ($opts,@cmd) = @_;
+    my $start = time();
+    my $pid = fork();
+    if ( !defined $pid ) { error("Cannot fork: $!"); }
+    if ( !$pid )
+    {
+        open(STDOUT,'>','/dev/null') or error("/dev/null: $!");
+        exec(@cmd) or error("Cannot execute the command: @cmd: $!");
+    }
+    my $rss = 'NA';
+    while ( waitpid($pid, WNOHANG)==0 )
+    {
+        if ( open(my $fh,'<',"/proc/$pid/status") )
+        {
+            while (my $line=<$fh>)
+            {
+                if ( $line=~/^VmHWM:\s+(\d+)/ ) { $rss = $1 if $rss eq 'NA' or $1>$rss; last; }
+            }
+            close($fh);
+        }
+        sleep(0.005);
+    }
+    my $ret = $?;
+    my $elapsed = time() - $start;
+    if ( $ret ) { error("The command failed [$ret]: @cmd\n"); }
+    return ($elapsed,$rss);
+}
+
+sub bench
+{
+    my ($opts,%args) = @_;
+    if ( $args{plugin} && !-e "$$opts{bin}/plugins/prune.so" ) { return; }
+    my @in = ref($args{in}) eq 'ARRAY' ? @{$args{in}} : ($args{in});
+    my $nrec  = 0;
+    my $bytes = 0;
+    for my $file (@in)
+    {
+        $nrec  += $$opts{nrec}{$file};
+        $bytes += -s "$$opts{tmp}/$file";
+    }
+    my @cmd = ("$$opts{bin}/bcftools", @{$args{args}});
+    if ( $$opts{threads} && $cmd[1]=~/^(view|query|merge|norm|annotate|concat|isec|call|csq)$/ )
+    {
+        push @cmd, '--threads', $$opts{threads};
+    }
+    push @cmd, map { "$$opts{tmp}/$_" } @in;
+
+    my ($best,$rss);
+    for (my $i=0; $i<$$opts{repeat}; $i++)
+    {
+        my ($elapsed,$peak) = run($opts,@cmd);
+        if ( !defined $best or $elapsed<$best ) { $best = $elapsed; }
+        if ( !defined $rss or ($peak ne 'NA' && ($rss eq 'NA' or $peak>$rss)) ) { $rss = $peak; }
+    }
+    printf "%s\t%d\t%d\t%.3f\t%.0f\t%.0f\t%s\n", $args{name},$nrec,$bytes,$best,$nrec/$best,$bytes/$best,$rss;
+}
+
+sub cmd
+{
+    my ($cmd) = @_;
+    my $ret = system('/bin/bash','-o','pipefail','-c',$cmd);
+    if ( $ret ) { error("The command failed: $cmd\n"); }
+}
+
+# Random reference with short tandem repeats so that some of the indels can
+# be realigned, genes with five coding exons every 10kb, and two VCFs with
+# the same sites and different samples.
+sub generate_data
+{
+    my ($opts) = @_;
+    srand($$opts{seed});
+
+    my $spacing = 50;
+    my $len = $$opts{records}*$spacing + 1000;
+    my @acgt = qw(A C G T);
+    my $ref = '';
+    while ( length($ref) < $len )
+    {
+        if ( rand()<0.02 ) { $ref .= join('',@acgt[int(rand(4)),int(rand(4))]) x (2+int(rand(5))); }
+        else { $ref .= $acgt[int(rand(4))]; }
+    }
+    $ref = substr($ref,0,$len);
+    open(my $fh,'>',"$$opts{tmp}/ref.fa") or error("$$opts{tmp}/ref.fa: $!");
+    print $fh ">1\n";
+    for (my $i=0; $i<$len; $i+=60) { print $fh substr($ref,$i,60),"\n"; }
+    close($fh);
+
+    open($fh,'>',"$$opts{tmp}/ref.gff3") or error("$$opts{tmp}/ref.gff3: $!");
+    print $fh "##gff-version 3\n";
+    for (my $beg=1000, my $i=1; $beg+5000<$len; $beg+=10000, $i++)
+    {
+        my $end = $beg + 4999;
+        my $id  = sprintf "%011d", $i;
+        print $fh "1\t.\tgene\t$beg\t$end\t.\t+\t.\tID=gene:ENSG$id;Name=G$i;biotype=protein_coding\n";
+        print $fh "1\t.\ttranscript\t$beg\t$end\t.\t+\t.\tID=transcript:ENST$id;Parent=gene:ENSG$id;biotype=protein_coding\n";
+        for (my $j=0; $j<5; $j++)
+        {
+            my $ebeg = $beg + $j*1000;
+            my $eend = $ebeg + ($j==4 ? 999 : 299);
+            print $fh "1\t.\texon\t$ebeg\t$eend\t.\t+\t.\tParent=transcript:ENST$id\n";
+            print $fh "1\t.\tCDS\t$ebeg\t$eend\t.\t+\t0\tParent=transcript:ENST$id\n";
+        }
+    }
+    close($fh);
+
+    my @sites = ();
+    for (my $i=0; $i<$$opts{records}; $i++)
+    {
+        my $pos  = 1 + $i*$spacing + int(rand($spacing-10));
+        my $rbase = substr($ref,$pos-1,1);
+        my ($rstr,@alts);
+        if ( rand()<0.1 )
+        {
+            my $n = 1 + int(rand(4));
+            if ( rand()<0.5 ) { $rstr = substr($ref,$pos-1,$n+1); @alts = ($rbase); }
+            else { $rstr = $rbase; @alts = ($rbase . join('',map { $acgt[int(rand(4))] } 1..$n)); }
+        }
+        else
+        {
+            $rstr = $rbase;
+            my @pool = grep { $_ ne $rbase } @acgt;
+            my $nalt = 1 + int(rand($$opts{alleles}-1));
+            $nalt = 3 if $nalt > 3;
+            @alts = @pool[0..$nalt-1];
+        }
+        push @sites, [$pos,$rstr,join(',',@alts),scalar @alts + 1, 0.05 + rand(0.45)];
+    }
+    write_vcf($opts,'a',\@sites);
+    write_vcf($opts,'b',\@sites);
+}
+
+sub write_vcf
+{
+    my ($opts,$name,$sites) = @_;
+    my $nfmt = $$opts{fmt};
+    open(my $fh,'>',"$$opts{tmp}/$name.vcf") or error("$$opts{tmp}/$name.vcf: $!");
+    print $fh "##fileformat=VCFv4.2\n";
+    print $fh "##contig=<ID=1,length=",$$opts{records}*50+1000,">\n";
+    print $fh "##INFO=<ID=DP,Number=1,Type=Integer,Description=\"Depth\">\n";
+    print $fh "##INFO=<ID=AF,Number=A,Type=Float,Description=\"Allele frequency\">\n";
+    print $fh "##INFO=<ID=MQ,Number=1,Type=Integer,Description=\"Mapping quality\">\n";
+    for (my $i=0; $i<$$opts{info}; $i++) { print $fh "##INFO=<ID=X$i,Number=1,Type=Float,Description=\"Extra tag\">\n"; }
+    print $fh "##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\">\n";
+    print $fh "##FORMAT=<ID=DP,Number=1,Type=Integer,Description=\"Depth\">\n" if $nfmt>=2;
+    print $fh "##FORMAT=<ID=AD,Number=R,Type=Integer,Description=\"Allelic depths\">\n" if $nfmt>=3;
+    print $fh "##FORMAT=<ID=PL,Number=G,Type=Integer,Description=\"Phred-scaled genotype likelihoods\">\n" if $nfmt>=4;
+    print $fh join("\t",'#CHROM','POS','ID','REF','ALT','QUAL','FILTER','INFO','FORMAT', map { "$name$_" } 1..$$opts{samples}),"\n";
+    my $fmt = join(':',('GT','DP','AD','PL')[0..($nfmt>4?3:$nfmt-1)]);
+    for my $site (@$sites)
+    {
+        my ($pos,$ref,$alt,$nals,$af) = @$site;
+        my $info = sprintf "DP=%d;AF=%s;MQ=%d", 10*$$opts{samples}, join(',',map { sprintf "%.3f",$af/($nals-1) } 2..$nals), 20+int(rand(40));
+        for (my $i=0; $i<$$opts{info}; $i++) { $info .= sprintf ";X$i=%.2f", rand(); }
+        my @line = (1,$pos,'.',$ref,$alt,int(rand(100)),'PASS',$info,$fmt);
+        for (my $j=0; $j<$$opts{samples}; $j++)
+        {
+            my $a = rand()<$af ? 1+int(rand($nals-1)) : 0;
+            my $b = rand()<$af ? 1+int(rand($nals-1)) : 0;
+            ($a,$b) = ($b,$a) if $a>$b;
+            my $smpl = "$a/$b";
+            my $dp = 5 + int(rand(30));
+            $smpl .= ":$dp" if $nfmt>=2;
+            if ( $nfmt>=3 )
+            {
+                my @ad = (0) x $nals;
+                $ad[$a] += int($dp/2);
+                $ad[$b] += $dp - int($dp/2);
+                $smpl .= ':' . join(',',@ad);
+            }
+            if ( $nfmt>=4 )
+            {
+                my @pl = ();
+                for (my $k=0; $k<$nals; $k++)
+                {
+                    for (my $l=0; $l<=$k; $l++) { push @pl, ($l==$a && $k==$b) ? 0 : 10+int(rand(90)); }
+                }
+                $smpl .= ':' . join(',',@pl);
+            }
+            push @line, $smpl;
+        }
+        print $fh join("\t",@line),"\n";
+    }
+    close($fh);
+    cmd("$$opts{bin}/bcftools view -Ob -o $$opts{tmp}/$name.bcf $$opts{tmp}/$name.vcf");
+    cmd("$$opts{bin}/bcftools index -f $$opts{tmp}/$name.bcf");
+    unlink("$$opts{tmp}/$name.vcf");
+    $$opts{nrec}{"$name.bcf"} = scalar @$sites;
+}
@@ -1,4 +1,4 @@
-/*  test/test-rbuf.c -- rbuf_t test harness.
+/*  test/test-rbuf.c -- rbuf_t and arbuf_t test harness.
 
     Copyright (C) 2014 Genome Research Ltd.
 
@@ -24,7 +24,13 @@ DEALINGS IN THE SOFTWARE.  */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/time.h>
 #include "rbuf.h"
+#include "arbuf.h"
 
 void debug_print(rbuf_t *rbuf, int *dat)
 {
@@ -35,8 +41,115 @@ void debug_print(rbuf_t *rbuf, int *dat)
     printf("\n");
 }
 
+// The producers push (iprod<<32 | i) for i=1..n, with the values packed in pointers.
+// The consumers check that the values of each producer come in order and sum
+// up what they saw.
+typedef struct
+{
+    arbuf_t *buf;
+    int iprod, nprod, batch;
+    uint64_t n, sum, *last;
+}
+worker_t;
+
+static void *produce(void *arg)
+{
+    worker_t *w = (worker_t*) arg;
+    uint64_t i;
+    void *dat[64];
+    int ndat = 0;
+    for (i=1; i<=w->n; i++)
+    {
+        void *ptr = (void*)(uintptr_t)((uint64_t)w->iprod<<32 | i);
+        if ( w->batch<=1 ) { arbuf_push(w->buf, ptr); continue; }
+        dat[ndat++] = ptr;
+        if ( ndat < w->batch && i < w->n ) continue;
+        int k = 0;
+        while ( k < ndat ) k += arbuf_push_n(w->buf, dat+k, ndat-k);
+        ndat = 0;
+    }
+    return NULL;
+}
+
+static void *consume(void *arg)
+{
+    worker_t *w = (worker_t*) arg;
+    void *dat[64];
+    int i, n, batch = w->batch > 1 ? w->batch : 1;
+    while ( (n = arbuf_pop_n(w->buf, dat, batch)) )
+    {
+        for (i=0; i<n; i++)
+        {
+            uint64_t val = (uintptr_t)dat[i];
+            int iprod = val>>32;
+            uint64_t k = val & 0xffffffff;
+            if ( iprod<0 || iprod>=w->nprod ) { fprintf(stderr,"arbuf: bad producer %d\n", iprod); exit(1); }
+            if ( k <= w->last[iprod] ) { fprintf(stderr,"arbuf: out of order %d: %"PRIu64" after %"PRIu64"\n", iprod,k,w->last[iprod]); exit(1); }
+            w->last[iprod] = k;
+            w->sum += k;
+        }
+    }
+    return NULL;
+}
+
+static double test_arbuf(int nprod, int ncons, int size, int batch, uint64_t n)
+{
+    struct timeval t0, t1;
+    arbuf_t *buf = arbuf_init(size);
+    worker_t *prod = (worker_t*) calloc(nprod, sizeof(worker_t));
+    worker_t *cons = (worker_t*) calloc(ncons, sizeof(worker_t));
+    pthread_t *tprod = (pthread_t*) malloc(sizeof(pthread_t)*nprod);
+    pthread_t *tcons = (pthread_t*) malloc(sizeof(pthread_t)*ncons);
+    int i;
+    gettimeofday(&t0, NULL);
+    for (i=0; i<ncons; i++)
+    {
+        cons[i].buf = buf; cons[i].nprod = nprod; cons[i].batch = batch;
+        cons[i].last = (uint64_t*) calloc(nprod, sizeof(uint64_t));
+        pthread_create(&tcons[i], NULL, consume, &cons[i]);
+    }
+    for (i=0; i<nprod; i++)
+    {
+        prod[i].buf = buf; prod[i].iprod = i; prod[i].n = n; prod[i].batch = batch;
+        pthread_create(&tprod[i], NULL, produce, &prod[i]);
+    }
+    for (i=0; i<nprod; i++) pthread_join(tprod[i], NULL);
+    arbuf_close(buf);
+    uint64_t sum = 0;
+    for (i=0; i<ncons; i++)
+    {
+        pthread_join(tcons[i], NULL);
+        sum += cons[i].sum;
+        free(cons[i].last);
+    }
+    gettimeofday(&t1, NULL);
+    if ( sum != nprod*(n*(n+1)/2) )
+    {
+        fprintf(stderr,"arbuf: expected sum %"PRIu64", found %"PRIu64"\n", nprod*(n*(n+1)/2), sum);
+        exit(1);
+    }
+    arbuf_destroy(buf);
+    free(prod); free(cons); free(tprod); free(tcons);
+    return (t1.tv_sec - t0.tv_sec) + (t1.tv_usec - t0.tv_usec)*1e-6;
+}
+
 int main(int argc, char **argv)
 {
+    if ( argc>1 && !strcmp("-b",argv[1]) )
+    {
+        // throughput benchmark: test-rbuf -b [nelements]
+        uint64_t n = argc>2 ? strtoull(argv[2],NULL,10) : 10000000;
+        int conf[][4] = { {1,1,1024,1}, {1,1,1024,32}, {2,2,1024,1}, {4,4,1024,1}, {4,4,1024,32} };
+        int i;
+        for (i=0; i<sizeof(conf)/sizeof(*conf); i++)
+        {
+            double t = test_arbuf(conf[i][0],conf[i][1],conf[i][2],conf[i][3],n);
+            printf("arbuf  producers=%d consumers=%d size=%d batch=%d: %.1f M elements/s\n",
+                conf[i][0],conf[i][1],conf[i][2],conf[i][3], conf[i][0]*n/t*1e-6);
+        }
+        return 0;
+    }
+
     int i, j, *dat = (int*)calloc(10,sizeof(int));
     rbuf_t rbuf;
     rbuf_init(&rbuf,10);
@@ -70,6 +183,12 @@ int main(int argc, char **argv)
     debug_print(&rbuf, dat);
 
     free(dat);
+
+    // small buffers with many threads to exercise the wrapping and the full/empty states
+    test_arbuf(1,1,2,1,100000);
+    test_arbuf(3,2,4,1,100000);
+    test_arbuf(4,4,16,8,100000);
+    printf("arbuf: ok\n");
     return 0;
 }
 
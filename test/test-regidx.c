@@ -33,6 +33,8 @@
 #include <getopt.h>
 #include <htslib/kstring.h>
 #include <time.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "regidx.h"
 
 static int verbose = 0;
@@ -176,7 +178,7 @@ void get_random_region(uint32_t min, uint32_t max, uint32_t *beg, uint32_t *end)
     *end = *beg + (float)e * (max-*beg) / RAND_MAX;
 }
 
-void test_random(int nregs, uint32_t min, uint32_t max)
+void test_random(int nregs, uint32_t min, uint32_t max, int index_type)
 {
     min--;
     max--;
@@ -184,6 +186,7 @@ void test_random(int nregs, uint32_t min, uint32_t max)
     // Init index with no file name, we will insert the regions manually
     regidx_t *idx = regidx_init(NULL,custom_parse,custom_free,sizeof(char*),NULL);
     if ( !idx ) error("init failed\n");
+    regidx_set_index_type(idx,index_type);
 
     // Test region
     uint32_t beg,end;
@@ -204,6 +207,7 @@ void test_random(int nregs, uint32_t min, uint32_t max)
 
     // Test 
     regitr_t *itr = regitr_init(idx);
+    uint32_t prev_beg = 0;
     int nhit = 0, ret = regidx_overlap(idx,"1",beg,end,itr);
     if ( nexp && !ret ) error("query failed, expected %d overlap(s), found none: %d-%d\n", nexp,beg+1,end+1);
     if ( !nexp && ret ) error("query failed, expected no overlaps, found some: %d-%d\n", beg+1,end+1);
@@ -215,6 +219,9 @@ void test_random(int nregs, uint32_t min, uint32_t max)
             error("query failed, incorrect payload: %s vs %s (%d-%d)\n",str.s,regitr_payload(itr,char*),beg+1,end+1);
         if ( itr->beg > end || itr->end < beg )
             error("query failed, incorrect hit: %d-%d vs %d-%d, payload %s\n", beg+1,end+1,itr->beg+1,itr->end+1,regitr_payload(itr,char*));
+        if ( itr->beg < prev_beg )
+            error("query failed, unsorted hits: %d after %d (%d-%d)\n", itr->beg+1,prev_beg+1,beg+1,end+1);
+        prev_beg = itr->beg;
         nhit++;
     }
     if ( nexp!=nhit ) error("query failed, expected %d overlap(s), found %d: %d-%d\n",nexp,nhit,beg+1,end+1);
@@ -226,6 +233,256 @@ void test_random(int nregs, uint32_t min, uint32_t max)
     free(str.s);
 }
 
+// Sorted queries through the cursor must give the same hits as unsorted ones
+void test_sorted(int nregs, uint32_t min, uint32_t max, int index_type)
+{
+    regidx_t *idx = regidx_init(NULL,regidx_parse_tab,NULL,0,NULL);
+    if ( !idx ) error("init failed\n");
+    regidx_set_index_type(idx,index_type);
+
+    int i;
+    char *chrs[2] = {"1","2"};
+    for (i=0; i<nregs; i++)
+    {
+        uint32_t b,e;
+        get_random_region(min,max,&b,&e);
+        if ( random()%4 ) e = b + (e-b)/64;
+        char *chr = chrs[random()%2];
+        if ( regidx_push(idx,chr,chr,b,e,NULL)!=0 ) error("push failed\n");
+    }
+
+    regitr_t *itr = regitr_init(idx);
+    regitr_t *sitr = regitr_init(idx);
+    regitr_set_sorted(sitr,1);
+    uint32_t beg = min;
+    for (i=0; i<200; i++)
+    {
+        char *chr = chrs[i/100];
+        if ( i%100==0 ) beg = min;
+        else if ( random()%20==0 ) beg = min + random()%(max-min);   // going back restarts the cursor
+        else beg += random()%((max-min)/50+1);
+        uint32_t end = beg + (random()%4 ? 0 : random()%((max-min)/10+1));
+
+        int ret = regidx_overlap(idx,chr,beg,end,itr);
+        int sret = regidx_overlap(idx,chr,beg,end,sitr);
+        if ( ret!=sret ) error("sorted query failed, %d vs %d: %s:%d-%d\n", ret,sret,chr,beg+1,end+1);
+        while ( ret )
+        {
+            ret = regitr_overlap(itr);
+            sret = regitr_overlap(sitr);
+            if ( ret!=sret ) error("sorted query failed, the number of hits differs: %s:%d-%d\n", chr,beg+1,end+1);
+            if ( ret && (itr->beg!=sitr->beg || itr->end!=sitr->end) )
+                error("sorted query failed, %d-%d vs %d-%d: %s:%d-%d\n", itr->beg+1,itr->end+1,sitr->beg+1,sitr->end+1,chr,beg+1,end+1);
+        }
+    }
+
+    regitr_destroy(itr);
+    regitr_destroy(sitr);
+    regidx_destroy(idx);
+}
+
+int int_parse(const char *line, char **chr_beg, char **chr_end, uint32_t *beg, uint32_t *end, void *payload, void *usr)
+{
+    int ret = regidx_parse_tab(line,chr_beg,chr_end,beg,end,NULL,NULL);
+    if ( ret!=0 ) return ret;
+    *((uint32_t*)payload) = *beg + *end;
+    return 0;
+}
+
+// The regions written by regidx_save and mapped back must give the same hits
+void test_save(int nregs)
+{
+    regidx_t *idx = regidx_init(NULL,int_parse,NULL,sizeof(uint32_t),NULL);
+    if ( !idx ) error("init failed\n");
+
+    int i;
+    kstring_t str = {0,0,0};
+    for (i=0; i<nregs; i++)
+    {
+        uint32_t b,e;
+        get_random_region(1,100000,&b,&e);
+        str.l = 0;
+        ksprintf(&str,"%d\t%"PRIu32"\t%"PRIu32,(int)(random()%3),b+1,e+1);
+        if ( regidx_insert(idx,str.s)!=0 ) error("insert failed: %s\n", str.s);
+    }
+
+    char fname[] = "/tmp/test-regidx.XXXXXX";
+    int fd = mkstemp(fname);
+    if ( fd<0 ) error("mkstemp failed\n");
+    close(fd);
+    if ( regidx_save(idx,fname)!=0 ) error("save failed: %s\n", fname);
+    regidx_t *midx = regidx_init(fname,int_parse,NULL,sizeof(uint32_t),NULL);
+    if ( !midx ) error("load failed: %s\n", fname);
+    if ( regidx_nregs(idx)!=regidx_nregs(midx) ) error("load failed, %d vs %d regions\n", regidx_nregs(idx),regidx_nregs(midx));
+    if ( regidx_insert(midx,"1\t1\t1")==0 ) error("insert should fail with a mapped index\n");
+
+    regitr_t *itr = regitr_init(idx), *mitr = regitr_init(midx);
+    for (i=0; i<100; i++)
+    {
+        uint32_t beg,end;
+        get_random_region(1,100000,&beg,&end);
+        str.l = 0;
+        ksprintf(&str,"%d",(int)(random()%4));
+        int ret = regidx_overlap(idx,str.s,beg,end,itr);
+        if ( ret!=regidx_overlap(midx,str.s,beg,end,mitr) ) error("query failed with the mapped index: %s:%d-%d\n",str.s,beg+1,end+1);
+        while ( ret )
+        {
+            ret = regitr_overlap(itr);
+            if ( ret!=regitr_overlap(mitr) ) error("query failed, the number of hits differs: %s:%d-%d\n",str.s,beg+1,end+1);
+            if ( ret && (itr->beg!=mitr->beg || itr->end!=mitr->end || regitr_payload(mitr,uint32_t)!=mitr->beg+mitr->end) )
+                error("query failed, %d-%d vs %d-%d: %s:%d-%d\n",itr->beg+1,itr->end+1,mitr->beg+1,mitr->end+1,str.s,beg+1,end+1);
+        }
+    }
+
+    regitr_destroy(itr);
+    regitr_destroy(mitr);
+    regidx_destroy(idx);
+    regidx_destroy(midx);
+    unlink(fname);
+    free(str.s);
+}
+
+typedef struct
+{
+    regidx_t *idx;
+    uint32_t *beg, *end, nreg;      // all regions of the sequence "1" for brute-force checks
+    unsigned int seed;
+    int sorted, nquery, nerr;
+}
+stress_t;
+
+static void *stress_queries(void *arg)
+{
+    stress_t *st = (stress_t*) arg;
+    regitr_t *itr = regitr_init(st->idx);
+    if ( st->sorted ) regitr_set_sorted(itr,1);
+    uint32_t beg = 0;
+    int i, j;
+    for (i=0; i<st->nquery; i++)
+    {
+        beg = st->sorted ? beg + rand_r(&st->seed)%100 : rand_r(&st->seed)%100000;
+        uint32_t end = beg + rand_r(&st->seed)%1000;
+        int nexp = 0, nhit = 0;
+        for (j=0; j<st->nreg; j++)
+            if ( st->beg[j] <= end && st->end[j] >= beg ) nexp++;
+        if ( regidx_overlap(st->idx,"1",beg,end,itr) )
+            while ( regitr_overlap(itr) )
+            {
+                if ( itr->beg > end || itr->end < beg ) st->nerr++;
+                nhit++;
+            }
+        if ( regidx_overlap(st->idx,"1",beg,end,NULL)!=(nexp ? 1 : 0) ) st->nerr++;
+        if ( nhit!=nexp ) st->nerr++;
+    }
+    regitr_destroy(itr);
+    return NULL;
+}
+
+// Concurrent queries of a finalized index, each thread with its own iterator
+void test_threads(int nthreads, int nregs)
+{
+    regidx_t *idx = regidx_init(NULL,regidx_parse_tab,NULL,0,NULL);
+    if ( !idx ) error("init failed\n");
+
+    uint32_t *beg = (uint32_t*) malloc(sizeof(uint32_t)*nregs), *end = (uint32_t*) malloc(sizeof(uint32_t)*nregs);
+    int i, n = 0;
+    for (i=0; i<nregs; i++)
+    {
+        uint32_t b,e;
+        get_random_region(1,100000,&b,&e);
+        if ( random()%100 ) e = b + (e-b)/1000;
+        char *chr = random()%2 ? "1" : "2";
+        if ( regidx_push(idx,chr,chr,b,e,NULL)!=0 ) error("push failed\n");
+        if ( *chr=='1' ) { beg[n] = b; end[n] = e; n++; }
+    }
+    if ( regidx_finalize(idx)!=0 ) error("finalize failed\n");
+    if ( regidx_push(idx,"1","1",1,1,NULL)==0 ) error("push should fail with a finalized index\n");
+
+    pthread_t *tid = (pthread_t*) malloc(sizeof(pthread_t)*nthreads);
+    stress_t *st = (stress_t*) calloc(nthreads,sizeof(stress_t));
+    for (i=0; i<nthreads; i++)
+    {
+        st[i].idx = idx;
+        st[i].beg = beg;
+        st[i].end = end;
+        st[i].nreg = n;
+        st[i].seed = random();
+        st[i].sorted = i%2;
+        st[i].nquery = 1000;
+        if ( pthread_create(&tid[i],NULL,stress_queries,&st[i])!=0 ) error("pthread_create failed\n");
+    }
+    for (i=0; i<nthreads; i++)
+    {
+        pthread_join(tid[i],NULL);
+        if ( st[i].nerr ) error("concurrent queries failed in thread %d: %d errors\n", i,st[i].nerr);
+    }
+
+    free(tid);
+    free(st);
+    free(beg);
+    free(end);
+    regidx_destroy(idx);
+}
+
+static int cmp_uint32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    if ( x < y ) return -1;
+    return x > y ? 1 : 0;
+}
+
+// Many short regions and a few long ones: the bins are slow with these
+static regidx_t *init_benchmark_idx(int nregs, uint32_t len, int index_type)
+{
+    regidx_t *idx = regidx_init(NULL,regidx_parse_tab,NULL,0,NULL);
+    if ( !idx ) error("init failed\n");
+    regidx_set_index_type(idx,index_type);
+
+    char *chr = "1";
+    int i;
+    for (i=0; i<nregs; i++)
+    {
+        uint32_t beg = (double)random() * len / RAND_MAX;
+        uint32_t size = i%10000 ? 1 + random()%1000 : 1 + random()%10000000;
+        if ( regidx_push(idx,chr,chr,beg,beg+size-1,NULL)!=0 ) error("push failed\n");
+    }
+    return idx;
+}
+
+void test_benchmark(int nregs, int nquery)
+{
+    uint32_t len = 100000000;
+    uint32_t *pos = (uint32_t*) malloc(sizeof(uint32_t)*nquery);
+    int i, j, nhit[4] = {0,0,0,0};
+    double elapsed[4];
+    char *name[4]  = {"bins","tree","bins, sorted","tree, sorted"};
+    int types[4]   = {REGIDX_INDEX_BINS,REGIDX_INDEX_TREE,REGIDX_INDEX_BINS,REGIDX_INDEX_TREE};
+    for (i=0; i<nquery; i++) pos[i] = (double)random() * len / RAND_MAX;
+    qsort(pos,nquery,sizeof(*pos),cmp_uint32);
+
+    for (j=0; j<4; j++)
+    {
+        srandom(1);     // the same regions for all
+        regidx_t *idx = init_benchmark_idx(nregs,len,types[j]);
+        regitr_t *itr = regitr_init(idx);
+        if ( j>=2 ) regitr_set_sorted(itr,1);
+        clock_t t0 = clock();
+        for (i=0; i<nquery; i++)
+        {
+            if ( !regidx_overlap(idx,"1",pos[i],pos[i],itr) ) continue;
+            while ( regitr_overlap(itr) ) nhit[j]++;
+        }
+        elapsed[j] = (double)(clock() - t0) / CLOCKS_PER_SEC;
+        regitr_destroy(itr);
+        regidx_destroy(idx);
+    }
+    for (j=1; j<4; j++)
+        if ( nhit[0]!=nhit[j] ) error("benchmark failed, the number of hits differs: %d vs %d\n", nhit[0],nhit[j]);
+    for (j=0; j<4; j++)
+        fprintf(stderr,"%s:\t%d regions, %d queries, %d hits, %.2fs\n", name[j],nregs,nquery,nhit[j],elapsed[j]);
+    free(pos);
+}
+
 void create_line_bed(char *line, char *chr, int start, int end)
 {
     sprintf(line,"%s\t%d\t%d\n",chr,start-1,end);
@@ -320,6 +577,7 @@ static void usage(void)
 {
     fprintf(stderr, "Usage: test-regidx [OPTIONS]\n");
     fprintf(stderr, "Options:\n");
+    fprintf(stderr, "   -b, --benchmark     compare the speed of the bins, tree and sorted queries\n");
     fprintf(stderr, "   -h, --help          this help message\n");
     fprintf(stderr, "   -s, --seed <int>    random seed\n");
     fprintf(stderr, "   -v, --verbose       increase verbosity by giving multiple times\n");
@@ -331,17 +589,19 @@ int main(int argc, char **argv)
 {
     static struct option loptions[] =
     {
+        {"benchmark",0,0,'b'},
         {"help",0,0,'h'},
         {"verbose",0,0,'v'},
         {"seed",1,0,'s'},
         {0,0,0,0}
     };
     char c;
-    int seed = (int)time(NULL);
-    while ((c = getopt_long(argc, argv, "hvs:",loptions,NULL)) >= 0) 
+    int seed = (int)time(NULL), benchmark = 0;
+    while ((c = getopt_long(argc, argv, "hvs:b",loptions,NULL)) >= 0) 
     {
         switch (c)
         {
+            case 'b': benchmark = 1; break;
             case 's': seed = atoi(optarg); break;
             case 'v': verbose++; break;
             default: usage(); break;
@@ -366,7 +626,26 @@ int main(int argc, char **argv)
     int i, ntest = 1000, nreg = 50;
     srandom(seed);
     info("%d randomized tests, %d regions per test. Random seed is %d\n", ntest,nreg,seed);
-    for (i=0; i<ntest; i++) test_random(nreg,1,1000);
+    for (i=0; i<ntest; i++) test_random(nreg,1,1000,REGIDX_INDEX_BINS);
+    for (i=0; i<ntest; i++) test_random(nreg,1,1000,REGIDX_INDEX_TREE);
+    for (i=0; i<ntest; i++) test_random(nreg,1,1000000,REGIDX_INDEX_AUTO);
+    for (i=0; i<ntest; i++) test_random(1+random()%1000,1,1000000,REGIDX_INDEX_TREE);
+
+    info("Testing save and load\n");
+    for (i=0; i<10; i++) test_save(1+random()%10000);
+
+    info("Testing concurrent queries\n");
+    for (i=0; i<5; i++) test_threads(8,1+random()%5000);
+
+    info("Testing sorted queries\n");
+    for (i=0; i<ntest/10; i++) test_sorted(1+random()%1000,0,1000000,REGIDX_INDEX_BINS);
+    for (i=0; i<ntest/10; i++) test_sorted(1+random()%1000,0,1000000,REGIDX_INDEX_TREE);
+
+    if ( benchmark )
+    {
+        info("Benchmarking\n");
+        test_benchmark(1000000,1000000);
+    }
 
     return 0;
 }
@@ -34,25 +34,71 @@ use Cwd qw/ abs_path /;
 
 my $opts = parse_params();
 test_usage($opts,cmd=>'bcftools');
+test_rbuf($opts,out=>'test-rbuf.out');
+test_bench($opts,out=>'bench.out',args=>'-s 2 -n 50 -r 1');
+test_bench($opts,out=>'bench.out',args=>'-s 2 -n 50 -r 1 -T 2');
+test_profile($opts,in=>'reheader.big',out=>'profile.out',txt=>'profile.txt.out',args=>q[view -Ou -i'QUAL>500']);
+test_profile($opts,in=>'reheader.big',out=>'profile.out',txt=>'profile.txt.out',args=>q[view -Ou -i'QUAL>500' --threads 2]);
 test_tabix($opts,in=>'merge.a',reg=>'2:3199812-3199812',out=>'tabix.2.3199812.out');
 test_tabix($opts,in=>'merge.a',reg=>'1:3000151-3000151',out=>'tabix.1.3000151.out');
 test_index($opts,in=>'large_chrom_csi_limit',reg=>'chr20:1-2147483647',out=>'large_chrom_csi_limit.20.1.2147483647.out'); # 2147483647 (1<<31-1) is the current chrom limit for csi. bcf conversion and indexing fail above this
 test_index($opts,in=>'large_chrom_csi_limit',reg=>'chr20',out=>'large_chrom.20.1.2147483647.out'); # this fails until bug resolved
+test_index($opts,in=>'large_chrom_csi_limit',reg=>'chr20:1-2147483647',out=>'large_chrom_csi_limit.20.1.2147483647.out',index_args=>'--threads 2');
+test_vcf_write_index($opts,in=>'reheader.big',out=>'write-index.out',cmd=>'view',args=>'',reg=>'2:5000-6000');
+test_vcf_write_index($opts,in=>'reheader.big',out=>'write-index.out',cmd=>'view',args=>'--threads 2',reg=>'2:5000-6000');
+test_vcf_write_index($opts,in=>'reheader.big',out=>'write-index.out',cmd=>'annotate',args=>'-x ID --threads 2',reg=>'2:5000-6000');
 test_vcf_idxstats($opts,in=>'idx',args=>'-s',out=>'idx.out');
 test_vcf_idxstats($opts,in=>'idx',args=>'-n',out=>'idx_count.out');
+test_vcf_idxstats($opts,in=>'idx',args=>'-se',pipe=>'cut -f1-3,5-',out=>'idx.ext.out');
+test_vcf_idxshards($opts,in=>'idx',args=>'--shards 1',out=>'idx.shards.out');
+test_vcf_idxshards($opts,in=>'idx',args=>'--shards 3',out=>'idx.shards.out');
+test_vcf_idxshards($opts,in=>'idx',args=>'--shards 20',out=>'idx.shards.out');
 test_vcf_idxstats($opts,in=>'empty',args=>'-s',out=>'empty.idx.out');
 test_vcf_idxstats($opts,in=>'empty',args=>'-n',out=>'empty.idx_count.out');
 test_vcf_check($opts,in=>'check',out=>'check.chk');
+test_vcf_check($opts,in=>'check',out=>'check.chk',args=>'--threads 2');
 test_vcf_check_merge($opts,in=>'check',out=>'check_merge.chk');
+test_vcf_stats_dump($opts,in=>'check',regs=>[qw(1 2 3 4)],out=>'check.chk');
 test_vcf_stats($opts,in=>['stats.a','stats.b'],out=>'stats.chk',args=>'-s -');
 test_vcf_stats($opts,in=>['stats.a','stats.b'],out=>'stats.B.chk',args=>'-s B');
 test_vcf_isec($opts,in=>['isec.a','isec.b'],out=>'isec.ab.out',args=>'-n =2');
 test_vcf_isec($opts,in=>['isec.a','isec.b'],out=>'isec.ab.flt.out',args=>'-n =2 -i"STRLEN(REF)==2"');
+test_vcf_isec($opts,in=>['isec.a','isec.b'],out=>'isec.ab.qual.out',args=>q[-n =2 -i'QUAL>500']);
 test_vcf_isec($opts,in=>['isec.a','isec.b'],out=>'isec.ab.both.out',args=>'-n =2 -c both');
 test_vcf_isec($opts,in=>['isec.a','isec.b'],out=>'isec.ab.any.out',args=>'-n =2 -c any');
 test_vcf_isec($opts,in=>['isec.a','isec.b'],out=>'isec.ab.C.out',args=>'-C -c any');
+test_vcf_isec($opts,in=>['isec.a','isec.b'],out=>'isec.ab.bitmask.out',args=>'-n =2 --bitmask --threads 2',summary=>'isec.ab.summary.out');
+test_vcf_isec($opts,in=>['isec.a','isec.b'],out=>'isec.ab.out',args=>'-n =2 --parallel --threads 2');
+test_vcf_isec($opts,in=>['isec.a','isec.b'],out=>'isec.ab.C.out',args=>'-C -c any --parallel --threads 2');
 test_vcf_isec2($opts,vcf_in=>['isec.a'],tab_in=>'isec',out=>'isec.tab.out',args=>'');
+test_vcf_gtcheck($opts,in=>'gtcheck',out=>'gtcheck.out',args=>'-G 1');
+test_vcf_gtcheck($opts,in=>'gtcheck',out=>'gtcheck.out',args=>'-G 1 --threads 2');
+test_vcf_gtcheck($opts,in=>'gtcheck.clust',out=>'gtcheck.clust.out',args=>'-G 1',grep=>'^(CLUSTER|TH)');
+test_vcf_gtcheck($opts,in=>'gtcheck.clust',out=>'gtcheck.clust.out',args=>'-G 1 --threads 2',grep=>'^(CLUSTER|TH)');
+test_vcf_gtcheck($opts,in=>'gtcheck.query',gt=>'gtcheck',out=>'gtcheck.query.out',args=>'-G 1');
+test_vcf_roh($opts,in=>'roh',out=>'roh.out',args=>'-G 30 --AF-dflt 0.5 -O r');
+test_vcf_roh($opts,in=>'roh',out=>'roh.out',args=>'-G 30 --AF-dflt 0.5 -O r --threads 2');
+test_vcf_roh($opts,in=>'roh.gaps',out=>'roh.gaps.out',args=>'-G 30 --AF-dflt 0.5 -O r');
+test_vcf_roh($opts,in=>'roh',out=>'roh.out',args=>'-G 30 --AF-dflt 0.5 -O r -m {PATH}/roh.genmap');
+test_vcf_roh($opts,in=>'roh',out=>'roh.out',args=>'-G 30 --AF-dflt 0.5 -O r -m {PATH}/roh.genmap --threads 2');
+test_vcf_roh($opts,in=>'roh',out=>'roh.out',args=>'-G 30 --AF-dflt 0.5 -O r -b 80,20');
+test_vcf_roh($opts,in=>'roh',out=>'roh.out',args=>'-G 30 --AF-dflt 0.5 -O r -b 80,20 --threads 2');
+test_vcf_roh($opts,in=>'roh',out=>'roh.out',af=>'roh.af',args=>'-G 30 --AF-file {TMP}/roh.af.tab.gz -O r');
+test_vcf_roh($opts,in=>'roh',out=>'roh.out',af=>'roh.af',args=>'-G 30 --AF-file {TMP}/roh.af.vcf.gz -O r');
+test_vcf_roh($opts,in=>'roh',out=>'roh.out',af=>'roh.af',args=>'-G 30 --AF-file {TMP}/roh.af.bcf -O r --threads 2');
+test_vcf_cnv($opts,in=>'cnv',out=>'cnv.out',samples=>[qw(A B)],args=>'--samples A,B');
+test_vcf_cnv($opts,in=>'cnv',out=>'cnv.out',samples=>[qw(A B)],args=>'--samples A,B --threads 2');
+test_vcf_cnv($opts,in=>'cnv',out=>'cnv.B.out',samples=>[qw(B)],args=>'-s B');
+test_vcf_cnv($opts,in=>'cnv.noise',out=>'cnv.out',samples=>[qw(A B)],args=>'--samples A,B');
+test_polysomy($opts,in=>'polysomy',out=>'polysomy.out',args=>'-n 21');
+test_polysomy($opts,in=>'polysomy',out=>'polysomy.out',args=>'-n 21 --threads 2');
+test_polysomy($opts,in=>'polysomy',out=>'polysomy.out',args=>'-n 21 --save-dist {TMP}/polysomy.dist');
+test_polysomy($opts,in=>'polysomy',out=>'polysomy.out',args=>'--load-dist {TMP}/polysomy.dist --threads 2');
+test_vcf_som($opts,in=>'som.tab',out=>'som.out',args=>'-s 2 -f 2 -n 1 -e -l 2.718281828459045',cargs=>'');
+test_vcf_som($opts,in=>'som.tab',out=>'som.out',args=>'-s 2 -f 2 -n 1 -e -l 2.718281828459045 --threads 2',cargs=>'--threads 2');
+test_vcf_som($opts,in=>'som.tab',out=>'som.out',convert=>'som.bin.out',args=>'-s 2 -f 2 -n 1 -e -l 2.718281828459045 --threads 2',cargs=>'');
 test_vcf_merge($opts,in=>['merge.a','merge.b','merge.c'],out=>'merge.abc.out',args=>'--force-samples');
+test_vcf_merge($opts,in=>['merge.a','merge.b','merge.c'],out=>'merge.abc.out',args=>'--force-samples --threads 2 --parallel');
 test_vcf_merge($opts,in=>['merge.a','merge.b','merge.c'],out=>'merge.abc.2.out',args=>'--force-samples -Fx');
 test_vcf_merge($opts,in=>['merge.a','merge.b','merge.c'],out=>'merge.abc.3.out',args=>'--force-samples -0');
 test_vcf_merge($opts,in=>['merge.2.a','merge.2.b'],out=>'merge.2.none.out',args=>'--force-samples -m none');
@@ -62,9 +108,16 @@ test_vcf_merge($opts,in=>['merge.3.a','merge.3.b'],out=>'merge.3.out',args=>'--f
 test_vcf_merge($opts,in=>['merge.4.a','merge.4.b'],out=>'merge.4.out',args=>'--force-samples -m id');
 test_vcf_merge($opts,in=>['gvcf.merge.1','gvcf.merge.2','gvcf.merge.3'],out=>'gvcf.merge.1.out',args=>'--gvcf -');
 test_vcf_merge($opts,in=>['merge.gvcf.2.a','merge.gvcf.2.b','merge.gvcf.2.c'],out=>'merge.gvcf.2.out',args=>'--gvcf -');
+test_vcf_merge($opts,in=>['merge.gvcf.2.a','merge.gvcf.2.b','merge.gvcf.2.c'],out=>'merge.gvcf.2.r8.out',args=>'--gvcf - -r 8');
 test_vcf_merge($opts,in=>['merge.gvcf.3.a','merge.gvcf.3.b'],out=>'merge.gvcf.3.out',args=>'--gvcf - -i SRC:join');
 test_vcf_merge($opts,in=>['merge.5.a','merge.5.b'],out=>'merge.5.out');
+test_vcf_merge($opts,in=>['merge.6.a','merge.6.b','merge.6.c'],out=>'merge.6.out',fmt=>'%CHROM\\t%POS\\t%REF\\t%ALT[\\t%GT]\\n');
+test_vcf_merge($opts,in=>['merge.6.a','merge.6.b','merge.6.c'],out=>'merge.6.out',fmt=>'%CHROM\\t%POS\\t%REF\\t%ALT[\\t%GT]\\n',args=>'--max-inputs 2');
+test_vcf_merge($opts,in=>['merge.6.a','merge.6.b','merge.6.c'],out=>'merge.6.out',fmt=>'%CHROM\\t%POS\\t%REF\\t%ALT[\\t%GT]\\n',args=>'--max-inputs 2 --threads 2');
+test_vcf_merge($opts,in=>['merge.7.a','merge.7.b'],out=>'merge.7.out',fmt=>'%POS\\t%ALT[\\t%GT:%XI:%XF]\\n');
+test_vcf_merge($opts,in=>['merge.8.a','merge.8.b'],out=>'merge.8.out',fmt=>'%POS\\t%ALT\\t%AC[\\t%GT]\\n');
 test_vcf_query($opts,in=>'query',out=>'query.out',args=>q[-f '%CHROM\\t%POS\\t%REF\\t%ALT\\t%DP4\\t%AN[\\t%GT\\t%TGT]\\n']);
+test_vcf_query($opts,in=>'query',out=>'query.out',args=>q[--threads 2 -f '%CHROM\\t%POS\\t%REF\\t%ALT\\t%DP4\\t%AN[\\t%GT\\t%TGT]\\n']);
 test_vcf_query($opts,in=>'view.filter',out=>'query.2.out',args=>q[-f'%XRI\\n' -i'XRI[*]>1111']);
 test_vcf_query($opts,in=>'view.filter',out=>'query.3.out',args=>q[-f'%XRF\\n' -i'XRF[*]=2e6']);
 test_vcf_query($opts,in=>'view.filter',out=>'query.4.out',args=>q[-f'%XGS\\n' -i'XGS[5]="PQR"']);
@@ -76,10 +129,47 @@ test_vcf_query($opts,in=>'view.filter',out=>'query.4.out',args=>q[-f'%XGS\\n' -i
 test_vcf_query($opts,in=>'query',out=>'query.5.out',args=>q[-f'%POS %REF %ALT\\n' -i'REF~"C" && ALT~"CT"']);
 test_vcf_query($opts,in=>'query',out=>'query.6.out',args=>q[-f'%POS %REF %ALT\\n' -i'N_ALT=2']);
 test_vcf_query($opts,in=>'query',out=>'query.7.out',args=>q[-f'%POS %AN\\n' -i'AN!=2*N_SAMPLES']);
+test_vcf_query($opts,in=>'query',out=>'query.7.out',args=>q[-f'%POS %AN\\n' -i'AN!=4*N_SAMPLES/2']);
 test_vcf_query($opts,in=>'query',out=>'query.8.out',args=>q[-f'%POS[ %GL]\\n' -i'min(abs(GL[0]))=10']);
 test_vcf_query($opts,in=>'view.filter',out=>'query.9.out',args=>q[-f'%POS %CIGAR\\n' -i'strlen(CIGAR[*])=4']);
 test_vcf_query($opts,in=>'query',out=>'query.10.out',args=>q[-f'%POS[ %GT]\\n' -i'AC[0]=3']);
+test_vcf_query($opts,in=>'query',out=>'query.10.out',args=>q[--threads 2 -f'%POS[ %GT]\\n' -i'AC[0]=3']);
+test_vcf_query($opts,in=>'reheader.big',out=>'query.big.out',args=>q[-f'%CHROM\\t%POS\\t%REF[\\t%GT:%DP]\\n']);
+test_vcf_query($opts,in=>'reheader.big',out=>'query.big.out',args=>q[--threads 1 -f'%CHROM\\t%POS\\t%REF[\\t%GT:%DP]\\n']);
+test_vcf_query($opts,in=>'reheader.big',out=>'query.big.out',args=>q[--threads 2 -f'%CHROM\\t%POS\\t%REF[\\t%GT:%DP]\\n']);
+test_vcf_query($opts,in=>'reheader.big',out=>'query.big.2.out',args=>q[--threads 1 -f'%CHROM\\t%POS\\t%REF[\\t%GT:%DP]\\n' -i'QUAL>500']);
+test_vcf_query($opts,in=>'reheader.big',out=>'query.big.out',ubcf=>1,args=>q[-f'%CHROM\\t%POS\\t%REF[\\t%GT:%DP]\\n']);
+test_vcf_query($opts,in=>'reheader.big',out=>'query.big.2.out',ubcf=>1,args=>q[--threads 2 -f'%CHROM\\t%POS\\t%REF[\\t%GT:%DP]\\n' -i'QUAL>500']);
+test_vcf_query($opts,in=>'reheader.big',out=>'query.big.3.out',ubcf=>1,args=>q[-s A,C -f'%CHROM\\t%POS\\t%REF[\\t%GT:%DP]\\n']);
+test_vcf_query_gti($opts,in=>'convert.gts',out=>'query.gti.out',args=>q[-f'%CHROM\\t%POS[\\t%SAMPLE=%GT]\\n']);
+test_vcf_query_gti($opts,in=>'reheader.big',out=>'query.gti.big.out',args=>q[-f'%CHROM\\t%POS[\\t%GT]\\n']);
+test_vcf_sort($opts,in=>'sort',out=>'sort.out',args=>'');
+test_vcf_sort($opts,in=>'sort',out=>'sort.out',args=>'-m 10k');
+test_vcf_sort($opts,in=>'sort',out=>'sort.out',args=>'-m 10k --threads 2');
 test_vcf_query($opts,in=>'query',out=>'query.10.out',args=>q[-f'%POS[ %GT]\\n' -i'AF[0]=3/4']);
+test_vcf_query($opts,in=>'filter.gtcls',out=>'filter.gtcls.hom.out',args=>q[-i'GT="hom"' -f'%POS\\n']);
+test_vcf_query($opts,in=>'filter.gtcls',out=>'filter.gtcls.het.out',args=>q[-i'GT="het"' -f'%POS\\n']);
+test_vcf_query($opts,in=>'filter.gtcls',out=>'filter.gtcls.hap.out',args=>q[-i'GT="hap"' -f'%POS\\n']);
+test_vcf_query($opts,in=>'filter.gtcls',out=>'filter.gtcls.mis.out',args=>q[-i'GT="mis"' -f'%POS\\n']);
+test_vcf_query($opts,in=>'filter.gtcls',out=>'filter.gtcls.ref.out',args=>q[-i'GT="ref"' -f'%POS\\n']);
+test_vcf_query($opts,in=>'filter.gtcls',out=>'filter.gtcls.alt.out',args=>q[-i'GT="alt"' -f'%POS\\n']);
+test_vcf_query($opts,in=>'filter.gtcls',out=>'filter.gtcls.RR.out',args=>q[-i'GT="RR"' -f'%POS\\n']);
+test_vcf_query($opts,in=>'filter.gtcls',out=>'filter.gtcls.RA.out',args=>q[-i'GT="RA"' -f'%POS\\n']);
+test_vcf_query($opts,in=>'filter.gtcls',out=>'filter.gtcls.AA.out',args=>q[-i'GT="AA"' -f'%POS\\n']);
+test_vcf_query($opts,in=>'filter.gtcls',out=>'filter.gtcls.A1A2.out',args=>q[-i'GT="Aa"' -f'%POS\\n']);
+test_vcf_query($opts,in=>'filter.gtcls',out=>'filter.gtcls.R.out',args=>q[-i'GT="R"' -f'%POS\\n']);
+test_vcf_query($opts,in=>'filter.gtcls',out=>'filter.gtcls.A.out',args=>q[-i'GT="A"' -f'%POS\\n']);
+test_vcf_query($opts,in=>'filter.gtcls',out=>'filter.gtcls.not-het.out',args=>q[-i'GT!="het"' -f'%POS\\n']);
+test_vcf_query($opts,in=>'filter.gtcls',out=>'filter.gtcls.not-het.out',args=>q[-e'GT="het"' -f'%POS\\n']);
+test_vcf_query($opts,in=>'filter.regex',out=>'filter.regex.1.out',args=>q[-i'STR~"abc"' -f'%POS\\n']);
+test_vcf_query($opts,in=>'filter.regex',out=>'filter.regex.2.out',args=>q[-i'STR~"^abc"' -f'%POS\\n']);
+test_vcf_query($opts,in=>'filter.regex',out=>'filter.regex.3.out',args=>q[-i'STR~"abc$"' -f'%POS\\n']);
+test_vcf_query($opts,in=>'filter.regex',out=>'filter.regex.4.out',args=>q[-i'STR~"^abc$"' -f'%POS\\n']);
+test_vcf_query($opts,in=>'filter.regex',out=>'filter.regex.5.out',args=>q[-i'STR~"abc/i"' -f'%POS\\n']);
+test_vcf_query($opts,in=>'filter.regex',out=>'filter.regex.6.out',args=>q[-i'STR~"^foo\|bar$"' -f'%POS\\n']);
+test_vcf_query($opts,in=>'filter.regex',out=>'filter.regex.7.out',args=>q[-i'STR~"a\.c"' -f'%POS\\n']);
+test_vcf_query($opts,in=>'filter.regex',out=>'filter.regex.8.out',args=>q[-i'STR~"a.c"' -f'%POS\\n']);
+test_vcf_query($opts,in=>'filter.regex',out=>'filter.regex.9.out',args=>q[-i'STR!~"abc"' -f'%POS\\n']);
 test_vcf_query($opts,in=>'query',out=>'query.11.out',args=>q[-f'%POS[ %GT]\\n' -i'MAC[0]=1']);
 test_vcf_query($opts,in=>'query',out=>'query.11.out',args=>q[-f'%POS[ %GT]\\n' -i'MAF[0]=1/4']);
 test_vcf_query($opts,in=>'view.vectors',out=>'query.12.out',args=>q[-f'I8=%I8 I16=%I16 I32=%I32 IF=%IF IA8=%IA8 IA16=%IA16 IA32=%IA32 IAF=%IAF IA8=%IA8{1} IA16=%IA16{1} IA32=%IA32{1} IAF=%IAF{1} [ %F8:%F16:%F32:%FF]\\n']);
@@ -103,6 +193,7 @@ test_vcf_query($opts,in=>'missing',out=>'query.22.out',args=>q[-e'ISTR!="."' -f'
 test_vcf_query($opts,in=>'missing',out=>'query.24.out',args=>q[-i'FILTER="q11"' -f'%POS %ISTR\\n']);
 test_vcf_query($opts,in=>'query',out=>'query.25.out',args=>q[-f'%LINE']);
 test_vcf_query($opts,in=>'query.filter-type',out=>'query.26.out',args=>q[-f'%POS\\t%REF\\t%ALT\\n' -i'type="snp"']);
+test_vcf_query($opts,in=>'view.vectors',out=>'query.vectors.out',args=>q[-f'%POS[ %GT][ %F16][ %FF][ %FRI{1}]\\n']);
 test_vcf_query($opts,in=>'query.filter-type',out=>'query.27.out',args=>q[-f'%POS\\t%REF\\t%ALT\\n' -i'type~"snp"']);
 test_vcf_query($opts,in=>'query.filter-type',out=>'query.28.out',args=>q[-f'%POS\\t%REF\\t%ALT\\n' -i'type!="snp"']);
 test_vcf_query($opts,in=>'query.filter-type',out=>'query.29.out',args=>q[-f'%POS\\t%REF\\t%ALT\\n' -i'type!~"snp"']);
@@ -111,19 +202,26 @@ test_vcf_query($opts,in=>'filter-missing-floats',out=>'query.31.out',args=>q[-f'
 test_vcf_query($opts,in=>'missing',out=>'query.32.out',args=>q[-i'FMT/FINT!="."' -f'[\t%FINT]\\n']);
 test_vcf_query($opts,in=>'query.filter.2',out=>'query.33.out',args=>q[-f'[%GT]\\n' -i'GT~"0/[1-9]" || GT~"[1-9]/0"']);
 test_vcf_norm($opts,in=>'norm',out=>'norm.out',fai=>'norm',args=>'-cx');
+test_vcf_norm($opts,in=>'norm',out=>'norm.r20.out',fai=>'norm',args=>'-cx -r 20');
 test_vcf_norm($opts,in=>'norm.split',out=>'norm.split.out',args=>'-m-');
+test_vcf_norm($opts,in=>'norm.split',out=>'norm.split.out',args=>'-m- --threads 2');
 test_vcf_norm($opts,in=>'norm.split.2',out=>'norm.split.2.out',args=>'-m-');
 test_vcf_norm($opts,in=>'norm.split',fai=>'norm',out=>'norm.split.and.norm.out',args=>'-m-');
 test_vcf_norm($opts,in=>'norm.merge',out=>'norm.merge.out',args=>'-m+');
+test_vcf_norm($opts,in=>'norm.merge',out=>'norm.merge.out',args=>'-m+ --threads 2');
 test_vcf_norm($opts,in=>'norm.merge.2',out=>'norm.merge.2.out',args=>'-m+');
 test_vcf_norm($opts,in=>'norm.merge.3',out=>'norm.merge.3.out',args=>'-m+');
 test_vcf_norm($opts,in=>'norm.merge',out=>'norm.merge.strict.out',args=>'-m+ -s');
 test_vcf_norm($opts,in=>'norm.setref',out=>'norm.setref.out',args=>'-Nc s',fai=>'norm');
 test_vcf_norm($opts,in=>'norm.telomere',out=>'norm.telomere.out',fai=>'norm');
+test_vcf_norm($opts,in=>'norm.trim',out=>'norm.trim.out',fai=>'norm');
+test_vcf_norm($opts,in=>'norm.rmdup',out=>'norm.rmdup.out',fai=>'norm',args=>'-d none');
+test_vcf_norm($opts,in=>'norm.rmdup',out=>'norm.rmdup.out',fai=>'norm',args=>'-D');
 test_vcf_view($opts,in=>'view',out=>'view.1.out',args=>'-aUc1 -C1 -s NA00002 -v snps',reg=>'');
 test_vcf_view($opts,in=>'view',out=>'view.2.out',args=>'-f PASS -Xks NA00003',reg=>'-r20,Y');
 test_vcf_view($opts,in=>'view',out=>'view.3.out',args=>'-xs NA00003',reg=>'');
 test_vcf_view($opts,in=>'view',out=>'view.4.out',args=>q[-i 'QUAL==999 && (FS<20 || FS>=41.02) && ICF>-0.1 && HWE*2>1.2'],reg=>'');
+test_vcf_view($opts,in=>'view',out=>'view.4.out',args=>q[--threads 2 -i 'QUAL==999 && (FS<20 || FS>=41.02) && ICF>-0.1 && HWE*2>1.2'],reg=>'');
 test_vcf_view($opts,in=>'view',out=>'view.5.out',args=>q[-p],reg=>'');
 test_vcf_view($opts,in=>'view',out=>'view.6.out',args=>q[-P],reg=>'');
 test_vcf_view($opts,in=>'view',out=>'view.7.out',args=>q[-hm2 -M2 -q0.3 -Q0.7],reg=>'');
@@ -131,9 +229,13 @@ test_vcf_view($opts,in=>'view',out=>'view.8.out',args=>q[-Hu],reg=>'');
 test_vcf_view($opts,in=>'view',out=>'view.9.out',args=>q[-GVsnps],reg=>'');
 test_vcf_view($opts,in=>'view',out=>'view.10.out',args=>q[-ne 'INDEL=1 || PV4[0]<0.006'],reg=>'');
 test_vcf_view($opts,in=>'view',out=>'view.exclude.out',args=>'-s ^NA00003',reg=>'');
+test_vcf_view($opts,in=>'view',out=>'view.exclude.out',args=>'--threads 2 -s ^NA00003',reg=>'');
+test_vcf_view($opts,in=>'view',out=>'view.exclude.out',args=>'-s NA00001,NA00002',reg=>'');
 test_vcf_view($opts,in=>'view.omitgenotypes',out=>'view.omitgenotypes.out',args=>'',reg=>'');
 test_vcf_view($opts,in=>'view.omitgenotypes',out=>'view.dropgenotypes.out',args=>'-G',reg=>'');
 test_vcf_view($opts,in=>'view.omitgenotypes',out=>'view.dropgenotypes.noheader.out',args=>'-HG',reg=>'');
+test_vcf_view($opts,in=>'view.omitgenotypes',out=>'view.dropgenotypes.qual.out',args=>q[-HG -i'QUAL>40'],reg=>'');
+test_vcf_view($opts,in=>'view.omitgenotypes',out=>'view.dropgenotypes.fmt.out',args=>q[-HG -i'FMT/DP>4'],reg=>'');
 test_vcf_view($opts,in=>'many.alleles',out=>'many.alleles.trim.out',args=>'-a',reg=>'');
 test_vcf_view($opts,in=>'view.vectors',out=>'view.vectors.A.out',args=>'-asA',reg=>'');
 test_vcf_view($opts,in=>'view.vectors',out=>'view.vectors.B.out',args=>'-asB',reg=>'');
@@ -144,6 +246,8 @@ test_vcf_view($opts,in=>'view.filter',out=>'view.filter.3.out',args=>q[-H -i'FMT
 test_vcf_view($opts,in=>'view.filter',out=>'view.filter.4.out',args=>q[-H -i'FMT/FRS[1]="BB"'],reg=>'');
 test_vcf_view($opts,in=>'view.filter',out=>'view.filter.5.out',args=>q[-H -i'TXT0="text"'],reg=>'');
 test_vcf_view($opts,in=>'view.chrs',out=>'view.chrs.out',args=>'',reg=>'',tgts=>'view.chrs.tab');
+test_vcf_view($opts,in=>'reheader.big',out=>'regplan.out',args=>'-H',reg=>"-R $$opts{path}/regplan.regs.tab");
+test_vcf_view($opts,in=>'reheader.big',out=>'regplan.out',args=>'-H ',reg=>'',tgts=>'regplan.tgts.tab');
 test_vcf_view($opts,in=>'filter.2',out=>'filter.11.out',args=>q[-i 'POS>=3062917'],reg=>'1:3062917-3157410');
 test_vcf_filter($opts,in=>'view.filter',out=>'view.filter.6.out',args=>q[-S. -e'TXT0="text"'],reg=>'');
 test_vcf_filter($opts,in=>'view.filter',out=>'view.filter.7.out',args=>q[-S. -e'FMT/FRS[1]="BB"'],reg=>'');
@@ -159,17 +263,30 @@ test_vcf_view($opts,in=>'view.filter.annovar',out=>'view.filter.annovar.2.out',a
 test_vcf_view($opts,in=>'view.filter.annovar',out=>'view.filter.annovar.3.out',args=>q[-H -i 'LJB2_MutationTaster=="0.291000"'],reg=>'');
 test_vcf_call($opts,in=>'mpileup',out=>'mpileup.1.out',args=>'-mv');
 test_vcf_call($opts,in=>'mpileup',out=>'mpileup.2.out',args=>'-mg0');
+test_vcf_call($opts,in=>'mpileup',out=>'mpileup.1.out',args=>'-mv -P 1.1e-3');
+test_vcf_call($opts,in=>'mpileup',out=>'mpileup.1.out',args=>'-mv --threads 2');
+test_vcf_call($opts,in=>'mpileup',out=>'mpileup.2.out',args=>'-mg0 --threads 2');
+test_vcf_call($opts,in=>'mpileup',out=>'mpileup.1.out',args=>'-mv',bcf=>1);
+test_vcf_call($opts,in=>'mpileup',out=>'mpileup.2.out',args=>'-mg0',bcf=>1);
 test_vcf_call($opts,in=>'mpileup.X',out=>'mpileup.X.out',args=>'-mv --ploidy-file {PATH}/mpileup.ploidy -S {PATH}/mpileup.samples');
 test_vcf_call($opts,in=>'mpileup.X',out=>'mpileup.X.out',args=>'-mv --ploidy-file {PATH}/mpileup.ploidy -S {PATH}/mpileup.ped');
 test_vcf_call($opts,in=>'mpileup.X',out=>'mpileup.X.2.out',args=>'-mv --ploidy-file {PATH}/mpileup.ploidy -S {PATH}/mpileup.2.samples');
+test_vcf_call($opts,in=>'mpileup.X',out=>'mpileup.X.2.out',args=>'-mv --threads 2 --ploidy-file {PATH}/mpileup.ploidy -S {PATH}/mpileup.2.samples');
+test_vcf_call($opts,in=>'mpileup.X',out=>'mpileup.X.out',args=>'-mv --ploidy-file {PATH}/mpileup.segs.ploidy -S {PATH}/mpileup.samples');
+test_vcf_call($opts,in=>'mpileup.X',out=>'mpileup.X.2.out',args=>'-mv --threads 2 --ploidy-file {PATH}/mpileup.segs.ploidy -S {PATH}/mpileup.2.samples');
 test_vcf_call_cAls($opts,in=>'mpileup',out=>'mpileup.cAls.out',tab=>'mpileup');
 test_vcf_call($opts,in=>'mpileup.c',out=>'mpileup.c.1.out',args=>'-cv');
+test_vcf_call($opts,in=>'mpileup.c',out=>'mpileup.c.1.out',args=>'-cv --threads 2');
+test_vcf_call($opts,in=>'mpileup.c',out=>'mpileup.c.1.out',args=>'-cv',bcf=>1);
+test_vcf_call($opts,in=>'mpileup.c',out=>'mpileup.c.3.out',args=>'-cv -p 0.01');
 # test_vcf_call($opts,in=>'mpileup.c',out=>'mpileup.c.2.out',args=>'-cg0');
 test_vcf_call($opts,in=>'mpileup.c.X',out=>'mpileup.c.X.out',args=>'-cv --ploidy-file {PATH}/mpileup.ploidy -S {PATH}/mpileup.samples');
 test_vcf_call($opts,in=>'mpileup.c.X',out=>'mpileup.c.X.out',args=>'-cv --ploidy-file {PATH}/mpileup.ploidy -S {PATH}/mpileup.ped');
 test_vcf_call($opts,in=>'mpileup.c.X',out=>'mpileup.c.X.2.out',args=>'-cv --ploidy-file {PATH}/mpileup.ploidy -S {PATH}/mpileup.2.samples');
+test_vcf_call($opts,in=>'mpileup.c.X',out=>'mpileup.c.X.out',args=>'-cv --ploidy-file {PATH}/mpileup.segs.ploidy -S {PATH}/mpileup.samples');
 test_vcf_filter($opts,in=>'filter.1',out=>'filter.1.out',args=>'-mx -g2 -G2');
 test_vcf_filter($opts,in=>'filter.2',out=>'filter.2.out',args=>q[-e'QUAL==59.2 || (INDEL=0 & (FMT/GQ=25 | FMT/DP=10))' -sModified -S.]);
+test_vcf_filter($opts,in=>'filter.2',out=>'filter.2.out',args=>q[-e'59.2==QUAL || (INDEL=0 & (25=FMT/GQ | 10=FMT/DP))' -sModified -S.]);
 test_vcf_filter($opts,in=>'filter.3',out=>'filter.3.out',args=>q[-e'DP=19'],fmt=>'%POS\\t%FILTER\\t%DP[\\t%GT]\\n');
 test_vcf_filter($opts,in=>'filter.3',out=>'filter.4.out',args=>q[-e'DP=19' -s XX],fmt=>'%POS\\t%FILTER\\t%DP[\\t%GT]\\n');
 test_vcf_filter($opts,in=>'filter.3',out=>'filter.5.out',args=>q[-e'DP=19' -s XX -m+],fmt=>'%POS\\t%FILTER\\t%DP[\\t%GT]\\n');
@@ -182,20 +299,33 @@ test_vcf_filter($opts,in=>'filter.3',out=>'filter.6.out',args=>q[-e'FMT/GT="0/2"
 test_vcf_filter($opts,in=>'filter.3',out=>'filter.7.out',args=>q[-e'FMT/GT="0/2"' -s XX -m+x],fmt=>'%POS\\t%FILTER\\t%DP[\\t%GT]\\n');
 test_vcf_filter($opts,in=>'filter.2',out=>'filter.8.out',args=>q[-i'FMT/GT="0/0" && AC[*]=2'],fmt=>'%POS\\t%AC[\\t%GT]\\n');
 test_vcf_filter($opts,in=>'filter.2',out=>'filter.8.out',args=>q[-i'AC[*]=2 && FMT/GT="0/0"'],fmt=>'%POS\\t%AC[\\t%GT]\\n');
+test_vcf_filter_stats($opts,in=>'filter.2',out=>'filter.stats.out',args=>q[-i'FMT/GT="0/0" && AC[*]=2']);
 test_vcf_filter($opts,in=>'filter.2',out=>'filter.9.out',args=>q[-i'ALT="."'],fmt=>'%POS\\t%AC[\\t%GT]\\n');
 test_vcf_filter($opts,in=>'filter.4',out=>'filter.10.out',args=>q[-S . -i 'FORMAT/TEST3<25']);
 test_vcf_filter($opts,in=>'filter.4',out=>'filter.10.out',args=>q[-S . -i 'FORMAT/TEST4<25']);
 test_vcf_regions($opts,in=>'regions');
 test_vcf_annotate($opts,in=>'annotate',tab=>'annotate',out=>'annotate.out',args=>'-c CHROM,POS,REF,ALT,ID,QUAL,INFO/T_INT,INFO/T_FLOAT,INDEL');
+test_vcf_annotate($opts,in=>'annotate',tab=>'annotate',out=>'annotate.out',args=>'--threads 2 -c CHROM,POS,REF,ALT,ID,QUAL,INFO/T_INT,INFO/T_FLOAT,INDEL');
+test_vcf_annotate($opts,in=>'annotate',tab=>'annotate',out=>'annotate.out',args=>q[--threads 2 -i 'POS>0' -c CHROM,POS,REF,ALT,ID,QUAL,INFO/T_INT,INFO/T_FLOAT,INDEL]);
 test_vcf_annotate($opts,in=>'annotate',tab=>'annotate2',out=>'annotate2.out',args=>'-c CHROM,FROM,TO,T_STR');
 test_vcf_annotate($opts,in=>'annotate',vcf=>'annots',out=>'annotate3.out',args=>'-c STR,ID,QUAL,FILTER');
 test_vcf_annotate($opts,in=>'annotate2',vcf=>'annots2',out=>'annotate4.out',args=>'-c ID,QUAL,FILTER,INFO,FMT');
 test_vcf_annotate($opts,in=>'annotate2',vcf=>'annots2',out=>'annotate5.out',args=>'-c ID,QUAL,+FILTER,+INFO,FMT/GT -s A');
 test_vcf_annotate($opts,in=>'annotate3',out=>'annotate6.out',args=>'-x ID,QUAL,^FILTER/fltA,FILTER/fltB,^INFO/AA,INFO/BB,^FMT/GT,FMT/PL');
 test_vcf_annotate($opts,in=>'annotate3',out=>'annotate7.out',args=>'-x FORMAT');
+test_vcf_annotate($opts,in=>'annotate.end',out=>'annotate.end.out',args=>'-x INFO/END,INFO/XX,FMT/YY',fmt=>'%POS\\t%END\\t%ALT\\t%DP[\\t%GT]\\n');
+test_vcf_annotate($opts,in=>'annotate.ar',vcf=>'annots.ar',out=>'annotate.ar.1.out',args=>'-c INFO/XA,INFO/XR',fmt=>'%POS\\t%REF\\t%ALT\\t%XA\\t%XR\\n');
+test_vcf_annotate($opts,in=>'annotate.ar',vcf=>'annots.ar',out=>'annotate.ar.2.out',args=>'-c INFO/XA',fmt=>'%POS\\t%REF\\t%ALT\\t%XA\\n');
+test_vcf_annotate($opts,in=>'annotate.fmt',vcf=>'annots.fmt',out=>'annotate.fmt.out',args=>'-c FMT/XI,FMT/XF,FMT/XS',fmt=>'%POS[\\t%XI:%XF:%XS]\\n');
+test_vcf_annotate($opts,in=>'annotate.fmt',vcf=>'annots.fmt.2',out=>'annotate.fmt.out',args=>'-c FMT/XI,FMT/XF,FMT/XS',fmt=>'%POS[\\t%XI:%XF:%XS]\\n');
 test_vcf_annotate($opts,in=>'annotate4',vcf=>'annots4',out=>'annotate8.out',args=>'-c +INFO');
 test_vcf_annotate($opts,in=>'annotate4',tab=>'annots4',out=>'annotate8.out',args=>'-c CHROM,POS,REF,ALT,+FA,+FR,+IA,+IR,+SA,+SR');
+test_vcf_annotate($opts,in=>'annotate4',tab=>'annots4',out=>'annotate8.out',args=>'--stream -c CHROM,POS,REF,ALT,+FA,+FR,+IA,+IR,+SA,+SR');
+test_vcf_annotate($opts,in=>'annotate4',tab=>'annots4',out=>'annotate8.out',args=>'--stream --threads 2 -c CHROM,POS,REF,ALT,+FA,+FR,+IA,+IR,+SA,+SR');
+test_vcf_annotate($opts,in=>'annotate4',tab=>'annots4',cache=>1,out=>'annotate8.out',args=>'-c CHROM,POS,REF,ALT,+FA,+FR,+IA,+IR,+SA,+SR');
 test_vcf_annotate($opts,in=>'annotate10',tab=>'annots10',out=>'annotate10.out',args=>'-c CHROM,POS,FMT/FINT,FMT/FFLT,FMT/FSTR');
+test_vcf_annotate($opts,in=>'annotate10',tab=>'annots10',out=>'annotate10.out',args=>'--stream -c CHROM,POS,FMT/FINT,FMT/FFLT,FMT/FSTR');
+test_vcf_annotate($opts,in=>'annotate10',tab=>'annots10',cache=>1,out=>'annotate10.out',args=>'-c CHROM,POS,FMT/FINT,FMT/FFLT,FMT/FSTR');
 test_vcf_annotate($opts,in=>'annotate2',vcf=>'annots2',out=>'annotate11.out',args=>'-c CHROM,POS,FMT/FINT,FMT/FFLT,FMT/FSTR -s A');
 test_vcf_annotate($opts,in=>'annotate2',tab=>'annots11',out=>'annotate11.out',args=>'-c CHROM,POS,FMT/FINT,FMT/FFLT,FMT/FSTR -s A');
 test_vcf_annotate($opts,in=>'annotate2',vcf=>'annots2',out=>'annotate12.out',args=>'-c AAA:=IINT,FMT/BBB:=FMT/FINT');
@@ -205,15 +335,34 @@ test_vcf_plugin($opts,in=>'plugin1',out=>'missing2ref.out',cmd=>'+setGT --no-ver
 test_vcf_plugin($opts,in=>'setGT',out=>'setGT.1.out',cmd=>'+setGT --no-version',args=>'-- -t q -n 0 -i \'GT~"." && FMT/DP=30 && GQ=150\'');
 test_vcf_annotate($opts,in=>'annotate9',tab=>'annots9',out=>'annotate9.out',args=>'-c CHROM,POS,REF,ALT,+ID');
 test_vcf_plugin($opts,in=>'plugin1',out=>'fill-AN-AC.out',cmd=>'+fill-AN-AC --no-version');
+test_vcf_plugin($opts,in=>'plugin1',out=>'fill-AN-AC.out',cmd=>'+fill-AN-AC --no-version',args=>'--threads 2');
+test_vcf_plugin($opts,in=>'fill-AN-AC.batch',out=>'fill-AN-AC.batch.out',cmd=>'+fill-AN-AC --no-version',args=>'| grep -v ^#');
+test_vcf_plugin($opts,in=>'fill-AN-AC.batch',out=>'fill-AN-AC.batch.out',cmd=>'+fill-AN-AC --no-version',args=>'--threads 2 | grep -v ^#');
 test_vcf_plugin($opts,in=>'plugin1',out=>'dosage.out',cmd=>'+dosage');
+test_vcf_plugin($opts,in=>'dosage',out=>'dosage.2.out',cmd=>'+dosage');
+test_vcf_plugin($opts,in=>'dosage',out=>'dosage.gt.out',cmd=>'+dosage',args=>'-- -t GT');
+test_vcf_plugin_dosage_bin($opts,in=>'dosage',out=>'dosage.bin.out');
 test_vcf_plugin($opts,in=>'fixploidy',out=>'fixploidy.out',cmd=>'+fixploidy --no-version',args=>'-- -s {PATH}/fixploidy.samples -p {PATH}/fixploidy.ploidy');
+test_vcf_plugin($opts,in=>'fixploidy.tree',out=>'fixploidy.tree.out',cmd=>'+fixploidy --no-version',args=>'-- -s {PATH}/fixploidy.samples -p {PATH}/fixploidy.tree.ploidy | grep -v ^#');
+test_vcf_plugin($opts,in=>'fixploidy.tree',out=>'fixploidy.tree.chain.1.out',cmd=>'+fixploidy,+fill-AN-AC --no-version',args=>'-- -s {PATH}/fixploidy.samples -p {PATH}/fixploidy.tree.ploidy -- | grep -v ^#');
+test_vcf_plugin($opts,in=>'fixploidy.tree',out=>'fixploidy.tree.chain.2.out',cmd=>'+fill-AN-AC,+fixploidy --no-version',args=>'-- -- -s {PATH}/fixploidy.samples -p {PATH}/fixploidy.tree.ploidy | grep -v ^#');
+test_vcf_plugin($opts,in=>'fixploidy.tree',out=>'fixploidy.tree.chain.2.out',cmd=>'+fill-AN-AC,+fixploidy --no-version',args=>'--threads 2 -- -- -s {PATH}/fixploidy.samples -p {PATH}/fixploidy.tree.ploidy | grep -v ^#');
 test_vcf_plugin($opts,in=>'view.PL',out=>'guess-ploidy.PL.out',cmd=>'+guess-ploidy',args=>'-vrX | grep -v bcftools');
 test_vcf_plugin($opts,in=>'view.GL',out=>'guess-ploidy.GL.out',cmd=>'+guess-ploidy',args=>'-vrX | grep -v bcftools');
+test_vcf_plugin($opts,in=>'view.PL',out=>'guess-ploidy.PL.out',cmd=>'+guess-ploidy',args=>'-vrX --threads 2 | grep -v bcftools');
+test_vcf_plugin($opts,in=>'view.GL',out=>'guess-ploidy.GL.out',cmd=>'+guess-ploidy',args=>'-vrX --threads 2 | grep -v bcftools');
+test_vcf_plugin($opts,in=>'check-sparsity',out=>'check-sparsity.1.out',cmd=>'+check-sparsity');
+test_vcf_plugin($opts,in=>'check-sparsity',out=>'check-sparsity.1.out',cmd=>'+check-sparsity',args=>'--threads 2');
+test_vcf_plugin($opts,in=>'check-sparsity',out=>'check-sparsity.2.out',cmd=>'+check-sparsity',args=>'-n 2');
+test_vcf_plugin($opts,in=>'check-sparsity',out=>'check-sparsity.2.out',cmd=>'+check-sparsity',args=>'-n 2 --threads 2');
+test_vcf_plugin($opts,in=>'check-sparsity',out=>'check-sparsity.3.out',cmd=>'+check-sparsity',args=>'-r 2,4 --threads 2');
 test_vcf_plugin($opts,in=>'view.GL',out=>'view.PL.vcf',cmd=>'+tag2tag --no-version',args=>'-- -r --gl-to-pl');
 test_vcf_plugin($opts,in=>'view.GP',out=>'view.GT.vcf',cmd=>'+tag2tag --no-version',args=>'-- -r --gp-to-gt -t 0.2');
 test_vcf_plugin($opts,in=>'merge.a',out=>'fill-tags.out',cmd=>'+fill-tags --no-version',args=>'-- -t AN,AC,AC_Hom,AC_Het,AC_Hemi');
 test_vcf_plugin($opts,in=>'view',out=>'fill-tags.2.out',cmd=>'+fill-tags --no-version',args=>'-- -t AC,AN,AF,MAF,NS');
 test_vcf_plugin($opts,in=>'view',out=>'fill-tags.3.out',cmd=>'+fill-tags --no-version',args=>'-- -t AC -S {PATH}/fill-tags.3.smpl');
+test_vcf_plugin($opts,in=>'fill-tags.4',out=>'fill-tags.4.out',cmd=>'+fill-tags --no-version',args=>'-- -t AN,AC,NS,AC_Hom,AC_Het,AC_Hemi -S {PATH}/fill-tags.4.smpl | grep -v ^#');
+test_vcf_plugin($opts,in=>'fill-tags.4',out=>'fill-tags.4.d.out',cmd=>'+fill-tags --no-version',args=>'-- -d -t AN,AC,NS,AC_Hom,AC_Het,AC_Hemi -S {PATH}/fill-tags.4.smpl | grep -v ^#');
 test_vcf_plugin($opts,in=>'fill-tags-hemi',out=>'fill-tags-hemi.1.out',cmd=>'+fill-tags --no-version');
 test_vcf_plugin($opts,in=>'fill-tags-hemi',out=>'fill-tags-hemi.2.out',cmd=>'+fill-tags --no-version',args=>'-- -d');
 test_vcf_plugin($opts,in=>'view',out=>'view.GTisec.out',cmd=>'+GTisec',args=>' | grep -v bcftools');
@@ -224,8 +373,11 @@ test_vcf_plugin($opts,in=>'view',out=>'view.GTisec.Hv.out',cmd=>'+GTisec',args=>
 test_vcf_plugin($opts,in=>'view',out=>'view.GTisec.m.out',cmd=>'+GTisec',args=>'-- -m | grep -v bcftools');
 test_vcf_plugin($opts,in=>'view',out=>'view.GTisec.mv.out',cmd=>'+GTisec',args=>'-- -mv | grep -v bcftools');
 test_vcf_plugin($opts,in=>'view',out=>'view.GTisec.v.out',cmd=>'+GTisec',args=>'-- -v | grep -v bcftools');
+test_vcf_plugin($opts,in=>'isecGT.a',out=>'isecGT.out',index=>['isecGT.b'],cmd=>'+isecGT',args=>'{TMP}/isecGT.b.vcf.gz | grep -v ^#');
+test_vcf_plugin($opts,in=>'isecGT.a',out=>'isecGT.out',index=>['isecGT.c'],cmd=>'+isecGT',args=>'{TMP}/isecGT.c.vcf.gz | grep -v ^#');
 test_vcf_plugin($opts,in=>'trio',out=>'trio.out',cmd=>'+trio-switch-rate',args=>'-- -p {PATH}/trio.ped | grep -v bcftools');
 test_vcf_plugin($opts,in=>'ad-bias',out=>'ad-bias.out',cmd=>'+ad-bias',args=>'-- -s {PATH}/ad-bias.samples | grep -v bcftools');
+test_vcf_plugin($opts,in=>'ad-bias.2',out=>'ad-bias.2.out',cmd=>'+ad-bias',args=>'-- -s {PATH}/ad-bias.2.samples -t 1 | grep -v bcftools');
 test_vcf_plugin($opts,in=>'af-dist',out=>'af-dist.out',cmd=>'+af-dist',args=>' | grep -v bcftools');
 test_vcf_plugin($opts,in=>'fixref.2a',out=>'fixref.2.out',index=>['fixref.2b'],cmd=>'+fixref',args=>'-- -f {PATH}/norm.fa -i {TMP}/fixref.2b.vcf.gz');
 test_vcf_plugin($opts,in=>'aa',out=>'aa.out',cmd=>'+fill-from-fasta',args=>'-- -f {PATH}/aa.fa -c AA -h {PATH}/aa.hdr -i \'TYPE="snp"\'');
@@ -236,26 +388,39 @@ test_vcf_plugin($opts,in=>'view',out=>'view.GTsubset.NA1NA2NA3.out',cmd=>'+GTsub
 test_vcf_plugin($opts,in=>'mendelian',out=>'mendelian.1.out',cmd=>'+mendelian --no-version',args=>'-- -t mom1,dad1,child1 -d');
 test_vcf_plugin($opts,in=>'mendelian',out=>'mendelian.2.out',cmd=>'+mendelian --no-version',args=>'-- -t mom1,dad1,child1 -l+');
 test_vcf_plugin($opts,in=>'mendelian',out=>'mendelian.3.out',cmd=>'+mendelian --no-version',args=>'-- -t mom1,dad1,child1 -lx');
+test_vcf_plugin($opts,in=>'mendelian.trios',out=>'mendelian.trios.1.out',cmd=>'+mendelian --no-version',args=>'-- -T {PATH}/mendelian.trios -d | grep -v ^#');
+test_vcf_plugin($opts,in=>'mendelian.trios',out=>'mendelian.trios.2.out',cmd=>'+mendelian --no-version',args=>'-- -T {PATH}/mendelian.trios -lx | grep -v ^#');
+test_vcf_prune($opts,in=>'prune',out=>'prune.out',args=>'-l 0.5');
+test_vcf_prune($opts,in=>'prune.threads',out=>'prune.threads.out',args=>'-l 0.8 -w 3000');
+test_vcf_prune($opts,in=>'prune.threads',out=>'prune.threads.out',args=>'-l 0.8 -w 3000 --threads 2');
+test_vcf_prune($opts,in=>'prune.threads',out=>'prune.threads.out',args=>'-l 0.8 -w 3000 --threads 2 --parallel');
 test_vcf_concat($opts,in=>['concat.1.a','concat.1.b'],out=>'concat.1.vcf.out',do_bcf=>0,args=>'');
 test_vcf_concat($opts,in=>['concat.1.a','concat.1.b'],out=>'concat.1.bcf.out',do_bcf=>1,args=>'');
+test_vcf_concat($opts,in=>['concat.1.a','concat.1.b'],out=>'concat.1.vcf.out',do_bcf=>0,args=>'--threads 2');
+test_vcf_concat($opts,in=>['concat.1.a','concat.1.b'],out=>'concat.1.bcf.out',do_bcf=>1,args=>'--threads 2');
 test_vcf_concat($opts,in=>['concat.2.a','concat.2.b'],out=>'concat.2.vcf.out',do_bcf=>0,args=>'-a');
 test_vcf_concat($opts,in=>['concat.2.a','concat.2.b'],out=>'concat.2.bcf.out',do_bcf=>1,args=>'-a');
 test_vcf_concat($opts,in=>['concat.2.a','concat.2.b'],out=>'concat.4.vcf.out',do_bcf=>0,args=>'-aD');
 test_vcf_concat($opts,in=>['concat.2.a','concat.2.b'],out=>'concat.4.bcf.out',do_bcf=>1,args=>'-aD');
 test_vcf_concat($opts,in=>['concat.3.a','concat.3.b','concat.3.0','concat.3.c','concat.3.d','concat.3.e','concat.3.f'],out=>'concat.3.vcf.out',do_bcf=>0,args=>'-l');
 test_vcf_concat($opts,in=>['concat.3.a','concat.3.b','concat.3.0','concat.3.c','concat.3.d','concat.3.e','concat.3.f'],out=>'concat.3.bcf.out',do_bcf=>1,args=>'-l');
+test_vcf_concat($opts,in=>['concat.3.a','concat.3.b','concat.3.0','concat.3.c','concat.3.d','concat.3.e','concat.3.f'],out=>'concat.3.vcf.out',do_bcf=>0,args=>'-l --threads 2');
+test_vcf_concat($opts,in=>['concat.hdr.a','concat.hdr.b','concat.hdr.c'],out=>'concat.hdr.out',do_bcf=>0,args=>'');
 test_naive_concat($opts,name=>'naive_concat',max_hdr_lines=>10000,max_body_lines=>10000,nfiles=>10);
 test_vcf_reheader($opts,in=>'reheader',out=>'reheader.1.out',header=>'reheader.hdr');
 test_vcf_reheader($opts,in=>'reheader',out=>'reheader.2.out',samples=>'reheader.samples');
 test_vcf_reheader($opts,in=>'reheader',out=>'reheader.2.out',samples=>'reheader.samples2');
 test_vcf_reheader($opts,in=>'reheader',out=>'reheader.3.out',samples=>'reheader.samples3');
 test_vcf_reheader($opts,in=>'reheader',out=>'reheader.4.out',samples=>'reheader.samples4');
+test_vcf_reheader($opts,in=>'reheader.big',out=>'reheader.big.out',samples=>'reheader.big.samples');
 test_vcf_reheader($opts,in=>'empty',out=>'reheader.empty.out',header=>'reheader.empty.hdr');
 test_rename_chrs($opts,in=>'annotate');
 test_vcf_convert($opts,in=>'convert',out=>'convert.gs.gt.gen',args=>'-g -,.');
 test_vcf_convert($opts,in=>'convert',out=>'convert.gs.gt.samples',args=>'-g .,-');
 test_vcf_convert($opts,in=>'convert',out=>'convert.gs.pl.gen',args=>'-g -,. --tag PL');
 test_vcf_convert($opts,in=>'convert',out=>'convert.gs.pl.samples',args=>'-g .,- --tag PL');
+test_vcf_convert($opts,in=>'convert.gp',out=>'convert.gs.gp.gen',args=>'-g -,. --tag GP');
+test_vcf_convert_columnar($opts,in=>'convert.columnar',out=>'convert.columnar.out',args=>'-c CHROM,POS,REF,FMT/GT,DP');
 test_vcf_convert($opts,in=>'check',out=>'check.gs.vcfids.gen',args=>'-g -,. --vcf-ids');
 test_vcf_convert($opts,in=>'check',out=>'check.gs.vcfids.samples',args=>'-g .,- --vcf-ids');
 test_vcf_convert($opts,in=>'check',out=>'check.gs.chrom.gen',args=>'-g -,. --chrom');
@@ -267,9 +432,15 @@ test_vcf_convert($opts,in=>'convert',out=>'convert.hls.legend',args=>'-h .,-,.')
 test_vcf_convert($opts,in=>'convert',out=>'convert.hls.samples',args=>'-h .,.,-');
 test_vcf_convert_hls2vcf($opts,h=>'convert.hls.gt.hap',l=>'convert.hls.gt.legend',s=>'convert.hls.gt.samples',out=>'convert.gt.noHead.vcf',args=>'-H');
 test_vcf_convert_hs2vcf($opts,h=>'convert.hs.gt.hap',s=>'convert.hs.gt.samples',out=>'convert.gt.noHead.vcf',args=>'--hapsample2vcf');
+test_vcf_convert_hs2vcf($opts,h=>'convert.hs.big.hap',s=>'convert.hs.gt.samples',out=>'convert.hs.big.vcf',args=>'--hapsample2vcf');
+test_vcf_convert_hs2vcf($opts,h=>'convert.hs.big.hap',s=>'convert.hs.gt.samples',out=>'convert.hs.big.vcf',args=>'--hapsample2vcf --threads 2');
 test_vcf_convert($opts,in=>'convert',out=>'convert.hs.hap',args=>'--hapsample -,.');
 test_vcf_convert($opts,in=>'convert',out=>'convert.hs.sample',args=>'--hapsample .,-');
+test_vcf_convert($opts,in=>'convert.gts',out=>'convert.gts.hap',args=>'--hapsample -,.');
+test_vcf_convert($opts,in=>'convert.gts',out=>'convert.gts.dip.hap',args=>'--hapsample -,. --haploid2diploid');
 test_vcf_convert_gvcf($opts,in=>'convert.gvcf',out=>'convert.gvcf.out',fa=>'gvcf.fa',args=>'--gvcf2vcf');
+test_vcf_convert_gvcf($opts,in=>'convert.gvcf',out=>'convert.gvcf.tgt.out',fa=>'gvcf.fa',args=>'--gvcf2vcf -t 22:5,22:53-54,22:86,22:100-103,22:205,22:460');
+test_vcf_convert_gvcf($opts,in=>'convert.gvcf',out=>'convert.gvcf.tgt.out',fa=>'gvcf.fa',args=>'--gvcf2vcf -T {PATH}/convert.gvcf.tgt.tab');
 test_vcf_convert_tsv2vcf($opts,in=>'convert.23andme',out=>'convert.23andme.vcf',args=>'-c ID,CHROM,POS,AA -s SAMPLE1',fai=>'23andme');
 test_vcf_consensus($opts,in=>'consensus',out=>'consensus.1.out',fa=>'consensus.fa',mask=>'consensus.tab',args=>'');
 test_vcf_consensus_chain($opts,in=>'consensus',out=>'consensus.1.chain',chain=>'consensus.1.chain',fa=>'consensus.fa',mask=>'consensus.tab',args=>'');
@@ -281,27 +452,48 @@ test_vcf_consensus($opts,in=>'consensus',out=>'consensus.4.out',fa=>'consensus.f
 test_vcf_consensus_chain($opts,in=>'consensus',out=>'consensus.4.chain',chain=>'consensus.4.chain',fa=>'consensus.fa',args=>'-H 1');
 test_vcf_consensus($opts,in=>'consensus2',out=>'consensus2.1.out',fa=>'consensus2.fa',args=>'-H 1');
 test_vcf_consensus($opts,in=>'consensus2',out=>'consensus2.2.out',fa=>'consensus2.fa',args=>'-H 2');
+test_vcf_consensus_multi($opts,in=>'consensus2',out=>'consensus2.12.out',fa=>'consensus2.fa',files=>[qw(NA001.1 NA001.2)],args=>'-H 1,2');
+test_vcf_consensus_multi($opts,in=>'consensus2',out=>'consensus2.12.out',fa=>'consensus2.fa',files=>[qw(NA001.1 NA001.2)],args=>'-H 1,2 --threads 2');
 test_vcf_consensus($opts,in=>'empty',out=>'consensus.5.out',fa=>'consensus.fa',args=>'');
+test_vcf_consensus($opts,in=>'consensus.cursor',out=>'consensus.cursor.out',fa=>'consensus.fa',mask=>'consensus.cursor.tab',args=>'');
+test_vcf_consensus($opts,in=>'consensus.cursor',out=>'consensus.cursor.out',fa=>'consensus.fa',mask=>'consensus.cursor.ridx',args=>'');
 test_mpileup($opts,in=>[qw(mpileup.1 mpileup.2 mpileup.3)],out=>'mpileup/mpileup.1.out',args=>q[-r17:100-150],test_list=>1);
 test_mpileup($opts,in=>[qw(mpileup.1 mpileup.2 mpileup.3)],out=>'mpileup/mpileup.2.out',args=>q[-a DP,DV -r17:100-600]); # test files from samtools mpileup test suite
+test_mpileup($opts,in=>[qw(mpileup.1 mpileup.2 mpileup.3)],out=>'mpileup/mpileup.2.out',args=>q[-a DP,DV -r17:100-600 --threads 2]);
+test_mpileup($opts,in=>[qw(mpileup.1 mpileup.2 mpileup.3)],out=>'mpileup/mpileup.2.out',args=>q[-a DP,DV -r17:100-200,17:201-300,17:301-400,17:401-500,17:501-600 --threads 2]);
+test_mpileup($opts,in=>[qw(mpileup.1 mpileup.2 mpileup.3)],out=>'mpileup/mpileup.2.out',args=>q[-a DP,DV -r17:100-600 --downsample 10000 --seed 1]);
+test_mpileup($opts,in=>[qw(mpileup.1 mpileup.2 mpileup.3)],out=>'mpileup/mpileup.lazy-baq.out',args=>q[-a DP,DV -r17:100-600 --lazy-BAQ],query=>'%CHROM\\t%POS\\t%REF\\t%ALT\\n');
 test_mpileup($opts,in=>[qw(mpileup.1)],out=>'mpileup/mpileup.3.out',args=>q[-B --ff 0x14 -r17:1050-1060]); # test file converted to vcf from samtools mpileup test suite
 test_mpileup($opts,in=>[qw(mpileup.1 mpileup.2 mpileup.3)],out=>'mpileup/mpileup.4.out',args=>q[-a DP,DPR,DV,DP4,INFO/DPR,SP -r17:100-600]); #test files from samtools mpileup test suite
 test_mpileup($opts,in=>[qw(mpileup.1 mpileup.2 mpileup.3)],out=>'mpileup/mpileup.5.out',args=>q[-a DP,AD,ADF,ADR,SP,INFO/AD,INFO/ADF,INFO/ADR -r17:100-600]);
 test_mpileup($opts,in=>[qw(mpileup.1 mpileup.2 mpileup.3)],out=>'mpileup/mpileup.6.out',args=>q[-a DP,DV -r17:100-600 --gvcf 0,2,5]);
+test_mpileup($opts,in=>[qw(mpileup.1 mpileup.2 mpileup.3)],out=>'mpileup/mpileup.6.out',args=>q[-a DP,DV -r17:100-600 --gvcf 0,2,5 --threads 2]);
 test_mpileup($opts,in=>[qw(mpileup.1 mpileup.2 mpileup.3)],out=>'mpileup/mpileup.6.out',args=>q[-a DP,DV -r17:100-200,17:201-300,17:301-400,17:401-500,17:501-600 --gvcf 0,2,5]);
+test_mpileup($opts,in=>[qw(mpileup.1 mpileup.2 mpileup.3)],out=>'mpileup/mpileup.6.b05.out',args=>q[-a DP,DV -r17:100-600 --gvcf 0,5]);
 test_mpileup($opts,in=>[qw(mpileup.1 mpileup.2 mpileup.3)],out=>'mpileup/mpileup.7.out',args=>q[-r17:100-150 -s HG00101,HG00102]);
 test_mpileup($opts,in=>[qw(mpileup.1 mpileup.2 mpileup.3)],out=>'mpileup/mpileup.7.out',args=>q[-r17:100-150 -S {PATH}/mplp.samples]);
 test_mpileup($opts,in=>[qw(mpileup.1 mpileup.2 mpileup.3)],out=>'mpileup/mpileup.8.out',args=>q[-r17:100-150 -s ^HG00101,HG00102]);
 test_mpileup($opts,in=>[qw(mpileup.1 mpileup.2 mpileup.3)],out=>'mpileup/mpileup.8.out',args=>q[-r17:100-150 -S ^{PATH}/mplp.samples]);
 test_mpileup($opts,in=>[qw(mpileup.1 mpileup.2 mpileup.3)],out=>'mpileup/mpileup.9.out',args=>q[-t17:100-150 -S {PATH}/mplp.9.samples]);
+test_mpileup($opts,in=>[qw(mpileup.1 mpileup.2 mpileup.3)],out=>'mpileup/mpileup.9.out',args=>q[-t17:100-150 -S {PATH}/mplp.9.samples --threads 2]);
+test_mpileup($opts,in=>[qw(mpileup.1 mpileup.2 mpileup.3)],out=>'mpileup/mpileup.9.out',args=>q[-T {PATH}/mplp.targets -S {PATH}/mplp.9.samples --threads 2]);
 test_mpileup($opts,in=>[qw(mpileup.1 mpileup.2 mpileup.3)],out=>'mpileup/mpileup.10.out',args=>q[-t17:100-150 -G {PATH}/mplp.10.samples]);
+test_mpileup($opts,in=>[qw(mpileup.1 mpileup.2 mpileup.3)],out=>'mpileup/mpileup.10.out',args=>q[-t17:100-150 -G {PATH}/mplp.10.samples --threads 2]);
+test_mpileup($opts,in=>[qw(mpileup.1 mpileup.2 mpileup.3)],out=>'mpileup/mpileup.7.out',args=>q[-r17:100-150 -s HG00101,HG00102 --threads 2]);
 test_mpileup($opts,in=>[qw(mpileup.3)],out=>'mpileup/mpileup.11.out',args=>q[]);
+test_mpileup($opts,in=>[qw(mpileup.3)],out=>'mpileup/mpileup.11.out',args=>q[--threads 2]);
 test_mpileup($opts,in=>[qw(mpileup.3 mpileup.4)],out=>'mpileup/mpileup.11.out',args=>q[-s HG00102]);
 test_mpileup($opts,in=>[qw(mpileup.3 mpileup.4)],out=>'mpileup/mpileup.11.out',args=>q[-s ^HG99999]);
 test_mpileup($opts,in=>[qw(mpileup.3 mpileup.4)],out=>'mpileup/mpileup.11.out',args=>q[-G {PATH}/mplp.11.rgs]);
 test_mpileup($opts,in=>[qw(mpileup.3 mpileup.4)],out=>'mpileup/mpileup.11.out',args=>q[-G {PATH}/mplp.11.rgs]);
 test_mpileup($opts,in=>[qw(indel-AD.1)],out=>'mpileup/indel-AD.1.out',ref=>'indel-AD.1.fa',args=>q[-a AD]);
+test_mpileup($opts,in=>[qw(indel-AD.1)],out=>'mpileup/indel-AD.1.out',ref=>'indel-AD.1.fa',args=>q[-a AD --open-prob 40 -e 20 -h 100]);
 test_csq($opts,in=>'csq',out=>'csq.1.out',cmd=>'-f {PATH}/csq.fa -g {PATH}/csq.gff3');
+test_csq($opts,in=>'csq',out=>'csq.1.out',build_cache=>'-g {PATH}/csq.gff3 --build-cache {TMP}/csq.cache',cmd=>'-f {PATH}/csq.fa --cache {TMP}/csq.cache');
+test_csq($opts,in=>'csq',out=>'csq.1.out',index=>1,cmd=>'-f {PATH}/csq.fa -g {PATH}/csq.gff3 --threads 2');
+test_csq($opts,in=>'csq.smpl',out=>'csq.1.out',cmd=>'-f {PATH}/csq.fa -g {PATH}/csq.gff3');
+test_csq($opts,in=>'csq.smpl',out=>'csq.1.out',index=>1,cmd=>'-f {PATH}/csq.fa -g {PATH}/csq.gff3 --threads 2');
+test_csq($opts,in=>'csq.sparse',out=>'csq.sparse.out',cmd=>'-f {PATH}/csq.fa -g {PATH}/csq.sparse.gff3 --ncsq 20 --sparse-BCSQ',query=>'%POS\\t%BCSQ_SMPL\\n');
 test_csq_real($opts,in=>'csq');
 
 print "\nNumber of tests:\n";
@@ -504,49 +696,76 @@ sub test_tabix
 sub test_index
 {
     my ($opts,%args) = @_;
+    my $iargs = exists($args{index_args}) ? $args{index_args} : '';
     cmd("$$opts{bin}/bcftools view -Oz $$opts{path}/$args{in}.vcf > $$opts{tmp}/$args{in}.vcf.gz");
-    cmd("$$opts{bin}/bcftools index -f $$opts{tmp}/$args{in}.vcf.gz");
+    cmd("$$opts{bin}/bcftools index $iargs -f $$opts{tmp}/$args{in}.vcf.gz");
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools view -H $$opts{tmp}/$args{in}.vcf.gz $args{reg}");
 
     cmd("$$opts{bin}/bcftools view -Ob $$opts{path}/$args{in}.vcf > $$opts{tmp}/$args{in}.bcf");
-    cmd("$$opts{bin}/bcftools index -f $$opts{tmp}/$args{in}.bcf");
+    cmd("$$opts{bin}/bcftools index $iargs -f $$opts{tmp}/$args{in}.bcf");
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools view -H $$opts{tmp}/$args{in}.bcf $args{reg}");
 
     # output path
     unlink("$$opts{tmp}/$args{in}.bcf.csi", "$$opts{tmp}/$args{in}.bcf.csi", "$$opts{tmp}/$args{in}.vcf.gz.tbi");
-    cmd("$$opts{bin}/bcftools index -fo $$opts{tmp}/$args{in}.csi $$opts{tmp}/$args{in}.bcf");
+    cmd("$$opts{bin}/bcftools index $iargs -fo $$opts{tmp}/$args{in}.csi $$opts{tmp}/$args{in}.bcf");
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools view -H $$opts{tmp}/$args{in}.bcf $args{reg}");
 
     # streaming
-    cmd("$$opts{bin}/bcftools view -Oz $$opts{path}/$args{in}.vcf | tee $$opts{tmp}/$args{in}.vcf.gz | $$opts{bin}/bcftools index -fo $$opts{tmp}/$args{in}.vcf.gz.csi");
+    cmd("$$opts{bin}/bcftools view -Oz $$opts{path}/$args{in}.vcf | tee $$opts{tmp}/$args{in}.vcf.gz | $$opts{bin}/bcftools index $iargs -fo $$opts{tmp}/$args{in}.vcf.gz.csi");
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools view -H $$opts{tmp}/$args{in}.vcf.gz $args{reg}");
 
-    cmd("$$opts{bin}/bcftools view -Ob $$opts{path}/$args{in}.vcf | tee $$opts{tmp}/$args{in}.bcf | $$opts{bin}/bcftools index -fo $$opts{tmp}/$args{in}.bcf.csi");
+    cmd("$$opts{bin}/bcftools view -Ob $$opts{path}/$args{in}.vcf | tee $$opts{tmp}/$args{in}.bcf | $$opts{bin}/bcftools index $iargs -fo $$opts{tmp}/$args{in}.bcf.csi");
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools view -H $$opts{tmp}/$args{in}.bcf $args{reg}");
 }
 
+sub test_vcf_write_index
+{
+    my ($opts,%args) = @_;
+    for my $fmt (qw(b z))
+    {
+        my $out = "$$opts{tmp}/$args{in}.$args{cmd}." . ($fmt eq 'b' ? 'bcf' : 'vcf.gz');
+        unlink("$out.csi");
+        test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools $args{cmd} $args{args} --write-index -O$fmt -o $out $$opts{path}/$args{in}.vcf && $$opts{bin}/bcftools view -H -r $args{reg} $out");
+    }
+}
 sub test_vcf_idxstats
 {
     my ($opts,%args) = @_;
+    my $pipe = exists($args{pipe}) ? "| $args{pipe}" : '';
     cmd("$$opts{bin}/bcftools view -Oz $$opts{path}/$args{in}.vcf > $$opts{tmp}/$args{in}.vcf.gz");
     cmd("$$opts{bin}/bcftools index --tbi -f $$opts{tmp}/$args{in}.vcf.gz");
-    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools index $args{args} $$opts{tmp}/$args{in}.vcf.gz");
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools index $args{args} $$opts{tmp}/$args{in}.vcf.gz $pipe");
     unlink("$$opts{tmp}/$args{in}.vcf.gz.tbi");
     cmd("$$opts{bin}/bcftools index --csi -f $$opts{tmp}/$args{in}.vcf.gz");
-    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools index $args{args} $$opts{tmp}/$args{in}.vcf.gz");
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools index $args{args} $$opts{tmp}/$args{in}.vcf.gz $pipe");
     unlink("$$opts{tmp}/$args{in}.vcf.gz.csi");
 
     cmd("$$opts{bin}/bcftools view -Ob $$opts{path}/$args{in}.vcf > $$opts{tmp}/$args{in}.bcf");
     cmd("$$opts{bin}/bcftools index -f $$opts{tmp}/$args{in}.bcf");
-    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools index $args{args} $$opts{tmp}/$args{in}.bcf");
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools index $args{args} $$opts{tmp}/$args{in}.bcf $pipe");
+}
+
+sub test_vcf_idxshards
+{
+    my ($opts,%args) = @_;
+    cmd("$$opts{bin}/bcftools view -Oz $$opts{path}/$args{in}.vcf > $$opts{tmp}/$args{in}.vcf.gz");
+    cmd("$$opts{bin}/bcftools index -f $$opts{tmp}/$args{in}.vcf.gz");
+    my $in = "$$opts{tmp}/$args{in}.vcf.gz";
+    test_cmd($opts,%args,cmd=>"for reg in `$$opts{bin}/bcftools index $args{args} $in`; do $$opts{bin}/bcftools view -H -t \$reg $in; done");
+
+    cmd("$$opts{bin}/bcftools view -Ob $$opts{path}/$args{in}.vcf > $$opts{tmp}/$args{in}.bcf");
+    cmd("$$opts{bin}/bcftools index -f $$opts{tmp}/$args{in}.bcf");
+    $in = "$$opts{tmp}/$args{in}.bcf";
+    test_cmd($opts,%args,cmd=>"for reg in `$$opts{bin}/bcftools index $args{args} $in`; do $$opts{bin}/bcftools view -H -t \$reg $in; done");
 }
 
 sub test_vcf_check
 {
     my ($opts,%args) = @_;
+    my $args = exists($args{args}) ? $args{args} : '';
     bgzip_tabix_vcf($opts,$args{in});
-    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools stats -s - $$opts{tmp}/$args{in}.vcf.gz | grep -v '^# The command' | grep -v '^# This' | grep -v '^ID\t'");
-    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools view -Ob $$opts{tmp}/$args{in}.vcf.gz | $$opts{bin}/bcftools stats -s - | grep -v '^# The command' | grep -v '^# This' | grep -v '^ID\t'");
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools stats -s - $args $$opts{tmp}/$args{in}.vcf.gz | grep -v '^# The command' | grep -v '^# This' | grep -v '^ID\t'");
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools view -Ob $$opts{tmp}/$args{in}.vcf.gz | $$opts{bin}/bcftools stats -s - $args | grep -v '^# The command' | grep -v '^# This' | grep -v '^ID\t'");
 }
 
 sub test_vcf_check_merge
@@ -560,6 +779,21 @@ sub test_vcf_check_merge
     test_cmd($opts,%args,cmd=>"$$opts{bin}/misc/plot-vcfstats -m $$opts{tmp}/$args{in}.1.chk $$opts{tmp}/$args{in}.2.chk $$opts{tmp}/$args{in}.3.chk $$opts{tmp}/$args{in}.4.chk 2>/dev/null | grep -v 'plot-vcfstats' | grep -v '^# The command' | grep -v '^# This' | grep -v '^ID\t'");
 }
 
+sub test_vcf_stats_dump
+{
+    my ($opts,%args) = @_;
+    bgzip_tabix_vcf($opts,$args{in});
+    my @dumps;
+    for my $reg (@{$args{regs}})
+    {
+        cmd("$$opts{bin}/bcftools stats -s - -r $reg --dump $$opts{tmp}/$args{in}.$reg.dump $$opts{tmp}/$args{in}.vcf.gz > /dev/null");
+        push @dumps, "$$opts{tmp}/$args{in}.$reg.dump";
+    }
+    my $dumps = join(' ',@dumps);
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools stats --merge $dumps | grep -v '^# The command' | grep -v '^# This' | grep -v '^ID\t'");
+    cmd("$$opts{bin}/bcftools stats --merge --dump $$opts{tmp}/$args{in}.dump $dumps > /dev/null");
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools stats --merge $$opts{tmp}/$args{in}.dump | grep -v '^# The command' | grep -v '^# This' | grep -v '^ID\t'");
+}
 sub test_vcf_stats
 {
     my ($opts,%args) = @_;
@@ -582,6 +816,12 @@ sub test_vcf_merge
     }
     my $args  = exists($args{args}) ? $args{args} : '';
     my $files = join(' ',@files);
+    if ( exists($args{fmt}) )
+    {
+        test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools merge $args $files | $$opts{bin}/bcftools query -f '$args{fmt}'");
+        test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools merge -Ob $args $files | $$opts{bin}/bcftools query -f '$args{fmt}'");
+        return;
+    }
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools merge --no-version $args $files");
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools merge -Ob $args $files | $$opts{bin}/bcftools view | grep -v ^##bcftools_");
 }
@@ -597,6 +837,10 @@ sub test_vcf_isec
     my $files = join(' ',@files);
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools isec $args{args} $files 2>/dev/null");
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools isec -Ob $args{args} $files 2>/dev/null");
+    if ( exists($args{summary}) )
+    {
+        test_cmd($opts,%args,out=>$args{summary},cmd=>"$$opts{bin}/bcftools isec $args{args} --summary $$opts{tmp}/$args{summary} $files 2>/dev/null >/dev/null && grep ^COUNT $$opts{tmp}/$args{summary}");
+    }
 }
 sub test_vcf_isec2
 {
@@ -612,12 +856,92 @@ sub test_vcf_isec2
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools isec --no-version  $args{args} -T $$opts{tmp}/$args{tab_in}.tab.gz $files 2>/dev/null");
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools isec -Ob $args{args} -T $$opts{tmp}/$args{tab_in}.tab.gz $files 2>/dev/null | $$opts{bin}/bcftools view | grep -v ^##bcftools_");
 }
+sub test_vcf_gtcheck
+{
+    my ($opts,%args) = @_;
+    bgzip_tabix_vcf($opts,$args{in});
+    if ( !exists($args{gt}) )
+    {
+        my $grep = exists($args{grep}) ? $args{grep} : '^ERR';
+        test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools gtcheck $args{args} $$opts{tmp}/$args{in}.vcf.gz 2>/dev/null | grep -E '$grep'");
+        return;
+    }
+    bgzip_tabix_vcf($opts,$args{gt});
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools gtcheck $args{args} -g $$opts{tmp}/$args{gt}.vcf.gz $$opts{tmp}/$args{in}.vcf.gz 2>/dev/null | grep ^CN");
+    cmd("$$opts{bin}/bcftools gtcheck --build-db $$opts{tmp}/$args{gt}.db $$opts{tmp}/$args{gt}.vcf.gz 2>/dev/null");
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools gtcheck $args{args} --db $$opts{tmp}/$args{gt}.db $$opts{tmp}/$args{in}.vcf.gz 2>/dev/null | grep ^CN");
+}
+sub test_vcf_roh
+{
+    my ($opts,%args) = @_;
+    bgzip_tabix_vcf($opts,$args{in});
+    if ( exists($args{af}) )
+    {
+        bgzip_tabix($opts,file=>"$args{af}",suffix=>'tab',args=>'-s1 -b2 -e2');
+        bgzip_tabix_vcf($opts,"$args{af}");
+        cmd("$$opts{bin}/bcftools view --no-version -Ob -o $$opts{tmp}/$args{af}.bcf $$opts{tmp}/$args{af}.vcf.gz");
+        cmd("$$opts{bin}/bcftools index -f $$opts{tmp}/$args{af}.bcf");
+    }
+    $args{args} =~ s/{PATH}/$$opts{path}/g;
+    $args{args} =~ s/{TMP}/$$opts{tmp}/g;
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools roh $args{args} $$opts{tmp}/$args{in}.vcf.gz 2>/dev/null | grep ^RG | cut -f1-7");
+}
+sub test_vcf_cnv
+{
+    my ($opts,%args) = @_;
+    bgzip_tabix_vcf($opts,$args{in});
+    my $summary = join(' ',map { "$$opts{tmp}/cnv/summary.$_.tab" } @{$args{samples}});
+    cmd("rm -rf $$opts{tmp}/cnv");
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools cnv $args{args} -o $$opts{tmp}/cnv $$opts{tmp}/$args{in}.vcf.gz 2>/dev/null && cat $summary | grep ^RG | cut -f1-5,7,8");
+}
+sub test_polysomy
+{
+    my ($opts,%args) = @_;
+    bgzip_tabix_vcf($opts,$args{in});
+    $args{args} =~ s/{TMP}/$$opts{tmp}/g;
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools polysomy $args{args} -o $$opts{tmp}/polysomy $$opts{tmp}/$args{in}.vcf.gz 2>/dev/null && grep -v ^# $$opts{tmp}/polysomy/dist.dat");
+}
+sub test_vcf_som
+{
+    my ($opts,%args) = @_;
+    my $in = "$$opts{path}/$args{in}";
+    if ( exists($args{convert}) )
+    {
+        cmd("$$opts{bin}/bcftools som --convert $$opts{tmp}/$args{in}.bin $in");
+        $in = "$$opts{tmp}/$args{in}.bin";
+        test_cmd($opts,%args,out=>$args{convert},cmd=>"od -An -tx1 -v $in");
+    }
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools som --train $args{args} -p $$opts{tmp}/som $in 2>/dev/null && $$opts{bin}/bcftools som --classify $args{cargs} -p $$opts{tmp}/som $in 2>/dev/null");
+}
 sub test_vcf_query
 {
     my ($opts,%args) = @_;
     bgzip_tabix_vcf($opts,$args{in});
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools query $args{args} $$opts{tmp}/$args{in}.vcf.gz");
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools view -Ob $$opts{tmp}/$args{in}.vcf.gz | $$opts{bin}/bcftools query $args{args}");
+    if ( $args{ubcf} )
+    {
+        # uncompressed BCF on disk, read through mmap when possible
+        cmd("$$opts{bin}/bcftools view -Ou -o $$opts{tmp}/$args{in}.u.bcf $$opts{tmp}/$args{in}.vcf.gz");
+        test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools query $args{args} $$opts{tmp}/$args{in}.u.bcf");
+    }
+}
+sub test_vcf_sort
+{
+    my ($opts,%args) = @_;
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools sort $args{args} -T $$opts{tmp} $$opts{path}/$args{in}.vcf | grep -v ^#");
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools sort -Ob $args{args} -T $$opts{tmp} $$opts{path}/$args{in}.vcf | $$opts{bin}/bcftools view -H");
+}
+sub test_vcf_query_gti
+{
+    my ($opts,%args) = @_;
+    cmd("$$opts{bin}/bcftools view -Oz -o $$opts{tmp}/$args{in}.gti.vcf.gz $$opts{path}/$args{in}.vcf");
+    cmd("$$opts{bin}/bcftools view -Ob -o $$opts{tmp}/$args{in}.gti.bcf $$opts{path}/$args{in}.vcf");
+    for my $file ("$args{in}.gti.vcf.gz","$args{in}.gti.bcf")
+    {
+        cmd("$$opts{bin}/bcftools index -f --gt $$opts{tmp}/$file");
+        test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools query $args{args} $$opts{tmp}/$file");
+    }
 }
 sub test_vcf_convert
 {
@@ -626,6 +950,13 @@ sub test_vcf_convert
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools convert $args{args} $$opts{tmp}/$args{in}.vcf.gz 2>/dev/null");
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools view -Ob $$opts{tmp}/$args{in}.vcf.gz | $$opts{bin}/bcftools convert $args{args} 2>/dev/null");
 }
+sub test_vcf_convert_columnar
+{
+    my ($opts,%args) = @_;
+    bgzip_tabix_vcf($opts,$args{in});
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools convert --columnar - $args{args} $$opts{tmp}/$args{in}.vcf.gz 2>/dev/null | od -An -tx1 -v");
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools view -Ob $$opts{tmp}/$args{in}.vcf.gz | $$opts{bin}/bcftools convert --columnar - $args{args} 2>/dev/null | od -An -tx1 -v");
+}
 sub test_vcf_convert_hls2vcf
 {
     my ($opts,%args) = @_;
@@ -643,6 +974,7 @@ sub test_vcf_convert_hs2vcf
 sub test_vcf_convert_gvcf
 {
     my ($opts,%args) = @_;
+    $args{args} =~ s/{PATH}/$$opts{path}/g;
     bgzip_tabix_vcf($opts,$args{in});
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools convert --no-version $args{args} -f $$opts{path}/$args{fa} $$opts{tmp}/$args{in}.vcf.gz 2>/dev/null");
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools view -Ob $$opts{tmp}/$args{in}.vcf.gz | $$opts{bin}/bcftools convert $args{args} -f $$opts{path}/$args{fa} 2>/dev/null | grep -v ^##bcftools");
@@ -682,8 +1014,14 @@ sub test_vcf_call
 {
     my ($opts,%args) = @_;
     $args{args} =~ s/{PATH}/$$opts{path}/g;
-    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools call --no-version $args{args} $$opts{path}/$args{in}.vcf 2>/dev/null");
-    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools call -Ob $args{args} $$opts{path}/$args{in}.vcf 2>/dev/null | $$opts{bin}/bcftools view | grep -v ^##bcftools_");
+    my $in_fname = "$$opts{path}/$args{in}.vcf";
+    if ( exists($args{bcf}) )
+    {
+        cmd("$$opts{bin}/bcftools view -Ob $in_fname > $$opts{tmp}/$args{in}.bcf");
+        $in_fname = "$$opts{tmp}/$args{in}.bcf";
+    }
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools call --no-version $args{args} $in_fname 2>/dev/null");
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools call -Ob $args{args} $in_fname 2>/dev/null | $$opts{bin}/bcftools view | grep -v ^##bcftools_");
 }
 sub test_vcf_call_cAls
 {
@@ -703,6 +1041,12 @@ sub test_vcf_filter
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools filter $args{args} $$opts{path}/$args{in}.vcf | $pipe");
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools filter -Ob $args{args} $$opts{path}/$args{in}.vcf | $$opts{bin}/bcftools view | $pipe");
 }
+sub test_vcf_filter_stats
+{
+    my ($opts,%args) = @_;
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools filter --filter-stats $args{args} $$opts{path}/$args{in}.vcf 2>&1 >/dev/null | grep ^Filter");
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools view --filter-stats $args{args} $$opts{path}/$args{in}.vcf 2>&1 >/dev/null | grep ^Filter");
+}
 sub test_vcf_regions
 {
     my ($opts,%args) = @_;
@@ -830,6 +1174,23 @@ sub test_usage_subcommand
 
     passed($opts,$test);
 }
+sub test_rbuf
+{
+    my ($opts,%args) = @_;
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/test/test-rbuf");
+}
+sub test_bench
+{
+    my ($opts,%args) = @_;
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/test/bench.pl $args{args} | grep -v ^# | cut -f1,2");
+}
+sub test_profile
+{
+    my ($opts,%args) = @_;
+    my $counters = q[grep -o '"\(records_in\|records_out\|filter_tested\)":[0-9]*'];
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools --profile=$$opts{tmp}/profile.json $args{args} $$opts{path}/$args{in}.vcf > /dev/null && $counters $$opts{tmp}/profile.json");
+    test_cmd($opts,%args,out=>$args{txt},cmd=>"$$opts{bin}/bcftools --profile $args{args} $$opts{path}/$args{in}.vcf 2>&1 >/dev/null | grep -E '^(records_in|records_out|filter_tested)\\b'");
+}
 sub test_vcf_annotate
 {
     my ($opts,%args) = @_;
@@ -840,6 +1201,11 @@ sub test_vcf_annotate
         $annot_fname = "-a $$opts{tmp}/$args{tab}.tab.gz";
         $in_fname = "$$opts{path}/$args{in}.vcf";
         $hdr = -e "$$opts{path}/$args{in}.hdr" ? "-h $$opts{path}/$args{in}.hdr" : '';
+        if ( $args{cache} )
+        {
+            cmd("$$opts{bin}/bcftools annotate --build-cache $$opts{tmp}/$args{tab}.cache $annot_fname $hdr $args{args} $in_fname 2>/dev/null");
+            $annot_fname = "--cache $$opts{tmp}/$args{tab}.cache";
+        }
     }
     elsif ( exists($args{vcf}) )
     {
@@ -855,6 +1221,12 @@ sub test_vcf_annotate
         $annot_fname = '';
         $hdr = '';
     }
+    if ( exists($args{fmt}) )
+    {
+        test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools annotate $annot_fname $hdr $args{args} $in_fname 2>/dev/null | $$opts{bin}/bcftools query -f '$args{fmt}'");
+        test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools annotate -Ob $annot_fname $hdr $args{args} $in_fname 2>/dev/null | $$opts{bin}/bcftools query -f '$args{fmt}'");
+        return;
+    }
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools annotate $annot_fname $hdr $args{args} $in_fname 2>/dev/null | $$opts{bin}/bcftools view | grep -v ^##bcftools_");
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools annotate -Ob $annot_fname $hdr $args{args} $in_fname 2>/dev/null | $$opts{bin}/bcftools view | grep -v ^##bcftools_");
 }
@@ -879,6 +1251,38 @@ sub test_vcf_plugin
     cmd("$$opts{bin}/bcftools index -f $$opts{tmp}/$args{in}.bcf");
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools $args{cmd} $$opts{tmp}/$args{in}.bcf $args{args} 2>/dev/null | grep -v ^##bcftools_");
 }
+sub test_vcf_plugin_dosage_bin
+{
+    my ($opts,%args) = @_;
+    if ( !$$opts{test_plugins} ) { return; }
+    $ENV{BCFTOOLS_PLUGINS} = "$$opts{bin}/plugins";
+    bgzip_tabix_vcf($opts,"$args{in}");
+
+    # print the binary matrix the same way as the text output
+    my $bin   = "$$opts{tmp}/$args{in}.dosage.bin";
+    my @sites = split(/\n/, cmd("$$opts{bin}/bcftools +dosage $$opts{tmp}/$args{in}.vcf.gz -- -b $bin 2>/dev/null"));
+    my @smpl  = split(/\n/, cmd("$$opts{bin}/bcftools query -l $$opts{tmp}/$args{in}.vcf.gz"));
+    open(my $in,'<',$bin) or error("$bin: $!");
+    binmode($in);
+    open(my $out,'>',"$bin.txt") or error("$bin.txt: $!");
+    for my $site (@sites)
+    {
+        if ( $site=~/^#/ ) { print $out "$site\n"; next; }
+        read($in, my $buf, 4*scalar @smpl) == 4*scalar @smpl or error("Too few values in $bin\n");
+        print $out join("\t", $site, map { sprintf("%.1f",$_) } unpack("f*",$buf)), "\n";
+    }
+    close($out) or error("close $bin.txt");
+    close($in);
+    test_cmd($opts,%args,cmd=>"cat $bin.txt");
+}
+sub test_vcf_prune
+{
+    my ($opts,%args) = @_;
+    if ( !$$opts{test_plugins} ) { return; }
+    $ENV{BCFTOOLS_PLUGINS} = "$$opts{bin}/plugins";
+    bgzip_tabix_vcf($opts,$args{in});
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools +prune $args{args} $$opts{tmp}/$args{in}.vcf.gz 2>/dev/null | $$opts{bin}/bcftools query -f'%POS\\n'");
+}
 sub test_vcf_concat
 {
     my ($opts,%args) = @_;
@@ -938,6 +1342,13 @@ sub test_vcf_consensus
     my $chain = $args{chain} ? "-c $$opts{tmp}/$args{chain}" : '';
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools consensus $$opts{tmp}/$args{in}.vcf.gz -f $$opts{path}/$args{fa} $args{args} $mask $chain 2>/dev/null");
 }
+sub test_vcf_consensus_multi
+{
+    my ($opts,%args) = @_;
+    bgzip_tabix_vcf($opts,$args{in});
+    my $files = join(' ',map { "$$opts{tmp}/$args{in}.cns.$_.fa" } @{$args{files}});
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools consensus $$opts{tmp}/$args{in}.vcf.gz -f $$opts{path}/$args{fa} $args{args} -o $$opts{tmp}/$args{in}.cns 2>/dev/null && cat $files");
+}
 sub test_vcf_consensus_chain
 {
     my ($opts,%args) = @_;
@@ -999,6 +1410,12 @@ sub test_naive_concat
 
     my $vcfs = join('.vcf.gz ',@files).'.vcf.gz';
     test_cmd($opts,exp=>$exp,out=>"concat.naive.vcf.out",cmd=>"$$opts{bin}/bcftools concat --naive $vcfs | $$opts{bin}/bcftools view -H");
+
+    # the regions are read through the index created by --write-index
+    cmd("$$opts{bin}/bcftools concat --naive --threads 2 --write-index -o $$opts{tmp}/$args{name}.bcf $bcfs");
+    test_cmd($opts,exp=>$exp,out=>"concat.naive.bcf.out",cmd=>"$$opts{bin}/bcftools view -H $$opts{tmp}/$args{name}.bcf 1");
+    cmd("$$opts{bin}/bcftools concat --naive --threads 2 --write-index -o $$opts{tmp}/$args{name}.vcf.gz $vcfs");
+    test_cmd($opts,exp=>$exp,out=>"concat.naive.vcf.out",cmd=>"$$opts{bin}/bcftools view -H $$opts{tmp}/$args{name}.vcf.gz 1");
 }
 
 sub test_mpileup
@@ -1034,6 +1451,7 @@ sub test_mpileup
         for my $file (@{$args{in}}) { push @files, "$$opts{path}/mpileup/$file.$fmt"; }
         my $files = join(' ',@files);
         my $grep_hdr = "grep -v ^##bcftools | grep -v ^##reference";
+        if ( exists($args{query}) ) { $grep_hdr = "$$opts{bin}/bcftools query -f '$args{query}'"; }
         test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools mpileup $args{args} -f $$opts{path}/mpileup/$ref $files 2>/dev/null | $grep_hdr");
         test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools mpileup $args{args} -f $$opts{path}/mpileup/$ref -Ob $files 2>/dev/null | $$opts{bin}/bcftools view  | $grep_hdr");
         if ($args{test_list})
@@ -1048,7 +1466,25 @@ sub test_csq
 {
     my ($opts,%args) = @_;
     $args{cmd}  =~ s/{PATH}/$$opts{path}/g;
-    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools csq $args{cmd} $$opts{path}/$args{in}.vcf | $$opts{bin}/test/csq/sort-csq | $$opts{bin}/bcftools query -f'%POS\\t%REF\\t%ALT\\t%EXP\\n%POS\\t%REF\\t%ALT\\t%BCSQ\\n\\n'");
+    $args{cmd}  =~ s/{TMP}/$$opts{tmp}/g;
+    my $in = "$$opts{path}/$args{in}.vcf";
+    if ( exists($args{build_cache}) )
+    {
+        $args{build_cache} =~ s/{PATH}/$$opts{path}/g;
+        $args{build_cache} =~ s/{TMP}/$$opts{tmp}/g;
+        cmd("$$opts{bin}/bcftools csq $args{build_cache} 2>/dev/null");
+    }
+    if ( $args{index} )
+    {
+        bgzip_tabix_vcf($opts,$args{in});
+        $in = "$$opts{tmp}/$args{in}.vcf.gz";
+    }
+    if ( exists($args{query}) )
+    {
+        test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools csq $args{cmd} $in | $$opts{bin}/bcftools query -f'$args{query}'");
+        return;
+    }
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools csq $args{cmd} $in | $$opts{bin}/test/csq/sort-csq | $$opts{bin}/bcftools query -f'%POS\\t%REF\\t%ALT\\t%EXP\\n%POS\\t%REF\\t%ALT\\t%BCSQ\\n\\n'");
 }
 sub test_csq_real
 {
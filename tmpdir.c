@@ -0,0 +1,99 @@
+/*  tmpdir.c -- temporary directories removed at exit.
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <htslib/kstring.h>
+#include "bcftools.h"
+#include "tmpdir.h"
+
+static char **dirs = NULL;
+static int ndirs = 0, mdirs = 0;
+
+static int remove_dir(const char *path)
+{
+    DIR *dp = opendir(path);
+    if ( dp )
+    {
+        kstring_t str = {0,0,0};
+        struct dirent *ent;
+        while ( (ent = readdir(dp)) )
+        {
+            if ( !strcmp(".",ent->d_name) || !strcmp("..",ent->d_name) ) continue;
+            str.l = 0;
+            ksprintf(&str, "%s/%s", path, ent->d_name);
+            unlink(str.s);
+        }
+        closedir(dp);
+        free(str.s);
+    }
+    return rmdir(path);
+}
+
+static void remove_dirs(void)
+{
+    int i;
+    for (i=0; i<ndirs; i++)
+    {
+        remove_dir(dirs[i]);
+        free(dirs[i]);
+    }
+    free(dirs);
+    dirs  = NULL;
+    ndirs = mdirs = 0;
+}
+
+char *tmpdir_create(const char *dir, const char *name)
+{
+    if ( !dir ) dir = getenv("TMPDIR");
+    kstring_t str = {0,0,0};
+    ksprintf(&str, "%s/bcftools-%s.XXXXXX", dir ? dir : "/tmp", name);
+    if ( !mkdtemp(str.s) ) error("Failed to create a temporary directory %s: %s\n", str.s, strerror(errno));
+
+    if ( !mdirs ) atexit(remove_dirs);
+    if ( ndirs==mdirs )
+    {
+        mdirs = mdirs ? 2*mdirs : 2;
+        dirs  = (char**) realloc(dirs, sizeof(*dirs)*mdirs);
+        if ( !dirs ) error("Could not allocate %d bytes\n", (int)(sizeof(*dirs)*mdirs));
+    }
+    dirs[ndirs++] = strdup(str.s);
+    return str.s;
+}
+
+int tmpdir_remove(const char *path)
+{
+    int i;
+    for (i=0; i<ndirs; i++)
+        if ( !strcmp(dirs[i],path) ) break;
+    if ( i<ndirs )
+    {
+        free(dirs[i]);
+        dirs[i] = dirs[--ndirs];
+    }
+    return remove_dir(path);
+}
@@ -0,0 +1,54 @@
+/*  tmpdir.h -- temporary directories removed at exit.
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.  */
+
+/*
+    The chunks written by the --parallel modes and the runs of the external
+    sort and of the hierarchical merge go to a directory created here. The
+    directories which were not removed with tmpdir_remove() are cleaned at
+    exit, which includes error() called from a worker thread.
+
+    The directories are flat, only files are expected in them. Both functions
+    are to be called from the main thread.
+*/
+
+#ifndef __TMPDIR_H__
+#define __TMPDIR_H__
+
+/*
+ *  tmpdir_create() - create the directory <dir>/bcftools-<name>.XXXXXX
+ *  @dir:   parent directory, NULL for $TMPDIR or /tmp
+ *  @name:  the command name, used only to make the directory recognisable
+ *
+ *  Returns the path of the new directory, the caller frees it. Exits on error.
+ */
+char *tmpdir_create(const char *dir, const char *name);
+
+/*
+ *  tmpdir_remove() - remove the files left in the directory and the directory
+ *
+ *  Returns 0 on success or -1 with errno set when the directory cannot be
+ *  removed. The directory is no longer cleaned at exit in either case.
+ */
+int tmpdir_remove(const char *path);
+
+#endif
@@ -36,6 +36,8 @@ THE SOFTWARE.  */
 #include <htslib/vcf.h>
 #include <htslib/synced_bcf_reader.h>
 #include <htslib/kseq.h>
+#include <htslib/bgzf.h>
+#include <htslib/thread_pool.h>
 #include <htslib/khash_str2int.h>
 #include <dlfcn.h>
 #include "bcftools.h"
@@ -54,6 +56,15 @@ typedef struct _rm_tag_t
 }
 rm_tag_t;
 
+// Numeric values parsed from a column of the annotation file, kept with the
+// annotation line so that consecutive VCF records do not parse them again
+typedef struct
+{
+    int parsed, n, nper, m;     // n values in total, nper per sample (FORMAT fields)
+    void *vals;
+}
+annot_vals_t;
+
 typedef struct
 {
     char **cols;
@@ -62,6 +73,8 @@ typedef struct
     int nals, mals;
     kstring_t line;
     int rid, start, end;
+    annot_vals_t *vals;     // indexed by column
+    int mvals;
 }
 annot_line_t;
 
@@ -84,8 +97,18 @@ annot_col_t;
 #define MARK_LISTED   1
 #define MARK_UNLISTED 2
 
+typedef struct _annot_cache_t annot_cache_t;
+typedef struct _annot_batch_t annot_batch_t;
+
+// Number of records processed by a worker thread at once
+#define BATCH_SIZE 1000
+
 typedef struct _args_t
 {
+    annot_batch_t *batches;     // with --threads, see annot_batch_t
+    int nbatches, nbusy;
+    hts_tpool_process *tpool_q;
+
     bcf_srs_t *files;
     bcf_hdr_t *hdr, *hdr_out;
     htsFile *out_fh;
@@ -98,6 +121,8 @@ typedef struct _args_t
 
     rm_tag_t *rm;           // tags scheduled for removal
     int nrm;
+    uint8_t *rm_info, *rm_fmt;  // INFO and FORMAT tags to remove, indexed by header id
+    int nrm_ids;
     int flt_keep_pass;      // when all filters removed, reset to PASS
 
     vcmp_t *vcmp;           // for matching annotation and VCF lines by allele
@@ -123,10 +148,35 @@ typedef struct _args_t
 
     char **argv, *output_fname, *targets_fname, *regions_list, *header_fname;
     char *remove_annots, *columns, *rename_chrs, *sample_names, *mark_sites;
-    int argc, drop_header, record_cmd_line, tgts_is_vcf, mark_sites_logic;
+    int argc, drop_header, record_cmd_line, tgts_is_vcf, mark_sites_logic, write_index;
+
+    // --stream: the annotation file is read in lockstep with the VCF, no index needed
+    int stream, annot_is_bed, annot_next_ok;    // annot_next_ok: 1 annot_next is loaded, 0 not, -1 EOF
+    htsFile *annot_fh;
+    kstring_t annot_str;
+    annot_line_t annot_next;
+    int prev_rid, prev_pos, vcf_rid, vcf_pos;
+
+    // --build-cache/--cache: binary columnar copy of the -a file, see annot_cache_t
+    char *cache_fname;
+    int build_cache;
+    annot_cache_t *cache;
 }
 args_t;
 
+// With --threads, batches of records are filtered and annotated by worker
+// threads. Each batch has a private copy of the arguments with its own
+// buffers, filter, vcmp and set_ids, and a copy of the annotation matching
+// each record, found by the main thread.
+struct _annot_batch_t
+{
+    args_t args;
+    bcf1_t **lines, **arecs;    // the records and the matching records from the -a VCF
+    annot_line_t *tabs;         // the matching lines from the tab-delimited -a file
+    uint8_t *has_annot, *pass;
+    int nlines;
+};
+
 char *msprintf(const char *fmt, ...);
 
 void remove_id(args_t *args, bcf1_t *line, rm_tag_t *tag)
@@ -169,6 +219,105 @@ void remove_format_tag(args_t *args, bcf1_t *line, rm_tag_t *tag)
 {
     bcf_update_format(args->hdr, line, tag->key, NULL, 0, BCF_HT_INT);  // the type does not matter with n=0
 }
+static inline uint8_t *skip_typed_vector(uint8_t *ptr, int nmul)
+{
+    int type, n = bcf_dec_size(ptr, &ptr, &type);
+    return ptr + nmul * (n << bcf_type_shift[type]);
+}
+
+// Remove the INFO fields marked in args->rm_info from a record which has not
+// been unpacked yet. The fields are skipped by their encoded lengths and the
+// remaining ones moved down in place, so that the pointers set by a partial
+// bcf_unpack(BCF_UN_STR) remain valid. Returns -1 if the record is unpacked.
+static int remove_info_raw(args_t *args, bcf1_t *line)
+{
+    if ( (line->unpacked & BCF_UN_INFO) || line->d.shared_dirty || !line->shared.l ) return -1;
+
+    uint8_t *ptr = (uint8_t*) line->shared.s, *end = ptr + line->shared.l;
+    int i, nkeep = 0;
+    ptr = skip_typed_vector(ptr, 1);        // ID
+    for (i=0; i<line->n_allele; i++)
+        ptr = skip_typed_vector(ptr, 1);    // REF and ALT
+    ptr = skip_typed_vector(ptr, 1);        // FILTER
+    uint8_t *dst = ptr;
+    for (i=0; i<line->n_info; i++)
+    {
+        uint8_t *beg = ptr;
+        int id = bcf_dec_typed_int1(ptr, &ptr);
+        ptr = skip_typed_vector(ptr, 1);
+        if ( ptr > end ) error("Could not parse the INFO fields at %s:%d\n", bcf_seqname(args->hdr,line),line->pos+1);
+        if ( id < args->nrm_ids && args->rm_info[id] ) continue;
+        if ( dst!=beg ) memmove(dst, beg, ptr - beg);
+        dst += ptr - beg;
+        nkeep++;
+    }
+    line->shared.l = dst - (uint8_t*)line->shared.s;
+    line->n_info = nkeep;
+    return 0;
+}
+void remove_info_tags(args_t *args, bcf1_t *line, rm_tag_t *tag)
+{
+    if ( remove_info_raw(args, line)==0 ) return;
+    if ( !(line->unpacked & BCF_UN_INFO) ) bcf_unpack(line, BCF_UN_INFO);
+
+    int i;
+    for (i=0; i<line->n_info; i++)
+    {
+        bcf_info_t *inf = &line->d.info[i];
+        if ( !inf->vptr || inf->key >= args->nrm_ids || !args->rm_info[inf->key] ) continue;
+        if ( inf->vptr_free )
+        {
+            free(inf->vptr - inf->vptr_off);
+            inf->vptr_free = 0;
+        }
+        line->d.shared_dirty |= BCF1_DIRTY_INF;
+        inf->vptr = NULL;
+        inf->vptr_off = inf->vptr_len = 0;
+    }
+}
+
+// As remove_info_raw(), the per-sample blocks of the removed FORMAT fields are
+// skipped without decoding
+static int remove_format_raw(args_t *args, bcf1_t *line)
+{
+    if ( (line->unpacked & BCF_UN_FMT) || line->d.indiv_dirty || !line->indiv.l ) return -1;
+
+    uint8_t *ptr = (uint8_t*) line->indiv.s, *end = ptr + line->indiv.l, *dst = ptr;
+    int i, nkeep = 0;
+    for (i=0; i<line->n_fmt; i++)
+    {
+        uint8_t *beg = ptr;
+        int id = bcf_dec_typed_int1(ptr, &ptr);
+        ptr = skip_typed_vector(ptr, line->n_sample);
+        if ( ptr > end ) error("Could not parse the FORMAT fields at %s:%d\n", bcf_seqname(args->hdr,line),line->pos+1);
+        if ( id < args->nrm_ids && args->rm_fmt[id] ) continue;
+        if ( dst!=beg ) memmove(dst, beg, ptr - beg);
+        dst += ptr - beg;
+        nkeep++;
+    }
+    line->indiv.l = dst - (uint8_t*)line->indiv.s;
+    line->n_fmt = nkeep;
+    return 0;
+}
+void remove_format_tags(args_t *args, bcf1_t *line, rm_tag_t *tag)
+{
+    if ( remove_format_raw(args, line)==0 ) return;
+    if ( !(line->unpacked & BCF_UN_FMT) ) bcf_unpack(line, BCF_UN_FMT);
+
+    int i;
+    for (i=0; i<line->n_fmt; i++)
+    {
+        bcf_fmt_t *fmt = &line->d.fmt[i];
+        if ( !fmt->p || fmt->id >= args->nrm_ids || !args->rm_fmt[fmt->id] ) continue;
+        if ( fmt->p_free )
+        {
+            free(fmt->p - fmt->p_off);
+            fmt->p_free = 0;
+        }
+        line->d.indiv_dirty = 1;
+        fmt->p = NULL;
+    }
+}
 void remove_format(args_t *args, bcf1_t *line, rm_tag_t *tag)
 {
     // remove all FORMAT fields except GT
@@ -360,6 +509,41 @@ static void init_remove_annots(args_t *args)
     khash_str2int_destroy_free(keep);
     if ( !args->nrm ) error("No matching tag in -x %s\n", args->remove_annots);
     bcf_hdr_sync(args->hdr_out);
+
+    // Replace the individual INFO and FORMAT tag handlers by a single pass over
+    // the record for each type
+    int i, j, ninfo = 0, nfmt = 0;
+    args->nrm_ids = args->hdr->n[BCF_DT_ID];
+    args->rm_info = (uint8_t*) calloc(args->nrm_ids, 1);
+    args->rm_fmt  = (uint8_t*) calloc(args->nrm_ids, 1);
+    for (i=0,j=0; i<args->nrm; i++)
+    {
+        rm_tag_t *tag = &args->rm[i];
+        // INFO/END stays with bcf_update_info(), which also resets rlen to the REF length
+        int is_end = tag->handler==remove_info_tag && !strcmp("END",tag->key);
+        if ( !is_end && (tag->handler==remove_info_tag || tag->handler==remove_format_tag) )
+        {
+            int id = bcf_hdr_id2int(args->hdr, BCF_DT_ID, tag->key);
+            if ( tag->handler==remove_info_tag ) { args->rm_info[id] = 1; ninfo++; }
+            else { args->rm_fmt[id] = 1; nfmt++; }
+            free(tag->key);
+            continue;
+        }
+        if ( i!=j ) args->rm[j] = *tag;
+        j++;
+    }
+    args->nrm = j;
+    args->rm = (rm_tag_t*) realloc(args->rm,sizeof(rm_tag_t)*(args->nrm+2));
+    if ( ninfo )
+    {
+        args->rm[args->nrm].key = NULL;
+        args->rm[args->nrm++].handler = remove_info_tags;
+    }
+    if ( nfmt )
+    {
+        args->rm[args->nrm].key = NULL;
+        args->rm[args->nrm++].handler = remove_format_tags;
+    }
 }
 static void init_header_lines(args_t *args)
 {
@@ -376,6 +560,23 @@ static void init_header_lines(args_t *args)
     bcf_hdr_sync(args->hdr_out);
     bcf_hdr_sync(args->hdr);
 }
+static annot_vals_t *annot_vals(annot_line_t *tab, int icol)
+{
+    if ( icol >= tab->mvals ) hts_expand0(annot_vals_t,icol+1,tab->mvals,tab->vals);
+    return &tab->vals[icol];
+}
+static void annot_vals_set(annot_vals_t *cache, void *vals, int n, int nper, size_t size)
+{
+    if ( cache->m < n*size )
+    {
+        cache->m = n*size;
+        cache->vals = realloc(cache->vals, cache->m);
+    }
+    memcpy(cache->vals, vals, n*size);
+    cache->n = n;
+    cache->nper = nper;
+    cache->parsed = 1;
+}
 static int setter_filter(args_t *args, bcf1_t *line, annot_col_t *col, void *data)
 {
     // note: so far this works only with one filter, not a list of filters
@@ -529,23 +730,39 @@ static int setter_ARinfo_int32(args_t *args, bcf1_t *line, annot_col_t *col, int
     bcf_update_info_int32(args->hdr_out,line,col->hdr_key_dst,args->tmpi2,ndst);
     return 0;
 }
-static int setter_info_int(args_t *args, bcf1_t *line, annot_col_t *col, void *data)
+// Parse the values into args->tmpi, or take them from the cache if already parsed
+static int parse_info_int(args_t *args, annot_line_t *tab, annot_col_t *col)
 {
-    annot_line_t *tab = (annot_line_t*) data;
-    char *str = tab->cols[col->icol], *end = str;
-    if ( str[0]=='.' && str[1]==0 ) return 0;
-
     int ntmpi = 0;
+    annot_vals_t *cache = annot_vals(tab, col->icol);
+    if ( cache->parsed )
+    {
+        ntmpi = cache->n;
+        hts_expand(int32_t,ntmpi,args->mtmpi,args->tmpi);
+        memcpy(args->tmpi, cache->vals, sizeof(int32_t)*ntmpi);
+        return ntmpi;
+    }
+    char *str = tab->cols[col->icol], *end = str;
     while ( *end )
     {
         int val = strtol(str, &end, 10); 
         if ( end==str )
-            error("Could not parse %s at %s:%d .. [%s]\n", bcf_seqname(args->hdr,line),line->pos+1,tab->cols[col->icol]);
+            error("Could not parse %s at %s:%d .. [%s]\n", col->hdr_key_src,tab->cols[args->chr_idx],tab->start+1,tab->cols[col->icol]);
         ntmpi++;
         hts_expand(int32_t,ntmpi,args->mtmpi,args->tmpi);
         args->tmpi[ntmpi-1] = val;
         str = end+1;
     }
+    annot_vals_set(cache, args->tmpi, ntmpi, 0, sizeof(int32_t));
+    return ntmpi;
+}
+static int setter_info_int(args_t *args, bcf1_t *line, annot_col_t *col, void *data)
+{
+    annot_line_t *tab = (annot_line_t*) data;
+    char *str = tab->cols[col->icol];
+    if ( str[0]=='.' && str[1]==0 ) return 0;
+
+    int ntmpi = parse_info_int(args, tab, col);
 
     if ( col->number==BCF_VL_A || col->number==BCF_VL_R ) 
         return setter_ARinfo_int32(args,line,col,tab->nals,tab->als,ntmpi);
@@ -609,23 +826,38 @@ static int setter_ARinfo_real(args_t *args, bcf1_t *line, annot_col_t *col, int
     bcf_update_info_float(args->hdr_out,line,col->hdr_key_dst,args->tmpf2,ndst);
     return 0;
 }
-static int setter_info_real(args_t *args, bcf1_t *line, annot_col_t *col, void *data)
+static int parse_info_real(args_t *args, annot_line_t *tab, annot_col_t *col)
 {
-    annot_line_t *tab = (annot_line_t*) data;
-    char *str = tab->cols[col->icol], *end = str;
-    if ( str[0]=='.' && str[1]==0 ) return 0;
-
     int ntmpf = 0;
+    annot_vals_t *cache = annot_vals(tab, col->icol);
+    if ( cache->parsed )
+    {
+        ntmpf = cache->n;
+        hts_expand(float,ntmpf,args->mtmpf,args->tmpf);
+        memcpy(args->tmpf, cache->vals, sizeof(float)*ntmpf);
+        return ntmpf;
+    }
+    char *str = tab->cols[col->icol], *end = str;
     while ( *end )
     {
         double val = strtod(str, &end);
         if ( end==str )
-            error("Could not parse %s at %s:%d .. [%s]\n", bcf_seqname(args->hdr,line),line->pos+1,tab->cols[col->icol]);
+            error("Could not parse %s at %s:%d .. [%s]\n", col->hdr_key_src,tab->cols[args->chr_idx],tab->start+1,tab->cols[col->icol]);
         ntmpf++;
         hts_expand(float,ntmpf,args->mtmpf,args->tmpf);
         args->tmpf[ntmpf-1] = val;
         str = end+1;
     }
+    annot_vals_set(cache, args->tmpf, ntmpf, 0, sizeof(float));
+    return ntmpf;
+}
+static int setter_info_real(args_t *args, bcf1_t *line, annot_col_t *col, void *data)
+{
+    annot_line_t *tab = (annot_line_t*) data;
+    char *str = tab->cols[col->icol];
+    if ( str[0]=='.' && str[1]==0 ) return 0;
+
+    int ntmpf = parse_info_real(args, tab, col);
 
     if ( col->number==BCF_VL_A || col->number==BCF_VL_R ) 
         return setter_ARinfo_real(args,line,col,tab->nals,tab->als,ntmpf);
@@ -866,10 +1098,7 @@ static int core_setter_format_int(args_t *args, bcf1_t *line, annot_col_t *col,
                 for (j=1; j<nvals; j++) dst[j] = bcf_int32_vector_end;
             }
             else
-            {
-                int32_t *src = vals + nvals*args->sample_map[i];
-                for (j=0; j<nvals; j++) dst[j] = src[j];
-            }
+                memcpy(dst, vals + nvals*args->sample_map[i], sizeof(*dst)*nvals);
         }
         return bcf_update_format_int32(args->hdr_out,line,col->hdr_key_dst,args->tmpi2,nvals*bcf_hdr_nsamples(args->hdr_out));
     }
@@ -940,10 +1169,7 @@ static int core_setter_format_real(args_t *args, bcf1_t *line, annot_col_t *col,
                 for (j=1; j<nvals; j++) bcf_float_set_vector_end(dst[j]);
             }
             else
-            {
-                float *src = vals + nvals*args->sample_map[i];
-                for (j=0; j<nvals; j++) dst[j] = src[j];
-            }
+                memcpy(dst, vals + nvals*args->sample_map[i], sizeof(*dst)*nvals);
         }
         return bcf_update_format_float(args->hdr_out,line,col->hdr_key_dst,args->tmpf2,nvals*bcf_hdr_nsamples(args->hdr_out));
     }
@@ -1022,11 +1248,16 @@ static int core_setter_format_str(args_t *args, bcf1_t *line, annot_col_t *col,
     }
     return bcf_update_format_string(args->hdr_out,line,col->hdr_key_dst,(const char**)args->tmpp2,nsmpl);
 }
-static int setter_format_int(args_t *args, bcf1_t *line, annot_col_t *col, void *data)
+// Parse the per-sample values into args->tmpi, returns the number of values per sample
+static int parse_format_int(args_t *args, annot_line_t *tab, annot_col_t *col)
 {
-    annot_line_t *tab = (annot_line_t*) data;
-    if ( col->icol+args->nsmpl_annot > tab->ncols ) 
-        error("Incorrect number of values for %s at %s:%d\n",col->hdr_key_src,bcf_seqname(args->hdr,line),line->pos+1);
+    annot_vals_t *cache = annot_vals(tab, col->icol);
+    if ( cache->parsed )
+    {
+        hts_expand(int32_t,cache->n,args->mtmpi,args->tmpi);
+        memcpy(args->tmpi, cache->vals, sizeof(int32_t)*cache->n);
+        return cache->nper;
+    }
     int nvals = count_vals(tab,col->icol,col->icol+args->nsmpl_annot);
     hts_expand(int32_t,nvals*args->nsmpl_annot,args->mtmpi,args->tmpi);
 
@@ -1049,7 +1280,7 @@ static int setter_format_int(args_t *args, bcf1_t *line, annot_col_t *col, void
             char *end = str;
             ptr[ival] = strtol(str, &end, 10); 
             if ( end==str )
-                error("Could not parse %s at %s:%d .. [%s]\n", col->hdr_key_src,bcf_seqname(args->hdr,line),line->pos+1,tab->cols[col->icol]);
+                error("Could not parse %s at %s:%d .. [%s]\n", col->hdr_key_src,tab->cols[args->chr_idx],tab->start+1,tab->cols[col->icol]);
 
             ival++;
             str = *end ? end+1 : end;
@@ -1057,13 +1288,27 @@ static int setter_format_int(args_t *args, bcf1_t *line, annot_col_t *col, void
         while ( ival<nvals ) ptr[ival++] = bcf_int32_vector_end;
         icol++;
     }
-    return core_setter_format_int(args,line,col,args->tmpi,nvals);
+    annot_vals_set(cache, args->tmpi, nvals*args->nsmpl_annot, nvals, sizeof(int32_t));
+    return nvals;
 }
-static int setter_format_real(args_t *args, bcf1_t *line, annot_col_t *col, void *data)
+static int setter_format_int(args_t *args, bcf1_t *line, annot_col_t *col, void *data)
 {
     annot_line_t *tab = (annot_line_t*) data;
     if ( col->icol+args->nsmpl_annot > tab->ncols ) 
         error("Incorrect number of values for %s at %s:%d\n",col->hdr_key_src,bcf_seqname(args->hdr,line),line->pos+1);
+    int nvals = parse_format_int(args, tab, col);
+    return core_setter_format_int(args,line,col,args->tmpi,nvals);
+}
+// Parse the per-sample values into args->tmpf, returns the number of values per sample
+static int parse_format_real(args_t *args, annot_line_t *tab, annot_col_t *col)
+{
+    annot_vals_t *cache = annot_vals(tab, col->icol);
+    if ( cache->parsed )
+    {
+        hts_expand(float,cache->n,args->mtmpf,args->tmpf);
+        memcpy(args->tmpf, cache->vals, sizeof(float)*cache->n);
+        return cache->nper;
+    }
     int nvals = count_vals(tab,col->icol,col->icol+args->nsmpl_annot);
     hts_expand(float,nvals*args->nsmpl_annot,args->mtmpf,args->tmpf);
 
@@ -1087,7 +1332,7 @@ static int setter_format_real(args_t *args, bcf1_t *line, annot_col_t *col, void
             char *end = str;
             ptr[ival] = strtod(str, &end); 
             if ( end==str )
-                error("Could not parse %s at %s:%d .. [%s]\n", col->hdr_key_src,bcf_seqname(args->hdr,line),line->pos+1,tab->cols[col->icol]);
+                error("Could not parse %s at %s:%d .. [%s]\n", col->hdr_key_src,tab->cols[args->chr_idx],tab->start+1,tab->cols[col->icol]);
 
             ival++;
             str = *end ? end+1 : end;
@@ -1095,6 +1340,15 @@ static int setter_format_real(args_t *args, bcf1_t *line, annot_col_t *col, void
         while ( ival<nvals ) { bcf_float_set_vector_end(ptr[ival]); ival++; }
         icol++;
     }
+    annot_vals_set(cache, args->tmpf, nvals*args->nsmpl_annot, nvals, sizeof(float));
+    return nvals;
+}
+static int setter_format_real(args_t *args, bcf1_t *line, annot_col_t *col, void *data)
+{
+    annot_line_t *tab = (annot_line_t*) data;
+    if ( col->icol+args->nsmpl_annot > tab->ncols ) 
+        error("Incorrect number of values for %s at %s:%d\n",col->hdr_key_src,bcf_seqname(args->hdr,line),line->pos+1);
+    int nvals = parse_format_real(args, tab, col);
     return core_setter_format_real(args,line,col,args->tmpf,nvals);
 }
 static int setter_format_str(args_t *args, bcf1_t *line, annot_col_t *col, void *data)
@@ -1109,9 +1363,21 @@ static int setter_format_str(args_t *args, bcf1_t *line, annot_col_t *col, void
 
     return core_setter_format_str(args,line,col,args->tmpp);
 }
+// When the samples are the same and in the same order, there is no sample map
+// and the source block can be passed on as it is, without decoding it into
+// args->tmpi first, provided it is already stored as 32-bit values
+static inline bcf_fmt_t *vcf_format_block(args_t *args, bcf1_t *rec, annot_col_t *col, int type)
+{
+    if ( args->sample_map ) return NULL;
+    bcf_fmt_t *fmt = bcf_get_fmt(args->files->readers[1].header, rec, col->hdr_key_src);
+    if ( !fmt || fmt->type!=type || !fmt->p ) return NULL;
+    return fmt;
+}
 static int vcf_setter_format_int(args_t *args, bcf1_t *line, annot_col_t *col, void *data)
 {
     bcf1_t *rec = (bcf1_t*) data;
+    bcf_fmt_t *fmt = vcf_format_block(args, rec, col, BCF_BT_INT32);
+    if ( fmt ) return core_setter_format_int(args,line,col,(int32_t*)fmt->p,fmt->n);
     int nsrc = bcf_get_format_int32(args->files->readers[1].header,rec,col->hdr_key_src,&args->tmpi,&args->mtmpi);
     if ( nsrc==-3 ) return 0;    // the tag is not present
     if ( nsrc<=0 ) return 1;     // error
@@ -1120,6 +1386,8 @@ static int vcf_setter_format_int(args_t *args, bcf1_t *line, annot_col_t *col, v
 static int vcf_setter_format_real(args_t *args, bcf1_t *line, annot_col_t *col, void *data)
 {
     bcf1_t *rec = (bcf1_t*) data;
+    bcf_fmt_t *fmt = vcf_format_block(args, rec, col, BCF_BT_FLOAT);
+    if ( fmt ) return core_setter_format_real(args,line,col,(float*)fmt->p,fmt->n);
     int nsrc = bcf_get_format_float(args->files->readers[1].header,rec,col->hdr_key_src,&args->tmpf,&args->mtmpf);
     if ( nsrc==-3 ) return 0;    // the tag is not present
     if ( nsrc<=0 ) return 1;     // error
@@ -1129,6 +1397,8 @@ static int vcf_setter_format_real(args_t *args, bcf1_t *line, annot_col_t *col,
 static int vcf_setter_format_str(args_t *args, bcf1_t *line, annot_col_t *col, void *data)
 {
     bcf1_t *rec = (bcf1_t*) data;
+    bcf_fmt_t *fmt = vcf_format_block(args, rec, col, BCF_BT_CHAR);
+    if ( fmt ) return bcf_update_format_char(args->hdr_out,line,col->hdr_key_dst,fmt->p,fmt->n*args->nsmpl_annot);
     args->tmpp[0] = args->tmps;
     int ret = bcf_get_format_string(args->files->readers[1].header,rec,col->hdr_key_src,&args->tmpp,&args->mtmps);
     args->tmps = args->tmpp[0]; // tmps might be realloced
@@ -1307,6 +1577,13 @@ static void bcf_hrec_format_rename(bcf_hrec_t *hrec, char *tag, kstring_t *str)
     }
     ksprintf(str,">\n");
 }
+static void init_tmpp(args_t *args)
+{
+    int n = bcf_hdr_nsamples(args->hdr_out);
+    if ( args->tgts_is_vcf && n<bcf_hdr_nsamples(args->files->readers[1].header) ) n = bcf_hdr_nsamples(args->files->readers[1].header);
+    args->tmpp  = (char**)malloc(sizeof(char*)*n);
+    args->tmpp2 = (char**)malloc(sizeof(char*)*n);
+}
 static void init_columns(args_t *args)
 {
     int need_sample_map = 0;
@@ -1560,13 +1837,7 @@ static void init_columns(args_t *args)
     free(args->columns);
     if ( skip_info ) khash_str2int_destroy_free(skip_info);
     if ( skip_fmt ) khash_str2int_destroy_free(skip_fmt);
-    if ( has_fmt_str )
-    {
-        int n = bcf_hdr_nsamples(args->hdr_out);
-        if ( args->tgts_is_vcf && n<bcf_hdr_nsamples(args->files->readers[1].header) ) n = bcf_hdr_nsamples(args->files->readers[1].header);
-        args->tmpp  = (char**)malloc(sizeof(char*)*n);
-        args->tmpp2 = (char**)malloc(sizeof(char*)*n);
-    }
+    if ( has_fmt_str ) init_tmpp(args);
     if ( !need_sample_map )
     {
         free(args->sample_map);
@@ -1605,6 +1876,681 @@ static void rename_chrs(args_t *args, char *fname)
     free(map);
 }
 
+// Drop buffered annotation lines which end before the VCF record
+static void prune_annot_lines(args_t *args, bcf1_t *line)
+{
+    if ( args->nalines && args->alines[0].rid != line->rid ) args->nalines = 0;
+
+    int i = 0;
+    while ( i<args->nalines )
+    {
+        if ( line->pos > args->alines[i].end )
+        {
+            args->nalines--;
+            if ( args->nalines && i<args->nalines )
+            {
+                annot_line_t tmp = args->alines[i];
+                memmove(&args->alines[i],&args->alines[i+1],(args->nalines-i)*sizeof(annot_line_t));
+                args->alines[args->nalines] = tmp;
+            }
+        }
+        else i++;
+    }
+}
+
+static void parse_annot_als(args_t *args, annot_line_t *tmp, char *str);
+
+// Split the annotation line into columns and the alleles, if the REF column is present
+static void parse_annot_line(args_t *args, annot_line_t *tmp, char *str)
+{
+    int i;
+    for (i=0; i<tmp->mvals; i++) tmp->vals[i].parsed = 0;
+    tmp->line.l = 0;
+    kputs(str, &tmp->line);
+    char *s = tmp->line.s;
+    tmp->ncols = 1;
+    hts_expand(char*,tmp->ncols,tmp->mcols,tmp->cols);
+    tmp->cols[0] = s;
+    while ( *s )
+    {
+        if ( *s=='\t' )
+        {
+            tmp->ncols++;
+            hts_expand(char*,tmp->ncols,tmp->mcols,tmp->cols);
+            tmp->cols[tmp->ncols-1] = s+1;
+            *s = 0;
+        }
+        s++;
+    }
+    if ( args->ref_idx != -1 && !args->build_cache ) parse_annot_als(args, tmp, str);   // ALT is stored unsplit in the cache
+}
+
+static void parse_annot_als(args_t *args, annot_line_t *tmp, char *str)
+{
+    char *s;
+    if ( args->ref_idx >= tmp->ncols ) 
+        error("Could not parse the line, expected %d+ columns, found %d:\n\t%s\n",args->ref_idx+1,tmp->ncols,str);
+    if ( args->alt_idx >= tmp->ncols )
+        error("Could not parse the line, expected %d+ columns, found %d:\n\t%s\n",args->alt_idx+1,tmp->ncols,str);
+    tmp->nals = 2;
+    hts_expand(char*,tmp->nals,tmp->mals,tmp->als);
+    tmp->als[0] = tmp->cols[args->ref_idx];
+    tmp->als[1] = s = tmp->cols[args->alt_idx];
+    while ( *s )
+    {
+        if ( *s==',' )
+        {
+            tmp->nals++;
+            hts_expand(char*,tmp->nals,tmp->mals,tmp->als);
+            tmp->als[tmp->nals-1] = s+1;
+            *s = 0;
+        }
+        s++;
+    }
+}
+
+static void buffer_annot_lines(args_t *args, bcf1_t *line, int start_pos, int end_pos)
+{
+    prune_annot_lines(args, line);
+
+    if ( args->ref_idx==-1 && args->nalines ) return;
+
+    while ( !bcf_sr_regions_overlap(args->tgts, bcf_seqname(args->hdr,line), start_pos,end_pos) )
+    {
+        args->nalines++;
+        hts_expand0(annot_line_t,args->nalines,args->malines,args->alines);
+        annot_line_t *tmp = &args->alines[args->nalines-1];
+        tmp->rid   = line->rid;
+        tmp->start = args->tgts->start;
+        tmp->end   = args->tgts->end;
+        parse_annot_line(args, tmp, args->tgts->line.s);
+        if ( args->ref_idx != -1 )
+        {
+            int iseq = args->tgts->iseq;
+            if ( bcf_sr_regions_next(args->tgts)<0 || args->tgts->iseq!=iseq ) break;
+        }
+        else break;
+    }
+}
+
+// Read the next annotation line with --stream, skipping sequences not present
+// in the VCF header. Returns 0 on success, -1 at the end of the file.
+static int stream_next_annot(args_t *args)
+{
+    annot_line_t *tmp = &args->annot_next;
+    while ( hts_getline(args->annot_fh, KS_SEP_LINE, &args->annot_str) > 0 )
+    {
+        char *str = args->annot_str.s;
+        if ( str[0]=='#' || !str[0] ) continue;
+        parse_annot_line(args, tmp, str);
+
+        int to_idx = args->to_idx < 0 ? args->from_idx : args->to_idx;
+        if ( args->chr_idx >= tmp->ncols || args->from_idx >= tmp->ncols || to_idx >= tmp->ncols )
+            error("Could not parse the line, expected %d+ columns, found %d:\n\t%s\n",
+                (args->chr_idx > to_idx ? args->chr_idx : to_idx)+1,tmp->ncols,args->annot_str.s);
+        char *end;
+        tmp->start = strtol(tmp->cols[args->from_idx], &end, 10);
+        if ( *end ) error("Could not parse the position: %s\n", tmp->cols[args->from_idx]);
+        tmp->end = strtol(tmp->cols[to_idx], &end, 10);
+        if ( *end ) error("Could not parse the position: %s\n", tmp->cols[to_idx]);
+        if ( !args->annot_is_bed ) tmp->start--;
+        tmp->end--;
+        if ( args->build_cache ) return 0;  // sequences checked by write_annot_cache()
+
+        tmp->rid = bcf_hdr_name2id(args->hdr, tmp->cols[args->chr_idx]);
+        if ( tmp->rid < 0 ) continue;
+        if ( tmp->rid < args->prev_rid || (tmp->rid==args->prev_rid && tmp->start < args->prev_pos) )
+            error("The annotation file is not sorted in the order of the VCF header, cannot use --stream: %s:%d\n",
+                tmp->cols[args->chr_idx], tmp->start+1);
+        args->prev_rid = tmp->rid;
+        args->prev_pos = tmp->start;
+        return 0;
+    }
+    return -1;
+}
+
+/*
+    Binary columnar cache of a tab-delimited annotation file, see --build-cache
+    and --cache. After a header with the -c columns, the file consists of blocks
+    of up to ANNOT_CACHE_BLOCK lines from a single sequence. Within a block, the
+    positions and each of the annotation columns are stored as separate arrays,
+    the numeric INFO and FORMAT columns already parsed into int32 or float
+    values. The block index is written to a separate file with the ".idx" suffix
+    and allows to skip the blocks which end before the VCF record.
+*/
+#define ANNOT_CACHE_MAGIC     "BCAN"
+#define ANNOT_CACHE_IDX_MAGIC "BCAI"
+#define ANNOT_CACHE_VERSION   1
+#define ANNOT_CACHE_BLOCK     4096
+
+#define CACHE_TEXT 0
+#define CACHE_INT  1
+#define CACHE_REAL 2
+
+typedef struct
+{
+    int icol, type, fmt, span;  // first column, CACHE_* type, FORMAT field spanning nsmpl_annot columns
+    annot_col_t *col;           // NULL for REF and ALT
+    int32_t *cnt, *nper;        // text: string length; typed: number of values (-1 if missing) and values per sample
+    int *off;                   // offset of the line's values in vals or txt
+    int32_t *vals;              // typed values, int32_t or float
+    char *txt;                  // text values concatenated
+    int mcnt, nvals, mvals, ntxt, mtxt;
+}
+cache_col_t;
+
+typedef struct
+{
+    uint64_t voff;
+    int iseq, rid, beg, end;
+}
+cache_blk_t;
+
+struct _annot_cache_t
+{
+    BGZF *fp;
+    char **seq;
+    int nseq, mseq;
+    cache_col_t *cols;
+    int ncols, ncols_tab, *tab2col, *tab_off;   // tab2col: index of the cache column for each annotation column or -1
+    cache_blk_t *blk;
+    int nblk, mblk, iblk;
+    int32_t *beg, *end;         // positions in the current block
+    int nrows, mrows, irow;
+};
+
+static inline void cache_write(args_t *args, BGZF *fp, const void *dat, size_t len)
+{
+    if ( bgzf_write(fp, dat, len)!=len ) error("Failed to write %s\n", args->cache_fname);
+}
+static inline void cache_write_u32(args_t *args, BGZF *fp, uint32_t val)
+{
+    cache_write(args, fp, &val, sizeof(val));
+}
+static inline void cache_write_str(args_t *args, BGZF *fp, const char *str)
+{
+    uint32_t len = str ? strlen(str) : 0;
+    cache_write_u32(args, fp, len);
+    if ( len ) cache_write(args, fp, str, len);
+}
+static inline void cache_read(args_t *args, BGZF *fp, void *dat, size_t len)
+{
+    if ( bgzf_read(fp, dat, len)!=len ) error("Failed to read %s, truncated cache file?\n", args->cache_fname);
+}
+static inline uint32_t cache_read_u32(args_t *args, BGZF *fp)
+{
+    uint32_t val;
+    cache_read(args, fp, &val, sizeof(val));
+    return val;
+}
+static inline char *cache_read_str(args_t *args, BGZF *fp)
+{
+    uint32_t len = cache_read_u32(args, fp);
+    char *str = (char*) malloc(len+1);
+    if ( len ) cache_read(args, fp, str, len);
+    str[len] = 0;
+    return str;
+}
+
+static void cache_add_col(annot_cache_t *cache, annot_col_t *col, int icol, int type, int fmt, int span)
+{
+    cache->ncols++;
+    cache->cols = (cache_col_t*) realloc(cache->cols, sizeof(cache_col_t)*cache->ncols);
+    cache_col_t *ccol = &cache->cols[cache->ncols-1];
+    memset(ccol, 0, sizeof(*ccol));
+    ccol->col  = col;
+    ccol->icol = icol;
+    ccol->type = type;
+    ccol->fmt  = fmt;
+    ccol->span = span;
+    if ( cache->ncols_tab < icol + span ) cache->ncols_tab = icol + span;
+}
+
+// Decide which columns are stored and how, the same for --build-cache and --cache
+static void init_cache_cols(args_t *args, annot_cache_t *cache)
+{
+    int i, j;
+    if ( args->ref_idx!=-1 ) cache_add_col(cache, NULL, args->ref_idx, CACHE_TEXT, 0, 1);
+    if ( args->alt_idx!=-1 ) cache_add_col(cache, NULL, args->alt_idx, CACHE_TEXT, 0, 1);
+    for (i=0; i<args->ncols; i++)
+    {
+        annot_col_t *col = &args->cols[i];
+        if ( col->icol < 0 ) continue;
+        if ( col->setter==setter_info_int ) cache_add_col(cache, col, col->icol, CACHE_INT, 0, 1);
+        else if ( col->setter==setter_info_real ) cache_add_col(cache, col, col->icol, CACHE_REAL, 0, 1);
+        else if ( col->setter==setter_format_int ) cache_add_col(cache, col, col->icol, CACHE_INT, 1, args->nsmpl_annot);
+        else if ( col->setter==setter_format_real ) cache_add_col(cache, col, col->icol, CACHE_REAL, 1, args->nsmpl_annot);
+        else if ( col->setter==setter_format_str )
+            for (j=0; j<args->nsmpl_annot; j++) cache_add_col(cache, col, col->icol+j, CACHE_TEXT, 1, 1);
+        else
+            cache_add_col(cache, col, col->icol, CACHE_TEXT, 0, 1);
+    }
+    cache->tab2col = (int*) malloc(sizeof(int)*cache->ncols_tab);
+    cache->tab_off = (int*) malloc(sizeof(int)*cache->ncols_tab);
+    for (i=0; i<cache->ncols_tab; i++) cache->tab2col[i] = -1;
+    for (i=0; i<cache->ncols; i++) cache->tab2col[cache->cols[i].icol] = i;
+}
+
+static void cache_col_expand(cache_col_t *ccol, int n)
+{
+    if ( n <= ccol->mcnt ) return;
+    ccol->mcnt = n;
+    ccol->cnt  = (int32_t*) realloc(ccol->cnt, sizeof(int32_t)*n);
+    ccol->nper = (int32_t*) realloc(ccol->nper, sizeof(int32_t)*n);
+    ccol->off  = (int*) realloc(ccol->off, sizeof(int)*n);
+}
+
+static void cache_add_line(args_t *args, annot_cache_t *cache, annot_line_t *tab)
+{
+    int i, irow = cache->nrows++;
+    if ( cache->ncols_tab > tab->ncols )
+        error("Could not parse the line, expected %d+ columns, found %d:\n\t%s\n",cache->ncols_tab,tab->ncols,args->annot_str.s);
+    hts_expand(int32_t,cache->nrows,cache->mrows,cache->beg);
+    cache->end = (int32_t*) realloc(cache->end, sizeof(int32_t)*cache->mrows);
+    cache->beg[irow] = tab->start;
+    cache->end[irow] = tab->end;
+    for (i=0; i<cache->ncols; i++)
+    {
+        cache_col_t *ccol = &cache->cols[i];
+        cache_col_expand(ccol, cache->nrows);
+        char *str = tab->cols[ccol->icol];
+        if ( ccol->type==CACHE_TEXT )
+        {
+            int len = strlen(str);
+            ccol->cnt[irow] = len;
+            hts_expand(char,ccol->ntxt+len,ccol->mtxt,ccol->txt);
+            memcpy(ccol->txt+ccol->ntxt, str, len);
+            ccol->ntxt += len;
+            continue;
+        }
+        int n, nper = 0;
+        if ( !ccol->fmt && str[0]=='.' && str[1]==0 ) n = -1;
+        else if ( ccol->fmt )
+        {
+            nper = ccol->type==CACHE_INT ? parse_format_int(args, tab, ccol->col) : parse_format_real(args, tab, ccol->col);
+            n = nper * args->nsmpl_annot;
+        }
+        else
+            n = ccol->type==CACHE_INT ? parse_info_int(args, tab, ccol->col) : parse_info_real(args, tab, ccol->col);
+        ccol->cnt[irow]  = n;
+        ccol->nper[irow] = nper;
+        if ( n<=0 ) continue;
+        hts_expand(int32_t,ccol->nvals+n,ccol->mvals,ccol->vals);
+        memcpy(ccol->vals+ccol->nvals, ccol->type==CACHE_INT ? (void*)args->tmpi : (void*)args->tmpf, sizeof(int32_t)*n);
+        ccol->nvals += n;
+    }
+}
+
+static void cache_write_block(args_t *args, annot_cache_t *cache)
+{
+    if ( !cache->nrows ) return;
+
+    int i;
+    hts_expand(cache_blk_t,cache->nblk+1,cache->mblk,cache->blk);
+    cache_blk_t *blk = &cache->blk[cache->nblk++];
+    blk->voff = bgzf_tell(cache->fp);
+    blk->iseq = cache->nseq - 1;
+    blk->beg  = cache->beg[0];
+    blk->end  = cache->end[0];
+    for (i=1; i<cache->nrows; i++)
+        if ( blk->end < cache->end[i] ) blk->end = cache->end[i];
+
+    cache_write_u32(args, cache->fp, cache->nrows);
+    cache_write_u32(args, cache->fp, blk->iseq);
+    cache_write(args, cache->fp, cache->beg, sizeof(int32_t)*cache->nrows);
+    cache_write(args, cache->fp, cache->end, sizeof(int32_t)*cache->nrows);
+    for (i=0; i<cache->ncols; i++)
+    {
+        cache_col_t *ccol = &cache->cols[i];
+        cache_write(args, cache->fp, ccol->cnt, sizeof(int32_t)*cache->nrows);
+        if ( ccol->type==CACHE_TEXT )
+        {
+            cache_write_u32(args, cache->fp, ccol->ntxt);
+            if ( ccol->ntxt ) cache_write(args, cache->fp, ccol->txt, ccol->ntxt);
+            ccol->ntxt = 0;
+            continue;
+        }
+        if ( ccol->fmt ) cache_write(args, cache->fp, ccol->nper, sizeof(int32_t)*cache->nrows);
+        cache_write_u32(args, cache->fp, ccol->nvals);
+        if ( ccol->nvals ) cache_write(args, cache->fp, ccol->vals, sizeof(int32_t)*ccol->nvals);
+        ccol->nvals = 0;
+    }
+    cache->nrows = 0;
+}
+
+static void destroy_annot_cache(annot_cache_t *cache)
+{
+    int i;
+    for (i=0; i<cache->ncols; i++)
+    {
+        free(cache->cols[i].cnt);
+        free(cache->cols[i].nper);
+        free(cache->cols[i].off);
+        free(cache->cols[i].vals);
+        free(cache->cols[i].txt);
+    }
+    free(cache->cols);
+    for (i=0; i<cache->nseq; i++) free(cache->seq[i]);
+    free(cache->seq);
+    free(cache->tab2col);
+    free(cache->tab_off);
+    free(cache->blk);
+    free(cache->beg);
+    free(cache->end);
+    free(cache);
+}
+
+static void write_annot_cache(args_t *args)
+{
+    int i;
+    annot_cache_t *cache = (annot_cache_t*) calloc(1,sizeof(annot_cache_t));
+    init_cache_cols(args, cache);
+
+    cache->fp = bgzf_open(args->cache_fname, "w");
+    if ( !cache->fp ) error("Failed to open %s: %s\n", args->cache_fname, strerror(errno));
+    cache_write(args, cache->fp, ANNOT_CACHE_MAGIC, 4);
+    cache_write_u32(args, cache->fp, ANNOT_CACHE_VERSION);
+    cache_write_str(args, cache->fp, args->columns);
+    cache_write_u32(args, cache->fp, cache->ncols);
+    for (i=0; i<cache->ncols; i++)
+    {
+        uint32_t dat[4] = { cache->cols[i].icol, cache->cols[i].type, cache->cols[i].fmt, cache->cols[i].span };
+        cache_write(args, cache->fp, dat, sizeof(dat));
+    }
+
+    void *seq2int = khash_str2int_init();
+    int prev_pos = -1;
+    while ( stream_next_annot(args)==0 )
+    {
+        annot_line_t *tmp = &args->annot_next;
+        char *chr = tmp->cols[args->chr_idx];
+        if ( !cache->nseq || strcmp(chr, cache->seq[cache->nseq-1]) )
+        {
+            cache_write_block(args, cache);
+            if ( khash_str2int_has_key(seq2int, chr) )
+                error("The annotation file is not sorted, the sequence %s is not contiguous\n", chr);
+            hts_expand(char*,cache->nseq+1,cache->mseq,cache->seq);
+            cache->seq[cache->nseq] = strdup(chr);
+            khash_str2int_inc(seq2int, cache->seq[cache->nseq]);
+            cache->nseq++;
+            prev_pos = -1;
+        }
+        if ( tmp->start < prev_pos ) error("The annotation file is not sorted: %s:%d\n", chr, tmp->start+1);
+        prev_pos = tmp->start;
+        cache_add_line(args, cache, tmp);
+        if ( cache->nrows==ANNOT_CACHE_BLOCK ) cache_write_block(args, cache);
+    }
+    cache_write_block(args, cache);
+    cache_write_u32(args, cache->fp, 0);
+    if ( bgzf_close(cache->fp)!=0 ) error("Close failed: %s\n", args->cache_fname);
+    khash_str2int_destroy(seq2int);
+
+    kstring_t str = {0,0,0};
+    ksprintf(&str, "%s.idx", args->cache_fname);
+    BGZF *fp = bgzf_open(str.s, "w");
+    if ( !fp ) error("Failed to open %s: %s\n", str.s, strerror(errno));
+    cache_write(args, fp, ANNOT_CACHE_IDX_MAGIC, 4);
+    cache_write_u32(args, fp, ANNOT_CACHE_VERSION);
+    cache_write_u32(args, fp, cache->nseq);
+    for (i=0; i<cache->nseq; i++) cache_write_str(args, fp, cache->seq[i]);
+    cache_write_u32(args, fp, cache->nblk);
+    for (i=0; i<cache->nblk; i++)
+    {
+        cache_write(args, fp, &cache->blk[i].voff, sizeof(uint64_t));
+        int32_t dat[3] = { cache->blk[i].iseq, cache->blk[i].beg, cache->blk[i].end };
+        cache_write(args, fp, dat, sizeof(dat));
+    }
+    if ( bgzf_close(fp)!=0 ) error("Close failed: %s\n", str.s);
+    free(str.s);
+    destroy_annot_cache(cache);
+}
+
+// Read the cache header and take the -c columns from it, called before init_columns()
+static void init_annot_cache(args_t *args)
+{
+    BGZF *fp = bgzf_open(args->cache_fname, "r");
+    if ( !fp ) error("Failed to read %s: %s\n", args->cache_fname, strerror(errno));
+    char magic[4];
+    cache_read(args, fp, magic, 4);
+    if ( memcmp(magic, ANNOT_CACHE_MAGIC, 4) ) error("Not a bcftools annotate cache file: %s\n", args->cache_fname);
+    if ( cache_read_u32(args, fp)!=ANNOT_CACHE_VERSION )
+        error("Unsupported version of the cache file %s, please rebuild with --build-cache\n", args->cache_fname);
+    char *columns = cache_read_str(args, fp);
+    if ( !args->columns ) args->columns = columns;
+    else
+    {
+        if ( strcmp(args->columns, columns) )
+            error("The cache %s was built with -c %s, cannot annotate with -c %s\n", args->cache_fname, columns, args->columns);
+        free(columns);
+    }
+    args->cache = (annot_cache_t*) calloc(1,sizeof(annot_cache_t));
+    args->cache->fp = fp;
+}
+
+// Check the stored columns and load the block index, called after init_columns()
+static void init_annot_cache_index(args_t *args)
+{
+    annot_cache_t *cache = args->cache;
+    init_cache_cols(args, cache);
+
+    int i, ncols = cache_read_u32(args, cache->fp);
+    if ( ncols!=cache->ncols ) error("The cache %s does not match the -c columns, please rebuild\n", args->cache_fname);
+    for (i=0; i<ncols; i++)
+    {
+        uint32_t dat[4];
+        cache_read(args, cache->fp, dat, sizeof(dat));
+        cache_col_t *ccol = &cache->cols[i];
+        if ( dat[0]!=ccol->icol || dat[1]!=ccol->type || dat[2]!=ccol->fmt || dat[3]!=ccol->span )
+            error("The cache %s does not match the -c columns, please rebuild\n", args->cache_fname);
+    }
+
+    kstring_t str = {0,0,0};
+    ksprintf(&str, "%s.idx", args->cache_fname);
+    BGZF *fp = bgzf_open(str.s, "r");
+    if ( !fp ) error("Failed to read %s: %s\n", str.s, strerror(errno));
+    char magic[4];
+    cache_read(args, fp, magic, 4);
+    if ( memcmp(magic, ANNOT_CACHE_IDX_MAGIC, 4) ) error("Not a bcftools annotate cache index: %s\n", str.s);
+    if ( cache_read_u32(args, fp)!=ANNOT_CACHE_VERSION )
+        error("Unsupported version of the cache index %s, please rebuild with --build-cache\n", str.s);
+    cache->nseq = cache->mseq = cache_read_u32(args, fp);
+    cache->seq  = (char**) malloc(sizeof(char*)*cache->nseq);
+    for (i=0; i<cache->nseq; i++) cache->seq[i] = cache_read_str(args, fp);
+    cache->nblk = cache->mblk = cache_read_u32(args, fp);
+    cache->blk  = (cache_blk_t*) malloc(sizeof(cache_blk_t)*cache->nblk);
+    int prev_rid = -1;
+    for (i=0; i<cache->nblk; i++)
+    {
+        cache_blk_t *blk = &cache->blk[i];
+        int32_t dat[3];
+        cache_read(args, fp, &blk->voff, sizeof(uint64_t));
+        cache_read(args, fp, dat, sizeof(dat));
+        if ( dat[0]<0 || dat[0]>=cache->nseq ) error("Corrupted cache index: %s\n", str.s);
+        blk->iseq = dat[0];
+        blk->beg  = dat[1];
+        blk->end  = dat[2];
+        blk->rid  = bcf_hdr_name2id(args->hdr, cache->seq[blk->iseq]);
+        if ( blk->rid < 0 ) continue;
+        if ( blk->rid < prev_rid )
+            error("The sequences in %s are not in the order of the VCF header, cannot use --cache: %s\n", args->cache_fname, cache->seq[blk->iseq]);
+        prev_rid = blk->rid;
+    }
+    if ( bgzf_close(fp)!=0 ) error("Close failed: %s\n", str.s);
+    free(str.s);
+    cache->iblk = -1;
+}
+
+// Read the next block, the file must be positioned at its beginning
+static void cache_load_block(args_t *args)
+{
+    annot_cache_t *cache = args->cache;
+    int i, j;
+    cache->iblk++;
+    cache->irow  = 0;
+    cache->nrows = cache_read_u32(args, cache->fp);
+    if ( cache_read_u32(args, cache->fp)!=cache->blk[cache->iblk].iseq ) error("Corrupted cache file: %s\n", args->cache_fname);
+    hts_expand(int32_t,cache->nrows,cache->mrows,cache->beg);
+    cache->end = (int32_t*) realloc(cache->end, sizeof(int32_t)*cache->mrows);
+    cache_read(args, cache->fp, cache->beg, sizeof(int32_t)*cache->nrows);
+    cache_read(args, cache->fp, cache->end, sizeof(int32_t)*cache->nrows);
+    for (i=0; i<cache->ncols; i++)
+    {
+        cache_col_t *ccol = &cache->cols[i];
+        cache_col_expand(ccol, cache->nrows);
+        cache_read(args, cache->fp, ccol->cnt, sizeof(int32_t)*cache->nrows);
+        if ( ccol->type==CACHE_TEXT )
+        {
+            ccol->ntxt = cache_read_u32(args, cache->fp);
+            hts_expand(char,ccol->ntxt,ccol->mtxt,ccol->txt);
+            if ( ccol->ntxt ) cache_read(args, cache->fp, ccol->txt, ccol->ntxt);
+        }
+        else
+        {
+            if ( ccol->fmt ) cache_read(args, cache->fp, ccol->nper, sizeof(int32_t)*cache->nrows);
+            else memset(ccol->nper, 0, sizeof(int32_t)*cache->nrows);
+            ccol->nvals = cache_read_u32(args, cache->fp);
+            hts_expand(int32_t,ccol->nvals,ccol->mvals,ccol->vals);
+            if ( ccol->nvals ) cache_read(args, cache->fp, ccol->vals, sizeof(int32_t)*ccol->nvals);
+        }
+        int off = 0, max = ccol->type==CACHE_TEXT ? ccol->ntxt : ccol->nvals;
+        for (j=0; j<cache->nrows; j++)
+        {
+            ccol->off[j] = off;
+            if ( ccol->cnt[j] > 0 ) off += ccol->cnt[j];
+        }
+        if ( off!=max ) error("Corrupted cache file: %s\n", args->cache_fname);
+    }
+}
+
+// Skip the blocks which end before the VCF position using the index
+static void cache_skip_blocks(args_t *args, int rid, int pos)
+{
+    annot_cache_t *cache = args->cache;
+    #define BLK_BEHIND(blk) ((blk).rid < rid || ((blk).rid==rid && (blk).end < pos))
+    if ( cache->iblk>=0 && cache->irow < cache->nrows && !BLK_BEHIND(cache->blk[cache->iblk]) ) return;
+    int i = cache->iblk + 1;
+    while ( i < cache->nblk && BLK_BEHIND(cache->blk[i]) ) i++;
+    #undef BLK_BEHIND
+    if ( i == cache->iblk + 1 ) return;     // the next block is needed anyway, no seek
+    cache->irow = cache->nrows = 0;
+    cache->iblk = i - 1;
+    if ( i == cache->nblk ) return;
+    if ( bgzf_seek(cache->fp, cache->blk[i].voff, SEEK_SET)<0 ) error("Failed to seek in %s\n", args->cache_fname);
+}
+
+// Rebuild the next annotation line from the cache: the text columns are
+// copied, the numeric values are passed to the setters via annot_vals_t
+static int cache_next_annot(args_t *args)
+{
+    annot_cache_t *cache = args->cache;
+    while ( cache->irow >= cache->nrows )
+    {
+        if ( cache->iblk+1 >= cache->nblk ) return -1;
+        cache_load_block(args);
+    }
+    int i, irow = cache->irow++;
+    annot_line_t *tmp = &args->annot_next;
+    tmp->rid   = cache->blk[cache->iblk].rid;
+    tmp->start = cache->beg[irow];
+    tmp->end   = cache->end[irow];
+    tmp->line.l = 0;
+    for (i=0; i<cache->ncols_tab; i++)
+    {
+        cache->tab_off[i] = tmp->line.l;
+        cache_col_t *ccol = cache->tab2col[i] < 0 ? NULL : &cache->cols[cache->tab2col[i]];
+        if ( !ccol || (ccol->type!=CACHE_TEXT && ccol->cnt[irow]<0) ) kputc('.', &tmp->line);
+        else if ( ccol->type==CACHE_TEXT ) kputsn(ccol->txt+ccol->off[irow], ccol->cnt[irow], &tmp->line);
+        kputc(0, &tmp->line);
+    }
+    tmp->ncols = cache->ncols_tab;
+    hts_expand(char*,tmp->ncols,tmp->mcols,tmp->cols);
+    for (i=0; i<tmp->ncols; i++) tmp->cols[i] = tmp->line.s + cache->tab_off[i];
+    for (i=0; i<tmp->mvals; i++) tmp->vals[i].parsed = 0;
+    for (i=0; i<cache->ncols; i++)
+    {
+        cache_col_t *ccol = &cache->cols[i];
+        if ( ccol->type==CACHE_TEXT || ccol->cnt[irow]<0 ) continue;
+        annot_vals_set(annot_vals(tmp,ccol->icol), ccol->vals+ccol->off[irow], ccol->cnt[irow], ccol->nper[irow], sizeof(int32_t));
+    }
+    if ( args->ref_idx != -1 ) parse_annot_als(args, tmp, tmp->line.s);
+    return 0;
+}
+
+// Merge-join the annotation lines with the VCF: read the annotation file until
+// the first line past the VCF record, buffering the overlapping lines
+static void stream_annot_lines(args_t *args, bcf1_t *line, int start_pos, int end_pos)
+{
+    prune_annot_lines(args, line);
+
+    while ( 1 )
+    {
+        if ( !args->annot_next_ok )
+        {
+            int ret;
+            if ( args->cache )
+            {
+                cache_skip_blocks(args, line->rid, start_pos);
+                ret = cache_next_annot(args);
+            }
+            else
+                ret = stream_next_annot(args);
+            args->annot_next_ok = ret==0 ? 1 : -1;
+        }
+        if ( args->annot_next_ok < 0 ) break;
+
+        annot_line_t *tmp = &args->annot_next;
+        if ( tmp->rid > line->rid || (tmp->rid==line->rid && tmp->start > end_pos) ) break;  // ahead of the VCF
+        args->annot_next_ok = 0;
+        if ( tmp->rid < line->rid || tmp->end < start_pos ) continue;   // behind the VCF
+
+        args->nalines++;
+        hts_expand0(annot_line_t,args->nalines,args->malines,args->alines);
+        annot_line_t swap = args->alines[args->nalines-1];
+        args->alines[args->nalines-1] = *tmp;
+        *tmp = swap;
+    }
+}
+
+// The tab-delimited annotations are read along with the records, which must
+// then be filtered before find_annot(), in the main thread
+static inline int annot_is_streamed(args_t *args)
+{
+    return args->tgts || args->annot_fh || args->cache ? 1 : 0;
+}
+
+// two batches per thread keep the workers busy while the output is written
+static void init_batches(args_t *args)
+{
+    int i;
+    args->nbatches = 2*args->n_threads;
+    args->batches  = (annot_batch_t*) calloc(args->nbatches, sizeof(annot_batch_t));
+    for (i=0; i<args->nbatches; i++)
+    {
+        annot_batch_t *batch = &args->batches[i];
+        args_t *bargs = &batch->args;
+        *bargs = *args;
+        bargs->mtmpi = bargs->mtmpf = bargs->mtmps = 0;
+        bargs->mtmpi2 = bargs->mtmpf2 = bargs->mtmps2 = 0;
+        bargs->mtmpi3 = bargs->mtmpf3 = bargs->mtmps3 = 0;
+        bargs->tmpi = bargs->tmpi2 = bargs->tmpi3 = NULL;
+        bargs->tmpf = bargs->tmpf2 = bargs->tmpf3 = NULL;
+        bargs->tmps = bargs->tmps2 = NULL;
+        bargs->tmpp = bargs->tmpp2 = NULL;
+        memset(&bargs->tmpks, 0, sizeof(bargs->tmpks));
+        if ( args->tmpp ) init_tmpp(bargs);
+        bargs->vcmp   = vcmp_init();
+        bargs->filter = args->filter && !annot_is_streamed(args) ? filter_init(args->hdr, args->filter_str) : NULL;
+        bargs->set_ids = args->set_ids ? convert_init(args->hdr_out, NULL, 0, args->set_ids_fmt) : NULL;
+        batch->lines = (bcf1_t**) calloc(BATCH_SIZE, sizeof(bcf1_t*));
+        batch->arecs = (bcf1_t**) calloc(BATCH_SIZE, sizeof(bcf1_t*));
+        batch->tabs  = (annot_line_t*) calloc(BATCH_SIZE, sizeof(annot_line_t));
+        batch->has_annot = (uint8_t*) malloc(BATCH_SIZE);
+        batch->pass  = (uint8_t*) malloc(BATCH_SIZE);
+    }
+    args->tpool_q = hts_tpool_process_init(args->files->p->pool, args->nbatches, 0);
+    if ( !args->tpool_q ) error("Failed to initialize the thread pool queue\n");
+}
+
 static void init_data(args_t *args)
 {
     args->hdr = args->files->readers[0].header;
@@ -1618,7 +2564,9 @@ static void init_data(args_t *args)
         if ( !bcf_sr_add_reader(args->files, args->targets_fname) )
             error("Failed to open %s: %s\n", args->targets_fname,bcf_sr_strerror(args->files->errnum));
     }
+    if ( args->cache_fname && !args->build_cache ) init_annot_cache(args);
     if ( args->columns ) init_columns(args);
+    if ( args->cache ) init_annot_cache_index(args);
     if ( args->targets_fname && !args->tgts_is_vcf )
     {
         if ( !args->columns ) error("The -c option not given\n");
@@ -1626,9 +2574,20 @@ static void init_data(args_t *args)
         if ( args->from_idx==-1 ) error("The -c POS option not given\n");
         if ( args->to_idx==-1 ) args->to_idx = -args->from_idx - 1;
 
-        args->tgts = bcf_sr_regions_init(args->targets_fname,1,args->chr_idx,args->from_idx,args->to_idx);
-        if ( !args->tgts ) error("Could not initialize the annotation file: %s\n", args->targets_fname);
-        if ( !args->tgts->tbx ) error("Expected tabix-indexed annotation file: %s\n", args->targets_fname);
+        if ( args->stream || args->build_cache )
+        {
+            args->annot_fh = hts_open(args->targets_fname, "r");
+            if ( !args->annot_fh ) error("Could not read the annotation file: %s\n", args->targets_fname);
+            int len = strlen(args->targets_fname);
+            if ( len>=4 && !strcasecmp(".bed",args->targets_fname+len-4) ) args->annot_is_bed = 1;
+            if ( len>=7 && !strcasecmp(".bed.gz",args->targets_fname+len-7) ) args->annot_is_bed = 1;
+        }
+        else
+        {
+            args->tgts = bcf_sr_regions_init(args->targets_fname,1,args->chr_idx,args->from_idx,args->to_idx);
+            if ( !args->tgts ) error("Could not initialize the annotation file: %s\n", args->targets_fname);
+            if ( !args->tgts->tbx ) error("Expected tabix-indexed annotation file: %s\n", args->targets_fname);
+        }
     }
     args->vcmp = vcmp_init();
 
@@ -1643,13 +2602,13 @@ static void init_data(args_t *args)
 
     if ( args->mark_sites )
     {
-        if ( !args->targets_fname ) error("The -a option not given\n");
+        if ( !args->targets_fname && !args->cache ) error("The -a option not given\n");
         bcf_hdr_printf(args->hdr_out,"##INFO=<ID=%s,Number=0,Type=Flag,Description=\"Sites %slisted in %s\">",
             args->mark_sites,args->mark_sites_logic==MARK_LISTED?"":"not ",args->mark_sites);
     }
 
      if (args->record_cmd_line) bcf_hdr_append_version(args->hdr_out, args->argc, args->argv, "bcftools_annotate");
-    if ( !args->drop_header )
+    if ( !args->drop_header && !args->build_cache )
     {
         if ( args->rename_chrs ) rename_chrs(args, args->rename_chrs);
 
@@ -1659,29 +2618,22 @@ static void init_data(args_t *args)
             hts_set_opt(args->out_fh, HTS_OPT_THREAD_POOL, args->files->p);
         bcf_hdr_write(args->out_fh, args->hdr_out);
     }
+    if ( args->n_threads && !args->build_cache ) init_batches(args);
 }
 
-static void destroy_data(args_t *args)
+static void destroy_annot_line(annot_line_t *tab)
 {
     int i;
-    for (i=0; i<args->nrm; i++) free(args->rm[i].key);
-    free(args->rm);
-    if ( args->hdr_out ) bcf_hdr_destroy(args->hdr_out);
-    if (args->vcmp) vcmp_destroy(args->vcmp);
-    for (i=0; i<args->ncols; i++)
-    {
-        free(args->cols[i].hdr_key_src);
-        free(args->cols[i].hdr_key_dst);
-    }
-    free(args->cols);
-    for (i=0; i<args->malines; i++)
-    {
-        free(args->alines[i].cols);
-        free(args->alines[i].als);
-        free(args->alines[i].line.s);
-    }
-    free(args->alines);
-    if ( args->tgts ) bcf_sr_regions_destroy(args->tgts);
+    for (i=0; i<tab->mvals; i++) free(tab->vals[i].vals);
+    free(tab->vals);
+    free(tab->cols);
+    free(tab->als);
+    free(tab->line.s);
+}
+
+// The buffers, filter and set_ids which are private to each batch with --threads
+static void destroy_buffers(args_t *args)
+{
     free(args->tmpks.s);
     free(args->tmpi);
     free(args->tmpf);
@@ -1697,92 +2649,68 @@ static void destroy_data(args_t *args)
         convert_destroy(args->set_ids);
     if ( args->filter )
         filter_destroy(args->filter);
-    if (args->out_fh) hts_close(args->out_fh);
-    free(args->sample_map);
 }
 
-static void buffer_annot_lines(args_t *args, bcf1_t *line, int start_pos, int end_pos)
+static void destroy_data(args_t *args)
 {
-    if ( args->nalines && args->alines[0].rid != line->rid ) args->nalines = 0;
-
-    int i = 0;
-    while ( i<args->nalines )
+    int i;
+    for (i=0; i<args->nrm; i++) free(args->rm[i].key);
+    free(args->rm);
+    free(args->rm_info);
+    free(args->rm_fmt);
+    if ( args->hdr_out ) bcf_hdr_destroy(args->hdr_out);
+    if (args->vcmp) vcmp_destroy(args->vcmp);
+    for (i=0; i<args->ncols; i++)
     {
-        if ( line->pos > args->alines[i].end )
-        {
-            args->nalines--;
-            if ( args->nalines && i<args->nalines )
-            {
-                annot_line_t tmp = args->alines[i];
-                memmove(&args->alines[i],&args->alines[i+1],(args->nalines-i)*sizeof(annot_line_t));
-                args->alines[args->nalines] = tmp;
-            }
-        }
-        else i++;
+        free(args->cols[i].hdr_key_src);
+        free(args->cols[i].hdr_key_dst);
     }
-
-    if ( args->ref_idx==-1 && args->nalines ) return;
-
-    while ( !bcf_sr_regions_overlap(args->tgts, bcf_seqname(args->hdr,line), start_pos,end_pos) )
+    free(args->cols);
+    for (i=0; i<args->malines; i++) destroy_annot_line(&args->alines[i]);
+    free(args->alines);
+    if ( args->tgts ) bcf_sr_regions_destroy(args->tgts);
+    if ( args->annot_fh )
     {
-        args->nalines++;
-        hts_expand0(annot_line_t,args->nalines,args->malines,args->alines);
-        annot_line_t *tmp = &args->alines[args->nalines-1];
-        tmp->rid   = line->rid;
-        tmp->start = args->tgts->start;
-        tmp->end   = args->tgts->end;
-        tmp->line.l = 0;
-        kputs(args->tgts->line.s, &tmp->line);
-        char *s = tmp->line.s;
-        tmp->ncols = 1;
-        hts_expand(char*,tmp->ncols,tmp->mcols,tmp->cols);
-        tmp->cols[0] = s;
-        while ( *s )
-        {
-            if ( *s=='\t' )
-            {
-                tmp->ncols++;
-                hts_expand(char*,tmp->ncols,tmp->mcols,tmp->cols);
-                tmp->cols[tmp->ncols-1] = s+1;
-                *s = 0;
-            }
-            s++;
-        }
-        if ( args->ref_idx != -1 )
+        destroy_annot_line(&args->annot_next);
+        if ( hts_close(args->annot_fh)!=0 ) error("Close failed: %s\n", args->targets_fname);
+        free(args->annot_str.s);
+    }
+    if ( args->cache )
+    {
+        destroy_annot_line(&args->annot_next);
+        if ( bgzf_close(args->cache->fp)!=0 ) error("Close failed: %s\n", args->cache_fname);
+        destroy_annot_cache(args->cache);
+    }
+    destroy_buffers(args);
+    for (i=0; i<args->nbatches; i++)
+    {
+        annot_batch_t *batch = &args->batches[i];
+        int j;
+        destroy_buffers(&batch->args);
+        vcmp_destroy(batch->args.vcmp);
+        for (j=0; j<BATCH_SIZE; j++)
         {
-            if ( args->ref_idx >= tmp->ncols ) 
-                error("Could not parse the line, expected %d+ columns, found %d:\n\t%s\n",args->ref_idx+1,tmp->ncols,args->tgts->line.s);
-            if ( args->alt_idx >= tmp->ncols )
-                error("Could not parse the line, expected %d+ columns, found %d:\n\t%s\n",args->alt_idx+1,tmp->ncols,args->tgts->line.s);
-            tmp->nals = 2;
-            hts_expand(char*,tmp->nals,tmp->mals,tmp->als);
-            tmp->als[0] = tmp->cols[args->ref_idx];
-            tmp->als[1] = s = tmp->cols[args->alt_idx];
-            while ( *s )
-            {
-                if ( *s==',' )
-                {
-                    tmp->nals++;
-                    hts_expand(char*,tmp->nals,tmp->mals,tmp->als);
-                    tmp->als[tmp->nals-1] = s+1;
-                    *s = 0;
-                }
-                s++;
-            }
-            int iseq = args->tgts->iseq;
-            if ( bcf_sr_regions_next(args->tgts)<0 || args->tgts->iseq!=iseq ) break;
+            if ( batch->lines[j] ) bcf_destroy1(batch->lines[j]);
+            if ( batch->arecs[j] ) bcf_destroy1(batch->arecs[j]);
+            destroy_annot_line(&batch->tabs[j]);
         }
-        else break;
+        free(batch->lines);
+        free(batch->arecs);
+        free(batch->tabs);
+        free(batch->has_annot);
+        free(batch->pass);
     }
+    free(args->batches);
+    if ( args->tpool_q ) hts_tpool_process_destroy(args->tpool_q);
+    if (args->out_fh) hts_close(args->out_fh);
+    free(args->sample_map);
 }
 
-static void annotate(args_t *args, bcf1_t *line)
+// Find the annotation line or record matching the VCF record, NULL if there is none
+static void *find_annot(args_t *args, bcf1_t *line)
 {
     int i, j;
-    for (i=0; i<args->nrm; i++)
-        args->rm[i].handler(args, line, &args->rm[i]);
-
-    if ( args->tgts )
+    if ( args->tgts || args->annot_fh || args->cache )
     {
         // Buffer annotation lines. When multiple ALT alleles are present in the
         // annotation file, at least one must match one of the VCF alleles.
@@ -1791,7 +2719,16 @@ static void annotate(args_t *args, bcf1_t *line)
         for (i=1; i<line->n_allele; i++)
             if ( len > line->d.var[i].n ) len = line->d.var[i].n;
         int end_pos = len<0 ? line->pos - len : line->pos;
-        buffer_annot_lines(args, line, line->pos, end_pos);
+        if ( args->annot_fh || args->cache )
+        {
+            if ( line->rid < args->vcf_rid || (line->rid==args->vcf_rid && line->pos < args->vcf_pos) )
+                error("The VCF is not sorted in the order of its header, cannot use --stream: %s:%d\n", bcf_seqname(args->hdr,line),line->pos+1);
+            args->vcf_rid = line->rid;
+            args->vcf_pos = line->pos;
+            stream_annot_lines(args, line, line->pos, end_pos);
+        }
+        else
+            buffer_annot_lines(args, line, line->pos, end_pos);
         for (i=0; i<args->nalines; i++)
         {
             if ( line->pos > args->alines[i].end || end_pos < args->alines[i].start ) continue;
@@ -1807,39 +2744,35 @@ static void annotate(args_t *args, bcf1_t *line)
             }
             break;
         }
+        return i<args->nalines ? &args->alines[i] : NULL;
+    }
+    if ( args->files->nreaders == 2 && bcf_sr_has_line(args->files,1) )
+        return bcf_sr_get_line(args->files,1);
+    return NULL;
+}
 
-        if ( i<args->nalines )
-        {
-            // there is a matching line
-            for (j=0; j<args->ncols; j++)
-                if ( args->cols[j].setter(args,line,&args->cols[j],&args->alines[i]) )
-                    error("fixme: Could not set %s at %s:%d\n", args->cols[j].hdr_key_src,bcf_seqname(args->hdr,line),line->pos+1);
-
-        }
+// Remove the tags and apply the annotation found by find_annot(), the only
+// part of the annotation process run by the worker threads with --threads
+static void annotate_line(args_t *args, bcf1_t *line, void *annot)
+{
+    int i;
+    for (i=0; i<args->nrm; i++)
+        args->rm[i].handler(args, line, &args->rm[i]);
 
-        if ( args->mark_sites )
-        {
-            // ideally, we'd like to be far more general than this in future, see https://github.com/samtools/bcftools/issues/87
-            if ( args->mark_sites_logic==MARK_LISTED )
-                bcf_update_info_flag(args->hdr_out,line,args->mark_sites,NULL,i<args->nalines?1:0);
-            else
-                bcf_update_info_flag(args->hdr_out,line,args->mark_sites,NULL,i<args->nalines?0:1);
-        }
+    if ( annot )
+    {
+        // there is a matching line
+        for (i=0; i<args->ncols; i++)
+            if ( args->cols[i].setter(args,line,&args->cols[i],annot) )
+                error("fixme: Could not set %s at %s:%d\n", args->cols[i].hdr_key_src,bcf_seqname(args->hdr,line),line->pos+1);
     }
-    else if ( args->files->nreaders == 2 )
+    if ( args->mark_sites )
     {
-        if ( bcf_sr_has_line(args->files,1) )
-        {
-            bcf1_t *aline = bcf_sr_get_line(args->files,1);
-            for (j=0; j<args->ncols; j++)
-                if ( args->cols[j].setter(args,line,&args->cols[j],aline) )
-                    error("fixme: Could not set %s at %s:%d\n", args->cols[j].hdr_key_src,bcf_seqname(args->hdr,line),line->pos+1);
-
-            if ( args->mark_sites )
-                bcf_update_info_flag(args->hdr_out,line,args->mark_sites,NULL,args->mark_sites_logic==MARK_LISTED ? 1 : 0);
-        }
-        else if ( args->mark_sites )
-            bcf_update_info_flag(args->hdr_out,line,args->mark_sites,NULL, args->mark_sites_logic==MARK_UNLISTED ? 1 : 0);
+        // ideally, we'd like to be far more general than this in future, see https://github.com/samtools/bcftools/issues/87
+        if ( args->mark_sites_logic==MARK_LISTED )
+            bcf_update_info_flag(args->hdr_out,line,args->mark_sites,NULL,annot?1:0);
+        else
+            bcf_update_info_flag(args->hdr_out,line,args->mark_sites,NULL,annot?0:1);
     }
     if ( args->set_ids )
     {
@@ -1856,6 +2789,115 @@ static void annotate(args_t *args, bcf1_t *line)
     }
 }
 
+static void annotate(args_t *args, bcf1_t *line)
+{
+    annotate_line(args, line, find_annot(args, line));
+}
+
+static int filter_line(args_t *args, bcf1_t *line)
+{
+    if ( !args->filter ) return 1;
+    int pass = filter_test(args->filter, line, NULL);
+    if ( args->filter_logic & FLT_EXCLUDE ) pass = pass ? 0 : 1;
+    return pass;
+}
+
+static void copy_annot_line(annot_line_t *dst, annot_line_t *src)
+{
+    int i;
+    dst->line.l = 0;
+    kputsn(src->line.s, src->line.l, &dst->line);
+    dst->ncols = src->ncols;
+    hts_expand(char*,dst->ncols,dst->mcols,dst->cols);
+    for (i=0; i<src->ncols; i++) dst->cols[i] = dst->line.s + (src->cols[i] - src->line.s);
+    dst->nals = src->nals;
+    hts_expand(char*,dst->nals,dst->mals,dst->als);
+    for (i=0; i<src->nals; i++) dst->als[i] = dst->line.s + (src->als[i] - src->line.s);
+    dst->rid   = src->rid;
+    dst->start = src->start;
+    dst->end   = src->end;
+    for (i=0; i<dst->mvals; i++) dst->vals[i].parsed = 0;
+    for (i=0; i<src->mvals; i++)
+    {
+        annot_vals_t *vals = &src->vals[i];
+        if ( vals->parsed ) annot_vals_set(annot_vals(dst,i), vals->vals, vals->n, vals->nper, sizeof(int32_t));
+    }
+}
+
+static void *process_batch(void *arg)
+{
+    annot_batch_t *batch = (annot_batch_t*) arg;
+    args_t *args = &batch->args;
+    int i;
+    for (i=0; i<batch->nlines; i++)
+    {
+        batch->pass[i] = filter_line(args, batch->lines[i]);
+        if ( !batch->pass[i] ) continue;
+        void *annot = NULL;
+        if ( batch->has_annot[i] ) annot = args->tgts_is_vcf ? (void*)batch->arecs[i] : (void*)&batch->tabs[i];
+        annotate_line(args, batch->lines[i], annot);
+    }
+    return batch;
+}
+
+// Wait for the oldest dispatched batch and write out the records which passed
+static void write_next_batch(args_t *args)
+{
+    hts_tpool_result *res = hts_tpool_next_result_wait(args->tpool_q);
+    if ( !res ) error("Failed to retrieve the processed records\n");
+    annot_batch_t *batch = (annot_batch_t*) hts_tpool_result_data(res);
+    int i;
+    for (i=0; i<batch->nlines; i++)
+        if ( batch->pass[i] ) bcf_write1(args->out_fh, args->hdr_out, batch->lines[i]);
+    batch->nlines = 0;
+    hts_tpool_delete_result(res, 0);
+    args->nbusy--;
+}
+
+static void dispatch_batch(args_t *args, annot_batch_t *batch)
+{
+    if ( hts_tpool_dispatch(args->files->p->pool, args->tpool_q, process_batch, batch) < 0 )
+        error("Failed to dispatch the records to the thread pool\n");
+    args->nbusy++;
+}
+
+// The main thread reads the records and pairs them with the matching
+// annotation, which depends on the order of the records, so that with
+// tab-delimited annotations the filter is also applied here. The batches are
+// filled and dispatched round-robin and written in the order of dispatching.
+static void annotate_parallel(args_t *args)
+{
+    int ibatch = 0;
+    while ( bcf_sr_next_line(args->files) )
+    {
+        if ( !bcf_sr_has_line(args->files,0) ) continue;
+        bcf1_t *line = bcf_sr_get_line(args->files,0);
+        if ( line->errcode ) error("Encountered error, cannot proceed. Please check the error output above.\n");
+        if ( annot_is_streamed(args) && !filter_line(args, line) ) continue;
+
+        annot_batch_t *batch = &args->batches[ibatch];
+        int i = batch->nlines++;
+        if ( !batch->lines[i] ) batch->lines[i] = bcf_init1();
+        bcf_copy(batch->lines[i], line);
+        void *annot = find_annot(args, line);
+        batch->has_annot[i] = annot ? 1 : 0;
+        if ( annot && args->tgts_is_vcf )
+        {
+            if ( !batch->arecs[i] ) batch->arecs[i] = bcf_init1();
+            bcf_copy(batch->arecs[i], (bcf1_t*)annot);
+        }
+        else if ( annot )
+            copy_annot_line(&batch->tabs[i], (annot_line_t*)annot);
+        if ( batch->nlines < BATCH_SIZE ) continue;
+
+        dispatch_batch(args, batch);
+        ibatch = (ibatch + 1) % args->nbatches;
+        if ( args->nbusy==args->nbatches ) write_next_batch(args);
+    }
+    if ( args->batches[ibatch].nlines ) dispatch_batch(args, &args->batches[ibatch]);
+    while ( args->nbusy ) write_next_batch(args);
+}
+
 static void usage(args_t *args)
 {
     fprintf(stderr, "\n");
@@ -1864,6 +2906,8 @@ static void usage(args_t *args)
     fprintf(stderr, "\n");
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "   -a, --annotations <file>       VCF file or tabix-indexed file with annotations: CHR\\tPOS[\\tVALUE]+\n");
+    fprintf(stderr, "       --build-cache <file>       convert the tab-delimited -a file to a binary cache and exit\n");
+    fprintf(stderr, "       --cache <file>             read the annotations from a cache created with --build-cache instead of -a\n");
     fprintf(stderr, "       --collapse <string>        matching records by <snps|indels|both|all|some|none>, see man page for details [some]\n");
     fprintf(stderr, "   -c, --columns <list>           list of columns in the annotation file, e.g. CHROM,POS,REF,ALT,-,INFO/TAG. See man page for details\n");
     fprintf(stderr, "   -e, --exclude <expr>           exclude sites for which the expression is true (see man page for details)\n");
@@ -1878,9 +2922,11 @@ static void usage(args_t *args)
     fprintf(stderr, "   -R, --regions-file <file>      restrict to regions listed in a file\n");
     fprintf(stderr, "       --rename-chrs <file>       rename sequences according to map file: from\\tto\n");
     fprintf(stderr, "   -s, --samples [^]<list>        comma separated list of samples to annotate (or exclude with \"^\" prefix)\n");
+    fprintf(stderr, "       --stream                   read the sorted -a file sequentially with the VCF, no index needed\n");
     fprintf(stderr, "   -S, --samples-file [^]<file>   file of samples to annotate (or exclude with \"^\" prefix)\n");
     fprintf(stderr, "   -x, --remove <list>            list of annotations to remove (e.g. ID,INFO/DP,FORMAT/DP,FILTER). See man page for details\n");
-    fprintf(stderr, "       --threads <int>            number of extra output compression threads [0]\n");
+    fprintf(stderr, "       --threads <int>            number of extra threads for compression and annotation [0]\n");
+    fprintf(stderr, "       --write-index              index the output file, requires compressed output written to a file\n");
     fprintf(stderr, "\n");
     exit(1);
 }
@@ -1897,6 +2943,7 @@ int main_vcfannotate(int argc, char *argv[])
     args->record_cmd_line = 1;
     args->ref_idx = args->alt_idx = args->chr_idx = args->from_idx = args->to_idx = -1;
     args->set_ids_replace = 1;
+    args->prev_rid = args->prev_pos = args->vcf_rid = args->vcf_pos = -1;
     int regions_is_file = 0, collapse = 0;
 
     static struct option loptions[] =
@@ -1919,6 +2966,10 @@ int main_vcfannotate(int argc, char *argv[])
         {"samples",required_argument,NULL,'s'},
         {"samples-file",required_argument,NULL,'S'},
         {"no-version",no_argument,NULL,8},
+        {"stream",no_argument,NULL,3},
+        {"build-cache",required_argument,NULL,4},
+        {"cache",required_argument,NULL,5},
+        {"write-index",no_argument,NULL,10},
         {NULL,0,NULL,0}
     };
     while ((c = getopt_long(argc, argv, "h:?o:O:r:R:a:x:c:i:e:S:s:I:m:",loptions,NULL)) >= 0)
@@ -1964,6 +3015,10 @@ int main_vcfannotate(int argc, char *argv[])
                 break;
             case  9 : args->n_threads = strtol(optarg, 0, 0); break;
             case  8 : args->record_cmd_line = 0; break;
+            case  3 : args->stream = 1; break;
+            case  4 : args->cache_fname = optarg; args->build_cache = 1; break;
+            case  5 : args->cache_fname = optarg; break;
+            case 10 : args->write_index = 1; break;
             case '?': usage(args); break;
             default: error("Unknown argument: %s\n", optarg);
         }
@@ -1993,28 +3048,40 @@ int main_vcfannotate(int argc, char *argv[])
             args->tgts_is_vcf = 1;
             args->files->require_index = 1;
             args->files->collapse = collapse ? collapse : COLLAPSE_SOME;
+            if ( args->stream ) error("The --stream option is for tab-delimited annotation files only\n");
+            if ( args->build_cache ) error("The --build-cache option is for tab-delimited annotation files only\n");
         }
     }
     if ( bcf_sr_set_threads(args->files, args->n_threads)<0 ) error("Failed to create threads\n");
     if ( !bcf_sr_add_reader(args->files, fname) ) error("Failed to open %s: %s\n", fname,bcf_sr_strerror(args->files->errnum));
 
+    if ( args->build_cache && !args->targets_fname ) error("The -a option not given\n");
+    if ( args->cache_fname && !args->build_cache && args->targets_fname ) error("The options --cache and -a cannot be combined\n");
+    if ( args->cache_fname && !args->build_cache && args->stream ) error("The options --cache and --stream cannot be combined\n");
+    if ( args->write_index && !args->build_cache ) init_write_index(args->output_fname, args->output_type);
+
     init_data(args);
-    while ( bcf_sr_next_line(args->files) )
+    if ( args->build_cache )
+    {
+        write_annot_cache(args);
+        destroy_data(args);
+        bcf_sr_destroy(args->files);
+        free(args);
+        return 0;
+    }
+    if ( args->batches ) annotate_parallel(args);
+    else while ( bcf_sr_next_line(args->files) )
     {
         if ( !bcf_sr_has_line(args->files,0) ) continue;
         bcf1_t *line = bcf_sr_get_line(args->files,0);
         if ( line->errcode ) error("Encountered error, cannot proceed. Please check the error output above.\n");
-        if ( args->filter )
-        {
-            int pass = filter_test(args->filter, line, NULL);
-            if ( args->filter_logic & FLT_EXCLUDE ) pass = pass ? 0 : 1;
-            if ( !pass ) continue;
-        }
+        if ( !filter_line(args, line) ) continue;
         annotate(args, line);
         bcf_write1(args->out_fh, args->hdr_out, line);
     }
     destroy_data(args);
     bcf_sr_destroy(args->files);
+    if ( args->write_index ) write_index(args->output_fname, args->output_type, args->n_threads);
     free(args);
     return 0;
 }
@@ -26,14 +26,42 @@
 
 #include <htslib/vcf.h>
 #include <htslib/vcfutils.h>
+#include <htslib/thread_pool.h>
 #include "bcftools.h"
 #include "vcfbuf.h"
 #include "rbuf.h"
 
+// Genotype dosages packed in three bit-planes of nwords: non-missing, dosage bit 0 and bit 1
+typedef struct
+{
+    uint64_t *bits;
+    int nwords, mbits;
+    int status;         // 0: not packed yet, 1: packed, -1: no GT or cannot be packed (ploidy>3)
+    int na;             // per-site sums for the correlation: number of non-missing samples,
+    double a, aa;       //  sum of dosages and of squared dosages
+}
+gtbits_t;
+
+// A range of the buffer compared with the query record by one thread
+typedef struct
+{
+    vcfbuf_t *buf;
+    bcf1_t *rec;
+    int beg, end;       // the range of k-th buffered sites, 0-based, end exclusive
+    int iexc, imax;     // rbuf index of the first site exceeding ld.max and of the maximum, -1 if none
+    double exc, max;
+}
+ld_job_t;
+
 typedef struct
 {
     double max;
     int rand_missing, skip_filter;
+    gtbits_t gt;        // the query record of vcfbuf_max_ld()
+    hts_tpool *pool;    // optional, the comparisons are spread across the threads
+    hts_tpool_process *q;
+    ld_job_t *jobs;
+    int njobs;
 }
 ld_t;
 
@@ -42,6 +70,7 @@ typedef struct
     bcf1_t *rec;
     double af;
     int af_set:1, idx:31;
+    gtbits_t gt;        // packed once and reused for all LD queries while in the buffer
 }
 vcfrec_t;
 
@@ -86,8 +115,14 @@ void vcfbuf_destroy(vcfbuf_t *buf)
 {
     int i;
     for (i=0; i<buf->rbuf.m; i++)
+    {
         if ( buf->vcf[i].rec ) bcf_destroy(buf->vcf[i].rec);
+        free(buf->vcf[i].gt.bits);
+    }
     free(buf->vcf);
+    free(buf->ld.gt.bits);
+    if ( buf->ld.q ) hts_tpool_process_destroy(buf->ld.q);
+    free(buf->ld.jobs);
     free(buf->prune.farr);
     free(buf->prune.vrec);
     free(buf->prune.ac);
@@ -103,6 +138,15 @@ void vcfbuf_set(vcfbuf_t *buf, vcfbuf_opt_t key, void *value)
     if ( key==VCFBUF_NSITES ) { buf->prune.max_sites = *((int*)value); return; }
     if ( key==VCFBUF_AF_TAG ) { buf->prune.af_tag = *((char**)value); return; }
     if ( key==VCFBUF_OVERLAP_WIN ) { buf->overlap.active = *((int*)value); return; }
+    if ( key==VCFBUF_THREAD_POOL )
+    {
+        buf->ld.pool  = *((hts_tpool**)value);
+        buf->ld.njobs = hts_tpool_size(buf->ld.pool);
+        buf->ld.jobs  = (ld_job_t*) calloc(buf->ld.njobs, sizeof(ld_job_t));
+        buf->ld.q = hts_tpool_process_init(buf->ld.pool, buf->ld.njobs, 0);
+        if ( !buf->ld.q ) error("Failed to initialize the thread pool queue\n");
+        return;
+    }
 }
 
 int vcfbuf_nsites(vcfbuf_t *buf)
@@ -122,6 +166,7 @@ bcf1_t *vcfbuf_push(vcfbuf_t *buf, bcf1_t *rec, int swap)
     bcf1_t *ret = buf->vcf[i].rec;
     buf->vcf[i].rec = rec;
     buf->vcf[i].af_set = 0;
+    buf->vcf[i].gt.status = 0;
 
     return ret;
 }
@@ -296,30 +341,126 @@ static double _estimate_af(int8_t *ptr, int size, int nvals, int nsamples)
     return (double)nalt/(nref+nalt);
 }
 
+static bcf_fmt_t *_get_gt_fmt(vcfbuf_t *buf, bcf1_t *rec)
+{
+    int i, igt = bcf_hdr_id2int(buf->hdr, BCF_DT_ID, "GT");
+    bcf_unpack(rec, BCF_UN_FMT);
+    for (i=0; i<rec->n_fmt; i++)
+        if ( rec->d.fmt[i].id==igt ) break;
+    if ( i==rec->n_fmt ) return NULL;   // no GT tag
+    bcf_fmt_t *fmt = &rec->d.fmt[i];
+    if ( fmt->n==0 ) return NULL;       // empty?!
+    if ( fmt->type!=BCF_BT_INT8 ) error("TODO: the GT fmt_type is not int8!\n");
+    return fmt;
+}
+
+static void _pack_gt(vcfbuf_t *buf, bcf1_t *rec, gtbits_t *gt)
+{
+    gt->status = -1;
+    bcf_fmt_t *fmt = _get_gt_fmt(buf, rec);
+    if ( !fmt ) return;
+
+    int i,j, nwords = (rec->n_sample + 63) / 64;
+    hts_expand(uint64_t, 3*nwords, gt->mbits, gt->bits);
+    memset(gt->bits, 0, sizeof(*gt->bits)*3*nwords);
+    uint64_t *mask = gt->bits, *bit0 = mask + nwords, *bit1 = bit0 + nwords;
+    gt->nwords = nwords;
+    gt->na = 0;
+    gt->a = gt->aa = 0;
+    for (i=0; i<rec->n_sample; i++)
+    {
+        int8_t *ptr = (int8_t*) (fmt->p + i*fmt->size);
+        int dsg = 0, n = 0;
+        for (j=0; j<fmt->n; j++)
+        {
+            if ( ptr[j]==bcf_int8_vector_end || ptr[j]==bcf_gt_missing ) break;
+            if ( bcf_gt_allele(ptr[j]) ) dsg++;
+            n++;
+        }
+        if ( !n ) continue;
+        if ( dsg > 3 ) return;  // leave to the scalar code
+        uint64_t bit = 1ULL << (i & 63);
+        mask[i>>6] |= bit;
+        if ( dsg & 1 ) bit0[i>>6] |= bit;
+        if ( dsg & 2 ) bit1[i>>6] |= bit;
+        gt->na++;
+        gt->a  += dsg;
+        gt->aa += dsg*dsg;
+    }
+    gt->status = 1;
+}
+
+static double _calc_cor2(double ab, double aa, double bb, double a, double b, int nab, int na, int nb, int ndiff)
+{
+    if ( !nab ) return -1;
+
+    double cor;
+    if ( !ndiff ) cor = 1;
+    else
+    {
+        // Don't know how to deal with zero variance. Since this the purpose is filtering,
+        // it is not enough to say the value is undefined. Therefore an artificial noise is
+        // added to make the denominator non-zero.
+        if ( aa == a*a/na || bb == b*b/nb )
+        {
+            aa += 3*3;
+            bb += 3*3;
+            ab += 3*3;
+            a  += 3;
+            b  += 3;
+            na++;
+            nb++;
+            nab++;
+        }
+        cor = (ab/nab - a/na*b/nb) / sqrt(aa/na - a/na*a/na) / sqrt(bb/nb - b/nb*b/nb);
+    }
+    return cor*cor;
+}
+
+/*
+    The same as the scalar code in _calc_ld() without --rand-missing, on the packed
+    dosages d = bit0 + 2*bit1: the product of two dosages expands to four ANDs
+*/
+static double _calc_ld_packed(gtbits_t *agt, gtbits_t *bgt)
+{
+    int i, n = agt->nwords, nab = 0, ndiff = 0;
+    uint64_t *am = agt->bits, *a0 = am + n, *a1 = a0 + n;
+    uint64_t *bm = bgt->bits, *b0 = bm + n, *b1 = b0 + n;
+    uint64_t ab1 = 0, ab2 = 0, ab4 = 0;
+    for (i=0; i<n; i++)
+    {
+        uint64_t both = am[i] & bm[i];
+        nab   += __builtin_popcountll(both);
+        ndiff += __builtin_popcountll(both & ((a0[i]^b0[i]) | (a1[i]^b1[i])));
+        ab1   += __builtin_popcountll(a0[i] & b0[i]);
+        ab2   += __builtin_popcountll(a0[i] & b1[i]) + __builtin_popcountll(a1[i] & b0[i]);
+        ab4   += __builtin_popcountll(a1[i] & b1[i]);
+    }
+    double ab = ab1 + 2*ab2 + 4*ab4;
+    return _calc_cor2(ab, agt->aa, bgt->aa, agt->a, bgt->a, nab, agt->na, bgt->na, ndiff);
+}
+
 /*
     For unphased genotypes D is approximated as suggested in https://www.ncbi.nlm.nih.gov/pmc/articles/PMC2710162/
         D =~ (GT correlation) * sqrt(Pa*(1-Pa)*Pb*(1-Pb))
 */
-static double _calc_ld(vcfbuf_t *buf, bcf1_t *arec, bcf1_t *brec)
+static double _calc_ld(vcfbuf_t *buf, vcfrec_t *avrec, bcf1_t *brec)
 {
+    bcf1_t *arec = avrec->rec;
     if ( arec->n_sample!=brec->n_sample ) error("Different number of samples: %d vs %d\n",arec->n_sample,brec->n_sample);
     assert( arec->n_sample );
 
-    int i,j,igt = bcf_hdr_id2int(buf->hdr, BCF_DT_ID, "GT");
-    bcf_unpack(arec, BCF_UN_FMT);
-    bcf_unpack(brec, BCF_UN_FMT);
-    bcf_fmt_t *afmt = NULL, *bfmt = NULL;
-    for (i=0; i<arec->n_fmt; i++)
-        if ( arec->d.fmt[i].id==igt ) { afmt = &arec->d.fmt[i]; break; }
-    if ( !afmt ) return -1;  // no GT tag
-    for (i=0; i<brec->n_fmt; i++)
-        if ( brec->d.fmt[i].id==igt ) { bfmt = &brec->d.fmt[i]; break; }
-    if ( !bfmt ) return -1;  // no GT tag
-
-    if ( afmt->n==0 ) return -1;   // empty?!
-    if ( bfmt->n==0 ) return -1;   // empty?!
-    if ( afmt->type!=BCF_BT_INT8 ) error("TODO: the GT fmt_type is not int8!\n");
-    if ( bfmt->type!=BCF_BT_INT8 ) error("TODO: the GT fmt_type is not int8!\n");
+    if ( !buf->ld.rand_missing )
+    {
+        if ( !avrec->gt.status ) _pack_gt(buf, arec, &avrec->gt);
+        if ( avrec->gt.status > 0 && buf->ld.gt.status > 0 ) return _calc_ld_packed(&avrec->gt, &buf->ld.gt);
+    }
+
+    int i,j;
+    bcf_fmt_t *afmt = _get_gt_fmt(buf, arec);
+    if ( !afmt ) return -1;
+    bcf_fmt_t *bfmt = _get_gt_fmt(buf, brec);
+    if ( !bfmt ) return -1;
 
     // Determine allele frequencies, this is to sample randomly missing genotypes
     double aaf = 0, baf = 0;
@@ -378,29 +519,38 @@ static double _calc_ld(vcfbuf_t *buf, bcf1_t *arec, bcf1_t *brec)
             nab++;
         }
     }
-    if ( !nab ) return -1;
+    return _calc_cor2(ab, aa, bb, a, b, nab, na, nb, ndiff);
+}
 
-    double cor;
-    if ( !ndiff ) cor = 1;
-    else
+static void *_max_ld_range(void *arg)
+{
+    ld_job_t *job = (ld_job_t*) arg;
+    vcfbuf_t *buf = job->buf;
+    int k;
+    job->iexc = job->imax = -1;
+    job->max  = 0;
+    for (k=job->beg; k<job->end; k++)
     {
-        // Don't know how to deal with zero variance. Since this the purpose is filtering,
-        // it is not enough to say the value is undefined. Therefore an artificial noise is
-        // added to make the denominator non-zero.
-        if ( aa == a*a/na || bb == b*b/nb )
+        int i = rbuf_kth(&buf->rbuf, k);
+        if ( buf->ld.skip_filter )
         {
-            aa += 3*3;
-            bb += 3*3;
-            ab += 3*3;
-            a  += 3;
-            b  += 3;
-            na++;
-            nb++;
-            nab++;
+            if ( buf->vcf[i].rec->d.n_flt > 1 ) continue;   // multiple filters are set
+            if ( buf->vcf[i].rec->d.n_flt==1 && buf->vcf[i].rec->d.flt[0]!=0 ) continue;    // not PASS
+        }
+        double val = _calc_ld(buf, &buf->vcf[i], job->rec);
+        if ( buf->ld.max && buf->ld.max < val ) 
+        {
+            job->exc  = val;
+            job->iexc = i;
+            break;
+        }
+        if ( val > job->max )
+        {
+            job->max  = val;
+            job->imax = i;
         }
-        cor = (ab/nab - a/na*b/nb) / sqrt(aa/na - a/na*a/na) / sqrt(bb/nb - b/nb*b/nb);
     }
-    return cor*cor;
+    return job;
 }
 
 bcf1_t *vcfbuf_max_ld(vcfbuf_t *buf, bcf1_t *rec, double *ld)
@@ -414,29 +564,58 @@ bcf1_t *vcfbuf_max_ld(vcfbuf_t *buf, bcf1_t *rec, double *ld)
     // must come from the same chromosome
     if ( buf->vcf[i].rec->rid != rec->rid ) return NULL;
 
-    int imax = 0;
-    double max = 0;
-    for (i=-1; rbuf_next(&buf->rbuf,&i); )
-    {   
-        if ( buf->ld.skip_filter )
+    buf->ld.gt.status = 0;
+    if ( !buf->ld.rand_missing ) _pack_gt(buf, rec, &buf->ld.gt);
+
+    // Split the buffer into contiguous ranges, small windows are not worth the
+    // dispatch and rand() of --randomize-missing is not thread-safe
+    int njobs = 1;
+    if ( buf->ld.pool && !buf->ld.rand_missing )
+    {
+        njobs = buf->rbuf.n / 1000;
+        if ( njobs > buf->ld.njobs ) njobs = buf->ld.njobs;
+        if ( njobs < 1 ) njobs = 1;
+    }
+    ld_job_t job1, *jobs = njobs > 1 ? buf->ld.jobs : &job1;
+    for (i=0; i<njobs; i++)
+    {
+        jobs[i].buf = buf;
+        jobs[i].rec = rec;
+        jobs[i].beg = (int64_t)buf->rbuf.n * i / njobs;
+        jobs[i].end = (int64_t)buf->rbuf.n * (i+1) / njobs;
+    }
+    if ( njobs==1 )
+        _max_ld_range(&job1);
+    else
+    {
+        for (i=0; i<njobs; i++)
+            if ( hts_tpool_dispatch(buf->ld.pool, buf->ld.q, _max_ld_range, &jobs[i]) < 0 )
+                error("Failed to dispatch the LD calculation to the thread pool\n");
+        for (i=0; i<njobs; i++)
         {
-            if ( buf->vcf[i].rec->d.n_flt > 1 ) continue;   // multiple filters are set
-            if ( buf->vcf[i].rec->d.n_flt==1 && buf->vcf[i].rec->d.flt[0]!=0 ) continue;    // not PASS
+            hts_tpool_result *res = hts_tpool_next_result_wait(buf->ld.q);
+            if ( !res ) error("Failed to retrieve the LD calculation\n");
+            hts_tpool_delete_result(res, 0);
         }
-        double val = _calc_ld(buf, buf->vcf[i].rec, rec);
-        if ( buf->ld.max && buf->ld.max < val ) 
+    }
+
+    // The first range with a site exceeding the threshold wins, otherwise the
+    // maximum of the earliest range, as if the buffer was scanned in order
+    int imax = 0;
+    double max = 0;
+    for (i=0; i<njobs; i++)
+    {
+        if ( jobs[i].iexc >= 0 )
         {
-            *ld = val;
-            return buf->vcf[i].rec;
+            *ld = jobs[i].exc;
+            return buf->vcf[jobs[i].iexc].rec;
         }
-        if ( val > max )
+        if ( jobs[i].max > max )
         {
-            max  = val;
-            imax = i;
+            max  = jobs[i].max;
+            imax = jobs[i].imax;
         }
     }
     *ld = max;
     return buf->vcf[imax].rec;
 }
-
-
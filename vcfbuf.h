@@ -44,6 +44,7 @@ typedef enum
     VCFBUF_NSITES,          // leave at max this many sites in the window
     VCFBUF_AF_TAG,          // use this INFO tag with LD_NSITES
     VCFBUF_OVERLAP_WIN,     // keep only overlapping variants in the window
+    VCFBUF_THREAD_POOL,     // hts_tpool* to spread the comparisons of vcfbuf_max_ld() across
 }
 vcfbuf_opt_t;
 
@@ -36,6 +36,7 @@ THE SOFTWARE.  */
 #include <htslib/kfunc.h>
 #include <htslib/synced_bcf_reader.h>
 #include <htslib/khash_str2int.h>
+#include <htslib/thread_pool.h>
 #include <ctype.h>
 #include "bcftools.h"
 #include "call.h"
@@ -66,6 +67,10 @@ void error(const char *format, ...);
 #define CF_QCNT         (1<<13)
 #define CF_INDEL_ONLY   (1<<14)
 
+#define BATCH_SIZE 1000
+
+typedef struct _call_batch_t call_batch_t;
+
 typedef struct
 {
     int flag;   // combination of CF_* flags above
@@ -82,11 +87,18 @@ typedef struct
     int *sample2sex;    // mapping for ploidy. If negative, interpreted as -1*ploidy
     int *sex2ploidy, *sex2ploidy_prev, nsex;
     ploidy_t *ploidy;
+    int ploidy_rid;                     // the segment with the current ploidy, see set_ploidy()
+    uint32_t ploidy_beg, ploidy_end;
     gvcf_t *gvcf;
 
     bcf1_t *missed_line;
     call_t aux;     // parameters and temporary data
 
+    // With --threads, batches of records are called in parallel, each with a private copy of aux
+    call_batch_t *batches;
+    int nbatches, nbusy;
+    hts_tpool_process *tpool_q;
+
     int argc;
     char **argv;
 
@@ -102,6 +114,14 @@ typedef struct
 }
 args_t;
 
+struct _call_batch_t
+{
+    args_t *args;
+    call_t call;        // private copy of args->aux
+    bcf1_t **lines;
+    int *ret, *unseen, nlines;
+};
+
 static char **add_sample(void *name2idx, char **lines, int *nlines, int *mlines, char *name, char sex, int *ith)
 {
     int ret = khash_str2int_get(name2idx, name, ith);
@@ -391,6 +411,7 @@ static void init_data(args_t *args)
             error("Failed to read the regions: %s\n", args->regions);
     }
 
+    if ( bcf_sr_set_threads(args->aux.srs, args->n_threads)<0 ) error("Failed to create threads\n");
     if ( !bcf_sr_add_reader(args->aux.srs, args->bcf_fname) ) error("Failed to open %s: %s\n", args->bcf_fname,bcf_sr_strerror(args->aux.srs->errnum));
     args->aux.hdr = bcf_sr_get_header(args->aux.srs,0);
 
@@ -407,6 +428,7 @@ static void init_data(args_t *args)
     if ( args->ploidy  )
     {
         args->nsex = ploidy_nsex(args->ploidy);
+        args->ploidy_rid = -1;
         args->sex2ploidy = (int*) calloc(args->nsex,sizeof(int));
         args->sex2ploidy_prev = (int*) calloc(args->nsex,sizeof(int));
         if ( !args->nsamples )
@@ -453,7 +475,7 @@ static void init_data(args_t *args)
 
     args->out_fh = hts_open(args->output_fname, hts_bcf_wmode(args->output_type));
     if ( args->out_fh == NULL ) error("Can't write to \"%s\": %s\n", args->output_fname, strerror(errno));
-    if ( args->n_threads ) hts_set_threads(args->out_fh, args->n_threads);
+    if ( args->n_threads > 0 ) hts_set_opt(args->out_fh, HTS_OPT_THREAD_POOL, args->aux.srs->p);
 
     if ( args->flag & CF_QCALL )
         return;
@@ -471,14 +493,47 @@ static void init_data(args_t *args)
     bcf_hdr_write(args->out_fh, args->aux.hdr);
 
     if ( args->flag&CF_INS_MISSED ) init_missed_line(args);
+
+    // Only the multiallelic caller can run in parallel. The consensus caller keeps
+    // state between sites and the constrained alleles are read in sync with the input.
+    if ( args->n_threads > 0 && (args->flag & CF_MCALL) && !(args->aux.flag & CALL_CONSTR_ALLELES) )
+    {
+        // two batches per thread keep the workers busy while the output is written
+        args->nbatches = 2*args->n_threads;
+        args->batches  = (call_batch_t*) calloc(args->nbatches, sizeof(call_batch_t));
+        for (i=0; i<args->nbatches; i++)
+        {
+            call_batch_t *batch = &args->batches[i];
+            batch->args = args;
+            mcall_init_copy(&batch->call, &args->aux);
+            batch->lines  = (bcf1_t**) calloc(BATCH_SIZE, sizeof(bcf1_t*));
+            batch->ret    = (int*) malloc(sizeof(int)*BATCH_SIZE);
+            batch->unseen = (int*) malloc(sizeof(int)*BATCH_SIZE);
+        }
+        args->tpool_q = hts_tpool_process_init(args->aux.srs->p->pool, args->nbatches, 0);
+        if ( !args->tpool_q ) error("Failed to initialize the thread pool queue\n");
+    }
 }
 
 static void destroy_data(args_t *args)
 {
+    int i, j;
+    for (i=0; i<args->nbatches; i++)
+    {
+        call_batch_t *batch = &args->batches[i];
+        mcall_destroy_copy(&batch->call);
+        for (j=0; j<BATCH_SIZE; j++)
+            if ( batch->lines[j] ) bcf_destroy(batch->lines[j]);
+        free(batch->lines);
+        free(batch->ret);
+        free(batch->unseen);
+    }
+    free(args->batches);
+    if ( args->tpool_q ) hts_tpool_process_destroy(args->tpool_q);
+
     if ( args->flag & CF_CCALL ) ccall_destroy(&args->aux);
     else if ( args->flag & CF_MCALL ) mcall_destroy(&args->aux);
     else if ( args->flag & CF_QCALL ) qcall_destroy(&args->aux);
-    int i;
     if ( args->samples )
     {
         for (i=0; i<args->nsamples; i++) free(args->samples[i]);
@@ -545,15 +600,18 @@ static int parse_format_flag(const char *str)
     return flag;
 }
 
-static void set_ploidy(args_t *args, bcf1_t *rec)
+// Returns 1 if the ploidy changed, 0 otherwise
+static int set_ploidy(args_t *args, bcf1_t *rec)
 {
-    ploidy_query(args->ploidy,(char*)bcf_seqname(args->aux.hdr,rec),rec->pos,args->sex2ploidy,NULL,NULL);
+    if ( rec->rid==args->ploidy_rid && rec->pos>=args->ploidy_beg && rec->pos<=args->ploidy_end ) return 0;
+    ploidy_query_segment(args->ploidy,(char*)bcf_seqname(args->aux.hdr,rec),rec->pos,args->sex2ploidy,NULL,NULL,&args->ploidy_beg,&args->ploidy_end);
+    args->ploidy_rid = rec->rid;
 
     int i;
     for (i=0; i<args->nsex; i++)
         if ( args->sex2ploidy[i]!=args->sex2ploidy_prev[i] ) break;
 
-    if ( i==args->nsex ) return;    // ploidy same as previously
+    if ( i==args->nsex ) return 0;  // ploidy same as previously
 
     for (i=0; i<args->nsamples; i++)
     {
@@ -563,6 +621,7 @@ static void set_ploidy(args_t *args, bcf1_t *rec)
             args->aux.ploidy[i] = args->sex2ploidy[args->sample2sex[i]];
     }
     int *tmp = args->sex2ploidy; args->sex2ploidy = args->sex2ploidy_prev; args->sex2ploidy_prev = tmp;
+    return 1;
 }
 
 ploidy_t *init_ploidy(char *alias)
@@ -601,6 +660,121 @@ ploidy_t *init_ploidy(char *alias)
     return ploidy_init_string(pld->ploidy,2);
 }
 
+// Sites filtered by type, returns 1 if the record should be skipped. Sets the
+// index of the unseen (symbolic) allele in args->aux.unseen.
+static int skip_line(args_t *args, bcf1_t *bcf_rec)
+{
+    bcf_unpack(bcf_rec, BCF_UN_STR);
+
+    // Skip unwanted sites
+    int i, is_indel = bcf_is_snp(bcf_rec) ? 0 : 1;
+    if ( (args->flag & CF_INDEL_ONLY) && !is_indel ) return 1;
+    if ( (args->flag & CF_NO_INDEL) && is_indel ) return 1;
+    if ( (args->flag & CF_ACGT_ONLY) && (bcf_rec->d.allele[0][0]=='N' || bcf_rec->d.allele[0][0]=='n') ) return 1;   // REF[0] is 'N'
+
+    // Which allele is symbolic? All SNPs should have it, but not indels
+    args->aux.unseen = 0;
+    for (i=1; i<bcf_rec->n_allele; i++)
+    {
+        if ( bcf_rec->d.allele[i][0]=='X' ) { args->aux.unseen = i; break; }  // old X
+        if ( bcf_rec->d.allele[i][0]=='<' )
+        {
+            if ( bcf_rec->d.allele[i][1]=='X' && bcf_rec->d.allele[i][2]=='>' ) { args->aux.unseen = i; break; } // old <X>
+            if ( bcf_rec->d.allele[i][1]=='*' && bcf_rec->d.allele[i][2]=='>' ) { args->aux.unseen = i; break; } // new <*>
+        }
+    }
+    int is_ref = (bcf_rec->n_allele==1 || (bcf_rec->n_allele==2 && args->aux.unseen>0)) ? 1 : 0;
+
+    if ( is_ref && args->aux.flag&CALL_VARONLY ) return 1;
+    return 0;
+}
+
+static void write_line(args_t *args, bcf1_t *bcf_rec, int ret)
+{
+    if ( ret==-1 ) error("Something is wrong\n");
+    else if ( ret==-2 ) return;     // skip the site
+
+    // Normal output
+    if ( (args->aux.flag & CALL_VARONLY) && ret==0 && !args->gvcf ) return;     // not a variant
+    if ( args->gvcf )
+        bcf_rec = gvcf_write(args->gvcf, args->out_fh, args->aux.hdr, bcf_rec, ret==1?1:0);
+    if ( bcf_rec )
+        bcf_write1(args->out_fh, args->aux.hdr, bcf_rec);
+}
+
+static void *call_batch(void *arg)
+{
+    call_batch_t *batch = (call_batch_t*) arg;
+    args_t *args = batch->args;
+    int i;
+    for (i=0; i<batch->nlines; i++)
+    {
+        bcf1_t *rec = batch->lines[i];
+        if ( args->samples_map ) bcf_subset(args->aux.hdr, rec, args->nsamples, args->samples_map);
+        bcf_unpack(rec, BCF_UN_ALL);
+        batch->call.unseen = batch->unseen[i];
+        batch->ret[i] = mcall(&batch->call, rec);
+    }
+    return batch;
+}
+
+// Wait for the oldest dispatched batch and write out its records in order
+static void write_next_batch(args_t *args)
+{
+    hts_tpool_result *res = hts_tpool_next_result_wait(args->tpool_q);
+    if ( !res ) error("Failed to retrieve the called records\n");
+    call_batch_t *batch = (call_batch_t*) hts_tpool_result_data(res);
+    int i;
+    for (i=0; i<batch->nlines; i++)
+        write_line(args, batch->lines[i], batch->ret[i]);
+    batch->nlines = 0;
+    hts_tpool_delete_result(res, 0);
+    args->nbusy--;
+}
+
+static void dispatch_batch(args_t *args, call_batch_t *batch)
+{
+    if ( hts_tpool_dispatch(args->aux.srs->p->pool, args->tpool_q, call_batch, batch) < 0 )
+        error("Failed to dispatch the records to the thread pool\n");
+    args->nbusy++;
+}
+
+// The batches are filled and dispatched round-robin and retrieved in the order of
+// dispatching, the gVCF blocks are then assembled from the ordered output. A
+// batch is dispatched early when the ploidy changes, so that all its records are
+// called with the ploidy copied at its start.
+static void call_parallel(args_t *args)
+{
+    int ibatch = 0;
+    while ( bcf_sr_next_line(args->aux.srs) )
+    {
+        bcf1_t *rec = args->aux.srs->readers[0].buffer[0];
+        if ( skip_line(args, rec) ) continue;
+
+        call_batch_t *batch = &args->batches[ibatch];
+        if ( args->nsex && set_ploidy(args, rec) && batch->nlines )
+        {
+            dispatch_batch(args, batch);
+            ibatch = (ibatch + 1) % args->nbatches;
+            if ( args->nbusy==args->nbatches ) write_next_batch(args);
+            batch = &args->batches[ibatch];
+        }
+        if ( !batch->nlines && args->aux.ploidy )
+            memcpy(batch->call.ploidy, args->aux.ploidy, bcf_hdr_nsamples(args->aux.hdr));
+
+        if ( !batch->lines[batch->nlines] ) batch->lines[batch->nlines] = bcf_init1();
+        bcf_copy(batch->lines[batch->nlines], rec);
+        batch->unseen[batch->nlines++] = args->aux.unseen;
+        if ( batch->nlines < BATCH_SIZE ) continue;
+
+        dispatch_batch(args, batch);
+        ibatch = (ibatch + 1) % args->nbatches;
+        if ( args->nbusy==args->nbatches ) write_next_batch(args);
+    }
+    if ( args->batches[ibatch].nlines ) dispatch_batch(args, &args->batches[ibatch]);
+    while ( args->nbusy ) write_next_batch(args);
+}
+
 static void usage(args_t *args)
 {
     fprintf(stderr, "\n");
@@ -623,7 +797,7 @@ static void usage(args_t *args)
     fprintf(stderr, "   -S, --samples-file <file>       PED file or a file with an optional column with sex (see man page for details) [all samples]\n");
     fprintf(stderr, "   -t, --targets <region>          similar to -r but streams rather than index-jumps\n");
     fprintf(stderr, "   -T, --targets-file <file>       similar to -R but streams rather than index-jumps\n");
-    fprintf(stderr, "       --threads <int>             number of extra output compression threads [0]\n");
+    fprintf(stderr, "       --threads <int>             number of extra (de)compression and, with -m, calling threads [0]\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Input/output options:\n");
     fprintf(stderr, "   -A, --keep-alts                 keep all possible alternate alleles at variant sites\n");
@@ -807,59 +981,34 @@ int main_vcfcall(int argc, char *argv[])
     if ( args.aux.flag&CALL_VARONLY && args.gvcf ) error("The two options cannot be combined: --variants-only and --gvcf\n");
     init_data(&args);
 
-    while ( bcf_sr_next_line(args.aux.srs) )
+    if ( args.batches )
+        call_parallel(&args);
+    else
     {
-        bcf1_t *bcf_rec = args.aux.srs->readers[0].buffer[0];
-        if ( args.samples_map ) bcf_subset(args.aux.hdr, bcf_rec, args.nsamples, args.samples_map);
-        bcf_unpack(bcf_rec, BCF_UN_STR);
+        while ( bcf_sr_next_line(args.aux.srs) )
+        {
+            bcf1_t *bcf_rec = args.aux.srs->readers[0].buffer[0];
+            if ( args.samples_map ) bcf_subset(args.aux.hdr, bcf_rec, args.nsamples, args.samples_map);
+            if ( skip_line(&args, bcf_rec) ) continue;
 
-        // Skip unwanted sites
-        int i, is_indel = bcf_is_snp(bcf_rec) ? 0 : 1;
-        if ( (args.flag & CF_INDEL_ONLY) && !is_indel ) continue;
-        if ( (args.flag & CF_NO_INDEL) && is_indel ) continue;
-        if ( (args.flag & CF_ACGT_ONLY) && (bcf_rec->d.allele[0][0]=='N' || bcf_rec->d.allele[0][0]=='n') ) continue;   // REF[0] is 'N'
+            bcf_unpack(bcf_rec, BCF_UN_ALL);
+            if ( args.nsex ) set_ploidy(&args, bcf_rec);
 
-        // Which allele is symbolic? All SNPs should have it, but not indels
-        args.aux.unseen = 0;
-        for (i=1; i<bcf_rec->n_allele; i++)
-        {
-            if ( bcf_rec->d.allele[i][0]=='X' ) { args.aux.unseen = i; break; }  // old X
-            if ( bcf_rec->d.allele[i][0]=='<' )
+            // Various output modes: QCall output (todo)
+            if ( args.flag & CF_QCALL )
             {
-                if ( bcf_rec->d.allele[i][1]=='X' && bcf_rec->d.allele[i][2]=='>' ) { args.aux.unseen = i; break; } // old <X>
-                if ( bcf_rec->d.allele[i][1]=='*' && bcf_rec->d.allele[i][2]=='>' ) { args.aux.unseen = i; break; } // new <*>
+                qcall(&args.aux, bcf_rec);
+                continue;
             }
-        }
-        int is_ref = (bcf_rec->n_allele==1 || (bcf_rec->n_allele==2 && args.aux.unseen>0)) ? 1 : 0;
-
-        if ( is_ref && args.aux.flag&CALL_VARONLY )
-            continue;
 
-        bcf_unpack(bcf_rec, BCF_UN_ALL);
-        if ( args.nsex ) set_ploidy(&args, bcf_rec);
-
-        // Various output modes: QCall output (todo)
-        if ( args.flag & CF_QCALL )
-        {
-            qcall(&args.aux, bcf_rec);
-            continue;
+            // Calling modes which output VCFs
+            int ret;
+            if ( args.flag & CF_MCALL )
+                ret = mcall(&args.aux, bcf_rec);
+            else
+                ret = ccall(&args.aux, bcf_rec);
+            write_line(&args, bcf_rec, ret);
         }
-
-        // Calling modes which output VCFs
-        int ret;
-        if ( args.flag & CF_MCALL )
-            ret = mcall(&args.aux, bcf_rec);
-        else
-            ret = ccall(&args.aux, bcf_rec);
-        if ( ret==-1 ) error("Something is wrong\n");
-        else if ( ret==-2 ) continue;   // skip the site
-
-        // Normal output
-        if ( (args.aux.flag & CALL_VARONLY) && ret==0 && !args.gvcf ) continue;     // not a variant
-        if ( args.gvcf )
-            bcf_rec = gvcf_write(args.gvcf, args.out_fh, args.aux.hdr, bcf_rec, ret==1?1:0);
-        if ( bcf_rec )
-            bcf_write1(args.out_fh, args.aux.hdr, bcf_rec);
     }
     if ( args.gvcf ) gvcf_write(args.gvcf, args.out_fh, args.aux.hdr, NULL, 0);
     if ( args.flag & CF_INS_MISSED ) bcf_sr_regions_flush(args.aux.srs->targets);
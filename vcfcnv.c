@@ -39,9 +39,11 @@
 #include <htslib/kstring.h>
 #include <htslib/kfunc.h>
 #include <htslib/khash_str2int.h>
+#include <htslib/thread_pool.h>
 #include "bcftools.h"
 #include "HMM.h"
 #include "rbuf.h"
+#include "smpl_ilist.h"
 
 #define DBG0 0
 
@@ -51,9 +53,12 @@
 #define CN2 2
 #define CN3 3
 
+#define BAF_NTAB 4096   // resolution of the BAF density table
+
 typedef struct
 {
     float mean, dev2, norm;
+    double scale, ihalf_dev2;   // precalculated 1/(norm*sqrt(2*pi*dev2)) and 0.5/dev2
 }
 gauss_param_t;
 
@@ -64,6 +69,7 @@ typedef struct
     float *lrr,*baf, baf_dev2, baf_dev2_dflt, lrr_dev2;
     float cell_frac, cell_frac_dflt;
     gauss_param_t gauss_param[18];
+    double *baf_pdf;    // the densities of the nine BAF peaks tabulated at BAF_NTAB+1 points in [0,1]
     double pobs[N_STATES];
     FILE *dat_fh, *cn_fh, *summary_fh;
     char *dat_fname, *cn_fname, *summary_fname;
@@ -100,6 +106,12 @@ typedef struct _args_t
     char **argv, *regions_list, *summary_fname, *output_dir;
     char *targets_list, *af_fname;
     int argc, verbose, lrr_smooth_win;
+
+    // --samples: each sample is called as in the single-sample mode, with its own
+    // copy of the arguments, HMM and site buffers, in one pass over the VCF
+    char *samples_list;
+    int samples_is_file, n_threads, nruns;
+    struct _args_t *runs;
 }
 args_t;
 
@@ -226,11 +238,40 @@ static void close_sample_files(sample_t *smpl)
 }
 
 static double norm_cdf(double mean, double dev);
+static void init_run(args_t *args);
+static void init_runs(args_t *args)
+{
+    if ( !args->files->readers[0].file->is_bin )
+    {
+        int ret = bcf_hdr_set_samples(args->hdr, args->samples_list, args->samples_is_file);
+        if ( ret<0 ) error("Error parsing the list of samples: %s\n", args->samples_list);
+        else if ( ret>0 ) error("The %d-th sample not found in the VCF\n", ret);
+    }
+    smpl_ilist_t *ilist = smpl_ilist_init(args->hdr, args->samples_list, args->samples_is_file, SMPL_STRICT);
+    if ( !ilist->n ) error("No samples to process: %s\n", args->samples_list);
+
+    int i;
+    args->nruns = ilist->n;
+    args->runs  = (args_t*) calloc(args->nruns, sizeof(args_t));
+    for (i=0; i<args->nruns; i++)
+    {
+        args_t *run = &args->runs[i];
+        *run = *args;
+        run->runs  = NULL;
+        run->nruns = 0;
+        run->query_sample.name = strdup(args->hdr->samples[ilist->idx[i]]);
+        init_run(run);
+    }
+    smpl_ilist_destroy(ilist);
+}
+
 static void init_data(args_t *args)
 {
     args->prev_rid = -1;
     args->hdr = args->files->readers[0].header;
 
+    if ( args->samples_list ) { init_runs(args); return; }
+
     if ( !args->query_sample.name )
     {
         if ( bcf_hdr_nsamples(args->hdr)>1 ) error("Multi-sample VCF, missing the -s option\n");
@@ -257,6 +298,11 @@ static void init_data(args_t *args)
 
         if ( args->control_sample.name ) free(tmp.s);
     }
+    init_run(args);
+}
+
+static void init_run(args_t *args)
+{
     args->query_sample.idx = bcf_hdr_id2int(args->hdr,BCF_DT_SAMPLE,args->query_sample.name);
     args->control_sample.idx = args->control_sample.name ? bcf_hdr_id2int(args->hdr,BCF_DT_SAMPLE,args->control_sample.name) : -1;
     args->nstates = args->control_sample.name ? N_STATES*N_STATES : N_STATES;
@@ -392,6 +438,12 @@ static void plot_sample(args_t *args, sample_t *smpl)
 
 static void create_plots(args_t *args)
 {
+    if ( args->nruns )
+    {
+        int i;
+        for (i=0; i<args->nruns; i++) create_plots(&args->runs[i]);
+        return;
+    }
     close_sample_files(&args->query_sample);
     if ( args->control_sample.name ) close_sample_files(&args->control_sample);
     if ( args->summary_fh ) fclose(args->summary_fh);
@@ -559,9 +611,8 @@ static void create_plots(args_t *args)
     free(fname);
 }
 
-static void destroy_data(args_t *args)
+static void destroy_run(args_t *args)
 {
-    bcf_sr_destroy(args->files);
     hmm_destroy(args->hmm);
     free(args->tmpf);
     free(args->sites);
@@ -583,6 +634,15 @@ static void destroy_data(args_t *args)
     free(args->control_sample.summary_fname);
 }
 
+static void destroy_data(args_t *args)
+{
+    int i;
+    for (i=0; i<args->nruns; i++) destroy_run(&args->runs[i]);
+    free(args->runs);
+    if ( !args->nruns ) destroy_run(args);
+    bcf_sr_destroy(args->files);
+}
+
 static inline char copy_number_state(args_t *args, int istate, int ismpl)
 {
     char code[] = "01234";
@@ -611,7 +671,23 @@ static double avg_ii_prob(int n, double *mat)
 
 static inline double norm_prob(double baf, gauss_param_t *param)
 {
-    return exp(-(baf-param->mean)*(baf-param->mean)*0.5/param->dev2) / param->norm / sqrt(2*M_PI*param->dev2);
+    return exp(-(baf-param->mean)*(baf-param->mean)*param->ihalf_dev2) * param->scale;
+}
+
+// The densities of all nine BAF peaks at once, linearly interpolated from the table
+static inline void baf_peak_probs(sample_t *smpl, float baf, double *pdf)
+{
+    int i;
+    if ( baf > 1 )
+    {
+        for (i=0; i<9; i++) pdf[i] = norm_prob(baf, &smpl->gauss_param[i]);
+        return;
+    }
+    double x = baf*BAF_NTAB;
+    int j = x;
+    if ( j >= BAF_NTAB ) j = BAF_NTAB - 1;
+    double f = x - j, *a = smpl->baf_pdf + j*9, *b = a + 9;
+    for (i=0; i<9; i++) pdf[i] = a[i] + (b[i] - a[i])*f;
 }
 
 static int set_observed_prob(args_t *args, sample_t *smpl, int isite)
@@ -632,18 +708,21 @@ static int set_observed_prob(args_t *args, sample_t *smpl, int isite)
         return 0;
     }
 
+    // in the order of the GAUSS_* macros
+    double pdf[9];
+    baf_peak_probs(smpl, baf, pdf);
     double cn1_baf = 
-        norm_prob(baf,GAUSS_CN1_PK_R(smpl)) * (fRR + fRA*0.5) +
-        norm_prob(baf,GAUSS_CN1_PK_A(smpl)) * (fAA + fRA*0.5) ;
+        pdf[0] * (fRR + fRA*0.5) +
+        pdf[1] * (fAA + fRA*0.5) ;
     double cn2_baf = 
-        norm_prob(baf,GAUSS_CN2_PK_RR(smpl)) * fRR + 
-        norm_prob(baf,GAUSS_CN2_PK_RA(smpl)) * fRA + 
-        norm_prob(baf,GAUSS_CN2_PK_AA(smpl)) * fAA;
+        pdf[2] * fRR + 
+        pdf[3] * fRA + 
+        pdf[4] * fAA;
     double cn3_baf = 
-        norm_prob(baf,GAUSS_CN3_PK_RRR(smpl)) * fRR + 
-        norm_prob(baf,GAUSS_CN3_PK_RRA(smpl)) * fRA*0.5 + 
-        norm_prob(baf,GAUSS_CN3_PK_RAA(smpl)) * fRA*0.5 + 
-        norm_prob(baf,GAUSS_CN3_PK_AAA(smpl)) * fAA;
+        pdf[5] * fRR + 
+        pdf[6] * fRA*0.5 + 
+        pdf[7] * fRA*0.5 + 
+        pdf[8] * fAA;
 
     double norm = cn1_baf + cn2_baf + cn3_baf;
     cn1_baf /= norm;
@@ -797,6 +876,21 @@ static void set_gauss_params(args_t *args, sample_t *smpl)
     GAUSS_CN3_PK_RRA(smpl)->norm = norm_cdf(GAUSS_CN3_PK_RRA(smpl)->mean,dev);
     GAUSS_CN3_PK_RAA(smpl)->norm = norm_cdf(GAUSS_CN3_PK_RAA(smpl)->mean,dev);
     GAUSS_CN3_PK_AAA(smpl)->norm = norm_cdf(GAUSS_CN3_PK_AAA(smpl)->mean,dev);
+
+    // the peaks are evaluated for every site and iteration, precalculate the constants
+    for (i=0; i<9; i++)
+    {
+        gauss_param_t *param = &smpl->gauss_param[i];
+        param->scale = 1. / param->norm / sqrt(2*M_PI*param->dev2);
+        param->ihalf_dev2 = 0.5 / param->dev2;
+    }
+
+    // tabulate the densities, set_observed_prob() interpolates instead of calling exp()
+    // for each peak at each site. The table is freed after the chromosome is done.
+    if ( !smpl->baf_pdf ) smpl->baf_pdf = (double*) malloc(sizeof(double)*(BAF_NTAB+1)*9);
+    int j;
+    for (j=0; j<=BAF_NTAB; j++)
+        for (i=0; i<9; i++) smpl->baf_pdf[j*9+i] = norm_prob((double)j/BAF_NTAB, &smpl->gauss_param[i]);
 }
 
 static int update_sample_args(args_t *args, sample_t *smpl, int ismpl)
@@ -1103,6 +1197,10 @@ static void cnv_flush_viterbi(args_t *args)
         fprintf(args->summary_fh,"RG\t%s\t%d\t%d\t%c\t%c\t%.1f\t%d\t%d\t%d\t%d\n",
             bcf_hdr_id2name(args->hdr,args->prev_rid), start_pos+1, args->sites[isite-1]+1,start_cn_query,start_cn_ctrl,qual,smpl_ntot,smpl_nhet,ctrl_ntot,ctrl_nhet);
     }
+
+    free(args->query_sample.baf_pdf);
+    free(args->control_sample.baf_pdf);
+    args->query_sample.baf_pdf = args->control_sample.baf_pdf = NULL;
 }
 
 static int parse_lrr_baf(sample_t *smpl, bcf_fmt_t *baf_fmt, bcf_fmt_t *lrr_fmt, float *baf, float *lrr)
@@ -1123,36 +1221,66 @@ static int parse_lrr_baf(sample_t *smpl, bcf_fmt_t *baf_fmt, bcf_fmt_t *lrr_fmt,
 
 int read_AF(bcf_sr_regions_t *tgt, bcf1_t *line, double *alt_freq);
 
-static void cnv_next_line(args_t *args, bcf1_t *line)
+static void *cnv_flush_job(void *arg)
 {
-    if ( !line ) 
+    cnv_flush_viterbi((args_t*) arg);
+    return arg;
+}
+
+// With --samples and --threads, the samples are run through the HMM by the extra
+// threads. Each sample writes to its own files, the order does not matter.
+static void cnv_flush(args_t *args)
+{
+    if ( !args->nruns ) { cnv_flush_viterbi(args); return; }
+
+    int i;
+    if ( !args->files->p )
     {
-        // Done, flush viterbi
-        cnv_flush_viterbi(args);
+        for (i=0; i<args->nruns; i++) cnv_flush_viterbi(&args->runs[i]);
         return;
     }
-
-    if ( line->rid!=args->prev_rid )
+    int nq = 2*args->n_threads, nbusy = 0;
+    hts_tpool_process *q = hts_tpool_process_init(args->files->p->pool, nq, 0);
+    if ( !q ) error("Failed to initialize the thread pool queue\n");
+    for (i=0; i<args->nruns; i++)
     {
-        // New chromosome
-        cnv_flush_viterbi(args);
-        args->prev_rid = line->rid;
-        args->nsites = 0;
-        args->nRR = args->nAA = args->nRA = 0;
+        if ( nbusy==nq )
+        {
+            hts_tpool_result *res = hts_tpool_next_result_wait(q);
+            if ( !res ) error("Failed to retrieve the flushed sample\n");
+            hts_tpool_delete_result(res, 0);
+            nbusy--;
+        }
+        if ( hts_tpool_dispatch(args->files->p->pool, q, cnv_flush_job, &args->runs[i]) < 0 )
+            error("Failed to dispatch the sample %s to the thread pool\n", args->runs[i].query_sample.name);
+        nbusy++;
     }
+    while ( nbusy )
+    {
+        hts_tpool_result *res = hts_tpool_next_result_wait(q);
+        if ( !res ) error("Failed to retrieve the flushed sample\n");
+        hts_tpool_delete_result(res, 0);
+        nbusy--;
+    }
+    hts_tpool_process_destroy(q);
+}
 
-    // Process line
-    args->ntot++;
-
-    bcf_fmt_t *baf_fmt, *lrr_fmt = NULL;
-    if ( !(baf_fmt = bcf_get_fmt(args->hdr, line, "BAF")) ) return; 
-    if ( args->lrr_bias>0 && !(lrr_fmt = bcf_get_fmt(args->hdr, line, "LRR")) ) return;
+static void cnv_new_chrom(args_t *args, int rid)
+{
+    args->prev_rid = rid;
+    args->nsites = 0;
+    args->nRR = args->nAA = args->nRA = 0;
+}
 
+// Add the site to the run's buffers, the non-ref AF is read from --AF-file on
+// first use and shared by all samples. Returns 1 if the site was used.
+static int cnv_add_site(args_t *args, bcf1_t *line, bcf_fmt_t *baf_fmt, bcf_fmt_t *lrr_fmt, float *nonref_af)
+{
     float baf1,lrr1,baf2,lrr2;
     int ret = 0;
     ret += parse_lrr_baf(&args->query_sample,  baf_fmt,lrr_fmt,&baf1,&lrr1);
     ret += parse_lrr_baf(&args->control_sample,baf_fmt,lrr_fmt,&baf2,&lrr2);
-    if ( !ret ) return;
+    if ( !ret ) return 0;
 
     // Realloc buffers needed to store observed data and used by viterbi and fwd-bwd
     args->nsites++;
@@ -1177,7 +1305,8 @@ static void cnv_next_line(args_t *args, bcf1_t *line)
     if ( args->af_fname )
     {
         double alt_freq;
-        args->nonref_afs[args->nsites-1] = read_AF(args->files->targets,line,&alt_freq)<0 ? args->nonref_af_dflt : alt_freq;
+        if ( *nonref_af < 0 ) *nonref_af = read_AF(args->files->targets,line,&alt_freq)<0 ? args->nonref_af_dflt : alt_freq;
+        args->nonref_afs[args->nsites-1] = *nonref_af;
     }
     if ( args->control_sample.name )
     {
@@ -1195,7 +1324,42 @@ static void cnv_next_line(args_t *args, bcf1_t *line)
         else if ( baf1>4/5. ) args->nAA++;
         else args->nRA++;
     }
-    args->nused++;
+    return 1;
+}
+
+static void cnv_next_line(args_t *args, bcf1_t *line)
+{
+    int i;
+    if ( !line ) 
+    {
+        // Done, flush viterbi
+        cnv_flush(args);
+        return;
+    }
+
+    if ( line->rid!=args->prev_rid )
+    {
+        // New chromosome
+        cnv_flush(args);
+        cnv_new_chrom(args, line->rid);
+        for (i=0; i<args->nruns; i++) cnv_new_chrom(&args->runs[i], line->rid);
+    }
+
+    // Process line
+    args->ntot++;
+
+    // the tags are looked up once per record for all samples
+    bcf_fmt_t *baf_fmt, *lrr_fmt = NULL;
+    if ( !(baf_fmt = bcf_get_fmt(args->hdr, line, "BAF")) ) return; 
+    if ( args->lrr_bias>0 && !(lrr_fmt = bcf_get_fmt(args->hdr, line, "LRR")) ) return;
+
+    float nonref_af = -1;
+    int nused = 0;
+    if ( !args->nruns )
+        nused = cnv_add_site(args, line, baf_fmt, lrr_fmt, &nonref_af);
+    else
+        for (i=0; i<args->nruns; i++) nused += cnv_add_site(&args->runs[i], line, baf_fmt, lrr_fmt, &nonref_af);
+    if ( nused ) args->nused++;
 }
 
 static void usage(args_t *args)
@@ -1213,8 +1377,11 @@ static void usage(args_t *args)
     fprintf(stderr, "    -r, --regions <region>             restrict to comma-separated list of regions\n");
     fprintf(stderr, "    -R, --regions-file <file>          restrict to regions listed in a file\n");
     fprintf(stderr, "    -s, --query-sample <string>        query samply name\n");
+    fprintf(stderr, "        --samples <list>               call each of the comma-separated samples independently in one pass\n");
+    fprintf(stderr, "        --samples-file <file>          same as --samples, samples listed in a file\n");
     fprintf(stderr, "    -t, --targets <region>             similar to -r but streams rather than index-jumps\n");
     fprintf(stderr, "    -T, --targets-file <file>          similar to -R but streams rather than index-jumps\n");
+    fprintf(stderr, "        --threads <int>                number of extra decompression threads, with --samples also HMM threads [0]\n");
     fprintf(stderr, "HMM Options:\n");
     fprintf(stderr, "    -a, --aberrant <float[,float]>     fraction of aberrant cells in query and control [1.0,1.0]\n");
     fprintf(stderr, "    -b, --BAF-weight <float>           relative contribution from BAF [1]\n");
@@ -1279,6 +1446,9 @@ int main_vcfcnv(int argc, char *argv[])
         {"regions-file",1,0,'R'},
         {"plot",1,0,'p'},
         {"output-dir",1,0,'o'},
+        {"samples",1,0,1},
+        {"samples-file",1,0,2},
+        {"threads",1,0,3},
         {0,0,0,0}
     };
     char *tmp = NULL;
@@ -1357,6 +1527,12 @@ int main_vcfcnv(int argc, char *argv[])
                 if ( *tmp ) error("Could not parse: -p %s\n", optarg);
                 break;
             case 'o': args->output_dir = optarg; break;
+            case  1 : args->samples_list = optarg; break;
+            case  2 : args->samples_list = optarg; args->samples_is_file = 1; break;
+            case  3 :
+                args->n_threads = strtol(optarg,&tmp,10);
+                if ( *tmp || args->n_threads<0 ) error("Could not parse: --threads %s\n", optarg);
+                break;
             case 's': args->query_sample.name = strdup(optarg); break;
             case 'c': args->control_sample.name = optarg; break;
             case 't': args->targets_list = optarg; break;
@@ -1378,6 +1554,9 @@ int main_vcfcnv(int argc, char *argv[])
     if ( !fname ) usage(args);
 
     if ( !args->output_dir ) error("Expected -o option\n");
+    if ( args->samples_list && (args->query_sample.name || args->control_sample.name) )
+        error("The --samples option cannot be combined with -s or -c\n");
+    if ( args->n_threads && bcf_sr_set_threads(args->files, args->n_threads)<0 ) error("Failed to create threads\n");
     if ( args->regions_list )
     {
         if ( bcf_sr_set_regions(args->files, args->regions_list, regions_is_file)<0 )
@@ -34,6 +34,8 @@ THE SOFTWARE.  */
 #include <htslib/bgzf.h>
 #include <htslib/tbx.h> // for hts_get_bgzfp()
 #include "bcftools.h"
+#include "prefetch.h"
+#include "hdrmerge.h"
 
 typedef struct _args_t
 {
@@ -52,7 +54,7 @@ typedef struct _args_t
 
     char **argv, *output_fname, *file_list, **fnames, *remove_dups, *regions_list;
     int argc, nfnames, allow_overlaps, phased_concat, regions_is_file;
-    int compact_PS, phase_set_changed, naive_concat;
+    int compact_PS, phase_set_changed, naive_concat, write_index;
 }
 args_t;
 
@@ -71,11 +73,12 @@ static void init_data(args_t *args)
 
     kstring_t str = {0,0,0};
     int i, prev_chrid = -1;
+    hdrmerge_t *hm = hdrmerge_init();
     for (i=0; i<args->nfnames; i++)
     {
         htsFile *fp = hts_open(args->fnames[i], "r"); if ( !fp ) error("Failed to open: %s\n", args->fnames[i]);
         bcf_hdr_t *hdr = bcf_hdr_read(fp); if ( !hdr ) error("Failed to parse header: %s\n", args->fnames[i]);
-        args->out_hdr = bcf_hdr_merge(args->out_hdr,hdr);
+        args->out_hdr = hdrmerge_add(hm, args->out_hdr, hdr);
         if ( bcf_hdr_nsamples(hdr) != bcf_hdr_nsamples(args->out_hdr) )
             error("Different number of samples in %s. Perhaps \"bcftools merge\" is what you are looking for?\n", args->fnames[i]);
 
@@ -98,6 +101,8 @@ static void init_data(args_t *args)
         bcf_hdr_destroy(hdr);
         hts_close(fp);
     }
+    hdrmerge_destroy(hm);
+    bcf_hdr_sync(args->out_hdr);
     free(str.s);
     if ( line ) bcf_destroy(line);
 
@@ -119,6 +124,7 @@ static void init_data(args_t *args)
     {
         args->files = bcf_sr_init();
         args->files->require_index = 1;
+        if ( args->n_threads && bcf_sr_set_threads(args->files, args->n_threads)<0 ) error("Failed to create threads\n");
         if ( args->regions_list )
         {
             if ( bcf_sr_set_regions(args->files, args->regions_list, args->regions_is_file)<0 )
@@ -168,6 +174,7 @@ static void init_data(args_t *args)
         args->phase_set  = (int32_t*) malloc(bcf_hdr_nsamples(args->out_hdr)*sizeof(int32_t));
         args->files = bcf_sr_init();
         args->files->require_index = 1;
+        if ( args->n_threads && bcf_sr_set_threads(args->files, args->n_threads)<0 ) error("Failed to create threads\n");
         args->ifname = 0;
     }
 }
@@ -491,7 +498,7 @@ static void concat(args_t *args)
     {
         kstring_t tmp = {0,0,0};
         int prev_chr_id = -1, prev_pos;
-        bcf1_t *line = bcf_init();
+        bcf1_t *rec = bcf_init(), *line = rec;
         for (i=0; i<args->nfnames; i++)
         {
             htsFile *fp = hts_open(args->fnames[i], "r"); if ( !fp ) error("Failed to open: %s\n", args->fnames[i]);
@@ -527,9 +534,16 @@ static void concat(args_t *args)
             }
             else
             {
-                // BCF conversion is required
+                // BCF conversion is required. With --threads, the records are decompressed
+                // and parsed ahead in another thread while this one translates and writes
+                prefetch_t *pf = NULL;
+                if ( args->n_threads )
+                {
+                    hts_set_threads(fp, args->n_threads);
+                    pf = prefetch_init(fp, hdr, 1024, 0);
+                }
                 line->max_unpack = 0;
-                while ( bcf_read(fp, hdr, line)==0 )
+                while ( pf ? (line = prefetch_next(pf))!=NULL : bcf_read(fp, hdr, line)==0 )
                 {
                     bcf_translate(args->out_hdr, hdr, line);
 
@@ -546,11 +560,16 @@ static void concat(args_t *args)
 
                     if ( bcf_write(args->out_fh, args->out_hdr, line)!=0 ) error("Failed to write\n");
                 }
+                if ( pf )
+                {
+                    prefetch_destroy(pf);
+                    line = rec;
+                }
             }
             bcf_hdr_destroy(hdr);
             hts_close(fp);
         }
-        bcf_destroy(line);
+        bcf_destroy(rec);
         free(tmp.s);
     }
 }
@@ -611,14 +630,74 @@ static int check_header(const uint8_t *header)
             && header[12] == 'B' && header[13] == 'C'
             && unpackInt16((uint8_t*)&header[14]) == 2) ? 0 : -1;
 }
+// The records can be copied verbatim only if the headers are compatible. BCF
+// records refer to tags, contigs and samples by their numeric IDs, therefore
+// the dictionaries must be identical; VCF records must have the same samples.
+static int naive_headers_compatible(bcf_hdr_t *a, bcf_hdr_t *b, int is_bcf)
+{
+    int i, j, k;
+    for (i=is_bcf ? BCF_DT_ID : BCF_DT_SAMPLE; i<=BCF_DT_SAMPLE; i++)
+    {
+        if ( a->n[i]!=b->n[i] ) return 0;
+        for (j=0; j<a->n[i]; j++)
+        {
+            const char *akey = a->id[i][j].key, *bkey = b->id[i][j].key;
+            if ( !akey || !bkey ) { if ( akey!=bkey ) return 0; continue; }
+            if ( strcmp(akey,bkey) ) return 0;
+            if ( i!=BCF_DT_ID ) continue;
+            const bcf_idinfo_t *aval = a->id[i][j].val, *bval = b->id[i][j].val;
+            for (k=0; k<3; k++)
+                if ( aval->info[k]!=bval->info[k] ) return 0;
+        }
+    }
+    return 1;
+}
+
+static bcf_hdr_t *naive_parse_header(kstring_t *str, const char *fname)
+{
+    if ( !str->l || str->s[str->l-1] )
+    {
+        ks_resize(str, str->l+1);
+        str->s[str->l] = 0;
+    }
+    bcf_hdr_t *hdr = bcf_hdr_init("r");
+    if ( !hdr || bcf_hdr_parse(hdr, str->s)!=0 ) error("Could not parse the header of %s\n", fname);
+    return hdr;
+}
+
+// Check the header against the header of the first file. The byte comparison
+// suffices for the usual output of scatter/gather jobs, the headers are parsed
+// only when they differ.
+static void naive_check_header(args_t *args, int ifile, kstring_t *hdr_str, kstring_t *hdr0_str, bcf_hdr_t **hdr0, int is_bcf)
+{
+    if ( ifile==0 )
+    {
+        hdr0_str->l = 0;
+        kputsn(hdr_str->s, hdr_str->l, hdr0_str);
+        return;
+    }
+    if ( hdr_str->l==hdr0_str->l && !memcmp(hdr_str->s,hdr0_str->s,hdr_str->l) ) return;
+
+    if ( !*hdr0 ) *hdr0 = naive_parse_header(hdr0_str, args->fnames[0]);
+    bcf_hdr_t *hdr = naive_parse_header(hdr_str, args->fnames[ifile]);
+    if ( !naive_headers_compatible(*hdr0, hdr, is_bcf) )
+        error("The header of %s is not compatible with %s, cannot use --naive\n", args->fnames[ifile], args->fnames[0]);
+    bcf_hdr_destroy(hdr);
+}
+
 static void naive_concat(args_t *args)
 {
     // only compressed BCF atm
     BGZF *bgzf_out = bgzf_open(args->output_fname,"w");;
+    if ( !bgzf_out ) error("Failed to open %s: %s\n", args->output_fname, strerror(errno));
+
+    // the boundary blocks are recompressed by the threads, the other blocks are copied as they are
+    if ( args->n_threads && bgzf_mt(bgzf_out, args->n_threads, 256)<0 ) error("Failed to create threads\n");
 
     const size_t page_size = BGZF_MAX_BLOCK_SIZE;
     uint8_t *buf = (uint8_t*) malloc(page_size);
-    kstring_t tmp = {0,0,0};
+    kstring_t tmp = {0,0,0}, hdr0_str = {0,0,0};
+    bcf_hdr_t *hdr0 = NULL;
     int i, file_types = 0;
     for (i=0; i<args->nfnames; i++)
     {
@@ -646,6 +725,7 @@ static void naive_concat(args_t *args)
             if ( bgzf_read(fp, &tmp.l, 4) != 4 ) error("Failed to read the BCF header in %s\n", args->fnames[i]);
             hts_expand(char,tmp.l,tmp.m,tmp.s);
             if ( bgzf_read(fp, tmp.s, tmp.l) != tmp.l ) error("Failed to read the BCF header in %s\n", args->fnames[i]);
+            naive_check_header(args, i, &tmp, &hdr0_str, &hdr0, 1);
 
             // write only the first header
             if ( i==0 )
@@ -658,8 +738,13 @@ static void naive_concat(args_t *args)
         }
         else
         {
-            nskip = print_vcf_gz_header(fp, bgzf_out, i==0?1:0, &tmp);
+            tmp.l = 0;
+            nskip = print_vcf_gz_header(fp, bgzf_out, 0, &tmp);
             if ( nskip==-1 ) error("Error reading %s\n", args->fnames[i]);
+            naive_check_header(args, i, &tmp, &hdr0_str, &hdr0, 0);
+
+            // write only the first header
+            if ( i==0 && bgzf_write(bgzf_out,tmp.s,tmp.l) != tmp.l ) error("Failed to write %d bytes to %s\n", tmp.l,args->output_fname);
         }
 
         // Output all non-header data that were read together with the header block
@@ -692,7 +777,10 @@ static void naive_concat(args_t *args)
     }
     free(buf);
     free(tmp.s);
+    free(hdr0_str.s);
+    if ( hdr0 ) bcf_hdr_destroy(hdr0);
     if (bgzf_close(bgzf_out) < 0) error("Error: %d\n",bgzf_out->errcode);
+    args->output_type = file_types==2 ? FT_BCF_GZ : FT_VCF_GZ;
 }
 
 static void usage(args_t *args)
@@ -704,8 +792,8 @@ static void usage(args_t *args)
     fprintf(stderr, "         VCF into one. The input files must be sorted by chr and position. The files\n");
     fprintf(stderr, "         must be given in the correct order to produce sorted VCF on output unless\n");
     fprintf(stderr, "         the -a, --allow-overlaps option is specified. With the --naive option, the files\n");
-    fprintf(stderr, "         are concatenated without being recompressed, which is very fast but dangerous\n");
-    fprintf(stderr, "         if the BCF headers differ.\n");
+    fprintf(stderr, "         are concatenated without being recompressed, which is very fast. The headers\n");
+    fprintf(stderr, "         must define the same samples and, for BCF, the same tags and contigs.\n");
     fprintf(stderr, "Usage:   bcftools concat [options] <A.vcf.gz> [<B.vcf.gz> [...]]\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Options:\n");
@@ -716,13 +804,14 @@ static void usage(args_t *args)
     fprintf(stderr, "   -f, --file-list <file>         Read the list of files from a file.\n");
     fprintf(stderr, "   -l, --ligate                   Ligate phased VCFs by matching phase at overlapping haplotypes\n");
     fprintf(stderr, "       --no-version               Do not append version and command line to the header\n");
-    fprintf(stderr, "   -n, --naive                    Concatenate files without recompression (dangerous, use with caution)\n");
+    fprintf(stderr, "   -n, --naive                    Concatenate files without recompression, the headers must be compatible\n");
     fprintf(stderr, "   -o, --output <file>            Write output to a file [standard output]\n");
     fprintf(stderr, "   -O, --output-type <b|u|z|v>    b: compressed BCF, u: uncompressed BCF, z: compressed VCF, v: uncompressed VCF [v]\n");
     fprintf(stderr, "   -q, --min-PQ <int>             Break phase set if phasing quality is lower than <int> [30]\n");
     fprintf(stderr, "   -r, --regions <region>         Restrict to comma-separated list of regions\n");
     fprintf(stderr, "   -R, --regions-file <file>      Restrict to regions listed in a file\n");
     fprintf(stderr, "       --threads <int>            Number of extra output compression threads [0]\n");
+    fprintf(stderr, "       --write-index              Index the output file, requires compressed output written to a file\n");
     fprintf(stderr, "\n");
     exit(1);
 }
@@ -754,6 +843,7 @@ int main_vcfconcat(int argc, char *argv[])
         {"file-list",required_argument,NULL,'f'},
         {"min-PQ",required_argument,NULL,'q'},
         {"no-version",no_argument,NULL,8},
+        {"write-index",no_argument,NULL,10},
         {NULL,0,NULL,0}
     };
     char *tmp;
@@ -785,6 +875,7 @@ int main_vcfconcat(int argc, char *argv[])
                 break;
             case  9 : args->n_threads = strtol(optarg, 0, 0); break;
             case  8 : args->record_cmd_line = 0; break;
+            case 10 : args->write_index = 1; break;
             case 'h':
             case '?': usage(args); break;
             default: error("Unknown argument: %s\n", optarg);
@@ -808,18 +899,24 @@ int main_vcfconcat(int argc, char *argv[])
     if ( !args->nfnames ) usage(args);
     if ( args->remove_dups && !args->allow_overlaps ) error("The -D option is supported only with -a\n");
     if ( args->regions_list && !args->allow_overlaps ) error("The -r/-R option is supported only with -a\n");
+    if ( args->write_index )
+    {
+        if ( args->naive_concat ) init_write_index(args->output_fname, FT_BCF_GZ);
+        else init_write_index(args->output_fname, args->output_type);
+    }
     if ( args->naive_concat )
     {
         if ( args->allow_overlaps ) error("The option --naive cannot be combined with --allow-overlaps\n");
         if ( args->phased_concat ) error("The option --naive cannot be combined with --ligate\n");
         naive_concat(args);
-        destroy_data(args);
-        free(args);
-        return 0;
     }
-    init_data(args);
-    concat(args);
+    else
+    {
+        init_data(args);
+        concat(args);
+    }
     destroy_data(args);
+    if ( args->write_index ) write_index(args->output_fname, args->output_type, args->n_threads);
     free(args);
     return 0;
 }
@@ -36,11 +36,14 @@ THE SOFTWARE.  */
 #include <htslib/bgzf.h>
 #include <htslib/synced_bcf_reader.h>
 #include <htslib/vcfutils.h>
+#include <htslib/thread_pool.h>
 #include <htslib/kseq.h>
+#include <htslib/khash_str2int.h>
 #include "bcftools.h"
 #include "filter.h"
 #include "convert.h"
 #include "tsv2vcf.h"
+#include "regidx.h"
 
 // Logic of the filters: include or exclude sites which match the filters?
 #define FLT_INCLUDE 1
@@ -68,11 +71,17 @@ struct _args_t
     char **argv, *sample_list, *targets_list, *regions_list, *tag, *columns;
     char *outfname, *infname, *ref_fname, *sex_fname;
     int argc, n_threads, record_cmd_line;
+    htsThreadPool tpool;    // the text imports only, see import_txt()
+    struct {
+        char *seq;
+        int rid, beg, len;
+    } ref_win;              // the reference window of gvcf_to_vcf()
 };
 
 static void destroy_data(args_t *args)
 {
     if ( args->ref ) fai_destroy(args->ref);
+    free(args->ref_win.seq);
     if ( args->convert) convert_destroy(args->convert);
     if ( args->filter ) filter_destroy(args->filter);
     free(args->samples);
@@ -311,6 +320,191 @@ static int tsv_setter_haps(tsv_t *tsv, bcf1_t *rec, void *usr)
     if ( bcf_update_genotypes(args->header,rec,args->gts,nsamples*2) ) error("Could not update GT field\n");
     return 0;
 }
+/*
+ *  Import of the text formats. With --threads the lines are read in batches
+ *  into a single buffer per batch, parsed into records by the pool, each batch
+ *  with its own copy of args_t (scratch buffers, counters, faidx handle) and
+ *  tsv_t, and written in the input order by the main thread.
+ */
+#define TXT_BATCH_SIZE 1000
+
+#define TXT_SKIP_COMMENTS 1     // skip lines starting with '#'
+#define TXT_SKIP_INVALID  2     // skip lines which fail to parse, otherwise error out
+
+typedef tsv_t *(*txt_init_f)(args_t *args);
+
+typedef struct
+{
+    args_t args;        // private copy
+    tsv_t *tsv;
+    kstring_t txt;      // the lines of the batch, NUL-terminated
+    int *off, *ret, nlines, mlines, mrec;
+    bcf1_t **rec;
+}
+txt_batch_t;
+
+static void *txt_parse_batch(void *arg)
+{
+    txt_batch_t *bt = (txt_batch_t*) arg;
+    int i;
+    for (i=0; i<bt->nlines; i++)
+    {
+        bcf_clear(bt->rec[i]);
+        bt->ret[i] = tsv_parse(bt->tsv, bt->rec[i], bt->txt.s + bt->off[i]);
+    }
+    return bt;
+}
+
+static void txt_write_batch(args_t *args, htsFile *out_fh, txt_batch_t *bt, int flags)
+{
+    int i;
+    for (i=0; i<bt->nlines; i++)
+    {
+        if ( !bt->ret[i] ) bcf_write(out_fh, args->header, bt->rec[i]);
+        else if ( flags & TXT_SKIP_INVALID ) args->n.skipped++;
+        else error("Error occurred while parsing: %s\n", bt->txt.s + bt->off[i]);
+    }
+    bt->nlines = 0;
+    bt->txt.l  = 0;
+}
+
+static void init_txt_pool(args_t *args, htsFile *in_fh, htsFile *out_fh)
+{
+    args->tpool.pool = hts_tpool_init(args->n_threads);
+    if ( !args->tpool.pool ) error("Could not initialize --threads %d\n", args->n_threads);
+    args->tpool.qsize = args->n_threads*2;
+    hts_set_thread_pool(in_fh, &args->tpool);
+    hts_set_thread_pool(out_fh, &args->tpool);
+}
+
+/*
+ *  Convert the lines of in_fh, the first line is expected in `line` unless
+ *  line->l is zero
+ */
+static void import_txt(args_t *args, htsFile *in_fh, kstring_t *line, htsFile *out_fh, txt_init_f init_tsv, int flags)
+{
+    if ( !line->l && hts_getline(in_fh, KS_SEP_LINE, line) <= 0 ) return;
+
+    if ( !args->tpool.pool )
+    {
+        tsv_t *tsv = init_tsv(args);
+        bcf1_t *rec = bcf_init();
+        do
+        {
+            if ( (flags & TXT_SKIP_COMMENTS) && line->s[0]=='#' ) continue;
+            bcf_clear(rec);
+            args->n.total++;
+            if ( !tsv_parse(tsv, rec, line->s) )
+                bcf_write(out_fh, args->header, rec);
+            else if ( flags & TXT_SKIP_INVALID )
+                args->n.skipped++;
+            else
+                error("Error occurred while parsing: %s\n", line->s);
+        }
+        while ( hts_getline(in_fh, KS_SEP_LINE, line) > 0 );
+        tsv_destroy(tsv);
+        bcf_destroy(rec);
+        return;
+    }
+
+    int i, j, nbatches = args->n_threads*2, ibatch = 0, nbusy = 0;
+    hts_tpool_process *q = hts_tpool_process_init(args->tpool.pool, nbatches, 0);
+    if ( !q ) error("Failed to initialize the thread pool queue\n");
+    txt_batch_t *batches = (txt_batch_t*) calloc(nbatches, sizeof(txt_batch_t));
+    for (i=0; i<nbatches; i++)
+    {
+        args_t *bargs = &batches[i].args;
+        memcpy(bargs, args, sizeof(args_t));
+        memset(&bargs->n, 0, sizeof(bargs->n));
+        memset(&bargs->str, 0, sizeof(bargs->str));
+        bargs->gts = NULL;
+        bargs->flt = NULL;
+        if ( args->ref )
+        {
+            // faidx_fetch_seq() seeks in the file, each batch needs its own handle
+            bargs->ref = fai_load(args->ref_fname);
+            if ( !bargs->ref ) error("Could not load the reference %s\n", args->ref_fname);
+        }
+        batches[i].tsv = init_tsv(bargs);
+    }
+
+    int eof = 0;
+    while ( !eof )
+    {
+        txt_batch_t *bt = &batches[ibatch];
+        do
+        {
+            if ( (flags & TXT_SKIP_COMMENTS) && line->s[0]=='#' ) continue;
+            args->n.total++;
+            hts_expand(int, bt->nlines+1, bt->mlines, bt->off);
+            bt->off[bt->nlines++] = bt->txt.l;
+            kputsn(line->s, line->l, &bt->txt);
+            kputc(0, &bt->txt);
+        }
+        while ( (eof = hts_getline(in_fh, KS_SEP_LINE, line) <= 0)==0 && bt->nlines < TXT_BATCH_SIZE );
+        if ( bt->nlines )
+        {
+            if ( bt->mrec < bt->nlines )
+            {
+                bt->rec = (bcf1_t**) realloc(bt->rec, sizeof(bcf1_t*)*bt->nlines);
+                bt->ret = (int*) realloc(bt->ret, sizeof(int)*bt->nlines);
+                for (j=bt->mrec; j<bt->nlines; j++) bt->rec[j] = bcf_init();
+                bt->mrec = bt->nlines;
+            }
+            if ( hts_tpool_dispatch(args->tpool.pool, q, txt_parse_batch, bt) < 0 )
+                error("Failed to dispatch the lines to the thread pool\n");
+            nbusy++;
+            ibatch = (ibatch + 1) % nbatches;
+        }
+
+        // the batches are dispatched round-robin and come back in order, so
+        // the oldest one is also the one to be filled next
+        while ( nbusy && (eof || nbusy==nbatches) )
+        {
+            hts_tpool_result *res = hts_tpool_next_result_wait(q);
+            if ( !res ) error("Failed to retrieve the parsed lines\n");
+            txt_write_batch(args, out_fh, (txt_batch_t*) hts_tpool_result_data(res), flags);
+            hts_tpool_delete_result(res, 0);
+            nbusy--;
+        }
+    }
+    hts_tpool_process_destroy(q);
+
+    for (i=0; i<nbatches; i++)
+    {
+        txt_batch_t *bt = &batches[i];
+        args->n.missing += bt->args.n.missing;
+        args->n.hom_rr  += bt->args.n.hom_rr;
+        args->n.het_ra  += bt->args.n.het_ra;
+        args->n.hom_aa  += bt->args.n.hom_aa;
+        args->n.het_aa  += bt->args.n.het_aa;
+        if ( bt->args.ref ) fai_destroy(bt->args.ref);
+        free(bt->args.str.s);
+        free(bt->args.gts);
+        free(bt->args.flt);
+        tsv_destroy(bt->tsv);
+        for (j=0; j<bt->mrec; j++) bcf_destroy(bt->rec[j]);
+        free(bt->rec);
+        free(bt->ret);
+        free(bt->off);
+        free(bt->txt.s);
+    }
+    free(batches);
+}
+
+static tsv_t *gensample_init_tsv(args_t *args)
+{
+    int nsamples = bcf_hdr_nsamples(args->header);
+    args->gts = (int32_t *) malloc(sizeof(int32_t)*nsamples*2);
+    args->flt = (float *) malloc(sizeof(float)*nsamples*3);
+
+    tsv_t *tsv = tsv_init("-,CHROM_POS_REF_ALT,POS,REF_ALT,GT_GP");
+    tsv_register(tsv, "CHROM_POS_REF_ALT", tsv_setter_chrom_pos_ref_alt, args);
+    tsv_register(tsv, "POS", tsv_setter_verify_pos, NULL);
+    tsv_register(tsv, "REF_ALT", tsv_setter_verify_ref_alt, args);
+    tsv_register(tsv, "GT_GP", tsv_setter_gt_gp, args);
+    return tsv;
+}
 static void gensample_to_vcf(args_t *args)
 {
     /*
@@ -359,12 +553,6 @@ static void gensample_to_vcf(args_t *args)
     if ( !se ) error("Expected CHROM:POS_REF_ALT in second column of %s\n", gen_fname);
     kputsn(ss, se-ss, &args->str);
 
-    tsv_t *tsv = tsv_init("-,CHROM_POS_REF_ALT,POS,REF_ALT,GT_GP");
-    tsv_register(tsv, "CHROM_POS_REF_ALT", tsv_setter_chrom_pos_ref_alt, args);
-    tsv_register(tsv, "POS", tsv_setter_verify_pos, NULL);
-    tsv_register(tsv, "REF_ALT", tsv_setter_verify_ref_alt, args);
-    tsv_register(tsv, "GT_GP", tsv_setter_gt_gp, args);
-
     args->header = bcf_hdr_init("w");
     bcf_hdr_append(args->header, "##INFO=<ID=END,Number=1,Type=Integer,Description=\"End position of the variant described in this record\">");
     bcf_hdr_append(args->header, "##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\">");
@@ -386,36 +574,21 @@ static void gensample_to_vcf(args_t *args)
 
     htsFile *out_fh = hts_open(args->outfname,hts_bcf_wmode(args->output_type));
     if ( out_fh == NULL ) error("Can't write to \"%s\": %s\n", args->outfname, strerror(errno));
-    if ( args->n_threads ) hts_set_threads(out_fh, args->n_threads);
+    if ( args->n_threads ) init_txt_pool(args, gen_fh, out_fh);
     bcf_hdr_write(out_fh,args->header);
-    bcf1_t *rec = bcf_init();
-
-    nsamples -= 2;
-    args->gts = (int32_t *) malloc(sizeof(int32_t)*nsamples*2);
-    args->flt = (float *) malloc(sizeof(float)*nsamples*3);
 
-    do
-    {
-        bcf_clear(rec);
-        args->n.total++;
-        if ( !tsv_parse(tsv, rec, line.s) )
-            bcf_write(out_fh, args->header, rec);
-        else
-            error("Error occurred while parsing: %s\n", line.s);
-    }
-    while ( hts_getline(gen_fh, KS_SEP_LINE, &line)>0 );
+    import_txt(args, gen_fh, &line, out_fh, gensample_init_tsv, 0);
 
     if ( hts_close(out_fh) ) error("Close failed: %s\n", args->outfname);
     if ( hts_close(gen_fh) ) error("Close failed: %s\n", gen_fname);
+    if ( args->tpool.pool ) hts_tpool_destroy(args->tpool.pool);
     bcf_hdr_destroy(args->header);
-    bcf_destroy(rec);
     free(sample_fname);
     free(gen_fname);
     free(args->str.s);
     free(line.s);
     free(args->gts);
     free(args->flt);
-    tsv_destroy(tsv);
 
     fprintf(stderr,"Number of processed rows: \t%d\n", args->n.total);
 }
@@ -558,6 +731,17 @@ static void haplegendsample_to_vcf(args_t *args)
     fprintf(stderr,"Number of processed rows: \t%d\n", args->n.total);
 }
 
+static tsv_t *hapsample_init_tsv(args_t *args)
+{
+    args->gts = (int32_t *) malloc(sizeof(int32_t)*bcf_hdr_nsamples(args->header)*2);
+
+    tsv_t *tsv = tsv_init("CHROM_POS_REF_ALT,-,POS,REF_ALT,HAPS");
+    tsv_register(tsv, "CHROM_POS_REF_ALT", tsv_setter_chrom_pos_ref_alt, args);
+    tsv_register(tsv, "POS", tsv_setter_verify_pos, NULL);
+    tsv_register(tsv, "REF_ALT", tsv_setter_verify_ref_alt, args);
+    tsv_register(tsv, "HAPS", tsv_setter_haps, args);
+    return tsv;
+}
 static void hapsample_to_vcf(args_t *args)
 {
     /*
@@ -599,12 +783,6 @@ static void hapsample_to_vcf(args_t *args)
     if ( !se ) error("Expected CHROM:POS_REF_ALT in first column of %s\n", hap_fname);
     kputsn(line.s, se-line.s, &args->str);
 
-    tsv_t *tsv = tsv_init("CHROM_POS_REF_ALT,-,POS,REF_ALT,HAPS");
-    tsv_register(tsv, "CHROM_POS_REF_ALT", tsv_setter_chrom_pos_ref_alt, args);
-    tsv_register(tsv, "POS", tsv_setter_verify_pos, NULL);
-    tsv_register(tsv, "REF_ALT", tsv_setter_verify_ref_alt, args);
-    tsv_register(tsv, "HAPS", tsv_setter_haps, args);
-
     args->header = bcf_hdr_init("w");
     bcf_hdr_append(args->header, "##INFO=<ID=END,Number=1,Type=Integer,Description=\"End position of the variant described in this record\">");
     bcf_hdr_append(args->header, "##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\">");
@@ -626,34 +804,20 @@ static void hapsample_to_vcf(args_t *args)
 
     htsFile *out_fh = hts_open(args->outfname,hts_bcf_wmode(args->output_type));
     if ( out_fh == NULL ) error("Can't write to \"%s\": %s\n", args->outfname, strerror(errno));
-    if ( args->n_threads ) hts_set_threads(out_fh, args->n_threads);
+    if ( args->n_threads ) init_txt_pool(args, hap_fh, out_fh);
     bcf_hdr_write(out_fh,args->header);
-    bcf1_t *rec = bcf_init();
 
-    nsamples -= 2;
-    args->gts = (int32_t *) malloc(sizeof(int32_t)*nsamples*2);
-
-    do
-    {
-        bcf_clear(rec);
-        args->n.total++;
-        if ( !tsv_parse(tsv, rec, line.s) )
-            bcf_write(out_fh, args->header, rec);
-        else
-            error("Error occurred while parsing: %s\n", line.s);
-    }
-    while ( hts_getline(hap_fh, KS_SEP_LINE, &line)>0 );
+    import_txt(args, hap_fh, &line, out_fh, hapsample_init_tsv, 0);
 
     if ( hts_close(out_fh) ) error("Close failed: %s\n", args->outfname);
     if ( hts_close(hap_fh) ) error("Close failed: %s\n", hap_fname);
+    if ( args->tpool.pool ) hts_tpool_destroy(args->tpool.pool);
     bcf_hdr_destroy(args->header);
-    bcf_destroy(rec);
     free(sample_fname);
     free(hap_fname);
     free(args->str.s);
     free(line.s);
     free(args->gts);
-    tsv_destroy(tsv);
 
     fprintf(stderr,"Number of processed rows: \t%d\n", args->n.total);
 }
@@ -1185,6 +1349,18 @@ static int tsv_setter_aa(tsv_t *tsv, bcf1_t *rec, void *usr)
     return 0;
 }
 
+static tsv_t *tsv_init_tsv(args_t *args)
+{
+    args->gts = (int32_t *) malloc(sizeof(int32_t)*bcf_hdr_nsamples(args->header)*2);
+
+    tsv_t *tsv = tsv_init(args->columns ? args->columns : "ID,CHROM,POS,AA");
+    if ( tsv_register(tsv, "CHROM", tsv_setter_chrom, args->header) < 0 ) error("Expected CHROM column\n");
+    if ( tsv_register(tsv, "POS", tsv_setter_pos, NULL) < 0 ) error("Expected POS column\n");
+    if ( tsv_register(tsv, "ID", tsv_setter_id, args->header) < 0 && !args->columns ) error("Expected ID column\n");
+    if ( tsv_register(tsv, "AA", tsv_setter_aa, args) < 0 ) error("Expected AA column\n");
+    return tsv;
+}
+
 static void tsv_to_vcf(args_t *args)
 {
     if ( !args->ref_fname ) error("--tsv2vcf requires the --fasta-ref option\n");
@@ -1208,43 +1384,22 @@ static void tsv_to_vcf(args_t *args)
     }
     free(smpls);
     bcf_hdr_add_sample(args->header, NULL);
-    args->gts = (int32_t *) malloc(sizeof(int32_t)*n*2);
 
+    htsFile *in_fh = hts_open(args->infname, "r");
+    if ( !in_fh ) error("Could not read: %s\n", args->infname);
     htsFile *out_fh = hts_open(args->outfname,hts_bcf_wmode(args->output_type));
     if ( out_fh == NULL ) error("Can't write to \"%s\": %s\n", args->outfname, strerror(errno));
-    if ( args->n_threads ) hts_set_threads(out_fh, args->n_threads);
+    if ( args->n_threads ) init_txt_pool(args, in_fh, out_fh);
     bcf_hdr_write(out_fh,args->header);
 
-    tsv_t *tsv = tsv_init(args->columns ? args->columns : "ID,CHROM,POS,AA");
-    if ( tsv_register(tsv, "CHROM", tsv_setter_chrom, args->header) < 0 ) error("Expected CHROM column\n");
-    if ( tsv_register(tsv, "POS", tsv_setter_pos, NULL) < 0 ) error("Expected POS column\n");
-    if ( tsv_register(tsv, "ID", tsv_setter_id, args->header) < 0 && !args->columns ) error("Expected ID column\n");
-    if ( tsv_register(tsv, "AA", tsv_setter_aa, args) < 0 ) error("Expected AA column\n");
-
-    bcf1_t *rec = bcf_init();
-    bcf_float_set_missing(rec->qual);
-
     kstring_t line = {0,0,0};
-    htsFile *in_fh = hts_open(args->infname, "r");
-    if ( !in_fh ) error("Could not read: %s\n", args->infname);
-    while ( hts_getline(in_fh, KS_SEP_LINE, &line) > 0 )
-    {
-        if ( line.s[0]=='#' ) continue;     // skip comments
-        bcf_clear(rec);
-
-        args->n.total++;
-        if ( !tsv_parse(tsv, rec, line.s) )
-            bcf_write(out_fh, args->header, rec);
-        else
-            args->n.skipped++;
-    }
+    import_txt(args, in_fh, &line, out_fh, tsv_init_tsv, TXT_SKIP_COMMENTS|TXT_SKIP_INVALID);
     if ( hts_close(in_fh) ) error("Close failed: %s\n", args->infname);
     free(line.s);
 
     bcf_hdr_destroy(args->header);
     hts_close(out_fh);
-    tsv_destroy(tsv);
-    bcf_destroy(rec);
+    if ( args->tpool.pool ) hts_tpool_destroy(args->tpool.pool);
     free(args->str.s);
     free(args->gts);
 
@@ -1281,6 +1436,37 @@ static void vcf_to_vcf(args_t *args)
     hts_close(out_fh);
 }
 
+// The reference bases of gVCF blocks are fetched in windows of GVCF_REF_WIN
+// bases rather than one by one, as the blocks come sorted
+#define GVCF_REF_WIN 1000000
+
+static char gvcf_ref_base(args_t *args, bcf_hdr_t *hdr, int rid, int pos)
+{
+    if ( !args->ref_win.seq || args->ref_win.rid!=rid || pos < args->ref_win.beg || pos >= args->ref_win.beg + args->ref_win.len )
+    {
+        free(args->ref_win.seq);
+        args->ref_win.seq = faidx_fetch_seq(args->ref, (char*)bcf_hdr_id2name(hdr,rid), pos, pos+GVCF_REF_WIN-1, &args->ref_win.len);
+        if ( !args->ref_win.seq || args->ref_win.len<=0 ) error("faidx_fetch_seq failed at %s:%d\n", bcf_hdr_id2name(hdr,rid), pos+1);
+        args->ref_win.rid = rid;
+        args->ref_win.beg = pos;
+    }
+    return args->ref_win.seq[pos - args->ref_win.beg];
+}
+
+// Write the block as per-base records from pos to end-1 (0-based), the record
+// serves as a template with only POS and REF changing
+static void gvcf_expand(args_t *args, htsFile *out_fh, bcf_hdr_t *hdr, bcf1_t *line, int beg, int end)
+{
+    int pos;
+    for (pos=beg; pos<end; pos++)
+    {
+        line->pos = pos;
+        line->d.allele[0][0] = gvcf_ref_base(args, hdr, line->rid, pos);
+        line->d.shared_dirty |= BCF1_DIRTY_ALS;
+        bcf_write(out_fh,hdr,line);
+    }
+}
+
 static void gvcf_to_vcf(args_t *args)
 {
     if ( !args->ref_fname ) error("--gvcf2vcf requires the --fasta-ref option\n");
@@ -1288,6 +1474,26 @@ static void gvcf_to_vcf(args_t *args)
     args->ref = fai_load(args->ref_fname);
     if ( !args->ref ) error("Could not load the fai index for reference %s\n", args->ref_fname);
 
+    // With targets only the target positions of the blocks are expanded. The
+    // synced reader would drop the blocks which start before a target, the
+    // targets are therefore applied here.
+    regidx_t *tgt = NULL;
+    regitr_t *itr = NULL;
+    if ( args->targets_list && args->targets_list[0]!='^' )
+    {
+        if ( args->targets_is_file )
+            tgt = regidx_init(args->targets_list,NULL,NULL,0,NULL);
+        else
+        {
+            tgt = regidx_init(NULL,regidx_parse_reg,NULL,0,NULL);
+            if ( tgt && regidx_insert_list(tgt,args->targets_list,',')!=0 ) error("Could not parse the targets: %s\n", args->targets_list);
+        }
+        if ( !tgt ) error("Failed to read the targets: %s\n", args->targets_list);
+        itr = regitr_init(tgt);
+        regitr_set_sorted(itr, 1);
+        args->targets_list = NULL;
+    }
+
     open_vcf(args,NULL);
     htsFile *out_fh = hts_open(args->outfname,hts_bcf_wmode(args->output_type));
     if ( out_fh == NULL ) error("Can't write to \"%s\": %s\n", args->outfname, strerror(errno));
@@ -1302,6 +1508,7 @@ static void gvcf_to_vcf(args_t *args)
     while ( bcf_sr_next_line(args->files) )
     {
         bcf1_t *line = bcf_sr_get_line(args->files,0);
+        if ( tgt && !regidx_overlap(tgt, bcf_seqname(hdr,line), line->pos, line->pos+line->rlen-1, itr) ) continue;
         if ( args->filter )
         {
             int pass = filter_test(args->filter, line, NULL);
@@ -1345,19 +1552,441 @@ static void gvcf_to_vcf(args_t *args)
             continue;
         }
         bcf_update_info_int32(hdr,line,"END",NULL,0);
-        int pos, len;
-        for (pos=line->pos; pos<itmp[0]; pos++)
+        int beg = line->pos, end = itmp[0];
+        if ( !tgt )
         {
-            line->pos = pos;
-            char *ref = faidx_fetch_seq(args->ref, (char*)bcf_hdr_id2name(hdr,line->rid), line->pos, line->pos, &len);
-            if ( !ref ) error("faidx_fetch_seq failed at %s:%d\n", bcf_hdr_id2name(hdr,line->rid), line->pos+1);
-            strncpy(line->d.allele[0],ref,len);
-            bcf_write(out_fh,hdr,line);
-            free(ref);
+            gvcf_expand(args, out_fh, hdr, line, beg, end);
+            continue;
+        }
+
+        // the overlapping targets are sorted by start, possibly overlapping each other
+        int last = beg;
+        if ( !regidx_overlap(tgt, bcf_seqname(hdr,line), beg, end-1, itr) ) continue;
+        while ( regitr_overlap(itr) )
+        {
+            int tbeg = itr->beg > last ? itr->beg : last;
+            int tend = itr->end+1 < end ? itr->end+1 : end;
+            if ( tbeg >= tend ) continue;
+            gvcf_expand(args, out_fh, hdr, line, tbeg, tend);
+            last = tend;
         }
     }
     free(itmp);
     hts_close(out_fh);
+    if ( tgt )
+    {
+        regitr_destroy(itr);
+        regidx_destroy(tgt);
+    }
+}
+
+/*
+    Columnar export, see the --columnar section of the man page for the layout.
+    The values are written in the native byte order, the byte order mark in the
+    header tells the reader if they need swapping. The records are buffered in
+    blocks of at most COLS_MAX_ROWS rows or COLS_MAX_BYTES bytes.
+*/
+#define COLS_MAGIC      "BCFCOLS1"
+#define COLS_MAX_ROWS   65536
+#define COLS_MAX_BYTES  (64*1024*1024)
+
+#define COL_CHROM   1
+#define COL_POS     2
+#define COL_ID      3
+#define COL_REF     4
+#define COL_ALT     5
+#define COL_QUAL    6
+#define COL_FILTER  7
+#define COL_INFO    8
+#define COL_FORMAT  9
+
+// the value types as written in the file header
+#define COL_INT32   1
+#define COL_FLOAT   2
+#define COL_STRING  3
+#define COL_GT      4
+#define COL_FLAG    5
+
+typedef struct
+{
+    char *name;
+    int field, type, is_list, is_sample, hdr_id;
+    kstring_t dat;          // the values or, for strings, the dictionary indexes
+    kstring_t off;          // list offsets, nrows+1 uint32 values
+    kstring_t dict, doff;   // string dictionary: the strings and nstr+1 uint32 offsets
+    void *dict_hash;
+    int gt_wide;            // GT values of this block collected as int32, some do not fit in int8
+}
+col_t;
+
+typedef struct
+{
+    FILE *fp;
+    char *fname;
+    col_t *cols;
+    int ncols, nsmpl, nrows;
+    int32_t *ibuf;
+    float *fbuf;
+    char *sbuf;
+    int nibuf, nfbuf, nsbuf;
+    kstring_t tmp;
+}
+cols_t;
+
+static void cols_write(cols_t *cols, const void *ptr, size_t size)
+{
+    if ( size && fwrite(ptr,1,size,cols->fp)!=size ) error("Failed to write to %s: %s\n", cols->fname, strerror(errno));
+}
+static void cols_write_u32(cols_t *cols, uint32_t val) { cols_write(cols, &val, 4); }
+static void cols_write_str(cols_t *cols, const char *str) { cols_write(cols, str, strlen(str)+1); }
+
+static inline void kput_u32(uint32_t val, kstring_t *str) { kputsn((char*)&val, 4, str); }
+static inline void kput_i32(int32_t val, kstring_t *str) { kputsn((char*)&val, 4, str); }
+
+static void cols_add_column(cols_t *cols, bcf_hdr_t *hdr, const char *name)
+{
+    cols->ncols++;
+    cols->cols = (col_t*) realloc(cols->cols, sizeof(col_t)*cols->ncols);
+    col_t *col = &cols->cols[cols->ncols-1];
+    memset(col, 0, sizeof(*col));
+
+    static const struct { const char *name; int field, type; } fixed[] = {
+        {"CHROM",COL_CHROM,COL_INT32}, {"POS",COL_POS,COL_INT32}, {"ID",COL_ID,COL_STRING}, {"REF",COL_REF,COL_STRING},
+        {"ALT",COL_ALT,COL_STRING}, {"QUAL",COL_QUAL,COL_FLOAT}, {"FILTER",COL_FILTER,COL_STRING}, {NULL,0,0} };
+    int i;
+    for (i=0; fixed[i].name; i++)
+        if ( !strcasecmp(name,fixed[i].name) ) break;
+    if ( fixed[i].name )
+    {
+        col->name  = strdup(fixed[i].name);
+        col->field = fixed[i].field;
+        col->type  = fixed[i].type;
+        return;
+    }
+
+    int hl = BCF_HL_INFO;
+    const char *tag = name;
+    if ( !strncasecmp(name,"INFO/",5) ) tag = name + 5;
+    else if ( !strncasecmp(name,"FORMAT/",7) ) { tag = name + 7; hl = BCF_HL_FMT; }
+    else if ( !strncasecmp(name,"FMT/",4) ) { tag = name + 4; hl = BCF_HL_FMT; }
+    col->hdr_id = bcf_hdr_id2int(hdr,BCF_DT_ID,tag);
+    if ( !bcf_hdr_idinfo_exists(hdr,hl,col->hdr_id) )
+        error("No such %s tag defined in the header: %s\n", hl==BCF_HL_INFO ? "INFO" : "FORMAT", tag);
+
+    kstring_t str = {0,0,0};
+    ksprintf(&str, "%s/%s", hl==BCF_HL_INFO ? "INFO" : "FORMAT", tag);
+    col->name   = str.s;
+    col->field  = hl==BCF_HL_INFO ? COL_INFO : COL_FORMAT;
+    col->is_sample = hl==BCF_HL_FMT ? 1 : 0;
+    col->is_list   = bcf_hdr_id2length(hdr,hl,col->hdr_id)==BCF_VL_FIXED && bcf_hdr_id2number(hdr,hl,col->hdr_id)==1 ? 0 : 1;
+
+    int type = bcf_hdr_id2type(hdr,hl,col->hdr_id);
+    if ( hl==BCF_HL_FMT && !strcmp(tag,"GT") ) { col->type = COL_GT; col->is_list = 0; }
+    else if ( type==BCF_HT_INT ) col->type = COL_INT32;
+    else if ( type==BCF_HT_REAL ) col->type = COL_FLOAT;
+    else if ( type==BCF_HT_FLAG ) { col->type = COL_FLAG; col->is_list = 0; }
+    else if ( hl==BCF_HL_INFO ) { col->type = COL_STRING; col->is_list = 0; }
+    else error("FORMAT string fields are not supported by --columnar: %s\n", tag);
+    if ( col->is_sample && !cols->nsmpl ) error("No samples in the input, cannot export %s\n", col->name);
+}
+
+static void cols_init(cols_t *cols, args_t *args)
+{
+    bcf_hdr_t *hdr = args->header;
+    cols->nsmpl = bcf_hdr_nsamples(hdr);
+
+    kstring_t str = {0,0,0};
+    if ( args->columns )
+        kputs(args->columns, &str);
+    else
+    {
+        kputs("CHROM,POS,ID,REF,ALT", &str);
+        int id = bcf_hdr_id2int(hdr,BCF_DT_ID,"GT");
+        if ( cols->nsmpl && bcf_hdr_idinfo_exists(hdr,BCF_HL_FMT,id) ) kputs(",FORMAT/GT", &str);
+    }
+    int i, n;
+    char **list = hts_readlist(str.s, 0, &n);
+    if ( !list || !n ) error("Could not parse the columns: %s\n", str.s);
+    for (i=0; i<n; i++)
+    {
+        cols_add_column(cols, hdr, list[i]);
+        free(list[i]);
+    }
+    free(list);
+    free(str.s);
+
+    cols->fname = args->outfname;
+    cols->fp = strcmp("-",args->outfname) ? fopen(args->outfname,"w") : stdout;
+    if ( !cols->fp ) error("Failed to open %s: %s\n", args->outfname, strerror(errno));
+
+    cols_write(cols, COLS_MAGIC, 8);
+    cols_write_u32(cols, 0x01020304);
+    cols_write_u32(cols, cols->nsmpl);
+    for (i=0; i<cols->nsmpl; i++) cols_write_str(cols, hdr->samples[i]);
+    cols_write_u32(cols, hdr->n[BCF_DT_CTG]);
+    for (i=0; i<hdr->n[BCF_DT_CTG]; i++) cols_write_str(cols, bcf_hdr_id2name(hdr,i));
+    cols_write_u32(cols, cols->ncols);
+    for (i=0; i<cols->ncols; i++)
+    {
+        col_t *col = &cols->cols[i];
+        uint8_t desc[3] = { col->is_sample, col->type, col->is_list };
+        cols_write_str(cols, col->name);
+        cols_write(cols, desc, 3);
+        kput_u32(0, &col->off);
+    }
+}
+
+static void cols_add_string(col_t *col, const char *str)
+{
+    int idx;
+    if ( !col->dict_hash ) col->dict_hash = khash_str2int_init();
+    if ( khash_str2int_get(col->dict_hash, str, &idx)<0 )
+    {
+        idx = khash_str2int_size(col->dict_hash);
+        khash_str2int_set(col->dict_hash, strdup(str), idx);
+        if ( !col->doff.l ) kput_u32(0, &col->doff);
+        kputsn(str, strlen(str), &col->dict);
+        kput_u32(col->dict.l, &col->doff);
+    }
+    kput_u32(idx, &col->dat);
+}
+
+static void cols_add_info(cols_t *cols, bcf_hdr_t *hdr, bcf1_t *line, col_t *col)
+{
+    const char *tag = hdr->id[BCF_DT_ID][col->hdr_id].key;
+    int n;
+    if ( col->type==COL_FLAG )
+    {
+        uint8_t flag = bcf_get_info_flag(hdr,line,tag,NULL,NULL)==1 ? 1 : 0;
+        kputsn((char*)&flag, 1, &col->dat);
+        return;
+    }
+    if ( col->type==COL_STRING )
+    {
+        n = bcf_get_info_string(hdr,line,tag,&cols->sbuf,&cols->nsbuf);
+        cols_add_string(col, n>0 ? cols->sbuf : ".");
+        return;
+    }
+    void *dat;
+    if ( col->type==COL_INT32 )
+    {
+        n = bcf_get_info_int32(hdr,line,tag,&cols->ibuf,&cols->nibuf);
+        if ( n<=0 && !col->is_list ) { n = 1; hts_expand(int32_t,1,cols->nibuf,cols->ibuf); cols->ibuf[0] = bcf_int32_missing; }
+        dat = cols->ibuf;
+    }
+    else
+    {
+        n = bcf_get_info_float(hdr,line,tag,&cols->fbuf,&cols->nfbuf);
+        if ( n<=0 && !col->is_list ) { n = 1; hts_expand(float,1,cols->nfbuf,cols->fbuf); bcf_float_set_missing(cols->fbuf[0]); }
+        dat = cols->fbuf;
+    }
+    if ( n<0 ) n = 0;
+    if ( !col->is_list ) n = 1;
+    kputsn((char*)dat, n*4, &col->dat);
+    if ( col->is_list ) kput_u32(col->dat.l/4, &col->off);
+}
+
+// Convert the int8 GT values collected so far in the block to int32
+static void cols_widen_gt(col_t *col)
+{
+    size_t i, n = col->dat.l;
+    ks_resize(&col->dat, 4*n);
+    int8_t *src = (int8_t*) col->dat.s;
+    int32_t *dst = (int32_t*) col->dat.s;
+    for (i=n; i>0; i--)
+        dst[i-1] = src[i-1]==bcf_int8_vector_end ? bcf_int32_vector_end : src[i-1];
+    col->dat.l = 4*n;
+    col->gt_wide = 1;
+}
+
+static void cols_add_format(cols_t *cols, bcf_hdr_t *hdr, bcf1_t *line, col_t *col)
+{
+    const char *tag = hdr->id[BCF_DT_ID][col->hdr_id].key;
+    int i, j, n, nsmpl = cols->nsmpl;
+    if ( col->type==COL_GT )
+    {
+        n = bcf_get_genotypes(hdr,line,&cols->ibuf,&cols->nibuf);
+        int ploidy = n>0 ? n/nsmpl : 0;
+        if ( ploidy>2 ) error("Only haploid and diploid genotypes are supported by --columnar: %s:%d\n", bcf_seqname(hdr,line),line->pos+1);
+        // int8 holds alleles up to 62 and the vector_end value; a block with
+        // anything else, such as the missing value, is written as int32
+        for (i=0; i<nsmpl*ploidy && !col->gt_wide; i++)
+        {
+            int32_t val = cols->ibuf[i];
+            if ( val==bcf_int32_vector_end ) continue;
+            if ( val<0 || val>INT8_MAX ) cols_widen_gt(col);
+        }
+        int size = col->gt_wide ? 4 : 1;
+        ks_resize(&col->dat, col->dat.l + 2*nsmpl*size);
+        int8_t *dst8 = (int8_t*)(col->dat.s + col->dat.l);
+        int32_t *dst32 = (int32_t*)(col->dat.s + col->dat.l);
+        for (i=0; i<nsmpl; i++)
+        {
+            int32_t *ptr = cols->ibuf + i*ploidy;
+            for (j=0; j<2; j++)
+            {
+                int32_t val;
+                if ( j>=ploidy ) val = j ? bcf_int32_vector_end : 0;
+                else val = ptr[j];
+                if ( size==4 ) dst32[2*i+j] = val;
+                else dst8[2*i+j] = val==bcf_int32_vector_end ? bcf_int8_vector_end : val;
+            }
+        }
+        col->dat.l += 2*nsmpl*size;
+        return;
+    }
+    int32_t *dat;
+    if ( col->type==COL_INT32 )
+    {
+        n = bcf_get_format_int32(hdr,line,tag,&cols->ibuf,&cols->nibuf);
+        dat = cols->ibuf;
+    }
+    else
+    {
+        n = bcf_get_format_float(hdr,line,tag,&cols->fbuf,&cols->nfbuf);
+        dat = (int32_t*) cols->fbuf;
+    }
+    int width = n>0 ? n/nsmpl : 0;
+    if ( col->is_list )
+    {
+        kputsn((char*)dat, width*nsmpl*4, &col->dat);
+        kput_u32(col->dat.l/4, &col->off);
+        return;
+    }
+    int32_t missing = bcf_int32_missing;
+    if ( col->type==COL_FLOAT ) { float tmp; bcf_float_set_missing(tmp); memcpy(&missing,&tmp,4); }
+    ks_resize(&col->dat, col->dat.l + 4*nsmpl);
+    int32_t *dst = (int32_t*)(col->dat.s + col->dat.l);
+    for (i=0; i<nsmpl; i++) dst[i] = width ? dat[i*width] : missing;
+    col->dat.l += 4*nsmpl;
+}
+
+static void cols_add_line(cols_t *cols, bcf_hdr_t *hdr, bcf1_t *line)
+{
+    int i, j;
+    bcf_unpack(line, BCF_UN_FLT);
+    for (i=0; i<cols->ncols; i++)
+    {
+        col_t *col = &cols->cols[i];
+        switch (col->field)
+        {
+            case COL_CHROM: kput_i32(line->rid, &col->dat); break;
+            case COL_POS: kput_i32(line->pos+1, &col->dat); break;
+            case COL_ID: cols_add_string(col, line->d.id); break;
+            case COL_REF: cols_add_string(col, line->d.allele[0]); break;
+            case COL_ALT:
+                cols->tmp.l = 0;
+                for (j=1; j<line->n_allele; j++)
+                {
+                    if ( j>1 ) kputc(',', &cols->tmp);
+                    kputs(line->d.allele[j], &cols->tmp);
+                }
+                cols_add_string(col, cols->tmp.l ? cols->tmp.s : ".");
+                break;
+            case COL_QUAL: kputsn((char*)&line->qual, 4, &col->dat); break;
+            case COL_FILTER:
+                cols->tmp.l = 0;
+                for (j=0; j<line->d.n_flt; j++)
+                {
+                    if ( j ) kputc(';', &cols->tmp);
+                    kputs(bcf_hdr_int2id(hdr,BCF_DT_ID,line->d.flt[j]), &cols->tmp);
+                }
+                cols_add_string(col, cols->tmp.l ? cols->tmp.s : ".");
+                break;
+            case COL_INFO: cols_add_info(cols, hdr, line, col); break;
+            case COL_FORMAT: cols_add_format(cols, hdr, line, col); break;
+        }
+    }
+    cols->nrows++;
+}
+
+static size_t cols_nbytes(cols_t *cols)
+{
+    size_t i, n = 0;
+    for (i=0; i<cols->ncols; i++)
+        n += cols->cols[i].dat.l + cols->cols[i].off.l + cols->cols[i].dict.l + cols->cols[i].doff.l;
+    return n;
+}
+
+static void cols_flush(cols_t *cols)
+{
+    if ( !cols->nrows ) return;
+    int i;
+    cols_write_u32(cols, cols->nrows);
+    for (i=0; i<cols->ncols; i++)
+    {
+        col_t *col = &cols->cols[i];
+        uint64_t nbytes = col->dat.l;
+        if ( col->is_list ) nbytes += col->off.l;
+        if ( col->type==COL_STRING ) nbytes += 4 + (col->doff.l ? col->doff.l : 4) + col->dict.l;
+        cols_write(cols, &nbytes, 8);
+        if ( col->type==COL_STRING )
+        {
+            uint32_t ndict = col->dict_hash ? khash_str2int_size(col->dict_hash) : 0;
+            cols_write_u32(cols, ndict);
+            if ( col->doff.l ) cols_write(cols, col->doff.s, col->doff.l);
+            else cols_write_u32(cols, 0);
+            cols_write(cols, col->dict.s, col->dict.l);
+            khash_str2int_clear_free(col->dict_hash);
+            col->dict.l = col->doff.l = 0;
+        }
+        if ( col->is_list ) cols_write(cols, col->off.s, col->off.l);
+        cols_write(cols, col->dat.s, col->dat.l);
+        col->dat.l = col->off.l = 0;
+        col->gt_wide = 0;
+        kput_u32(0, &col->off);
+    }
+    cols->nrows = 0;
+}
+
+static void cols_destroy(cols_t *cols)
+{
+    cols_flush(cols);
+    cols_write_u32(cols, 0);
+    if ( cols->fp!=stdout && fclose(cols->fp)!=0 ) error("Failed to close %s: %s\n", cols->fname, strerror(errno));
+    if ( cols->fp==stdout && fflush(stdout)!=0 ) error("Failed to write to the standard output\n");
+    int i;
+    for (i=0; i<cols->ncols; i++)
+    {
+        col_t *col = &cols->cols[i];
+        free(col->name);
+        free(col->dat.s);
+        free(col->off.s);
+        free(col->dict.s);
+        free(col->doff.s);
+        khash_str2int_destroy_free(col->dict_hash);
+    }
+    free(cols->cols);
+    free(cols->ibuf);
+    free(cols->fbuf);
+    free(cols->sbuf);
+    free(cols->tmp.s);
+}
+
+static void vcf_to_columnar(args_t *args)
+{
+    open_vcf(args,NULL);
+
+    cols_t cols;
+    memset(&cols, 0, sizeof(cols));
+    cols_init(&cols, args);
+
+    int nok = 0, filtered = 0;
+    while ( bcf_sr_next_line(args->files) )
+    {
+        bcf1_t *line = bcf_sr_get_line(args->files,0);
+        if ( args->filter )
+        {
+            int pass = filter_test(args->filter, line, NULL);
+            if ( args->filter_logic & FLT_EXCLUDE ) pass = pass ? 0 : 1;
+            if ( !pass ) { filtered++; continue; }
+        }
+        cols_add_line(&cols, args->header, line);
+        nok++;
+        if ( cols.nrows >= COLS_MAX_ROWS || cols_nbytes(&cols) >= COLS_MAX_BYTES ) cols_flush(&cols);
+    }
+    cols_destroy(&cols);
+    fprintf(stderr, "%d records written, %d filtered\n", nok, filtered);
 }
 
 static void usage(void)
@@ -1382,7 +2011,7 @@ static void usage(void)
     fprintf(stderr, "       --no-version               do not append version and command line to the header\n");
     fprintf(stderr, "   -o, --output <file>            output file name [stdout]\n");
     fprintf(stderr, "   -O, --output-type <b|u|z|v>    b: compressed BCF, u: uncompressed BCF, z: compressed VCF, v: uncompressed VCF [v]\n");
-    fprintf(stderr, "       --threads <int>            number of extra output compression threads [0]\n");
+    fprintf(stderr, "       --threads <int>            number of extra compression and parsing threads [0]\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "GEN/SAMPLE conversion (input/output from IMPUTE2):\n");
     fprintf(stderr, "   -G, --gensample2vcf <...>   <prefix>|<gen-file>,<sample-file>\n");
@@ -1410,6 +2039,10 @@ static void usage(void)
     fprintf(stderr, "       --sex <file>                 output sex column in the sample-file, input format is: Sample\\t[MF]\n");
     fprintf(stderr, "       --vcf-ids                    output VCF IDs instead of CHROM:POS_REF_ALT\n");
     fprintf(stderr, "\n");
+    fprintf(stderr, "Columnar binary export:\n");
+    fprintf(stderr, "       --columnar <file>       write the selected columns in the binary columnar format, see man page for the layout\n");
+    fprintf(stderr, "   -c, --columns <list>        CHROM,POS,ID,REF,ALT,QUAL,FILTER,INFO/TAG,FORMAT/TAG [CHROM,POS,ID,REF,ALT,FORMAT/GT]\n");
+    fprintf(stderr, "\n");
     fprintf(stderr, "TSV conversion:\n");
     fprintf(stderr, "       --tsv2vcf <file>        \n");
     fprintf(stderr, "   -c, --columns <string>      columns of the input tsv file [ID,CHROM,POS,AA]\n");
@@ -1467,6 +2100,7 @@ int main_vcfconvert(int argc, char *argv[])
         {"columns",required_argument,NULL,'c'},
         {"fasta-ref",required_argument,NULL,'f'},
         {"no-version",no_argument,NULL,10},
+        {"columnar",required_argument,NULL,12},
         {NULL,0,NULL,0}
     };
     while ((c = getopt_long(argc, argv, "?h:r:R:s:S:t:T:i:e:g:G:o:O:c:f:H:",loptions,NULL)) >= 0) {
@@ -1506,6 +2140,7 @@ int main_vcfconvert(int argc, char *argv[])
             case  9 : args->n_threads = strtol(optarg, 0, 0); break;
             case 10 : args->record_cmd_line = 0; break;
             case 11 : args->sex_fname = optarg; break;
+            case 12 : args->convert_func = vcf_to_columnar; args->outfname = optarg; break;
             case '?': usage();
             default: error("Unknown argument: %s\n", optarg);
         }
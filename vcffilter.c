@@ -23,6 +23,7 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.  */
 
 #include <stdio.h>
+#include <inttypes.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <ctype.h>
@@ -36,6 +37,7 @@ THE SOFTWARE.  */
 #include <htslib/vcfutils.h>
 #include "bcftools.h"
 #include "filter.h"
+#include "profile.h"
 #include "rbuf.h"
 
 // Logic of the filters: include or exclude sites which match the filters?
@@ -71,7 +73,7 @@ typedef struct _args_t
     int output_type, n_threads;
 
     char **argv, *output_fname, *targets_list, *regions_list;
-    int argc, record_cmd_line;
+    int argc, record_cmd_line, filter_stats;
 }
 args_t;
 
@@ -405,6 +407,7 @@ static void usage(args_t *args)
     fprintf(stderr, "\n");
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "    -e, --exclude <expr>          exclude sites for which the expression is true (see man page for details)\n");
+    fprintf(stderr, "        --filter-stats            report the number of records decided without reading FORMAT fields\n");
     fprintf(stderr, "    -g, --SnpGap <int>            filter SNPs within <int> base pairs of an indel\n");
     fprintf(stderr, "    -G, --IndelGap <int>          filter clusters of indels separated by <int> or fewer base pairs allowing only one to pass\n");
     fprintf(stderr, "    -i, --include <expr>          include only sites for which the expression is true (see man page for details\n");
@@ -452,6 +455,7 @@ int main_vcffilter(int argc, char *argv[])
         {"SnpGap",required_argument,NULL,'g'},
         {"IndelGap",required_argument,NULL,'G'},
         {"no-version",no_argument,NULL,8},
+        {"filter-stats",no_argument,NULL,10},
         {NULL,0,NULL,0}
     };
     char *tmp;
@@ -493,6 +497,7 @@ int main_vcffilter(int argc, char *argv[])
                 break;
             case  9 : args->n_threads = strtol(optarg, 0, 0); break;
             case  8 : args->record_cmd_line = 0; break;
+            case 10 : args->filter_stats = 1; break;
             case 'h':
             case '?': usage(args);
             default: error("Unknown argument: %s\n", optarg);
@@ -535,9 +540,12 @@ int main_vcffilter(int argc, char *argv[])
 
     init_data(args);
     bcf_hdr_write(args->out_fh, args->hdr);
+    uint64_t prof_start = profile_start();
     while ( bcf_sr_next_line(args->files) )
     {
+        profile_stop(PROF_READ, prof_start);
         bcf1_t *line = bcf_sr_get_line(args->files, 0);
+        profile_in(line);
         int pass = 1;
         if ( args->filter )
         {
@@ -558,13 +566,20 @@ int main_vcffilter(int argc, char *argv[])
             }
             if ( args->set_gts ) set_genotypes(args, line, pass);
             if ( !args->rbuf_lines )
+            {
+                prof_start = profile_start();
                 bcf_write1(args->out_fh, args->hdr, line);
+                profile_stop(PROF_WRITE, prof_start);
+            }
             else
                 buffered_filters(args, line);
         }
+        profile_done(line, args->soft_filter || args->set_gts || pass);
+        prof_start = profile_start();
     }
     buffered_filters(args, NULL);
 
+    if ( args->filter_stats && args->filter ) print_filter_stats(&args->filter, 1);
     hts_close(args->out_fh);
     destroy_data(args);
     bcf_sr_destroy(args->files);
@@ -35,10 +35,20 @@ THE SOFTWARE.  */
 #include <htslib/vcf.h>
 #include <htslib/synced_bcf_reader.h>
 #include <htslib/vcfutils.h>
+#include <htslib/thread_pool.h>
+#include <htslib/bgzf.h>
+#include <htslib/khash_str2int.h>
 #include <inttypes.h>
 #include "bcftools.h"
 #include "hclust.h"
 
+typedef struct
+{
+    uint32_t rid, pos;
+    uint64_t voff;
+}
+db_site_t;
+
 typedef struct
 {
     bcf_srs_t *files;           // first reader is the query VCF - single sample normally or multi-sample for cross-check
@@ -48,10 +58,41 @@ typedef struct
     double *lks, *sites, min_inter_err, max_intra_err;
     int *cnts, *dps, hom_only, cross_check, all_sites;
     char *cwd, **argv, *gt_fname, *plot, *query_sample, *target_sample;
-    int argc, no_PLs, narr, nsmpl;
+    int argc, no_PLs, narr, nsmpl, n_threads;
+
+    // Cross-check genotypes of a batch of biallelic sites packed into bit-planes: for each
+    // sample and 64-site word the valid, low and high bit of the genotype class
+    uint64_t *gt_bits;
+    int8_t *gt_codes;
+    int ngt_sites, ntiles;
+    struct _gt_tile_t *tiles;
+    hts_tpool_process *tpool_q;
+
+    // Fingerprint database of the -g panel created by --build-db and used instead of -g with --db
+    char *db_fname, *build_db;
+    BGZF *db_fp;
+    char **db_samples, **db_ctgs, **db_als;
+    void *db_ctg2id;
+    db_site_t *db_sites;
+    int *db_ctg_beg, *db_ctg_end;   // range of db_sites on each sequence
+    int db_nsmpl, db_nctg, db_nsites, db_nals, db_mals, db_nbits;
+    uint8_t *db_gts;
+    int db_mgts;
 }
 args_t;
 
+#define GT_BATCH_WORDS 16   // sites packed per batch in units of 64
+#define GT_TILE 64          // samples per cache tile
+
+// Rows [ibeg,iend) of the pairwise ntot/ndif matrix, updated by one job
+typedef struct _gt_tile_t
+{
+    args_t *args;
+    int ibeg, iend;
+    uint32_t *ntot, *ndif;
+}
+gt_tile_t;
+
 FILE *open_file(char **fname, const char *mode, const char *fmt, ...);
 char *msprintf(const char *fmt, ...);
 void mkdir_p(const char *fmt, ...);
@@ -219,16 +260,29 @@ static void plot_cross_check(args_t *args)
 }
 #endif
 
+static void init_db(args_t *args);
+static void destroy_db(args_t *args);
+
 static void init_data(args_t *args)
 {
     args->sm_hdr = args->files->readers[0].header;
     if ( !bcf_hdr_nsamples(args->sm_hdr) ) error("No samples in %s?\n", args->files->readers[0].fname);
 
+    if ( args->build_db ) return;
     if ( !args->cross_check )
     {
-        args->gt_hdr = args->files->readers[1].header;
-        int nsamples = bcf_hdr_nsamples(args->gt_hdr);
-        if ( !nsamples ) error("No samples in %s?\n", args->files->readers[1].fname);
+        int nsamples;
+        if ( args->db_fname )
+        {
+            init_db(args);
+            nsamples = args->db_nsmpl;
+        }
+        else
+        {
+            args->gt_hdr = args->files->readers[1].header;
+            nsamples = bcf_hdr_nsamples(args->gt_hdr);
+            if ( !nsamples ) error("No samples in %s?\n", args->files->readers[1].fname);
+        }
         args->lks   = (double*) calloc(nsamples,sizeof(double));
         args->cnts  = (int*) calloc(nsamples,sizeof(int));
         args->sites = (double*) calloc(nsamples,sizeof(double));
@@ -239,6 +293,7 @@ static void init_data(args_t *args)
 static void destroy_data(args_t *args)
 {
     free(args->lks); free(args->cnts); free(args->dps); free(args->cwd); free(args->sites);
+    destroy_db(args);
 }
 
 static int allele_to_int(bcf1_t *line, char *allele)
@@ -250,18 +305,18 @@ static int allele_to_int(bcf1_t *line, char *allele)
     return i-1;
 }
 
-static int init_gt2ipl(args_t *args, bcf1_t *gt_line, bcf1_t *sm_line, int *gt2ipl, int n_gt2ipl)
+static int init_gt2ipl(args_t *args, char **gt_als, int gt_nals, bcf1_t *sm_line, int *gt2ipl, int n_gt2ipl)
 {
     int i, j;
     for (i=0; i<n_gt2ipl; i++) gt2ipl[i] = -1;
-    for (i=0; i<gt_line->n_allele; i++)
+    for (i=0; i<gt_nals; i++)
     {
         // find which of the sm_alleles (k) corresponds to the gt_allele (i)
-        int k = allele_to_int(sm_line, gt_line->d.allele[i]);
+        int k = allele_to_int(sm_line, gt_als[i]);
         if ( k<0 ) return 0;
         for (j=0; j<=i; j++)
         {
-            int l = allele_to_int(sm_line, gt_line->d.allele[j]);
+            int l = allele_to_int(sm_line, gt_als[j]);
             if ( l<0 ) return 0;
             gt2ipl[ bcf_ij2G(j,i) ] = k<=l ? bcf_ij2G(k,l) : bcf_ij2G(l,k);
         }
@@ -335,6 +390,80 @@ static int cmp_doubleptr(const void *_a, const void *_b)
     return 1;
 }
 
+static int query_pls(args_t *args, bcf1_t *sm_line, int fake_pls)
+{
+    if ( fake_pls ) return fake_PLs(args, args->sm_hdr, sm_line);
+
+    int npl = bcf_get_format_int32(args->sm_hdr, sm_line, "PL", &args->pl_arr, &args->npl_arr);
+    if ( npl > 0 ) return npl / bcf_hdr_nsamples(args->sm_hdr);
+
+    // PL values may not be present when ALT=. (mpileup/bcftools output), in that case
+    // switch automatically to GT at these sites
+    if ( sm_line->n_allele==1 ) return fake_PLs(args, args->sm_hdr, sm_line);
+    error("PL not present at %s:%d?\n", args->sm_hdr->id[BCF_DT_CTG][sm_line->rid].key, sm_line->pos+1);
+    return 0;
+}
+
+// Sum of the query sample's likelihoods for converting PLs to probs, 0 if no PLs are
+// present and -1 if the discordance is to be the number of mismatching GTs
+static double query_sum_pl(args_t *args, int *pl_ptr, int npl, int fake_pls, int *max_ipl)
+{
+    double sum_pl = 0;
+    int i;
+    for (i=0; i<npl; i++)
+    {
+        if ( pl_ptr[i]==bcf_int32_vector_end ) break;
+        if ( pl_ptr[i]==bcf_int32_missing ) continue;
+        sum_pl += pow(10, -0.1*pl_ptr[i]);
+    }
+    *max_ipl = i;
+    if ( sum_pl!=0 && fake_pls && args->no_PLs==1 ) sum_pl = -1;
+    return sum_pl;
+}
+
+static void print_check(args_t *args, FILE *fp, int query_isample, int nsamples, char **samples)
+{
+    // To be able to plot total discordance (=number of mismatching GTs with -G1) in the same
+    // plot as discordance per site, the latter must be scaled to the same range
+    int i;
+    double extreme_lk = 0, extreme_lk_per_site = 0;
+    for (i=0; i<nsamples; i++)
+    {
+        if ( args->lks[i] < extreme_lk ) extreme_lk = args->lks[i];
+        if ( args->sites[i] && args->lks[i]/args->sites[i] < extreme_lk_per_site ) extreme_lk_per_site = args->lks[i]/args->sites[i];
+    }
+
+    // Sorted output
+    double **p = (double**) malloc(sizeof(double*)*nsamples);
+    for (i=0; i<nsamples; i++) p[i] = &args->lks[i];
+    qsort(p, nsamples, sizeof(int*), cmp_doubleptr);
+
+    fprintf(fp, "# [1]CN\t[2]Discordance with %s (total)\t[3]Discordance (avg score per site)\t[4]Number of sites compared\t[5]Sample\t[6]Sample ID\n", args->sm_hdr->samples[query_isample]);
+    for (i=0; i<nsamples; i++)
+    {
+        int idx = p[i] - args->lks;
+        double per_site = 0;
+        if ( args->sites[idx] )
+        {
+            if ( args->sites[idx] && extreme_lk_per_site )
+            {
+                per_site = args->lks[idx]/args->sites[idx];
+                per_site *= extreme_lk / extreme_lk_per_site;
+            }
+            else
+                per_site = 0;
+        }
+        fprintf(fp, "CN\t%e\t%e\t%.0f\t%s\t%d\n", fabs(args->lks[idx]), fabs(per_site), args->sites[idx], samples[idx], i);
+    }
+    free(p);
+
+    if ( args->plot )
+    {
+        fclose(fp);
+        plot_check(args, args->target_sample ? args->target_sample : "", args->sm_hdr->samples[query_isample]);
+    }
+}
+
 static void check_gt(args_t *args)
 {
     int i,ret, *gt2ipl = NULL, m_gt2ipl = 0, *gt_arr = NULL, ngt_arr = 0;
@@ -394,7 +523,7 @@ static void check_gt(args_t *args)
             m_gt2ipl = n_gt2ipl;
             gt2ipl   = (int*) realloc(gt2ipl, sizeof(int)*m_gt2ipl);
         }
-        if ( !init_gt2ipl(args, gt_line, sm_line, gt2ipl, n_gt2ipl) ) continue;
+        if ( !init_gt2ipl(args, gt_line->d.allele, gt_line->n_allele, sm_line, gt2ipl, n_gt2ipl) ) continue;
 
         // Target genotypes
         int ngt, npl;
@@ -404,38 +533,14 @@ static void check_gt(args_t *args)
         if ( ngt!=2 ) continue; // checking only diploid genotypes
 
         // Sample PLs
-        if ( !fake_pls )
-        {
-            if ( (npl=bcf_get_format_int32(args->sm_hdr, sm_line, "PL", &args->pl_arr, &args->npl_arr)) <= 0 )
-            {
-                if ( sm_line->n_allele==1 )
-                {
-                    // PL values may not be present when ALT=. (mpileup/bcftools output), in that case 
-                    // switch automatically to GT at these sites
-                    npl = fake_PLs(args, args->sm_hdr, sm_line);
-                }
-                else
-                    error("PL not present at %s:%d?\n", args->sm_hdr->id[BCF_DT_CTG][sm_line->rid].key, sm_line->pos+1);
-            }
-            else
-                npl /= bcf_hdr_nsamples(args->sm_hdr);
-        }
-        else
-            npl = fake_PLs(args, args->sm_hdr, sm_line);
+        npl = query_pls(args, sm_line, fake_pls);
 
         // Calculate likelihoods for all samples, assuming diploid genotypes
 
         // For faster access to genotype likelihoods (PLs) of the query sample
         int max_ipl, *pl_ptr = args->pl_arr + query_isample*npl;
-        double sum_pl = 0; // for converting PLs to probs
-        for (max_ipl=0; max_ipl<npl; max_ipl++)
-        {
-            if ( pl_ptr[max_ipl]==bcf_int32_vector_end ) break;
-            if ( pl_ptr[max_ipl]==bcf_int32_missing ) continue;
-            sum_pl += pow(10, -0.1*pl_ptr[max_ipl]);
-        }
+        double sum_pl = query_sum_pl(args, pl_ptr, npl, fake_pls, &max_ipl);
         if ( sum_pl==0 ) continue; // no PLs present
-        if ( fake_pls && args->no_PLs==1 ) sum_pl = -1;
 
         // The main stats: concordance of the query sample with the target -g samples
         for (i=0; i<bcf_hdr_nsamples(args->gt_hdr); i++)
@@ -480,44 +585,323 @@ static void check_gt(args_t *args)
     free(args->pl_arr);
     free(args->tmp_arr);
 
-    // To be able to plot total discordance (=number of mismatching GTs with -G1) in the same
-    // plot as discordance per site, the latter must be scaled to the same range
-    int nsamples = bcf_hdr_nsamples(args->gt_hdr);
-    double extreme_lk = 0, extreme_lk_per_site = 0;
-    for (i=0; i<nsamples; i++)
+    print_check(args, fp, query_isample, bcf_hdr_nsamples(args->gt_hdr), args->gt_hdr->samples);
+}
+
+/*
+    The fingerprint database stores diploid genotypes of the -g panel so that
+    query samples can be checked without reading the panel VCF. The data file
+    starts with the list of samples and continues with one record per site:
+
+        rid, pos, nals, alleles, nbits, genotypes
+
+    where the genotype index of each sample is packed to two bits at biallelic
+    sites and to a byte otherwise, with the largest value reserved for missing
+    and haploid genotypes. The FILE.idx index lists the sequence names and the
+    position and virtual offset of each site. All integers are uint32 unless
+    stated otherwise, strings are stored as uint32 length and the characters.
+*/
+#define GT_DB_MAGIC     "BCGD"
+#define GT_DB_IDX_MAGIC "BCGI"
+#define GT_DB_VERSION   1
+#define GT_DB_MAX_ALS   21      // so that the genotype index fits in a byte
+
+static inline void db_write(BGZF *fp, const char *fname, const void *dat, size_t len)
+{
+    if ( bgzf_write(fp, dat, len)!=len ) error("Failed to write %s\n", fname);
+}
+static inline void db_write_u32(BGZF *fp, const char *fname, uint32_t val)
+{
+    db_write(fp, fname, &val, sizeof(val));
+}
+static inline void db_write_str(BGZF *fp, const char *fname, const char *str)
+{
+    uint32_t len = strlen(str);
+    db_write_u32(fp, fname, len);
+    if ( len ) db_write(fp, fname, str, len);
+}
+static inline void db_read(BGZF *fp, const char *fname, void *dat, size_t len)
+{
+    if ( bgzf_read(fp, dat, len)!=len ) error("Failed to read %s, truncated database?\n", fname);
+}
+static inline uint32_t db_read_u32(BGZF *fp, const char *fname)
+{
+    uint32_t val;
+    db_read(fp, fname, &val, sizeof(val));
+    return val;
+}
+static inline char *db_read_str(BGZF *fp, const char *fname)
+{
+    uint32_t len = db_read_u32(fp, fname);
+    char *str = (char*) malloc(len+1);
+    if ( len ) db_read(fp, fname, str, len);
+    str[len] = 0;
+    return str;
+}
+
+static void build_db(args_t *args)
+{
+    bcf_hdr_t *hdr = args->sm_hdr;
+    if ( bcf_hdr_id2int(hdr, BCF_DT_ID, "GT")<0 ) error("[E::%s] GT not present in the header of %s?\n", __func__, args->files->readers[0].fname);
+
+    BGZF *fp = bgzf_open(args->build_db, "w");
+    if ( !fp ) error("Failed to open %s: %s\n", args->build_db, strerror(errno));
+    int i, nsmpl = bcf_hdr_nsamples(hdr);
+    db_write(fp, args->build_db, GT_DB_MAGIC, 4);
+    db_write_u32(fp, args->build_db, GT_DB_VERSION);
+    db_write_u32(fp, args->build_db, nsmpl);
+    for (i=0; i<nsmpl; i++) db_write_str(fp, args->build_db, hdr->samples[i]);
+
+    int nsites = 0, msites = 0, ngt_arr = 0, prev_rid = -1, prev_pos = -1;
+    int32_t *gt_arr = NULL;
+    db_site_t *sites = NULL;
+    uint8_t *gts = (uint8_t*) malloc(nsmpl);
+    uint8_t *seen_ctg = (uint8_t*) calloc(hdr->n[BCF_DT_CTG], 1);
+    while ( bcf_sr_next_line(args->files) )
     {
-        if ( args->lks[i] < extreme_lk ) extreme_lk = args->lks[i];
-        if ( args->sites[i] && args->lks[i]/args->sites[i] < extreme_lk_per_site ) extreme_lk_per_site = args->lks[i]/args->sites[i];
+        bcf1_t *line = bcf_sr_get_line(args->files,0);
+        if ( line->rid!=prev_rid )
+        {
+            if ( seen_ctg[line->rid] ) error("The file is not sorted: %s:%d\n", bcf_seqname(hdr,line),line->pos+1);
+            seen_ctg[line->rid] = 1;
+        }
+        else if ( line->pos < prev_pos ) error("The file is not sorted: %s:%d\n", bcf_seqname(hdr,line),line->pos+1);
+        prev_rid = line->rid;
+        prev_pos = line->pos;
+        if ( line->n_allele > GT_DB_MAX_ALS ) continue;
+
+        int ngt = bcf_get_genotypes(hdr, line, &gt_arr, &ngt_arr);
+        if ( ngt<=0 ) error("GT not present at %s:%d?\n", bcf_seqname(hdr,line), line->pos+1);
+        ngt /= nsmpl;
+        if ( ngt!=2 ) continue; // checking only diploid genotypes
+
+        int nbits = line->n_allele<=2 ? 2 : 8, missing = (1<<nbits) - 1;
+        int nbytes = nbits==2 ? (nsmpl+3)/4 : nsmpl;
+        memset(gts, 0, nbytes);
+        for (i=0; i<nsmpl; i++)
+        {
+            int32_t *gt_ptr = gt_arr + i*2;
+            int igt = missing;
+            if ( gt_ptr[1]!=bcf_int32_vector_end && !bcf_gt_is_missing(gt_ptr[0]) && !bcf_gt_is_missing(gt_ptr[1]) )
+                igt = bcf_alleles2gt(bcf_gt_allele(gt_ptr[0]),bcf_gt_allele(gt_ptr[1]));
+            if ( nbits==2 ) gts[i>>2] |= igt << ((i&3)*2);
+            else gts[i] = igt;
+        }
+
+        bcf_unpack(line, BCF_UN_STR);
+        hts_expand(db_site_t, nsites+1, msites, sites);
+        sites[nsites].rid  = line->rid;
+        sites[nsites].pos  = line->pos;
+        sites[nsites].voff = bgzf_tell(fp);
+        nsites++;
+        db_write_u32(fp, args->build_db, line->rid);
+        db_write_u32(fp, args->build_db, line->pos);
+        db_write_u32(fp, args->build_db, line->n_allele);
+        for (i=0; i<line->n_allele; i++) db_write_str(fp, args->build_db, line->d.allele[i]);
+        db_write_u32(fp, args->build_db, nbits);
+        db_write(fp, args->build_db, gts, nbytes);
     }
+    if ( bgzf_close(fp)!=0 ) error("Close failed: %s\n", args->build_db);
 
-    // Sorted output
-    double **p = (double**) malloc(sizeof(double*)*nsamples);
-    for (i=0; i<nsamples; i++) p[i] = &args->lks[i];
-    qsort(p, nsamples, sizeof(int*), cmp_doubleptr);
+    kstring_t str = {0,0,0};
+    ksprintf(&str, "%s.idx", args->build_db);
+    fp = bgzf_open(str.s, "w");
+    if ( !fp ) error("Failed to open %s: %s\n", str.s, strerror(errno));
+    db_write(fp, str.s, GT_DB_IDX_MAGIC, 4);
+    db_write_u32(fp, str.s, GT_DB_VERSION);
+    db_write_u32(fp, str.s, hdr->n[BCF_DT_CTG]);
+    for (i=0; i<hdr->n[BCF_DT_CTG]; i++) db_write_str(fp, str.s, hdr->id[BCF_DT_CTG][i].key);
+    db_write_u32(fp, str.s, nsites);
+    db_write(fp, str.s, sites, sizeof(db_site_t)*nsites);
+    if ( bgzf_close(fp)!=0 ) error("Close failed: %s\n", str.s);
+    fprintf(stderr,"Stored %d sites and %d samples in %s\n", nsites, nsmpl, args->build_db);
 
-    fprintf(fp, "# [1]CN\t[2]Discordance with %s (total)\t[3]Discordance (avg score per site)\t[4]Number of sites compared\t[5]Sample\t[6]Sample ID\n", args->sm_hdr->samples[query_isample]);
-    for (i=0; i<nsamples; i++)
+    free(str.s);
+    free(sites);
+    free(gts);
+    free(gt_arr);
+    free(seen_ctg);
+}
+
+static void init_db(args_t *args)
+{
+    args->db_fp = bgzf_open(args->db_fname, "r");
+    if ( !args->db_fp ) error("Failed to open %s: %s\n", args->db_fname, strerror(errno));
+    char magic[4];
+    db_read(args->db_fp, args->db_fname, magic, 4);
+    if ( memcmp(magic, GT_DB_MAGIC, 4) ) error("Not a bcftools gtcheck database: %s\n", args->db_fname);
+    if ( db_read_u32(args->db_fp, args->db_fname)!=GT_DB_VERSION ) error("Unsupported version of the database: %s\n", args->db_fname);
+    int i;
+    args->db_nsmpl = db_read_u32(args->db_fp, args->db_fname);
+    if ( !args->db_nsmpl ) error("No samples in %s?\n", args->db_fname);
+    args->db_samples = (char**) malloc(sizeof(char*)*args->db_nsmpl);
+    for (i=0; i<args->db_nsmpl; i++) args->db_samples[i] = db_read_str(args->db_fp, args->db_fname);
+    args->db_gts = (uint8_t*) malloc(args->db_nsmpl);
+
+    kstring_t str = {0,0,0};
+    ksprintf(&str, "%s.idx", args->db_fname);
+    BGZF *fp = bgzf_open(str.s, "r");
+    if ( !fp ) error("Failed to open %s: %s\n", str.s, strerror(errno));
+    db_read(fp, str.s, magic, 4);
+    if ( memcmp(magic, GT_DB_IDX_MAGIC, 4) ) error("Not a bcftools gtcheck database index: %s\n", str.s);
+    if ( db_read_u32(fp, str.s)!=GT_DB_VERSION ) error("Unsupported version of the database index: %s\n", str.s);
+    args->db_nctg    = db_read_u32(fp, str.s);
+    args->db_ctgs    = (char**) malloc(sizeof(char*)*args->db_nctg);
+    args->db_ctg2id  = khash_str2int_init();
+    args->db_ctg_beg = (int*) malloc(sizeof(int)*args->db_nctg);
+    args->db_ctg_end = (int*) calloc(args->db_nctg, sizeof(int));
+    for (i=0; i<args->db_nctg; i++)
     {
-        int idx = p[i] - args->lks;
-        double per_site = 0;
-        if ( args->sites[idx] )
+        args->db_ctgs[i] = db_read_str(fp, str.s);
+        khash_str2int_set(args->db_ctg2id, args->db_ctgs[i], i);
+    }
+    args->db_nsites = db_read_u32(fp, str.s);
+    args->db_sites  = (db_site_t*) malloc(sizeof(db_site_t)*args->db_nsites);
+    db_read(fp, str.s, args->db_sites, sizeof(db_site_t)*args->db_nsites);
+    if ( bgzf_close(fp)!=0 ) error("Close failed: %s\n", str.s);
+    free(str.s);
+
+    // sites are sorted, each sequence is a single contiguous range
+    for (i=args->db_nsites-1; i>=0; i--)
+    {
+        if ( args->db_sites[i].rid >= args->db_nctg ) error("Corrupted database index: %s.idx\n", args->db_fname);
+        args->db_ctg_beg[args->db_sites[i].rid] = i;
+        if ( !args->db_ctg_end[args->db_sites[i].rid] ) args->db_ctg_end[args->db_sites[i].rid] = i+1;
+    }
+}
+
+static void destroy_db(args_t *args)
+{
+    int i;
+    if ( args->db_fp && bgzf_close(args->db_fp)!=0 ) error("Close failed: %s\n", args->db_fname);
+    for (i=0; i<args->db_nsmpl; i++) free(args->db_samples[i]);
+    for (i=0; i<args->db_nctg; i++) free(args->db_ctgs[i]);
+    for (i=0; i<args->db_nals; i++) free(args->db_als[i]);
+    free(args->db_samples);
+    free(args->db_ctgs);
+    free(args->db_als);
+    free(args->db_ctg_beg);
+    free(args->db_ctg_end);
+    free(args->db_sites);
+    free(args->db_gts);
+    if ( args->db_ctg2id ) khash_str2int_destroy(args->db_ctg2id);
+}
+
+// Read the alleles and genotypes of the i-th site
+static void db_read_site(args_t *args, int isite)
+{
+    BGZF *fp = args->db_fp;
+    if ( bgzf_seek(fp, args->db_sites[isite].voff, SEEK_SET)<0 ) error("Failed to seek in %s\n", args->db_fname);
+    int i;
+    db_read_u32(fp, args->db_fname);   // rid and pos, known from the index
+    db_read_u32(fp, args->db_fname);
+    for (i=0; i<args->db_nals; i++) free(args->db_als[i]);
+    args->db_nals = db_read_u32(fp, args->db_fname);
+    if ( args->db_nals > GT_DB_MAX_ALS ) error("Corrupted database: %s\n", args->db_fname);
+    hts_expand(char*, args->db_nals, args->db_mals, args->db_als);
+    for (i=0; i<args->db_nals; i++) args->db_als[i] = db_read_str(fp, args->db_fname);
+    args->db_nbits = db_read_u32(fp, args->db_fname);
+    db_read(fp, args->db_fname, args->db_gts, args->db_nbits==2 ? (args->db_nsmpl+3)/4 : args->db_nsmpl);
+}
+
+// Find the database site matching the query record and set gt2ipl, returns 0 if there is none
+static int db_find_site(args_t *args, bcf1_t *sm_line, int *gt2ipl)
+{
+    int ictg;
+    if ( khash_str2int_get(args->db_ctg2id, bcf_seqname(args->sm_hdr,sm_line), &ictg)!=0 ) return 0;
+
+    // the first site at the position
+    int beg = args->db_ctg_beg[ictg], end = args->db_ctg_end[ictg];
+    while ( beg < end )
+    {
+        int mid = (beg + end) / 2;
+        if ( args->db_sites[mid].pos < sm_line->pos ) beg = mid + 1;
+        else end = mid;
+    }
+    for (; beg < args->db_ctg_end[ictg] && args->db_sites[beg].pos==sm_line->pos; beg++)
+    {
+        db_read_site(args, beg);
+        if ( init_gt2ipl(args, args->db_als, args->db_nals, sm_line, gt2ipl, args->db_nals*(args->db_nals+1)/2) ) return 1;
+    }
+    return 0;
+}
+
+static void check_gt_db(args_t *args)
+{
+    int i, j, fake_pls = args->no_PLs;
+    if ( bcf_hdr_id2int(args->sm_hdr, BCF_DT_ID, "PL")<0 )
+    {
+        if ( bcf_hdr_id2int(args->sm_hdr, BCF_DT_ID, "GT")<0 )
+            error("[E::%s] Neither PL nor GT present in the header of %s\n", __func__, args->files->readers[0].fname);
+        if ( !args->no_PLs )
+            fprintf(stderr,"Warning: PL not present in the header of %s, using GT instead\n", args->files->readers[0].fname);
+        fake_pls = 1;
+    }
+
+    FILE *fp = args->plot ? open_file(NULL, "w", "%s.tab", args->plot) : stdout;
+    print_header(args, fp);
+
+    int query_isample = 0;
+    if ( args->query_sample )
+    {
+        query_isample = bcf_hdr_id2int(args->sm_hdr, BCF_DT_SAMPLE, args->query_sample);
+        if ( query_isample<0 ) error("No such sample in %s: [%s]\n", args->files->readers[0].fname, args->query_sample);
+    }
+
+    // Genotypes which are homozygous, for -H
+    int is_hom[256];
+    for (i=0; i<GT_DB_MAX_ALS; i++)
+        for (j=0; j<=i; j++) is_hom[bcf_alleles2gt(j,i)] = i==j;
+
+    int gt2ipl[256];
+    double lk[256], nsite[256];
+    while ( bcf_sr_next_line(args->files) )
+    {
+        bcf1_t *sm_line = bcf_sr_get_line(args->files,0);
+        bcf_unpack(sm_line, BCF_UN_STR);
+        if ( !db_find_site(args, sm_line, gt2ipl) ) continue;
+
+        int npl = query_pls(args, sm_line, fake_pls);
+        int max_ipl, *pl_ptr = args->pl_arr + query_isample*npl;
+        double sum_pl = query_sum_pl(args, pl_ptr, npl, fake_pls, &max_ipl);
+        if ( sum_pl==0 ) continue; // no PLs present
+
+        // The contribution of each target genotype is the same for all samples, tabulate
+        // it once and score the whole panel by lookup. The missing value has no contribution.
+        int igt, ngt = 1 << args->db_nbits;
+        for (igt=0; igt<ngt; igt++)
         {
-            if ( args->sites[idx] && extreme_lk_per_site )
+            lk[igt] = nsite[igt] = 0;
+            if ( igt >= args->db_nals*(args->db_nals+1)/2 ) continue;
+            if ( args->hom_only && !is_hom[igt] ) continue;
+            int igt_qry = gt2ipl[igt];
+            if ( igt_qry>=max_ipl || pl_ptr[igt_qry]<0 ) continue;
+            lk[igt] = sum_pl<0 ? -pl_ptr[igt_qry] : log(pow(10, -0.1*pl_ptr[igt_qry])/sum_pl);
+            nsite[igt] = 1;
+        }
+        uint8_t *gts = args->db_gts;
+        if ( args->db_nbits==2 )
+        {
+            for (i=0; i<args->db_nsmpl; i++)
             {
-                per_site = args->lks[idx]/args->sites[idx];
-                per_site *= extreme_lk / extreme_lk_per_site;
+                igt = (gts[i>>2] >> ((i&3)*2)) & 3;
+                args->lks[i]   += lk[igt];
+                args->sites[i] += nsite[igt];
+            }
+        }
+        else
+        {
+            for (i=0; i<args->db_nsmpl; i++)
+            {
+                args->lks[i]   += lk[gts[i]];
+                args->sites[i] += nsite[gts[i]];
             }
-            else
-                per_site = 0;
         }
-        fprintf(fp, "CN\t%e\t%e\t%.0f\t%s\t%d\n", fabs(args->lks[idx]), fabs(per_site), args->sites[idx], args->gt_hdr->samples[idx], i);
     }
+    free(args->pl_arr);
+    free(args->tmp_arr);
 
-    if ( args->plot )
-    {
-        fclose(fp);
-        plot_check(args, args->target_sample ? args->target_sample : "", args->sm_hdr->samples[query_isample]);
-    }
+    print_check(args, fp, query_isample, args->db_nsmpl, args->db_samples);
 }
 
 // static inline int is_hom_most_likely(int nals, int *pls)
@@ -604,6 +988,154 @@ int process_PL(args_t *args, bcf1_t *line, uint32_t *ntot, uint32_t *ndif)
     return 0;
 }
 
+// Genotype classes of a biallelic site as in process_GT(), -1 for missing.
+// Returns 0 on success, 1 or 2 as process_GT(), 3 if the site is multiallelic
+static int pack_GT(args_t *args, bcf1_t *line)
+{
+    int ngt = bcf_get_genotypes(args->sm_hdr, line, &args->tmp_arr, &args->ntmp_arr);
+
+    if ( ngt<=0 ) return 1;                 // GT not present
+    if ( ngt!=args->nsmpl*2 ) return 2;     // not diploid
+    if ( line->n_allele>2 ) return 3;
+
+    int i;
+    for (i=0; i<args->nsmpl; i++)
+    {
+        int32_t *a = args->tmp_arr + i*2;
+        if ( bcf_gt_is_missing(a[0]) || bcf_gt_is_missing(a[1]) || a[1]==bcf_int32_vector_end ) { args->gt_codes[i] = -1; continue; }
+        int ia = bcf_gt_allele(a[0]), ib = bcf_gt_allele(a[1]);
+        if ( ia>1 || ib>1 ) return 3;
+        args->gt_codes[i] = (1<<ia | 1<<ib) - 1;
+    }
+    return 0;
+}
+// Most likely genotypes as in process_PL(), -1 for missing. Returns 0 on
+// success, 1 if PL is not present and 3 if the site is multiallelic
+static int pack_PL(args_t *args, bcf1_t *line)
+{
+    int npl = bcf_get_format_int32(args->sm_hdr, line, "PL", &args->tmp_arr, &args->ntmp_arr);
+
+    if ( npl<=0 ) return 1;                 // PL not present
+    npl /= args->nsmpl;
+    if ( npl>3 ) return 3;
+
+    int i,k;
+    for (i=0; i<args->nsmpl; i++)
+    {
+        int32_t *a = args->tmp_arr + i*npl;
+        int imin = -1;
+        for (k=0; k<npl; k++)
+        {
+            if ( a[k]==bcf_int32_vector_end ) break;
+            if ( a[k]==bcf_int32_missing ) continue;
+            if ( imin==-1 || a[imin] > a[k] ) imin = k;
+        }
+        args->gt_codes[i] = imin;
+    }
+    return 0;
+}
+static void add_packed_site(args_t *args)
+{
+    int i, iw = args->ngt_sites >> 6;
+    uint64_t bit = 1ULL << (args->ngt_sites & 63);
+    for (i=0; i<args->nsmpl; i++)
+    {
+        int code = args->gt_codes[i];
+        if ( code<0 ) continue;
+        uint64_t *bits = args->gt_bits + ((size_t)i*GT_BATCH_WORDS + iw)*3;
+        bits[0] |= bit;
+        if ( code&1 ) bits[1] |= bit;
+        if ( code&2 ) bits[2] |= bit;
+    }
+    args->ngt_sites++;
+}
+static void *cross_check_tile(void *arg)
+{
+    gt_tile_t *tile = (gt_tile_t*) arg;
+    args_t *args = tile->args;
+    int i, j, jbeg, w, nw = (args->ngt_sites + 63) >> 6;
+
+    // the pairs are processed in GT_TILE x GT_TILE blocks so that both sets of packed
+    // genotypes stay in the cache
+    for (jbeg=0; jbeg<tile->iend; jbeg+=GT_TILE)
+    {
+        for (i=tile->ibeg; i<tile->iend; i++)
+        {
+            uint64_t *a = args->gt_bits + (size_t)i*GT_BATCH_WORDS*3;
+            uint32_t *ntot = tile->ntot + (size_t)i*(i-1)/2;
+            uint32_t *ndif = tile->ndif + (size_t)i*(i-1)/2;
+            int jend = jbeg + GT_TILE < i ? jbeg + GT_TILE : i;
+            for (j=jbeg; j<jend; j++)
+            {
+                uint64_t *b = args->gt_bits + (size_t)j*GT_BATCH_WORDS*3;
+                uint32_t tot = 0, dif = 0;
+                for (w=0; w<nw; w++)
+                {
+                    uint64_t both = a[3*w] & b[3*w];
+                    uint64_t diff = ((a[3*w+1] ^ b[3*w+1]) | (a[3*w+2] ^ b[3*w+2])) & both;
+                    tot += __builtin_popcountll(both);
+                    dif += __builtin_popcountll(diff);
+                }
+                ntot[j] += tot;
+                ndif[j] += dif;
+            }
+        }
+    }
+    return NULL;
+}
+static void flush_packed_sites(args_t *args)
+{
+    if ( !args->ngt_sites ) return;
+
+    int i;
+    if ( args->tpool_q )
+    {
+        for (i=0; i<args->ntiles; i++)
+            if ( hts_tpool_dispatch(args->files->p->pool, args->tpool_q, cross_check_tile, &args->tiles[i]) < 0 )
+                error("Failed to dispatch the cross-check to the thread pool\n");
+        for (i=0; i<args->ntiles; i++)
+        {
+            hts_tpool_result *res = hts_tpool_next_result_wait(args->tpool_q);
+            if ( !res ) error("Failed to retrieve the cross-check result\n");
+            hts_tpool_delete_result(res, 0);
+        }
+    }
+    else
+        for (i=0; i<args->ntiles; i++) cross_check_tile(&args->tiles[i]);
+
+    memset(args->gt_bits, 0, sizeof(*args->gt_bits)*args->nsmpl*GT_BATCH_WORDS*3);
+    args->ngt_sites = 0;
+}
+static void init_packed_sites(args_t *args, uint32_t *ntot, uint32_t *ndif)
+{
+    args->gt_bits  = (uint64_t*) calloc((size_t)args->nsmpl*GT_BATCH_WORDS*3, sizeof(*args->gt_bits));
+    args->gt_codes = (int8_t*) malloc(args->nsmpl);
+    args->ntiles   = (args->nsmpl + GT_TILE - 1) / GT_TILE;
+    args->tiles    = (gt_tile_t*) calloc(args->ntiles, sizeof(gt_tile_t));
+    int i;
+    for (i=0; i<args->ntiles; i++)
+    {
+        gt_tile_t *tile = &args->tiles[i];
+        tile->args = args;
+        tile->ibeg = i*GT_TILE;
+        tile->iend = tile->ibeg + GT_TILE < args->nsmpl ? tile->ibeg + GT_TILE : args->nsmpl;
+        tile->ntot = ntot;
+        tile->ndif = ndif;
+    }
+    if ( args->n_threads > 0 )
+    {
+        args->tpool_q = hts_tpool_process_init(args->files->p->pool, args->ntiles, 0);
+        if ( !args->tpool_q ) error("Failed to initialize the thread pool queue\n");
+    }
+}
+static void destroy_packed_sites(args_t *args)
+{
+    if ( args->tpool_q ) hts_tpool_process_destroy(args->tpool_q);
+    free(args->gt_bits);
+    free(args->gt_codes);
+    free(args->tiles);
+}
+
 static void cross_check_gts(args_t *args)
 {
     // Initialize things: check which tags are defined in the header, sample names etc.
@@ -622,18 +1154,31 @@ static void cross_check_gts(args_t *args)
 
     uint32_t *ndif = (uint32_t*) calloc(args->narr,4);
     uint32_t *ntot = (uint32_t*) calloc(args->narr,4);
+    init_packed_sites(args, ntot, ndif);
 
+    // Biallelic sites are packed and compared in batches, multiallelic sites one by one
     while ( bcf_sr_next_line(args->files) )
     {
         bcf1_t *line = bcf_sr_get_line(args->files,0);
 
         // use PLs unless no_PLs is set and GT exists
+        int ret = -1;
         if ( args->no_PLs )
         {
-            if ( process_GT(args,line,ntot,ndif)==0 ) continue;
+            ret = pack_GT(args,line);
+            if ( ret==3 ) ret = process_GT(args,line,ntot,ndif);
+            else if ( ret==0 ) add_packed_site(args);
+        }
+        if ( ret!=0 )
+        {
+            ret = pack_PL(args,line);
+            if ( ret==3 ) process_PL(args,line,ntot,ndif);
+            else if ( ret==0 ) add_packed_site(args);
         }
-        process_PL(args,line,ntot,ndif);
+        if ( args->ngt_sites == GT_BATCH_WORDS*64 ) flush_packed_sites(args);
     }
+    flush_packed_sites(args);
+    destroy_packed_sites(args);
     
     FILE *fp = stdout;
     print_header(args, fp);
@@ -710,10 +1255,14 @@ static void usage(void)
     fprintf(stderr, "\n");
     fprintf(stderr, "About:   Check sample identity. With no -g BCF given, multi-sample cross-check is performed.\n");
     fprintf(stderr, "Usage:   bcftools gtcheck [options] [-g <genotypes.vcf.gz>] <query.vcf.gz>\n");
+    fprintf(stderr, "         bcftools gtcheck [options] --db <file> <query.vcf.gz>\n");
+    fprintf(stderr, "         bcftools gtcheck --build-db <file> <genotypes.vcf.gz>\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "    -a, --all-sites                 output comparison for all sites\n");
+    fprintf(stderr, "        --build-db <file>           save genotypes of the input file to a fingerprint database\n");
     fprintf(stderr, "    -c, --cluster <min,max>         min inter- and max intra-sample error [0.23,-0.3]\n");
+    fprintf(stderr, "        --db <file>                 fingerprint database to compare against, instead of -g\n");
     fprintf(stderr, "    -g, --genotypes <file>          genotypes to compare against\n");
     fprintf(stderr, "    -G, --GTs-only <int>            use GTs, ignore PLs, using <int> for unseen genotypes [99]\n");
     fprintf(stderr, "    -H, --homs-only                 homozygous genotypes only (useful for low coverage data)\n");
@@ -724,6 +1273,7 @@ static void usage(void)
     fprintf(stderr, "    -S, --target-sample <string>    target sample in the -g file (used only for plotting)\n");
     fprintf(stderr, "    -t, --targets <region>          similar to -r but streams rather than index-jumps\n");
     fprintf(stderr, "    -T, --targets-file <file>       similar to -R but streams rather than index-jumps\n");
+    fprintf(stderr, "        --threads <int>             number of extra decompression and cross-check threads [0]\n");
     fprintf(stderr, "\n");
     exit(1);
 }
@@ -759,6 +1309,9 @@ int main_vcfgtcheck(int argc, char *argv[])
         {"regions-file",1,0,'R'},
         {"targets",1,0,'t'},
         {"targets-file",1,0,'T'},
+        {"threads",1,0,9},
+        {"build-db",1,0,1},
+        {"db",1,0,2},
         {0,0,0,0}
     };
     char *tmp;
@@ -787,6 +1340,9 @@ int main_vcfgtcheck(int argc, char *argv[])
             case 'R': regions = optarg; regions_is_file = 1; break;
             case 't': targets = optarg; break;
             case 'T': targets = optarg; targets_is_file = 1; break;
+            case  9 : args->n_threads = strtol(optarg, 0, 0); break;
+            case  1 : args->build_db = optarg; break;
+            case  2 : args->db_fname = optarg; break;
             case 'h':
             case '?': usage();
             default: error("Unknown argument: %s\n", optarg);
@@ -800,17 +1356,25 @@ int main_vcfgtcheck(int argc, char *argv[])
     }
     else fname = argv[optind];
     if ( argc>optind+1 )  usage();  // too many files given
-    if ( !args->gt_fname ) args->cross_check = 1;   // no genotype file, run in cross-check mode
-    else args->files->require_index = 1;
+    if ( args->db_fname && args->gt_fname ) error("The options --db and -g cannot be combined\n");
+    if ( args->build_db && (args->db_fname || args->gt_fname) ) error("The option --build-db cannot be combined with --db or -g\n");
+    if ( args->db_fname && args->all_sites ) error("The option -a is not supported with --db\n");
+    if ( !args->gt_fname && !args->db_fname && !args->build_db ) args->cross_check = 1;   // no genotype file, run in cross-check mode
+    else if ( args->gt_fname ) args->files->require_index = 1;
     if ( regions && bcf_sr_set_regions(args->files, regions, regions_is_file)<0 ) error("Failed to read the regions: %s\n", regions);
     if ( targets && bcf_sr_set_targets(args->files, targets, targets_is_file, 0)<0 ) error("Failed to read the targets: %s\n", targets);
+    if ( bcf_sr_set_threads(args->files, args->n_threads)<0 ) error("Failed to create threads\n");
     if ( !bcf_sr_add_reader(args->files, fname) ) error("Failed to open %s: %s\n", fname,bcf_sr_strerror(args->files->errnum));
     if ( args->gt_fname && !bcf_sr_add_reader(args->files, args->gt_fname) ) error("Failed to open %s: %s\n", args->gt_fname,bcf_sr_strerror(args->files->errnum));
     args->files->collapse = COLLAPSE_SNPS|COLLAPSE_INDELS;
     if ( args->plot ) args->plot = init_prefix(args->plot);
     init_data(args);
-    if ( args->cross_check )
+    if ( args->build_db )
+        build_db(args);
+    else if ( args->cross_check )
         cross_check_gts(args);
+    else if ( args->db_fname )
+        check_gt_db(args);
     else
         check_gt(args);
     destroy_data(args);
@@ -24,15 +24,18 @@ DEALINGS IN THE SOFTWARE.  */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <htslib/vcf.h>
 #include <htslib/tbx.h>
+#include <htslib/bgzf.h>
 #include <sys/stat.h>
 #define __STDC_FORMAT_MACROS
 #include <inttypes.h>
 #include <htslib/kstring.h>
 #include "bcftools.h"
+#include "gtidx.h"
 
 #define BCF_LIDX_SHIFT    14
 
@@ -45,19 +48,150 @@ static void usage(void)
     fprintf(stderr, "Indexing options:\n");
     fprintf(stderr, "    -c, --csi                generate CSI-format index for VCF/BCF files [default]\n");
     fprintf(stderr, "    -f, --force              overwrite index if it already exists\n");
+    fprintf(stderr, "        --gt                 generate a genotype-only sidecar index (.gti), see the man page\n");
     fprintf(stderr, "    -m, --min-shift INT      set minimal interval size for CSI indices to 2^INT [14]\n");
     fprintf(stderr, "    -o, --output-file FILE   optional output index file name\n");
     fprintf(stderr, "    -t, --tbi                generate TBI-format index for VCF files\n");
-    fprintf(stderr, "        --threads            sets the number of threads [0]\n");
+    fprintf(stderr, "        --threads INT        number of extra threads to decompress the input with [0]\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Stats options:\n");
     fprintf(stderr, "    -n, --nrecords       print number of records based on existing index file\n");
     fprintf(stderr, "    -s, --stats          print per contig stats based on existing index file\n");
+    fprintf(stderr, "    -e, --extended       with -s, print also compressed bytes, first/last position and density\n");
+    fprintf(stderr, "        --shards INT     print up to INT regions with balanced compressed size, one per line, for -r and -t\n");
     fprintf(stderr, "\n");
     exit(1);
 }
 
-int vcf_index_stats(char *fname, int stats)
+typedef struct
+{
+    int tid;
+    uint64_t nrec, beg_off, end_off;    // records and the span of compressed offsets
+    int beg, end;                       // 0-based positions of the first and the last record
+}
+ctg_stats_t;
+
+static hts_itr_t *contig_query(tbx_t *tbx, hts_idx_t *idx, int tid, int beg, int end)
+{
+    return tbx ? tbx_itr_queryi(tbx, tid, beg, end) : bcf_itr_queryi(idx, tid, beg, end);
+}
+
+// Returns the next record and its 0-based end position or -1 when done
+static int contig_next(htsFile *fp, tbx_t *tbx, bcf_hdr_t *hdr, hts_itr_t *itr, bcf1_t *rec, kstring_t *str, int *end)
+{
+    if ( tbx )
+    {
+        if ( tbx_itr_next(fp, tbx, itr, str) < 0 ) return -1;
+        if ( vcf_parse1(str, hdr, rec) < 0 ) error("Could not parse the line: %s\n", str->s);
+    }
+    else if ( bcf_itr_next(fp, itr, rec) < 0 ) return -1;
+    *end = rec->pos + rec->rlen - 1;
+    return 0;
+}
+
+// Reads the first record overlapping the position pos or later on the contig,
+// the index is accessed only through the iterators. Returns the 0-based end of
+// the record and sets the compressed offset after it, or returns -1 if there is
+// no such record.
+static int contig_first(htsFile *fp, tbx_t *tbx, hts_idx_t *idx, bcf_hdr_t *hdr, int tid, int pos, bcf1_t *rec, kstring_t *str, uint64_t *off)
+{
+    int end = -1;
+    hts_itr_t *itr = contig_query(tbx, idx, tid, pos, INT_MAX);
+    if ( itr && contig_next(fp, tbx, hdr, itr, rec, str, &end)==0 )
+    {
+        if ( off ) *off = bgzf_tell(hts_get_bgzfp(fp)) >> 16;
+    }
+    else end = -1;
+    hts_itr_destroy(itr);
+    return end;
+}
+
+// The first position and the byte span come from the first record and the end
+// is found by bisection: a query at pos returns a record as long as pos is not
+// past the end of the last record. Only a few BGZF blocks are read per query.
+static void contig_stats(htsFile *fp, tbx_t *tbx, hts_idx_t *idx, bcf_hdr_t *hdr, ctg_stats_t *stats)
+{
+    uint64_t v;
+    hts_idx_get_stat(tbx ? tbx->idx : idx, stats->tid, &stats->nrec, &v);
+    stats->beg = stats->end = -1;
+    stats->beg_off = stats->end_off = 0;
+    if ( !stats->nrec ) return;
+
+    bcf1_t *rec = bcf_init1();
+    kstring_t str = {0,0,0};
+    if ( contig_first(fp, tbx, idx, hdr, stats->tid, 0, rec, &str, &stats->beg_off) < 0 ) goto done;
+    stats->beg = rec->pos;
+
+    int lo = stats->beg, hi = INT_MAX - 1;
+    while ( lo < hi )
+    {
+        int mid = lo + (hi - lo + 1)/2;
+        if ( contig_first(fp, tbx, idx, hdr, stats->tid, mid, rec, &str, NULL) >= 0 ) lo = mid;
+        else hi = mid - 1;
+    }
+    stats->end = lo;
+
+    // the records overlapping the last position, the offset after the last of them
+    int end;
+    hts_itr_t *itr = contig_query(tbx, idx, stats->tid, stats->end, INT_MAX);
+    while ( itr && contig_next(fp, tbx, hdr, itr, rec, &str, &end)==0 )
+        stats->end_off = bgzf_tell(hts_get_bgzfp(fp)) >> 16;
+    hts_itr_destroy(itr);
+
+done:
+    bcf_destroy(rec);
+    free(str.s);
+}
+
+// Split the contigs into nshards regions of about the same compressed size.
+// The cut positions are found by bisection on the offsets of the records. The
+// shards do not overlap, each record belongs to the shard with its start
+// position, which is what -t tests.
+static void print_shards(htsFile *fp, tbx_t *tbx, hts_idx_t *idx, bcf_hdr_t *hdr, const char **seq, ctg_stats_t *stats, int nseq, int nshards)
+{
+    int i, ishard = 1, nprinted = 0;
+    uint64_t total = 0, cum = 0;
+    for (i=0; i<nseq; i++) total += stats[i].end_off - stats[i].beg_off;
+
+    bcf1_t *rec = bcf_init1();
+    kstring_t str = {0,0,0}, tmp = {0,0,0};
+    for (i=0; i<nseq; i++)
+    {
+        ctg_stats_t *st = &stats[i];
+        if ( st->beg<0 ) continue;
+        int beg = st->beg;
+        uint64_t size = st->end_off - st->beg_off;
+        while ( ishard < nshards )
+        {
+            uint64_t target = total * ishard / nshards;
+            if ( target >= cum + size ) break;
+            int lo = beg, hi = st->end;
+            while ( lo < hi )
+            {
+                int mid = lo + (hi - lo)/2;
+                uint64_t off = UINT64_MAX;
+                if ( contig_first(fp, tbx, idx, hdr, st->tid, mid, rec, &tmp, &off) < 0 ) off = UINT64_MAX;
+                if ( off!=UINT64_MAX && off - st->beg_off + cum < target ) lo = mid + 1;
+                else hi = mid;
+            }
+            ishard++;
+            if ( lo <= beg ) continue;  // all of the target falls into one block
+            ksprintf(&str, "%s%s:%d-%d", str.l ? "," : "", seq[i], beg+1, lo);
+            printf("%s\n", str.s);
+            str.l = 0;
+            nprinted++;
+            beg = lo;
+        }
+        ksprintf(&str, "%s%s:%d-%d", str.l ? "," : "", seq[i], beg+1, st->end+1);
+        cum += size;
+    }
+    if ( str.l ) printf("%s\n", str.s);
+    free(str.s);
+    free(tmp.s);
+    bcf_destroy(rec);
+}
+
+int vcf_index_stats(char *fname, int stats, int nshards)
 {
     const char **seq;
     int i, nseq;
@@ -86,18 +220,44 @@ int vcf_index_stats(char *fname, int stats)
     }
 
     seq = tbx ? tbx_seqnames(tbx, &nseq) : bcf_index_seqnames(idx, hdr, &nseq);
+    if ( stats&4 || nshards )
+    {
+        ctg_stats_t *ctg = (ctg_stats_t*) calloc(nseq, sizeof(ctg_stats_t));
+        for (i=0; i<nseq; i++)
+        {
+            ctg[i].tid = tbx ? tbx_name2id(tbx, seq[i]) : bcf_hdr_name2id(hdr, seq[i]);
+            contig_stats(fp, tbx, idx, hdr, &ctg[i]);
+        }
+        if ( nshards ) print_shards(fp, tbx, idx, hdr, seq, ctg, nseq, nshards);
+        else
+        {
+            printf("# [1]contig\t[2]length\t[3]nRecords\t[4]compressed bytes\t[5]first position\t[6]last position\t[7]records per Mb\n");
+            for (i=0; i<nseq; i++)
+            {
+                if ( !ctg[i].nrec ) continue;
+                bcf_hrec_t *hrec = bcf_hdr_get_hrec(hdr, BCF_HL_CTG, "ID", seq[i], NULL);
+                int hkey = hrec ? bcf_hrec_find_key(hrec, "length") : -1;
+                double span = ctg[i].end - ctg[i].beg + 1;
+                printf("%s\t%s\t%" PRIu64 "\t%" PRIu64 "\t%d\t%d\t%.1f\n", seq[i], hkey<0?".":hrec->vals[hkey], ctg[i].nrec,
+                    ctg[i].end_off - ctg[i].beg_off, ctg[i].beg+1, ctg[i].end+1, ctg[i].beg<0 ? 0 : ctg[i].nrec*1e6/span);
+            }
+        }
+        free(ctg);
+        stats = 0;  // done, skip the basic stats
+    }
     uint64_t sum = 0;
-    for (i=0; i<nseq; i++)
+    for (i=0; stats && i<nseq; i++)
     {
         uint64_t records, v;
-        hts_idx_get_stat(tbx ? tbx->idx : idx, i, &records, &v);
+        int tid = tbx ? tbx_name2id(tbx, seq[i]) : bcf_hdr_name2id(hdr, seq[i]);
+        hts_idx_get_stat(tbx ? tbx->idx : idx, tid, &records, &v);
         sum+=records;
         if (stats&2 || !records) continue;
         bcf_hrec_t *hrec = bcf_hdr_get_hrec(hdr, BCF_HL_CTG, "ID", seq[i], NULL);
         int hkey = hrec ? bcf_hrec_find_key(hrec, "length") : -1;
         printf("%s\t%s\t%" PRIu64 "\n", seq[i], hkey<0?".":hrec->vals[hkey], records);
     }
-    if (!sum)
+    if (stats && !sum)
     {
         // No counts found.
         // Is this because index version has no stored count data, or no records?
@@ -120,9 +280,24 @@ int vcf_index_stats(char *fname, int stats)
     return 0;
 }
 
+void init_write_index(const char *fname, int file_type)
+{
+    if ( !fname || !strcmp("-",fname) ) error("The --write-index option requires the output file name, see -o\n");
+    if ( file_type!=FT_BCF_GZ && file_type!=FT_VCF_GZ ) error("The --write-index option requires compressed output, see -O\n");
+}
+
+// CSI for BCF and TBI for VCF, the threads decompress the output being indexed
+void write_index(const char *fname, int file_type, int n_threads)
+{
+    int ret = file_type==FT_BCF_GZ ?
+        bcf_index_build3(fname, NULL, 14, n_threads) :
+        tbx_index_build3(fname, NULL, 0, n_threads, &tbx_conf_vcf);
+    if ( ret!=0 ) error("Failed to index %s\n", fname);
+}
+
 int main_vcfindex(int argc, char *argv[])
 {
-    int c, force = 0, tbi = 0, stats = 0, n_threads = 0;
+    int c, force = 0, tbi = 0, stats = 0, n_threads = 0, nshards = 0, gti = 0;
     int min_shift = BCF_LIDX_SHIFT;
     char *outfn = NULL;
 
@@ -134,13 +309,16 @@ int main_vcfindex(int argc, char *argv[])
         {"min-shift",required_argument,NULL,'m'},
         {"stats",no_argument,NULL,'s'},
         {"nrecords",no_argument,NULL,'n'},
+        {"extended",no_argument,NULL,'e'},
+        {"shards",required_argument,NULL,10},
         {"threads",required_argument,NULL,9},
+        {"gt",no_argument,NULL,11},
         {"output-file",required_argument,NULL,'o'},
         {NULL, 0, NULL, 0}
     };
 
     char *tmp;
-    while ((c = getopt_long(argc, argv, "ctfm:sno:", loptions, NULL)) >= 0)
+    while ((c = getopt_long(argc, argv, "ctfm:sneo:", loptions, NULL)) >= 0)
     {
         switch (c)
         {
@@ -153,17 +331,28 @@ int main_vcfindex(int argc, char *argv[])
                 break;
             case 's': stats |= 1; break;
             case 'n': stats |= 2; break;
+            case 'e': stats |= 4; break;
+            case 10:
+                nshards = strtol(optarg,&tmp,10);
+                if ( *tmp || nshards<=0 ) error("Could not parse argument: --shards %s\n", optarg);
+                break;
             case 9:
                 n_threads = strtol(optarg,&tmp,10);
                 if ( *tmp ) error("Could not parse argument: --threads %s\n", optarg);
                 break;
+            case 11 : gti = 1; break;
             case 'o': outfn = optarg; break;
             default: usage();
         }
     }
-    if (stats>2)
+    if ((stats&4) && !(stats&1))
+    {
+        fprintf(stderr, "[E::%s] the --extended option requires --stats\n", __func__);
+        return 1;
+    }
+    if ((stats&3)==3 || (nshards && (stats&3)))
     {
-        fprintf(stderr, "[E::%s] expected only one of --stats or --nrecords options\n", __func__);
+        fprintf(stderr, "[E::%s] expected only one of --stats, --nrecords or --shards options\n", __func__);
         return 1;
     }
     if (tbi && min_shift>0)
@@ -184,7 +373,7 @@ int main_vcfindex(int argc, char *argv[])
         else usage();
     }
     else fname = argv[optind];
-    if (stats) return vcf_index_stats(fname, stats);
+    if (stats || nshards) return vcf_index_stats(fname, stats, nshards);
 
     kstring_t idx_fname = {0,0,0};
     if (outfn)
@@ -192,7 +381,7 @@ int main_vcfindex(int argc, char *argv[])
     else
     {
         if (!strcmp(fname, "-")) { fprintf(stderr, "[E::%s] must specify an output path for index file when reading VCF/BCF from stdin\n", __func__); return 1; }
-        ksprintf(&idx_fname, "%s.%s", fname, tbi ? "tbi" : "csi");
+        ksprintf(&idx_fname, "%s.%s", fname, gti ? "gti" : (tbi ? "tbi" : "csi"));
     }
     if (!force)
     {
@@ -210,6 +399,13 @@ int main_vcfindex(int argc, char *argv[])
         }
     }
 
+    if ( gti )
+    {
+        if ( gtidx_build(fname, idx_fname.s, n_threads)!=0 ) error("index: failed to create the genotype index for \"%s\"\n", fname);
+        free(idx_fname.s);
+        return 0;
+    }
+
     int ret = bcf_index_build3(fname, idx_fname.s, min_shift, n_threads);
     free(idx_fname.s);
     if (ret != 0) {
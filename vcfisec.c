@@ -28,13 +28,20 @@ THE SOFTWARE.  */
 #include <ctype.h>
 #include <string.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <htslib/vcf.h>
+#include <htslib/tbx.h>
 #include <htslib/synced_bcf_reader.h>
 #include <htslib/vcfutils.h>
+#include <htslib/khash_str2int.h>
+#include <htslib/bgzf.h>
+#include <htslib/hfile.h>
+#include <htslib/thread_pool.h>
 #include "bcftools.h"
 #include "filter.h"
+#include "tmpdir.h"
 
 #define OP_PLUS 1
 #define OP_MINUS 2
@@ -59,9 +66,31 @@ typedef struct
     char **argv, *prefix, *output_fname, **fnames, *write_files, *targets_list, *regions_list;
     char *isec_exact;
     int argc, record_cmd_line;
+    int bitmask;            // --bitmask: print sites with hexadecimal membership mask only
+    char *summary_fname, *mask;
+    void *comb_idx;         // --summary: mask -> index to comb_keys and comb_counts
+    char **comb_keys;
+    uint64_t *comb_counts;
+    int ncomb, mcomb;
+    htsFile *out_fh;        // the single VCF output when not writing to the -p directory
+    int parallel, targets_is_file;
+    char *tmp_dir;
 }
 args_t;
 
+// With --parallel, each chromosome is intersected by a worker thread which writes
+// each output stream to a temporary file, using its own readers and filters and a
+// private copy of the arguments
+typedef struct
+{
+    args_t args;
+    const char *chr;
+    char *reg_fname;    // a one-line regions file when the name cannot be given as a region string
+    char **fnames;  // fh_out[0..nout-1], out_fh and fh_sites in this order, NULL if not used
+    int nfnames;
+}
+chunk_t;
+
 /**
  *  mkdir_p() - create new directory for a file $fname
  *  @fname:   the file name to create the directory for, the part after last "/" is ignored
@@ -128,26 +157,94 @@ FILE *open_file(char **fname, const char *mode, const char *fmt, ...)
     return fp;
 }
 
-void isec_vcf(args_t *args)
+/*
+    The membership mask printed by --bitmask and --summary: hexadecimal digits with
+    the bit 0 of the last digit set when the site is present in the first file,
+    bit 1 in the second file etc.
+*/
+static void set_mask(args_t *args)
 {
     bcf_srs_t *files = args->files;
-    kstring_t str = {0,0,0};
-    htsFile *out_fh = NULL;
+    int i, nhex = (files->nreaders+3)/4;
+    memset(args->mask, 0, nhex);
+    for (i=0; i<files->nreaders; i++)
+        if ( bcf_sr_has_line(files,i) ) args->mask[nhex-1-i/4] |= 1<<(i%4);
+    for (i=0; i<nhex; i++)
+        args->mask[i] = "0123456789abcdef"[(int)args->mask[i]];
+}
 
-    // When only one VCF is output, print VCF to stdout or -o file
-    int out_std = 0;
-    if ( args->nwrite==1 && !args->prefix ) out_std = 1;
-    if ( args->targets_list && files->nreaders==1 ) out_std = 1;
-    if ( out_std )
+static void count_mask(args_t *args, const char *mask, uint64_t count)
+{
+    int idx;
+    if ( khash_str2int_get(args->comb_idx, mask, &idx)==0 )
     {
-        out_fh = hts_open(args->output_fname? args->output_fname : "-",hts_bcf_wmode(args->output_type));
-        if ( out_fh == NULL ) error("Can't write to %s: %s\n", args->output_fname? args->output_fname : "standard output", strerror(errno));
-        if ( args->n_threads ) hts_set_threads(out_fh, args->n_threads);
-        if (args->record_cmd_line) bcf_hdr_append_version(files->readers[args->iwrite].header,args->argc,args->argv,"bcftools_isec");
-        bcf_hdr_write(out_fh, files->readers[args->iwrite].header);
+        args->comb_counts[idx] += count;
+        return;
     }
-    if ( !args->nwrite && !out_std && !args->prefix )
-        fprintf(stderr,"Note: -w option not given, printing list of sites...\n");
+    idx = args->ncomb++;
+    hts_expand(char*, args->ncomb, args->mcomb, args->comb_keys);
+    args->comb_counts = (uint64_t*) realloc(args->comb_counts, sizeof(uint64_t)*args->mcomb);
+    args->comb_keys[idx] = strdup(mask);
+    args->comb_counts[idx] = count;
+    khash_str2int_set(args->comb_idx, args->comb_keys[idx], idx);
+}
+
+static int cmp_comb(const void *a, const void *b)
+{
+    return strcmp(*((char**)a), *((char**)b));
+}
+
+static void write_summary(args_t *args)
+{
+    bcf_srs_t *files = args->files;
+    FILE *fp = strcmp("-",args->summary_fname) ? fopen(args->summary_fname,"w") : stdout;
+    if ( !fp ) error("Failed to open %s: %s\n", args->summary_fname, strerror(errno));
+
+    int i, j;
+    fprintf(fp, "# This file was produced by: bcftools isec(%s+htslib-%s)\n", bcftools_version(),hts_version());
+    fprintf(fp, "# The command line was:\tbcftools %s", args->argv[0]);
+    for (i=1; i<args->argc; i++) fprintf(fp, " %s",args->argv[i]);
+    fprintf(fp, "\n#\n");
+    fprintf(fp, "# Input files, the bit 1<<(n-1) is set in the mask for the n-th file\n");
+    fprintf(fp, "# FILE\t[2]n\t[3]file name\n");
+    for (i=0; i<files->nreaders; i++)
+        fprintf(fp, "FILE\t%d\t%s\n", i+1, files->readers[i].fname);
+    fprintf(fp, "# Counts of sites with each combination of files, missing combinations have zero count\n");
+    fprintf(fp, "# COUNT\t[2]hexadecimal mask\t[3]presence in files 1..n\t[4]number of files\t[5]number of sites\n");
+
+    // fixed-width masks sort as numbers
+    char **keys = (char**) malloc(sizeof(char*)*args->ncomb);
+    for (i=0; i<args->ncomb; i++) keys[i] = args->comb_keys[i];
+    qsort(keys, args->ncomb, sizeof(*keys), cmp_comb);
+
+    kstring_t str = {0,0,0};
+    int nhex = (files->nreaders+3)/4;
+    for (i=0; i<args->ncomb; i++)
+    {
+        int idx, nset = 0;
+        khash_str2int_get(args->comb_idx, keys[i], &idx);
+        str.l = 0;
+        for (j=0; j<files->nreaders; j++)
+        {
+            char c = keys[i][nhex-1-j/4];
+            int val = c<='9' ? c-'0' : c-'a'+10;
+            int is_set = val & (1<<(j%4)) ? 1 : 0;
+            kputc(is_set ? '1' : '0', &str);
+            nset += is_set;
+        }
+        fprintf(fp, "COUNT\t%s\t%s\t%d\t%"PRIu64"\n", keys[i], str.s, nset, args->comb_counts[idx]);
+    }
+    free(str.s);
+    free(keys);
+    if ( fp!=stdout && fclose(fp)!=0 ) error("Failed to close %s: %s\n", args->summary_fname, strerror(errno));
+}
+
+static void isec_records(args_t *args)
+{
+    bcf_srs_t *files = args->files;
+    kstring_t str = {0,0,0};
+    htsFile *out_fh = args->out_fh;
+    int out_std = out_fh ? 1 : 0;
 
     int n;
     while ( (n=bcf_sr_next_line(files)) )
@@ -193,6 +290,12 @@ void isec_vcf(args_t *args)
                 break;
         }
 
+        if ( args->mask )
+        {
+            set_mask(args);
+            if ( args->summary_fname ) count_mask(args, args->mask, 1);
+        }
+
         if ( out_std )
         {
             if ( bcf_sr_has_line(files,args->iwrite) )
@@ -215,8 +318,13 @@ void isec_vcf(args_t *args)
                 kputs(line->d.allele[i], &str);
             }
             kputc('\t', &str);
-            for (i=0; i<files->nreaders; i++)
-                kputc(bcf_sr_has_line(files,i)?'1':'0', &str);
+            if ( args->bitmask )
+                kputs(args->mask, &str);
+            else
+            {
+                for (i=0; i<files->nreaders; i++)
+                    kputc(bcf_sr_has_line(files,i)?'1':'0', &str);
+            }
             kputc('\n', &str);
             fwrite(str.s,sizeof(char),str.l,args->fh_sites);
         }
@@ -242,7 +350,266 @@ void isec_vcf(args_t *args)
         }
     }
     if ( str.s ) free(str.s);
-    if ( out_fh ) hts_close(out_fh);
+}
+
+static void *isec_chunk(void *arg)
+{
+    chunk_t *chunk = (chunk_t*) arg;
+    args_t *args = &chunk->args;
+    bcf_srs_t *files = args->files;
+    int i, nout = chunk->nfnames - 2;
+
+    args->files = bcf_sr_init();
+    args->files->require_index = 1;
+    args->files->apply_filters = files->apply_filters;
+    args->files->collapse = files->collapse;
+    args->files->max_unpack = files->max_unpack;
+    if ( args->targets_list && bcf_sr_set_targets(args->files, args->targets_list, args->targets_is_file,0)<0 )
+        error("Failed to read the targets: %s\n", args->targets_list);
+    // a sequence name with a colon would be parsed as chr:pos, read it from a file instead
+    if ( chunk->reg_fname )
+    {
+        if ( bcf_sr_set_regions(args->files, chunk->reg_fname, 1)<0 ) error("Failed to set the region: %s\n", chunk->chr);
+    }
+    else if ( bcf_sr_set_regions(args->files, chunk->chr, 0)<0 ) error("Failed to set the region: %s\n", chunk->chr);
+    for (i=0; i<files->nreaders; i++)
+        if ( !bcf_sr_add_reader(args->files, files->readers[i].fname) )
+            error("Failed to open %s: %s\n", files->readers[i].fname,bcf_sr_strerror(args->files->errnum));
+
+    // filters keep state, each worker needs its own
+    if ( args->nflt )
+    {
+        args->flt = (filter_t**) calloc(args->nflt, sizeof(filter_t*));
+        for (i=0; i<args->nflt; i++)
+            if ( args->flt_expr[i] ) args->flt[i] = filter_init(args->files->readers[i].header, args->flt_expr[i]);
+    }
+
+    // the records are written without the header and appended to the real outputs later
+    const char *mode = args->output_type & FT_BCF ? "wbu" : "w";
+    htsFile **fh_out = args->fh_out ? (htsFile**) calloc(nout, sizeof(htsFile*)) : NULL;
+    for (i=0; i<nout; i++)
+    {
+        if ( !chunk->fnames[i] ) continue;
+        fh_out[i] = hts_open(chunk->fnames[i], mode);
+        if ( !fh_out[i] ) error("Can't write to \"%s\": %s\n", chunk->fnames[i], strerror(errno));
+    }
+    args->fh_out = fh_out;
+    if ( chunk->fnames[nout] )
+    {
+        args->out_fh = hts_open(chunk->fnames[nout], mode);
+        if ( !args->out_fh ) error("Can't write to \"%s\": %s\n", chunk->fnames[nout], strerror(errno));
+    }
+    if ( chunk->fnames[nout+1] )
+    {
+        args->fh_sites = fopen(chunk->fnames[nout+1], "w");
+        if ( !args->fh_sites ) error("Can't write to \"%s\": %s\n", chunk->fnames[nout+1], strerror(errno));
+    }
+    if ( args->mask ) args->mask = (char*) calloc((files->nreaders+3)/4+1, 1);
+    if ( args->summary_fname )
+    {
+        args->comb_idx = khash_str2int_init();
+        args->comb_keys = NULL;
+        args->comb_counts = NULL;
+        args->ncomb = args->mcomb = 0;
+    }
+
+    isec_records(args);
+
+    for (i=0; i<nout; i++)
+        if ( fh_out[i] && hts_close(fh_out[i])!=0 ) error("Close failed: %s\n", chunk->fnames[i]);
+    free(fh_out);
+    if ( args->out_fh && hts_close(args->out_fh)!=0 ) error("Close failed: %s\n", chunk->fnames[nout]);
+    if ( args->fh_sites && fclose(args->fh_sites)!=0 ) error("Close failed: %s\n", chunk->fnames[nout+1]);
+    for (i=0; i<args->nflt; i++)
+        if ( args->flt[i] ) filter_destroy(args->flt[i]);
+    if ( args->nflt ) free(args->flt);
+    free(args->mask);
+    bcf_sr_destroy(args->files);
+    return chunk;
+}
+
+// Append the temporary file to the output and remove it
+static void append_file(const char *fname, htsFile *out_fh, FILE *out_fp)
+{
+    BGZF *fp = bgzf_open(fname, "r");
+    if ( !fp ) error("Failed to open %s: %s\n", fname, strerror(errno));
+    const size_t page_size = BGZF_MAX_BLOCK_SIZE;
+    uint8_t *buf = (uint8_t*) malloc(page_size);
+    ssize_t nread;
+    while ( (nread = bgzf_read(fp, buf, page_size)) > 0 )
+    {
+        ssize_t nwr;
+        if ( out_fp ) nwr = fwrite(buf, 1, nread, out_fp);
+        else nwr = out_fh->is_bgzf ? bgzf_write(out_fh->fp.bgzf, buf, nread) : hwrite(out_fh->fp.hfile, buf, nread);
+        if ( nwr!=nread ) error("Write failed, wrote %d instead of %d bytes.\n", (int)nwr,(int)nread);
+    }
+    if ( nread<0 ) error("Failed to read %s\n", fname);
+    free(buf);
+    if ( bgzf_close(fp)<0 ) error("Close failed: %s\n", fname);
+    unlink(fname);
+}
+
+static void write_chunk(args_t *args, hts_tpool_process *q)
+{
+    hts_tpool_result *res = hts_tpool_next_result_wait(q);
+    if ( !res ) error("Failed to retrieve the intersected chunk\n");
+    chunk_t *chunk = (chunk_t*) hts_tpool_result_data(res);
+    args_t *cargs = &chunk->args;
+
+    int i, nout = chunk->nfnames - 2;
+    for (i=0; i<nout; i++)
+        if ( chunk->fnames[i] ) append_file(chunk->fnames[i], args->fh_out[i], NULL);
+    if ( chunk->fnames[nout] ) append_file(chunk->fnames[nout], args->out_fh, NULL);
+    if ( chunk->fnames[nout+1] ) append_file(chunk->fnames[nout+1], NULL, args->fh_sites);
+    if ( chunk->reg_fname ) unlink(chunk->reg_fname);
+    if ( args->summary_fname )
+    {
+        for (i=0; i<cargs->ncomb; i++)
+        {
+            count_mask(args, cargs->comb_keys[i], cargs->comb_counts[i]);
+            free(cargs->comb_keys[i]);
+        }
+        free(cargs->comb_keys);
+        free(cargs->comb_counts);
+        khash_str2int_destroy(cargs->comb_idx);
+    }
+    hts_tpool_delete_result(res, 0);
+}
+
+// The union of sequence names in the order of their first appearance in the indexes.
+// The indexes are used rather than the headers so that VCF records on contigs without
+// a ##contig line are not lost.
+static char **isec_seqnames(args_t *args, int *nseq)
+{
+    void *seen = khash_str2int_init();
+    char **seqs = NULL;
+    int i, j, n = 0, m = 0;
+    for (i=0; i<args->files->nreaders; i++)
+    {
+        bcf_sr_t *reader = &args->files->readers[i];
+        int nchr = 0;
+        const char **chrs = NULL;
+        if ( reader->tbx_idx ) chrs = tbx_seqnames(reader->tbx_idx, &nchr);
+        else if ( reader->bcf_idx ) chrs = bcf_index_seqnames(reader->bcf_idx, reader->header, &nchr);
+        else error("The --parallel option requires indexed files: %s\n", reader->fname);
+        for (j=0; j<nchr; j++)
+        {
+            if ( khash_str2int_has_key(seen, chrs[j]) ) continue;
+            n++;
+            hts_expand(char*, n, m, seqs);
+            seqs[n-1] = strdup(chrs[j]);
+            khash_str2int_inc(seen, seqs[n-1]);
+        }
+        free(chrs);
+    }
+    khash_str2int_destroy(seen);
+    *nseq = n;
+    return seqs;
+}
+
+// The chromosomes are intersected independently and the outputs concatenated in
+// the order of the headers. At most two chunks per thread are in flight, the
+// oldest one is written out before another is dispatched.
+static void isec_chunks(args_t *args)
+{
+    if ( !args->files->p ) error("The --parallel option requires --threads\n");
+    if ( args->regions_list ) error("The --parallel option cannot be combined with -r/-R, use -t/-T instead\n");
+
+    int i, j, nchr;
+    char **chrs = isec_seqnames(args, &nchr);
+    if ( !nchr ) error("No sequences found in the indexes\n");
+
+    char *dir = tmpdir_create(args->tmp_dir, "isec");
+    kstring_t str = {0,0,0};
+
+    int nout = args->fh_out ? (args->isec_op==OP_VENN ? 4 : args->files->nreaders) : 0;
+    int nchunks = 2*args->n_threads, nbusy = 0, ichunk = 0;
+    chunk_t *chunks = (chunk_t*) calloc(nchunks, sizeof(chunk_t));
+    for (i=0; i<nchunks; i++)
+    {
+        chunks[i].nfnames = nout + 2;
+        chunks[i].fnames  = (char**) calloc(nout + 2, sizeof(char*));
+    }
+    hts_tpool_process *q = hts_tpool_process_init(args->files->p->pool, nchunks, 0);
+    if ( !q ) error("Failed to initialize the thread pool queue\n");
+    for (i=0; i<nchr; i++)
+    {
+        chunk_t *chunk = &chunks[ichunk];
+        ichunk = (ichunk + 1) % nchunks;
+        if ( nbusy==nchunks ) { write_chunk(args, q); nbusy--; }
+        chunk->args = *args;
+        chunk->chr  = chrs[i];
+        free(chunk->reg_fname);
+        chunk->reg_fname = NULL;
+        if ( strchr(chrs[i],':') )
+        {
+            str.l = 0;
+            ksprintf(&str, "%s/%d.reg", dir, i);
+            FILE *fp = fopen(str.s, "w");
+            if ( !fp ) error("Can't write to \"%s\": %s\n", str.s, strerror(errno));
+            fprintf(fp, "%s\t1\t%"PRId64"\n", chrs[i], (int64_t)HTS_POS_MAX);
+            if ( fclose(fp)!=0 ) error("Close failed: %s\n", str.s);
+            chunk->reg_fname = strdup(str.s);
+        }
+        for (j=0; j<nout+2; j++)
+        {
+            free(chunk->fnames[j]);
+            chunk->fnames[j] = NULL;
+            if ( j<nout && !args->fh_out[j] ) continue;
+            if ( j==nout && !args->out_fh ) continue;
+            if ( j==nout+1 && (!args->fh_sites || args->out_fh) ) continue;
+            str.l = 0;
+            ksprintf(&str, "%s/%d.%d", dir, i, j);
+            chunk->fnames[j] = strdup(str.s);
+        }
+        if ( hts_tpool_dispatch(args->files->p->pool, q, isec_chunk, chunk) < 0 )
+            error("Failed to dispatch the chunk %s to the thread pool\n", chrs[i]);
+        nbusy++;
+    }
+    while ( nbusy ) { write_chunk(args, q); nbusy--; }
+    hts_tpool_process_destroy(q);
+
+    for (i=0; i<nchunks; i++)
+    {
+        for (j=0; j<nout+2; j++) free(chunks[i].fnames[j]);
+        free(chunks[i].fnames);
+        free(chunks[i].reg_fname);
+    }
+    free(chunks);
+    for (i=0; i<nchr; i++) free(chrs[i]);
+    free(chrs);
+    tmpdir_remove(dir);
+    free(dir);
+    free(str.s);
+}
+
+void isec_vcf(args_t *args)
+{
+    bcf_srs_t *files = args->files;
+
+    // When only one VCF is output, print VCF to stdout or -o file
+    int out_std = 0;
+    if ( args->nwrite==1 && !args->prefix ) out_std = 1;
+    if ( args->targets_list && files->nreaders==1 ) out_std = 1;
+    if ( args->bitmask ) out_std = 0;
+    if ( out_std )
+    {
+        args->out_fh = hts_open(args->output_fname? args->output_fname : "-",hts_bcf_wmode(args->output_type));
+        if ( args->out_fh == NULL ) error("Can't write to %s: %s\n", args->output_fname? args->output_fname : "standard output", strerror(errno));
+        if ( args->n_threads ) hts_set_threads(args->out_fh, args->n_threads);
+        if (args->record_cmd_line) bcf_hdr_append_version(files->readers[args->iwrite].header,args->argc,args->argv,"bcftools_isec");
+        bcf_hdr_write(args->out_fh, files->readers[args->iwrite].header);
+    }
+    if ( !args->nwrite && !out_std && !args->prefix && !args->bitmask )
+        fprintf(stderr,"Note: -w option not given, printing list of sites...\n");
+
+    if ( args->parallel )
+        isec_chunks(args);
+    else
+        isec_records(args);
+
+    if ( args->out_fh ) hts_close(args->out_fh);
+    if ( args->summary_fname ) write_summary(args);
 }
 
 static void add_filter(args_t *args, char *expr, int logic)
@@ -294,6 +661,16 @@ static void init_data(args_t *args)
         }
     }
 
+    // When only the list of sites is printed, the text VCF parser can skip the fields not
+    // required by the filters
+    if ( args->bitmask || (!args->prefix && !args->write_files && !(args->targets_list && args->files->nreaders==1)) )
+    {
+        int max_unpack = BCF_UN_STR;
+        for (i=0; i<args->nflt; i++)
+            if ( args->flt[i] ) max_unpack |= filter_max_unpack(args->flt[i]);
+        args->files->max_unpack = max_unpack;
+    }
+
     if ( args->isec_op==OP_EXACT )
     {
         if ( strlen(args->isec_exact)!=args->files->nreaders )
@@ -324,6 +701,13 @@ static void init_data(args_t *args)
         if ( !args->write[0] ) error("Only -w1 makes sense with -C\n");
     }
 
+    if ( args->bitmask && (args->prefix || args->write_files) )
+        error("The --bitmask option cannot be combined with -p or -w\n");
+    if ( args->bitmask || args->summary_fname )
+        args->mask = (char*) calloc((args->files->nreaders+3)/4+1, 1);
+    if ( args->summary_fname )
+        args->comb_idx = khash_str2int_init();
+
     if ( args->prefix )
     {
         // Init output directory and create the readme file
@@ -343,7 +727,7 @@ static void init_data(args_t *args)
         // Open output files and write the legend
         if ( args->isec_op==OP_VENN )
         {
-            args->fh_out = (htsFile**) malloc(sizeof(htsFile*)*4);
+            args->fh_out = (htsFile**) calloc(4, sizeof(htsFile*));
             args->fnames = (char**) calloc(4,sizeof(char*));
 
             #define OPEN_FILE(i,j) { \
@@ -442,6 +826,13 @@ static void destroy_data(args_t *args)
         if ( args->fh_sites ) fclose(args->fh_sites);
         if ( args->write ) free(args->write);
     }
+    else if ( args->fh_sites && args->fh_sites!=stdout && fclose(args->fh_sites)!=0 )
+        error("Failed to close %s: %s\n", args->output_fname, strerror(errno));
+    for (i=0; i<args->ncomb; i++) free(args->comb_keys[i]);
+    free(args->comb_keys);
+    free(args->comb_counts);
+    khash_str2int_destroy(args->comb_idx);
+    free(args->mask);
 }
 
 static void usage(void)
@@ -452,6 +843,7 @@ static void usage(void)
     fprintf(stderr, "\n");
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "    -c, --collapse <string>       treat as identical records with <snps|indels|both|all|some|none>, see man page for details [none]\n");
+    fprintf(stderr, "        --bitmask                 print only CHROM,POS,REF,ALT and a hexadecimal mask of the files the site is present in\n");
     fprintf(stderr, "    -C, --complement              output positions present only in the first file but missing in the others\n");
     fprintf(stderr, "    -e, --exclude <expr>          exclude sites for which the expression is true\n");
     fprintf(stderr, "    -f, --apply-filters <list>    require at least one of the listed FILTER strings (e.g. \"PASS,.\")\n");
@@ -461,11 +853,14 @@ static void usage(void)
     fprintf(stderr, "    -o, --output <file>           write output to a file [standard output]\n");
     fprintf(stderr, "    -O, --output-type <b|u|z|v>   b: compressed BCF, u: uncompressed BCF, z: compressed VCF, v: uncompressed VCF [v]\n");
     fprintf(stderr, "    -p, --prefix <dir>            if given, subset each of the input files accordingly, see also -w\n");
+    fprintf(stderr, "        --parallel                intersect chromosomes in parallel, requires --threads\n");
     fprintf(stderr, "    -r, --regions <region>        restrict to comma-separated list of regions\n");
     fprintf(stderr, "    -R, --regions-file <file>     restrict to regions listed in a file\n");
+    fprintf(stderr, "        --summary <file>          write the number of sites for each combination of files\n");
     fprintf(stderr, "    -t, --targets <region>        similar to -r but streams rather than index-jumps\n");
     fprintf(stderr, "    -T, --targets-file <file>     similar to -R but streams rather than index-jumps\n");
-    fprintf(stderr, "        --threads <int>           number of extra output compression threads [0]\n");
+    fprintf(stderr, "        --temp-dir <dir>          directory for temporary files with --parallel [$TMPDIR or /tmp]\n");
+    fprintf(stderr, "        --threads <int>           number of extra decompression and output compression threads [0]\n");
     fprintf(stderr, "    -w, --write <list>            list of files to write with -p given as 1-based indexes. By default, all files are written\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Examples:\n");
@@ -481,6 +876,9 @@ static void usage(void)
     fprintf(stderr, "   # Extract records private to A or B comparing by position only\n");
     fprintf(stderr, "   bcftools isec A.vcf.gz B.vcf.gz -p dir -n -1 -c all\n");
     fprintf(stderr, "\n");
+    fprintf(stderr, "   # Site membership and combination counts for many call sets\n");
+    fprintf(stderr, "   bcftools isec -n +1 --bitmask --summary counts.txt --threads 4 -o sites.txt *.vcf.gz\n");
+    fprintf(stderr, "\n");
     exit(1);
 }
 
@@ -515,6 +913,10 @@ int main_vcfisec(int argc, char *argv[])
         {"output-type",required_argument,NULL,'O'},
         {"threads",required_argument,NULL,9},
         {"no-version",no_argument,NULL,8},
+        {"bitmask",no_argument,NULL,10},
+        {"summary",required_argument,NULL,11},
+        {"parallel",no_argument,NULL,12},
+        {"temp-dir",required_argument,NULL,13},
         {NULL,0,NULL,0}
     };
     while ((c = getopt_long(argc, argv, "hc:r:R:p:n:w:t:T:Cf:o:O:i:e:",loptions,NULL)) >= 0) {
@@ -544,7 +946,7 @@ int main_vcfisec(int argc, char *argv[])
             case 'r': args->regions_list = optarg; break;
             case 'R': args->regions_list = optarg; regions_is_file = 1; break;
             case 't': args->targets_list = optarg; break;
-            case 'T': args->targets_list = optarg; targets_is_file = 1; break;
+            case 'T': args->targets_list = optarg; targets_is_file = 1; args->targets_is_file = 1; break;
             case 'p': args->prefix = optarg; break;
             case 'w': args->write_files = optarg; break;
             case 'i': add_filter(args, optarg, FLT_INCLUDE); break;
@@ -564,6 +966,10 @@ int main_vcfisec(int argc, char *argv[])
                 break;
             case  9 : args->n_threads = strtol(optarg, 0, 0); break;
             case  8 : args->record_cmd_line = 0; break;
+            case 10 : args->bitmask = 1; break;
+            case 11 : args->summary_fname = optarg; break;
+            case 12 : args->parallel = 1; break;
+            case 13 : args->tmp_dir = optarg; break;
             case 'h':
             case '?': usage();
             default: error("Unknown argument: %s\n", optarg);
@@ -585,6 +991,8 @@ int main_vcfisec(int argc, char *argv[])
         if ( !args->isec_op ) error("Expected two file names or one of the options --complement, --nfiles or --targets\n");
     }
     args->files->require_index = 1;
+    if ( args->n_threads && bcf_sr_set_threads(args->files, args->n_threads)!=0 )
+        error("Could not initialize --threads %d\n", args->n_threads);
     while (optind<argc)
     {
         if ( !bcf_sr_add_reader(args->files, argv[optind]) ) error("Failed to open %s: %s\n", argv[optind],bcf_sr_strerror(args->files->errnum));
@@ -32,12 +32,19 @@ THE SOFTWARE.  */
 #include <htslib/synced_bcf_reader.h>
 #include <htslib/vcfutils.h>
 #include <htslib/faidx.h>
+#include <htslib/bgzf.h>
+#include <htslib/hfile.h>
+#include <htslib/thread_pool.h>
 #include <math.h>
 #include <ctype.h>
 #include <time.h>
 #include "bcftools.h"
 #include "regidx.h"
 #include "vcmp.h"
+#include "kheap.h"
+#include "arena.h"
+#include "hdrmerge.h"
+#include "tmpdir.h"
 
 #define DBG 0
 
@@ -88,6 +95,20 @@ typedef struct
 }
 gvcf_aux_t;
 
+// END positions of the active gVCF blocks, the entries are not removed when a
+// block is inactivated elsewhere; stale entries are recognised by comparing
+// with gvcf_aux_t and dropped when they reach the top
+typedef struct
+{
+    int end, ireader;
+}
+gvcf_end_t;
+static inline int gvcf_end_is_smaller(gvcf_end_t *a, gvcf_end_t *b)
+{
+    return a->end < b->end ? 1 : 0;
+}
+KHEAP_INIT(gvcf, gvcf_end_t, gvcf_end_is_smaller)
+
 // Auxiliary merge data for selecting the right combination
 //  of buffered records across multiple readers. maux1_t
 //  corresponds to one buffered line.
@@ -128,6 +149,10 @@ typedef struct
     bcf_srs_t *files;
     int gvcf_min, gvcf_break;   // min buffered gvcf END position (NB: gvcf_min is 1-based) or 0 if no active lines are present
     gvcf_aux_t *gvcf;           // buffer of gVCF lines
+    khp_gvcf_t *gvcf_heap;      // END positions of the active gVCF blocks
+    gvcf_end_t *gvcf_tmp;
+    int mgvcf_tmp;
+    arena_t arena;              // scratch memory of the current output record, reset in merge_chrom2qual
 }
 maux_t;
 
@@ -138,7 +163,7 @@ typedef struct
     regidx_t *regs;    // apply regions only after the blocks are expanded
     regitr_t *regs_itr;
     int header_only, collapse, output_type, force_samples, merge_by_id, do_gvcf, filter_logic, missing_to_ref;
-    char *header_fname, *output_fname, *regions_list, *info_rules, *file_list;
+    char *header_fname, *output_fname, *regions_list, *info_rules, *file_list, *tmp_dir;
     faidx_t *gvcf_fai;
     info_rule_t *rules;
     int nrules;
@@ -149,10 +174,30 @@ typedef struct
     htsFile *out_fh;
     bcf_hdr_t *out_hdr;
     char **argv;
-    int argc, n_threads, record_cmd_line;
+    int argc, n_threads, record_cmd_line, parallel, regions_is_file, max_inputs, write_index;
 }
 args_t;
 
+// With --parallel, each chromosome is merged by a worker thread into a temporary
+// file, using its own readers and a private copy of the arguments
+typedef struct
+{
+    args_t args;
+    const char *chr;
+    char *fname;
+}
+chunk_t;
+
+// With --max-inputs, at most that many files are merged at once into temporary
+// files which are then merged in the next round
+typedef struct
+{
+    args_t args;
+    char **fnames, *fname;  // input files and the output temporary file
+    int nfnames;
+}
+merge_batch_t;
+
 static bcf1_t *maux_get_line(args_t *args, int i)
 {
     maux_t *ma = args->maux;
@@ -492,10 +537,10 @@ static int info_rules_add_values(args_t *args, bcf_hdr_t *hdr, bcf1_t *line, inf
 
 int bcf_hdr_sync(bcf_hdr_t *h);
 
-void merge_headers(bcf_hdr_t *hw, const bcf_hdr_t *hr, const char *clash_prefix, int force_samples)
+void merge_headers(hdrmerge_t *hm, bcf_hdr_t *hw, const bcf_hdr_t *hr, const char *clash_prefix, int force_samples)
 {
-    // header lines
-    hw = bcf_hdr_merge(hw, hr);
+    // header lines, the header is synced by the caller once all are merged
+    hw = hdrmerge_add(hm, hw, hr);
 
     // samples
     int i;
@@ -683,6 +728,7 @@ maux_t *maux_init(args_t *args)
         ma->gvcf = (gvcf_aux_t*) calloc(ma->n,sizeof(gvcf_aux_t));
         for (i=0; i<ma->n; i++)
             ma->gvcf[i].line = bcf_init1();
+        ma->gvcf_heap = khp_init(gvcf);
     }
     ma->smpl_ploidy = (int*) calloc(n_smpl,sizeof(int));
     ma->smpl_nGsize = (int*) malloc(n_smpl*sizeof(int));
@@ -710,6 +756,8 @@ void maux_destroy(maux_t *ma)
     {
         for (i=0; i<ma->n; i++) bcf_destroy(ma->gvcf[i].line);
         free(ma->gvcf);
+        khp_destroy(gvcf, ma->gvcf_heap);
+        free(ma->gvcf_tmp);
     }
     for (i=0; i<ma->mAGR_info; i++)
         free(ma->AGR_info[i].buf);
@@ -725,6 +773,7 @@ void maux_destroy(maux_t *ma)
     free(ma->smpl_ploidy);
     free(ma->smpl_nGsize);
     free(ma->chr);
+    arena_destroy(&ma->arena);
     free(ma);
 }
 void maux_expand1(buffer_t *buf, int size)
@@ -784,6 +833,7 @@ void maux_reset(maux_t *ma)
         }
         if ( new_chr && ma->gvcf ) ma->gvcf[i].active = 0;  // make sure to close active gvcf block on new chr
     }
+    if ( new_chr && ma->gvcf ) ma->gvcf_heap->ndat = 0;
 }
 void maux_debug(maux_t *ma, int ir, int ib)
 {
@@ -809,7 +859,8 @@ void merge_chrom2qual(args_t *args, bcf1_t *out)
     tmps->l = 0;
 
     maux_t *ma = args->maux;
-    int *al_idxs = (int*) calloc(ma->nals,sizeof(int));
+    arena_reset(&ma->arena);
+    int *al_idxs = (int*) arena_calloc(&ma->arena, ma->nals, sizeof(int));
     bcf_float_set_missing(out->qual);
 
     // CHROM, POS, ID, QUAL
@@ -889,12 +940,10 @@ void merge_chrom2qual(args_t *args, bcf1_t *out)
     hts_expand0(char*, ma->nout_als, ma->mout_als, ma->out_als);
     int k = 0;
     for (i=0; i<ma->nals; i++)
-        if ( i==0 || al_idxs[i] ) ma->out_als[k++] = strdup(ma->als[i]);
+        if ( i==0 || al_idxs[i] ) ma->out_als[k++] = arena_strdup(&ma->arena, ma->als[i]);
     assert( k==ma->nout_als );
     normalize_alleles(ma->out_als, ma->nout_als);
     bcf_update_alleles(out_hdr, out, (const char**) ma->out_als, ma->nout_als);
-    free(al_idxs);
-    for (i=0; i<ma->nout_als; i++) free(ma->out_als[i]);
 }
 
 void merge_filter(args_t *args, bcf1_t *out)
@@ -1268,9 +1317,9 @@ void merge_info(args_t *args, bcf1_t *out)
     }
 }
 
-void update_AN_AC(bcf_hdr_t *hdr, bcf1_t *line)
+void update_AN_AC(arena_t *arena, bcf_hdr_t *hdr, bcf1_t *line)
 {
-    int32_t an = 0, *tmp = (int32_t*) malloc(sizeof(int)*line->n_allele);
+    int32_t an = 0, *tmp = (int32_t*) arena_alloc(arena, sizeof(int32_t)*line->n_allele);
     int ret = bcf_calc_ac(hdr, line, tmp, BCF_UN_FMT);
     if ( ret>0 )
     {
@@ -1279,7 +1328,6 @@ void update_AN_AC(bcf_hdr_t *hdr, bcf1_t *line)
         bcf_update_info_int32(hdr, line, "AN", &an, 1);
         bcf_update_info_int32(hdr, line, "AC", tmp+1, line->n_allele-1);
     }
-    free(tmp);
 }
 
 void merge_GT(args_t *args, bcf_fmt_t **fmt_map, bcf1_t *out)
@@ -1415,10 +1463,13 @@ void merge_format_field(args_t *args, bcf_fmt_t **fmt_map, bcf1_t *out)
         if ( fmt_map[i]->n > nsize ) nsize = fmt_map[i]->n;
     }
 
+    // the staging array is shared by all tags and records and only grows,
+    // reserve some room for extra alleles to avoid frequent reallocs
     int msize = sizeof(float)>sizeof(int32_t) ? sizeof(float) : sizeof(int32_t);
     if ( ma->ntmp_arr < nsamples*nsize*msize )
     {
         ma->ntmp_arr = nsamples*nsize*msize;
+        kroundup32(ma->ntmp_arr);
         ma->tmp_arr  = realloc(ma->tmp_arr, ma->ntmp_arr);
     }
 
@@ -1470,6 +1521,13 @@ void merge_format_field(args_t *args, bcf_fmt_t **fmt_map, bcf1_t *out)
             if ( (length!=BCF_VL_G && length!=BCF_VL_A && length!=BCF_VL_R) || (line->n_allele==out->n_allele && !ma->buf[i].rec[irec].als_differ) ) \
             { \
                 /* alleles unchanged, copy over */ \
+                if ( sizeof(src_type_t)==sizeof(tgt_type_t) && fmt_ori->n==nsize ) \
+                { \
+                    /* the same type and block size, incl. the missing and vector_end values: copy the whole block */ \
+                    memcpy(tgt, src, sizeof(tgt_type_t)*nsize*bcf_hdr_nsamples(hdr)); \
+                    ismpl += bcf_hdr_nsamples(hdr); \
+                    continue; \
+                } \
                 for (j=0; j<bcf_hdr_nsamples(hdr); j++) \
                 { \
                     for (l=0; l<fmt_ori->n; l++) \
@@ -1655,7 +1713,7 @@ void merge_format(args_t *args, bcf1_t *out)
     out->n_sample = bcf_hdr_nsamples(out_hdr);
     if ( has_GT )
         merge_GT(args, ma->fmt_map, out);
-    update_AN_AC(out_hdr, out);
+    update_AN_AC(&args->maux->arena, out_hdr, out);
 
     for (i=1; i<=max_ifmt; i++)
         merge_format_field(args, &ma->fmt_map[i*files->nreaders], out);
@@ -1712,7 +1770,9 @@ void gvcf_write_block(args_t *args, int start, int end)
     gvcf_aux_t *gaux = maux->gvcf;
     assert(gaux);
 
-    // Update POS
+    // Update POS. These loops, gvcf_set_alleles() and the merge_* calls below still
+    // visit every reader for each written block, the merged record has a column
+    // for each of them anyway; the heap only replaces the search for the next END.
     int min = INT_MAX;
     char ref = 'N';
     for (i=0; i<args->files->nreaders; i++)
@@ -1774,20 +1834,36 @@ void gvcf_write_block(args_t *args, int start, int end)
     bcf_clear1(out);
 
 
-    // Inactivate blocks which do not extend beyond END and find new gvcf_min
+    // Inactivate blocks which do not extend beyond END and find new gvcf_min. Only the
+    // blocks ending first are visited, rather than all readers for each written block.
+    khp_gvcf_t *heap = maux->gvcf_heap;
+    while ( heap->ndat && heap->dat[0].end < end )
+    {
+        int ir = heap->dat[0].ireader;
+        if ( gaux[ir].active && gaux[ir].end==heap->dat[0].end )
+        {
+            gaux[ir].active = 0;
+            maux->buf[ir].cur = -1;
+        }
+        khp_delete(gvcf, heap);
+    }
+    // next min END position bigger than the current one; blocks which end at the current
+    // position stay active, they are put aside and returned to the heap afterwards
+    int ntmp = 0;
     min = INT_MAX;
-    for (i=0; i<args->files->nreaders; i++)
+    while ( heap->ndat )
     {
-        if ( !gaux[i].active ) continue;
-        if ( gaux[i].end < end )
+        gvcf_end_t *top = &heap->dat[0];
+        int ir = top->ireader;
+        if ( gaux[ir].active && gaux[ir].end==top->end )
         {
-            gaux[i].active = 0; 
-            maux->buf[i].cur = -1;
-            continue; 
+            if ( maux->gvcf_min < top->end+1 ) { min = top->end + 1; break; }
+            hts_expand(gvcf_end_t, ntmp+1, maux->mgvcf_tmp, maux->gvcf_tmp);
+            maux->gvcf_tmp[ntmp++] = *top;
         }
-        // next min END position bigger than the current one
-        if ( maux->gvcf_min < gaux[i].end+1 && min > gaux[i].end+1 ) min = gaux[i].end + 1;
+        khp_delete(gvcf, heap);
     }
+    for (i=0; i<ntmp; i++) khp_insert(gvcf, heap, &maux->gvcf_tmp[i]);
     maux->gvcf_min = min==INT_MAX ? 0 : min;
 }
 
@@ -1895,6 +1971,8 @@ void gvcf_stage(args_t *args, int pos)
             // an empty record: the gaux line must be kept until we reach its END.
             gaux[i].active = 1;
             gaux[i].end = end[0] - 1;
+            gvcf_end_t blk = { gaux[i].end, i };
+            khp_insert(gvcf, maux->gvcf_heap, &blk);
             SWAP(bcf1_t*,args->files->readers[i].buffer[irec],gaux[i].line);
             gaux[i].line->pos = pos;
 
@@ -2265,6 +2343,143 @@ void bcf_hdr_append_version(bcf_hdr_t *hdr, int argc, char **argv, const char *c
     bcf_hdr_sync(hdr);
 }
 
+static void merge_records(args_t *args)
+{
+    if ( args->collapse==COLLAPSE_NONE ) args->vcmp = vcmp_init();
+    args->maux = maux_init(args);
+    args->out_line = bcf_init1();
+    args->tmph = kh_init(strdict);
+
+    while ( bcf_sr_next_line(args->files) )
+    {
+        // output cached gVCF blocks which end before the new record
+        if ( args->do_gvcf )
+            gvcf_flush(args,0);
+
+        maux_reset(args->maux);
+
+        // determine which of the new records are gvcf blocks
+        if ( args->do_gvcf )
+            gvcf_stage(args, args->maux->pos);
+
+        while ( can_merge(args) )
+        {
+            stage_line(args);
+            merge_line(args);
+        }
+        clean_buffer(args);
+        // debug_state(args);
+    }
+    if ( args->do_gvcf )
+        gvcf_flush(args,1);
+
+    maux_destroy(args->maux);
+    bcf_destroy1(args->out_line);
+    kh_destroy(strdict, args->tmph);
+    if ( args->tmps.m ) free(args->tmps.s);
+    if ( args->vcmp ) vcmp_destroy(args->vcmp);
+}
+
+static void *merge_chunk(void *arg)
+{
+    chunk_t *chunk = (chunk_t*) arg;
+    args_t *args = &chunk->args;
+    bcf_srs_t *files = args->files;
+    int i;
+
+    args->files = bcf_sr_init();
+    args->files->require_index = 1;
+    args->files->apply_filters = files->apply_filters;
+    if ( bcf_sr_set_regions(args->files, chunk->chr, 0)<0 ) error("Failed to set the region: %s\n", chunk->chr);
+    for (i=0; i<files->nreaders; i++)
+        if ( !bcf_sr_add_reader(args->files, files->readers[i].fname) )
+            error("Failed to open %s: %s\n", files->readers[i].fname,bcf_sr_strerror(args->files->errnum));
+
+    args->out_fh = hts_open(chunk->fname, args->output_type & FT_BCF ? "wbu" : "w");
+    if ( !args->out_fh ) error("Can't write to \"%s\": %s\n", chunk->fname, strerror(errno));
+    args->tmps.l = args->tmps.m = 0; args->tmps.s = NULL;
+    args->rules  = NULL; args->nrules = 0;
+    info_rules_init(args);
+
+    merge_records(args);
+
+    info_rules_destroy(args);
+    if ( hts_close(args->out_fh)!=0 ) error("Close failed: %s\n", chunk->fname);
+    bcf_sr_destroy(args->files);
+    return chunk;
+}
+
+// Append the merged chromosome to the output and remove the temporary file
+static void write_chunk(args_t *args, hts_tpool_process *q)
+{
+    hts_tpool_result *res = hts_tpool_next_result_wait(q);
+    if ( !res ) error("Failed to retrieve the merged chunk\n");
+    chunk_t *chunk = (chunk_t*) hts_tpool_result_data(res);
+
+    BGZF *fp = bgzf_open(chunk->fname, "r");
+    if ( !fp ) error("Failed to open %s: %s\n", chunk->fname, strerror(errno));
+    const size_t page_size = BGZF_MAX_BLOCK_SIZE;
+    uint8_t *buf = (uint8_t*) malloc(page_size);
+    ssize_t nread;
+    while ( (nread = bgzf_read(fp, buf, page_size)) > 0 )
+    {
+        ssize_t nwr = args->out_fh->is_bgzf ? bgzf_write(args->out_fh->fp.bgzf, buf, nread) : hwrite(args->out_fh->fp.hfile, buf, nread);
+        if ( nwr!=nread ) error("Write failed, wrote %d instead of %d bytes.\n", (int)nwr,(int)nread);
+    }
+    if ( nread<0 ) error("Failed to read %s\n", chunk->fname);
+    free(buf);
+    if ( bgzf_close(fp)<0 ) error("Close failed: %s\n", chunk->fname);
+    unlink(chunk->fname);
+    hts_tpool_delete_result(res, 0);
+}
+
+// The chromosomes are merged independently and concatenated in the order of the
+// output header. At most two chunks per thread are in flight, the oldest one is
+// written out before another is dispatched.
+static void merge_chunks(args_t *args)
+{
+    if ( !args->files->p ) error("The --parallel option requires --threads\n");
+    if ( args->do_gvcf ) error("The --parallel option cannot be combined with --gvcf\n");
+
+    int i, nchr;
+    const char **chrs = bcf_hdr_seqnames(args->out_hdr, &nchr);
+    if ( !nchr ) error("The --parallel option requires ##contig lines in the header\n");
+
+    char *dir = tmpdir_create(args->tmp_dir, "merge");
+    kstring_t str = {0,0,0};
+    int nchunks = 2*args->n_threads, nbusy = 0, ichunk = 0;
+    chunk_t *chunks = (chunk_t*) calloc(nchunks, sizeof(chunk_t));
+    hts_tpool_process *q = hts_tpool_process_init(args->files->p->pool, nchunks, 0);
+    if ( !q ) error("Failed to initialize the thread pool queue\n");
+    for (i=0; i<nchr; i++)
+    {
+        // build the region index in the main thread, the workers query it concurrently
+        if ( args->regs && !regidx_overlap(args->regs, chrs[i], 0, UINT32_MAX, NULL) ) continue;
+
+        chunk_t *chunk = &chunks[ichunk];
+        ichunk = (ichunk + 1) % nchunks;
+        if ( nbusy==nchunks ) { write_chunk(args, q); nbusy--; }
+        chunk->args = *args;
+        chunk->chr  = chrs[i];
+        free(chunk->fname);
+        str.l = 0;
+        ksprintf(&str, "%s/%d", dir, i);
+        chunk->fname = strdup(str.s);
+        if ( hts_tpool_dispatch(args->files->p->pool, q, merge_chunk, chunk) < 0 )
+            error("Failed to dispatch the chunk %s to the thread pool\n", chrs[i]);
+        nbusy++;
+    }
+    while ( nbusy ) { write_chunk(args, q); nbusy--; }
+    hts_tpool_process_destroy(q);
+
+    for (i=0; i<nchunks; i++) free(chunks[i].fname);
+    free(chunks);
+    tmpdir_remove(dir);
+    free(dir);
+    free(str.s);
+    free(chrs);
+}
+
 void merge_vcf(args_t *args)
 {
     args->out_fh  = hts_open(args->output_fname, hts_bcf_wmode(args->output_type));
@@ -2279,11 +2494,13 @@ void merge_vcf(args_t *args)
     else
     {
         int i;
+        hdrmerge_t *hm = hdrmerge_init();
         for (i=0; i<args->files->nreaders; i++)
         {
             char buf[10]; snprintf(buf,10,"%d",i+1);
-            merge_headers(args->out_hdr, args->files->readers[i].header,buf,args->force_samples);
+            merge_headers(hm, args->out_hdr, args->files->readers[i].header,buf,args->force_samples);
         }
+        hdrmerge_destroy(hm);
         if (args->record_cmd_line) bcf_hdr_append_version(args->out_hdr, args->argc, args->argv, "bcftools_merge");
         bcf_hdr_sync(args->out_hdr);
     }
@@ -2298,42 +2515,139 @@ void merge_vcf(args_t *args)
         return;
     }
 
-    if ( args->collapse==COLLAPSE_NONE ) args->vcmp = vcmp_init();
-    args->maux = maux_init(args);
-    args->out_line = bcf_init1();
-    args->tmph = kh_init(strdict);
+    if ( args->parallel )
+        merge_chunks(args);
+    else
+        merge_records(args);
 
-    while ( bcf_sr_next_line(args->files) )
-    {
-        // output cached gVCF blocks which end before the new record
-        if ( args->do_gvcf )
-            gvcf_flush(args,0);
+    info_rules_destroy(args);
+    bcf_hdr_destroy(args->out_hdr);
+    hts_close(args->out_fh);
+}
 
-        maux_reset(args->maux);
+static void *merge_batch(void *arg)
+{
+    merge_batch_t *batch = (merge_batch_t*) arg;
+    args_t *args = &batch->args;
+    bcf_srs_t *files = args->files;
+    int i;
 
-        // determine which of the new records are gvcf blocks
-        if ( args->do_gvcf )
-            gvcf_stage(args, args->maux->pos);
+    args->files = bcf_sr_init();
+    args->files->require_index = 1;
+    args->files->apply_filters = files->apply_filters;
+    if ( args->regions_list && bcf_sr_set_regions(args->files, args->regions_list, args->regions_is_file)<0 )
+        error("Failed to read the regions: %s\n", args->regions_list);
+    for (i=0; i<batch->nfnames; i++)
+        if ( !bcf_sr_add_reader(args->files, batch->fnames[i]) )
+            error("Failed to open %s: %s\n", batch->fnames[i],bcf_sr_strerror(args->files->errnum));
+
+    // the intermediate files are always indexed BCFs, the final header is built in the last round
+    args->output_fname = batch->fname;
+    args->output_type  = FT_BCF_GZ;
+    args->header_fname = NULL;
+    args->record_cmd_line = 0;
+    args->n_threads = 0;
+    args->parallel  = 0;
+    merge_vcf(args);
+    if ( bcf_index_build(batch->fname,14) ) error("Could not index %s\n", batch->fname);
 
-        while ( can_merge(args) )
+    bcf_sr_destroy(args->files);
+    return batch;
+}
+
+static void remove_tmp_files(char **fnames, int nfnames)
+{
+    kstring_t str = {0,0,0};
+    int i;
+    for (i=0; i<nfnames; i++)
+    {
+        str.l = 0;
+        ksprintf(&str, "%s.csi", fnames[i]);
+        unlink(str.s);
+        unlink(fnames[i]);
+    }
+    free(str.s);
+}
+
+// Merge the files in rounds until at most args->max_inputs files are left. The
+// batches of one round are merged in parallel when threads are available. Returns
+// the files for the final merge; if any round was run, these are temporary files
+// in the directory returned in tmp_dir.
+static char **merge_hierarchically(args_t *args, char **fnames, int *nfnames, char **tmp_dir)
+{
+    if ( args->do_gvcf ) error("The --max-inputs option cannot be combined with --gvcf\n");
+
+    // the rounds merge already merged values again, fine for sum, min, max and
+    // join but an average of averages is not the overall average
+    if ( args->info_rules && strcmp("-",args->info_rules) )
+    {
+        char *rules = strdup(args->info_rules), *ss = rules;
+        while ( ss )
         {
-            stage_line(args);
-            merge_line(args);
+            char *se = strchr(ss,',');
+            if ( se ) *se++ = 0;
+            char *logic = strchr(ss,':');
+            if ( logic && !strcasecmp(logic+1,"avg") )
+                error("The --max-inputs option cannot be combined with the non-associative rule -i %s\n", ss);
+            ss = se;
         }
-        clean_buffer(args);
-        // debug_state(args);
+        free(rules);
     }
-    if ( args->do_gvcf )
-        gvcf_flush(args,1);
 
-    info_rules_destroy(args);
-    maux_destroy(args->maux);
-    bcf_hdr_destroy(args->out_hdr);
-    hts_close(args->out_fh);
-    bcf_destroy1(args->out_line);
-    kh_destroy(strdict, args->tmph);
-    if ( args->tmps.m ) free(args->tmps.s);
-    if ( args->vcmp ) vcmp_destroy(args->vcmp);
+    int i, iround = 0;
+    kstring_t str = {0,0,0};
+    if ( args->regs ) regidx_finalize(args->regs);     // the batches query it concurrently
+    char *dir = tmpdir_create(args->tmp_dir, "merge");
+    while ( *nfnames > args->max_inputs )
+    {
+        int nbatches = (*nfnames + args->max_inputs - 1) / args->max_inputs;
+        merge_batch_t *batches = (merge_batch_t*) calloc(nbatches, sizeof(merge_batch_t));
+        for (i=0; i<nbatches; i++)
+        {
+            merge_batch_t *batch = &batches[i];
+            batch->args    = *args;
+            batch->fnames  = fnames + i*args->max_inputs;
+            batch->nfnames = i+1 < nbatches ? args->max_inputs : *nfnames - i*args->max_inputs;
+            str.l = 0;
+            ksprintf(&str, "%s/%d.%d.bcf", dir, iround, i);
+            batch->fname = strdup(str.s);
+        }
+        if ( args->files->p )
+        {
+            hts_tpool_process *q = hts_tpool_process_init(args->files->p->pool, nbatches, 0);
+            if ( !q ) error("Failed to initialize the thread pool queue\n");
+            for (i=0; i<nbatches; i++)
+                if ( hts_tpool_dispatch(args->files->p->pool, q, merge_batch, &batches[i]) < 0 )
+                    error("Failed to dispatch the merge of %s to the thread pool\n", batches[i].fname);
+            for (i=0; i<nbatches; i++)
+            {
+                hts_tpool_result *res = hts_tpool_next_result_wait(q);
+                if ( !res ) error("Failed to retrieve the merged batch\n");
+                hts_tpool_delete_result(res, 0);
+            }
+            hts_tpool_process_destroy(q);
+        }
+        else
+            for (i=0; i<nbatches; i++) merge_batch(&batches[i]);
+
+        // the inputs of rounds other than the first are temporary files from the previous round
+        if ( iround ) remove_tmp_files(fnames, *nfnames);
+        for (i=0; i<*nfnames; i++) free(fnames[i]);
+        fnames = (char**) realloc(fnames, sizeof(char*)*nbatches);
+        for (i=0; i<nbatches; i++) fnames[i] = batches[i].fname;
+        *nfnames = nbatches;
+        free(batches);
+        iround++;
+    }
+    free(str.s);
+    if ( !iround )
+    {
+        tmpdir_remove(dir);
+        free(dir);
+        dir = NULL;
+    }
+    *tmp_dir = dir;
+    return fnames;
 }
 
 static void usage(void)
@@ -2355,12 +2669,16 @@ static void usage(void)
     fprintf(stderr, "    -i, --info-rules <tag:method,..>   rules for merging INFO fields (method is one of sum,avg,min,max,join) or \"-\" to turn off the default [DP:sum,DP4:sum]\n");
     fprintf(stderr, "    -l, --file-list <file>             read file names from the file\n");
     fprintf(stderr, "    -m, --merge <string>               allow multiallelic records for <snps|indels|both|all|none|id>, see man page for details [both]\n");
+    fprintf(stderr, "        --max-inputs <int>             merge at most <int> files at once, via temporary files in rounds\n");
     fprintf(stderr, "        --no-version                   do not append version and command line to the header\n");
     fprintf(stderr, "    -o, --output <file>                write output to a file [standard output]\n");
+    fprintf(stderr, "        --parallel                     merge chromosomes in parallel, requires --threads\n");
     fprintf(stderr, "    -O, --output-type <b|u|z|v>        'b' compressed BCF; 'u' uncompressed BCF; 'z' compressed VCF; 'v' uncompressed VCF [v]\n");
     fprintf(stderr, "    -r, --regions <region>             restrict to comma-separated list of regions\n");
     fprintf(stderr, "    -R, --regions-file <file>          restrict to regions listed in a file\n");
+    fprintf(stderr, "        --temp-dir <dir>               directory for temporary files [$TMPDIR or /tmp]\n");
     fprintf(stderr, "        --threads <int>                number of extra output compression threads [0]\n");
+    fprintf(stderr, "        --write-index                  index the output file, requires compressed output written to a file\n");
     fprintf(stderr, "\n");
     exit(1);
 }
@@ -2377,6 +2695,7 @@ int main_vcfmerge(int argc, char *argv[])
     args->record_cmd_line = 1;
     args->collapse = COLLAPSE_BOTH;
     int regions_is_file = 0;
+    char *tmp;
 
     static struct option loptions[] =
     {
@@ -2397,6 +2716,10 @@ int main_vcfmerge(int argc, char *argv[])
         {"info-rules",required_argument,NULL,'i'},
         {"no-version",no_argument,NULL,8},
         {"filter-logic",required_argument,NULL,'F'},
+        {"parallel",no_argument,NULL,10},
+        {"max-inputs",required_argument,NULL,11},
+        {"temp-dir",required_argument,NULL,12},
+        {"write-index",no_argument,NULL,13},
         {NULL,0,NULL,0}
     };
     while ((c = getopt_long(argc, argv, "hm:f:r:R:o:O:i:l:g:F:0",loptions,NULL)) >= 0) {
@@ -2440,12 +2763,19 @@ int main_vcfmerge(int argc, char *argv[])
                 break;
             case 'f': args->files->apply_filters = optarg; break;
             case 'r': args->regions_list = optarg; break;
-            case 'R': args->regions_list = optarg; regions_is_file = 1; break;
+            case 'R': args->regions_list = optarg; args->regions_is_file = regions_is_file = 1; break;
             case  1 : args->header_fname = optarg; break;
             case  2 : args->header_only = 1; break;
             case  3 : args->force_samples = 1; break;
             case  9 : args->n_threads = strtol(optarg, 0, 0); break;
             case  8 : args->record_cmd_line = 0; break;
+            case 10 : args->parallel = 1; break;
+            case 11 :
+                args->max_inputs = strtol(optarg,&tmp,10);
+                if ( *tmp || args->max_inputs<2 ) error("Could not parse argument: --max-inputs %s\n", optarg);
+                break;
+            case 12 : args->tmp_dir = optarg; break;
+            case 13 : args->write_index = 1; break;
             case 'h':
             case '?': usage();
             default: error("Unknown argument: %s\n", optarg);
@@ -2453,6 +2783,7 @@ int main_vcfmerge(int argc, char *argv[])
     }
     if ( argc==optind && !args->file_list ) usage();
     if ( argc-optind<2 && !args->file_list ) usage();
+    if ( args->write_index ) init_write_index(args->output_fname, args->output_type);
 
     args->files->require_index = 1;
     if ( args->regions_list )
@@ -2469,26 +2800,43 @@ int main_vcfmerge(int argc, char *argv[])
         }
         if ( !args->regs ) error("Could not parse the regions: %s\n", args->regions_list);
         args->regs_itr = regitr_init(args->regs);
+        regitr_set_sorted(args->regs_itr,1);
     }
 
     if ( bcf_sr_set_threads(args->files, args->n_threads)<0 ) error("Failed to create threads\n");
+
+    int i, nfiles = 0;
+    char **files = NULL;
     while (optind<argc)
     {
-        if ( !bcf_sr_add_reader(args->files, argv[optind]) ) error("Failed to open %s: %s\n", argv[optind],bcf_sr_strerror(args->files->errnum));
-        optind++;
+        files = (char**) realloc(files, sizeof(char*)*(nfiles+1));
+        files[nfiles++] = strdup(argv[optind++]);
     }
     if ( args->file_list )
     {
-        int nfiles, i;
-        char **files = hts_readlines(args->file_list, &nfiles);
-        if ( !files ) error("Failed to read from %s\n", args->file_list);
-        for (i=0;i<nfiles; i++)
-            if ( !bcf_sr_add_reader(args->files, files[i]) ) error("Failed to open %s: %s\n", files[i],bcf_sr_strerror(args->files->errnum));
-        for (i=0; i<nfiles; i++) free(files[i]);
-        free(files);
-    }
+        // the positional files come first
+        int nlist;
+        char **list = hts_readlines(args->file_list, &nlist);
+        if ( !list ) error("Failed to read from %s\n", args->file_list);
+        files = (char**) realloc(files, sizeof(char*)*(nfiles + nlist));
+        for (i=0; i<nlist; i++) files[nfiles++] = list[i];
+        free(list);
+    }
+    char *tmp_dir = NULL;
+    if ( args->max_inputs )
+        files = merge_hierarchically(args, files, &nfiles, &tmp_dir);
+    for (i=0;i<nfiles; i++)
+        if ( !bcf_sr_add_reader(args->files, files[i]) ) error("Failed to open %s: %s\n", files[i],bcf_sr_strerror(args->files->errnum));
     merge_vcf(args);
+    if ( args->write_index ) write_index(args->output_fname, args->output_type, args->n_threads);
     bcf_sr_destroy(args->files);
+    if ( tmp_dir )
+    {
+        tmpdir_remove(tmp_dir);
+        free(tmp_dir);
+    }
+    for (i=0; i<nfiles; i++) free(files[i]);
+    free(files);
     if ( args->regs ) regidx_destroy(args->regs);
     if ( args->regs_itr ) regitr_destroy(args->regs_itr);
     if ( args->gvcf_fai ) fai_destroy(args->gvcf_fai);
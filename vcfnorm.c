@@ -34,8 +34,11 @@ THE SOFTWARE.  */
 #include <htslib/vcf.h>
 #include <htslib/synced_bcf_reader.h>
 #include <htslib/faidx.h>
+#include <htslib/thread_pool.h>
+#include <htslib/khash_str2int.h>
 #include "bcftools.h"
 #include "rbuf.h"
+#include "refseq.h"
 
 #define CHECK_REF_EXIT 0
 #define CHECK_REF_WARN 1
@@ -53,7 +56,13 @@ typedef struct
 }
 map_t;
 
-typedef struct
+// Number of input records (-m-) or groups of records (-m+) processed by a
+// worker thread at once
+#define BATCH_SIZE 1000
+
+typedef struct _norm_batch_t norm_batch_t;
+
+typedef struct _args_t
 {
     char *tseq, *seq;
     int mseq;
@@ -73,14 +82,38 @@ typedef struct
     bcf_srs_t *files;       // using the synced reader only for -r option
     bcf_hdr_t *hdr;
     faidx_t *fai;
+    refseq_t *ref;          // sliding window over the reference, ref_str holds the current query
+    kstring_t ref_str;
     struct { int tot, set, swap; } nref;
     char **argv, *output_fname, *ref_fname, *vcf_fname, *region, *targets;
-    int argc, rmdup, output_type, n_threads, check_ref, strict_filter, do_indels;
+    int argc, rmdup, rmdup_exact, output_type, n_threads, check_ref, strict_filter, do_indels;
     int nchanged, nskipped, nsplit, ntotal, mrows_op, mrows_collapse, parsimonious;
-    int record_cmd_line;
+    int record_cmd_line, write_index;
+    void *dup_als;          // with -d none: alleles of the records written at dup_rid:dup_pos, but the first
+    kstring_t dup_first, dup_key;   // the first record's alleles and the current key
+    int dup_rid, dup_pos;
+    norm_batch_t *batches;  // with --threads, see norm_batch_t
+    int nbatches, nbusy, ibatch;
+    hts_tpool_process *tpool_q;
 }
 args_t;
 
+// With --threads, multiallelic records are split (-m-) or biallelic records
+// joined (-m+) by worker threads in batches. Each batch has a private copy of
+// the arguments for the scratch buffers. The batches are dispatched round-robin
+// and the results consumed in the order of dispatching, so the positional order
+// expected by the sorting buffer and flush_buffer() is preserved.
+struct _norm_batch_t
+{
+    args_t args;
+    bcf1_t **lines;         // input records; when joining, groups of nals[i] lines followed by nbls[i] lines
+    int nlines, mlines;
+    int *nals, *nbls, ngrp, mgrp;
+    bcf1_t **out;           // output records; when splitting, nout[i] records for i-th input record
+    int *nout, nout_lines, mout_lines;
+    int nsplit;
+};
+
 static inline int replace_iupac_codes(char *seq, int nseq)
 {
     // Replace ambiguity codes with N for now, it awaits to be seen what the VCF spec codifies in the end
@@ -104,6 +137,36 @@ static inline int has_non_acgtn(char *seq, int nseq)
     return 0;
 }
 
+// Length of the common suffix and prefix, comparing eight bytes at a time
+static inline int common_suffix_len(const char *a, int na, const char *b, int nb)
+{
+    int n = na < nb ? na : nb, k = 0;
+    while ( k + 8 <= n )
+    {
+        uint64_t x, y;
+        memcpy(&x, a + na - k - 8, 8);
+        memcpy(&y, b + nb - k - 8, 8);
+        if ( x!=y ) break;
+        k += 8;
+    }
+    while ( k < n && a[na-k-1]==b[nb-k-1] ) k++;
+    return k;
+}
+static inline int common_prefix_len(const char *a, int na, const char *b, int nb)
+{
+    int n = na < nb ? na : nb, k = 0;
+    while ( k + 8 <= n )
+    {
+        uint64_t x, y;
+        memcpy(&x, a + k, 8);
+        memcpy(&y, b + k, 8);
+        if ( x!=y ) break;
+        k += 8;
+    }
+    while ( k < n && a[k]==b[k] ) k++;
+    return k;
+}
+
 static void fix_ref(args_t *args, bcf1_t *line)
 {
     int reflen = strlen(line->d.allele[0]);
@@ -114,21 +177,20 @@ static void fix_ref(args_t *args, bcf1_t *line)
         if ( maxlen < len ) maxlen = len;
     }
 
-    char *ref = faidx_fetch_seq(args->fai, (char*)bcf_seqname(args->hdr,line), line->pos, line->pos+maxlen-1, &len);
+    char *ref = refseq_fetch_kstr(args->ref, bcf_seqname(args->hdr,line), line->pos, line->pos+maxlen-1, &args->ref_str, &len);
     if ( !ref ) error("faidx_fetch_seq failed at %s:%d\n", bcf_seqname(args->hdr,line),line->pos+1);
     replace_iupac_codes(ref,len);
 
     args->nref.tot++;
 
     // is the REF different?
-    if ( !strncasecmp(line->d.allele[0],ref,reflen) ) { free(ref); return; }
+    if ( !strncasecmp(line->d.allele[0],ref,reflen) ) return;
 
     // is the REF allele missing or N?
     if ( reflen==1 && (line->d.allele[0][0]=='.' || line->d.allele[0][0]=='N' || line->d.allele[0][0]=='n') ) 
     { 
         line->d.allele[0][0] = ref[0]; 
         args->nref.set++; 
-        free(ref);
         bcf_update_alleles(args->hdr,line,(const char**)line->d.allele,line->n_allele);
         return;
     }
@@ -138,7 +200,7 @@ static void fix_ref(args_t *args, bcf1_t *line)
     {
         args->nref.set++;
         bcf_update_alleles(args->hdr,line,(const char**)line->d.allele,line->n_allele);
-        if ( !strncasecmp(line->d.allele[0],ref,reflen) ) { free(ref); return; }
+        if ( !strncasecmp(line->d.allele[0],ref,reflen) ) return;
     }
 
     // is it swapped?
@@ -170,7 +232,6 @@ static void fix_ref(args_t *args, bcf1_t *line)
     }
     else
         args->nref.swap++;
-    free(ref);
 
     // swap the alleles
     int j;
@@ -272,7 +333,7 @@ static int realign(args_t *args, bcf1_t *line)
 
     // Sanity check REF
     int i, nref, reflen = strlen(line->d.allele[0]);
-    char *ref = faidx_fetch_seq(args->fai, (char*)args->hdr->id[BCF_DT_CTG][line->rid].key, line->pos, line->pos+reflen-1, &nref);
+    char *ref = refseq_fetch_kstr(args->ref, args->hdr->id[BCF_DT_CTG][line->rid].key, line->pos, line->pos+reflen-1, &args->ref_str, &nref);
     if ( !ref ) error("faidx_fetch_seq failed at %s:%d\n", args->hdr->id[BCF_DT_CTG][line->rid].key, line->pos+1);
     replace_iupac_codes(ref,nref);  // any non-ACGT character in fasta ref is replaced with N
 
@@ -283,7 +344,6 @@ static int realign(args_t *args, bcf1_t *line)
             error("Non-ACGTN reference allele at %s:%d .. REF_SEQ:'%s' vs VCF:'%s'\n", bcf_seqname(args->hdr,line),line->pos+1,ref,line->d.allele[0]);
         if ( args->check_ref & CHECK_REF_WARN )
             fprintf(stderr,"NON_ACGTN_REF\t%s\t%d\t%s\n", bcf_seqname(args->hdr,line),line->pos+1,line->d.allele[0]);
-        free(ref);
         return ERR_REF_MISMATCH;
     }
     if ( strcasecmp(ref,line->d.allele[0]) )
@@ -292,10 +352,8 @@ static int realign(args_t *args, bcf1_t *line)
             error("Reference allele mismatch at %s:%d .. REF_SEQ:'%s' vs VCF:'%s'\n", bcf_seqname(args->hdr,line),line->pos+1,ref,line->d.allele[0]);
         if ( args->check_ref & CHECK_REF_WARN )
             fprintf(stderr,"REF_MISMATCH\t%s\t%d\t%s\n", bcf_seqname(args->hdr,line),line->pos+1,line->d.allele[0]);
-        free(ref);
         return ERR_REF_MISMATCH;
     }
-    free(ref);
     ref = NULL;
 
     if ( line->n_allele == 1 ) return ERR_OK;    // a REF
@@ -323,60 +381,49 @@ static int realign(args_t *args, bcf1_t *line)
         if ( i>0 && als[i].l==als[0].l && !strcasecmp(als[0].s,als[i].s) ) return ERR_DUP_ALLELE;
     }
 
-    // trim from right
+    // trim from right: all bases of the common suffix at once, padding from
+    // the left whenever one of the alleles becomes empty
     int ori_pos = line->pos;
     while (1)
     {
-        // is the rightmost base identical in all alleles?
-        int min_len = als[0].l;
+        int min_len = als[0].l, ntrim = als[0].l;
         for (i=1; i<line->n_allele; i++)
         {
-            if ( als[0].s[ als[0].l-1 ]!=als[i].s[ als[i].l-1 ] ) break;
-            if ( als[i].l < min_len ) min_len = als[i].l;
+            int n = common_suffix_len(als[0].s,als[0].l,als[i].s,als[i].l);
+            if ( ntrim > n ) ntrim = n;
+            if ( min_len > als[i].l ) min_len = als[i].l;
         }
-        if ( i!=line->n_allele ) break; // there are differences, cannot be trimmed
-        if ( min_len<=1 && line->pos==0 ) break;
+        if ( line->pos==0 && ntrim > min_len - 1 ) ntrim = min_len - 1;
+        if ( ntrim<=0 ) break;  // there are differences, cannot be trimmed
 
-        int pad_from_left = 0;
-        for (i=0; i<line->n_allele; i++) // trim all alleles
-        {
-            als[i].l--;
-            if ( !als[i].l ) pad_from_left = 1;
-        }
-        if ( pad_from_left )
+        for (i=0; i<line->n_allele; i++) als[i].l -= ntrim;
+        if ( ntrim < min_len ) break;   // a difference or the start of the sequence
+
+        // one of the alleles is empty, pad from the left
+        int npad = line->pos >= args->aln_win ? args->aln_win : line->pos;
+        ref = refseq_fetch_kstr(args->ref, args->hdr->id[BCF_DT_CTG][line->rid].key, line->pos-npad, line->pos-1, &args->ref_str, &nref);
+        if ( !ref ) error("faidx_fetch_seq failed at %s:%d\n", args->hdr->id[BCF_DT_CTG][line->rid].key, line->pos-npad+1);
+        replace_iupac_codes(ref,nref);
+        for (i=0; i<line->n_allele; i++)
         {
-            int npad = line->pos >= args->aln_win ? args->aln_win : line->pos;
-            free(ref);
-            ref = faidx_fetch_seq(args->fai, (char*)args->hdr->id[BCF_DT_CTG][line->rid].key, line->pos-npad, line->pos-1, &nref);
-            if ( !ref ) error("faidx_fetch_seq failed at %s:%d\n", args->hdr->id[BCF_DT_CTG][line->rid].key, line->pos-npad+1);
-            replace_iupac_codes(ref,nref);
-            for (i=0; i<line->n_allele; i++)
-            {
-                ks_resize(&als[i], als[i].l + npad);
-                if ( als[i].l ) memmove(als[i].s+npad,als[i].s,als[i].l);
-                memcpy(als[i].s,ref,npad);
-                als[i].l += npad;
-            }
-            line->pos -= npad;
+            ks_resize(&als[i], als[i].l + npad);
+            if ( als[i].l ) memmove(als[i].s+npad,als[i].s,als[i].l);
+            memcpy(als[i].s,ref,npad);
+            als[i].l += npad;
         }
+        line->pos -= npad;
     }
-    free(ref);
 
-    // trim from left
-    int ntrim_left = 0;
-    while (1)
+    // trim from left, keeping at least one base in each allele
+    int min_len = als[0].l, ntrim_left = als[0].l;
+    for (i=1; i<line->n_allele; i++)
     {
-        // is the first base identical in all alleles?
-        int min_len = als[0].l - ntrim_left;
-        for (i=1; i<line->n_allele; i++)
-        {
-            if ( als[0].s[ntrim_left]!=als[i].s[ntrim_left] ) break;
-            if ( min_len > als[i].l - ntrim_left ) min_len = als[i].l - ntrim_left;
-        }
-        if ( i!=line->n_allele || min_len<=1 ) break; // there are differences, cannot be trimmed
-        ntrim_left++;
+        int n = common_prefix_len(als[0].s,als[0].l,als[i].s,als[i].l);
+        if ( ntrim_left > n ) ntrim_left = n;
+        if ( min_len > als[i].l ) min_len = als[i].l;
     }
-    if ( ntrim_left )
+    if ( ntrim_left > min_len - 1 ) ntrim_left = min_len - 1;
+    if ( ntrim_left > 0 )
     {
         for (i=0; i<line->n_allele; i++)
         {
@@ -1424,6 +1471,7 @@ static void merge_biallelics_to_multiallelic(args_t *args, bcf1_t *dst, bcf1_t *
 }
 
 #define SWAP(type_t, a, b) { type_t t = a; a = b; b = t; }
+static void mrows_push(args_t *args, htsFile *out, bcf1_t **line);
 static void mrows_schedule(args_t *args, bcf1_t **line)
 {
     int i,m;
@@ -1491,6 +1539,35 @@ static bcf1_t *mrows_flush(args_t *args)
     }
     return NULL;
 }
+// With -d none, check if a record with the same REF and ALT alleles was
+// output at this position already. The records come sorted and normalized,
+// so it is enough to remember the alleles seen at the current position: the
+// first record needs only a string comparison, the rest a hash lookup
+static int is_exact_dup(args_t *args, bcf1_t *line)
+{
+    bcf_unpack(line, BCF_UN_STR);
+    kstring_t *key = line->rid==args->dup_rid && line->pos==args->dup_pos ? &args->dup_key : &args->dup_first;
+    int i;
+    key->l = 0;
+    for (i=0; i<line->n_allele; i++)
+    {
+        if ( i ) kputc(',', key);
+        kputs(line->d.allele[i], key);
+    }
+    if ( key==&args->dup_first )
+    {
+        // new position, forget the alleles seen at the previous one
+        if ( khash_str2int_size(args->dup_als) ) khash_str2int_clear_free(args->dup_als);
+        args->dup_rid = line->rid;
+        args->dup_pos = line->pos;
+        return 0;
+    }
+    if ( !strcmp(key->s, args->dup_first.s) ) return 1;
+    if ( khash_str2int_has_key(args->dup_als, key->s) ) return 1;
+    khash_str2int_inc(args->dup_als, strdup(key->s));
+    return 0;
+}
+
 static void flush_buffer(args_t *args, htsFile *file, int n)
 {
     bcf1_t *line;
@@ -1498,11 +1575,13 @@ static void flush_buffer(args_t *args, htsFile *file, int n)
     for (i=0; i<n; i++)
     {
         k = rbuf_shift(&args->rbuf);
+        if ( args->rmdup_exact && is_exact_dup(args, args->lines[k]) ) continue;
         if ( args->mrows_op==MROWS_MERGE )
         {
             if ( mrows_ready_to_flush(args, args->lines[k]) )
             {
-                while ( (line=mrows_flush(args)) ) bcf_write1(file, args->hdr, line);
+                if ( args->batches ) mrows_push(args, file, NULL);
+                else while ( (line=mrows_flush(args)) ) bcf_write1(file, args->hdr, line);
             }
             int merge = 1;
             if ( args->mrows_collapse!=COLLAPSE_BOTH && args->mrows_collapse!=COLLAPSE_ANY )
@@ -1514,25 +1593,27 @@ static void flush_buffer(args_t *args, htsFile *file, int n)
                 mrows_schedule(args, &args->lines[k]);
                 continue;
             }
+            if ( args->batches ) { mrows_push(args, file, &args->lines[k]); continue; }
         }
         bcf_write1(file, args->hdr, args->lines[k]);
     }
     if ( args->mrows_op==MROWS_MERGE && !args->rbuf.n )
     {
-        while ( (line=mrows_flush(args)) ) bcf_write1(file, args->hdr, line);
+        if ( args->batches ) { if ( args->nalines || args->nblines ) mrows_push(args, file, NULL); }
+        else while ( (line=mrows_flush(args)) ) bcf_write1(file, args->hdr, line);
     }
 }
 
-static void init_data(args_t *args)
+static void init_scratch(args_t *args)
 {
-    args->hdr = args->files->readers[0].header;
-    rbuf_init(&args->rbuf, 100);
-    args->lines = (bcf1_t**) calloc(args->rbuf.m, sizeof(bcf1_t*));
-    if ( args->ref_fname )
-    {
-        args->fai = fai_load(args->ref_fname);
-        if ( !args->fai ) error("Failed to load the fai index: %s\n", args->ref_fname);
-    }
+    args->tmp_lines = args->alines = args->blines = NULL;
+    args->ntmp_lines = args->mtmp_lines = args->nalines = args->malines = args->nblines = args->mblines = 0;
+    args->maps = NULL; args->mmaps = 0;
+    args->als  = NULL; args->nals = args->mals = 0;
+    args->tmp_arr1 = args->tmp_arr2 = NULL; args->ntmp_arr1 = args->ntmp_arr2 = 0;
+    args->tmp_als = NULL; args->ntmp_als = 0;
+    memset(&args->tmp_als_str, 0, sizeof(args->tmp_als_str));
+    args->mrow_out = NULL; args->tmp_str = NULL; args->diploid = NULL;
     if ( args->mrows_op==MROWS_MERGE )
     {
         args->mrow_out = bcf_init1();
@@ -1541,12 +1622,9 @@ static void init_data(args_t *args)
     }
 }
 
-static void destroy_data(args_t *args)
+static void destroy_scratch(args_t *args)
 {
     int i;
-    for (i=0; i<args->rbuf.m; i++)
-        if ( args->lines[i] ) bcf_destroy1(args->lines[i]);
-    free(args->lines);
     for (i=0; i<args->mtmp_lines; i++)
         if ( args->tmp_lines[i] ) bcf_destroy1(args->tmp_lines[i]);
     free(args->tmp_lines);
@@ -1573,8 +1651,67 @@ static void destroy_data(args_t *args)
     free(args->tmp_arr2);
     free(args->diploid);
     if ( args->mrow_out ) bcf_destroy1(args->mrow_out);
+}
+
+static void init_data(args_t *args)
+{
+    args->hdr = args->files->readers[0].header;
+    rbuf_init(&args->rbuf, 100);
+    args->lines = (bcf1_t**) calloc(args->rbuf.m, sizeof(bcf1_t*));
+    args->dup_als = khash_str2int_init();
+    args->dup_rid = -1;
+    if ( args->ref_fname )
+    {
+        args->fai = fai_load(args->ref_fname);
+        if ( !args->fai ) error("Failed to load the fai index: %s\n", args->ref_fname);
+        args->ref = refseq_init(args->fai, 0);
+    }
+    init_scratch(args);
+
+    // two batches per thread keep the workers busy while the output is written
+    if ( args->n_threads && args->mrows_op )
+    {
+        int i;
+        args->nbatches = 2*args->n_threads;
+        args->batches  = (norm_batch_t*) calloc(args->nbatches, sizeof(norm_batch_t));
+        for (i=0; i<args->nbatches; i++)
+        {
+            args->batches[i].args = *args;
+            init_scratch(&args->batches[i].args);
+        }
+        args->tpool_q = hts_tpool_process_init(args->files->p->pool, args->nbatches, 0);
+        if ( !args->tpool_q ) error("Failed to initialize the thread pool queue\n");
+    }
+}
+
+static void destroy_data(args_t *args)
+{
+    int i,j;
+    for (i=0; i<args->rbuf.m; i++)
+        if ( args->lines[i] ) bcf_destroy1(args->lines[i]);
+    free(args->lines);
+    destroy_scratch(args);
+    for (i=0; i<args->nbatches; i++)
+    {
+        norm_batch_t *batch = &args->batches[i];
+        destroy_scratch(&batch->args);
+        for (j=0; j<batch->mlines; j++) bcf_destroy1(batch->lines[j]);
+        for (j=0; j<batch->mout_lines; j++) bcf_destroy1(batch->out[j]);
+        free(batch->lines);
+        free(batch->out);
+        free(batch->nout);
+        free(batch->nals);
+        free(batch->nbls);
+    }
+    free(args->batches);
+    if ( args->tpool_q ) hts_tpool_process_destroy(args->tpool_q);
+    refseq_destroy(args->ref);
+    free(args->ref_str.s);
     if ( args->fai ) fai_destroy(args->fai);
     if ( args->mseq ) free(args->seq);
+    khash_str2int_destroy_free(args->dup_als);
+    free(args->dup_first.s);
+    free(args->dup_key.s);
 }
 
 
@@ -1619,6 +1756,182 @@ static void normalize_line(args_t *args, bcf1_t **line_ptr)
     }
 }
 
+static int needs_split(args_t *args, bcf1_t *line)
+{
+    if ( args->mrows_op!=MROWS_SPLIT ) return 0;
+    if ( args->mrows_collapse!=COLLAPSE_BOTH && args->mrows_collapse!=COLLAPSE_ANY )
+    {
+        if ( !(bcf_get_variant_types(line) & args->mrows_collapse) ) return 0;
+    }
+    return line->n_allele>2 ? 1 : 0;
+}
+
+// Normalize and buffer the records created from a single input record, flush
+// the lines which cannot change order anymore
+static void buffer_lines(args_t *args, htsFile *out, bcf1_t **lines, int nlines)
+{
+    // still on the same chromosome?
+    int i,j,ilast = rbuf_last(&args->rbuf);
+    if ( ilast>=0 && lines[0]->rid != args->lines[ilast]->rid ) flush_buffer(args, out, args->rbuf.n); // new chromosome
+
+    for (j=0; j<nlines; j++)
+        normalize_line(args, &lines[j]);
+
+    // find out how many sites to flush
+    ilast = rbuf_last(&args->rbuf);
+    j = 0;
+    for (i=-1; rbuf_next(&args->rbuf,&i); )
+    {
+        if ( args->lines[ilast]->pos - args->lines[i]->pos < args->buf_win ) break;
+        j++;
+    }
+    if ( j>0 ) flush_buffer(args, out, j);
+}
+
+static inline bcf1_t **batch_out_line(norm_batch_t *batch)
+{
+    int i, m = batch->mout_lines;
+    hts_expand(bcf1_t*,batch->nout_lines+1,batch->mout_lines,batch->out);
+    for (i=m; i<batch->mout_lines; i++) batch->out[i] = bcf_init1();
+    return &batch->out[batch->nout_lines++];
+}
+
+static void *process_batch(void *arg)
+{
+    norm_batch_t *batch = (norm_batch_t*) arg;
+    args_t *args = &batch->args;
+    int i, j, k = 0;
+    batch->nout_lines = 0;
+    if ( args->mrows_op==MROWS_SPLIT )
+    {
+        hts_expand(int,batch->nlines,batch->mgrp,batch->nout);
+        for (i=0; i<batch->nlines; i++)
+        {
+            if ( !needs_split(args, batch->lines[i]) )
+            {
+                bcf1_t **dst = batch_out_line(batch);
+                SWAP(bcf1_t*, batch->lines[i], *dst);
+                batch->nout[i] = 1;
+                continue;
+            }
+            batch->nsplit++;
+            split_multiallelic_to_biallelics(args, batch->lines[i]);
+            for (j=0; j<args->ntmp_lines; j++)
+            {
+                bcf1_t **dst = batch_out_line(batch);
+                SWAP(bcf1_t*, args->tmp_lines[j], *dst);
+            }
+            batch->nout[i] = args->ntmp_lines;
+        }
+        return batch;
+    }
+
+    // join the groups of lines, the groups are scheduled by the main thread
+    for (i=0; i<batch->ngrp; i++)
+    {
+        int m;
+        args->nalines = batch->nals[i];
+        args->nblines = batch->nbls[i];
+        m = args->malines;
+        hts_expand(bcf1_t*,args->nalines,args->malines,args->alines);
+        for (j=m; j<args->malines; j++) args->alines[j] = bcf_init1();
+        m = args->mblines;
+        hts_expand(bcf1_t*,args->nblines,args->mblines,args->blines);
+        for (j=m; j<args->mblines; j++) args->blines[j] = bcf_init1();
+        for (j=0; j<args->nalines; j++) SWAP(bcf1_t*, args->alines[j], batch->lines[k++]);
+        for (j=0; j<args->nblines; j++) SWAP(bcf1_t*, args->blines[j], batch->lines[k++]);
+
+        bcf1_t *line;
+        while ( (line=mrows_flush(args)) )
+        {
+            bcf1_t **dst = batch_out_line(batch);
+            if ( line==args->mrow_out ) { SWAP(bcf1_t*, *dst, args->mrow_out); }
+            else if ( line==args->alines[0] ) { SWAP(bcf1_t*, *dst, args->alines[0]); }
+            else { SWAP(bcf1_t*, *dst, args->blines[0]); }
+        }
+    }
+    return batch;
+}
+
+// Wait for the oldest dispatched batch and pass its records on
+static void consume_batch(args_t *args, htsFile *out)
+{
+    hts_tpool_result *res = hts_tpool_next_result_wait(args->tpool_q);
+    if ( !res ) error("Failed to retrieve the processed records\n");
+    norm_batch_t *batch = (norm_batch_t*) hts_tpool_result_data(res);
+    int i, k = 0;
+    if ( args->mrows_op==MROWS_SPLIT )
+    {
+        for (i=0; i<batch->nlines; i++)
+        {
+            buffer_lines(args, out, batch->out + k, batch->nout[i]);
+            k += batch->nout[i];
+        }
+    }
+    else
+    {
+        for (i=0; i<batch->nout_lines; i++)
+            bcf_write1(out, args->hdr, batch->out[i]);
+    }
+    batch->nlines = batch->ngrp = 0;
+    hts_tpool_delete_result(res, 0);
+    args->nbusy--;
+}
+
+static void dispatch_batch(args_t *args, htsFile *out)
+{
+    norm_batch_t *batch = &args->batches[args->ibatch];
+    if ( !batch->nlines ) return;
+    if ( hts_tpool_dispatch(args->files->p->pool, args->tpool_q, process_batch, batch) < 0 )
+        error("Failed to dispatch the records to the thread pool\n");
+    args->nbusy++;
+    args->ibatch = (args->ibatch + 1) % args->nbatches;
+    if ( args->nbusy==args->nbatches ) consume_batch(args, out);
+}
+
+static inline bcf1_t **batch_in_line(norm_batch_t *batch)
+{
+    int i, m = batch->mlines;
+    hts_expand(bcf1_t*,batch->nlines+1,batch->mlines,batch->lines);
+    for (i=m; i<batch->mlines; i++) batch->lines[i] = bcf_init1();
+    return &batch->lines[batch->nlines++];
+}
+
+// With --threads -m+, move the scheduled lines to the current batch as a new
+// group, or a single line to be output unchanged
+static void mrows_push(args_t *args, htsFile *out, bcf1_t **line)
+{
+    int i;
+    norm_batch_t *batch = &args->batches[args->ibatch];
+    hts_expand(int,batch->ngrp+1,batch->mgrp,batch->nals);
+    batch->nbls = (int*) realloc(batch->nbls, sizeof(int)*batch->mgrp);
+    if ( line )
+    {
+        bcf1_t **dst = batch_in_line(batch);
+        SWAP(bcf1_t*, *line, *dst);
+        batch->nals[batch->ngrp] = 1;
+        batch->nbls[batch->ngrp] = 0;
+    }
+    else
+    {
+        for (i=0; i<args->nalines; i++)
+        {
+            bcf1_t **dst = batch_in_line(batch);
+            SWAP(bcf1_t*, args->alines[i], *dst);
+        }
+        for (i=0; i<args->nblines; i++)
+        {
+            bcf1_t **dst = batch_in_line(batch);
+            SWAP(bcf1_t*, args->blines[i], *dst);
+        }
+        batch->nals[batch->ngrp] = args->nalines;
+        batch->nbls[batch->ngrp] = args->nblines;
+        args->nalines = args->nblines = 0;
+    }
+    batch->ngrp++;
+    if ( batch->ngrp >= BATCH_SIZE ) dispatch_batch(args, out);
+}
+
 static void normalize_vcf(args_t *args)
 {
     htsFile *out = hts_open(args->output_fname, hts_bcf_wmode(args->output_type));
@@ -1652,42 +1965,39 @@ static void normalize_vcf(args_t *args)
             prev_type |= line_type;
         }
 
-        // still on the same chromosome?
-        int i,j,ilast = rbuf_last(&args->rbuf);
-        if ( ilast>=0 && line->rid != args->lines[ilast]->rid ) flush_buffer(args, out, args->rbuf.n); // new chromosome
-
-        int split = 0;
-        if ( args->mrows_op==MROWS_SPLIT )
+        if ( args->batches && args->mrows_op==MROWS_SPLIT )
         {
-            split = 1;
-            if ( args->mrows_collapse!=COLLAPSE_BOTH && args->mrows_collapse!=COLLAPSE_ANY )
-            {
-                if ( !(bcf_get_variant_types(line) & args->mrows_collapse) ) split = 0;
-            }
-            if ( split && line->n_allele>2 )
-            {
-                args->nsplit++;
-                split_multiallelic_to_biallelics(args, line);
-                for (j=0; j<args->ntmp_lines; j++)
-                    normalize_line(args, &args->tmp_lines[j]);
-            }
-            else
-                split = 0;
+            // split by the workers, normalized by consume_batch()
+            norm_batch_t *batch = &args->batches[args->ibatch];
+            bcf1_t **dst = batch_in_line(batch);
+            SWAP(bcf1_t*, args->files->readers[0].buffer[0], *dst);
+            if ( batch->nlines >= BATCH_SIZE ) dispatch_batch(args, out);
+            continue;
         }
-        if ( !split )
-            normalize_line(args, &args->files->readers[0].buffer[0]);
-
-        // find out how many sites to flush
-        ilast = rbuf_last(&args->rbuf);
-        j = 0;
-        for (i=-1; rbuf_next(&args->rbuf,&i); )
+        if ( needs_split(args, line) )
         {
-            if ( args->lines[ilast]->pos - args->lines[i]->pos < args->buf_win ) break;
-            j++;
+            args->nsplit++;
+            split_multiallelic_to_biallelics(args, line);
+            buffer_lines(args, out, args->tmp_lines, args->ntmp_lines);
         }
-        if ( j>0 ) flush_buffer(args, out, j);
+        else
+            buffer_lines(args, out, &args->files->readers[0].buffer[0], 1);
     }
-    flush_buffer(args, out, args->rbuf.n);
+    if ( args->batches )
+    {
+        if ( args->mrows_op==MROWS_SPLIT )
+        {
+            dispatch_batch(args, out);
+            while ( args->nbusy ) consume_batch(args, out);
+        }
+        flush_buffer(args, out, args->rbuf.n);
+        dispatch_batch(args, out);
+        while ( args->nbusy ) consume_batch(args, out);
+        int i;
+        for (i=0; i<args->nbatches; i++) args->nsplit += args->batches[i].nsplit;
+    }
+    else
+        flush_buffer(args, out, args->rbuf.n);
     hts_close(out);
 
     fprintf(stderr,"Lines   total/split/realigned/skipped:\t%d/%d/%d/%d\n", args->ntotal,args->nsplit,args->nchanged,args->nskipped);
@@ -1705,8 +2015,8 @@ static void usage(void)
     fprintf(stderr, "\n");
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "    -c, --check-ref <e|w|x|s>         check REF alleles and exit (e), warn (w), exclude (x), or set (s) bad sites [e]\n");
-    fprintf(stderr, "    -D, --remove-duplicates           remove duplicate lines of the same type.\n");
-    fprintf(stderr, "    -d, --rm-dup <type>               remove duplicate snps|indels|both|any\n");
+    fprintf(stderr, "    -D, --remove-duplicates           remove duplicate lines with identical alleles, same as -d none\n");
+    fprintf(stderr, "    -d, --rm-dup <type>               remove duplicate snps|indels|both|all|none\n");
     fprintf(stderr, "    -f, --fasta-ref <file>            reference sequence (MANDATORY)\n");
     fprintf(stderr, "    -m, --multiallelics <-|+>[type]   split multiallelics (-) or join biallelics (+), type: snps|indels|both|any [both]\n");
     fprintf(stderr, "        --no-version                  do not append version and command line to the header\n");
@@ -1718,7 +2028,8 @@ static void usage(void)
     fprintf(stderr, "    -s, --strict-filter               when merging (-m+), merged site is PASS only if all sites being merged PASS\n");
     fprintf(stderr, "    -t, --targets <region>            similar to -r but streams rather than index-jumps\n");
     fprintf(stderr, "    -T, --targets-file <file>         similar to -R but streams rather than index-jumps\n");
-    fprintf(stderr, "        --threads <int>               number of extra (de)compression threads [0]\n");
+    fprintf(stderr, "        --threads <int>               number of extra (de)compression threads, with -m also splitting/joining threads [0]\n");
+    fprintf(stderr, "        --write-index                 index the output file, requires compressed output written to a file\n");
     fprintf(stderr, "    -w, --site-win <int>              buffer for sorting lines which changed position during realignment [1000]\n");
     fprintf(stderr, "\n");
     exit(1);
@@ -1760,6 +2071,7 @@ int main_vcfnorm(int argc, char *argv[])
         {"check-ref",required_argument,NULL,'c'},
         {"strict-filter",no_argument,NULL,'s'},
         {"no-version",no_argument,NULL,8},
+        {"write-index",no_argument,NULL,10},
         {NULL,0,NULL,0}
     };
     char *tmp;
@@ -1770,7 +2082,8 @@ int main_vcfnorm(int argc, char *argv[])
                 if ( !strcmp("snps",optarg) ) args->rmdup = COLLAPSE_SNPS<<1;
                 else if ( !strcmp("indels",optarg) ) args->rmdup = COLLAPSE_INDELS<<1;
                 else if ( !strcmp("both",optarg) ) args->rmdup = COLLAPSE_BOTH<<1;
-                else if ( !strcmp("any",optarg) ) args->rmdup = COLLAPSE_ANY<<1;
+                else if ( !strcmp("any",optarg) || !strcmp("all",optarg) ) args->rmdup = COLLAPSE_ANY<<1;
+                else if ( !strcmp("none",optarg) ) args->rmdup_exact = 1;
                 else error("The argument to -d not recognised: %s\n", optarg);
                 break;
             case 'm':
@@ -1803,8 +2116,8 @@ int main_vcfnorm(int argc, char *argv[])
                 break;
             case 'o': args->output_fname = optarg; break;
             case 'D':
-                fprintf(stderr,"Warning: `-D` is functional but deprecated, replaced by `-d both`.\n"); 
-                args->rmdup = COLLAPSE_NONE<<1;
+                fprintf(stderr,"Warning: `-D` is functional but deprecated, replaced by `-d none`.\n"); 
+                args->rmdup_exact = 1;
                 break;
             case 's': args->strict_filter = 1; break;
             case 'f': args->ref_fname = optarg; break;
@@ -1818,14 +2131,16 @@ int main_vcfnorm(int argc, char *argv[])
                 break;
             case  9 : args->n_threads = strtol(optarg, 0, 0); break;
             case  8 : args->record_cmd_line = 0; break;
+            case 10 : args->write_index = 1; break;
             case 'h':
             case '?': usage();
             default: error("Unknown argument: %s\n", optarg);
         }
     }
     if ( argc>optind+1 ) usage();
-    if ( !args->ref_fname && !args->mrows_op && !args->rmdup ) usage();
+    if ( !args->ref_fname && !args->mrows_op && !args->rmdup && !args->rmdup_exact ) usage();
     if ( !args->ref_fname && args->check_ref&CHECK_REF_FIX ) error("Expected --fasta-ref with --check-ref s\n");
+    if ( args->write_index ) init_write_index(args->output_fname, args->output_type);
     char *fname = NULL;
     if ( optind>=argc )
     {
@@ -1847,9 +2162,10 @@ int main_vcfnorm(int argc, char *argv[])
 
     if ( bcf_sr_set_threads(args->files, args->n_threads)<0 ) error("Failed to create threads\n");
     if ( !bcf_sr_add_reader(args->files, fname) ) error("Failed to open %s: %s\n", fname,bcf_sr_strerror(args->files->errnum));
-    if ( args->mrows_op&MROWS_SPLIT && args->rmdup ) error("Cannot combine -D and -m-\n");
+    if ( args->mrows_op&MROWS_SPLIT && (args->rmdup || args->rmdup_exact) ) error("Cannot combine -D and -m-\n");
     init_data(args);
     normalize_vcf(args);
+    if ( args->write_index ) write_index(args->output_fname, args->output_type, args->n_threads);
     destroy_data(args);
     bcf_sr_destroy(args->files);
     free(args);
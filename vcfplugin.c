@@ -37,6 +37,7 @@ THE SOFTWARE.  */
 #include <htslib/synced_bcf_reader.h>
 #include <htslib/kseq.h>
 #include <htslib/khash_str2int.h>
+#include <htslib/thread_pool.h>
 #include <dlfcn.h>
 #include "bcftools.h"
 #include "vcmp.h"
@@ -66,6 +67,18 @@ typedef struct _plugin_t plugin_t;
  *   bcf1_t *process(bcf1_t *rec)
  *      - called for each VCF record, return NULL for no output
  *
+ *   int process_batch(bcf1_t **recs, int nrecs)
+ *      - optional, called instead of process() with batches of records. The
+ *      plugin can replace recs[i] by NULL for no output. Return 0 on success
+ *      or -1 on critical errors
+ *
+ *   int thread_safe
+ *      - optional, a non-zero value tells that process() or process_batch()
+ *      can be called concurrently, each call with different records. The
+ *      batches are then processed in parallel with --threads and written in
+ *      the input order. Such a plugin must keep no state between records
+ *      and must output only the records it was given
+ *
  *   void destroy(void)
  *      - called after all lines have been processed to clean up
  */
@@ -75,6 +88,7 @@ typedef int (*dl_init_f) (int, char **, bcf_hdr_t *, bcf_hdr_t *);
 typedef char* (*dl_about_f) (void);
 typedef char* (*dl_usage_f) (void);
 typedef bcf1_t* (*dl_process_f) (bcf1_t *);
+typedef int (*dl_process_batch_f) (bcf1_t **, int);
 typedef void (*dl_destroy_f) (void);
 
 struct _plugin_t
@@ -87,10 +101,23 @@ struct _plugin_t
     dl_about_f about;
     dl_usage_f usage;
     dl_process_f process;
+    dl_process_batch_f process_batch;
     dl_destroy_f destroy;
+    int thread_safe;
     void *handle;
 };
 
+#define BATCH_SIZE 1000
+
+typedef struct
+{
+    plugin_t *plugins;
+    int nplugins;
+    bcf1_t **lines, **out;  // the copies of input records and the records to output
+    int nlines, nout;
+}
+batch_t;
+
 
 struct _args_t;
 
@@ -136,12 +163,21 @@ typedef struct _args_t
     char *filter_str;
     int filter_logic;   // include or exclude sites which match the filters? One of FLT_INCLUDE/FLT_EXCLUDE
 
-    plugin_t plugin;
+    // Plugins chained in one process, each gets the output header of the previous one
+    plugin_t *plugins;
+    int nplugins;
+    bcf_hdr_t **hdrs;       // input header of plugin i, hdrs[nplugins] is hdr_out
     int nplugin_paths;
     char **plugin_paths;
 
     char **argv, *output_fname, *regions_list, *targets_list;
     int argc, drop_header, verbose, record_cmd_line;
+
+    // Batches of records for process_batch() or, with a thread-safe plugin and
+    // --threads, for processing in parallel
+    batch_t *batches;
+    int nbatches, nbusy;
+    hts_tpool_process *tpool_q;
 }
 args_t;
 
@@ -307,14 +343,30 @@ static int load_plugin(args_t *args, const char *fname, int exit_on_error, plugi
 
     if ( plugin->run ) return 0;
 
+    plugin->process_batch = (dl_process_batch_f) dlsym(plugin->handle, "process_batch");
+    ret = dlerror();
+    if ( ret )
+        plugin->process_batch = NULL;
+    else
+        if ( args->verbose > 1 ) fprintf(stderr,"\tprocess_batch .. ok\n");
+
     plugin->process = (dl_process_f) dlsym(plugin->handle, "process");
     ret = dlerror();
     if ( ret )
     {
-        if ( exit_on_error ) error("Could not initialize %s: %s\n", plugin->name, ret);
-        return -1;
+        plugin->process = NULL;
+        if ( !plugin->process_batch )
+        {
+            if ( exit_on_error ) error("Could not initialize %s: %s\n", plugin->name, ret);
+            return -1;
+        }
     }
 
+    int *thread_safe = (int*) dlsym(plugin->handle, "thread_safe");
+    ret = dlerror();
+    plugin->thread_safe = !ret && thread_safe && *thread_safe ? 1 : 0;
+    if ( plugin->thread_safe && args->verbose > 1 ) fprintf(stderr,"\tthread_safe .. ok\n");
+
     plugin->destroy = (dl_destroy_f) dlsym(plugin->handle, "destroy");
     ret = dlerror();
     if ( ret )
@@ -326,27 +378,81 @@ static int load_plugin(args_t *args, const char *fname, int exit_on_error, plugi
     return 0;
 }
 
-static void init_plugin(args_t *args)
+static void init_plugin(args_t *args, plugin_t *plugin, bcf_hdr_t *in_hdr, bcf_hdr_t *out_hdr)
 {
     static int warned_bcftools = 0, warned_htslib = 0;
 
-    int ret = args->plugin.init(args->plugin.argc,args->plugin.argv,args->hdr,args->hdr_out);
+    int ret = plugin->init(plugin->argc,plugin->argv,in_hdr,out_hdr);
     if ( ret<0 ) error("The plugin exited with an error.\n");
     const char *bver, *hver;
-    args->plugin.version(&bver, &hver);
+    plugin->version(&bver, &hver);
     if ( strcmp(bver,bcftools_version()) && !warned_bcftools )
     {
-        fprintf(stderr,"WARNING: bcftools version mismatch .. bcftools at %s, the plugin \"%s\" at %s\n", bcftools_version(),args->plugin.name,bver);
+        fprintf(stderr,"WARNING: bcftools version mismatch .. bcftools at %s, the plugin \"%s\" at %s\n", bcftools_version(),plugin->name,bver);
         warned_bcftools = 1;
     }
     if ( strcmp(hver,hts_version()) && !warned_htslib )
     {
-        fprintf(stderr,"WARNING: htslib version mismatch .. bcftools at %s, the plugin \"%s\" at %s\n", hts_version(),args->plugin.name,hver);
+        fprintf(stderr,"WARNING: htslib version mismatch .. bcftools at %s, the plugin \"%s\" at %s\n", hts_version(),plugin->name,hver);
         warned_htslib = 1;
     }
     args->drop_header += ret;
 }
 
+// Load a comma-separated list of plugins, the names can be given with the "+" prefix
+static void load_plugins(args_t *args, const char *names)
+{
+    char *tmp = strdup(names), *ss = tmp;
+    while ( 1 )
+    {
+        char *se = ss;
+        while ( *se && *se!=',' ) se++;
+        int last = *se ? 0 : 1;
+        *se = 0;
+        if ( *ss=='+' ) ss++;
+        if ( !*ss ) error("Could not parse the list of plugins: %s\n", names);
+        args->nplugins++;
+        args->plugins = (plugin_t*) realloc(args->plugins, sizeof(plugin_t)*args->nplugins);
+        plugin_t *plugin = &args->plugins[args->nplugins-1];
+        memset(plugin, 0, sizeof(plugin_t));
+        load_plugin(args, ss, 1, plugin);
+        if ( last ) break;
+        ss = se + 1;
+    }
+    free(tmp);
+
+    int i, j;
+    for (i=0; i<args->nplugins; i++)
+    {
+        if ( args->plugins[i].run && args->nplugins>1 ) error("The plugin %s cannot be chained with other plugins\n", args->plugins[i].name);
+
+        // dlopen returns the same handle again, the instances would share the plugin's static variables
+        for (j=0; j<i; j++)
+            if ( args->plugins[i].handle==args->plugins[j].handle )
+                error("The plugin %s cannot be given more than once in the chain\n", args->plugins[i].name);
+    }
+}
+
+// With multiple plugins, the plugin options are separated by "--", in the order of plugins
+static void set_plugin_args(args_t *args, int argc, char **argv)
+{
+    int i, j = 1;
+    for (i=0; i<args->nplugins; i++)
+    {
+        plugin_t *plugin = &args->plugins[i];
+        plugin->argv = (char**) malloc(sizeof(char*)*(argc+1));
+        plugin->argv[0] = argv[0];
+        plugin->argc = 1;
+        for (; j<argc; j++)
+        {
+            if ( args->nplugins>1 && !strcmp("--",argv[j]) ) { j++; break; }
+            plugin->argv[plugin->argc++] = argv[j];
+        }
+        plugin->argv[plugin->argc] = NULL;
+    }
+    if ( j<argc ) error("Too many \"--\" separated plugin option groups: %d plugins given\n", args->nplugins);
+}
+
 static int cmp_plugin_name(const void *p1, const void *p2)
 {
     plugin_t *a = (plugin_t*) p1;
@@ -410,9 +516,19 @@ static int list_plugins(args_t *args)
 static void init_data(args_t *args)
 {
     args->hdr = args->files->readers[0].header;
-    args->hdr_out = bcf_hdr_dup(args->hdr);
+    args->hdrs = (bcf_hdr_t**) malloc(sizeof(bcf_hdr_t*)*(args->nplugins+1));
+    args->hdrs[0] = args->hdr;
 
-    init_plugin(args);
+    int i, parallel = args->n_threads ? 1 : 0, batched = 0;
+    for (i=0; i<args->nplugins; i++)
+    {
+        args->hdrs[i+1] = bcf_hdr_dup(args->hdrs[i]);
+        init_plugin(args, &args->plugins[i], args->hdrs[i], args->hdrs[i+1]);
+        bcf_hdr_sync(args->hdrs[i+1]);
+        if ( !args->plugins[i].thread_safe ) parallel = 0;
+        if ( args->plugins[i].process_batch ) batched = 1;
+    }
+    args->hdr_out = args->hdrs[args->nplugins];
 
     if ( args->filter_str )
         args->filter = filter_init(args->hdr, args->filter_str);
@@ -425,17 +541,58 @@ static void init_data(args_t *args)
         if ( args->n_threads ) hts_set_threads(args->out_fh, args->n_threads);
         bcf_hdr_write(args->out_fh, args->hdr_out);
     }
+
+    if ( batched || parallel )
+    {
+        // two batches per thread keep the workers busy while the output is written
+        args->nbatches = parallel ? 2*args->n_threads : 1;
+        args->batches  = (batch_t*) calloc(args->nbatches, sizeof(batch_t));
+        for (i=0; i<args->nbatches; i++)
+        {
+            batch_t *batch = &args->batches[i];
+            batch->plugins  = args->plugins;
+            batch->nplugins = args->nplugins;
+            batch->lines  = (bcf1_t**) calloc(BATCH_SIZE, sizeof(bcf1_t*));
+            batch->out    = (bcf1_t**) malloc(sizeof(bcf1_t*)*BATCH_SIZE);
+        }
+    }
+    if ( parallel )
+    {
+        args->tpool_q = hts_tpool_process_init(args->files->p->pool, args->nbatches, 0);
+        if ( !args->tpool_q ) error("Failed to initialize the thread pool queue\n");
+    }
 }
 
 static void destroy_data(args_t *args)
 {
-    free(args->plugin.name);
-    if ( args->plugin.destroy ) args->plugin.destroy();
-    dlclose(args->plugin.handle);
-    if ( args->hdr_out ) bcf_hdr_destroy(args->hdr_out);
+    int i, j;
+    for (i=0; i<args->nbatches; i++)
+    {
+        batch_t *batch = &args->batches[i];
+        for (j=0; j<BATCH_SIZE; j++)
+            if ( batch->lines[j] ) bcf_destroy(batch->lines[j]);
+        free(batch->lines);
+        free(batch->out);
+    }
+    free(args->batches);
+    if ( args->tpool_q ) hts_tpool_process_destroy(args->tpool_q);
+
+    // the plugins can access their input header in destroy(), which is the
+    // output header of the previous plugin: destroy all before freeing any
+    for (i=0; i<args->nplugins; i++)
+        if ( args->plugins[i].destroy ) args->plugins[i].destroy();
+    for (i=0; i<args->nplugins; i++)
+    {
+        plugin_t *plugin = &args->plugins[i];
+        free(plugin->name);
+        free(plugin->argv);
+        dlclose(plugin->handle);
+        if ( args->hdrs ) bcf_hdr_destroy(args->hdrs[i+1]);
+    }
+    free(args->plugins);
+    free(args->hdrs);
     if ( args->nplugin_paths>0 )
     {
-        int i;
         for (i=0; i<args->nplugin_paths; i++) free(args->plugin_paths[i]);
         free(args->plugin_paths);
     }
@@ -444,12 +601,94 @@ static void destroy_data(args_t *args)
     if (args->out_fh) hts_close(args->out_fh);
 }
 
+static void *process_records(void *arg)
+{
+    batch_t *batch = (batch_t*) arg;
+    memcpy(batch->out, batch->lines, sizeof(*batch->lines)*batch->nlines);
+    batch->nout = batch->nlines;
+    int i, j, k;
+    for (k=0; k<batch->nplugins && batch->nout; k++)
+    {
+        plugin_t *plugin = &batch->plugins[k];
+        if ( plugin->process_batch )
+        {
+            if ( plugin->process_batch(batch->out, batch->nout)<0 ) error("The plugin exited with an error.\n");
+        }
+        else
+            for (i=0; i<batch->nout; i++) batch->out[i] = plugin->process(batch->out[i]);
+
+        // the next plugin gets only the records which passed
+        for (i=j=0; i<batch->nout; i++)
+            if ( batch->out[i] ) batch->out[j++] = batch->out[i];
+        batch->nout = j;
+    }
+    return batch;
+}
+
+static void write_batch(args_t *args, batch_t *batch)
+{
+    int i;
+    for (i=0; i<batch->nout; i++)
+        bcf_write1(args->out_fh, args->hdr_out, batch->out[i]);
+    batch->nlines = 0;
+}
+
+// Wait for the oldest dispatched batch and write out its records
+static void write_next_batch(args_t *args)
+{
+    hts_tpool_result *res = hts_tpool_next_result_wait(args->tpool_q);
+    if ( !res ) error("Failed to retrieve the processed records\n");
+    write_batch(args, (batch_t*) hts_tpool_result_data(res));
+    hts_tpool_delete_result(res, 0);
+    args->nbusy--;
+}
+
+static void flush_batch(args_t *args, batch_t *batch)
+{
+    if ( !args->tpool_q )
+    {
+        write_batch(args, (batch_t*) process_records(batch));
+        return;
+    }
+    if ( hts_tpool_dispatch(args->files->p->pool, args->tpool_q, process_records, batch) < 0 )
+        error("Failed to dispatch the records to the thread pool\n");
+    args->nbusy++;
+}
+
+// The batches are filled and dispatched round-robin and retrieved in the order
+// of dispatching, so that the output order is preserved
+static void process_batches(args_t *args)
+{
+    int ibatch = 0;
+    while ( bcf_sr_next_line(args->files) )
+    {
+        bcf1_t *line = bcf_sr_get_line(args->files,0);
+        if ( args->filter )
+        {
+            int pass = filter_test(args->filter, line, NULL);
+            if ( args->filter_logic & FLT_EXCLUDE ) pass = pass ? 0 : 1;
+            if ( !pass ) continue;
+        }
+        batch_t *batch = &args->batches[ibatch];
+        if ( !batch->lines[batch->nlines] ) batch->lines[batch->nlines] = bcf_init1();
+        bcf_copy(batch->lines[batch->nlines++], line);
+        if ( batch->nlines < BATCH_SIZE ) continue;
+
+        flush_batch(args, batch);
+        ibatch = (ibatch + 1) % args->nbatches;
+        if ( args->nbusy==args->nbatches ) write_next_batch(args);
+    }
+    if ( args->batches[ibatch].nlines ) flush_batch(args, &args->batches[ibatch]);
+    while ( args->nbusy ) write_next_batch(args);
+}
+
 static void usage(args_t *args)
 {
     fprintf(stderr, "\n");
     fprintf(stderr, "About:   Run user defined plugin\n");
     fprintf(stderr, "Usage:   bcftools plugin <name> [OPTIONS] <file> [-- PLUGIN_OPTIONS]\n");
     fprintf(stderr, "         bcftools +name [OPTIONS] <file>  [-- PLUGIN_OPTIONS]\n");
+    fprintf(stderr, "         bcftools +name1,+name2 [OPTIONS] <file>  [-- PLUGIN1_OPTIONS -- PLUGIN2_OPTIONS]\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "VCF input options:\n");
     fprintf(stderr, "   -e, --exclude <expr>        exclude sites for which the expression is true\n");
@@ -462,7 +701,7 @@ static void usage(args_t *args)
     fprintf(stderr, "       --no-version            do not append version and command line to the header\n");
     fprintf(stderr, "   -o, --output <file>         write output to a file [standard output]\n");
     fprintf(stderr, "   -O, --output-type <type>    'b' compressed BCF; 'u' uncompressed BCF; 'z' compressed VCF; 'v' uncompressed VCF [v]\n");
-    fprintf(stderr, "       --threads <int>         number of extra output compression threads [0]\n");
+    fprintf(stderr, "       --threads <int>         number of extra output compression and, with thread-safe plugins, processing threads [0]\n");
     fprintf(stderr, "Plugin options:\n");
     fprintf(stderr, "   -h, --help                  list plugin's options\n");
     fprintf(stderr, "   -l, --list-plugins          list available plugins. See BCFTOOLS_PLUGINS environment variable and man page for details\n");
@@ -495,7 +734,7 @@ static int is_verbose(int argc, char *argv[])
 }
 int main_plugin(int argc, char *argv[])
 {
-    int c;
+    int c, i;
     args_t *args  = (args_t*) calloc(1,sizeof(args_t));
     args->argc    = argc; args->argv = argv;
     args->output_fname = "-";
@@ -514,10 +753,10 @@ int main_plugin(int argc, char *argv[])
         plugin_name = argv[1]; 
         argc--; 
         argv++; 
-        load_plugin(args, plugin_name, 1, &args->plugin);
-        if ( args->plugin.run )
+        load_plugins(args, plugin_name);
+        if ( args->plugins[0].run )
         {
-            int ret = args->plugin.run(argc, argv);
+            int ret = args->plugins[0].run(argc, argv);
             destroy_data(args);
             free(args);
             return ret;
@@ -572,23 +811,30 @@ int main_plugin(int argc, char *argv[])
         }
     }
     if ( plist_only )  return list_plugins(args);
-    if ( usage_only && ! plugin_name ) usage(args);
+    if ( !plugin_name ) usage(args);
 
     if ( version_only )
     {
         const char *bver, *hver;
-        args->plugin.version(&bver, &hver);
         printf("bcftools  %s using htslib %s\n", bcftools_version(), hts_version());
-        printf("plugin at %s using htslib %s\n\n", bver, hver);
+        for (i=0; i<args->nplugins; i++)
+        {
+            args->plugins[i].version(&bver, &hver);
+            printf("plugin %s at %s using htslib %s\n", args->plugins[i].name, bver, hver);
+        }
+        printf("\n");
         return 0;
     }
 
     if ( usage_only )
     {
-        if ( args->plugin.usage )
-            fprintf(stderr,"%s",args->plugin.usage());
-        else
-            fprintf(stderr,"Usage: bcftools +%s [General Options] -- [Plugin Options]\n",plugin_name);
+        for (i=0; i<args->nplugins; i++)
+        {
+            if ( args->plugins[i].usage )
+                fprintf(stderr,"%s",args->plugins[i].usage());
+            else
+                fprintf(stderr,"Usage: bcftools +%s [General Options] -- [Plugin Options]\n",args->plugins[i].name);
+        }
         return 0;
     }
 
@@ -597,14 +843,12 @@ int main_plugin(int argc, char *argv[])
     {
         if ( !isatty(fileno((FILE *)stdin)) ) fname = "-";  // reading from stdin
         else usage(args);
-        args->plugin.argc = argc - optind + 1;
-        args->plugin.argv = argv + optind - 1;
+        set_plugin_args(args, argc - optind + 1, argv + optind - 1);
     }
     else
     {
         fname = argv[optind];
-        args->plugin.argc = argc - optind;
-        args->plugin.argv = argv + optind;
+        set_plugin_args(args, argc - optind, argv + optind);
     }
     optind = 0;
 
@@ -620,20 +864,30 @@ int main_plugin(int argc, char *argv[])
             error("Failed to read the targets: %s\n", args->targets_list);
         args->files->collapse |= COLLAPSE_SOME;
     }
+    int parallel = args->n_threads ? 1 : 0;
+    for (i=0; i<args->nplugins; i++)
+        if ( !args->plugins[i].thread_safe ) parallel = 0;
+    if ( parallel && bcf_sr_set_threads(args->files, args->n_threads)<0 ) error("Failed to create threads\n");
     if ( !bcf_sr_add_reader(args->files, fname) ) error("Failed to open %s: %s\n", fname,bcf_sr_strerror(args->files->errnum));
 
     init_data(args);
-    while ( bcf_sr_next_line(args->files) )
+    if ( args->batches )
+        process_batches(args);
+    else
     {
-        bcf1_t *line = bcf_sr_get_line(args->files,0);
-        if ( args->filter )
+        while ( bcf_sr_next_line(args->files) )
         {
-            int pass = filter_test(args->filter, line, NULL);
-            if ( args->filter_logic & FLT_EXCLUDE ) pass = pass ? 0 : 1;
-            if ( !pass ) continue;
+            bcf1_t *line = bcf_sr_get_line(args->files,0);
+            if ( args->filter )
+            {
+                int pass = filter_test(args->filter, line, NULL);
+                if ( args->filter_logic & FLT_EXCLUDE ) pass = pass ? 0 : 1;
+                if ( !pass ) continue;
+            }
+            for (i=0; i<args->nplugins && line; i++)
+                line = args->plugins[i].process(line);
+            if ( line ) bcf_write1(args->out_fh, args->hdr_out, line);
         }
-        line = args->plugin.process(line);
-        if ( line ) bcf_write1(args->out_fh, args->hdr_out, line);
     }
     destroy_data(args);
     bcf_sr_destroy(args->files);
@@ -33,17 +33,42 @@ THE SOFTWARE.  */
 #include <htslib/vcf.h>
 #include <htslib/synced_bcf_reader.h>
 #include <htslib/vcfutils.h>
+#include <htslib/thread_pool.h>
 #include "bcftools.h"
 #include "filter.h"
 #include "convert.h"
+#include "bpool.h"
+#include "bcfmmap.h"
+#include "gtidx.h"
+#include "regplan.h"
+#include "profile.h"
 
 
 // Logic of the filters: include or exclude sites which match the filters?
 #define FLT_INCLUDE 1
 #define FLT_EXCLUDE 2
 
+// Number of records formatted by a worker thread at once
+#define BATCH_SIZE 1000
+
+// With --threads, batches of records are filtered and formatted in parallel,
+// each batch with its own filter, convert_t and output buffer. The batches are
+// written out in the order of dispatching.
 typedef struct
 {
+    filter_t *filter;
+    convert_t *convert;
+    kstring_t str, out;
+}
+batch_t;
+
+typedef struct _args_t
+{
+    bpool_t *bpool;
+    bcf_mmap_t *mmap;   // set when reading a local uncompressed BCF
+    gtidx_t *gtidx;     // set when reading the genotype index
+    regplan_t *plan;    // set when large region lists are coalesced
+    int n_threads;
     filter_t *filter;
     char *filter_str;
     int filter_logic;   // include or exclude sites which match the filters? One of FLT_INCLUDE/FLT_EXCLUDE
@@ -65,6 +90,40 @@ static void destroy_list(char **list, int n)
     free(list);
 }
 
+static void process_batch(bpool_batch_t *bb, void *usr)
+{
+    args_t *args = (args_t*) usr;
+    batch_t *batch = (batch_t*) bb->data;
+    int i;
+    batch->out.l = 0;
+    for (i=0; i<bb->nlines; i++)
+    {
+        bcf1_t *line = bb->lines[i];
+        bcf_unpack(line, args->files->max_unpack);
+        if ( batch->filter )
+        {
+            int pass = filter_test(batch->filter, line, NULL);
+            if ( args->filter_logic & FLT_EXCLUDE ) pass = pass ? 0 : 1;
+            if ( !pass ) continue;
+        }
+        convert_line(batch->convert, line, &batch->str);
+        if ( !batch->str.l ) continue;
+        kputsn(batch->str.s, batch->str.l, &batch->out);
+        profile_count(PROF_NREC_OUT, 1);
+    }
+}
+
+static void write_batch(bpool_batch_t *bb, void *usr)
+{
+    args_t *args = (args_t*) usr;
+    batch_t *batch = (batch_t*) bb->data;
+    int i;
+    for (i=0; i<bb->nlines; i++) profile_done(bb->lines[i], 0);    // written records were counted by the workers
+    uint64_t prof_start = profile_start();
+    if ( batch->out.l && fwrite(batch->out.s, batch->out.l, 1, args->out)!=1 ) error("Failed to write the output\n");
+    profile_stop(PROF_WRITE, prof_start);
+}
+
 static void init_data(args_t *args)
 {
     args->header = args->files->readers[0].header;
@@ -99,7 +158,6 @@ static void init_data(args_t *args)
     }
     args->convert = convert_init(args->header, samples, nsamples, args->format_str);
     if ( args->allow_undef_tags ) convert_set_option(args->convert, allow_undef_tags, 1);
-    free(samples);
 
     int max_unpack = convert_max_unpack(args->convert);
     if ( args->filter_str )
@@ -108,14 +166,90 @@ static void init_data(args_t *args)
         max_unpack |= filter_max_unpack(args->filter);
     }
     args->files->max_unpack = max_unpack;
+
+    // A single file read from start to end can be also read from its genotype index when
+    // only genotypes are printed and no threads are used, the records of the index are not
+    // meant to be copied. The other way is to map an uncompressed BCF to memory. The synced
+    // reader still provides the header.
+    if ( args->files->nreaders==1 && !args->regions_list && !args->targets_list && (!args->sample_list || !strcmp("-",args->sample_list)) )
+    {
+        if ( !args->filter && !args->n_threads && convert_gt_only(args->convert) )
+            args->gtidx = gtidx_open(args->files->readers[0].fname, args->header);
+        if ( !args->gtidx )
+            args->mmap = bcf_mmap_open(args->files->readers[0].fname);
+    }
+
+    if ( args->n_threads && args->files->nreaders==1 )
+    {
+        // two batches per thread keep the workers busy while the output is written
+        args->bpool = bpool_init(args->files->p->pool, 2*args->n_threads, BATCH_SIZE, process_batch, write_batch, args);
+        for (i=0; i<bpool_nbatches(args->bpool); i++)
+        {
+            batch_t *batch = (batch_t*) calloc(1, sizeof(batch_t));
+            batch->convert = convert_init(args->header, samples, nsamples, args->format_str);
+            if ( args->allow_undef_tags ) convert_set_option(batch->convert, allow_undef_tags, 1);
+            if ( args->filter_str ) batch->filter = filter_init(args->header, args->filter_str);
+            bpool_batch(args->bpool, i)->data = batch;
+        }
+    }
+    free(samples);
 }
 
 static void destroy_data(args_t *args)
 {
+    int i;
     convert_destroy(args->convert);
     if ( args->filter )
         filter_destroy(args->filter);
     free(args->samples);
+    bcf_mmap_close(args->mmap);
+    args->mmap = NULL;
+    gtidx_close(args->gtidx);
+    args->gtidx = NULL;
+    if ( !args->bpool ) return;
+    for (i=0; i<bpool_nbatches(args->bpool); i++)
+    {
+        batch_t *batch = (batch_t*) bpool_batch(args->bpool, i)->data;
+        convert_destroy(batch->convert);
+        if ( batch->filter ) filter_destroy(batch->filter);
+        free(batch->str.s);
+        free(batch->out.s);
+        free(batch);
+    }
+    bpool_destroy(args->bpool);
+    args->bpool = NULL;
+}
+
+// The next record of the first reader or NULL at the end
+static bcf1_t *next_line(args_t *args)
+{
+    uint64_t prof_start = profile_start();
+    bcf1_t *line = NULL;
+    if ( args->gtidx )
+        line = gtidx_next(args->gtidx);
+    else if ( args->mmap )
+        line = bcf_mmap_next(args->mmap);
+    else
+    {
+        while ( bcf_sr_next_line(args->files) )
+        {
+            if ( !bcf_sr_has_line(args->files,0) ) continue;
+            line = args->files->readers[0].buffer[0];
+            if ( args->plan && !regplan_test(args->plan, args->header, line) ) { line = NULL; continue; }
+            break;
+        }
+    }
+    profile_stop(PROF_READ, prof_start);
+    if ( line ) profile_in(line);
+    return line;
+}
+
+static void query_parallel(args_t *args)
+{
+    bcf1_t *line;
+    while ( (line = next_line(args)) )
+        bpool_push(args->bpool, line);
+    bpool_flush(args->bpool);
 }
 
 static void query_vcf(args_t *args)
@@ -128,23 +262,34 @@ static void query_vcf(args_t *args)
         fwrite(str.s, str.l, 1, args->out);
     }
 
-    while ( bcf_sr_next_line(args->files) )
+    if ( args->bpool )
+    {
+        query_parallel(args);
+        free(str.s);
+        return;
+    }
+
+    bcf1_t *line;
+    while ( (line = next_line(args)) )
     {
-        if ( !bcf_sr_has_line(args->files,0) ) continue;
-        bcf1_t *line = args->files->readers[0].buffer[0];
         bcf_unpack(line, args->files->max_unpack);
 
         if ( args->filter )
         {
             int pass = filter_test(args->filter, line, NULL);
             if ( args->filter_logic & FLT_EXCLUDE ) pass = pass ? 0 : 1;
-            if ( !pass ) continue;
+            if ( !pass ) { profile_done(line, 0); continue; }
         }
 
         str.l = 0;
         convert_line(args->convert, line, &str);
         if ( str.l )
+        {
+            uint64_t t0 = profile_start();
             fwrite(str.s, str.l, 1, args->out);
+            profile_stop(PROF_WRITE, t0);
+        }
+        profile_done(line, str.l ? 1 : 0);
     }
     if ( str.m ) free(str.s);
 }
@@ -194,6 +339,7 @@ static void usage(void)
     fprintf(stderr, "    -S, --samples-file <file>         file of samples to include\n");
     fprintf(stderr, "    -t, --targets <region>            similar to -r but streams rather than index-jumps\n");
     fprintf(stderr, "    -T, --targets-file <file>         similar to -R but streams rather than index-jumps\n");
+    fprintf(stderr, "        --threads <int>               number of extra decompression and formatting threads [0]\n");
     fprintf(stderr, "    -u, --allow-undef-tags            print \".\" for undefined tags\n");
     fprintf(stderr, "    -v, --vcf-list <file>             process multiple VCFs listed in the file\n");
     fprintf(stderr, "\n");
@@ -229,6 +375,7 @@ int main_vcfquery(int argc, char *argv[])
         {"collapse",1,0,'c'},
         {"vcf-list",1,0,'v'},
         {"allow-undef-tags",0,0,'u'},
+        {"threads",1,0,9},
         {0,0,0,0}
     };
     while ((c = getopt_long(argc, argv, "hlr:R:f:a:s:S:Ht:T:c:v:i:e:o:u",loptions,NULL)) >= 0) {
@@ -273,6 +420,7 @@ int main_vcfquery(int argc, char *argv[])
             case 'u': args->allow_undef_tags = 1; break;
             case 's': args->sample_list = optarg; break;
             case 'S': args->sample_list = optarg; args->sample_is_file = 1; break;
+            case  9 : args->n_threads = strtol(optarg, 0, 0); break;
             case 'h':
             case '?': usage();
             default: error("Unknown argument: %s\n", optarg);
@@ -307,13 +455,19 @@ int main_vcfquery(int argc, char *argv[])
         args->files = bcf_sr_init();
         args->files->collapse = collapse;
         if ( optind+1 < argc ) args->files->require_index = 1;
-        if ( args->regions_list && bcf_sr_set_regions(args->files, args->regions_list, regions_is_file)<0 )
-            error("Failed to read the regions: %s\n", args->regions_list);
-        if ( args->targets_list )
+        if ( optind+1 == argc )
+            args->plan = regplan_init(args->files, fname, args->regions_list, regions_is_file, args->targets_list, targets_is_file);
+        else
         {
-            if ( bcf_sr_set_targets(args->files, args->targets_list, targets_is_file, 0)<0 )
-                error("Failed to read the targets: %s\n", args->targets_list);
+            if ( args->regions_list && bcf_sr_set_regions(args->files, args->regions_list, regions_is_file)<0 )
+                error("Failed to read the regions: %s\n", args->regions_list);
+            if ( args->targets_list )
+            {
+                if ( bcf_sr_set_targets(args->files, args->targets_list, targets_is_file, 0)<0 )
+                    error("Failed to read the targets: %s\n", args->targets_list);
+            }
         }
+        if ( args->n_threads && bcf_sr_set_threads(args->files, args->n_threads)<0 ) error("Failed to create threads\n");
         while ( fname )
         {
             if ( !bcf_sr_add_reader(args->files, fname) ) error("Failed to open %s: %s\n", fname,bcf_sr_strerror(args->files->errnum));
@@ -323,6 +477,7 @@ int main_vcfquery(int argc, char *argv[])
         query_vcf(args);
         free(args->format_str);
         destroy_data(args);
+        regplan_destroy(args->plan);
         bcf_sr_destroy(args->files);
         fclose(args->out);
         free(args);
@@ -346,6 +501,7 @@ int main_vcfquery(int argc, char *argv[])
             if ( bcf_sr_set_targets(args->files, args->targets_list,targets_is_file, 0)<0 )
                 error("Failed to read the targets: %s\n", args->targets_list);
         }
+        if ( args->n_threads && bcf_sr_set_threads(args->files, args->n_threads)<0 ) error("Failed to create threads\n");
         if ( !bcf_sr_add_reader(args->files, fnames[i]) ) error("Failed to open %s: %s\n", fnames[i],bcf_sr_strerror(args->files->errnum));
         for (k=optind; k<argc; k++)
             if ( !bcf_sr_add_reader(args->files, argv[k]) ) error("Failed to open %s: %s\n", argv[k],bcf_sr_strerror(args->files->errnum));
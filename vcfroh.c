@@ -31,6 +31,7 @@ THE SOFTWARE.  */
 #include <htslib/kstring.h>
 #include <htslib/kseq.h>
 #include <htslib/bgzf.h>
+#include <htslib/thread_pool.h>
 #include <errno.h>
 #include "bcftools.h"
 #include "HMM.h"
@@ -43,6 +44,8 @@ THE SOFTWARE.  */
 #define OUTPUT_RG (1<<2)
 #define OUTPUT_GZ (1<<3)
 
+#define GENMAP_BIN_SHIFT 10     // 1kb bins of the genetic map index
+
 /** Genetic map */
 typedef struct
 {
@@ -57,7 +60,6 @@ typedef struct
     double *eprob;      // emission probs [2*nsites,msites]
     uint32_t *sites;    // positions [nsites,msites]
     int nsites, msites;
-    int igenmap;        // current position in genmap
     int nused;          // some stats to detect if things didn't go wrong
     int nrid, *rid, *rid_off;   // for viterbi training, keep all chromosomes
     void *snapshot;             // hmm snapshot
@@ -69,6 +71,8 @@ typedef struct
 }
 smpl_t;
 
+typedef struct _roh_job_t roh_job_t;
+
 typedef struct _args_t
 {
     bcf_srs_t *files;
@@ -78,7 +82,8 @@ typedef struct _args_t
 
     char *genmap_fname;
     genmap_t *genmap;
-    int ngenmap, mgenmap, igenmap;
+    int ngenmap, mgenmap;
+    int *genmap_bin, ngenmap_bin, mgenmap_bin;  // the first genmap index with pos >= (ibin<<GENMAP_BIN_SHIFT)
     double rec_rate;        // constant recombination rate if > 0
 
     hmm_t *hmm;
@@ -99,13 +104,28 @@ typedef struct _args_t
     smpl_ilist_t *roh_smpl;     // list of samples to analyze (--samples, --samples-file)
     char *estimate_AF;          // list of samples for AF estimate and query sample
     int af_from_PL;             // estimate AF from FMT/PL rather than FMT/GT
+    int af_vcf;                 // --AF-file is a VCF/BCF, read by its own indexed reader instead of targets
+    bcf_srs_t *af_files;
+    int af_rid, af_pos, af_peek;            // the position of af_recs; the current line of af_files is not consumed yet
+    bcf1_t **af_recs;                       // the --AF-file records at af_pos
+    int naf_recs, maf_recs;
     char **argv, *targets_list, *regions_list, *af_fname, *af_tag, *samples, *buffer_size, *output_fname;
     int argc, fake_PLs, snps_only, vi_training, samples_is_file, output_type, skip_homref, n_threads;
     BGZF *out;
     kstring_t str;
+    int is_worker;              // the output is kept in str for the main thread to write
+    roh_job_t *jobs;            // per-thread copies of the model for --threads
+    int njobs, *iflush;         // iflush: samples with the -b buffer full at the current site
 }
 args_t;
 
+/** Samples are flushed in parallel, each thread with its own model and output buffer */
+struct _roh_job_t
+{
+    args_t args;    // private copy of the arguments
+    int ismpl;
+};
+
 void set_tprob_genmap(hmm_t *hmm, uint32_t prev_pos, uint32_t pos, void *data, double *tprob);
 void set_tprob_rrate(hmm_t *hmm, uint32_t prev_pos, uint32_t pos, void *data, double *tprob);
 
@@ -264,6 +284,21 @@ static void init_data(args_t *args)
     else if ( args->rec_rate > 0 )
         hmm_set_tprob_func(args->hmm, set_tprob_rrate, args);
 
+    if ( args->nbuf_max ) args->iflush = (int*) malloc(sizeof(int)*args->roh_smpl->n);
+    if ( args->n_threads > 0 && !args->vi_training )
+    {
+        args->njobs = 2*args->n_threads;
+        if ( args->njobs > args->roh_smpl->n ) args->njobs = args->roh_smpl->n;
+        args->jobs = (roh_job_t*) calloc(args->njobs, sizeof(roh_job_t));
+        for (i=0; i<args->njobs; i++)
+        {
+            roh_job_t *job = &args->jobs[i];
+            job->args.hmm = hmm_copy(args->hmm);
+            if ( args->genmap_fname || args->rec_rate > 0 )
+                hmm_set_tprob_func(job->args.hmm, args->genmap_fname ? set_tprob_genmap : set_tprob_rrate, &job->args);
+        }
+    }
+
     args->out = bgzf_open(strcmp("stdout",args->output_fname)?args->output_fname:"-", args->output_type&OUTPUT_GZ ? "wg" : "wu"); 
     if ( !args->out ) error("Failed to open %s: %s\n", args->output_fname, strerror(errno));
 
@@ -320,6 +355,9 @@ static void destroy_data(args_t *args)
 {
     if ( bgzf_close(args->out)!=0 ) error("Error: close failed .. %s\n", args->output_fname);
     int i;
+    if ( args->af_files ) bcf_sr_destroy(args->af_files);
+    for (i=0; i<args->maf_recs; i++) bcf_destroy1(args->af_recs[i]);
+    free(args->af_recs);
     for (i=0; i<args->roh_smpl->n; i++)
     {
         free(args->smpl[i].eprob);
@@ -329,6 +367,13 @@ static void destroy_data(args_t *args)
         free(args->smpl[i].snapshot);
     }
     free(args->str.s);
+    for (i=0; i<args->njobs; i++)
+    {
+        hmm_destroy(args->jobs[i].args.hmm);
+        free(args->jobs[i].args.str.s);
+    }
+    free(args->jobs);
+    free(args->iflush);
     free(args->smpl);
     if ( args->af_smpl ) smpl_ilist_destroy(args->af_smpl);
     smpl_ilist_destroy(args->roh_smpl);
@@ -338,6 +383,7 @@ static void destroy_data(args_t *args)
     bcf_sr_destroy(args->files);
     free(args->AFs); free(args->pdg);
     free(args->genmap);
+    free(args->genmap_bin);
     free(args->itmp);
     free(args->samples);
 }
@@ -369,7 +415,7 @@ static int load_genmap(args_t *args, const char *chr)
     if ( strcmp(str.s,"position COMBINED_rate(cM/Mb) Genetic_Map(cM)") )
         error("Unexpected header, found:\n\t[%s], but expected:\n\t[position COMBINED_rate(cM/Mb) Genetic_Map(cM)]\n", fname, str.s);
 
-    args->ngenmap = args->igenmap = 0;
+    args->ngenmap = 0;
     while ( hts_getline(fp, KS_SEP_LINE, &str) > 0 )
     {
         args->ngenmap++;
@@ -392,36 +438,46 @@ static int load_genmap(args_t *args, const char *chr)
         gm->rate *= 0.01;
     }
     if ( !args->ngenmap ) error("Genetic map empty?\n");
+
+    // index the map so that the interval of a position can be found in constant
+    // time, regardless of the direction the HMM moves in
+    args->ngenmap_bin = (args->genmap[args->ngenmap-1].pos >> GENMAP_BIN_SHIFT) + 1;
+    hts_expand(int,args->ngenmap_bin,args->mgenmap_bin,args->genmap_bin);
+    int i, ibin = 0;
+    for (i=0; i<args->ngenmap; i++)
+    {
+        if ( args->genmap[i].pos < 0 ) continue;
+        while ( ibin <= args->genmap[i].pos >> GENMAP_BIN_SHIFT ) args->genmap_bin[ibin++] = i;
+    }
+    while ( ibin < args->ngenmap_bin ) args->genmap_bin[ibin++] = args->ngenmap - 1;
     if ( hts_close(fp) ) error("Close failed\n");
     free(str.s);
     return 0;
 }
 
+// The first genmap index with pos >= the given position
+static inline int genmap_lower_bound(args_t *args, int pos)
+{
+    if ( pos < 0 ) return 0;
+    int ibin = pos >> GENMAP_BIN_SHIFT;
+    if ( ibin >= args->ngenmap_bin ) return args->ngenmap;
+    int i = args->genmap_bin[ibin];
+    while ( i < args->ngenmap && args->genmap[i].pos < pos ) i++;
+    return i;
+}
+
 static double get_genmap_rate(args_t *args, int start, int end)
 {
-    // position i to be equal to or smaller than start
-    int i = args->igenmap;
-    if ( args->genmap[i].pos > start )
-    {
-        while ( i>0 && args->genmap[i].pos > start ) i--;
-    }
-    else
-    {
-        while ( i+1<args->ngenmap && args->genmap[i+1].pos < start ) i++;
-    }
-    // position j to be equal or larger than end
-    int j = i;
-    while ( j+1<args->ngenmap && args->genmap[j].pos < end ) j++;
-    if ( i==j )
-    {
-        args->igenmap = i;
-        return 0;
-    }
+    // position i to be smaller than start (or the first), j to be equal or larger than end (or the last)
+    int i = genmap_lower_bound(args, start) - 1;
+    if ( i < 0 ) i = 0;
+    int j = genmap_lower_bound(args, end);
+    if ( j >= args->ngenmap ) j = args->ngenmap - 1;
+    if ( j <= i ) return 0;
 
     if ( start <  args->genmap[i].pos ) start = args->genmap[i].pos;
     if ( end >  args->genmap[j].pos ) end = args->genmap[j].pos;
     double rate = (args->genmap[j].rate - args->genmap[i].rate)/(args->genmap[j].pos - args->genmap[i].pos) * (end-start);
-    args->igenmap = j;
     return rate;
 }
 
@@ -474,6 +530,14 @@ void set_tprob_rrate(hmm_t *hmm, uint32_t prev_pos, uint32_t pos, void *data, do
  *
  */
 
+static void write_output(args_t *args, int force)
+{
+    if ( args->is_worker ) return;
+    if ( !force && args->str.l < 65536 ) return;
+    if ( args->str.l && bgzf_write(args->out, args->str.s, args->str.l) != args->str.l ) error("Error writing %s: %s\n", args->output_fname, strerror(errno));
+    args->str.l = 0;
+}
+
 static void flush_viterbi(args_t *args, int ismpl)
 {
     smpl_t *smpl = &args->smpl[ismpl];
@@ -485,12 +549,12 @@ static void flush_viterbi(args_t *args, int ismpl)
 
     if ( !args->vi_training ) // single viterbi pass
     {
+        args->str.l = 0;
         hmm_restore(args->hmm, smpl->snapshot); 
         int end = (args->nbuf_max && smpl->nsites >= args->nbuf_max && smpl->nsites > args->nbuf_olap) ? smpl->nsites - args->nbuf_olap : smpl->nsites;
         if ( end < smpl->nsites )
             smpl->snapshot = hmm_snapshot(args->hmm, smpl->snapshot, smpl->sites[smpl->nsites - args->nbuf_olap - 1]);
 
-        args->igenmap = smpl->igenmap;
         hmm_run_viterbi(args->hmm, smpl->nsites, smpl->eprob, smpl->sites);
         hmm_run_fwd_bwd(args->hmm, smpl->nsites, smpl->eprob, smpl->sites);
         double *fwd = hmm_get_fwd_bwd_prob(args->hmm);
@@ -504,9 +568,8 @@ static void flush_viterbi(args_t *args, int ismpl)
             double qual = phred_score(1.0 - fwd[i*2 + state]);
             if ( args->output_type & OUTPUT_ST )
             {
-                args->str.l = 0;
                 ksprintf(&args->str, "ST\t%s\t%s\t%d\t%d\t%.1f\n", name,chr,smpl->sites[i]+1, state, qual);
-                if ( bgzf_write(args->out, args->str.s, args->str.l) != args->str.l ) error("Error writing %s: %s\n", args->output_fname, strerror(errno));
+                write_output(args, 0);
             }
 
             if ( args->output_type & OUTPUT_RG )
@@ -515,10 +578,9 @@ static void flush_viterbi(args_t *args, int ismpl)
                 {
                     if ( !state )   // the region ends, flush
                     {
-                        args->str.l = 0;
                         ksprintf(&args->str, "RG\t%s\t%s\t%d\t%d\t%d\t%d\t%.1f\n",name,bcf_hdr_id2name(args->hdr,smpl->rg.rid),
                                 smpl->rg.beg+1,smpl->rg.end+1,smpl->rg.end-smpl->rg.beg+1,smpl->rg.nqual,smpl->rg.qual/smpl->rg.nqual);
-                        if ( bgzf_write(args->out, args->str.s, args->str.l) != args->str.l ) error("Error writing %s: %s\n", args->output_fname, strerror(errno));
+                        write_output(args, 0);
                         smpl->rg.state = 0;
                     }
                     else
@@ -543,23 +605,19 @@ static void flush_viterbi(args_t *args, int ismpl)
             memmove(smpl->sites, smpl->sites + end, sizeof(*smpl->sites)*args->nbuf_olap);
             memmove(smpl->eprob, smpl->eprob + end*2, sizeof(*smpl->eprob)*args->nbuf_olap*2);
             smpl->nsites  = args->nbuf_olap;
-            smpl->igenmap = args->igenmap;
         }
         else
         {
             smpl->nsites  = 0;
-            smpl->igenmap = 0;
 
             if ( smpl->rg.state )
             {
-                args->str.l = 0;
                 ksprintf(&args->str, "RG\t%s\t%s\t%d\t%d\t%d\t%d\t%.1f\n",name,bcf_hdr_id2name(args->hdr,smpl->rg.rid),
                         smpl->rg.beg+1,smpl->rg.end+1,smpl->rg.end-smpl->rg.beg+1,smpl->rg.nqual,smpl->rg.qual/smpl->rg.nqual);
-                if ( bgzf_write(args->out, args->str.s, args->str.l) != args->str.l ) error("Error writing %s: %s\n", args->output_fname, strerror(errno));
                 smpl->rg.state = 0;
             }
         }
-
+        write_output(args, 1);
         return;
     }
 
@@ -586,7 +644,6 @@ static void flush_viterbi(args_t *args, int ismpl)
         {
             int ioff = smpl->rid_off[i];
             int nsites = (i+1==smpl->nrid ? smpl->nsites : smpl->rid_off[i+1]) - ioff;
-            args->igenmap = 0;
             tprob_arr = hmm_run_baum_welch(args->hmm, nsites, smpl->eprob+ioff*2, smpl->sites+ioff);
             for (j=0; j<2; j++)
                 for (k=0; k<2; k++) MAT(tprob_new,2,j,k) += MAT(tprob_arr,2,j,k);
@@ -613,7 +670,6 @@ static void flush_viterbi(args_t *args, int ismpl)
     {
         int ioff = smpl->rid_off[i];
         int nsites = (i+1==smpl->nrid ? smpl->nsites : smpl->rid_off[i+1]) - ioff;
-        args->igenmap = 0;
         hmm_run_viterbi(args->hmm, nsites, smpl->eprob+ioff*2, smpl->sites+ioff);
         hmm_run_fwd_bwd(args->hmm, nsites, smpl->eprob+ioff*2, smpl->sites+ioff);
         uint8_t *vpath = hmm_get_viterbi_path(args->hmm);
@@ -657,6 +713,66 @@ int read_AF(bcf_sr_regions_t *tgt, bcf1_t *line, double *alt_freq)
     return 0;
 }
 
+// Collect the --AF-file records at the position of the line. The file is read
+// sequentially as long as the input is sorted and jumps through the index on a
+// new chromosome, so that the input itself needs no index.
+static void buffer_AF_vcf(args_t *args, bcf1_t *line)
+{
+    const char *chr = bcf_seqname(args->hdr,line);
+    if ( line->rid!=args->af_rid || line->pos < args->af_pos )
+    {
+        if ( bcf_sr_seek(args->af_files, chr, line->pos)!=0 ) error("Failed to seek to %s:%d in %s\n", chr,line->pos+1,args->af_fname);
+        args->af_rid  = line->rid;
+        args->af_pos  = -1;
+        args->af_peek = 0;
+    }
+    if ( line->pos==args->af_pos ) return;
+    args->af_pos   = line->pos;
+    args->naf_recs = 0;
+
+    bcf_hdr_t *af_hdr = bcf_sr_get_header(args->af_files,0);
+    while ( args->af_peek || bcf_sr_next_line(args->af_files) )
+    {
+        args->af_peek = 1;
+        bcf1_t *rec = bcf_sr_get_line(args->af_files,0);
+        if ( strcmp(chr,bcf_seqname(af_hdr,rec)) ) break;   // past the chromosome
+        if ( rec->pos > line->pos ) break;
+        args->af_peek = 0;
+        if ( rec->pos < line->pos ) continue;
+        args->naf_recs++;
+        hts_expand0(bcf1_t*, args->naf_recs, args->maf_recs, args->af_recs);
+        if ( !args->af_recs[args->naf_recs-1] ) args->af_recs[args->naf_recs-1] = bcf_init1();
+        bcf_copy(args->af_recs[args->naf_recs-1], rec);
+    }
+}
+
+// With a VCF/BCF --AF-file, the AF comes from INFO/AF of the record with the
+// same position and alleles, no text is parsed
+int read_AF_vcf(args_t *args, bcf1_t *line, int ial, double *alt_freq)
+{
+    buffer_AF_vcf(args, line);
+
+    int i, j;
+    bcf1_t *rec = NULL;
+    for (j=0; j<args->naf_recs; j++)
+    {
+        rec = args->af_recs[j];
+        if ( rec->n_allele != line->n_allele ) continue;    // number of alleles does not match
+        bcf_unpack(rec, BCF_UN_INFO);
+        for (i=0; i<rec->n_allele; i++)
+            if ( strcmp(line->d.allele[i],rec->d.allele[i]) ) break;
+        if ( i==rec->n_allele ) break;
+    }
+    if ( j==args->naf_recs ) return -1;
+
+    int ret = bcf_get_info_float(bcf_sr_get_header(args->af_files,0), rec, "AF", &args->AFs, &args->mAFs);
+    if ( ret==-2 ) error("Type mismatch for INFO/AF tag in %s at %s:%d\n", args->af_fname, bcf_seqname(args->hdr,line), line->pos+1);
+    if ( ret < ial || bcf_float_is_missing(args->AFs[ial-1]) ) return -1;
+    *alt_freq = args->AFs[ial-1];
+    if ( *alt_freq<0 || *alt_freq>1 ) error("Could not parse AF in %s at %s:%d\n", args->af_fname, bcf_seqname(args->hdr,line), line->pos+1);
+    return 0;
+}
+
 int8_t *get_GT(args_t *args, bcf1_t *line)
 {
     int i;
@@ -790,6 +906,58 @@ bcf_fmt_t *get_PL(args_t *args, bcf1_t *line)
     return NULL;
 }
 
+static void *flush_job(void *arg)
+{
+    roh_job_t *job = (roh_job_t*) arg;
+    flush_viterbi(&job->args, job->ismpl);
+    return job;
+}
+
+// Flush the listed samples, all if the list is NULL. With --threads, the samples are
+// run by the extra threads in batches and their output is written in the order given
+static void flush_samples(args_t *args, int *list, int nlist)
+{
+    int i, j;
+    if ( !list ) nlist = args->roh_smpl->n;
+    if ( !args->njobs )
+    {
+        for (i=0; i<nlist; i++) flush_viterbi(args, list ? list[i] : i);
+        return;
+    }
+    hts_tpool_process *q = hts_tpool_process_init(args->files->p->pool, args->njobs, 0);
+    if ( !q ) error("Failed to initialize the thread pool queue\n");
+    for (i=0; i<nlist; i+=args->njobs)
+    {
+        int n = i + args->njobs <= nlist ? args->njobs : nlist - i;
+        for (j=0; j<n; j++)
+        {
+            roh_job_t *job = &args->jobs[j];
+            hmm_t *hmm = job->args.hmm;
+            kstring_t str = job->args.str;
+            job->args = *args;
+            job->args.hmm = hmm;
+            job->args.str = str;
+            job->args.str.l = 0;
+            job->args.is_worker = 1;
+            job->ismpl = list ? list[i+j] : i+j;
+            if ( hts_tpool_dispatch(args->files->p->pool, q, flush_job, job) < 0 )
+                error("Failed to dispatch the sample %s to the thread pool\n", args->hdr->samples[ args->roh_smpl->idx[job->ismpl] ]);
+        }
+        for (j=0; j<n; j++)
+        {
+            hts_tpool_result *res = hts_tpool_next_result_wait(q);
+            if ( !res ) error("Failed to retrieve the flushed sample\n");
+            hts_tpool_delete_result(res, 0);
+        }
+        for (j=0; j<n; j++)
+        {
+            kstring_t *str = &args->jobs[j].args.str;
+            if ( str->l && bgzf_write(args->out, str->s, str->l) != str->l ) error("Error writing %s: %s\n", args->output_fname, strerror(errno));
+        }
+    }
+    hts_tpool_process_destroy(q);
+}
+
 int process_line(args_t *args, bcf1_t *line, int ial)
 {
     if ( !(line->unpacked & BCF_UN_FMT) ) bcf_unpack(line, BCF_UN_FMT);
@@ -799,7 +967,7 @@ int process_line(args_t *args, bcf1_t *line, int ial)
     bcf_fmt_t *fmt_pl = NULL;
 
     // Set allele frequency
-    int ret = 0, i,j;
+    int ret = 0, i,j, nflush = 0;
     if ( args->af_tag )
     {
         // Use an INFO tag provided by the user
@@ -812,7 +980,10 @@ int process_line(args_t *args, bcf1_t *line, int ial)
     else if ( args->af_fname ) 
     {
         // Read AF from a file
-        ret = read_AF(args->files->targets, line, &alt_freq);
+        if ( args->af_vcf )
+            ret = read_AF_vcf(args, line, ial, &alt_freq);
+        else
+            ret = read_AF(args->files->targets, line, &alt_freq);
     }
     else if ( args->dflt_AF > 0 )
     {
@@ -952,9 +1123,12 @@ int process_line(args_t *args, bcf1_t *line, int ial)
                 smpl->rid_off[smpl->nrid-1] = smpl->nsites - 1;
             }
         }
-        else if ( args->nbuf_max && smpl->nsites >= args->nbuf_max ) flush_viterbi(args, i);
+        else if ( args->nbuf_max && smpl->nsites >= args->nbuf_max ) args->iflush[nflush++] = i;
     }
 
+    // samples whose buffers filled up at this site are flushed together
+    if ( nflush ) flush_samples(args, args->iflush, nflush);
+
     return 0;
 }
 
@@ -965,7 +1139,7 @@ static void vcfroh(args_t *args, bcf1_t *line)
     // Are we done?
     if ( !line )
     { 
-        for (i=0; i<args->roh_smpl->n; i++) flush_viterbi(args, i);
+        flush_samples(args, NULL, 0);
         return; 
     }
     args->ntot++;
@@ -1005,11 +1179,9 @@ static void vcfroh(args_t *args, bcf1_t *line)
     {
         if ( !args->vi_training )
         {
+            flush_samples(args, NULL, 0);
             for (i=0; i<args->roh_smpl->n; i++)
-            {
-                flush_viterbi(args, i);
                 hmm_reset(args->hmm, args->smpl[i].snapshot);
-            }
         }
         args->prev_rid = line->rid;
         args->prev_pos = line->pos;
@@ -1042,7 +1214,7 @@ static void usage(args_t *args)
     fprintf(stderr, "General Options:\n");
     fprintf(stderr, "        --AF-dflt <float>              if AF is not known, use this allele frequency [skip]\n");
     fprintf(stderr, "        --AF-tag <TAG>                 use TAG for allele frequency\n");
-    fprintf(stderr, "        --AF-file <file>               read allele frequencies from file (CHR\\tPOS\\tREF,ALT\\tAF)\n");
+    fprintf(stderr, "        --AF-file <file>               read allele frequencies from file (CHR\\tPOS\\tREF,ALT\\tAF) or INFO/AF of a VCF/BCF\n");
     fprintf(stderr, "    -b  --buffer-size <int[,int]>      buffer size and the number of overlapping sites, 0 for unlimited [0]\n");
     fprintf(stderr, "                                           If the first number is negative, it is interpreted as the maximum memory to\n");
     fprintf(stderr, "                                           use, in MB. The default overlap is set to roughly 1%% of the buffer size.\n");
@@ -1063,7 +1235,7 @@ static void usage(args_t *args)
     fprintf(stderr, "    -S, --samples-file <file>          file of samples to analyze [all samples]\n");
     fprintf(stderr, "    -t, --targets <region>             similar to -r but streams rather than index-jumps\n");
     fprintf(stderr, "    -T, --targets-file <file>          similar to -R but streams rather than index-jumps\n");
-    fprintf(stderr, "        --threads <int>                number of extra decompression threads [0]\n");
+    fprintf(stderr, "        --threads <int>                number of extra decompression and HMM threads [0]\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "HMM Options:\n");
     fprintf(stderr, "    -a, --hw-to-az <float>             P(AZ|HW) transition probability from HW (Hardy-Weinberg) to AZ (autozygous) state [6.7e-8]\n");
@@ -1194,7 +1366,19 @@ int main_vcfroh(int argc, char *argv[])
     }
     if ( args->af_fname )
     {
-        if ( bcf_sr_set_targets(args->files, args->af_fname, 1, 3)<0 )
+        htsFile *fp = hts_open(args->af_fname, "r");
+        if ( !fp ) error("Failed to open %s\n", args->af_fname);
+        args->af_vcf = hts_get_format(fp)->format==vcf || hts_get_format(fp)->format==bcf ? 1 : 0;
+        hts_close(fp);
+        if ( args->af_vcf )
+        {
+            args->af_files = bcf_sr_init();
+            args->af_files->require_index = 1;
+            args->af_rid = args->af_pos = -1;
+            if ( !bcf_sr_add_reader(args->af_files, args->af_fname) )
+                error("Failed to open %s: %s\n", args->af_fname,bcf_sr_strerror(args->af_files->errnum));
+        }
+        else if ( bcf_sr_set_targets(args->files, args->af_fname, 1, 3)<0 )
             error("Failed to read the targets: %s\n", args->af_fname);
     }
     if ( args->n_threads && bcf_sr_set_threads(args->files, args->n_threads)<0)
@@ -30,16 +30,28 @@ THE SOFTWARE.  */
 #include <errno.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <math.h>
 #include <time.h>
 #include <htslib/vcf.h>
 #include <htslib/synced_bcf_reader.h>
 #include <htslib/vcfutils.h>
+#include <htslib/thread_pool.h>
 #include <inttypes.h>
 #include "bcftools.h"
 
 #define SOM_TRAIN    1
 #define SOM_CLASSIFY 2
+#define SOM_CONVERT  3
+
+// Binary annotation matrix written by --convert and memory-mapped by the reader:
+//  - 8-byte magic, int32 number of values per site, int32 padding, int64 number of sites
+//  - double values of each site, in the same layout as args_t.train_dat
+//  - int32 class of each site
+#define ANNOTS_MAGIC "SOMAv1\0\0"
+
+#define SCORE_BATCH 10000   // number of sites scored at once by do_classify()
 
 typedef struct
 {
@@ -68,18 +80,41 @@ typedef struct
     htsFile *file;              // reader
     kstring_t str;              // temporary string for the reader
     int dclass, mvals;
-    double *vals;
+    double *vals;               // points into annots_dat with binary input
+    char *convert_fname;
+
+    // memory-mapped binary annotations
+    void *annots_map;
+    size_t annots_size;
+    int64_t nannots, iannots;
+    int32_t *annots_class;
+    double *annots_dat;
 
     // training data
     double *train_dat;
-    int *train_class, mtrain_class, mtrain_dat;
+    int *train_class, mtrain_class, mtrain_dat, ntrain_dat;
 
     int rand_seed, good_class, bad_class;
     char **argv, *fname, *prefix;
     int argc, action, train_bad, merge;
+
+    // the maps are trained and the sites scored in parallel with --threads
+    int n_threads;
+    hts_tpool *pool;
+    hts_tpool_process *queue;
 }
 args_t;
 
+typedef struct
+{
+    args_t *args;
+    double *dat, *score;    // input vectors and their scores
+    int *iskip;             // the SOM to skip for each vector, NULL to use all
+    int n;
+    int isom;               // the SOM to train
+}
+som_job_t;
+
 static void usage(void);
 FILE *open_file(char **fname, const char *mode, const char *fmt, ...);
 void mkdir_p(const char *fmt, ...);
@@ -120,6 +155,15 @@ static inline char *column_next(char *start, char delim)
  */
 int annots_reader_next(args_t *args)
 {
+    if ( args->annots_map )
+    {
+        if ( args->iannots >= args->nannots ) return 0;
+        args->dclass = args->annots_class[args->iannots];
+        args->vals   = args->annots_dat + args->iannots*args->mvals;
+        args->iannots++;
+        return 1;
+    }
+
     args->str.l = 0;
     if ( hts_getline(args->file,'\n',&args->str)<=0 ) return 0;
 
@@ -150,15 +194,44 @@ int annots_reader_next(args_t *args)
     }
     return 1;
 }
+static int annots_map_open(args_t *args)
+{
+    int fd = open(args->fname, O_RDONLY);
+    if ( fd<0 ) error("Failed to open %s: %s\n", args->fname,strerror(errno));
+    char magic[8];
+    struct stat st;
+    if ( read(fd,magic,8)!=8 || memcmp(magic,ANNOTS_MAGIC,8) || fstat(fd,&st)!=0 ) { close(fd); return 0; }
+
+    args->annots_size = st.st_size;
+    args->annots_map  = mmap(NULL, args->annots_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if ( args->annots_map==MAP_FAILED ) error("Failed to mmap %s: %s\n", args->fname,strerror(errno));
+
+    char *ptr = (char*) args->annots_map + 8;
+    int32_t nvals  = *((int32_t*)ptr);
+    args->nannots  = *((int64_t*)(ptr+8));
+    if ( nvals<=0 || args->nannots<0 || 24 + args->nannots*(nvals*sizeof(double) + sizeof(int32_t)) > args->annots_size )
+        error("The file is truncated or broken: %s\n", args->fname);
+    args->mvals = nvals;
+    args->annots_dat   = (double*)(ptr + 16);
+    args->annots_class = (int32_t*)(args->annots_dat + args->nannots*nvals);
+    return 1;
+}
 void annots_reader_reset(args_t *args)
 {
-    if ( args->file ) hts_close(args->file);
     if ( !args->fname ) error("annots_reader_reset: no fname\n");
+    args->iannots = 0;
+    if ( args->annots_map ) return;
+    if ( args->file ) hts_close(args->file);
+    args->file = NULL;
+    if ( strcmp("-",args->fname) && annots_map_open(args) ) return;
     args->file = hts_open(args->fname, "r");
+    if ( !args->file ) error("Failed to open %s: %s\n", args->fname,strerror(errno));
 }
 void annots_reader_close(args_t *args)
 {
-    hts_close(args->file);
+    if ( args->file ) hts_close(args->file);
+    args->file = NULL;
 }
 
 static void som_write_map(char *prefix, som_t **som, int nsom)
@@ -238,6 +311,26 @@ static void som_create_plot(som_t *som, char *prefix)
     fclose(fp);
     free(fname);
 }
+// Squared distance between the input vector and a node, four dimensions at a time
+// so that the compiler can vectorize the loop. Gives up as soon as the partial sum
+// reaches max_dist, such node cannot be the best match.
+static inline double som_node_dist(const double *vec, const double *ptr, int kdim, double max_dist)
+{
+    double d0 = 0, d1 = 0, d2 = 0, d3 = 0;
+    int k;
+    for (k=0; k+4<=kdim; k+=4)
+    {
+        double a = vec[k]   - ptr[k];
+        double b = vec[k+1] - ptr[k+1];
+        double c = vec[k+2] - ptr[k+2];
+        double d = vec[k+3] - ptr[k+3];
+        d0 += a*a; d1 += b*b; d2 += c*c; d3 += d*d;
+        if ( d0 + d1 + d2 + d3 >= max_dist ) return HUGE_VAL;
+    }
+    double dist = d0 + d1 + d2 + d3;
+    for (; k<kdim; k++) dist += (vec[k] - ptr[k]) * (vec[k] - ptr[k]);
+    return dist;
+}
 // Find the best matching unit: the node with minimum distance from the input vector
 static inline int som_find_bmu(som_t *som, double *vec, double *dist)
 {
@@ -245,12 +338,10 @@ static inline int som_find_bmu(som_t *som, double *vec, double *dist)
     double min_dist = HUGE_VAL;
     int min_idx = 0;
 
-    int i, k;
+    int i;
     for (i=0; i<som->size; i++)
     {
-        double dist = 0;
-        for (k=0; k<som->kdim; k++)
-            dist += (vec[k] - ptr[k]) * (vec[k] - ptr[k]);
+        double dist = som_node_dist(vec, ptr, som->kdim, min_dist);
         if ( dist < min_dist )
         {
             min_dist = dist;
@@ -267,14 +358,12 @@ static inline double som_get_score(som_t *som, double *vec, double bmu_th)
     double *ptr = som->w;
     double min_dist = HUGE_VAL;
 
-    int i, k;
+    int i;
     for (i=0; i<som->size; i++)
     {
         if ( som->c[i] >= bmu_th )
         {
-            double dist = 0;
-            for (k=0; k<som->kdim; k++)
-                dist += (vec[k] - ptr[k]) * (vec[k] - ptr[k]);
+            double dist = som_node_dist(vec, ptr, som->kdim, min_dist);
             if ( dist < min_dist ) min_dist = dist;
         }
         ptr += som->kdim;
@@ -379,6 +468,12 @@ static void init_data(args_t *args)
 
     if ( args->action==SOM_CLASSIFY )
         args->som = som_load_map(args->prefix,&args->nfold);
+
+    if ( args->n_threads )
+    {
+        if ( !(args->pool = hts_tpool_init(args->n_threads)) ) error("Failed to initialize a pool of %d threads\n", args->n_threads);
+        if ( !(args->queue = hts_tpool_process_init(args->pool, 2*args->n_threads, 1)) ) error("Failed to initialize the thread pool queue\n");
+    }
 }
 static void destroy_data(args_t *args)
 {
@@ -387,52 +482,97 @@ static void destroy_data(args_t *args)
     {
         for (i=0; i<args->nfold; i++) som_destroy(args->som[i]);
     }
-    free(args->train_dat);
+    if ( !args->annots_map ) free(args->train_dat);
     free(args->train_class);
     free(args->som);
-    free(args->vals);
+    if ( args->annots_map ) munmap(args->annots_map, args->annots_size);
+    else free(args->vals);
     free(args->str.s);
+    if ( args->queue ) hts_tpool_process_destroy(args->queue);
+    if ( args->pool ) hts_tpool_destroy(args->pool);
 }
 
 #define MERGE_MIN 0
 #define MERGE_MAX 1
 #define MERGE_AVG 2
-static double get_min_score(args_t *args, int iskip)
+static double get_min_score(args_t *args, double *vec, int iskip)
 {
     int i;
     double score, min_score = HUGE_VAL;
     for (i=0; i<args->nfold; i++)
     {
         if ( i==iskip ) continue;
-        score = som_get_score(args->som[i], args->vals, args->bmu_th);
+        score = som_get_score(args->som[i], vec, args->bmu_th);
         if ( i==0 || score < min_score ) min_score = score;
     }
     return min_score;
 }
-static double get_max_score(args_t *args, int iskip)
+static double get_max_score(args_t *args, double *vec, int iskip)
 {
     int i;
     double score, max_score = -HUGE_VAL;
     for (i=0; i<args->nfold; i++)
     {
         if ( i==iskip ) continue;
-        score = som_get_score(args->som[i], args->vals, args->bmu_th);
+        score = som_get_score(args->som[i], vec, args->bmu_th);
         if ( i==0 || max_score < score ) max_score = score;
     }
     return max_score;
 }
-static double get_avg_score(args_t *args, int iskip)
+static double get_avg_score(args_t *args, double *vec, int iskip)
 {
     int i, n = 0;
     double score = 0;
     for (i=0; i<args->nfold; i++)
     {
         if ( i==iskip ) continue;
-        score += som_get_score(args->som[i], args->vals, args->bmu_th);
+        score += som_get_score(args->som[i], vec, args->bmu_th);
         n++;
     }
     return score/n;
 }
+static void *score_sites(void *arg)
+{
+    som_job_t *job = (som_job_t*) arg;
+    args_t *args = job->args;
+    int i;
+    for (i=0; i<job->n; i++)
+    {
+        double *vec = job->dat + i*args->mvals;
+        int iskip = job->iskip ? job->iskip[i] : -1;
+        switch (args->merge)
+        {
+            case MERGE_MIN: job->score[i] = get_min_score(args, vec, iskip); break;
+            case MERGE_MAX: job->score[i] = get_max_score(args, vec, iskip); break;
+            case MERGE_AVG: job->score[i] = get_avg_score(args, vec, iskip); break;
+        }
+    }
+    return NULL;
+}
+// Score a batch of vectors, spread across the threads if requested
+static void score_batch(args_t *args, double *dat, int *iskip, int n, double *score)
+{
+    if ( !args->pool )
+    {
+        som_job_t job = { args, dat, score, iskip, n, 0 };
+        score_sites(&job);
+        return;
+    }
+    int i, njob = 4*args->n_threads, size = (n + njob - 1) / njob;
+    som_job_t *jobs = (som_job_t*) calloc(njob,sizeof(som_job_t));
+    for (i=0; i<njob && i*size<n; i++)
+    {
+        som_job_t *job = &jobs[i];
+        job->args  = args;
+        job->dat   = dat + i*size*args->mvals;
+        job->score = score + i*size;
+        job->iskip = iskip ? iskip + i*size : NULL;
+        job->n     = i*size + size <= n ? size : n - i*size;
+        if ( hts_tpool_dispatch(args->pool, args->queue, score_sites, job) < 0 ) error("Failed to dispatch a scoring job\n");
+    }
+    hts_tpool_process_flush(args->queue);
+    free(jobs);
+}
 static int cmpfloat_desc(const void *a, const void *b)
 {
     float fa = *((float*)a);
@@ -472,6 +612,22 @@ static void create_eval_plot(args_t *args)
     fclose(fp);
 }
 
+static void *train_som(void *arg)
+{
+    som_job_t *job = (som_job_t*) arg;
+    args_t *args = job->args;
+    int i;
+    for (i=0; i<args->ntrain_dat; i++)
+    {
+        int is_good = args->train_class[i] & 1;
+        int isom    = args->train_class[i] >> 1;
+        if ( isom!=job->isom ) continue;
+        if ( is_good || args->train_bad )
+            som_train_site(args->som[isom], args->train_dat+i*args->mvals, is_good);
+    }
+    return NULL;
+}
+
 static void do_train(args_t *args)
 {
     // read training sites
@@ -496,14 +652,18 @@ static void do_train(args_t *args)
         else
             error("Could not determine the class: %d (vs %d and %d)\n", args->dclass,args->good_class,args->bad_class);
 
-        // save the values for evaluation
+        // save the values for evaluation, the mapped binary annotations are used in place
         ntrain++;
-        hts_expand(double, ntrain*args->mvals, args->mtrain_dat, args->train_dat);
         hts_expand(int, ntrain, args->mtrain_class, args->train_class);
-        memcpy(args->train_dat+(ntrain-1)*args->mvals, args->vals, args->mvals*sizeof(double));
+        if ( !args->annots_map )
+        {
+            hts_expand(double, ntrain*args->mvals, args->mtrain_dat, args->train_dat);
+            memcpy(args->train_dat+(ntrain-1)*args->mvals, args->vals, args->mvals*sizeof(double));
+        }
         args->train_class[ntrain-1] = (args->dclass==args->good_class ? 1 : 0) | isom<<1;  // store class + chunk used for training
     }
     annots_reader_close(args);
+    if ( args->annots_map ) args->train_dat = args->annots_dat;
 
     // init maps
     if ( !args->ntrain ) args->ntrain = ngood/args->nfold;
@@ -511,14 +671,18 @@ static void do_train(args_t *args)
     args->som = (som_t**) malloc(sizeof(som_t*)*args->nfold);
     for (i=0; i<args->nfold; i++) args->som[i] = som_init(args);
 
-    // train
-    for (i=0; i<ntrain; i++)
+    // train, the maps are independent and each sees its own sites in the input order
+    args->ntrain_dat = ntrain;
+    som_job_t *jobs = (som_job_t*) calloc(args->nfold,sizeof(som_job_t));
+    for (i=0; i<args->nfold; i++)
     {
-        int is_good = args->train_class[i] & 1;
-        int isom    = args->train_class[i] >> 1;
-        if ( is_good || args->train_bad )
-            som_train_site(args->som[isom], args->train_dat+i*args->mvals, is_good);
+        jobs[i].args = args;
+        jobs[i].isom = i;
+        if ( !args->pool ) train_som(&jobs[i]);
+        else if ( hts_tpool_dispatch(args->pool, args->queue, train_som, &jobs[i]) < 0 ) error("Failed to dispatch the training of SOM %d\n", i);
     }
+    if ( args->pool ) hts_tpool_process_flush(args->queue);
+    free(jobs);
 
     // norm and create plots
     for (i=0; i<args->nfold; i++)
@@ -537,20 +701,16 @@ static void do_train(args_t *args)
     float *bad  = (float*) malloc(sizeof(float)*nbad); assert(bad);
     igood = ibad = 0;
     double max_score = sqrt(args->som[0]->kdim);
+    double *scores = (double*) malloc(sizeof(double)*ntrain);
+    int *iskip = (int*) malloc(sizeof(int)*ntrain);
+    for (i=0; i<ntrain; i++)
+        iskip[i] = args->nfold==1 ? -1 : args->train_class[i] >> 1;    // this vector was used for training isom-th SOM, skip
+    score_batch(args, args->train_dat, iskip, ntrain, scores);
+    free(iskip);
     for (i=0; i<ntrain; i++)
     {
-        double score = 0;
         int is_good = args->train_class[i] & 1;
-        int isom    = args->train_class[i] >> 1;    // this vector was used for training isom-th SOM, skip
-        if ( args->nfold==1 ) isom = -1;
-        memcpy(args->vals, args->train_dat+i*args->mvals, args->mvals*sizeof(double));
-        switch (args->merge)
-        {
-            case MERGE_MIN: score = get_min_score(args, isom); break;
-            case MERGE_MAX: score = get_max_score(args, isom); break;
-            case MERGE_AVG: score = get_avg_score(args, isom); break;
-        }
-        score = 1.0 - score/max_score;
+        double score = 1.0 - scores[i]/max_score;
         if ( is_good )
             good[igood++] = score;
         else
@@ -588,25 +748,59 @@ static void do_train(args_t *args)
         som_write_map(args->prefix, args->som, args->nfold);
     }
 
+    free(scores);
     free(good);
     free(bad);
 }
 
+static void do_convert(args_t *args)
+{
+    if ( args->annots_map ) error("The file is already converted: %s\n", args->fname);
+    FILE *fp = fopen(args->convert_fname,"wb");
+    if ( !fp ) error("Failed to open %s: %s\n", args->convert_fname,strerror(errno));
+
+    // the header is rewritten once the number of sites is known
+    int32_t hdr[2] = { args->mvals, 0 }, *dclass = NULL;
+    int64_t n = 0;
+    int mclass = 0;
+    if ( fwrite(ANNOTS_MAGIC,1,8,fp)!=8 || fwrite(hdr,sizeof(int32_t),2,fp)!=2 || fwrite(&n,sizeof(n),1,fp)!=1 )
+        error("Failed to write %s\n", args->convert_fname);
+    annots_reader_reset(args);
+    while ( annots_reader_next(args) )
+    {
+        if ( fwrite(args->vals,sizeof(double),args->mvals,fp)!=args->mvals ) error("Failed to write %s\n", args->convert_fname);
+        n++;
+        hts_expand(int32_t, n, mclass, dclass);
+        dclass[n-1] = args->dclass;
+    }
+    annots_reader_close(args);
+    if ( n && fwrite(dclass,sizeof(int32_t),n,fp)!=n ) error("Failed to write %s\n", args->convert_fname);
+    if ( fseek(fp,16,SEEK_SET)!=0 || fwrite(&n,sizeof(n),1,fp)!=1 ) error("Failed to write %s\n", args->convert_fname);
+    if ( fclose(fp) ) error("%s: fclose failed: %s\n", args->convert_fname,strerror(errno));
+    free(dclass);
+}
+
 static void do_classify(args_t *args)
 {
     annots_reader_reset(args);
     double max_score = sqrt(args->som[0]->kdim);
-    while ( annots_reader_next(args) )
+    double *dat = (double*) malloc(sizeof(double)*SCORE_BATCH*args->mvals);
+    double *scores = (double*) malloc(sizeof(double)*SCORE_BATCH);
+    int i, n, eof = 0;
+    while ( !eof )
     {
-        double score = 0;
-        switch (args->merge)
+        // read a batch of sites, score them and output in the input order
+        for (n=0; n<SCORE_BATCH; n++)
         {
-            case MERGE_MIN: score = get_min_score(args, -1); break;
-            case MERGE_MAX: score = get_max_score(args, -1); break;
-            case MERGE_AVG: score = get_avg_score(args, -1); break;
+            if ( !annots_reader_next(args) ) { eof = 1; break; }
+            memcpy(dat+n*args->mvals, args->vals, args->mvals*sizeof(double));
         }
-        printf("%e\n", 1.0 - score/max_score);
+        score_batch(args, dat, NULL, n, scores);
+        for (i=0; i<n; i++)
+            printf("%e\n", 1.0 - scores[i]/max_score);
     }
+    free(scores);
+    free(dat);
     annots_reader_close(args);
 }
 
@@ -616,6 +810,10 @@ static void usage(void)
     fprintf(stderr, "About:   SOM (Self-Organizing Map) filtering.\n");
     fprintf(stderr, "Usage:   bcftools som --train    [options] <annots.tab.gz>\n");
     fprintf(stderr, "         bcftools som --classify [options]\n");
+    fprintf(stderr, "         bcftools som --convert <annots.bin> <annots.tab.gz>\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "The annotations can be converted once to a binary file which is then\n");
+    fprintf(stderr, "memory-mapped by --train and --classify instead of being parsed.\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Model training options:\n");
     fprintf(stderr, "    -f, --nfold <int>                  n-fold cross-validation (number of maps) [5]\n");
@@ -635,6 +833,9 @@ static void usage(void)
     fprintf(stderr, "    -n, --ntrain-sites <int>           effective number of training sites [number of good sites]\n");
     fprintf(stderr, "    -r, --random-seed <int>            random seed, 0 for time() [1]\n");
     fprintf(stderr, "\n");
+    fprintf(stderr, "General options:\n");
+    fprintf(stderr, "        --threads <int>                train the maps and score the sites in <int> threads [0]\n");
+    fprintf(stderr, "\n");
     exit(1);
 }
 
@@ -669,11 +870,15 @@ int main_vcfsom(int argc, char *argv[])
         {"merge",1,0,'m'},
         {"train",0,0,'t'},
         {"classify",0,0,'c'},
+        {"threads",1,0,1},
+        {"convert",1,0,2},
         {0,0,0,0}
     };
     while ((c = getopt_long(argc, argv, "htcp:n:r:b:l:s:f:d:m:e",loptions,NULL)) >= 0) {
         switch (c) {
             case 'e': args->train_bad = 0; break;
+            case  1 : args->n_threads = atoi(optarg); break;
+            case  2 : args->action = SOM_CONVERT; args->convert_fname = optarg; break;
             case 'm':
                 if ( !strcmp(optarg,"min") ) args->merge = MERGE_MIN;
                 else if ( !strcmp(optarg,"max") ) args->merge = MERGE_MAX;
@@ -707,6 +912,7 @@ int main_vcfsom(int argc, char *argv[])
 
     if ( args->action == SOM_TRAIN ) do_train(args);
     else if ( args->action == SOM_CLASSIFY ) do_classify(args);
+    else if ( args->action == SOM_CONVERT ) do_convert(args);
 
     destroy_data(args);
     free(args);
@@ -0,0 +1,415 @@
+/*  vcfsort.c -- sort VCF/BCF files using a bounded amount of memory.
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.  */
+
+/*
+    The records are read into buffers of at most --max-mem bytes. A full
+    buffer is sorted and written to a temporary BCF file; with --threads the
+    input is split between nthreads+1 smaller buffers so that the reading
+    continues while the previous buffers are being sorted and written. The
+    runs are then merged with a heap. When all records fit in one buffer,
+    the output is written directly and no temporary files are created.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <htslib/vcf.h>
+#include <htslib/kstring.h>
+#include <htslib/thread_pool.h>
+#include "bcftools.h"
+#include "kheap.h"
+#include "tmpdir.h"
+
+#define SORT_MAX_MEM "768M"
+
+typedef struct
+{
+    bcf_hdr_t *hdr;
+    bcf1_t **recs;
+    int nrecs, mrecs;
+    size_t mem;
+    char *fname;        // the run this buffer is written to
+}
+blk_t;
+
+typedef struct
+{
+    bcf1_t *rec;
+    int irun;
+}
+run_rec_t;
+
+typedef struct
+{
+    htsThreadPool tpool;
+    hts_tpool_process *q;
+    blk_t *blks;
+    int nblks, iblk, nbusy;
+    char **runs;
+    int nruns;
+    size_t max_mem;
+    bcf_hdr_t *hdr, *out_hdr;
+    char *fname, *output_fname, *tmp_dir, *run_dir;
+    int output_type, n_threads, record_cmd_line, write_index;
+    int argc;
+    char **argv;
+}
+args_t;
+
+// the sort key: chromosome in the order of the header, position and alleles
+static inline int cmp_bcf_pos(bcf1_t *a, bcf1_t *b)
+{
+    if ( a->rid < b->rid ) return -1;
+    if ( a->rid > b->rid ) return 1;
+    if ( a->pos < b->pos ) return -1;
+    if ( a->pos > b->pos ) return 1;
+    int i, n = a->n_allele < b->n_allele ? a->n_allele : b->n_allele;
+    for (i=0; i<n; i++)
+    {
+        int ret = strcmp(a->d.allele[i], b->d.allele[i]);
+        if ( ret ) return ret;
+    }
+    if ( a->n_allele < b->n_allele ) return -1;
+    if ( a->n_allele > b->n_allele ) return 1;
+    return 0;
+}
+typedef struct
+{
+    bcf1_t *rec;
+    int idx;        // the input order within the buffer
+}
+blk_rec_t;
+static int cmp_blk_rec(const void *aptr, const void *bptr)
+{
+    const blk_rec_t *a = (const blk_rec_t*) aptr, *b = (const blk_rec_t*) bptr;
+    int ret = cmp_bcf_pos(a->rec, b->rec);
+    if ( ret ) return ret;
+    return a->idx < b->idx ? -1 : 1;    // qsort is not stable
+}
+
+// ties are broken by the run index to keep identical records in the input order
+static inline int run_rec_is_smaller(run_rec_t *a, run_rec_t *b)
+{
+    int ret = cmp_bcf_pos(a->rec, b->rec);
+    if ( ret ) return ret < 0 ? 1 : 0;
+    return a->irun < b->irun ? 1 : 0;
+}
+KHEAP_INIT(rec, run_rec_t, run_rec_is_smaller)
+typedef khp_rec_t rec_heap_t;
+
+static size_t parse_mem_string(const char *str)
+{
+    char *tmp;
+    double mem = strtod(str, &tmp);
+    if ( tmp==str || mem<=0 ) error("Could not parse the memory string: \"%s\"\n", str);
+    if ( !strcasecmp("k",tmp) ) mem *= 1024;
+    else if ( !strcasecmp("m",tmp) ) mem *= 1024*1024;
+    else if ( !strcasecmp("g",tmp) ) mem *= 1024*1024*1024;
+    else if ( *tmp ) error("Could not parse the memory string: \"%s\"\n", str);
+    return mem;
+}
+
+// records with the same key keep their input order, as they do across the
+// runs, see run_rec_is_smaller()
+static void sort_blk(blk_t *blk)
+{
+    if ( !blk->nrecs ) return;
+    int i;
+    blk_rec_t *srt = (blk_rec_t*) malloc(sizeof(*srt)*blk->nrecs);
+    for (i=0; i<blk->nrecs; i++)
+    {
+        srt[i].rec = blk->recs[i];
+        srt[i].idx = i;
+    }
+    qsort(srt, blk->nrecs, sizeof(*srt), cmp_blk_rec);
+    for (i=0; i<blk->nrecs; i++) blk->recs[i] = srt[i].rec;
+    free(srt);
+}
+
+// runs in a worker thread: sort the buffer and write it to a temporary file
+static void *write_run(void *arg)
+{
+    blk_t *blk = (blk_t*) arg;
+    sort_blk(blk);
+    htsFile *fh = hts_open(blk->fname, "wb1");
+    if ( !fh ) error("Failed to open %s: %s\n", blk->fname, strerror(errno));
+    if ( bcf_hdr_write(fh, blk->hdr)!=0 ) error("Failed to write to %s\n", blk->fname);
+    int i;
+    for (i=0; i<blk->nrecs; i++)
+        if ( bcf_write(fh, blk->hdr, blk->recs[i])!=0 ) error("Failed to write to %s\n", blk->fname);
+    if ( hts_close(fh)!=0 ) error("Close failed: %s\n", blk->fname);
+    bcf_hdr_destroy(blk->hdr);
+    blk->hdr = NULL;
+    return blk;
+}
+
+static void finish_run(args_t *args)
+{
+    hts_tpool_result *res = hts_tpool_next_result_wait(args->q);
+    if ( !res ) error("Failed to retrieve the sorted run\n");
+    blk_t *blk = (blk_t*) hts_tpool_result_data(res);
+    blk->nrecs = 0;
+    blk->mem   = 0;
+    hts_tpool_delete_result(res, 0);
+    args->nbusy--;
+}
+
+static void flush_blk(args_t *args, blk_t *blk)
+{
+    if ( !args->nruns ) args->run_dir = tmpdir_create(args->tmp_dir, "sort");
+    kstring_t str = {0,0,0};
+    ksprintf(&str, "%s/%05d.bcf", args->run_dir, args->nruns);
+    args->runs = (char**) realloc(args->runs, sizeof(*args->runs)*(args->nruns+1));
+    args->runs[args->nruns++] = blk->fname = str.s;
+
+    // VCF input can add undeclared contigs and tags to the header while the run is written
+    blk->hdr = bcf_hdr_dup(args->hdr);
+
+    if ( !args->q )
+    {
+        write_run(blk);
+        blk->nrecs = 0;
+        blk->mem   = 0;
+        return;
+    }
+    if ( hts_tpool_dispatch(args->tpool.pool, args->q, write_run, blk) < 0 ) error("Failed to dispatch the sort job\n");
+    args->nbusy++;
+    args->iblk = (args->iblk + 1) % args->nblks;
+    if ( args->nbusy==args->nblks ) finish_run(args);
+}
+
+static void init_data(args_t *args)
+{
+    args->nblks = args->n_threads > 0 ? args->n_threads + 1 : 1;
+    args->blks  = (blk_t*) calloc(args->nblks, sizeof(blk_t));
+    if ( args->n_threads > 0 )
+    {
+        if ( !(args->tpool.pool = hts_tpool_init(args->n_threads)) ) error("Failed to initialize a pool of %d threads\n", args->n_threads);
+        if ( !(args->q = hts_tpool_process_init(args->tpool.pool, args->nblks, 0)) ) error("Failed to initialize the thread pool queue\n");
+    }
+}
+
+static void destroy_data(args_t *args)
+{
+    int i, j;
+    for (i=0; i<args->nruns; i++)
+    {
+        if ( unlink(args->runs[i])!=0 ) error("Failed to remove the temporary file %s: %s\n", args->runs[i], strerror(errno));
+        free(args->runs[i]);
+    }
+    free(args->runs);
+    if ( args->nruns && tmpdir_remove(args->run_dir)!=0 ) error("Failed to remove the temporary directory %s: %s\n", args->run_dir, strerror(errno));
+    free(args->run_dir);
+    free(args->tmp_dir);
+    for (i=0; i<args->nblks; i++)
+    {
+        for (j=0; j<args->blks[i].mrecs; j++) bcf_destroy(args->blks[i].recs[j]);
+        free(args->blks[i].recs);
+    }
+    free(args->blks);
+    if ( args->q ) hts_tpool_process_destroy(args->q);
+    if ( args->tpool.pool ) hts_tpool_destroy(args->tpool.pool);
+}
+
+static htsFile *open_output(args_t *args)
+{
+    htsFile *out_fh = hts_open(args->output_fname, hts_bcf_wmode(args->output_type));
+    if ( !out_fh ) error("Can't write to \"%s\": %s\n", args->output_fname, strerror(errno));
+    if ( args->tpool.pool ) hts_set_opt(out_fh, HTS_OPT_THREAD_POOL, &args->tpool);
+    if ( bcf_hdr_write(out_fh, args->out_hdr)!=0 ) error("Failed to write to %s\n", args->output_fname);
+    return out_fh;
+}
+
+static void merge_runs(args_t *args)
+{
+    int i;
+    htsFile **fhs = (htsFile**) calloc(args->nruns, sizeof(*fhs));
+    rec_heap_t *heap = khp_init(rec);
+    run_rec_t dat;
+    for (i=0; i<args->nruns; i++)
+    {
+        fhs[i] = hts_open(args->runs[i], "r");
+        if ( !fhs[i] ) error("Failed to open %s: %s\n", args->runs[i], strerror(errno));
+        bcf_hdr_t *hdr = bcf_hdr_read(fhs[i]);
+        if ( !hdr ) error("Failed to read the header of %s\n", args->runs[i]);
+        bcf_hdr_destroy(hdr);
+        dat.rec  = bcf_init();
+        dat.irun = i;
+        if ( bcf_read(fhs[i], args->hdr, dat.rec)!=0 ) error("Failed to read from %s\n", args->runs[i]);
+        bcf_unpack(dat.rec, BCF_UN_STR);
+        khp_insert(rec, heap, &dat);
+    }
+
+    htsFile *out_fh = open_output(args);
+    while ( heap->ndat )
+    {
+        dat = heap->dat[0];
+        if ( bcf_write(out_fh, args->out_hdr, dat.rec)!=0 ) error("Failed to write to %s\n", args->output_fname);
+        khp_delete(rec, heap);
+        int ret = bcf_read(fhs[dat.irun], args->hdr, dat.rec);
+        if ( ret < -1 ) error("Failed to read from %s\n", args->runs[dat.irun]);
+        if ( ret==-1 ) { bcf_destroy(dat.rec); continue; }
+        bcf_unpack(dat.rec, BCF_UN_STR);
+        khp_insert(rec, heap, &dat);
+    }
+    if ( hts_close(out_fh)!=0 ) error("Close failed: %s\n", args->output_fname);
+
+    for (i=0; i<args->nruns; i++)
+        if ( hts_close(fhs[i])!=0 ) error("Close failed: %s\n", args->runs[i]);
+    free(fhs);
+    khp_destroy(rec, heap);
+}
+
+static void sort_vcf(args_t *args)
+{
+    htsFile *in_fh = hts_open(args->fname, "r");
+    if ( !in_fh ) error("Could not read: %s\n", args->fname);
+    if ( args->tpool.pool ) hts_set_opt(in_fh, HTS_OPT_THREAD_POOL, &args->tpool);
+    args->hdr = bcf_hdr_read(in_fh);
+    if ( !args->hdr ) error("Could not read the header: %s\n", args->fname);
+
+    size_t max_mem = args->max_mem / args->nblks;
+    int i, ret;
+    blk_t *blk = &args->blks[args->iblk];
+    while ( 1 )
+    {
+        blk = &args->blks[args->iblk];
+        hts_expand0(bcf1_t*, blk->nrecs+1, blk->mrecs, blk->recs);
+        if ( !blk->recs[blk->nrecs] ) blk->recs[blk->nrecs] = bcf_init();
+        bcf1_t *rec = blk->recs[blk->nrecs];
+        if ( (ret=bcf_read(in_fh, args->hdr, rec))!=0 ) break;
+        if ( rec->errcode ) error("Error encountered while parsing the input at %s:%d\n", bcf_seqname(args->hdr,rec), rec->pos+1);
+        bcf_unpack(rec, BCF_UN_STR);
+        blk->nrecs++;
+        blk->mem += sizeof(bcf1_t) + rec->shared.m + rec->indiv.m + rec->d.m_als + rec->d.m_allele*sizeof(char*);
+        if ( blk->mem >= max_mem ) flush_blk(args, blk);
+    }
+    if ( ret < -1 ) error("Failed to read from %s\n", args->fname);
+    args->out_hdr = bcf_hdr_dup(args->hdr);
+    if ( args->record_cmd_line ) bcf_hdr_append_version(args->out_hdr, args->argc, args->argv, "bcftools_sort");
+
+    if ( !args->nruns )
+    {
+        // everything fits in memory
+        sort_blk(blk);
+        htsFile *out_fh = open_output(args);
+        for (i=0; i<blk->nrecs; i++)
+            if ( bcf_write(out_fh, args->out_hdr, blk->recs[i])!=0 ) error("Failed to write to %s\n", args->output_fname);
+        if ( hts_close(out_fh)!=0 ) error("Close failed: %s\n", args->output_fname);
+    }
+    else
+    {
+        if ( blk->nrecs ) flush_blk(args, blk);
+        while ( args->nbusy ) finish_run(args);
+        merge_runs(args);
+    }
+    if ( hts_close(in_fh)!=0 ) error("Close failed: %s\n", args->fname);
+    bcf_hdr_destroy(args->hdr);
+    bcf_hdr_destroy(args->out_hdr);
+}
+
+static void usage(args_t *args)
+{
+    fprintf(stderr, "\n");
+    fprintf(stderr, "About:   Sort VCF/BCF file by chromosome, position and alleles. The chromosomes are\n");
+    fprintf(stderr, "         ordered as in the header. Files which do not fit in memory are sorted in\n");
+    fprintf(stderr, "         chunks written to a temporary directory and merged.\n");
+    fprintf(stderr, "Usage:   bcftools sort [options] <in.vcf.gz>\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "   -m, --max-mem <float>[kMG]     Maximum memory to use [%s]\n", SORT_MAX_MEM);
+    fprintf(stderr, "       --no-version               Do not append version and command line to the header\n");
+    fprintf(stderr, "   -o, --output <file>            Write output to a file [standard output]\n");
+    fprintf(stderr, "   -O, --output-type <b|u|z|v>    b: compressed BCF, u: uncompressed BCF, z: compressed VCF, v: uncompressed VCF [v]\n");
+    fprintf(stderr, "   -T, --temp-dir <dir>           Directory for temporary files [$TMPDIR or /tmp]\n");
+    fprintf(stderr, "       --threads <int>            Number of extra threads to sort and compress with [0]\n");
+    fprintf(stderr, "       --write-index              Index the output file, requires compressed output written to a file\n");
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+int main_vcfsort(int argc, char *argv[])
+{
+    int c;
+    args_t *args  = (args_t*) calloc(1,sizeof(args_t));
+    args->argc    = argc; args->argv = argv;
+    args->output_fname = "-";
+    args->output_type = FT_VCF;
+    args->n_threads = 0;
+    args->record_cmd_line = 1;
+    args->max_mem = parse_mem_string(SORT_MAX_MEM);
+
+    static struct option loptions[] =
+    {
+        {"max-mem",required_argument,NULL,'m'},
+        {"temp-dir",required_argument,NULL,'T'},
+        {"output",required_argument,NULL,'o'},
+        {"output-type",required_argument,NULL,'O'},
+        {"threads",required_argument,NULL,9},
+        {"no-version",no_argument,NULL,8},
+        {"write-index",no_argument,NULL,10},
+        {"help",no_argument,NULL,'h'},
+        {NULL,0,NULL,0}
+    };
+    while ((c = getopt_long(argc, argv, "m:T:o:O:h?",loptions,NULL)) >= 0)
+    {
+        switch (c) {
+            case 'm': args->max_mem = parse_mem_string(optarg); break;
+            case 'T': args->tmp_dir = strdup(optarg); break;
+            case 'o': args->output_fname = optarg; break;
+            case 'O':
+                switch (optarg[0]) {
+                    case 'b': args->output_type = FT_BCF_GZ; break;
+                    case 'u': args->output_type = FT_BCF; break;
+                    case 'z': args->output_type = FT_VCF_GZ; break;
+                    case 'v': args->output_type = FT_VCF; break;
+                    default: error("The output type \"%s\" not recognised\n", optarg);
+                };
+                break;
+            case  9 : args->n_threads = strtol(optarg, 0, 0); break;
+            case  8 : args->record_cmd_line = 0; break;
+            case 10 : args->write_index = 1; break;
+            case 'h':
+            case '?': usage(args); break;
+            default: error("Unknown argument: %s\n", optarg);
+        }
+    }
+
+    if ( optind>=argc )
+    {
+        if ( !isatty(fileno((FILE *)stdin)) ) args->fname = "-";  // reading from stdin
+        else usage(args);
+    }
+    else args->fname = argv[optind];
+    if ( args->write_index ) init_write_index(args->output_fname, args->output_type);
+
+    init_data(args);
+    sort_vcf(args);
+    destroy_data(args);
+    if ( args->write_index ) write_index(args->output_fname, args->output_type, args->n_threads);
+    free(args);
+    return 0;
+}
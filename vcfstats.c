@@ -36,6 +36,7 @@ THE SOFTWARE.  */
 #include <htslib/synced_bcf_reader.h>
 #include <htslib/vcfutils.h>
 #include <htslib/faidx.h>
+#include <htslib/thread_pool.h>
 #include <inttypes.h>
 #include "bcftools.h"
 #include "filter.h"
@@ -123,6 +124,15 @@ typedef struct
 }
 indel_ctx_t;
 
+// bcf_gt_type() output for a diploid genotype encoded as int8, see init_gt8()
+typedef struct
+{
+    uint8_t type, ial, jal;
+}
+gt8_t;
+
+typedef struct _batch_t batch_t;
+
 typedef struct
 {
     // stats
@@ -155,9 +165,35 @@ typedef struct
     char *filter_str;
     int filter_logic;   // include or exclude sites which match the filters? One of FLT_INCLUDE/FLT_EXCLUDE
     int n_threads;
+    gt8_t *gt8;
+
+    // the input files and samples as seen by print_header() and print_stats(),
+    // taken from the readers or, with --merge, from the snapshots
+    int nfiles, nfile_smpl[2], nsmpl;
+    char *fnames[2], **smpl_names;
+    char *dump_fname;
+    int merge;
+
+    batch_t *batches;
+    int nbatches, nbusy, ibatch;
+    hts_tpool_process *tpool_q;
 }
 args_t;
 
+#define BATCH_SIZE 1000
+
+// With --threads, batches of records are processed in parallel. Each batch has
+// its own copy of args with private stats, filter, exons and indel context, the
+// stats are added up at the end. The batches are reused round-robin so that the
+// records of one batch come in the genomic order, as the exon and indel context
+// lookups require.
+struct _batch_t
+{
+    args_t args;
+    bcf1_t **lines;
+    int nlines;
+};
+
 static int type2dosage[6], type2ploidy[6], type2stats[7];
 
 static void idist_init(idist_t *d, int min, int max, int step)
@@ -388,12 +424,108 @@ static void init_user_stats(args_t *args, bcf_hdr_t *hdr, stats_t *stats)
         user_stats_t *usr = &stats->usr[i];
         usr->vals_ts = (uint64_t*)calloc(usr->nbins,sizeof(uint64_t));
         usr->vals_tv = (uint64_t*)calloc(usr->nbins,sizeof(uint64_t));
+        if ( !hdr ) continue;   // --merge, the tags were checked when the snapshot was created
         int id = bcf_hdr_id2int(hdr,BCF_DT_ID,usr->tag);
         if ( !bcf_hdr_idinfo_exists(hdr,BCF_HL_INFO,id) ) error("The INFO tag \"%s\" is not defined in the header\n", usr->tag);
         usr->type = bcf_hdr_id2type(hdr,BCF_HL_INFO,id);
         if ( usr->type!=BCF_HT_REAL && usr->type!=BCF_HT_INT ) error("The INFO tag \"%s\" is not of Float or Integer type (%d)\n", usr->type);
     }
 }
+static void init_stats1(args_t *args, stats_t *stats, bcf_hdr_t *hdr)
+{
+    stats->m_indel     = 60;
+    stats->insertions  = (int*) calloc(stats->m_indel,sizeof(int));
+    stats->deletions   = (int*) calloc(stats->m_indel,sizeof(int));
+    stats->af_ts       = (int*) calloc(args->m_af,sizeof(int));
+    stats->af_tv       = (int*) calloc(args->m_af,sizeof(int));
+    stats->af_snps     = (int*) calloc(args->m_af,sizeof(int));
+    int j;
+    for (j=0; j<3; j++) stats->af_repeats[j] = (int*) calloc(args->m_af,sizeof(int));
+    #if QUAL_STATS
+        stats->qual_ts     = (int*) calloc(args->m_qual,sizeof(int));
+        stats->qual_tv     = (int*) calloc(args->m_qual,sizeof(int));
+        stats->qual_snps   = (int*) calloc(args->m_qual,sizeof(int));
+        stats->qual_indels = (int*) calloc(args->m_qual,sizeof(int));
+    #endif
+    if ( args->nsmpl )
+    {
+        stats->smpl_hets   = (int *) calloc(args->nsmpl,sizeof(int));
+        stats->smpl_homAA  = (int *) calloc(args->nsmpl,sizeof(int));
+        stats->smpl_homRR  = (int *) calloc(args->nsmpl,sizeof(int));
+        stats->smpl_indel_hets = (int *) calloc(args->nsmpl,sizeof(int));
+        stats->smpl_indel_homs = (int *) calloc(args->nsmpl,sizeof(int));
+        stats->smpl_ts     = (int *) calloc(args->nsmpl,sizeof(int));
+        stats->smpl_tv     = (int *) calloc(args->nsmpl,sizeof(int));
+        stats->smpl_indels = (int *) calloc(args->nsmpl,sizeof(int));
+        stats->smpl_dp     = (unsigned long int *) calloc(args->nsmpl,sizeof(unsigned long int));
+        stats->smpl_ndp    = (int *) calloc(args->nsmpl,sizeof(int));
+        stats->smpl_sngl   = (int *) calloc(args->nsmpl,sizeof(int));
+        #if HWE_STATS
+            stats->af_hwe  = (int*) calloc(args->m_af*args->naf_hwe,sizeof(int));
+        #endif
+        if ( args->exons_fname )
+            stats->smpl_frm_shifts = (int*) calloc(args->nsmpl*3,sizeof(int));
+    }
+    idist_init(&stats->dp, args->dp_min,args->dp_max,args->dp_step);
+    idist_init(&stats->dp_sites, args->dp_min,args->dp_max,args->dp_step);
+    init_user_stats(args, hdr, stats);
+}
+
+static bcf_sr_regions_t *init_exons(args_t *args)
+{
+    bcf_sr_regions_t *exons = bcf_sr_regions_init(args->exons_fname,1,0,1,2);
+    if ( !exons )
+        error("Error occurred while reading, was the file compressed with bgzip: %s?\n", args->exons_fname);
+    return exons;
+}
+
+// bcf_gt_type() of all diploid genotypes encoded as int8, indexed by the two raw bytes
+static void init_gt8(args_t *args)
+{
+    int8_t gt[2];
+    bcf_fmt_t fmt;
+    memset(&fmt, 0, sizeof(fmt));
+    fmt.n = fmt.size = 2;
+    fmt.type = BCF_BT_INT8;
+    fmt.p = (uint8_t*) gt;
+    args->gt8 = (gt8_t*) malloc(sizeof(gt8_t)*65536);
+    int i;
+    for (i=0; i<65536; i++)
+    {
+        int ial = 0, jal = 0;
+        gt[0] = (int8_t)(i >> 8);
+        gt[1] = (int8_t)(i & 0xff);
+        args->gt8[i].type = bcf_gt_type(&fmt, 0, &ial, &jal);
+        args->gt8[i].ial  = ial;
+        args->gt8[i].jal  = jal;
+    }
+}
+
+static void init_gt_types(void)
+{
+    type2dosage[GT_HOM_RR] = 0;
+    type2dosage[GT_HET_RA] = 1;
+    type2dosage[GT_HOM_AA] = 2;
+    type2dosage[GT_HET_AA] = 2;
+    type2dosage[GT_HAPL_R] = 0;
+    type2dosage[GT_HAPL_A] = 1;
+
+    type2ploidy[GT_HOM_RR] = 1;
+    type2ploidy[GT_HET_RA] = 1;
+    type2ploidy[GT_HOM_AA] = 1;
+    type2ploidy[GT_HET_AA] = 1;
+    type2ploidy[GT_HAPL_R] = -1;
+    type2ploidy[GT_HAPL_A] = -1;
+
+    type2stats[GT_HOM_RR] = 0;
+    type2stats[GT_HET_RA] = 1;
+    type2stats[GT_HOM_AA] = 2;
+    type2stats[GT_HET_AA] = 3;
+    type2stats[GT_HAPL_R] = 0;
+    type2stats[GT_HAPL_A] = 2;
+    type2stats[GT_UNKN]   = 4;
+}
+
 static void init_stats(args_t *args)
 {
     int i;
@@ -450,126 +582,76 @@ static void init_stats(args_t *args)
         args->smpl_gts_snps   = (gtcmp_t *) calloc(args->files->n_smpl,sizeof(gtcmp_t));
         args->smpl_gts_indels = (gtcmp_t *) calloc(args->files->n_smpl,sizeof(gtcmp_t));
     }
-    for (i=0; i<args->nstats; i++)
+    args->nfiles = args->files->nreaders;
+    for (i=0; i<args->nfiles; i++)
     {
-        stats_t *stats = &args->stats[i];
-        stats->m_indel     = 60;
-        stats->insertions  = (int*) calloc(stats->m_indel,sizeof(int));
-        stats->deletions   = (int*) calloc(stats->m_indel,sizeof(int));
-        stats->af_ts       = (int*) calloc(args->m_af,sizeof(int));
-        stats->af_tv       = (int*) calloc(args->m_af,sizeof(int));
-        stats->af_snps     = (int*) calloc(args->m_af,sizeof(int));
-        int j;
-        for (j=0; j<3; j++) stats->af_repeats[j] = (int*) calloc(args->m_af,sizeof(int));
-        #if QUAL_STATS
-            stats->qual_ts     = (int*) calloc(args->m_qual,sizeof(int));
-            stats->qual_tv     = (int*) calloc(args->m_qual,sizeof(int));
-            stats->qual_snps   = (int*) calloc(args->m_qual,sizeof(int));
-            stats->qual_indels = (int*) calloc(args->m_qual,sizeof(int));
-        #endif
-        if ( args->files->n_smpl )
-        {
-            stats->smpl_hets   = (int *) calloc(args->files->n_smpl,sizeof(int));
-            stats->smpl_homAA  = (int *) calloc(args->files->n_smpl,sizeof(int));
-            stats->smpl_homRR  = (int *) calloc(args->files->n_smpl,sizeof(int));
-            stats->smpl_indel_hets = (int *) calloc(args->files->n_smpl,sizeof(int));
-            stats->smpl_indel_homs = (int *) calloc(args->files->n_smpl,sizeof(int));
-            stats->smpl_ts     = (int *) calloc(args->files->n_smpl,sizeof(int));
-            stats->smpl_tv     = (int *) calloc(args->files->n_smpl,sizeof(int));
-            stats->smpl_indels = (int *) calloc(args->files->n_smpl,sizeof(int));
-            stats->smpl_dp     = (unsigned long int *) calloc(args->files->n_smpl,sizeof(unsigned long int));
-            stats->smpl_ndp    = (int *) calloc(args->files->n_smpl,sizeof(int));
-            stats->smpl_sngl   = (int *) calloc(args->files->n_smpl,sizeof(int));
-            #if HWE_STATS
-                stats->af_hwe  = (int*) calloc(args->m_af*args->naf_hwe,sizeof(int));
-            #endif
-            if ( args->exons_fname )
-                stats->smpl_frm_shifts = (int*) calloc(args->files->n_smpl*3,sizeof(int));
-        }
-        idist_init(&stats->dp, args->dp_min,args->dp_max,args->dp_step);
-        idist_init(&stats->dp_sites, args->dp_min,args->dp_max,args->dp_step);
-        init_user_stats(args, i!=1 ? args->files->readers[0].header : args->files->readers[1].header, stats);
+        args->fnames[i] = args->files->readers[i].fname;
+        args->nfile_smpl[i] = bcf_hdr_nsamples(args->files->readers[i].header);
     }
+    args->nsmpl = args->files->n_smpl;
+    args->smpl_names = args->files->samples;
+    for (i=0; i<args->nstats; i++)
+        init_stats1(args, &args->stats[i], i!=1 ? args->files->readers[0].header : args->files->readers[1].header);
 
     if ( args->exons_fname )
-    {
-        args->exons = bcf_sr_regions_init(args->exons_fname,1,0,1,2);
-        if ( !args->exons )
-            error("Error occurred while reading, was the file compressed with bgzip: %s?\n", args->exons_fname);
-    }
+        args->exons = init_exons(args);
+    if ( args->files->n_smpl )
+        init_gt8(args);
 
     #if IRC_STATS
     if ( args->ref_fname )
         args->indel_ctx = indel_ctx_init(args->ref_fname);
     #endif
 
-    type2dosage[GT_HOM_RR] = 0;
-    type2dosage[GT_HET_RA] = 1;
-    type2dosage[GT_HOM_AA] = 2;
-    type2dosage[GT_HET_AA] = 2;
-    type2dosage[GT_HAPL_R] = 0;
-    type2dosage[GT_HAPL_A] = 1;
-
-    type2ploidy[GT_HOM_RR] = 1;
-    type2ploidy[GT_HET_RA] = 1;
-    type2ploidy[GT_HOM_AA] = 1;
-    type2ploidy[GT_HET_AA] = 1;
-    type2ploidy[GT_HAPL_R] = -1;
-    type2ploidy[GT_HAPL_A] = -1;
-
-    type2stats[GT_HOM_RR] = 0;
-    type2stats[GT_HET_RA] = 1;
-    type2stats[GT_HOM_AA] = 2;
-    type2stats[GT_HET_AA] = 3;
-    type2stats[GT_HAPL_R] = 0;
-    type2stats[GT_HAPL_A] = 2;
-    type2stats[GT_UNKN]   = 4;
+    init_gt_types();
 
 }
+static void destroy_stats1(args_t *args, stats_t *stats)
+{
+    int j;
+    if (stats->af_ts) free(stats->af_ts);
+    if (stats->af_tv) free(stats->af_tv);
+    if (stats->af_snps) free(stats->af_snps);
+    for (j=0; j<3; j++)
+        if (stats->af_repeats[j]) free(stats->af_repeats[j]);
+    #if QUAL_STATS
+        if (stats->qual_ts) free(stats->qual_ts);
+        if (stats->qual_tv) free(stats->qual_tv);
+        if (stats->qual_snps) free(stats->qual_snps);
+        if (stats->qual_indels) free(stats->qual_indels);
+    #endif
+    #if HWE_STATS
+        free(stats->af_hwe);
+    #endif
+    free(stats->insertions);
+    free(stats->deletions);
+    if (stats->smpl_hets) free(stats->smpl_hets);
+    if (stats->smpl_homAA) free(stats->smpl_homAA);
+    if (stats->smpl_homRR) free(stats->smpl_homRR);
+    if (stats->smpl_indel_homs) free(stats->smpl_indel_homs);
+    if (stats->smpl_indel_hets) free(stats->smpl_indel_hets);
+    if (stats->smpl_ts) free(stats->smpl_ts);
+    if (stats->smpl_tv) free(stats->smpl_tv);
+    if (stats->smpl_indels) free(stats->smpl_indels);
+    if (stats->smpl_dp) free(stats->smpl_dp);
+    if (stats->smpl_ndp) free(stats->smpl_ndp);
+    if (stats->smpl_sngl) free(stats->smpl_sngl);
+    idist_destroy(&stats->dp);
+    idist_destroy(&stats->dp_sites);
+    for (j=0; j<stats->nusr; j++)
+    {
+        free(stats->usr[j].vals_ts);
+        free(stats->usr[j].vals_tv);
+        free(stats->usr[j].val);
+    }
+    free(stats->usr);
+    free(stats->smpl_frm_shifts);
+}
 static void destroy_stats(args_t *args)
 {
     int id, j;
     for (id=0; id<args->nstats; id++)
-    {
-        stats_t *stats = &args->stats[id];
-        if (stats->af_ts) free(stats->af_ts);
-        if (stats->af_tv) free(stats->af_tv);
-        if (stats->af_snps) free(stats->af_snps);
-        for (j=0; j<3; j++)
-            if (stats->af_repeats[j]) free(stats->af_repeats[j]);
-        #if QUAL_STATS
-            if (stats->qual_ts) free(stats->qual_ts);
-            if (stats->qual_tv) free(stats->qual_tv);
-            if (stats->qual_snps) free(stats->qual_snps);
-            if (stats->qual_indels) free(stats->qual_indels);
-        #endif
-        #if HWE_STATS
-            free(stats->af_hwe);
-        #endif
-        free(stats->insertions);
-        free(stats->deletions);
-        if (stats->smpl_hets) free(stats->smpl_hets);
-        if (stats->smpl_homAA) free(stats->smpl_homAA);
-        if (stats->smpl_homRR) free(stats->smpl_homRR);
-        if (stats->smpl_indel_homs) free(stats->smpl_indel_homs);
-        if (stats->smpl_indel_hets) free(stats->smpl_indel_hets);
-        if (stats->smpl_ts) free(stats->smpl_ts);
-        if (stats->smpl_tv) free(stats->smpl_tv);
-        if (stats->smpl_indels) free(stats->smpl_indels);
-        if (stats->smpl_dp) free(stats->smpl_dp);
-        if (stats->smpl_ndp) free(stats->smpl_ndp);
-        if (stats->smpl_sngl) free(stats->smpl_sngl);
-        idist_destroy(&stats->dp);
-        idist_destroy(&stats->dp_sites);
-        for (j=0; j<stats->nusr; j++)
-        {
-            free(stats->usr[j].vals_ts);
-            free(stats->usr[j].vals_tv);
-            free(stats->usr[j].val);
-        }
-        free(stats->usr);
-        if ( args->exons ) free(stats->smpl_frm_shifts);
-    }
+        destroy_stats1(args, &args->stats[id]);
     for (j=0; j<args->nusr; j++) free(args->usr[j].tag);
     if ( args->af_bins ) bin_destroy(args->af_bins);
     free(args->farr);
@@ -584,6 +666,426 @@ static void destroy_stats(args_t *args)
     if (args->indel_ctx) indel_ctx_destroy(args->indel_ctx);
     if (args->filter[0]) filter_destroy(args->filter[0]);
     if (args->filter[1]) filter_destroy(args->filter[1]);
+    free(args->gt8);
+    if ( args->merge )
+    {
+        for (j=0; j<args->nfiles; j++) free(args->fnames[j]);
+        for (j=0; j<args->nsmpl; j++) free(args->smpl_names[j]);
+        free(args->smpl_names);
+        free(args->exons_fname);
+        free(args->ref_fname);
+    }
+}
+
+static void merge_ints(int *dst, int *src, int n)
+{
+    int i;
+    for (i=0; i<n; i++) dst[i] += src[i];
+}
+static void merge_uint64s(uint64_t *dst, uint64_t *src, int n)
+{
+    int i;
+    for (i=0; i<n; i++) dst[i] += src[i];
+}
+
+// Add the counts of src to dst, both initialized by init_stats1() with the same args
+static void merge_stats(args_t *args, stats_t *dst, stats_t *src)
+{
+    int i, j;
+    dst->n_snps     += src->n_snps;
+    dst->n_indels   += src->n_indels;
+    dst->n_mnps     += src->n_mnps;
+    dst->n_others   += src->n_others;
+    dst->n_mals     += src->n_mals;
+    dst->n_snp_mals += src->n_snp_mals;
+    dst->n_records  += src->n_records;
+    dst->n_noalts   += src->n_noalts;
+    dst->ts_alt1    += src->ts_alt1;
+    dst->tv_alt1    += src->tv_alt1;
+    dst->in_frame   += src->in_frame;
+    dst->out_frame  += src->out_frame;
+    dst->na_frame   += src->na_frame;
+    dst->in_frame_alt1  += src->in_frame_alt1;
+    dst->out_frame_alt1 += src->out_frame_alt1;
+    dst->na_frame_alt1  += src->na_frame_alt1;
+    merge_ints(dst->subst, src->subst, 15);
+    merge_ints(dst->af_ts, src->af_ts, args->m_af);
+    merge_ints(dst->af_tv, src->af_tv, args->m_af);
+    merge_ints(dst->af_snps, src->af_snps, args->m_af);
+    merge_ints(dst->insertions, src->insertions, dst->m_indel);
+    merge_ints(dst->deletions, src->deletions, dst->m_indel);
+    #if HWE_STATS
+        if ( dst->af_hwe ) merge_ints(dst->af_hwe, src->af_hwe, args->m_af*args->naf_hwe);
+    #endif
+    #if IRC_STATS
+        for (i=0; i<IRC_RLEN; i++) merge_ints(dst->n_repeat[i], src->n_repeat[i], 4);
+        dst->n_repeat_na += src->n_repeat_na;
+        for (j=0; j<3; j++) merge_ints(dst->af_repeats[j], src->af_repeats[j], args->m_af);
+    #endif
+    #if QUAL_STATS
+        merge_ints(dst->qual_ts, src->qual_ts, args->m_qual);
+        merge_ints(dst->qual_tv, src->qual_tv, args->m_qual);
+        merge_ints(dst->qual_snps, src->qual_snps, args->m_qual);
+        merge_ints(dst->qual_indels, src->qual_indels, args->m_qual);
+    #endif
+    int nsmpl = args->nsmpl;
+    if ( nsmpl )
+    {
+        merge_ints(dst->smpl_hets, src->smpl_hets, nsmpl);
+        merge_ints(dst->smpl_homRR, src->smpl_homRR, nsmpl);
+        merge_ints(dst->smpl_homAA, src->smpl_homAA, nsmpl);
+        merge_ints(dst->smpl_ts, src->smpl_ts, nsmpl);
+        merge_ints(dst->smpl_tv, src->smpl_tv, nsmpl);
+        merge_ints(dst->smpl_indels, src->smpl_indels, nsmpl);
+        merge_ints(dst->smpl_ndp, src->smpl_ndp, nsmpl);
+        merge_ints(dst->smpl_sngl, src->smpl_sngl, nsmpl);
+        merge_ints(dst->smpl_indel_hets, src->smpl_indel_hets, nsmpl);
+        merge_ints(dst->smpl_indel_homs, src->smpl_indel_homs, nsmpl);
+        for (i=0; i<nsmpl; i++) dst->smpl_dp[i] += src->smpl_dp[i];
+        if ( dst->smpl_frm_shifts ) merge_ints(dst->smpl_frm_shifts, src->smpl_frm_shifts, nsmpl*3);
+    }
+    merge_uint64s(dst->dp.vals, src->dp.vals, dst->dp.m_vals);
+    merge_uint64s(dst->dp_sites.vals, src->dp_sites.vals, dst->dp_sites.m_vals);
+    for (i=0; i<dst->nusr; i++)
+    {
+        merge_uint64s(dst->usr[i].vals_ts, src->usr[i].vals_ts, dst->usr[i].nbins);
+        merge_uint64s(dst->usr[i].vals_tv, src->usr[i].vals_tv, dst->usr[i].nbins);
+    }
+}
+
+static void merge_gtcmp(gtcmp_t *dst, gtcmp_t *src, int n)
+{
+    int i, j, k;
+    for (i=0; i<n; i++)
+    {
+        for (j=0; j<5; j++)
+            for (k=0; k<5; k++) dst[i].gt2gt[j][k] += src[i].gt2gt[j][k];
+        dst[i].y  += src[i].y;
+        dst[i].yy += src[i].yy;
+        dst[i].x  += src[i].x;
+        dst[i].xx += src[i].xx;
+        dst[i].yx += src[i].yx;
+        dst[i].n  += src[i].n;
+    }
+}
+
+// Binary snapshot of the counts for --dump and --merge. The values are written
+// in the native byte order, snapshots can be merged only on the same architecture.
+#define SNAPSHOT_MAGIC      "BCFSTATS"
+#define SNAPSHOT_VERSION    1
+#define SNAPSHOT_BYTE_ORDER 0x01020304
+
+typedef struct
+{
+    FILE *fp;
+    const char *fname;
+    int write;
+}
+snapshot_t;
+
+// the parameters which determine the layout of the counts
+typedef struct
+{
+    int nfiles, nfile_smpl[2], nsmpl, nstats, split_by_id, m_af, m_qual, naf_hwe;
+    int dp_min, dp_max, dp_step, naf_bins, nusr, has_gtcmp;
+    char *fnames[2], **smpl_names, *exons_fname, *ref_fname;
+    float *af_bins;
+    user_stats_t *usr;
+}
+snapshot_cfg_t;
+
+static void snapshot_io(snapshot_t *snap, void *ptr, size_t size)
+{
+    if ( !size ) return;
+    size_t ret = snap->write ? fwrite(ptr,1,size,snap->fp) : fread(ptr,1,size,snap->fp);
+    if ( ret!=size ) error("Could not %s the snapshot %s\n", snap->write ? "write" : "read", snap->fname);
+}
+static inline void snapshot_io_int(snapshot_t *snap, int *val)
+{
+    snapshot_io(snap, val, sizeof(int));
+}
+static void snapshot_io_str(snapshot_t *snap, char **str)
+{
+    int len = snap->write && *str ? strlen(*str) : -1;
+    snapshot_io_int(snap, &len);
+    if ( snap->write )
+    {
+        if ( len>0 ) snapshot_io(snap, *str, len);
+        return;
+    }
+    if ( len<0 ) { *str = NULL; return; }
+    *str = (char*) malloc(len+1);
+    snapshot_io(snap, *str, len);
+    (*str)[len] = 0;
+}
+static void snapshot_io_gtcmp(snapshot_t *snap, args_t *args)
+{
+    if ( snap->write )
+    {
+        snapshot_io(snap, args->af_gts_snps, sizeof(gtcmp_t)*args->m_af);
+        snapshot_io(snap, args->af_gts_indels, sizeof(gtcmp_t)*args->m_af);
+        snapshot_io(snap, args->smpl_gts_snps, sizeof(gtcmp_t)*args->nsmpl);
+        snapshot_io(snap, args->smpl_gts_indels, sizeof(gtcmp_t)*args->nsmpl);
+        return;
+    }
+    int n = args->m_af > args->nsmpl ? args->m_af : args->nsmpl;
+    gtcmp_t *tmp = (gtcmp_t*) malloc(sizeof(gtcmp_t)*n);
+    snapshot_io(snap, tmp, sizeof(gtcmp_t)*args->m_af); merge_gtcmp(args->af_gts_snps, tmp, args->m_af);
+    snapshot_io(snap, tmp, sizeof(gtcmp_t)*args->m_af); merge_gtcmp(args->af_gts_indels, tmp, args->m_af);
+    snapshot_io(snap, tmp, sizeof(gtcmp_t)*args->nsmpl); merge_gtcmp(args->smpl_gts_snps, tmp, args->nsmpl);
+    snapshot_io(snap, tmp, sizeof(gtcmp_t)*args->nsmpl); merge_gtcmp(args->smpl_gts_indels, tmp, args->nsmpl);
+    free(tmp);
+}
+static void snapshot_io_cfg(snapshot_t *snap, snapshot_cfg_t *cfg)
+{
+    int i, *ints[] = { &cfg->nfiles, &cfg->nsmpl, &cfg->nstats, &cfg->split_by_id, &cfg->m_af, &cfg->m_qual, &cfg->naf_hwe,
+        &cfg->dp_min, &cfg->dp_max, &cfg->dp_step, &cfg->naf_bins, &cfg->nusr, &cfg->has_gtcmp };
+    for (i=0; i<sizeof(ints)/sizeof(*ints); i++) snapshot_io_int(snap, ints[i]);
+    if ( cfg->nfiles<1 || cfg->nfiles>2 || cfg->nstats<1 || cfg->nstats>3 || cfg->nsmpl<0 || cfg->naf_bins<0 || cfg->nusr<0 )
+        error("Corrupted snapshot: %s\n", snap->fname);
+    for (i=0; i<cfg->nfiles; i++)
+    {
+        snapshot_io_int(snap, &cfg->nfile_smpl[i]);
+        snapshot_io_str(snap, &cfg->fnames[i]);
+    }
+    snapshot_io_str(snap, &cfg->exons_fname);
+    snapshot_io_str(snap, &cfg->ref_fname);
+    if ( !snap->write )
+    {
+        cfg->smpl_names = (char**) calloc(cfg->nsmpl, sizeof(char*));
+        cfg->af_bins = (float*) malloc(sizeof(float)*cfg->naf_bins);
+        cfg->usr = (user_stats_t*) calloc(cfg->nusr, sizeof(user_stats_t));
+    }
+    for (i=0; i<cfg->nsmpl; i++) snapshot_io_str(snap, &cfg->smpl_names[i]);
+    snapshot_io(snap, cfg->af_bins, sizeof(float)*cfg->naf_bins);
+    for (i=0; i<cfg->nusr; i++)
+    {
+        user_stats_t *usr = &cfg->usr[i];
+        snapshot_io_str(snap, &usr->tag);
+        snapshot_io(snap, &usr->min, sizeof(usr->min));
+        snapshot_io(snap, &usr->max, sizeof(usr->max));
+        snapshot_io_int(snap, &usr->nbins);
+        snapshot_io_int(snap, &usr->type);
+    }
+}
+static void snapshot_io_stats(snapshot_t *snap, args_t *args, stats_t *stats)
+{
+    int i, *ints[] = { &stats->n_snps, &stats->n_indels, &stats->n_mnps, &stats->n_others, &stats->n_mals, &stats->n_snp_mals,
+        &stats->n_records, &stats->n_noalts, &stats->ts_alt1, &stats->tv_alt1, &stats->in_frame, &stats->out_frame,
+        &stats->na_frame, &stats->in_frame_alt1, &stats->out_frame_alt1, &stats->na_frame_alt1 };
+    for (i=0; i<sizeof(ints)/sizeof(*ints); i++) snapshot_io_int(snap, ints[i]);
+
+    int m_indel = stats->m_indel;
+    snapshot_io_int(snap, &m_indel);
+    if ( m_indel!=stats->m_indel ) error("Corrupted snapshot: %s\n", snap->fname);
+
+    snapshot_io(snap, stats->subst, sizeof(stats->subst));
+    snapshot_io(snap, stats->af_ts, sizeof(int)*args->m_af);
+    snapshot_io(snap, stats->af_tv, sizeof(int)*args->m_af);
+    snapshot_io(snap, stats->af_snps, sizeof(int)*args->m_af);
+    snapshot_io(snap, stats->insertions, sizeof(int)*stats->m_indel);
+    snapshot_io(snap, stats->deletions, sizeof(int)*stats->m_indel);
+    #if HWE_STATS
+        if ( stats->af_hwe ) snapshot_io(snap, stats->af_hwe, sizeof(int)*args->m_af*args->naf_hwe);
+    #endif
+    #if IRC_STATS
+        snapshot_io(snap, stats->n_repeat, sizeof(stats->n_repeat));
+        snapshot_io_int(snap, &stats->n_repeat_na);
+        for (i=0; i<3; i++) snapshot_io(snap, stats->af_repeats[i], sizeof(int)*args->m_af);
+    #endif
+    #if QUAL_STATS
+        snapshot_io(snap, stats->qual_ts, sizeof(int)*args->m_qual);
+        snapshot_io(snap, stats->qual_tv, sizeof(int)*args->m_qual);
+        snapshot_io(snap, stats->qual_snps, sizeof(int)*args->m_qual);
+        snapshot_io(snap, stats->qual_indels, sizeof(int)*args->m_qual);
+    #endif
+    if ( args->nsmpl )
+    {
+        int n = sizeof(int)*args->nsmpl;
+        snapshot_io(snap, stats->smpl_hets, n);
+        snapshot_io(snap, stats->smpl_homRR, n);
+        snapshot_io(snap, stats->smpl_homAA, n);
+        snapshot_io(snap, stats->smpl_ts, n);
+        snapshot_io(snap, stats->smpl_tv, n);
+        snapshot_io(snap, stats->smpl_indels, n);
+        snapshot_io(snap, stats->smpl_ndp, n);
+        snapshot_io(snap, stats->smpl_sngl, n);
+        snapshot_io(snap, stats->smpl_indel_hets, n);
+        snapshot_io(snap, stats->smpl_indel_homs, n);
+        snapshot_io(snap, stats->smpl_dp, sizeof(*stats->smpl_dp)*args->nsmpl);
+        if ( stats->smpl_frm_shifts ) snapshot_io(snap, stats->smpl_frm_shifts, n*3);
+    }
+    snapshot_io(snap, stats->dp.vals, sizeof(uint64_t)*stats->dp.m_vals);
+    snapshot_io(snap, stats->dp_sites.vals, sizeof(uint64_t)*stats->dp_sites.m_vals);
+    for (i=0; i<stats->nusr; i++)
+    {
+        snapshot_io(snap, stats->usr[i].vals_ts, sizeof(uint64_t)*stats->usr[i].nbins);
+        snapshot_io(snap, stats->usr[i].vals_tv, sizeof(uint64_t)*stats->usr[i].nbins);
+    }
+}
+
+static void dump_stats(args_t *args)
+{
+    snapshot_t snap = { fopen(args->dump_fname,"wb"), args->dump_fname, 1 };
+    if ( !snap.fp ) error("Failed to open %s\n", args->dump_fname);
+
+    char magic[] = SNAPSHOT_MAGIC;
+    int i, version = SNAPSHOT_VERSION, order = SNAPSHOT_BYTE_ORDER;
+    snapshot_io(&snap, magic, 8);
+    snapshot_io_int(&snap, &version);
+    snapshot_io_int(&snap, &order);
+
+    snapshot_cfg_t cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.nfiles  = args->nfiles;
+    for (i=0; i<args->nfiles; i++)
+    {
+        cfg.fnames[i] = args->fnames[i];
+        cfg.nfile_smpl[i] = args->nfile_smpl[i];
+    }
+    cfg.nsmpl   = args->nsmpl;
+    cfg.smpl_names = args->smpl_names;
+    cfg.nstats  = args->nstats;
+    cfg.split_by_id = args->split_by_id;
+    cfg.m_af    = args->m_af;
+    cfg.m_qual  = args->m_qual;
+    cfg.naf_hwe = args->naf_hwe;
+    cfg.dp_min  = args->dp_min;
+    cfg.dp_max  = args->dp_max;
+    cfg.dp_step = args->dp_step;
+    cfg.exons_fname = args->exons_fname;
+    cfg.ref_fname   = args->ref_fname;
+    cfg.nusr = args->nusr;
+    cfg.usr  = args->usr;
+    cfg.has_gtcmp = args->af_gts_snps ? 1 : 0;
+    if ( args->af_bins )
+    {
+        cfg.naf_bins = bin_get_size(args->af_bins);
+        cfg.af_bins  = (float*) malloc(sizeof(float)*cfg.naf_bins);
+        for (i=0; i<cfg.naf_bins; i++) cfg.af_bins[i] = bin_get_value(args->af_bins,i);
+    }
+    snapshot_io_cfg(&snap, &cfg);
+    free(cfg.af_bins);
+
+    for (i=0; i<args->nstats; i++)
+        snapshot_io_stats(&snap, args, &args->stats[i]);
+    if ( args->af_gts_snps ) snapshot_io_gtcmp(&snap, args);
+
+    if ( fclose(snap.fp)!=0 ) error("Failed to close %s\n", args->dump_fname);
+}
+
+// the first snapshot with --merge, set up args as init_stats() would
+static void snapshot_init_args(args_t *args, snapshot_cfg_t *cfg)
+{
+    int i;
+    args->nfiles = cfg->nfiles;
+    for (i=0; i<cfg->nfiles; i++)
+    {
+        args->fnames[i] = cfg->fnames[i];
+        args->nfile_smpl[i] = cfg->nfile_smpl[i];
+    }
+    args->nsmpl       = cfg->nsmpl;
+    args->smpl_names  = cfg->smpl_names;
+    args->nstats      = cfg->nstats;
+    args->split_by_id = cfg->split_by_id;
+    args->m_af    = cfg->m_af;
+    args->m_qual  = cfg->m_qual;
+    args->naf_hwe = cfg->naf_hwe;
+    args->dp_min  = cfg->dp_min;
+    args->dp_max  = cfg->dp_max;
+    args->dp_step = cfg->dp_step;
+    args->exons_fname = cfg->exons_fname;
+    args->ref_fname   = cfg->ref_fname;
+    args->nusr = cfg->nusr;
+    args->usr  = cfg->usr;
+    if ( cfg->naf_bins )
+    {
+        kstring_t str = {0,0,0};
+        for (i=0; i<cfg->naf_bins; i++) ksprintf(&str, "%s%.9g", i ? "," : "", cfg->af_bins[i]);
+        args->af_bins = bin_init(str.s,0,1);
+        free(str.s);
+    }
+    free(cfg->af_bins);
+    if ( cfg->has_gtcmp )
+    {
+        args->af_gts_snps     = (gtcmp_t *) calloc(args->m_af,sizeof(gtcmp_t));
+        args->af_gts_indels   = (gtcmp_t *) calloc(args->m_af,sizeof(gtcmp_t));
+        args->smpl_gts_snps   = (gtcmp_t *) calloc(args->nsmpl,sizeof(gtcmp_t));
+        args->smpl_gts_indels = (gtcmp_t *) calloc(args->nsmpl,sizeof(gtcmp_t));
+    }
+    for (i=0; i<args->nstats; i++)
+        init_stats1(args, &args->stats[i], NULL);
+    init_gt_types();
+}
+
+static void snapshot_check_cfg(args_t *args, snapshot_cfg_t *cfg, const char *fname)
+{
+    #define CHECK(cond,what) if ( !(cond) ) error("The snapshot %s is not compatible with the first one, different %s\n", fname, what)
+    int i;
+    CHECK(cfg->nfiles==args->nfiles && cfg->nstats==args->nstats && cfg->split_by_id==args->split_by_id, "number of input files");
+    CHECK(cfg->m_af==args->m_af && cfg->naf_hwe==args->naf_hwe, "allele frequency bins");
+    CHECK(cfg->m_qual==args->m_qual, "quality bins");
+    CHECK(cfg->dp_min==args->dp_min && cfg->dp_max==args->dp_max && cfg->dp_step==args->dp_step, "--depth");
+    CHECK(!cfg->exons_fname==!args->exons_fname, "--exons");
+    CHECK(!cfg->ref_fname==!args->ref_fname, "--fasta-ref");
+    CHECK(cfg->has_gtcmp==(args->af_gts_snps ? 1 : 0), "--samples");
+    CHECK(cfg->naf_bins==(args->af_bins ? bin_get_size(args->af_bins) : 0), "--af-bins");
+    for (i=0; i<cfg->naf_bins; i++)
+        CHECK(cfg->af_bins[i]==bin_get_value(args->af_bins,i), "--af-bins");
+    CHECK(cfg->nsmpl==args->nsmpl, "samples");
+    for (i=0; i<cfg->nsmpl; i++)
+        CHECK(!strcmp(cfg->smpl_names[i],args->smpl_names[i]), "samples");
+    CHECK(cfg->nusr==args->nusr, "--user-tstv");
+    for (i=0; i<cfg->nusr; i++)
+        CHECK(!strcmp(cfg->usr[i].tag,args->usr[i].tag) && cfg->usr[i].min==args->usr[i].min && cfg->usr[i].max==args->usr[i].max
+            && cfg->usr[i].nbins==args->usr[i].nbins, "--user-tstv");
+    #undef CHECK
+
+    for (i=0; i<cfg->nfiles; i++) free(cfg->fnames[i]);
+    for (i=0; i<cfg->nsmpl; i++) free(cfg->smpl_names[i]);
+    for (i=0; i<cfg->nusr; i++) free(cfg->usr[i].tag);
+    free(cfg->smpl_names);
+    free(cfg->af_bins);
+    free(cfg->usr);
+    free(cfg->exons_fname);
+    free(cfg->ref_fname);
+}
+
+// add the counts from a snapshot created with --dump
+static void read_snapshot(args_t *args, const char *fname)
+{
+    snapshot_t snap = { fopen(fname,"rb"), fname, 0 };
+    if ( !snap.fp ) error("Failed to open %s\n", fname);
+
+    char magic[8];
+    int i, version, order;
+    snapshot_io(&snap, magic, 8);
+    if ( memcmp(magic,SNAPSHOT_MAGIC,8) ) error("Not a bcftools stats snapshot: %s\n", fname);
+    snapshot_io_int(&snap, &version);
+    if ( version!=SNAPSHOT_VERSION ) error("Unsupported version of the snapshot %s: %d\n", fname, version);
+    snapshot_io_int(&snap, &order);
+    if ( order!=SNAPSHOT_BYTE_ORDER ) error("The snapshot %s was created on a machine with different byte order\n", fname);
+
+    snapshot_cfg_t cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    snapshot_io_cfg(&snap, &cfg);
+    if ( !args->nstats )
+        snapshot_init_args(args, &cfg);
+    else
+        snapshot_check_cfg(args, &cfg, fname);
+
+    for (i=0; i<args->nstats; i++)
+    {
+        stats_t tmp;
+        memset(&tmp, 0, sizeof(tmp));
+        init_stats1(args, &tmp, NULL);
+        snapshot_io_stats(&snap, args, &tmp);
+        merge_stats(args, &args->stats[i], &tmp);
+        destroy_stats1(args, &tmp);
+    }
+    if ( args->af_gts_snps ) snapshot_io_gtcmp(&snap, args);
+    if ( fgetc(snap.fp)!=EOF ) error("Corrupted snapshot: %s\n", fname);
+    fclose(snap.fp);
 }
 
 static void init_iaf(args_t *args, bcf_sr_t *reader)
@@ -849,10 +1351,20 @@ static void do_sample_stats(args_t *args, stats_t *stats, bcf_sr_t *reader, int
     {
         int ref = bcf_acgt2int(*line->d.allele[0]);
         int is, n_nref = 0, i_nref = 0;
+        int is_gt8 = fmt_ptr->type==BCF_BT_INT8 && fmt_ptr->n==2 ? 1 : 0;   // the common diploid case, use the lookup table
         for (is=0; is<args->files->n_smpl; is++)
         {
-            int ial, jal;
-            int gt = bcf_gt_type(fmt_ptr, reader->samples[is], &ial, &jal);
+            int ial, jal, gt;
+            if ( is_gt8 )
+            {
+                uint8_t *p = fmt_ptr->p + fmt_ptr->size*reader->samples[is];
+                gt8_t *gt8 = &args->gt8[p[0]<<8 | p[1]];
+                gt  = gt8->type;
+                ial = gt8->ial;
+                jal = gt8->jal;
+            }
+            else
+                gt = bcf_gt_type(fmt_ptr, reader->samples[is], &ial, &jal);
             if ( gt==GT_UNKN ) continue;
             if ( gt==GT_HAPL_R || gt==GT_HAPL_A )
             {
@@ -1017,6 +1529,163 @@ static void do_sample_stats(args_t *args, stats_t *stats, bcf_sr_t *reader, int
     }
 }
 
+static void do_record_stats(args_t *args, bcf_sr_t *reader, bcf1_t *line, int ret)
+{
+    int line_type = bcf_get_variant_types(line);
+    init_iaf(args, reader);
+
+    stats_t *stats = &args->stats[ret-1];
+    if ( args->split_by_id && line->d.id[0]=='.' && !line->d.id[1] )
+        stats = &args->stats[1];
+
+    stats->n_records++;
+
+    if ( line_type==VCF_REF )
+        stats->n_noalts++;
+    if ( line_type&VCF_SNP )
+        do_snp_stats(args, stats, reader);
+    if ( line_type&VCF_INDEL )
+        do_indel_stats(args, stats, reader);
+    if ( line_type&VCF_MNP )
+        do_mnp_stats(args, stats, reader);
+    if ( line_type&VCF_OTHER )
+        do_other_stats(args, stats, reader);
+
+    if ( line->n_allele>2 )
+    {
+        stats->n_mals++;
+        if ( line_type == VCF_SNP ) stats->n_snp_mals++;
+    }
+
+    if ( args->files->n_smpl )
+        do_sample_stats(args, stats, reader, ret);
+
+    if ( bcf_get_info_int32(reader->header,line,"DP",&args->tmp_iaf,&args->ntmp_iaf)==1 )
+        (*idist(&stats->dp_sites, args->tmp_iaf[0]))++;
+}
+
+static void *process_batch(void *arg)
+{
+    batch_t *batch = (batch_t*) arg;
+    args_t *args = &batch->args;
+    bcf_srs_t *files = args->files;
+
+    // a private reader so that the stats functions see the batch record as reader->buffer[0]
+    bcf_sr_t reader = files->readers[0];
+    int i;
+    for (i=0; i<batch->nlines; i++)
+    {
+        bcf1_t *line = batch->lines[i];
+        bcf_unpack(line, files->max_unpack);
+        if ( args->filter[0] )
+        {
+            int is_ok = filter_test(args->filter[0], line, NULL);
+            if ( args->filter_logic & FLT_EXCLUDE ) is_ok = is_ok ? 0 : 1;
+            if ( !is_ok ) continue;
+        }
+        reader.buffer = &line;
+        do_record_stats(args, &reader, line, 1);
+    }
+    return batch;
+}
+
+static void dispatch_batch(args_t *args, int ibatch)
+{
+    batch_t *batch = &args->batches[ibatch];
+    if ( hts_tpool_dispatch(args->files->p->pool, args->tpool_q, process_batch, batch) < 0 )
+        error("Could not dispatch a batch of records\n");
+    args->nbusy++;
+}
+
+static void wait_for_batch(args_t *args)
+{
+    hts_tpool_result *res = hts_tpool_next_result_wait(args->tpool_q);
+    if ( !res ) error("Failed to process a batch of records\n");
+    batch_t *batch = (batch_t*) hts_tpool_result_data(res);
+    hts_tpool_delete_result(res, 0);
+    batch->nlines = 0;
+    args->nbusy--;
+}
+
+static void add_to_batch(args_t *args, bcf1_t *line)
+{
+    batch_t *batch = &args->batches[args->ibatch];
+    bcf_copy(batch->lines[batch->nlines++], line);
+    if ( batch->nlines < BATCH_SIZE ) return;
+
+    // The results come in the order of dispatching, so when all batches are
+    // busy, the one waited for is the oldest, which is also the next to fill
+    dispatch_batch(args, args->ibatch);
+    args->ibatch = (args->ibatch + 1) % args->nbatches;
+    if ( args->nbusy == args->nbatches ) wait_for_batch(args);
+}
+
+static void flush_batches(args_t *args)
+{
+    if ( args->batches[args->ibatch].nlines ) dispatch_batch(args, args->ibatch);
+    while ( args->nbusy ) wait_for_batch(args);
+}
+
+static void init_batches(args_t *args)
+{
+    args->nbatches = 2*args->n_threads;
+    args->batches  = (batch_t*) calloc(args->nbatches, sizeof(batch_t));
+    args->tpool_q  = hts_tpool_process_init(args->files->p->pool, args->nbatches, 0);
+    if ( !args->tpool_q ) error("Failed to initialize the thread pool queue\n");
+
+    bcf_hdr_t *hdr = bcf_sr_get_header(args->files,0);
+    int i, j;
+    for (i=0; i<args->nbatches; i++)
+    {
+        batch_t *batch = &args->batches[i];
+        batch->lines = (bcf1_t**) malloc(sizeof(bcf1_t*)*BATCH_SIZE);
+        for (j=0; j<BATCH_SIZE; j++) batch->lines[j] = bcf_init();
+
+        args_t *bargs = &batch->args;
+        memcpy(bargs, args, sizeof(args_t));
+        bargs->tmp_iaf = NULL; bargs->ntmp_iaf = 0;
+        bargs->tmp_frm = NULL; bargs->mtmp_frm = 0;
+        bargs->farr    = NULL; bargs->mfarr    = 0;
+        bargs->batches = NULL;
+        for (j=0; j<args->nstats; j++)
+        {
+            memset(&bargs->stats[j], 0, sizeof(stats_t));
+            init_stats1(args, &bargs->stats[j], hdr);
+        }
+        if ( args->filter_str ) bargs->filter[0] = filter_init(hdr, args->filter_str);
+        if ( args->exons_fname ) bargs->exons = init_exons(args);
+        #if IRC_STATS
+        if ( args->ref_fname ) bargs->indel_ctx = indel_ctx_init(args->ref_fname);
+        #endif
+    }
+}
+
+static void destroy_batches(args_t *args)
+{
+    int i, j;
+    for (i=0; i<args->nbatches; i++)
+    {
+        batch_t *batch = &args->batches[i];
+        args_t *bargs = &batch->args;
+        for (j=0; j<args->nstats; j++)
+        {
+            merge_stats(args, &args->stats[j], &bargs->stats[j]);
+            destroy_stats1(bargs, &bargs->stats[j]);
+        }
+        for (j=0; j<BATCH_SIZE; j++) bcf_destroy(batch->lines[j]);
+        free(batch->lines);
+        free(bargs->tmp_iaf);
+        free(bargs->tmp_frm);
+        free(bargs->farr);
+        if ( bargs->filter[0] ) filter_destroy(bargs->filter[0]);
+        if ( bargs->exons ) bcf_sr_regions_destroy(bargs->exons);
+        if ( bargs->indel_ctx ) indel_ctx_destroy(bargs->indel_ctx);
+    }
+    hts_tpool_process_destroy(args->tpool_q);
+    free(args->batches);
+    args->batches = NULL;
+}
+
 static void do_vcf_stats(args_t *args)
 {
     bcf_srs_t *files = args->files;
@@ -1029,7 +1698,7 @@ static void do_vcf_stats(args_t *args)
         for (i=0; i<files->nreaders; i++)
         {
             if ( !bcf_sr_has_line(files,i) ) continue;
-            if ( args->filter[i] )
+            if ( args->filter[i] && !args->batches )    // with batches the filtering is done by the workers
             {
                 int is_ok = filter_test(args->filter[i], bcf_sr_get_line(files,i), NULL);
                 if ( args->filter_logic & FLT_EXCLUDE ) is_ok = is_ok ? 0 : 1;
@@ -1045,37 +1714,15 @@ static void do_vcf_stats(args_t *args)
         }
         if ( !pass ) continue;
 
-        int line_type = bcf_get_variant_types(line);
-        init_iaf(args, reader);
-
-        stats_t *stats = &args->stats[ret-1];
-        if ( args->split_by_id && line->d.id[0]=='.' && !line->d.id[1] )
-            stats = &args->stats[1];
-
-        stats->n_records++;
-
-        if ( line_type==VCF_REF )
-            stats->n_noalts++;
-        if ( line_type&VCF_SNP )
-            do_snp_stats(args, stats, reader);
-        if ( line_type&VCF_INDEL )
-            do_indel_stats(args, stats, reader);
-        if ( line_type&VCF_MNP )
-            do_mnp_stats(args, stats, reader);
-        if ( line_type&VCF_OTHER )
-            do_other_stats(args, stats, reader);
-
-        if ( line->n_allele>2 )
-        {
-            stats->n_mals++;
-            if ( line_type == VCF_SNP ) stats->n_snp_mals++;
-        }
-
-        if ( files->n_smpl )
-            do_sample_stats(args, stats, reader, ret);
-
-        if ( bcf_get_info_int32(reader->header,line,"DP",&args->tmp_iaf,&args->ntmp_iaf)==1 )
-            (*idist(&stats->dp_sites, args->tmp_iaf[0]))++;    
+        if ( args->batches )
+            add_to_batch(args, line);
+        else
+            do_record_stats(args, reader, line, ret);
+    }
+    if ( args->batches )
+    {
+        flush_batches(args);
+        destroy_batches(args);
     }
 }
 
@@ -1089,9 +1736,9 @@ static void print_header(args_t *args)
     printf("\n#\n");
 
     printf("# Definition of sets:\n# ID\t[2]id\t[3]tab-separated file names\n");
-    if ( args->files->nreaders==1 )
+    if ( args->nfiles==1 )
     {
-        const char *fname = strcmp("-",args->files->readers[0].fname) ? args->files->readers[0].fname : "<STDIN>";
+        const char *fname = strcmp("-",args->fnames[0]) ? args->fnames[0] : "<STDIN>";
         if ( args->split_by_id )
         {
             printf("ID\t0\t%s:known (sites with ID different from \".\")\n", fname);
@@ -1102,8 +1749,8 @@ static void print_header(args_t *args)
     }
     else
     {
-        const char *fname0 = strcmp("-",args->files->readers[0].fname) ? args->files->readers[0].fname : "<STDIN>";
-        const char *fname1 = strcmp("-",args->files->readers[1].fname) ? args->files->readers[1].fname : "<STDIN>";
+        const char *fname0 = strcmp("-",args->fnames[0]) ? args->fnames[0] : "<STDIN>";
+        const char *fname1 = strcmp("-",args->fnames[1]) ? args->fnames[1] : "<STDIN>";
         printf("ID\t0\t%s\n", fname0);
         printf("ID\t1\t%s\n", fname1);
         printf("ID\t2\t%s\t%s\n", fname0,fname1);
@@ -1126,8 +1773,8 @@ static void print_stats(args_t *args)
 {
     int i, j,k, id;
     printf("# SN, Summary numbers:\n# SN\t[2]id\t[3]key\t[4]value\n");
-    for (id=0; id<args->files->nreaders; id++)
-        printf("SN\t%d\tnumber of samples:\t%d\n", id, bcf_hdr_nsamples(args->files->readers[id].header));
+    for (id=0; id<args->nfiles; id++)
+        printf("SN\t%d\tnumber of samples:\t%d\n", id, args->nfile_smpl[id]);
     for (id=0; id<args->nstats; id++)
     {
         stats_t *stats = &args->stats[id];
@@ -1158,7 +1805,7 @@ static void print_stats(args_t *args)
             printf("FS\t%d\t%d\t%d\t%d\t%.2f\t%d\t%d\t%d\t%.2f\n", id, in,out,na,out?(float)out/(in+out):0,in1,out1,na1,out1?(float)out1/(in1+out1):0);
         }
     }
-    if ( args->indel_ctx )
+    if ( args->ref_fname )
     {
         printf("# ICS, Indel context summary:\n# ICS\t[2]id\t[3]repeat-consistent\t[4]repeat-inconsistent\t[5]not applicable\t[6]c/(c+i) ratio\n");
         for (id=0; id<args->nstats; id++)
@@ -1275,9 +1922,9 @@ static void print_stats(args_t *args)
             printf("ST\t%d\t%c>%c\t%d\n", id, bcf_int2acgt(t>>2),bcf_int2acgt(t&3),args->stats[id].subst[t]);
         }
     }
-    if ( args->files->nreaders>1 && args->files->n_smpl )
+    if ( args->nfiles>1 && args->nsmpl )
     {
-        printf("SN\t%d\tnumber of samples:\t%d\n", 2, args->files->n_smpl);
+        printf("SN\t%d\tnumber of samples:\t%d\n", 2, args->nsmpl);
 
         int x;
         for (x=0; x<2; x++)     // x=0: snps, x=1: indels
@@ -1368,7 +2015,7 @@ static void print_stats(args_t *args)
                 printf("# GCiS, Genotype concordance by sample (indels)\n# GCiS\t[2]id\t[3]sample\t[4]non-reference discordance rate\t[5]RR Hom matches\t[6]RA Het matches\t[7]AA Hom matches\t[8]RR Hom mismatches\t[9]RA Het mismatches\t[10]AA Hom mismatches\t[11]dosage r-squared\n");
                 stats = args->smpl_gts_indels;
             }
-            for (i=0; i<args->files->n_smpl; i++)
+            for (i=0; i<args->nsmpl; i++)
             {
                 uint64_t mm = 0, m = stats[i].gt2gt[T2S(GT_HET_RA)][T2S(GT_HET_RA)] + stats[i].gt2gt[T2S(GT_HOM_AA)][T2S(GT_HOM_AA)];
                 for (j=0; j<3; j++)
@@ -1383,7 +2030,7 @@ static void print_stats(args_t *args)
                     r2 /= sqrt((stats[i].xx - stats[i].x*stats[i].x/stats[i].n) * (stats[i].yy - stats[i].y*stats[i].y/stats[i].n));
                     r2 *= r2;
                 }
-                printf("GC%cS\t2\t%s\t%.3f",  x==0 ? 's' : 'i', args->files->samples[i], m+mm ? mm*100.0/(m+mm) : 0);
+                printf("GC%cS\t2\t%s\t%.3f",  x==0 ? 's' : 'i', args->smpl_names[i], m+mm ? mm*100.0/(m+mm) : 0);
                 printf("\t%"PRId64"\t%"PRId64"\t%"PRId64"", 
                     stats[i].gt2gt[T2S(GT_HOM_RR)][T2S(GT_HOM_RR)],
                     stats[i].gt2gt[T2S(GT_HET_RA)][T2S(GT_HET_RA)],
@@ -1439,9 +2086,9 @@ static void print_stats(args_t *args)
             printf("\t[%d]missing -> AA Het", ++i);
             printf("\t[%d]missing -> missing\n", ++i);
 
-            for (i=0; i<args->files->n_smpl; i++)
+            for (i=0; i<args->nsmpl; i++)
             {
-                printf("GCT%c\t%s",  x==0 ? 's' : 'i', args->files->samples[i]);
+                printf("GCT%c\t%s",  x==0 ? 's' : 'i', args->smpl_names[i]);
                 for (j=0; j<5; j++)
                     for (k=0; k<5; k++)
                         printf("\t%"PRId64, stats[i].gt2gt[j][k]);
@@ -1468,16 +2115,16 @@ static void print_stats(args_t *args)
         }
     }
 
-    if ( args->files->n_smpl )
+    if ( args->nsmpl )
     {
         printf("# PSC, Per-sample counts\n# PSC\t[2]id\t[3]sample\t[4]nRefHom\t[5]nNonRefHom\t[6]nHets\t[7]nTransitions\t[8]nTransversions\t[9]nIndels\t[10]average depth\t[11]nSingletons\n");
         for (id=0; id<args->nstats; id++)
         {
             stats_t *stats = &args->stats[id];
-            for (i=0; i<args->files->n_smpl; i++)
+            for (i=0; i<args->nsmpl; i++)
             {
                 float dp = stats->smpl_ndp[i] ? stats->smpl_dp[i]/(float)stats->smpl_ndp[i] : 0;
-                printf("PSC\t%d\t%s\t%d\t%d\t%d\t%d\t%d\t%d\t%.1f\t%d\n", id,args->files->samples[i],
+                printf("PSC\t%d\t%s\t%d\t%d\t%d\t%d\t%d\t%d\t%.1f\t%d\n", id,args->smpl_names[i],
                     stats->smpl_homRR[i], stats->smpl_homAA[i], stats->smpl_hets[i], stats->smpl_ts[i],
                     stats->smpl_tv[i], stats->smpl_indels[i],dp, stats->smpl_sngl[i]);
             }
@@ -1488,10 +2135,10 @@ static void print_stats(args_t *args)
         for (id=0; id<args->nstats; id++)
         {
             stats_t *stats = &args->stats[id];
-            for (i=0; i<args->files->n_smpl; i++)
+            for (i=0; i<args->nsmpl; i++)
             {
                 int na = 0, in = 0, out = 0;
-                if ( args->exons )
+                if ( args->exons_fname )
                 {
                     na  = stats->smpl_frm_shifts[i*3 + 0];
                     in  = stats->smpl_frm_shifts[i*3 + 1];
@@ -1499,7 +2146,7 @@ static void print_stats(args_t *args)
                 }
                 int nhom = stats->smpl_indel_homs[i];
                 int nhet = stats->smpl_indel_hets[i];
-                printf("PSI\t%d\t%s\t%d\t%d\t%d\t%.2f\t%d\t%d\n", id,args->files->samples[i], in,out,na,in+out?1.0*out/(in+out):0,nhet,nhom);
+                printf("PSI\t%d\t%s\t%d\t%d\t%d\t%.2f\t%d\t%d\n", id,args->smpl_names[i], in,out,na,in+out?1.0*out/(in+out):0,nhet,nhom);
             }
         }
 
@@ -1555,6 +2202,7 @@ static void usage(void)
     fprintf(stderr, "         and the complements. By default only sites are compared, -s/-S must given to include\n");
     fprintf(stderr, "         also sample columns.\n");
     fprintf(stderr, "Usage:   bcftools stats [options] <A.vcf.gz> [<B.vcf.gz>]\n");
+    fprintf(stderr, "         bcftools stats --merge [--dump <file>] <snapshot1> [...]\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "        --af-bins <list>               allele frequency bins, a list (0.1,0.5,1) or a file (0.1\\n0.5\\n1)\n");
@@ -1562,12 +2210,14 @@ static void usage(void)
     fprintf(stderr, "    -1, --1st-allele-only              include only 1st allele at multiallelic sites\n");
     fprintf(stderr, "    -c, --collapse <string>            treat as identical records with <snps|indels|both|all|some|none>, see man page for details [none]\n");
     fprintf(stderr, "    -d, --depth <int,int,int>          depth distribution: min,max,bin size [0,500,1]\n");
+    fprintf(stderr, "        --dump <file>                  save a binary snapshot of the stats which can be combined with --merge\n");
     fprintf(stderr, "    -e, --exclude <expr>               exclude sites for which the expression is true (see man page for details)\n");
     fprintf(stderr, "    -E, --exons <file.gz>              tab-delimited file with exons for indel frameshifts (chr,from,to; 1-based, inclusive, bgzip compressed)\n");
     fprintf(stderr, "    -f, --apply-filters <list>         require at least one of the listed FILTER strings (e.g. \"PASS,.\")\n");
     fprintf(stderr, "    -F, --fasta-ref <file>             faidx indexed reference sequence file to determine INDEL context\n");
     fprintf(stderr, "    -i, --include <expr>               select sites for which the expression is true (see man page for details)\n");
     fprintf(stderr, "    -I, --split-by-ID                  collect stats for sites with ID separately (known vs novel)\n");
+    fprintf(stderr, "        --merge                        sum the snapshots created by --dump and print the stats\n");
     fprintf(stderr, "    -r, --regions <region>             restrict to comma-separated list of regions\n");
     fprintf(stderr, "    -R, --regions-file <file>          restrict to regions listed in a file\n");
     fprintf(stderr, "    -s, --samples <list>               list of samples for sample stats, \"-\" to include all samples\n");
@@ -1575,7 +2225,7 @@ static void usage(void)
     fprintf(stderr, "    -t, --targets <region>             similar to -r but streams rather than index-jumps\n");
     fprintf(stderr, "    -T, --targets-file <file>          similar to -R but streams rather than index-jumps\n");
     fprintf(stderr, "    -u, --user-tstv <TAG[:min:max:n]>  collect Ts/Tv stats for any tag using the given binning [0:1:100]\n");
-    fprintf(stderr, "        --threads <int>                number of extra decompression threads [0]\n");
+    fprintf(stderr, "        --threads <int>                number of extra decompression and record processing threads [0]\n");
     fprintf(stderr, "    -v, --verbose                      produce verbose per-site and per-sample output\n");
     fprintf(stderr, "\n");
     exit(1);
@@ -1613,6 +2263,8 @@ int main_vcfstats(int argc, char *argv[])
         {"fasta-ref",1,0,'F'},
         {"user-tstv",1,0,'u'},
         {"threads",1,0,9},
+        {"dump",1,0,3},
+        {"merge",0,0,4},
         {0,0,0,0}
     };
     while ((c = getopt_long(argc, argv, "hc:r:R:e:s:S:d:i:t:T:F:f:1u:vIE:",loptions,NULL)) >= 0) {
@@ -1651,11 +2303,27 @@ int main_vcfstats(int argc, char *argv[])
             case 'e': args->filter_str = optarg; args->filter_logic |= FLT_EXCLUDE; break;
             case 'i': args->filter_str = optarg; args->filter_logic |= FLT_INCLUDE; break;
             case  9 : args->n_threads = strtol(optarg, 0, 0); break;
+            case  3 : args->dump_fname = optarg; break;
+            case  4 : args->merge = 1; break;
             case 'h':
             case '?': usage();
             default: error("Unknown argument: %s\n", optarg);
         }
     }
+    if ( args->merge )
+    {
+        // sum the snapshots given on the command line, optionally into a new snapshot
+        if ( optind==argc ) usage();
+        for (; optind<argc; optind++) read_snapshot(args, argv[optind]);
+        if ( args->dump_fname ) dump_stats(args);
+        print_header(args);
+        print_stats(args);
+        destroy_stats(args);
+        bcf_sr_destroy(args->files);
+        free(args);
+        return 0;
+    }
+
     char *fname = NULL;
     if ( optind==argc )
     {
@@ -1686,8 +2354,10 @@ int main_vcfstats(int argc, char *argv[])
     }
 
     init_stats(args);
+    if ( args->n_threads && args->files->nreaders==1 ) init_batches(args);
     print_header(args);
     do_vcf_stats(args);
+    if ( args->dump_fname ) dump_stats(args);
     print_stats(args);
     destroy_stats(args);
     bcf_sr_destroy(args->files);
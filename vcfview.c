@@ -23,6 +23,7 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.  */
 
 #include <stdio.h>
+#include <inttypes.h>
 #include <strings.h>
 #include <unistd.h>
 #include <getopt.h>
@@ -35,8 +36,11 @@ THE SOFTWARE.  */
 #include <htslib/vcf.h>
 #include <htslib/synced_bcf_reader.h>
 #include <htslib/vcfutils.h>
+#include <htslib/thread_pool.h>
 #include "bcftools.h"
 #include "filter.h"
+#include "profile.h"
+#include "regplan.h"
 #include "htslib/khash_str2int.h"
 
 #define FLT_INCLUDE 1
@@ -55,13 +59,33 @@ THE SOFTWARE.  */
 #define GT_NEED_MISSING 5
 #define GT_NO_MISSING 6
 
-typedef struct _args_t
+// Number of records processed by a worker thread at once
+#define BATCH_SIZE 1000
+
+// With --threads, batches of records are processed by subset_vcf() in parallel.
+// Each batch has its own filter and buffers, in the single-threaded mode only
+// the first batch is used.
+typedef struct _batch_t
 {
+    struct _args_t *args;
     filter_t *filter;
+    int *ac, mac;
+    bcf1_t **lines;
+    uint8_t *pass;
+    int nlines;
+}
+batch_t;
+
+typedef struct _args_t
+{
+    batch_t *batches;
+    int nbatches, nbusy;
+    hts_tpool_process *tpool_q;
     char *filter_str;
     int filter_logic;   // one of FLT_INCLUDE/FLT_EXCLUDE (-i or -e)
 
     bcf_srs_t *files;
+    regplan_t *plan;    // set when large region lists are coalesced
     bcf_hdr_t *hdr, *hnull, *hsub; // original header, sites-only header, subset header
     char **argv, *format, *sample_names, *subset_fname, *targets_list, *regions_list;
     int argc, clevel, n_threads, output_type, print_header, update_info, header_only, n_samples, *imap, calc_ac;
@@ -74,6 +98,7 @@ typedef struct _args_t
     char *include_types, *exclude_types;
     int include, exclude;
     int record_cmd_line;
+    int filter_stats, write_index;
     htsFile *out;
 }
 args_t;
@@ -245,8 +270,32 @@ static void init_data(args_t *args)
         }
     }
 
-    if ( args->filter_str )
-        args->filter = filter_init(args->hdr, args->filter_str);
+    // two batches per thread keep the workers busy while the output is written
+    args->nbatches = args->n_threads > 0 ? 2*args->n_threads : 1;
+    args->batches  = (batch_t*) calloc(args->nbatches, sizeof(batch_t));
+    for (i=0; i<args->nbatches; i++)
+    {
+        batch_t *batch = &args->batches[i];
+        batch->args = args;
+        if ( args->filter_str )
+            batch->filter = filter_init(args->hdr, args->filter_str);
+    }
+
+    // With -G, the text VCF parser can skip the FORMAT columns unless genotypes are needed
+    // for AC/AN, trimming of alleles, phasing and genotype filters or by the expression
+    int need_fmt = args->calc_ac || args->trim_alts || args->phased || args->gt_type;
+    if ( args->batches[0].filter && filter_max_unpack(args->batches[0].filter) & BCF_UN_FMT ) need_fmt = 1;
+    if ( args->sites_only && !need_fmt ) args->files->max_unpack = BCF_UN_SHR;
+    if ( args->n_threads > 0 )
+    {
+        for (i=0; i<args->nbatches; i++)
+        {
+            args->batches[i].lines = (bcf1_t**) calloc(BATCH_SIZE, sizeof(bcf1_t*));
+            args->batches[i].pass  = (uint8_t*) malloc(BATCH_SIZE);
+        }
+        args->tpool_q = hts_tpool_process_init(args->files->p->pool, args->nbatches, 0);
+        if ( !args->tpool_q ) error("Failed to initialize the thread pool queue\n");
+    }
 }
 
 static void destroy_data(args_t *args)
@@ -260,9 +309,22 @@ static void destroy_data(args_t *args)
     }
     if (args->hnull) bcf_hdr_destroy(args->hnull);
     if (args->hsub) bcf_hdr_destroy(args->hsub);
-    if ( args->filter )
-        filter_destroy(args->filter);
-    free(args->ac);
+    if ( args->tpool_q ) hts_tpool_process_destroy(args->tpool_q);
+    for (i=0; i<args->nbatches; i++)
+    {
+        batch_t *batch = &args->batches[i];
+        if ( batch->filter ) filter_destroy(batch->filter);
+        free(batch->ac);
+        if ( batch->lines )
+        {
+            int j;
+            for (j=0; j<BATCH_SIZE; j++)
+                if ( batch->lines[j] ) bcf_destroy1(batch->lines[j]);
+            free(batch->lines);
+        }
+        free(batch->pass);
+    }
+    free(args->batches);
 }
 
 // true if all samples are phased.
@@ -308,8 +370,9 @@ int bcf_all_phased(const bcf_hdr_t *header, bcf1_t *line)
     return all_phased;
 }
 
-int subset_vcf(args_t *args, bcf1_t *line)
+static int subset_vcf(batch_t *batch, bcf1_t *line)
 {
+    args_t *args = batch->args;
     if ( args->min_alleles && line->n_allele < args->min_alleles ) return 0; // min alleles
     if ( args->max_alleles && line->n_allele > args->max_alleles ) return 0; // max alleles
     if (args->novel || args->known)
@@ -325,21 +388,24 @@ int subset_vcf(args_t *args, bcf1_t *line)
         if ( args->exclude &&   (line_type<<1) & args->exclude  ) return 0; // exclude given variant types
     }
 
-    if ( args->filter )
+    if ( batch->filter )
     {
-        int ret = filter_test(args->filter, line, NULL);
+        int ret = filter_test(batch->filter, line, NULL);
         if ( args->filter_logic==FLT_INCLUDE ) { if ( !ret ) return 0; }
         else if ( ret ) return 0;
     }
 
-    hts_expand(int, line->n_allele, args->mac, args->ac);
+    hts_expand(int, line->n_allele, batch->mac, batch->ac);
     int i, an = 0, non_ref_ac = 0;
-    if (args->calc_ac) {
-        bcf_calc_ac(args->hdr, line, args->ac, BCF_UN_INFO|BCF_UN_FMT); // get original AC and AN values from INFO field if available, otherwise calculate
+    // With sample subsetting, the counts are recalculated from the subset below. The counts
+    // over all samples are needed only to determine private sites, skip them otherwise so that
+    // the cost does not scale with the total number of samples.
+    if (args->calc_ac && (!args->n_samples || args->private_vars)) {
+        bcf_calc_ac(args->hdr, line, batch->ac, BCF_UN_INFO|BCF_UN_FMT); // get original AC and AN values from INFO field if available, otherwise calculate
         for (i=1; i<line->n_allele; i++)
-            non_ref_ac += args->ac[i];
+            non_ref_ac += batch->ac[i];
         for (i=0; i<line->n_allele; i++)
-            an += args->ac[i];
+            an += batch->ac[i];
     }
 
     if (args->n_samples)
@@ -350,7 +416,7 @@ int subset_vcf(args_t *args, bcf1_t *line)
             bcf_calc_ac(args->hsub, line, ac_sub, BCF_UN_FMT); // recalculate AC and AN
             an = 0;
             for (i=0; i<line->n_allele; i++) {
-                args->ac[i] = ac_sub[i];
+                batch->ac[i] = ac_sub[i];
                 an += ac_sub[i];
             }
             for (i=1; i<line->n_allele; i++)
@@ -396,11 +462,11 @@ int subset_vcf(args_t *args, bcf1_t *line)
     int major_ac = 0;
     if ( args->calc_ac )
     {
-        minor_ac = args->ac[0];
-        major_ac = args->ac[0];
+        minor_ac = batch->ac[0];
+        major_ac = batch->ac[0];
         for (i=1; i<line->n_allele; i++){
-            if (args->ac[i] < minor_ac) { minor_ac = args->ac[i]; }
-            if (args->ac[i] > major_ac) { major_ac = args->ac[i]; }
+            if (batch->ac[i] < minor_ac) { minor_ac = batch->ac[i]; }
+            if (batch->ac[i] > major_ac) { major_ac = batch->ac[i]; }
         }
     }
 
@@ -408,7 +474,7 @@ int subset_vcf(args_t *args, bcf1_t *line)
     {
         if (args->min_ac_type == ALLELE_NONREF && args->min_ac>non_ref_ac) return 0; // min AC
         else if (args->min_ac_type == ALLELE_MINOR && args->min_ac>minor_ac) return 0; // min minor AC
-        else if (args->min_ac_type == ALLELE_ALT1 && args->min_ac>args->ac[1]) return 0; // min 1st alternate AC
+        else if (args->min_ac_type == ALLELE_ALT1 && args->min_ac>batch->ac[1]) return 0; // min 1st alternate AC
         else if (args->min_ac_type == ALLELE_MAJOR && args->min_ac > major_ac) return 0; // min major AC
         else if (args->min_ac_type == ALLELE_NONMAJOR && args->min_ac > an-major_ac) return 0; // min non-major AC
     }
@@ -416,7 +482,7 @@ int subset_vcf(args_t *args, bcf1_t *line)
     {
         if (args->max_ac_type == ALLELE_NONREF && args->max_ac<non_ref_ac) return 0; // max AC
         else if (args->max_ac_type == ALLELE_MINOR && args->max_ac<minor_ac) return 0; // max minor AC
-        else if (args->max_ac_type == ALLELE_ALT1 && args->max_ac<args->ac[1]) return 0; // max 1st alternate AC
+        else if (args->max_ac_type == ALLELE_ALT1 && args->max_ac<batch->ac[1]) return 0; // max 1st alternate AC
         else if (args->max_ac_type == ALLELE_MAJOR && args->max_ac < major_ac) return 0; // max major AC
         else if (args->max_ac_type == ALLELE_NONMAJOR && args->max_ac < an-major_ac) return 0; // max non-major AC
     }
@@ -425,7 +491,7 @@ int subset_vcf(args_t *args, bcf1_t *line)
         if (an == 0) return 0; // freq not defined, skip site
         if (args->min_af_type == ALLELE_NONREF && args->min_af>non_ref_ac/(double)an) return 0; // min AF
         else if (args->min_af_type == ALLELE_MINOR && args->min_af>minor_ac/(double)an) return 0; // min minor AF
-        else if (args->min_af_type == ALLELE_ALT1 && args->min_af>args->ac[1]/(double)an) return 0; // min 1st alternate AF
+        else if (args->min_af_type == ALLELE_ALT1 && args->min_af>batch->ac[1]/(double)an) return 0; // min 1st alternate AF
         else if (args->min_af_type == ALLELE_MAJOR && args->min_af > major_ac/(double)an) return 0; // min major AF
         else if (args->min_af_type == ALLELE_NONMAJOR && args->min_af > (an-major_ac)/(double)an) return 0; // min non-major AF
     }
@@ -434,7 +500,7 @@ int subset_vcf(args_t *args, bcf1_t *line)
         if (an == 0) return 0; // freq not defined, skip site
         if (args->max_af_type == ALLELE_NONREF && args->max_af<non_ref_ac/(double)an) return 0; // max AF
         else if (args->max_af_type == ALLELE_MINOR && args->max_af<minor_ac/(double)an) return 0; // max minor AF
-        else if (args->max_af_type == ALLELE_ALT1 && args->max_af<args->ac[1]/(double)an) return 0; // max 1st alternate AF
+        else if (args->max_af_type == ALLELE_ALT1 && args->max_af<batch->ac[1]/(double)an) return 0; // max 1st alternate AF
         else if (args->max_af_type == ALLELE_MAJOR && args->max_af < major_ac/(double)an) return 0; // max major AF
         else if (args->max_af_type == ALLELE_NONMAJOR && args->max_af < (an-major_ac)/(double)an) return 0; // max non-major AF
     }
@@ -443,7 +509,7 @@ int subset_vcf(args_t *args, bcf1_t *line)
         if (args->uncalled == FLT_EXCLUDE && an == 0) return 0; // skip if uncalled
     }
     if (args->calc_ac && args->update_info) {
-        bcf_update_info_int32(args->hdr, line, "AC", &args->ac[1], line->n_allele-1);
+        bcf_update_info_int32(args->hdr, line, "AC", &batch->ac[1], line->n_allele-1);
         bcf_update_info_int32(args->hdr, line, "AN", &an, 1);
     }
     if (args->trim_alts)
@@ -483,6 +549,81 @@ void set_allele_type (int *atype, char *atype_string)
     }
 }
 
+static void *process_batch(void *arg)
+{
+    batch_t *batch = (batch_t*) arg;
+    int i;
+    for (i=0; i<batch->nlines; i++)
+        batch->pass[i] = subset_vcf(batch, batch->lines[i]);
+    return batch;
+}
+
+// Wait for the oldest dispatched batch and write out the records which passed
+static void write_next_batch(args_t *args, bcf_hdr_t *out_hdr)
+{
+    hts_tpool_result *res = hts_tpool_next_result_wait(args->tpool_q);
+    if ( !res ) error("Failed to retrieve the processed records\n");
+    batch_t *batch = (batch_t*) hts_tpool_result_data(res);
+    int i;
+    uint64_t prof_start = profile_start();
+    for (i=0; i<batch->nlines; i++)
+    {
+        if ( batch->pass[i] ) bcf_write1(args->out, out_hdr, batch->lines[i]);
+        profile_done(batch->lines[i], batch->pass[i]);
+    }
+    profile_stop(PROF_WRITE, prof_start);
+    batch->nlines = 0;
+    hts_tpool_delete_result(res, 0);
+    args->nbusy--;
+}
+
+static void dispatch_batch(args_t *args, batch_t *batch)
+{
+    if ( hts_tpool_dispatch(args->files->p->pool, args->tpool_q, process_batch, batch) < 0 )
+        error("Failed to dispatch the records to the thread pool\n");
+    args->nbusy++;
+}
+
+// The batches are filled and dispatched round-robin. The results are retrieved
+// in the order of dispatching, thus the batch to be filled next is always the
+// one written out first.
+static void view_parallel(args_t *args, bcf_hdr_t *out_hdr)
+{
+    int ibatch = 0;
+    uint64_t prof_start = profile_start();
+    while ( bcf_sr_next_line(args->files) )
+    {
+        profile_stop(PROF_READ, prof_start);
+        bcf1_t *line = args->files->readers[0].buffer[0];
+        if ( args->plan && !regplan_test(args->plan, args->hdr, line) ) { prof_start = profile_start(); continue; }
+        profile_in(line);
+        if ( line->errcode && out_hdr!=args->hdr ) error("Undefined tags in the header, cannot proceed in the sample subset mode.\n");
+
+        batch_t *batch = &args->batches[ibatch];
+        if ( !batch->lines[batch->nlines] ) batch->lines[batch->nlines] = bcf_init1();
+        bcf_copy(batch->lines[batch->nlines++], line);
+        if ( batch->nlines >= BATCH_SIZE )
+        {
+            dispatch_batch(args, batch);
+            ibatch = (ibatch + 1) % args->nbatches;
+            if ( args->nbusy==args->nbatches ) write_next_batch(args, out_hdr);
+        }
+        prof_start = profile_start();
+    }
+    if ( args->batches[ibatch].nlines ) dispatch_batch(args, &args->batches[ibatch]);
+    while ( args->nbusy ) write_next_batch(args, out_hdr);
+}
+
+// each batch has its own filter, the counts are summed over the batches
+static void print_batch_filter_stats(args_t *args)
+{
+    filter_t **filters = (filter_t**) malloc(sizeof(*filters)*args->nbatches);
+    int i;
+    for (i=0; i<args->nbatches; i++) filters[i] = args->batches[i].filter;
+    print_filter_stats(filters, args->nbatches);
+    free(filters);
+}
+
 static void usage(args_t *args)
 {
     fprintf(stderr, "\n");
@@ -500,7 +641,8 @@ static void usage(args_t *args)
     fprintf(stderr, "    -R, --regions-file <file>           restrict to regions listed in a file\n");
     fprintf(stderr, "    -t, --targets [^]<region>           similar to -r but streams rather than index-jumps. Exclude regions with \"^\" prefix\n");
     fprintf(stderr, "    -T, --targets-file [^]<file>        similar to -R but streams rather than index-jumps. Exclude regions with \"^\" prefix\n");
-    fprintf(stderr, "        --threads <int>                 number of extra (de)compression threads [0]\n");
+    fprintf(stderr, "        --threads <int>                 number of extra (de)compression and record processing threads [0]\n");
+    fprintf(stderr, "        --write-index                   index the output file, requires compressed output written to a file\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Subset options:\n");
     fprintf(stderr, "    -a, --trim-alt-alleles        trim alternate alleles not seen in the subset\n");
@@ -513,6 +655,7 @@ static void usage(args_t *args)
     fprintf(stderr, "    -c/C, --min-ac/--max-ac <int>[:<type>]      minimum/maximum count for non-reference (nref), 1st alternate (alt1), least frequent\n");
     fprintf(stderr, "                                                   (minor), most frequent (major) or sum of all but most frequent (nonmajor) alleles [nref]\n");
     fprintf(stderr, "    -f,   --apply-filters <list>                require at least one of the listed FILTER strings (e.g. \"PASS,.\")\n");
+    fprintf(stderr, "          --filter-stats                        report the number of records decided without reading FORMAT fields\n");
     fprintf(stderr, "    -g,   --genotype [^]<hom|het|miss>          require one or more hom/het/missing genotype or, if prefixed with \"^\", exclude sites with hom/het/missing genotypes\n");
     fprintf(stderr, "    -i/e, --include/--exclude <expr>            select/exclude sites for which the expression is true (see man page for details)\n");
     fprintf(stderr, "    -k/n, --known/--novel                       select known/novel sites only (ID is not/is '.')\n");
@@ -581,6 +724,8 @@ int main_vcfview(int argc, char *argv[])
         {"phased",no_argument,NULL,'p'},
         {"exclude-phased",no_argument,NULL,'P'},
         {"no-version",no_argument,NULL,8},
+        {"filter-stats",no_argument,NULL,10},
+        {"write-index",no_argument,NULL,11},
         {NULL,0,NULL,0}
     };
     char *tmp;
@@ -691,6 +836,8 @@ int main_vcfview(int argc, char *argv[])
             }
             case  9 : args->n_threads = strtol(optarg, 0, 0); break;
             case  8 : args->record_cmd_line = 0; break;
+            case 10 : args->filter_stats = 1; break;
+            case 11 : args->write_index = 1; break;
             case '?': usage(args);
             default: error("Unknown argument: %s\n", optarg);
         }
@@ -702,6 +849,7 @@ int main_vcfview(int argc, char *argv[])
     if ( args->phased > FLT_EXCLUDE ) error("Only one of -p or -P can be given.\n");
 
     if ( args->sample_names && args->update_info) args->calc_ac = 1;
+    if ( args->write_index ) init_write_index(args->fn_out, args->output_type);
 
     char *fname = NULL;
     if ( optind>=argc )
@@ -712,26 +860,16 @@ int main_vcfview(int argc, char *argv[])
     else fname = argv[optind];
 
     // read in the regions from the command line
-    if ( args->regions_list )
-    {
-        if ( bcf_sr_set_regions(args->files, args->regions_list, regions_is_file)<0 )
-            error("Failed to read the regions: %s\n", args->regions_list);
-    }
-    else if ( optind+1 < argc )
+    kstring_t regs = {0,0,0};
+    if ( !args->regions_list && optind+1 < argc )
     {
         int i;
-        kstring_t tmp = {0,0,0};
-        kputs(argv[optind+1],&tmp);
-        for (i=optind+2; i<argc; i++) { kputc(',',&tmp); kputs(argv[i],&tmp); }
-        if ( bcf_sr_set_regions(args->files, tmp.s, 0)<0 )
-            error("Failed to read the regions: %s\n", tmp.s);
-        free(tmp.s);
-    }
-    if ( args->targets_list )
-    {
-        if ( bcf_sr_set_targets(args->files, args->targets_list, targets_is_file, 0)<0 )
-            error("Failed to read the targets: %s\n", args->targets_list);
+        kputs(argv[optind+1],&regs);
+        for (i=optind+2; i<argc; i++) { kputc(',',&regs); kputs(argv[i],&regs); }
     }
+    args->plan = regplan_init(args->files, fname, args->regions_list ? args->regions_list : regs.s, args->regions_list ? regions_is_file : 0,
+                    args->targets_list, targets_is_file);
+    free(regs.s);
 
     if ( bcf_sr_set_threads(args->files, args->n_threads)<0 ) error("Failed to create threads\n");
     if ( !bcf_sr_add_reader(args->files, fname) ) error("Failed to open %s: %s\n", fname,bcf_sr_strerror(args->files->errnum));
@@ -746,18 +884,37 @@ int main_vcfview(int argc, char *argv[])
     int ret = 0;
     if (!args->header_only)
     {
-        while ( bcf_sr_next_line(args->files) )
+        if ( args->tpool_q )
+            view_parallel(args, out_hdr);
+        else
         {
-            bcf1_t *line = args->files->readers[0].buffer[0];
-            if ( line->errcode && out_hdr!=args->hdr ) error("Undefined tags in the header, cannot proceed in the sample subset mode.\n");
-            if ( subset_vcf(args, line) )
-                bcf_write1(args->out, out_hdr, line);
+            uint64_t prof_start = profile_start();
+            while ( bcf_sr_next_line(args->files) )
+            {
+                profile_stop(PROF_READ, prof_start);
+                bcf1_t *line = args->files->readers[0].buffer[0];
+                if ( args->plan && !regplan_test(args->plan, args->hdr, line) ) { prof_start = profile_start(); continue; }
+                profile_in(line);
+                if ( line->errcode && out_hdr!=args->hdr ) error("Undefined tags in the header, cannot proceed in the sample subset mode.\n");
+                int pass = subset_vcf(&args->batches[0], line);
+                if ( pass )
+                {
+                    prof_start = profile_start();
+                    bcf_write1(args->out, out_hdr, line);
+                    profile_stop(PROF_WRITE, prof_start);
+                }
+                profile_done(line, pass);
+                prof_start = profile_start();
+            }
         }
         ret = args->files->errnum;
         if ( ret ) fprintf(stderr,"Error: %s\n", bcf_sr_strerror(args->files->errnum));
     }
+    if ( args->filter_stats && args->filter_str ) print_batch_filter_stats(args);
     hts_close(args->out);
+    if ( args->write_index && !ret ) write_index(args->fn_out, args->output_type, args->n_threads);
     destroy_data(args);
+    regplan_destroy(args->plan);
     bcf_sr_destroy(args->files);
     free(args);
     return ret;
@@ -35,6 +35,9 @@ struct _vcmp_t
     int ndref, mdref;   // ndref: positive when ref1 longer, negative when ref2 is longer
     int nmatch;
     int *map, mmap;
+    // the alleles of the last vcmp_map_ARvalues() call, NUL-separated; map holds its result
+    char *last_als;
+    int nlast_als, mlast_als, last_n, last_nals1, last_nals2;
 };
 
 vcmp_t *vcmp_init()
@@ -46,6 +49,7 @@ void vcmp_destroy(vcmp_t *vcmp)
 {
     free(vcmp->map);
     free(vcmp->dref);
+    free(vcmp->last_als);
     free(vcmp);
 }
 
@@ -116,17 +120,75 @@ int vcmp_find_allele(vcmp_t *vcmp, char **als1, int nals1, char *al2)
 }
 
 
+static int same_alleles(int nals1, char **als1, int nals2, char **als2)
+{
+    if ( nals1!=nals2 ) return 0;
+    int i;
+    for (i=0; i<nals1; i++)
+        if ( strcmp(als1[i],als2[i]) ) return 0;
+    return 1;
+}
+
+static int is_last_query(vcmp_t *vcmp, int n, int nals1, char **als1, int nals2, char **als2)
+{
+    if ( !vcmp->nlast_als || vcmp->last_n!=n || vcmp->last_nals1!=nals1 || vcmp->last_nals2!=nals2 ) return 0;
+    const char *str = vcmp->last_als;
+    int i;
+    for (i=0; i<nals1; i++)
+    {
+        size_t len = strlen(als1[i]) + 1;
+        if ( memcmp(str,als1[i],len) ) return 0;
+        str += len;
+    }
+    for (i=0; i<nals2; i++)
+    {
+        size_t len = strlen(als2[i]) + 1;
+        if ( memcmp(str,als2[i],len) ) return 0;
+        str += len;
+    }
+    return 1;
+}
+
+static void set_last_query(vcmp_t *vcmp, int n, int nals1, char **als1, int nals2, char **als2)
+{
+    int i;
+    vcmp->nlast_als = 0;
+    for (i=0; i<nals1+nals2; i++)
+    {
+        char *al = i<nals1 ? als1[i] : als2[i-nals1];
+        int len = strlen(al) + 1;
+        hts_expand(char,vcmp->nlast_als+len,vcmp->mlast_als,vcmp->last_als);
+        memcpy(vcmp->last_als+vcmp->nlast_als,al,len);
+        vcmp->nlast_als += len;
+    }
+    vcmp->last_n     = n;
+    vcmp->last_nals1 = nals1;
+    vcmp->last_nals2 = nals2;
+}
+
 int *vcmp_map_ARvalues(vcmp_t *vcmp, int n, int nals1, char **als1, int nals2, char **als2)
 {
     if ( vcmp_set_ref(vcmp,als1[0],als2[0]) < 0 ) return NULL;
 
-    vcmp->map = (int*) realloc(vcmp->map,sizeof(int)*n);
-
     int i, ifrom = n==nals2 ? 0 : 1;
+
+    // Annotations usually come with the same alleles in the same order, or with
+    // the same alleles as the previous record
+    if ( same_alleles(nals1,als1,nals2,als2) )
+    {
+        hts_expand(int,n+1,vcmp->mmap,vcmp->map);
+        for (i=0; i<n; i++) vcmp->map[i] = i;
+        vcmp->nlast_als = 0;
+        return vcmp->map;
+    }
+    if ( is_last_query(vcmp,n,nals1,als1,nals2,als2) ) return vcmp->map;
+
+    hts_expand(int,n+1,vcmp->mmap,vcmp->map);   // +1: never return NULL for n=0
     for (i=ifrom; i<nals2; i++)
     {
         vcmp->map[i-ifrom] = vcmp_find_allele(vcmp, als1+ifrom, nals1-ifrom, als2[i]);
     }
+    set_last_query(vcmp,n,nals1,als1,nals2,als2);
     return vcmp->map;
 }
 